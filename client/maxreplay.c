@@ -0,0 +1,526 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file maxreplay.c  - Replay a captured qlafilter log against MaxScale
+ *
+ * The tool reads a query log produced by the qlafilter, replays the
+ * statements against a MaxScale listener at a configurable concurrency
+ * and speed, and reports the achieved throughput together with latency
+ * percentiles. Replaying the same capture before and after a change to
+ * the configuration or to MaxScale itself gives comparable figures for
+ * the production traffic shape.
+ *
+ * The qlafilter writes one line per statement:
+ *
+ *    HH:MM:SS.mmm D/MM/YYYY, user@host, SQL text
+ *
+ * The timestamps are used to pace the replay; the --speed option scales
+ * the original inter-arrival times and a speed of zero replays the log
+ * as fast as the server accepts it.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date        Who             Description
+ * 01/07/16    Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+
+#include <mysql.h>
+
+#include <version.h>
+
+/** One statement loaded from the capture file */
+typedef struct
+{
+    char     *sql;      /*< The statement text */
+    uint64_t offset;    /*< Microseconds since the first statement */
+} REPLAY_QUERY;
+
+/** The latency recorded for one executed statement */
+typedef struct
+{
+    uint64_t latency;   /*< Execution time in microseconds */
+    int      error;     /*< Non-zero if the statement failed */
+} REPLAY_RESULT;
+
+/** The shared state of the replay run */
+typedef struct
+{
+    REPLAY_QUERY  *queries;     /*< All loaded statements */
+    int           n_queries;    /*< Number of loaded statements */
+    REPLAY_RESULT *results;     /*< Per-statement results */
+    int           n_threads;    /*< Replay concurrency */
+    double        speed;        /*< Speed factor, 0 for flat out */
+    uint64_t      start;        /*< Wall clock start of the replay */
+    char          *host;        /*< MaxScale host */
+    int           port;         /*< MaxScale port */
+    char          *user;        /*< User to connect as */
+    char          *passwd;      /*< Password for the user */
+    char          *db;          /*< Default database, may be NULL */
+} REPLAY;
+
+/** The argument given to each replay thread */
+typedef struct
+{
+    REPLAY *replay;     /*< The shared replay state */
+    int    id;          /*< Thread number, selects the statements */
+    int    failed;      /*< Set if the thread could not connect */
+} REPLAY_THREAD;
+
+static struct option long_options[] =
+{
+    {"host",        required_argument, 0, 'h'},
+    {"port",        required_argument, 0, 'P'},
+    {"user",        required_argument, 0, 'u'},
+    {"password",    required_argument, 0, 'p'},
+    {"database",    required_argument, 0, 'd'},
+    {"concurrency", required_argument, 0, 'c'},
+    {"speed",       required_argument, 0, 's'},
+    {"version",     no_argument,       0, 'V'},
+    {"help",        no_argument,       0, '?'},
+    {0, 0, 0, 0}
+};
+
+/**
+ * Return the wall clock in microseconds.
+ */
+static uint64_t
+replay_clock_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Parse the timestamp of a qlafilter log line into microseconds since
+ * the epoch of the day in the capture.
+ *
+ * @param line      The log line
+ * @param timestamp The parsed timestamp in microseconds
+ * @return          Zero if the line did not carry a valid timestamp
+ */
+static int
+parse_timestamp(const char *line, uint64_t *timestamp)
+{
+    struct tm t;
+    int hour, min, sec, msec, day, month, year;
+    time_t when;
+
+    if (sscanf(line, "%d:%d:%d.%d %d/%d/%d",
+               &hour, &min, &sec, &msec, &day, &month, &year) != 7)
+    {
+        return 0;
+    }
+    memset(&t, 0, sizeof(t));
+    t.tm_hour = hour;
+    t.tm_min = min;
+    t.tm_sec = sec;
+    t.tm_mday = day;
+    t.tm_mon = month - 1;
+    t.tm_year = year - 1900;
+    t.tm_isdst = -1;
+    if ((when = mktime(&t)) == (time_t) - 1)
+    {
+        return 0;
+    }
+    *timestamp = (uint64_t)when * 1000000UL + (uint64_t)msec * 1000;
+    return 1;
+}
+
+/**
+ * Load the capture file into memory. Lines that do not match the
+ * qlafilter format are skipped with a warning.
+ *
+ * @param replay    The replay state to populate
+ * @param filename  The capture file to load
+ * @return          The number of statements loaded or -1 on error
+ */
+static int
+load_capture(REPLAY *replay, const char *filename)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t linelen = 0;
+    ssize_t len;
+    int size = 0, skipped = 0;
+    uint64_t timestamp, first = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Unable to open capture file '%s': %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+
+    while ((len = getline(&line, &linelen, fp)) != -1)
+    {
+        char *sql;
+
+        if (len > 0 && line[len - 1] == '\n')
+        {
+            line[--len] = '\0';
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+        /* The SQL text starts after the second ", " separator */
+        if (!parse_timestamp(line, &timestamp) ||
+            (sql = strstr(line, ", ")) == NULL ||
+            (sql = strstr(sql + 2, ", ")) == NULL)
+        {
+            skipped++;
+            continue;
+        }
+        sql += 2;
+        if (replay->n_queries == size)
+        {
+            REPLAY_QUERY *tmp;
+
+            size = size ? size * 2 : 1024;
+            if ((tmp = realloc(replay->queries,
+                               size * sizeof(REPLAY_QUERY))) == NULL)
+            {
+                fprintf(stderr, "Out of memory loading the capture file.\n");
+                free(line);
+                fclose(fp);
+                return -1;
+            }
+            replay->queries = tmp;
+        }
+        if (replay->n_queries == 0)
+        {
+            first = timestamp;
+        }
+        replay->queries[replay->n_queries].sql = strdup(sql);
+        replay->queries[replay->n_queries].offset =
+            timestamp >= first ? timestamp - first : 0;
+        replay->n_queries++;
+    }
+    free(line);
+    fclose(fp);
+
+    if (skipped)
+    {
+        fprintf(stderr, "Skipped %d lines that did not match the "
+                "qlafilter log format.\n", skipped);
+    }
+    return replay->n_queries;
+}
+
+/**
+ * The replay thread main routine. Thread N executes statements
+ * N, N + threads, N + 2 * threads ... so that the statement order of
+ * the capture is roughly preserved while running concurrently, each
+ * statement being paced by the scaled capture timestamp.
+ *
+ * @param data  The thread argument
+ */
+static void *
+replay_thread_main(void *data)
+{
+    REPLAY_THREAD *thr = (REPLAY_THREAD *)data;
+    REPLAY *replay = thr->replay;
+    MYSQL *conn;
+    int i;
+
+    if ((conn = mysql_init(NULL)) == NULL ||
+        mysql_real_connect(conn, replay->host, replay->user, replay->passwd,
+                           replay->db, replay->port, NULL, 0) == NULL)
+    {
+        fprintf(stderr, "Thread %d failed to connect to %s:%d: %s\n",
+                thr->id, replay->host, replay->port,
+                conn ? mysql_error(conn) : "out of memory");
+        thr->failed = 1;
+        if (conn)
+        {
+            mysql_close(conn);
+        }
+        return NULL;
+    }
+
+    for (i = thr->id; i < replay->n_queries; i += replay->n_threads)
+    {
+        uint64_t due, now, start;
+
+        if (replay->speed > 0.0)
+        {
+            due = replay->start +
+                (uint64_t)(replay->queries[i].offset / replay->speed);
+            while ((now = replay_clock_us()) < due)
+            {
+                usleep(due - now > 1000 ? 1000 : due - now);
+            }
+        }
+        start = replay_clock_us();
+        if (mysql_query(conn, replay->queries[i].sql) != 0)
+        {
+            replay->results[i].error = 1;
+        }
+        else
+        {
+            MYSQL_RES *res;
+
+            /* Drain the results so the full round trip is measured */
+            if ((res = mysql_store_result(conn)) != NULL)
+            {
+                mysql_free_result(res);
+            }
+        }
+        replay->results[i].latency = replay_clock_us() - start;
+    }
+
+    mysql_close(conn);
+    return NULL;
+}
+
+/**
+ * Compare two latencies for qsort.
+ */
+static int
+latency_cmp(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+/**
+ * Report the throughput and the latency percentiles of the replay.
+ *
+ * @param replay    The completed replay
+ * @param elapsed   Wall time of the replay in microseconds
+ */
+static void
+report(REPLAY *replay, uint64_t elapsed)
+{
+    uint64_t *latencies;
+    uint64_t total = 0;
+    int i, n = 0, errors = 0;
+
+    if ((latencies = malloc(replay->n_queries * sizeof(uint64_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory reporting results.\n");
+        return;
+    }
+    for (i = 0; i < replay->n_queries; i++)
+    {
+        if (replay->results[i].error)
+        {
+            errors++;
+        }
+        latencies[n++] = replay->results[i].latency;
+        total += replay->results[i].latency;
+    }
+    qsort(latencies, n, sizeof(uint64_t), latency_cmp);
+
+    printf("\n");
+    printf("Statements replayed:    %d\n", n);
+    printf("Statement errors:       %d\n", errors);
+    printf("Elapsed time:           %.3f seconds\n", elapsed / 1000000.0);
+    printf("Throughput:             %.1f statements/second\n",
+           n / (elapsed / 1000000.0));
+    if (n > 0)
+    {
+        printf("Latency average:        %.3f ms\n", total / 1000.0 / n);
+        printf("Latency 50th percentile:  %.3f ms\n",
+               latencies[(n * 50) / 100] / 1000.0);
+        printf("Latency 90th percentile:  %.3f ms\n",
+               latencies[(n * 90) / 100] / 1000.0);
+        printf("Latency 95th percentile:  %.3f ms\n",
+               latencies[(n * 95) / 100] / 1000.0);
+        printf("Latency 99th percentile:  %.3f ms\n",
+               latencies[(n * 99) / 100] / 1000.0);
+        printf("Latency maximum:        %.3f ms\n",
+               latencies[n - 1] / 1000.0);
+    }
+    free(latencies);
+}
+
+/**
+ * Display the version information for the tool
+ */
+static void
+print_version(const char *progname)
+{
+    printf("%s Version %s\n", progname, MAXSCALE_VERSION);
+}
+
+/**
+ * Display the usage information for the tool
+ */
+static void
+print_usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [-h host] [-P port] [-u user] [-p password] "
+            "[-d database]\n"
+            "               [-c concurrency] [-s speed] <capture file>\n\n"
+            "  -h, --host=HOST          MaxScale host to connect to "
+            "(default: localhost)\n"
+            "  -P, --port=PORT          Port of the listener to replay "
+            "against (default: 4006)\n"
+            "  -u, --user=USER          User to connect as (default: "
+            "maxuser)\n"
+            "  -p, --password=PASSWD    Password for the user\n"
+            "  -d, --database=DB        Default database for the "
+            "connections\n"
+            "  -c, --concurrency=N      Number of client connections to "
+            "replay over (default: 1)\n"
+            "  -s, --speed=FACTOR       Speed factor applied to the "
+            "capture timestamps,\n"
+            "                           e.g. 2 replays twice as fast, 0 "
+            "replays flat out (default: 1)\n"
+            "  -V, --version            Print version information and "
+            "exit\n"
+            "  -?, --help               Print this help text\n",
+            progname);
+}
+
+int
+main(int argc, char **argv)
+{
+    REPLAY replay;
+    REPLAY_THREAD *threads;
+    pthread_t *handles;
+    uint64_t elapsed;
+    int option_index = 0;
+    int i, c, failed = 0;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.host = "localhost";
+    replay.port = 4006;
+    replay.user = "maxuser";
+    replay.passwd = "";
+    replay.n_threads = 1;
+    replay.speed = 1.0;
+
+    while ((c = getopt_long(argc, argv, "h:P:u:p:d:c:s:V?",
+                            long_options, &option_index)) >= 0)
+    {
+        switch (c)
+        {
+            case 'h':
+                replay.host = optarg;
+                break;
+            case 'P':
+                replay.port = atoi(optarg);
+                break;
+            case 'u':
+                replay.user = optarg;
+                break;
+            case 'p':
+                replay.passwd = optarg;
+                break;
+            case 'd':
+                replay.db = optarg;
+                break;
+            case 'c':
+                replay.n_threads = atoi(optarg);
+                break;
+            case 's':
+                replay.speed = atof(optarg);
+                break;
+            case 'V':
+                print_version(*argv);
+                return EXIT_SUCCESS;
+            case '?':
+                print_usage(*argv);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if (optind >= argc || replay.n_threads < 1 || replay.speed < 0.0)
+    {
+        print_usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    if (load_capture(&replay, argv[optind]) <= 0)
+    {
+        fprintf(stderr, "No statements loaded from '%s'.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    printf("Loaded %d statements from %s, replaying with %d connection%s",
+           replay.n_queries, argv[optind], replay.n_threads,
+           replay.n_threads == 1 ? "" : "s");
+    if (replay.speed > 0.0)
+    {
+        printf(" at %.1fx capture speed.\n", replay.speed);
+    }
+    else
+    {
+        printf(" flat out.\n");
+    }
+
+    if ((replay.results = calloc(replay.n_queries,
+                                 sizeof(REPLAY_RESULT))) == NULL ||
+        (threads = calloc(replay.n_threads, sizeof(REPLAY_THREAD))) == NULL ||
+        (handles = calloc(replay.n_threads, sizeof(pthread_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory setting up the replay.\n");
+        return EXIT_FAILURE;
+    }
+
+    mysql_library_init(0, NULL, NULL);
+
+    replay.start = replay_clock_us();
+    for (i = 0; i < replay.n_threads; i++)
+    {
+        threads[i].replay = &replay;
+        threads[i].id = i;
+        if (pthread_create(&handles[i], NULL, replay_thread_main,
+                           &threads[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start replay thread %d.\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < replay.n_threads; i++)
+    {
+        pthread_join(handles[i], NULL);
+        failed += threads[i].failed;
+    }
+    elapsed = replay_clock_us() - replay.start;
+
+    if (failed == replay.n_threads)
+    {
+        fprintf(stderr, "All replay connections failed, nothing was "
+                "replayed.\n");
+        return EXIT_FAILURE;
+    }
+    report(&replay, elapsed);
+
+    mysql_library_end();
+    return EXIT_SUCCESS;
+}
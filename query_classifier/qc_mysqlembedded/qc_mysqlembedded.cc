@@ -69,6 +69,15 @@
 
 #define MYSQL_COM_QUERY_HEADER_SIZE 5 /*< 3 bytes size, 1 sequence, 1 command */
 #define MAX_QUERYBUF_SIZE 2048
+
+/** Maximum number of parsing handles kept for reuse per thread */
+#define QC_HANDLE_POOL_MAX 4
+
+/** Number of queries a pooled handle parses before it is torn down and
+ * recreated, so the memory arenas of the embedded server THD cannot grow
+ * without bound */
+#define QC_HANDLE_MAX_REUSE 100
+
 typedef struct parsing_info_st
 {
 #if defined(SS_DEBUG)
@@ -77,11 +86,34 @@ typedef struct parsing_info_st
     void* pi_handle; /*< parsing info object pointer */
     char* pi_query_plain_str; /*< query as plain string */
     void (*pi_done_fp)(void *); /*< clean-up function for parsing info */
+    pthread_t pi_owner; /*< Thread on which the parsing handle was taken into use */
+    int pi_uses; /*< Number of queries parsed with the handle so far */
 #if defined(SS_DEBUG)
     skygw_chk_t pi_chk_tail;
 #endif
 } parsing_info_t;
 
+/**
+ * A per thread pool of embedded server handles with live thread contexts.
+ *
+ * Creating the parsing infrastructure is by far the most expensive part of
+ * classifying a query: every call used to run mysql_init, create a THD,
+ * initialize the embedded connection and authenticate against the embedded
+ * server, all of which serialize on shared embedded server state under load.
+ * Keeping the handle and its THD alive between queries parsed on the same
+ * thread avoids both the setup cost and the cross thread synchronization.
+ * The pool is thread local so it needs no locking; a handle is only
+ * returned to the pool from the thread that took it into use.
+ */
+typedef struct qc_pooled_handle
+{
+    MYSQL* handle; /*< Embedded server handle with a live THD */
+    int n_uses; /*< Number of queries parsed with the handle */
+} qc_pooled_handle_t;
+
+static __thread qc_pooled_handle_t qc_handle_pool[QC_HANDLE_POOL_MAX];
+static __thread int qc_handle_pool_len = 0;
+
 #define QTYPE_LESS_RESTRICTIVE_THAN_WRITE(t) (t<QUERY_TYPE_WRITE ? true : false)
 
 static THD* get_or_create_thd_for_parsing(MYSQL* mysql, char* query_str);
@@ -93,6 +125,7 @@ static bool skygw_stmt_causes_implicit_commit(LEX* lex, int* autocommit_stmt);
 static int is_autocommit_stmt(LEX* lex);
 static parsing_info_t* parsing_info_init(void (*donefun)(void *));
 static void parsing_info_set_plain_str(void* ptr, char* str);
+static void qc_handle_close(MYSQL* mysql);
 /** Free THD context and close MYSQL */
 static void parsing_info_done(void* ptr);
 static void* skygw_get_affected_tables(void* lexptr);
@@ -288,26 +321,29 @@ static THD* get_or_create_thd_for_parsing(MYSQL* mysql, char* query_str)
     query_len = strlen(query_str);
     client_flags = set_client_flags(mysql);
 
-    /** Get THD.
-     * NOTE: Instead of creating new every time, THD instance could
-     * be get from a pool of them.
-     */
-    thd = (THD *) create_embedded_thd(client_flags);
+    /** A handle taken from the thread pool still has its THD; only a
+     * freshly created handle pays for the embedded server setup. */
+    thd = (THD *) mysql->thd;
 
     if (thd == NULL)
     {
-        MXS_ERROR("Failed to create thread context for parsing.");
-        goto return_thd;
-    }
+        thd = (THD *) create_embedded_thd(client_flags);
 
-    mysql->thd = thd;
-    init_embedded_mysql(mysql, client_flags);
-    failp = check_embedded_connection(mysql, db);
+        if (thd == NULL)
+        {
+            MXS_ERROR("Failed to create thread context for parsing.");
+            goto return_thd;
+        }
 
-    if (failp)
-    {
-        MXS_ERROR("Call to check_embedded_connection failed.");
-        goto return_err_with_thd;
+        mysql->thd = thd;
+        init_embedded_mysql(mysql, client_flags);
+        failp = check_embedded_connection(mysql, db);
+
+        if (failp)
+        {
+            MXS_ERROR("Call to check_embedded_connection failed.");
+            goto return_err_with_thd;
+        }
     }
 
     thd->clear_data_list();
@@ -1443,22 +1479,8 @@ char* qc_get_canonical(GWBUF* querybuf)
     char *querystr = NULL;
     if (GWBUF_LENGTH(querybuf) > MYSQL_COM_QUERY_HEADER_SIZE && GWBUF_IS_SQL(querybuf))
     {
-        size_t srcsize = GWBUF_LENGTH(querybuf) - MYSQL_COM_QUERY_HEADER_SIZE;
-        char *src = (char*) malloc(srcsize);
-        size_t destsize = 0;
-        char *dest = NULL;
-        if (src)
-        {
-            memcpy(src, (uint8_t*) GWBUF_DATA(querybuf) + MYSQL_COM_QUERY_HEADER_SIZE,
-                   srcsize);
-            if (replace_quoted((const char**) &src, &srcsize, &dest, &destsize) &&
-                remove_mysql_comments((const char**) &dest, &destsize, &src, &srcsize) &&
-                replace_values((const char**) &src, &srcsize, &dest, &destsize))
-            {
-                querystr = dest;
-            }
-            free(src);
-        }
+        querystr = canonicalize_sql((const char*) GWBUF_DATA(querybuf) + MYSQL_COM_QUERY_HEADER_SIZE,
+                                    GWBUF_LENGTH(querybuf) - MYSQL_COM_QUERY_HEADER_SIZE);
     }
     return querystr;
 }
@@ -1475,36 +1497,48 @@ static parsing_info_t* parsing_info_init(void (*donefun)(void *))
 {
     parsing_info_t* pi = NULL;
     MYSQL* mysql;
+    int n_uses = 0;
     const char* user = "skygw";
     const char* db = "skygw";
 
     ss_dassert(donefun != NULL);
 
-    /** Get server handle */
-    mysql = mysql_init(NULL);
-
-    if (mysql == NULL)
+    if (qc_handle_pool_len > 0)
     {
-        MXS_ERROR("Call to mysql_real_connect failed due %d, %s.",
-                  mysql_errno(mysql),
-                  mysql_error(mysql));
-        ss_dassert(mysql != NULL);
-        goto retblock;
+        /** Reuse a handle that already has a live thread context, the
+         * expensive embedded server setup is skipped entirely */
+        qc_pooled_handle_t* slot = &qc_handle_pool[--qc_handle_pool_len];
+        mysql = slot->handle;
+        n_uses = slot->n_uses;
     }
+    else
+    {
+        /** Get server handle */
+        mysql = mysql_init(NULL);
+
+        if (mysql == NULL)
+        {
+            MXS_ERROR("Call to mysql_real_connect failed due %d, %s.",
+                      mysql_errno(mysql),
+                      mysql_error(mysql));
+            ss_dassert(mysql != NULL);
+            goto retblock;
+        }
 
-    /** Set methods and authentication to mysql */
-    mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, "libmysqld_skygw");
-    mysql_options(mysql, MYSQL_OPT_USE_EMBEDDED_CONNECTION, NULL);
-    mysql->methods = &embedded_methods;
-    mysql->user = my_strdup(user, MYF(0));
-    mysql->db = my_strdup(db, MYF(0));
-    mysql->passwd = NULL;
+        /** Set methods and authentication to mysql */
+        mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, "libmysqld_skygw");
+        mysql_options(mysql, MYSQL_OPT_USE_EMBEDDED_CONNECTION, NULL);
+        mysql->methods = &embedded_methods;
+        mysql->user = my_strdup(user, MYF(0));
+        mysql->db = my_strdup(db, MYF(0));
+        mysql->passwd = NULL;
+    }
 
     pi = (parsing_info_t*) calloc(1, sizeof (parsing_info_t));
 
     if (pi == NULL)
     {
-        mysql_close(mysql);
+        qc_handle_close(mysql);
         goto retblock;
     }
 
@@ -1515,11 +1549,32 @@ static parsing_info_t* parsing_info_init(void (*donefun)(void *))
     /** Set handle and free function to parsing info struct */
     pi->pi_handle = mysql;
     pi->pi_done_fp = donefun;
+    pi->pi_owner = pthread_self();
+    pi->pi_uses = n_uses;
 
 retblock:
     return pi;
 }
 
+/**
+ * Tear down an embedded server handle, freeing the thread context it may
+ * still hold.
+ *
+ * @param mysql Handle to close
+ */
+static void qc_handle_close(MYSQL* mysql)
+{
+    if (mysql->thd != NULL)
+    {
+        THD* thd = (THD*) mysql->thd;
+        thd->end_statement();
+        (*mysql->methods->free_embedded_thd)(mysql);
+        mysql->thd = NULL;
+    }
+
+    mysql_close(mysql);
+}
+
 /**
  * Free function for parsing info. Called by gwbuf_free or in case initialization
  * of parsing information fails.
@@ -1542,15 +1597,26 @@ static void parsing_info_done(void* ptr)
         {
             MYSQL* mysql = (MYSQL *) pi->pi_handle;
 
-            if (mysql->thd != NULL)
+            if (mysql->thd != NULL &&
+                pi->pi_uses < QC_HANDLE_MAX_REUSE &&
+                qc_handle_pool_len < QC_HANDLE_POOL_MAX &&
+                pthread_equal(pi->pi_owner, pthread_self()))
             {
+                /** Return the handle with its live thread context to the
+                 * pool of this thread so the next query parsed here can
+                 * skip the embedded server setup. Handles freed on some
+                 * other thread than the one that used them are torn down
+                 * the slow way. */
                 thd = (THD*) mysql->thd;
                 thd->end_statement();
-                (*mysql->methods->free_embedded_thd)(mysql);
-                mysql->thd = NULL;
+                qc_handle_pool[qc_handle_pool_len].handle = mysql;
+                qc_handle_pool[qc_handle_pool_len].n_uses = pi->pi_uses + 1;
+                qc_handle_pool_len++;
+            }
+            else
+            {
+                qc_handle_close(mysql);
             }
-
-            mysql_close(mysql);
         }
 
         /** Free plain text query string */
@@ -1856,6 +1922,12 @@ bool qc_thread_init(void)
 
 void qc_thread_end(void)
 {
+    /** Drain the parsing handle pool of this thread */
+    while (qc_handle_pool_len > 0)
+    {
+        qc_handle_close(qc_handle_pool[--qc_handle_pool_len].handle);
+    }
+
     mysql_thread_end();
 }
 
@@ -28,6 +28,18 @@
 #include <mysql_client_server_protocol.h>
 #include <platform.h>
 #include <query_classifier.h>
+#include <skygw_utils.h>
+
+#define QC_COM_QUERY_HEADER_SIZE 5 /*< 3 bytes size, 1 sequence, 1 command */
+
+/**
+ * The lookaside arena handed to each thread's database handle. All parse tree
+ * allocations are served from it and, as every statement's trees are freed
+ * when the classification callbacks have run, the arena is effectively reset
+ * between queries without any malloc traffic.
+ */
+#define QC_LOOKASIDE_SLOT_SIZE 512
+#define QC_LOOKASIDE_NSLOTS    512
 
 //#define QC_TRACE_ENABLED
 #undef QC_TRACE_ENABLED
@@ -54,10 +66,16 @@ typedef struct qc_sqlite_info
 {
     qc_info_status_t status;    // The validity of the information in this structure.
     const char* query;          // The query passed to sqlite.
-    // TODO: More to be added.
     uint32_t types;             // The types of the query.
     qc_query_op_t operation;    // The operation in question.
     char* affected_fields;      // The affected fields.
+    char* created_table_name;   // The name of a table a CREATE TABLE creates.
+    bool is_drop_table;         // Is the query a DROP TABLE.
+    bool has_clause;            // Does the query have a WHERE or HAVING clause.
+    char** table_names;         // The names of the tables the query accesses.
+    int table_names_len;        // The number of entries in table_names.
+    char** database_names;      // The explicitly referred databases.
+    int database_names_len;     // The number of entries in database_names.
 } QC_SQLITE_INFO;
 
 /**
@@ -75,6 +93,7 @@ static thread_local struct
 {
     bool initialized;
     sqlite3* db;      // Thread specific database handle.
+    void* arena;      // Lookaside arena handed to the database handle.
     QC_SQLITE_INFO* info;
 } this_thread;
 
@@ -94,6 +113,9 @@ static bool is_submitted_query(const QC_SQLITE_INFO* info, const char* query);
 static bool parse_query(GWBUF* query);
 static void parse_query_string(const char* query, size_t len);
 static bool query_is_parsed(GWBUF* query);
+static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable);
+static void update_names_from_srclist(QC_SQLITE_INFO* info, const SrcList* pSrc);
+static void free_string_array(char** strings, int len);
 
 
 /**
@@ -145,7 +167,113 @@ static QC_SQLITE_INFO* info_alloc(void)
 
 static void info_finish(QC_SQLITE_INFO* info)
 {
-    (void) info;
+    free(info->affected_fields);
+    free(info->created_table_name);
+    free_string_array(info->table_names, info->table_names_len);
+    free_string_array(info->database_names, info->database_names_len);
+}
+
+static void free_string_array(char** strings, int len)
+{
+    if (strings)
+    {
+        int i;
+
+        for (i = 0; i < len; ++i)
+        {
+            free(strings[i]);
+        }
+
+        free(strings);
+    }
+}
+
+/**
+ * Append a table reference to the information gathered about a query.
+ *
+ * The table name is stored qualified with the database name when one was
+ * given; explicitly referred databases are collected separately, without
+ * duplicates.
+ *
+ * @param info      The info object being filled in.
+ * @param zDatabase The database name, may be NULL.
+ * @param zTable    The table name.
+ */
+static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable)
+{
+    char* name;
+    char** names;
+
+    if (zDatabase)
+    {
+        size_t len = strlen(zDatabase) + 1 + strlen(zTable) + 1;
+
+        if ((name = malloc(len)))
+        {
+            sprintf(name, "%s.%s", zDatabase, zTable);
+        }
+    }
+    else
+    {
+        name = strdup(zTable);
+    }
+
+    if (name &&
+        (names = realloc(info->table_names,
+                         (info->table_names_len + 1) * sizeof(char*))))
+    {
+        info->table_names = names;
+        info->table_names[info->table_names_len++] = name;
+    }
+    else
+    {
+        free(name);
+    }
+
+    if (zDatabase)
+    {
+        int i;
+
+        for (i = 0; i < info->database_names_len; ++i)
+        {
+            if (strcasecmp(info->database_names[i], zDatabase) == 0)
+            {
+                return;
+            }
+        }
+
+        if ((name = strdup(zDatabase)))
+        {
+            if ((names = realloc(info->database_names,
+                                 (info->database_names_len + 1) * sizeof(char*))))
+            {
+                info->database_names = names;
+                info->database_names[info->database_names_len++] = name;
+            }
+            else
+            {
+                free(name);
+            }
+        }
+    }
+}
+
+static void update_names_from_srclist(QC_SQLITE_INFO* info, const SrcList* pSrc)
+{
+    int i;
+
+    for (i = 0; i < pSrc->nSrc; ++i)
+    {
+        if (pSrc->a[i].zName)
+        {
+            update_names(info, pSrc->a[i].zDatabase, pSrc->a[i].zName);
+        }
+
+        if (pSrc->a[i].pSelect && pSrc->a[i].pSelect->pSrc)
+        {
+            update_names_from_srclist(info, pSrc->a[i].pSelect->pSrc);
+        }
+    }
 }
 
 static void info_free(QC_SQLITE_INFO* info)
@@ -218,7 +346,7 @@ static bool parse_query(GWBUF* query)
         }
         else
         {
-            MXS_ERROR("qc_sqlite: SQL statement \"%.*s\", was not recognized.", (int)len, s);
+            MXS_INFO("qc_sqlite: SQL statement \"%.*s\", was not recognized.", (int)len, s);
         }
 
         // TODO: Add return value to gwbuf_add_buffer_object.
@@ -270,7 +398,7 @@ static bool is_submitted_query(const QC_SQLITE_INFO* info, const char* query)
 
 void mxs_sqlite3BeginTransaction(Parse* pParse, int type)
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3BeginTransaction called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -281,7 +409,7 @@ void mxs_sqlite3BeginTransaction(Parse* pParse, int type)
 
 void mxs_sqlite3CommitTransaction(Parse* pParse)
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3CommitTransaction called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -296,7 +424,7 @@ void mxs_sqlite3EndTable(Parse *pParse,   /* Parse context */
                          u8 tabOpts,      /* Extra table options. Usually 0. */
                          Select *pSelect) /* Select from a "CREATE ... AS SELECT" */
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3EndTable called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -307,6 +435,11 @@ void mxs_sqlite3EndTable(Parse *pParse,   /* Parse context */
         info->operation = QUERY_OP_CREATE;
         info->types |= QUERY_TYPE_WRITE;
 
+        if (pParse->pNewTable && pParse->pNewTable->zName && !info->created_table_name)
+        {
+            info->created_table_name = strdup(pParse->pNewTable->zName);
+        }
+
         // From sqlite:
         /* The cookie mask contains one bit for each database file open.
         ** (Bit 0 is for main, bit 1 is for temp, and so forth.)  Bits are
@@ -325,7 +458,7 @@ void mxs_sqlite3EndTable(Parse *pParse,   /* Parse context */
 
 void mxs_sqlite3Insert(Parse* pParse, SrcList* pTabList, Select* pSelect, IdList* pColumn, int onError)
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3Insert called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -333,11 +466,22 @@ void mxs_sqlite3Insert(Parse* pParse, SrcList* pTabList, Select* pSelect, IdList
     info->status = QC_INFO_OK;
     info->types |= QUERY_TYPE_WRITE;
     info->operation = QUERY_OP_INSERT;
+
+    if (pTabList)
+    {
+        update_names_from_srclist(info, pTabList);
+    }
+
+    /** The grammar rule hands the trees over; releasing them here returns
+     * the memory to the lookaside arena for the next query. */
+    sqlite3SrcListDelete(pParse->db, pTabList);
+    sqlite3SelectDelete(pParse->db, pSelect);
+    sqlite3IdListDelete(pParse->db, pColumn);
 }
 
 void mxs_sqlite3RollbackTransaction(Parse* pParse)
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3CommitTransaction called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -348,7 +492,7 @@ void mxs_sqlite3RollbackTransaction(Parse* pParse)
 
 int mxs_sqlite3Select(Parse* pParse, Select* p, SelectDest* pDest)
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3Select called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -362,6 +506,16 @@ int mxs_sqlite3Select(Parse* pParse, Select* p, SelectDest* pDest)
         info->operation = QUERY_OP_SELECT;
         info->types |= QUERY_TYPE_READ;
 
+        if (p->pSrc)
+        {
+            update_names_from_srclist(info, p->pSrc);
+        }
+
+        if (p->pWhere || p->pHaving)
+        {
+            info->has_clause = true;
+        }
+
         ExprList* pEList = p->pEList; // List of columns to extract
 
         if (pEList)
@@ -402,7 +556,7 @@ int mxs_sqlite3Select(Parse* pParse, Select* p, SelectDest* pDest)
 
 void mxs_sqlite3Update(Parse* pParse, SrcList* pTablist, ExprList* pChanges, Expr* pWhere, int onError)
 {
-    MXS_NOTICE("qc_sqlite: mxs_sqlite3Update called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -410,11 +564,74 @@ void mxs_sqlite3Update(Parse* pParse, SrcList* pTablist, ExprList* pChanges, Exp
     info->status = QC_INFO_OK;
     info->types |= QUERY_TYPE_WRITE;
     info->operation = QUERY_OP_UPDATE;
+
+    if (pTablist)
+    {
+        update_names_from_srclist(info, pTablist);
+    }
+
+    if (pWhere)
+    {
+        info->has_clause = true;
+    }
+
+    sqlite3SrcListDelete(pParse->db, pTablist);
+    sqlite3ExprListDelete(pParse->db, pChanges);
+    sqlite3ExprDelete(pParse->db, pWhere);
+}
+
+void mxs_sqlite3DeleteFrom(Parse* pParse, SrcList* pTabList, Expr* pWhere)
+{
+    QC_TRACE();
+
+    QC_SQLITE_INFO* info = this_thread.info;
+    ss_dassert(info);
+
+    info->status = QC_INFO_OK;
+    info->types |= QUERY_TYPE_WRITE;
+    info->operation = QUERY_OP_DELETE;
+
+    if (pTabList)
+    {
+        update_names_from_srclist(info, pTabList);
+    }
+
+    if (pWhere)
+    {
+        info->has_clause = true;
+    }
+
+    sqlite3SrcListDelete(pParse->db, pTabList);
+    sqlite3ExprDelete(pParse->db, pWhere);
+}
+
+void mxs_sqlite3DropTable(Parse* pParse, SrcList* pName, int isView, int noErr)
+{
+    QC_TRACE();
+
+    QC_SQLITE_INFO* info = this_thread.info;
+    ss_dassert(info);
+
+    info->status = QC_INFO_OK;
+    info->types |= QUERY_TYPE_WRITE;
+    info->operation = QUERY_OP_DROP;
+
+    if (!isView)
+    {
+        info->is_drop_table = true;
+    }
+
+    if (pName)
+    {
+        update_names_from_srclist(info, pName);
+    }
+
+    sqlite3SrcListDelete(pParse->db, pName);
 }
 
 void maxscaleSet(Parse* pParse, ExprList* pList)
 {
-    MXS_NOTICE("qc_sqlite: maxscaleSet called.");
+    QC_TRACE();
 
     QC_SQLITE_INFO* info = this_thread.info;
     ss_dassert(info);
@@ -513,6 +730,26 @@ static bool qc_sqlite_thread_init(void)
     {
         this_thread.initialized = true;
 
+        /**
+         * Hand the handle a generous lookaside arena. Parse tree nodes are
+         * allocated from it and, as every statement's trees are released when
+         * the classification callbacks have run, parsing a query normally
+         * does no malloc calls at all. If the configuration fails, sqlite
+         * falls back to its default allocator which is merely slower.
+         */
+        this_thread.arena = malloc(QC_LOOKASIDE_SLOT_SIZE * QC_LOOKASIDE_NSLOTS);
+
+        if (this_thread.arena)
+        {
+            if (sqlite3_db_config(this_thread.db, SQLITE_DBCONFIG_LOOKASIDE,
+                                  this_thread.arena, QC_LOOKASIDE_SLOT_SIZE,
+                                  QC_LOOKASIDE_NSLOTS) != SQLITE_OK)
+            {
+                free(this_thread.arena);
+                this_thread.arena = NULL;
+            }
+        }
+
         MXS_INFO("In-memory sqlite database successfully opened for thread %lu.",
                  (unsigned long) pthread_self());
     }
@@ -541,6 +778,10 @@ static void qc_sqlite_thread_end(void)
     }
 
     this_thread.db = NULL;
+
+    free(this_thread.arena);
+    this_thread.arena = NULL;
+
     this_thread.initialized = false;
 }
 
@@ -606,9 +847,22 @@ static char* qc_sqlite_get_created_table_name(GWBUF* query)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_get_created_table_name not implemented yet.");
+    char* name = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query);
+
+    if (info)
+    {
+        if (info->status == QC_INFO_OK && info->created_table_name)
+        {
+            name = strdup(info->created_table_name);
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
 
-    return NULL;
+    return name;
 }
 
 static bool qc_sqlite_is_drop_table_query(GWBUF* query)
@@ -617,9 +871,19 @@ static bool qc_sqlite_is_drop_table_query(GWBUF* query)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_is_drop_table_query not implemented yet.");
+    bool is_drop_table = false;
+    QC_SQLITE_INFO* info = get_query_info(query);
+
+    if (info)
+    {
+        is_drop_table = info->status == QC_INFO_OK && info->is_drop_table;
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
 
-    return false;
+    return is_drop_table;
 }
 
 static bool qc_sqlite_is_real_query(GWBUF* query)
@@ -628,9 +892,37 @@ static bool qc_sqlite_is_real_query(GWBUF* query)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_is_real_query not implemented yet.");
+    bool is_real = false;
+    QC_SQLITE_INFO* info = get_query_info(query);
+
+    if (info)
+    {
+        if (info->status == QC_INFO_OK)
+        {
+            switch (info->operation)
+            {
+            case QUERY_OP_SELECT:
+                is_real = info->table_names_len > 0;
+                break;
+
+            case QUERY_OP_UPDATE:
+            case QUERY_OP_INSERT:
+            case QUERY_OP_DELETE:
+            case QUERY_OP_TRUNCATE:
+                is_real = true;
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
 
-    return false;
+    return is_real;
 }
 
 static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
@@ -639,9 +931,54 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_get_table names not implemented yet.");
+    char** names = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query);
+
+    *tblsize = 0;
+
+    if (info)
+    {
+        if (info->status == QC_INFO_OK && info->table_names_len > 0 &&
+            (names = malloc(info->table_names_len * sizeof(char*))))
+        {
+            int i;
+
+            for (i = 0; i < info->table_names_len; ++i)
+            {
+                const char* name = info->table_names[i];
+
+                if (!fullnames)
+                {
+                    /** The stored name is qualified when the statement
+                     * qualified it; strip the database part. */
+                    const char* dot = strchr(name, '.');
+
+                    if (dot)
+                    {
+                        name = dot + 1;
+                    }
+                }
+
+                if ((names[i] = strdup(name)) == NULL)
+                {
+                    free_string_array(names, i);
+                    names = NULL;
+                    break;
+                }
+            }
+
+            if (names)
+            {
+                *tblsize = info->table_names_len;
+            }
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
 
-    return NULL;
+    return names;
 }
 
 static char* qc_sqlite_get_canonical(GWBUF* query)
@@ -650,9 +987,16 @@ static char* qc_sqlite_get_canonical(GWBUF* query)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_get_canonical not implemented yet.");
+    char* querystr = NULL;
 
-    return NULL;
+    /** The canonical form does not need the parse tree at all */
+    if (GWBUF_LENGTH(query) > QC_COM_QUERY_HEADER_SIZE && GWBUF_IS_SQL(query))
+    {
+        querystr = canonicalize_sql((const char*) GWBUF_DATA(query) + QC_COM_QUERY_HEADER_SIZE,
+                                    GWBUF_LENGTH(query) - QC_COM_QUERY_HEADER_SIZE);
+    }
+
+    return querystr;
 }
 
 static bool qc_sqlite_query_has_clause(GWBUF* query)
@@ -661,9 +1005,19 @@ static bool qc_sqlite_query_has_clause(GWBUF* query)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_query_has_clause not implemented yet.");
+    bool has_clause = false;
+    QC_SQLITE_INFO* info = get_query_info(query);
+
+    if (info)
+    {
+        has_clause = info->status == QC_INFO_OK && info->has_clause;
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
 
-    return NULL;
+    return has_clause;
 }
 
 static char* qc_sqlite_get_affected_fields(GWBUF* query)
@@ -705,9 +1059,40 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    MXS_ERROR("qc_sqlite: qc_get_database_names not implemented yet.");
+    char** names = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query);
+
+    *sizep = 0;
+
+    if (info)
+    {
+        if (info->status == QC_INFO_OK && info->database_names_len > 0 &&
+            (names = malloc(info->database_names_len * sizeof(char*))))
+        {
+            int i;
+
+            for (i = 0; i < info->database_names_len; ++i)
+            {
+                if ((names[i] = strdup(info->database_names[i])) == NULL)
+                {
+                    free_string_array(names, i);
+                    names = NULL;
+                    break;
+                }
+            }
+
+            if (names)
+            {
+                *sizep = info->database_names_len;
+            }
+        }
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
+    }
 
-    return NULL;
+    return names;
 }
 
 /**
@@ -58,6 +58,8 @@
 //
 extern void mxs_sqlite3BeginTransaction(Parse*, int);
 extern void mxs_sqlite3CommitTransaction(Parse*);
+extern void mxs_sqlite3DeleteFrom(Parse*, SrcList*, Expr*);
+extern void mxs_sqlite3DropTable(Parse*, SrcList*, int, int);
 extern void mxs_sqlite3EndTable(Parse*, Token*, Token*, u8, Select*);
 extern void mxs_sqlite3Insert(Parse*, SrcList*, Select*, IdList*, int);
 extern void mxs_sqlite3RollbackTransaction(Parse*);
@@ -419,7 +421,7 @@ resolvetype(A) ::= REPLACE.                  {A = OE_Replace;}
 ////////////////////////// The DROP TABLE /////////////////////////////////////
 //
 cmd ::= DROP TABLE ifexists(E) fullname(X). {
-  sqlite3DropTable(pParse, X, 0, E);
+  mxs_sqlite3DropTable(pParse, X, 0, E);
 }
 %type ifexists {int}
 ifexists(A) ::= IF EXISTS.   {A = 1;}
@@ -433,7 +435,7 @@ cmd ::= createkw(X) temp(T) VIEW ifnotexists(E) nm(Y) dbnm(Z) eidlist_opt(C)
   sqlite3CreateView(pParse, &X, &Y, &Z, C, S, T, E);
 }
 cmd ::= DROP VIEW ifexists(E) fullname(X). {
-  sqlite3DropTable(pParse, X, 1, E);
+  mxs_sqlite3DropTable(pParse, X, 1, E);
 }
 %endif  SQLITE_OMIT_VIEW
 
@@ -778,14 +780,14 @@ cmd ::= with(C) DELETE FROM fullname(X) indexed_opt(I) where_opt(W)
   sqlite3WithPush(pParse, C, 1);
   sqlite3SrcListIndexedBy(pParse, X, &I);
   W = sqlite3LimitWhere(pParse, X, W, O, L.pLimit, L.pOffset, "DELETE");
-  sqlite3DeleteFrom(pParse,X,W);
+  mxs_sqlite3DeleteFrom(pParse,X,W);
 }
 %endif
 %ifndef SQLITE_ENABLE_UPDATE_DELETE_LIMIT
 cmd ::= with(C) DELETE FROM fullname(X) indexed_opt(I) where_opt(W). {
   sqlite3WithPush(pParse, C, 1);
   sqlite3SrcListIndexedBy(pParse, X, &I);
-  sqlite3DeleteFrom(pParse,X,W);
+  mxs_sqlite3DeleteFrom(pParse,X,W);
 }
 %endif
 
@@ -24,6 +24,7 @@
  *
  * Date         Who             Description
  * 10/06/13     Mark Riddoch    Initial implementation
+ * 14/06/16     Mark Riddoch    Added atomic_or and atomic_and
  *
  * @endverbatim
  */
@@ -58,3 +59,51 @@ atomic_add(int *variable, int value)
     return value;
 #endif
 }
+
+/**
+ * Implementation of an atomic bitwise or operation for the GCC environment,
+ * or the X86 processor, along the same lines as atomic_add above.
+ *
+ * Atomically sets in the location pointed to by the first parameter all the
+ * bits that are set in the second parameter.
+ *
+ * @param variable      Pointer to the variable to operate on
+ * @param bits          Bits to be set in the variable
+ */
+void
+atomic_or(unsigned int *variable, unsigned int bits)
+{
+#ifdef __GNUC__
+    (void) __sync_fetch_and_or(variable, bits);
+#else
+    asm volatile(
+        "lock; orl %1, %0;"
+        : "+m" (*variable)
+        : "ir" (bits)
+        : "memory" );
+#endif
+}
+
+/**
+ * Implementation of an atomic bitwise and operation for the GCC environment,
+ * or the X86 processor, along the same lines as atomic_add above.
+ *
+ * Atomically clears in the location pointed to by the first parameter all the
+ * bits that are clear in the second parameter.
+ *
+ * @param variable      Pointer to the variable to operate on
+ * @param bits          Bits to be retained in the variable
+ */
+void
+atomic_and(unsigned int *variable, unsigned int bits)
+{
+#ifdef __GNUC__
+    (void) __sync_fetch_and_and(variable, bits);
+#else
+    asm volatile(
+        "lock; andl %1, %0;"
+        : "+m" (*variable)
+        : "ir" (bits)
+        : "memory" );
+#endif
+}
@@ -39,16 +39,50 @@
  *                                      accessed by "show buffers" maxadmin command
  * 20/12/2015   Martin Brampton         Change gwbuf_free to free the whole list; add the
  *                                      gwbuf_count and gwbuf_alloc_and_load functions.
+ * 12/04/2016   Mark Riddoch            Pooled allocation of buffer headers and common
+ *                                      payload sizes with per-thread free lists
+ * 01/07/2016   Mark Riddoch            Addition of gwbuf_make_writable so that
+ *                                      zero-copy clones may be modified safely
+ * 02/07/2016   Mark Riddoch            Clones carry the statement digest of the
+ *                                      original buffer
+ * 03/07/2016   Mark Riddoch            Iterator for reading across the links
+ *                                      of a buffer chain
+ * 03/07/2016   Mark Riddoch            Well known properties stored in fixed
+ *                                      slots of the buffer
+ * 03/07/2016   Mark Riddoch            Report heap allocations to the memory
+ *                                      accounting of memaccount.c
+ * 03/07/2016   Mark Riddoch            Maintain the chain byte count on the
+ *                                      head buffer so that the length of a
+ *                                      chain is available without walking it
+ * 03/07/2016   Mark Riddoch            Small payloads allocated inline in the
+ *                                      buffer header allocation so that one
+ *                                      allocation serves the whole buffer
+ * 05/07/2016   Mark Riddoch            Buffer count of the chain maintained
+ *                                      incrementally with the byte count so
+ *                                      gwbuf_count no longer walks the chain
+ * 05/07/2016   Mark Riddoch            Buffers freed on a thread other than
+ *                                      the one that allocated them are batched
+ *                                      and handed back to the free lists of
+ *                                      the home thread
+ * 05/07/2016   Mark Riddoch            Contiguous buffers tagged with a type
+ *                                      flag maintained by gwbuf_append and
+ *                                      gwbuf_make_contiguous
+ * 05/07/2016   Mark Riddoch            Buffer pools primed from the
+ *                                      expected_connections capacity hint
  *
  * @endverbatim
  */
 #include <stdlib.h>
+#include <string.h>
 #include <buffer.h>
 #include <atomic.h>
 #include <skygw_debug.h>
 #include <spinlock.h>
 #include <hint.h>
 #include <log_manager.h>
+#include <platform.h>
+#include <memaccount.h>
+#include <statistics.h>
 #include <errno.h>
 
 #if defined(BUFFER_TRACE)
@@ -61,6 +95,551 @@ static HASHTABLE *buffer_hashtable = NULL;
 static void gwbuf_free_one(GWBUF *buf);
 static buffer_object_t* gwbuf_remove_buffer_object(GWBUF*           buf,
                                                    buffer_object_t* bufobj);
+static void bufpool_handoff(void *ptr, int kind, int owner);
+static void bufpool_drain();
+
+/**
+ * The pooled buffer allocator.
+ *
+ * Buffer headers and the shared buffers of the common payload sizes are
+ * recycled on free lists rather than returned to the heap. Each thread
+ * has its own set of free lists, so no lock is needed on the allocation
+ * fast path; a buffer freed by a thread goes onto the free list of that
+ * thread. The number of entries kept on each list is capped so that a
+ * burst of traffic does not pin memory for the lifetime of the process.
+ */
+#define BUFPOOL_CLASSES   4     /*< Number of pooled payload size classes */
+#define BUFPOOL_MAX_FREE  256   /*< Cap on free entries per class and thread */
+
+/** Payloads of at most this many bytes are stored inline in the buffer
+ * header allocation itself, so the header, the shared buffer and the data
+ * area come from a single allocation. Most packets that pass through the
+ * gateway - OK packets, pings and short queries - are below this size and
+ * the whole buffer then occupies adjacent cache lines rather than three
+ * scattered allocations. */
+#define BUFPOOL_INLINE_MAX 128
+
+/** The payload size of each class; requests larger than the last class
+ * fall back to plain malloc and free. The classes cover the common MySQL
+ * packet sizes seen on the wire, up to 4KB. */
+static const unsigned int bufpool_sizes[BUFPOOL_CLASSES] = {128, 512, 1024, 4096};
+
+/** Upper bound on the number of threads the ownership return scheme can
+ * distinguish; threads with an id beyond this free foreign buffers into
+ * their own pools as before. */
+#define BUFPOOL_MAX_THREADS   64
+
+/** Number of foreign buffers accumulated for one home thread before the
+ * batch is handed back to it. */
+#define BUFPOOL_HANDOFF_BATCH 32
+
+/**
+ * Overlay placed on a pooled object while it travels back to the free
+ * lists of its home thread. The fields overlap only parts of the object
+ * that the allocation paths rebuild on reuse: the buffer header is
+ * cleared on allocation and the link of a shared buffer reuses the data
+ * pointer just as the free lists themselves do; the size class, data
+ * size and owner of a shared buffer are beyond the overlay and survive.
+ */
+typedef struct bufpool_node
+{
+    struct bufpool_node *next;  /*< Next object in the batch */
+    int                 kind;   /*< BUFPOOL_NODE_HEADER or BUFPOOL_NODE_SBUF */
+} BUFPOOL_NODE;
+
+#define BUFPOOL_NODE_HEADER 0   /*< The object is a plain buffer header */
+#define BUFPOOL_NODE_SBUF   1   /*< The object is a shared buffer; its size
+                                 *  class tells inline blocks and the pooled
+                                 *  classes apart */
+
+typedef struct
+{
+    GWBUF        *headers;                  /*< Free list of buffer headers */
+    int          n_headers;                 /*< Number of free headers */
+    GWBUF        *inlines;                  /*< Free list of headers with an
+                                             *  inline shared buffer */
+    int          n_inlines;                 /*< Number of free inline buffers */
+    SHARED_BUF   *sbufs[BUFPOOL_CLASSES];   /*< Free lists of shared buffers by class */
+    int          n_sbufs[BUFPOOL_CLASSES];  /*< Number of free shared buffers */
+    BUFPOOL_NODE *out[BUFPOOL_MAX_THREADS]; /*< Outbound stashes of buffers freed
+                                             *  here but owned by other threads */
+    BUFPOOL_NODE *out_tail[BUFPOOL_MAX_THREADS]; /*< Tails of the stashes, for
+                                             *  linking a whole batch in one go */
+    int          n_out[BUFPOOL_MAX_THREADS]; /*< Number of buffers in each stash */
+} BUFPOOL;
+
+/**
+ * The inbound side of the ownership return scheme: one lock-free stack
+ * per thread, padded to a cache line of its own. A thread freeing a
+ * batch of foreign buffers pushes the whole chain onto the stack of the
+ * home thread with a single compare-and-swap; the home thread empties
+ * its stack with an atomic exchange from its allocation path and feeds
+ * the returned buffers into its ordinary free lists.
+ */
+typedef union
+{
+    BUFPOOL_NODE * volatile head;   /*< Batches awaiting collection */
+    char pad[64];                   /*< Pad the slot to a full cache line */
+} BUFPOOL_INBOX;
+
+static BUFPOOL_INBOX bufpool_inbox[BUFPOOL_MAX_THREADS];
+
+/**
+ * A shared buffer that references memory owned by someone else. The done
+ * function is called when the last reference is dropped instead of freeing
+ * the data area.
+ */
+typedef struct
+{
+    SHARED_BUF  sbuf;                       /*< The shared buffer, must be first */
+    void        (*donefun)(void *);         /*< Called when the last reference is dropped */
+    void        *arg;                       /*< Argument passed to the done function */
+} SHARED_BUF_REF;
+
+static thread_local BUFPOOL bufpool;
+
+#if defined(SS_DEBUG)
+/** Non-zero while the calling thread is inside a zero-copy zone, a
+ * stretch of code that has declared that the buffers passing through it
+ * must flow onwards without their data being copied. The buffer
+ * operations that do copy assert that the zone is not active. */
+static thread_local int gwbuf_zero_copy_zone = 0;
+
+/**
+ * Enter a zero-copy zone on the calling thread.
+ *
+ * Used in debug builds around forwarding paths that guarantee the
+ * buffers are passed on untouched, such as the routing of complete
+ * backend packets to the client. A copying buffer operation reached
+ * from inside the zone trips an assertion.
+ */
+void
+gwbuf_zero_copy_enter()
+{
+    gwbuf_zero_copy_zone++;
+}
+
+/**
+ * Leave a zero-copy zone on the calling thread.
+ */
+void
+gwbuf_zero_copy_exit()
+{
+    ss_dassert(gwbuf_zero_copy_zone > 0);
+    gwbuf_zero_copy_zone--;
+}
+#endif /* SS_DEBUG */
+
+/**
+ * Allocate a zeroed buffer header, from the free list of the calling
+ * thread if one is available.
+ *
+ * @return A buffer header or NULL if memory could not be allocated
+ */
+static GWBUF *
+gwbuf_header_alloc()
+{
+    GWBUF *rval;
+    int   tid = ts_stats_get_thread_id();
+
+    if (tid < BUFPOOL_MAX_THREADS && bufpool_inbox[tid].head != NULL)
+    {
+        bufpool_drain();
+    }
+    if ((rval = bufpool.headers) != NULL)
+    {
+        bufpool.headers = rval->next;
+        bufpool.n_headers--;
+    }
+    else if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    {
+        return NULL;
+    }
+    else
+    {
+        memacct_add(MEM_ACCT_BUFFER, sizeof(GWBUF));
+    }
+    memset(rval, 0, sizeof(GWBUF));
+    rval->gwbuf_owner = tid;
+    return rval;
+}
+
+/**
+ * Return a buffer header to the free list of the calling thread, or to
+ * the heap if the free list is full.
+ *
+ * @param buf   The buffer header to release
+ */
+static void
+gwbuf_header_free(GWBUF *buf)
+{
+    int owner = buf->gwbuf_owner;
+
+    if (owner != ts_stats_get_thread_id()
+        && owner >= 0 && owner < BUFPOOL_MAX_THREADS)
+    {
+        bufpool_handoff(buf, BUFPOOL_NODE_HEADER, owner);
+    }
+    else if (bufpool.n_headers < BUFPOOL_MAX_FREE)
+    {
+        buf->next = bufpool.headers;
+        bufpool.headers = buf;
+        bufpool.n_headers++;
+    }
+    else
+    {
+        memacct_add(MEM_ACCT_BUFFER, -(int64_t)sizeof(GWBUF));
+        free(buf);
+    }
+}
+
+/**
+ * Allocate a buffer header followed by an inline shared buffer and its
+ * data area, all in a single allocation. The header is marked so that the
+ * free path knows it is released together with the shared buffer when the
+ * last reference is dropped.
+ *
+ * @return A buffer header with an inline shared buffer or NULL if memory
+ * could not be allocated
+ */
+static GWBUF *
+gwbuf_inline_alloc()
+{
+    GWBUF      *rval;
+    SHARED_BUF *sbuf;
+    int        tid = ts_stats_get_thread_id();
+
+    if (tid < BUFPOOL_MAX_THREADS && bufpool_inbox[tid].head != NULL)
+    {
+        bufpool_drain();
+    }
+    if ((rval = bufpool.inlines) != NULL)
+    {
+        bufpool.inlines = rval->next;
+        bufpool.n_inlines--;
+    }
+    else if ((rval = (GWBUF *)malloc(sizeof(GWBUF) + sizeof(SHARED_BUF)
+                                     + BUFPOOL_INLINE_MAX)) == NULL)
+    {
+        return NULL;
+    }
+    else
+    {
+        memacct_add(MEM_ACCT_BUFFER, sizeof(GWBUF) + sizeof(SHARED_BUF)
+                    + BUFPOOL_INLINE_MAX);
+    }
+    memset(rval, 0, sizeof(GWBUF));
+    sbuf = (SHARED_BUF *)(rval + 1);
+    sbuf->data = (unsigned char *)(sbuf + 1);
+    sbuf->refcount = 1;
+    sbuf->sclass = GWBUF_SCLASS_INLINE;
+    sbuf->bsize = BUFPOOL_INLINE_MAX;
+    sbuf->owner = tid;
+    rval->sbuf = sbuf;
+    rval->gwbuf_inline = 1;
+    rval->gwbuf_owner = tid;
+    return rval;
+}
+
+/**
+ * Allocate a shared buffer with at least size bytes of data area. If the
+ * size fits one of the pooled classes the buffer is taken from the free
+ * list of the calling thread when possible and the data area follows the
+ * SHARED_BUF structure in a single allocation. Larger requests are
+ * allocated directly from the heap as before.
+ *
+ * @param size  The size in bytes of the data area required
+ * @return A shared buffer or NULL if memory could not be allocated
+ */
+static SHARED_BUF *
+gwbuf_sbuf_alloc(unsigned int size)
+{
+    SHARED_BUF *sbuf;
+    int class = -1;
+    int i;
+
+    for (i = 0; i < BUFPOOL_CLASSES; i++)
+    {
+        if (size <= bufpool_sizes[i])
+        {
+            class = i;
+            break;
+        }
+    }
+    if (class < 0)
+    {
+        /* Too large to pool, use separate allocations for the
+         * structure and the data so that the data area is exactly
+         * the requested size. */
+        if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
+        {
+            return NULL;
+        }
+        if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
+        {
+            free(sbuf);
+            return NULL;
+        }
+        sbuf->sclass = 0;
+        sbuf->bsize = size;
+        memacct_add(MEM_ACCT_BUFFER, (int64_t)sizeof(SHARED_BUF) + size);
+    }
+    else if ((sbuf = bufpool.sbufs[class]) != NULL)
+    {
+        /* The data pointer is used as the free list link */
+        bufpool.sbufs[class] = (SHARED_BUF *)sbuf->data;
+        bufpool.n_sbufs[class]--;
+        sbuf->data = (unsigned char *)(sbuf + 1);
+        ss_dassert(sbuf->sclass == class + 1);
+    }
+    else
+    {
+        if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF)
+                                         + bufpool_sizes[class])) == NULL)
+        {
+            return NULL;
+        }
+        sbuf->data = (unsigned char *)(sbuf + 1);
+        sbuf->sclass = class + 1;
+        sbuf->bsize = bufpool_sizes[class];
+        memacct_add(MEM_ACCT_BUFFER,
+                    (int64_t)sizeof(SHARED_BUF) + bufpool_sizes[class]);
+    }
+    sbuf->refcount = 1;
+    sbuf->owner = ts_stats_get_thread_id();
+    return sbuf;
+}
+
+/**
+ * Release a shared buffer whose reference count has dropped to zero,
+ * returning pooled buffers to the free list of the calling thread.
+ *
+ * @param sbuf  The shared buffer to release
+ */
+static void
+gwbuf_sbuf_free(SHARED_BUF *sbuf)
+{
+    int class = sbuf->sclass - 1;
+
+    if ((sbuf->sclass == GWBUF_SCLASS_INLINE || class >= 0)
+        && sbuf->owner != ts_stats_get_thread_id()
+        && sbuf->owner >= 0 && sbuf->owner < BUFPOOL_MAX_THREADS)
+    {
+        /* The buffer belongs to the pools of another thread. An inline
+         * buffer travels by its shared buffer too; the home thread
+         * recovers the enclosing allocation from the size class. */
+        bufpool_handoff(sbuf, BUFPOOL_NODE_SBUF, sbuf->owner);
+        return;
+    }
+    if (sbuf->sclass == GWBUF_SCLASS_REFERENCED)
+    {
+        SHARED_BUF_REF *ref = (SHARED_BUF_REF *)sbuf;
+
+        if (ref->donefun)
+        {
+            ref->donefun(ref->arg);
+        }
+        memacct_add(MEM_ACCT_BUFFER, -(int64_t)sizeof(SHARED_BUF_REF));
+        free(ref);
+    }
+    else if (sbuf->sclass == GWBUF_SCLASS_INLINE)
+    {
+        /* The shared buffer lives in the same allocation as the buffer
+         * header that precedes it; the whole block is recycled. */
+        GWBUF *base = ((GWBUF *)sbuf) - 1;
+
+        if (bufpool.n_inlines < BUFPOOL_MAX_FREE)
+        {
+            base->next = bufpool.inlines;
+            bufpool.inlines = base;
+            bufpool.n_inlines++;
+        }
+        else
+        {
+            memacct_add(MEM_ACCT_BUFFER, -((int64_t)sizeof(GWBUF)
+                        + sizeof(SHARED_BUF) + BUFPOOL_INLINE_MAX));
+            free(base);
+        }
+    }
+    else if (class < 0)
+    {
+        memacct_add(MEM_ACCT_BUFFER,
+                    -((int64_t)sizeof(SHARED_BUF) + sbuf->bsize));
+        free(sbuf->data);
+        free(sbuf);
+    }
+    else if (bufpool.n_sbufs[class] < BUFPOOL_MAX_FREE)
+    {
+        sbuf->data = (unsigned char *)bufpool.sbufs[class];
+        bufpool.sbufs[class] = sbuf;
+        bufpool.n_sbufs[class]++;
+    }
+    else
+    {
+        memacct_add(MEM_ACCT_BUFFER,
+                    -((int64_t)sizeof(SHARED_BUF) + sbuf->bsize));
+        free(sbuf);
+    }
+}
+
+/**
+ * Prime the buffer pools of the calling thread with n free entries on
+ * each free list, up to the pool caps. Called by each polling thread at
+ * startup when the configuration carries an expected_connections
+ * capacity hint, so that the allocations are made before traffic
+ * arrives rather than during the connection ramp. The primed entries
+ * carry only the fields the free lists themselves rely on; everything
+ * else is rebuilt by the allocation paths on reuse.
+ *
+ * @param n     The number of entries to place on each free list
+ */
+void
+gwbuf_pool_prime(int n)
+{
+    GWBUF      *buf;
+    SHARED_BUF *sbuf;
+    int        class;
+    int        tid = ts_stats_get_thread_id();
+
+    if (n > BUFPOOL_MAX_FREE)
+    {
+        n = BUFPOOL_MAX_FREE;
+    }
+    while (bufpool.n_headers < n)
+    {
+        if ((buf = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+        {
+            return;
+        }
+        memacct_add(MEM_ACCT_BUFFER, sizeof(GWBUF));
+        buf->next = bufpool.headers;
+        bufpool.headers = buf;
+        bufpool.n_headers++;
+    }
+    while (bufpool.n_inlines < n)
+    {
+        if ((buf = (GWBUF *)malloc(sizeof(GWBUF) + sizeof(SHARED_BUF)
+                                   + BUFPOOL_INLINE_MAX)) == NULL)
+        {
+            return;
+        }
+        memacct_add(MEM_ACCT_BUFFER, sizeof(GWBUF) + sizeof(SHARED_BUF)
+                    + BUFPOOL_INLINE_MAX);
+        buf->next = bufpool.inlines;
+        bufpool.inlines = buf;
+        bufpool.n_inlines++;
+    }
+    for (class = 0; class < BUFPOOL_CLASSES; class++)
+    {
+        while (bufpool.n_sbufs[class] < n)
+        {
+            if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF)
+                                             + bufpool_sizes[class])) == NULL)
+            {
+                return;
+            }
+            memacct_add(MEM_ACCT_BUFFER,
+                        (int64_t)sizeof(SHARED_BUF) + bufpool_sizes[class]);
+            sbuf->sclass = class + 1;
+            sbuf->bsize = bufpool_sizes[class];
+            sbuf->owner = tid;
+            /* The data pointer is used as the free list link */
+            sbuf->data = (unsigned char *)bufpool.sbufs[class];
+            bufpool.sbufs[class] = sbuf;
+            bufpool.n_sbufs[class]++;
+        }
+    }
+}
+
+/**
+ * Push the outbound stash kept for one home thread onto the inbox of
+ * that thread. The whole chain is linked in with a single
+ * compare-and-swap, so a batch of buffers costs one cross-core atomic
+ * operation rather than one per buffer.
+ *
+ * @param owner The home thread the stash is kept for
+ */
+static void
+bufpool_handoff_flush(int owner)
+{
+    BUFPOOL_NODE *head = bufpool.out[owner];
+    BUFPOOL_NODE *tail = bufpool.out_tail[owner];
+    BUFPOOL_NODE *old;
+
+    if (head == NULL)
+    {
+        return;
+    }
+    do
+    {
+        old = bufpool_inbox[owner].head;
+        tail->next = old;
+    }
+    while (!__sync_bool_compare_and_swap(&bufpool_inbox[owner].head,
+                                         old, head));
+    bufpool.out[owner] = NULL;
+    bufpool.out_tail[owner] = NULL;
+    bufpool.n_out[owner] = 0;
+}
+
+/**
+ * Stash a buffer freed on the calling thread but owned by another one.
+ * The buffer joins the outbound stash kept for its home thread; when
+ * the stash reaches a full batch it is handed over in one go. Until
+ * then no atomic operations are needed, and at most a batch worth of
+ * buffers per home thread can sit in the stashes of a thread.
+ *
+ * @param ptr   The buffer header or shared buffer being freed
+ * @param kind  BUFPOOL_NODE_HEADER or BUFPOOL_NODE_SBUF
+ * @param owner The home thread of the buffer
+ */
+static void
+bufpool_handoff(void *ptr, int kind, int owner)
+{
+    BUFPOOL_NODE *node = (BUFPOOL_NODE *)ptr;
+
+    node->kind = kind;
+    node->next = bufpool.out[owner];
+    bufpool.out[owner] = node;
+    if (node->next == NULL)
+    {
+        bufpool.out_tail[owner] = node;
+    }
+    if (++bufpool.n_out[owner] >= BUFPOOL_HANDOFF_BATCH)
+    {
+        bufpool_handoff_flush(owner);
+    }
+}
+
+/**
+ * Collect the buffers other threads have returned to the calling
+ * thread and feed them into its free lists. The inbox is emptied with
+ * a single atomic exchange; each returned buffer then goes through the
+ * ordinary free path of its kind, which now runs on the home thread
+ * and so places it on the local free lists.
+ */
+static void
+bufpool_drain()
+{
+    BUFPOOL_NODE *node;
+
+    node = (BUFPOOL_NODE *)__sync_lock_test_and_set(
+        &bufpool_inbox[ts_stats_get_thread_id()].head, NULL);
+    while (node)
+    {
+        BUFPOOL_NODE *next = node->next;
+
+        if (node->kind == BUFPOOL_NODE_HEADER)
+        {
+            gwbuf_header_free((GWBUF *)node);
+        }
+        else
+        {
+            gwbuf_sbuf_free((SHARED_BUF *)node);
+        }
+        node = next;
+    }
+}
 
 #if defined(BUFFER_TRACE)
 static void gwbuf_add_to_hashtable(GWBUF *buf);
@@ -72,9 +651,9 @@ static void gwbuf_remove_from_hashtable(GWBUF *buf);
 /**
  * Allocate a new gateway buffer structure of size bytes.
  *
- * For now we allocate memory directly from malloc for buffer the management
- * structure and the actual data buffer itself. We may swap at a future date
- * to a more efficient mechanism.
+ * The buffer header and, for the common sizes, the shared data buffer are
+ * taken from the per-thread buffer pool so that the hot path does not
+ * touch the global heap.
  *
  * @param       size The size in bytes of the data area required
  * @return      Pointer to the buffer structure or NULL if memory could not
@@ -86,36 +665,40 @@ gwbuf_alloc(unsigned int size)
     GWBUF      *rval;
     SHARED_BUF *sbuf;
 
-    /* Allocate the buffer header */
-    if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if (size <= BUFPOOL_INLINE_MAX)
     {
-        goto retblock;
+        /* Small payload, the header and the data come from a single
+         * inline allocation */
+        if ((rval = gwbuf_inline_alloc()) == NULL)
+        {
+            goto retblock;
+        }
+        sbuf = rval->sbuf;
     }
-
-    /* Allocate the shared data buffer */
-    if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
+    else
     {
-        free(rval);
-        rval = NULL;
-        goto retblock;
-    }
+        /* Allocate the buffer header */
+        if ((rval = gwbuf_header_alloc()) == NULL)
+        {
+            goto retblock;
+        }
 
-    /* Allocate the space for the actual data */
-    if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
-    {
-        ss_dassert(sbuf->data != NULL);
-        free(rval);
-        free(sbuf);
-        rval = NULL;
-        goto retblock;
+        /* Allocate the shared data buffer */
+        if ((sbuf = gwbuf_sbuf_alloc(size)) == NULL)
+        {
+            gwbuf_header_free(rval);
+            rval = NULL;
+            goto retblock;
+        }
     }
     spinlock_init(&rval->gwbuf_lock);
     rval->start = sbuf->data;
     rval->end = (void *)((char *)rval->start+size);
-    sbuf->refcount = 1;
     rval->sbuf = sbuf;
     rval->next = NULL;
     rval->tail = rval;
+    rval->chlen = size;
+    rval->chcnt = 1;
     rval->hint = NULL;
     rval->properties = NULL;
     rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
@@ -138,6 +721,66 @@ retblock:
     return rval;
 }
 
+/**
+ * Allocate a gateway buffer that references externally owned memory, such
+ * as a memory mapped file, without copying it. The buffer may be cloned
+ * and freed like any other; when the last reference is dropped the done
+ * function is called with the given argument rather than the data being
+ * freed, allowing the owner to release the underlying memory.
+ *
+ * The caller must guarantee the data remains valid until the done
+ * function has been called.
+ *
+ * @param       data    The externally owned data area
+ * @param       size    The number of valid bytes at data
+ * @param       donefun Called when the last reference is dropped, may be NULL
+ * @param       arg     Argument passed to the done function
+ * @return      Pointer to the buffer structure or NULL if memory could not
+ *              be allocated.
+ */
+GWBUF *
+gwbuf_alloc_referenced(void *data, unsigned int size, void (*donefun)(void *), void *arg)
+{
+    GWBUF          *rval;
+    SHARED_BUF_REF *ref;
+
+    if ((rval = gwbuf_header_alloc()) == NULL)
+    {
+        return NULL;
+    }
+    if ((ref = (SHARED_BUF_REF *)malloc(sizeof(SHARED_BUF_REF))) == NULL)
+    {
+        gwbuf_header_free(rval);
+        return NULL;
+    }
+    ref->sbuf.data = data;
+    ref->sbuf.refcount = 1;
+    ref->sbuf.sclass = GWBUF_SCLASS_REFERENCED;
+    ref->sbuf.bsize = 0;    /*< The data area is not owned by the buffer */
+    ref->donefun = donefun;
+    ref->arg = arg;
+    memacct_add(MEM_ACCT_BUFFER, sizeof(SHARED_BUF_REF));
+
+    spinlock_init(&rval->gwbuf_lock);
+    rval->start = data;
+    rval->end = (void *)((char *)rval->start + size);
+    rval->sbuf = &ref->sbuf;
+    rval->next = NULL;
+    rval->tail = rval;
+    rval->chlen = size;
+    rval->chcnt = 1;
+    rval->hint = NULL;
+    rval->properties = NULL;
+    rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
+    rval->gwbuf_info = GWBUF_INFO_NONE;
+    rval->gwbuf_bufobj = NULL;
+    CHK_GWBUF(rval);
+#if defined(BUFFER_TRACE)
+    gwbuf_add_to_hashtable(rval);
+#endif
+    return rval;
+}
+
 /**
  * Allocate a new gateway buffer structure of size bytes and load with data.
  *
@@ -284,11 +927,16 @@ gwbuf_free_one(GWBUF *buf)
 {
     BUF_PROPERTY    *prop;
     buffer_object_t *bo;
+    SHARED_BUF      *sbuf = NULL;
+    int              i;
 
     if (atomic_add(&buf->sbuf->refcount, -1) == 1)
     {
-        free(buf->sbuf->data);
-        free(buf->sbuf);
+        /* The shared buffer is freed after the header has been cleaned
+         * up; an inline shared buffer shares its allocation with the
+         * header so it must not be released while the header is still
+         * being read. */
+        sbuf = buf->sbuf;
         bo = buf->gwbuf_bufobj;
 
         while (bo != NULL)
@@ -305,6 +953,10 @@ gwbuf_free_one(GWBUF *buf)
         free(prop->value);
         free(prop);
     }
+    for (i = 0; i < GWBUF_PROP_WELLKNOWN_MAX; i++)
+    {
+        free(buf->wkprops[i]);
+    }
     /** Release the hint */
     while (buf->hint)
     {
@@ -315,7 +967,30 @@ gwbuf_free_one(GWBUF *buf)
 #if defined(BUFFER_TRACE)
     gwbuf_remove_from_hashtable(buf);
 #endif
-    free(buf);
+    if (buf->gwbuf_inline)
+    {
+        SHARED_BUF *inlbuf = (SHARED_BUF *)(buf + 1);
+
+        /**
+         * The header shares its allocation with the inline shared
+         * buffer and is released with it when the last reference to
+         * the shared buffer is dropped. If copy-on-write has repointed
+         * the header at another shared buffer the reference the header
+         * kept on its inline buffer is dropped here instead.
+         */
+        if (inlbuf != buf->sbuf && atomic_add(&inlbuf->refcount, -1) == 1)
+        {
+            gwbuf_sbuf_free(inlbuf);
+        }
+    }
+    else
+    {
+        gwbuf_header_free(buf);
+    }
+    if (sbuf != NULL)
+    {
+        gwbuf_sbuf_free(sbuf);
+    }
 }
 
 /**
@@ -333,7 +1008,7 @@ gwbuf_clone(GWBUF *buf)
 {
     GWBUF *rval;
 
-    if ((rval = (GWBUF *)calloc(1,sizeof(GWBUF))) == NULL)
+    if ((rval = gwbuf_header_alloc()) == NULL)
     {
         ss_dassert(rval != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -349,7 +1024,11 @@ gwbuf_clone(GWBUF *buf)
     rval->gwbuf_type = buf->gwbuf_type;
     rval->gwbuf_info = buf->gwbuf_info;
     rval->gwbuf_bufobj = buf->gwbuf_bufobj;
+    rval->digest = buf->digest;
+    rval->digest_id = buf->digest_id;
     rval->tail = rval;
+    rval->chlen = GWBUF_LENGTH(rval);
+    rval->chcnt = 1;
     rval->next = NULL;
     CHK_GWBUF(rval);
 #if defined(BUFFER_TRACE)
@@ -383,10 +1062,63 @@ GWBUF* gwbuf_clone_all(GWBUF* buf)
         buf = buf->next;
         clonebuf->next = gwbuf_clone(buf);
         clonebuf = clonebuf->next;
+        rval->chlen += GWBUF_LENGTH(clonebuf);
+        rval->chcnt++;
     }
+    rval->tail = clonebuf;
     return rval;
 }
 
+/**
+ * Ensure that the data area referenced by a buffer is private to that
+ * buffer so that it may safely be modified in place. The clone functions
+ * share the data area between the original and the clone; a writer that
+ * modified shared data would corrupt the packet seen by the other
+ * reference. If the shared buffer has other references, or references
+ * memory owned by someone else, the portion this buffer points to is
+ * copied into a freshly allocated shared buffer and the buffer header is
+ * repointed at the copy. This is the copy-on-write step that makes the
+ * clones free; the copy is only ever made if a sharer writes.
+ *
+ * @param buf   The buffer that is about to be modified
+ * @return      The buffer passed in, or NULL if the copy could not be
+ *              allocated in which case the buffer is left unmodified
+ */
+GWBUF *
+gwbuf_make_writable(GWBUF *buf)
+{
+    SHARED_BUF   *sbuf;
+    unsigned int len = GWBUF_LENGTH(buf);
+
+    CHK_GWBUF(buf);
+    if (buf->sbuf->refcount == 1 &&
+        buf->sbuf->sclass != GWBUF_SCLASS_REFERENCED)
+    {
+        return buf;
+    }
+    if ((sbuf = gwbuf_sbuf_alloc(len)) == NULL)
+    {
+        return NULL;
+    }
+    memcpy(sbuf->data, buf->start, len);
+    if (buf->gwbuf_inline && buf->sbuf == (SHARED_BUF *)(buf + 1))
+    {
+        /**
+         * The header keeps its reference on the inline shared buffer
+         * it shares an allocation with; the reference is dropped when
+         * the header itself is freed.
+         */
+    }
+    else if (atomic_add(&buf->sbuf->refcount, -1) == 1)
+    {
+        gwbuf_sbuf_free(buf->sbuf);
+    }
+    buf->sbuf = sbuf;
+    buf->start = sbuf->data;
+    buf->end = (void *)(sbuf->data + len);
+    return buf;
+}
+
 
 GWBUF *gwbuf_clone_portion(GWBUF *buf,
                            size_t start_offset,
@@ -397,7 +1129,7 @@ GWBUF *gwbuf_clone_portion(GWBUF *buf,
     CHK_GWBUF(buf);
     ss_dassert(start_offset+length <= GWBUF_LENGTH(buf));
 
-    if ((clonebuf = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if ((clonebuf = gwbuf_header_alloc()) == NULL)
     {
         ss_dassert(clonebuf != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -417,6 +1149,8 @@ GWBUF *gwbuf_clone_portion(GWBUF *buf,
     clonebuf->gwbuf_bufobj = buf->gwbuf_bufobj;
     clonebuf->next = NULL;
     clonebuf->tail = clonebuf;
+    clonebuf->chlen = length;
+    clonebuf->chcnt = 1;
     CHK_GWBUF(clonebuf);
 #if defined(BUFFER_TRACE)
     gwbuf_add_to_hashtable(clonebuf);
@@ -498,10 +1232,58 @@ gwbuf_append(GWBUF *head, GWBUF *tail)
     CHK_GWBUF(head);
     head->tail->next = tail;
     head->tail = tail->tail;
+    head->chlen += tail->chlen;
+    head->chcnt += tail->chcnt;
+    /*< The chain has more than one link now */
+    head->gwbuf_type &= ~GWBUF_TYPE_CONTIGUOUS;
 
     return head;
 }
 
+/**
+ * Append a buffer onto a linked list of buffer structures, merging it
+ * into the current tail when the two are adjacent views over the same
+ * shared buffer.
+ *
+ * Consecutive reads on a DCB land one after another in its retained
+ * receive buffer and the views over them can simply be fused by moving
+ * the end pointer of the earlier view, keeping the chain a single
+ * buffer that needs no linearising copy when the packets in it are
+ * examined. Buffers that are not adjacent, differ in type or carry
+ * hints or properties of their own are appended as separate links in
+ * the ordinary way.
+ *
+ * @param head  The current head of the linked list
+ * @param tail  The new buffer to add to the linked list
+ * @return      The new head of the linked list
+ */
+GWBUF *
+gwbuf_append_coalesce(GWBUF *head, GWBUF *tail)
+{
+    GWBUF *last;
+
+    if (!head || !tail)
+    {
+        return gwbuf_append(head, tail);
+    }
+    CHK_GWBUF(head);
+    last = head->tail;
+    if (last->sbuf == tail->sbuf &&
+        last->end == tail->start &&
+        last->gwbuf_type == tail->gwbuf_type &&
+        tail->next == NULL &&
+        tail->hint == NULL &&
+        tail->properties == NULL &&
+        tail->gwbuf_bufobj == NULL)
+    {
+        last->end = tail->end;
+        head->chlen += tail->chlen;
+        gwbuf_free(tail);
+        return head;
+    }
+    return gwbuf_append(head, tail);
+}
+
 /**
  * Consume data from a buffer in the linked list. The assumption is to consume
  * n bytes from the buffer chain.
@@ -522,8 +1304,11 @@ GWBUF *
 gwbuf_consume(GWBUF *head, unsigned int length)
 {
     GWBUF *rval = head;
+    unsigned int buflen;
 
     CHK_GWBUF(head);
+    buflen = GWBUF_LENGTH(head);
+    head->chlen -= length > buflen ? buflen : length;
     GWBUF_CONSUME(head, length);
     CHK_GWBUF(head);
 
@@ -533,6 +1318,8 @@ gwbuf_consume(GWBUF *head, unsigned int length)
         if (head->next)
         {
             head->next->tail = head->tail;
+            head->next->chlen = head->chlen;
+            head->next->chcnt = head->chcnt - 1;
         }
 
         gwbuf_free_one(head);
@@ -542,6 +1329,36 @@ gwbuf_consume(GWBUF *head, unsigned int length)
     return rval;
 }
 
+/**
+ * Detach the first buffer from a chain of buffers.
+ *
+ * The tail pointer and chain byte count of both the detached buffer and
+ * the remainder of the chain are updated, so both remain valid chain
+ * heads. Code that removes a buffer from a chain should use this rather
+ * than relinking the next pointers itself.
+ *
+ * @param head          The head of the chain
+ * @param remainder     Returns the remainder of the chain, may be NULL
+ * @return The detached first buffer of the chain
+ */
+GWBUF *
+gwbuf_detach_head(GWBUF *head, GWBUF **remainder)
+{
+    CHK_GWBUF(head);
+    *remainder = head->next;
+    if (head->next)
+    {
+        head->next->tail = head->tail;
+        head->next->chlen = head->chlen - GWBUF_LENGTH(head);
+        head->next->chcnt = head->chcnt - 1;
+        head->next = NULL;
+    }
+    head->tail = head;
+    head->chlen = GWBUF_LENGTH(head);
+    head->chcnt = 1;
+    return head;
+}
+
 /**
  * Return the number of bytes of data in the linked list.
  *
@@ -551,38 +1368,55 @@ gwbuf_consume(GWBUF *head, unsigned int length)
 unsigned int
 gwbuf_length(GWBUF *head)
 {
-    int rval = 0;
-
-    if (head)
+    if (head == NULL)
     {
-        CHK_GWBUF(head);
+        return 0;
     }
-    while (head)
+    CHK_GWBUF(head);
+#if defined(SS_DEBUG)
     {
-        rval += GWBUF_LENGTH(head);
-        head = head->next;
+        GWBUF *ptr = head;
+        unsigned int total = 0;
+
+        while (ptr)
+        {
+            total += GWBUF_LENGTH(ptr);
+            ptr = ptr->next;
+        }
+        ss_dassert(total == head->chlen);
     }
-    return rval;
+#endif
+    return head->chlen;
 }
 
 /**
  * Return the number of individual buffers in the linked list.
  *
- * Currently not used, provided mainly for use during debugging sessions.
- *
  * @param head  The current head of the linked list
- * @return The number of bytes of data in the linked list
+ * @return The number of buffers in the linked list
  */
 int
 gwbuf_count(GWBUF *head)
 {
-    int result = 0;
-    while (head)
+    if (head == NULL)
     {
-        result++;
-        head = head->next;
+        return 0;
+    }
+    CHK_GWBUF(head);
+#if defined(SS_DEBUG)
+    {
+        GWBUF *ptr = head;
+        unsigned int total = 0;
+
+        while (ptr)
+        {
+            total++;
+            ptr = ptr->next;
+        }
+        ss_dassert(total == head->chcnt);
     }
-    return result;
+#endif
+    return head->chcnt;
 }
 
 /**
@@ -607,6 +1441,7 @@ gwbuf_trim(GWBUF *buf, unsigned int n_bytes)
         return NULL;
     }
     buf->end = (void *)((char *)buf->end - n_bytes);
+    buf->chlen -= n_bytes;
 
     return buf;
 }
@@ -624,14 +1459,24 @@ GWBUF *
 gwbuf_rtrim(GWBUF *head, unsigned int n_bytes)
 {
     GWBUF *rval = head;
+    unsigned int buflen;
+
     CHK_GWBUF(head);
+    buflen = GWBUF_LENGTH(head);
+    head->chlen -= n_bytes > buflen ? buflen : n_bytes;
     GWBUF_RTRIM(head, n_bytes);
     CHK_GWBUF(head);
 
     if (GWBUF_EMPTY(head))
     {
         rval = head->next;
-        gwbuf_free(head);
+        if (head->next)
+        {
+            head->next->tail = head->tail;
+            head->next->chlen = head->chlen;
+            head->next->chcnt = head->chcnt - 1;
+        }
+        gwbuf_free_one(head);
     }
     return rval;
 }
@@ -745,7 +1590,39 @@ static buffer_object_t* gwbuf_remove_buffer_object(GWBUF* buf, buffer_object_t*
 }
 
 /**
- * Add a property to a buffer.
+ * The names of the well known properties, indexed by gwbuf_wkprop_t.
+ * These are stored in the fixed slots of the buffer rather than in the
+ * linked list of named properties.
+ */
+static const char *gwbuf_wkprop_names[GWBUF_PROP_WELLKNOWN_MAX] =
+{
+    "URL"
+};
+
+/**
+ * Map a property name to a well known property slot.
+ *
+ * @param name  The property name
+ * @return The slot index, or -1 if the property is not a well known one
+ */
+static int
+gwbuf_wkprop_id(const char *name)
+{
+    int i;
+
+    for (i = 0; i < GWBUF_PROP_WELLKNOWN_MAX; i++)
+    {
+        if (strcmp(gwbuf_wkprop_names[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Add a property to a buffer. Well known properties go to the fixed
+ * slot of the buffer, anything else to the linked list.
  *
  * @param buf   The buffer to add the property to
  * @param name  The property name
@@ -756,7 +1633,16 @@ int
 gwbuf_add_property(GWBUF *buf, char *name, char *value)
 {
     BUF_PROPERTY *prop;
+    int id;
 
+    if ((id = gwbuf_wkprop_id(name)) >= 0)
+    {
+        spinlock_acquire(&buf->gwbuf_lock);
+        free(buf->wkprops[id]);
+        buf->wkprops[id] = strdup(value);
+        spinlock_release(&buf->gwbuf_lock);
+        return buf->wkprops[id] != NULL;
+    }
     if ((prop = malloc(sizeof(BUF_PROPERTY))) == NULL)
     {
         ss_dassert(prop != NULL);
@@ -774,6 +1660,23 @@ gwbuf_add_property(GWBUF *buf, char *name, char *value)
     return 1;
 }
 
+/**
+ * Return the value of a well known buffer property. The lookup is a
+ * plain array index; the caller names the property with its enum value
+ * so no string comparison is made.
+ *
+ * @param buf   The buffer itself
+ * @param prop  The well known property to return
+ * @return The property value or NULL if the property has not been set.
+ */
+char *
+gwbuf_get_wellknown_property(GWBUF *buf, gwbuf_wkprop_t prop)
+{
+    CHK_GWBUF(buf);
+    ss_dassert(prop >= 0 && prop < GWBUF_PROP_WELLKNOWN_MAX);
+    return buf->wkprops[prop];
+}
+
 /**
  * Return the value of a buffer property
  * @param buf   The buffer itself
@@ -784,7 +1687,12 @@ char *
 gwbuf_get_property(GWBUF *buf, char *name)
 {
     BUF_PROPERTY *prop;
+    int id;
 
+    if ((id = gwbuf_wkprop_id(name)) >= 0)
+    {
+        return buf->wkprops[id];
+    }
     spinlock_acquire(&buf->gwbuf_lock);
     prop = buf->properties;
     while (prop && strcmp(prop->name, name) != 0)
@@ -819,12 +1727,16 @@ gwbuf_make_contiguous(GWBUF *orig)
     }
     if (orig->next == NULL)
     {
+        orig->gwbuf_type |= GWBUF_TYPE_CONTIGUOUS;
         return orig;
     }
 
+    /* A multi-link chain is about to be linearised with a copy */
+    ss_dassert(gwbuf_zero_copy_zone == 0);
+
     if ((newbuf = gwbuf_alloc(gwbuf_length(orig))) != NULL)
     {
-        newbuf->gwbuf_type = orig->gwbuf_type;
+        newbuf->gwbuf_type = orig->gwbuf_type | GWBUF_TYPE_CONTIGUOUS;
         newbuf->hint = hint_dup(orig->hint);
         ptr = GWBUF_DATA(newbuf);
 
@@ -839,6 +1751,106 @@ gwbuf_make_contiguous(GWBUF *orig)
     return newbuf;
 }
 
+/**
+ * Initialise an iterator for reading the data held in a buffer chain.
+ *
+ * The iterator starts at the first unconsumed byte of the chain and
+ * reads across the links of the chain, so the chain need not be made
+ * contiguous before it is examined.
+ *
+ * @param iter  The iterator to initialise
+ * @param buf   The head of the buffer chain
+ */
+void
+gwbuf_iterator_init(GWBUF_ITERATOR *iter, GWBUF *buf)
+{
+    iter->buffer = buf;
+    iter->offset = 0;
+}
+
+/**
+ * Advance an iterator over the data of a buffer chain without copying
+ * the bytes that are skipped.
+ *
+ * @param iter          The iterator to advance
+ * @param nbytes        The number of bytes to skip
+ * @return True if the requested number of bytes were available
+ */
+bool
+gwbuf_iterator_skip(GWBUF_ITERATOR *iter, size_t nbytes)
+{
+    size_t left;
+
+    while (iter->buffer)
+    {
+        left = GWBUF_LENGTH(iter->buffer) - iter->offset;
+        if (nbytes < left)
+        {
+            iter->offset += nbytes;
+            return true;
+        }
+        nbytes -= left;
+        iter->buffer = iter->buffer->next;
+        iter->offset = 0;
+    }
+    return nbytes == 0;
+}
+
+/**
+ * Copy bytes from the current position of an iterator, advancing the
+ * iterator past the bytes that are copied. The copy crosses the links
+ * of the chain as required.
+ *
+ * @param iter          The iterator to read from
+ * @param dest          The destination for the copied bytes
+ * @param nbytes        The number of bytes to copy
+ * @return The number of bytes actually copied, which is less than
+ * nbytes only if the end of the chain was reached
+ */
+size_t
+gwbuf_iterator_copy(GWBUF_ITERATOR *iter, uint8_t *dest, size_t nbytes)
+{
+    size_t copied = 0, left, chunk;
+
+    while (iter->buffer && copied < nbytes)
+    {
+        left = GWBUF_LENGTH(iter->buffer) - iter->offset;
+        chunk = nbytes - copied < left ? nbytes - copied : left;
+        memcpy(dest + copied,
+               (uint8_t *)GWBUF_DATA(iter->buffer) + iter->offset, chunk);
+        copied += chunk;
+        iter->offset += chunk;
+        if (iter->offset == GWBUF_LENGTH(iter->buffer))
+        {
+            iter->buffer = iter->buffer->next;
+            iter->offset = 0;
+        }
+    }
+    return copied;
+}
+
+/**
+ * Copy bytes from an arbitrary offset within a buffer chain.
+ *
+ * This is a convenience wrapper around the buffer iterator for callers
+ * that need a single range of bytes rather than a sequential scan.
+ *
+ * @param buf           The head of the buffer chain
+ * @param offset        Offset from the start of the unconsumed data
+ * @param nbytes        The number of bytes to copy
+ * @param dest          The destination for the copied bytes
+ * @return The number of bytes actually copied
+ */
+size_t
+gwbuf_copy_data(GWBUF *buf, size_t offset, size_t nbytes, uint8_t *dest)
+{
+    GWBUF_ITERATOR iter;
+
+    gwbuf_iterator_init(&iter, buf);
+    gwbuf_iterator_skip(&iter, offset);
+    return gwbuf_iterator_copy(&iter, dest, nbytes);
+}
+
 /**
  * Add hint to a buffer.
  *
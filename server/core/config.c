@@ -45,6 +45,16 @@
  * 20/04/15     Guillaume Lefranc       Added available_when_donor parameter
  * 22/04/15     Martin Brampton         Added disable_master_role_setting parameter
  * 26/01/16     Martin Brampton         Transfer SSL processing to listener
+ * 03/07/16     Mark Riddoch            Retain the applied configuration and
+ *                                      only reprocess the sections that have
+ *                                      changed when the config is reloaded
+ * 03/07/16     Mark Riddoch            Added read_batch_limit parameter for services
+ * 03/07/16     Mark Riddoch            Added thread_group parameter for services
+ * 03/07/16     Mark Riddoch            Added memory_budget global parameter
+ * 03/07/16     Mark Riddoch            Added max_inflight server parameter
+ * 05/07/16     Mark Riddoch            Added expected_sessions, expected_connections
+ *                                      and expected_users capacity hints
+ * 05/07/16     Mark Riddoch            Added accept_threads global parameter
  *
  * @endverbatim
  */
@@ -83,6 +93,8 @@ extern int setipaddress(struct in_addr *, char *);
 static int process_config_context(CONFIG_CONTEXT   *);
 static int process_config_update(CONFIG_CONTEXT *);
 static void free_config_context(CONFIG_CONTEXT      *);
+static CONFIG_CONTEXT *config_context_find(CONFIG_CONTEXT *, const char *);
+static bool config_params_changed(CONFIG_PARAMETER *, CONFIG_PARAMETER *);
 static char *config_get_value(CONFIG_PARAMETER *, const char *);
 static const char *config_get_value_string(CONFIG_PARAMETER *, const char *);
 static int handle_global_item(const char *, const char *);
@@ -92,6 +104,7 @@ static void feedback_defaults();
 static void check_config_objects(CONFIG_CONTEXT *context);
 static int maxscale_getline(char** dest, int* size, FILE* file);
 static SSL_LISTENER *make_ssl_structure(CONFIG_CONTEXT *obj, bool require_cert, int *error_count);
+static int config_parse_affinity(const char *value);
 
 int config_truth_value(char *str);
 int config_get_ifaddr(unsigned char *output);
@@ -105,12 +118,22 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
 int create_new_listener(CONFIG_CONTEXT *obj, bool startnow);
 int create_new_filter(CONFIG_CONTEXT *obj);
 int configure_new_service(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj);
+bool is_normal_server_parameter(const char *param);
 
 static char          *config_file = NULL;
 static GATEWAY_CONF  gateway;
 static FEEDBACK_CONF feedback;
 char                 *version_string = NULL;
 
+/**
+ * The configuration that is currently applied. The parsed context is
+ * retained after it has been processed so that a reload can be diffed
+ * against it; sections whose parameters are unchanged are then left
+ * untouched rather than being reprocessed, and only the sections that
+ * actually differ are applied to the running objects.
+ */
+static CONFIG_CONTEXT *applied_context = NULL;
+
 
 static char *service_params[] =
 {
@@ -122,6 +145,12 @@ static char *service_params[] =
     "passwd",
     "enable_root_user",
     "connection_timeout",
+    "query_timeout",
+    "rate_limit",
+    "rate_limit_burst",
+    "connection_pool_max",
+    "read_batch_limit",
+    "thread_group",
     "auth_all_servers",
     "optimize_wildcard",
     "strip_db_esc",
@@ -190,6 +219,7 @@ static char *server_params[] =
     "monitorpw",
     "persistpoolmax",
     "persistmaxtime",
+    "max_inflight",
     /* The following, or something similar, will be needed for backend SSL
     "ssl_cert",
     "ssl_ca_cert",
@@ -432,9 +462,29 @@ config_load(char *file)
 
     config_file = file;
 
+    if (gateway.writeq_high_water &&
+        gateway.writeq_low_water >= gateway.writeq_high_water)
+    {
+        MXS_WARNING("writeq_low_water (%u) must be less than writeq_high_water "
+                    "(%u), disabling the write queue flow control.",
+                    gateway.writeq_low_water, gateway.writeq_high_water);
+        gateway.writeq_high_water = 0;
+        gateway.writeq_low_water = 0;
+    }
+    else if (gateway.writeq_high_water && gateway.writeq_low_water == 0)
+    {
+        gateway.writeq_low_water = gateway.writeq_high_water / 2;
+    }
+
     check_config_objects(config.next);
     rval = process_config_context(config.next);
-    free_config_context(config.next);
+
+    /* Retain the processed context so that a reload can diff against it */
+    if (applied_context)
+    {
+        free_config_context(applied_context);
+    }
+    applied_context = config.next;
 
     /** Start all monitors */
     if (rval)
@@ -482,7 +532,13 @@ config_reload()
     }
 
     rval = process_config_update(config.next);
-    free_config_context(config.next);
+
+    /* The new context becomes the one the next reload is diffed against */
+    if (applied_context)
+    {
+        free_config_context(applied_context);
+    }
+    applied_context = config.next;
 
     return rval;
 }
@@ -830,6 +886,57 @@ free_config_context(CONFIG_CONTEXT *context)
     }
 }
 
+/**
+ * Find a configuration section by name
+ *
+ * @param context       The configuration data to search
+ * @param name          The section name to look for
+ * @return The section or NULL if it is not present
+ */
+static CONFIG_CONTEXT *
+config_context_find(CONFIG_CONTEXT *context, const char *name)
+{
+    while (context && strcmp(context->object, name) != 0)
+    {
+        context = context->next;
+    }
+    return context;
+}
+
+/**
+ * Compare the parameters of two configuration sections
+ *
+ * The two parameter lists are considered changed if a parameter has been
+ * added, removed or has had its value altered. The order of the parameters
+ * within the section is of no significance.
+ *
+ * @param oldp          The parameters of the currently applied section
+ * @param newp          The parameters of the newly parsed section
+ * @return True if the parameter lists differ
+ */
+static bool
+config_params_changed(CONFIG_PARAMETER *oldp, CONFIG_PARAMETER *newp)
+{
+    CONFIG_PARAMETER *param, *other;
+
+    for (param = newp; param; param = param->next)
+    {
+        other = config_get_param(oldp, param->name);
+        if (other == NULL || strcmp(other->value, param->value) != 0)
+        {
+            return true;
+        }
+    }
+    for (param = oldp; param; param = param->next)
+    {
+        if (config_get_param(newp, param->name) == NULL)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * Return the number of configured threads
  *
@@ -865,6 +972,206 @@ config_pollsleep()
     return gateway.pollsleep;
 }
 
+/**
+ * Return whether each polling thread should use a private epoll instance
+ * with DCBs pinned to a single thread, rather than the shared epoll
+ * descriptor and event queue.
+ *
+ * @return Non-zero if thread local polling is enabled
+ */
+int
+config_thread_local_polls()
+{
+    return gateway.thread_local_polls;
+}
+
+/**
+ * Parse the thread_affinity parameter, a comma separated list of CPU
+ * numbers and ranges, e.g. "0,2-5,12". The parsed CPU list replaces any
+ * previously configured list.
+ *
+ * @param value The parameter value to parse
+ * @return 1 if the value parsed to at least one CPU, 0 on error
+ */
+static int
+config_parse_affinity(const char *value)
+{
+    int  *cpus = NULL;
+    int  n_cpus = 0, size = 0, cpu;
+    char *copy, *token, *dash, *saveptr = NULL;
+
+    if ((copy = strdup(value)) == NULL)
+    {
+        return 0;
+    }
+    token = strtok_r(copy, ", ", &saveptr);
+    while (token)
+    {
+        int first = atoi(token), last = first;
+
+        if ((dash = strchr(token, '-')) != NULL)
+        {
+            last = atoi(dash + 1);
+        }
+        if (first < 0 || last < first || !isdigit(*token))
+        {
+            free(copy);
+            free(cpus);
+            return 0;
+        }
+        for (cpu = first; cpu <= last; cpu++)
+        {
+            if (n_cpus == size)
+            {
+                int *tmp = realloc(cpus, (size + 16) * sizeof(int));
+
+                if (tmp == NULL)
+                {
+                    free(copy);
+                    free(cpus);
+                    return 0;
+                }
+                cpus = tmp;
+                size += 16;
+            }
+            cpus[n_cpus++] = cpu;
+        }
+        token = strtok_r(NULL, ", ", &saveptr);
+    }
+    free(copy);
+    if (n_cpus == 0)
+    {
+        free(cpus);
+        return 0;
+    }
+    free(gateway.thread_affinity);
+    gateway.thread_affinity = cpus;
+    gateway.n_thread_affinity = n_cpus;
+    return 1;
+}
+
+/**
+ * Return the CPU to which the given polling thread should be pinned, or
+ * -1 if no thread affinity has been configured. If more polling threads
+ * are configured than there are CPUs in the affinity list the list is
+ * reused from the start.
+ *
+ * @param thread_id The polling thread number
+ * @return The CPU to bind the thread to or -1 for no binding
+ */
+int
+config_thread_affinity(int thread_id)
+{
+    if (gateway.n_thread_affinity == 0)
+    {
+        return -1;
+    }
+    return gateway.thread_affinity[thread_id % gateway.n_thread_affinity];
+}
+
+/**
+ * Return the number of polling threads that should be dedicated to
+ * accepting and authenticating client connections. Zero if connection
+ * setup is to share the polling threads with query traffic.
+ *
+ * @return The number of accept threads configured
+ */
+int
+config_accept_threads()
+{
+    return gateway.accept_threads;
+}
+
+/**
+ * Return the number of threads to start for offloading SSL handshake
+ * processing from the polling threads. Zero if handshakes are to be
+ * performed inline on the polling threads.
+ *
+ * @return The number of SSL offload threads configured
+ */
+int
+config_ssl_offload_threads()
+{
+    return gateway.ssl_offload_threads;
+}
+
+/**
+ * Return the high water mark, in bytes, above which the flow control
+ * suspends the reads feeding a DCB write queue. Zero if the write queue
+ * flow control is disabled.
+ *
+ * @return The write queue high water mark
+ */
+unsigned int
+config_writeq_high_water()
+{
+    return gateway.writeq_high_water;
+}
+
+/**
+ * Return the low water mark, in bytes, below which a DCB write queue
+ * must drain before suspended reads are resumed.
+ *
+ * @return The write queue low water mark
+ */
+unsigned int
+config_writeq_low_water()
+{
+    return gateway.writeq_low_water;
+}
+
+/**
+ * Return the memory budget, in bytes, above which the periodic check of
+ * memaccount.c applies memory pressure to the caching subsystems. Zero
+ * if no budget has been configured.
+ *
+ * @return The memory budget
+ */
+uint64_t
+config_memory_budget()
+{
+    return gateway.memory_budget;
+}
+
+/**
+ * Return the configured capacity hint for the steady state number of
+ * sessions, used to pre-size the session structures at startup. Zero
+ * if no hint has been configured.
+ *
+ * @return The expected number of sessions
+ */
+int
+config_expected_sessions()
+{
+    return gateway.expected_sessions;
+}
+
+/**
+ * Return the configured capacity hint for the steady state number of
+ * connections, used to pre-size the DCB and buffer pools at startup.
+ * Zero if no hint has been configured.
+ *
+ * @return The expected number of connections
+ */
+int
+config_expected_connections()
+{
+    return gateway.expected_connections;
+}
+
+/**
+ * Return the configured capacity hint for the number of entries in the
+ * user tables, used to size their hashtables. Zero if no hint has been
+ * configured.
+ *
+ * @return The expected number of users
+ */
+int
+config_expected_users()
+{
+    return gateway.expected_users;
+}
+
 /**
  * Return the feedback config data pointer
  *
@@ -941,6 +1248,41 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.pollsleep = atoi(value);
     }
+    else if (strcmp(name, "thread_local_polls") == 0)
+    {
+        gateway.thread_local_polls = config_truth_value((char*)value);
+    }
+    else if (strcmp(name, "thread_affinity") == 0)
+    {
+        if (config_parse_affinity(value) == 0)
+        {
+            MXS_WARNING("Invalid value for 'thread_affinity': %s.", value);
+        }
+    }
+    else if (strcmp(name, "ssl_offload_threads") == 0)
+    {
+        int intval = atoi(value);
+        if (intval >= 0)
+        {
+            gateway.ssl_offload_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'ssl_offload_threads': %s.", value);
+        }
+    }
+    else if (strcmp(name, "accept_threads") == 0)
+    {
+        int intval = atoi(value);
+        if (intval >= 0)
+        {
+            gateway.accept_threads = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'accept_threads': %s.", value);
+        }
+    }
     else if (strcmp(name, "ms_timestamp") == 0)
     {
         mxs_log_set_highprecision_enabled(config_truth_value((char*)value));
@@ -984,6 +1326,84 @@ handle_global_item(const char *name, const char *value)
             MXS_ERROR("Invalid timeout value for 'auth_write_timeout': %s", value);
         }
     }
+    else if (strcmp(name, "writeq_high_water") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.writeq_high_water = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid size value for 'writeq_high_water': %s", value);
+        }
+    }
+    else if (strcmp(name, "writeq_low_water") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.writeq_low_water = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid size value for 'writeq_low_water': %s", value);
+        }
+    }
+    else if (strcmp(name, "memory_budget") == 0)
+    {
+        char* endptr;
+        long long llval = strtoll(value, &endptr, 0);
+        if (*endptr == '\0' && llval >= 0)
+        {
+            gateway.memory_budget = llval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid size value for 'memory_budget': %s", value);
+        }
+    }
+    else if (strcmp(name, "expected_sessions") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.expected_sessions = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'expected_sessions': %s", value);
+        }
+    }
+    else if (strcmp(name, "expected_connections") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.expected_connections = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'expected_connections': %s", value);
+        }
+    }
+    else if (strcmp(name, "expected_users") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.expected_users = intval;
+        }
+        else
+        {
+            MXS_WARNING("Invalid value for 'expected_users': %s", value);
+        }
+    }
     else if (strcmp(name, "query_classifier") == 0)
     {
         int len = strlen(value);
@@ -1216,9 +1636,19 @@ global_defaults()
     gateway.n_threads = DEFAULT_NTHREADS;
     gateway.n_nbpoll = DEFAULT_NBPOLLS;
     gateway.pollsleep = DEFAULT_POLLSLEEP;
+    gateway.thread_local_polls = 0;
+    gateway.thread_affinity = NULL;
+    gateway.n_thread_affinity = 0;
+    gateway.ssl_offload_threads = 0;
+    gateway.accept_threads = 0;
     gateway.auth_conn_timeout = DEFAULT_AUTH_CONNECT_TIMEOUT;
     gateway.auth_read_timeout = DEFAULT_AUTH_READ_TIMEOUT;
     gateway.auth_write_timeout = DEFAULT_AUTH_WRITE_TIMEOUT;
+    gateway.writeq_high_water = 0;
+    gateway.writeq_low_water = 0;
+    gateway.expected_sessions = 0;
+    gateway.expected_connections = 0;
+    gateway.expected_users = 0;
     if (version_string != NULL)
     {
         gateway.version_string = strdup(version_string);
@@ -1299,6 +1729,18 @@ process_config_update(CONFIG_CONTEXT *context)
     while (obj)
     {
         char *type = config_get_value(obj->parameters, "type");
+        CONFIG_CONTEXT *applied = config_context_find(applied_context, obj->object);
+
+        if (applied && !config_params_changed(applied->parameters, obj->parameters))
+        {
+            /*
+             * The section is identical to the one that is already applied,
+             * carry the running object over and leave it untouched.
+             */
+            obj->element = applied->element;
+            obj = obj->next;
+            continue;
+        }
         if (type == NULL)
         {
             MXS_ERROR("Configuration object %s has no type.", obj->object);
@@ -1310,11 +1752,23 @@ process_config_update(CONFIG_CONTEXT *context)
             {
                 if ((service = service_find(obj->object)) != NULL)
                 {
+                    if (strcmp(service->routerModule, router) != 0)
+                    {
+                        MXS_WARNING("The router of service '%s' has changed "
+                                    "from %s to %s, the router of a running "
+                                    "service can not be changed without a "
+                                    "restart.",
+                                    service->name,
+                                    service->routerModule,
+                                    router);
+                    }
+
                     char *user;
                     char *auth;
                     char *enable_root_user;
 
                     char *connection_timeout;
+                    char *connection_pool_max;
 
                     char* auth_all_servers;
                     char* optimize_wildcard;
@@ -1327,6 +1781,12 @@ process_config_update(CONFIG_CONTEXT *context)
                     enable_root_user = config_get_value(obj->parameters, "enable_root_user");
 
                     connection_timeout = config_get_value(obj->parameters, "connection_timeout");
+                    char *query_timeout = config_get_value(obj->parameters, "query_timeout");
+                    char *rate_limit = config_get_value(obj->parameters, "rate_limit");
+                    char *rate_limit_burst = config_get_value(obj->parameters, "rate_limit_burst");
+                    connection_pool_max = config_get_value(obj->parameters, "connection_pool_max");
+                    char *read_batch_limit = config_get_value(obj->parameters, "read_batch_limit");
+                    char *thread_group = config_get_value(obj->parameters, "thread_group");
                     user = config_get_value(obj->parameters, "user");
                     auth = config_get_value(obj->parameters, "passwd");
 
@@ -1365,6 +1825,12 @@ process_config_update(CONFIG_CONTEXT *context)
                         service->version_string = strdup(version_string);
                     }
 
+                    char *weightby = config_get_value(obj->parameters, "weightby");
+                    if (weightby)
+                    {
+                        serviceWeightBy(service, weightby);
+                    }
+
                     if (user && auth)
                     {
                         service_update(service, router, user, auth);
@@ -1378,6 +1844,47 @@ process_config_update(CONFIG_CONTEXT *context)
                             serviceSetTimeout(service, config_truth_value(connection_timeout));
                         }
 
+                        if (query_timeout)
+                        {
+                            serviceSetQueryTimeout(service, atoi(query_timeout));
+                        }
+
+                        if (rate_limit)
+                        {
+                            serviceSetRateLimit(service, atoi(rate_limit),
+                                                rate_limit_burst ?
+                                                atoi(rate_limit_burst) : 0);
+                        }
+
+                        if (connection_pool_max)
+                        {
+                            serviceSetConnectionPoolMax(service, atoi(connection_pool_max));
+                        }
+
+                        if (read_batch_limit)
+                        {
+                            serviceSetReadBatchLimit(service, atoi(read_batch_limit));
+                        }
+
+                        if (thread_group)
+                        {
+                            int first = -1;
+                            int last = -1;
+
+                            if (sscanf(thread_group, "%d-%d", &first, &last) == 1)
+                            {
+                                last = first;
+                            }
+                            if (!serviceSetThreadGroup(service, first, last))
+                            {
+                                MXS_ERROR("Invalid value '%s' for parameter "
+                                          "'thread_group' in service '%s'. Expected "
+                                          "a polling thread number or an inclusive "
+                                          "range, e.g. 0-3.",
+                                          thread_group, obj->object);
+                            }
+                        }
+
                         if (auth_all_servers)
                         {
                             serviceAuthAllServers(service, config_truth_value(auth_all_servers));
@@ -1508,11 +2015,32 @@ process_config_update(CONFIG_CONTEXT *context)
                 char *protocol = config_get_value(obj->parameters, "protocol");
                 char *monuser = config_get_value(obj->parameters, "monuser");
                 char *monpw = config_get_value(obj->parameters, "monpw");
+                CONFIG_PARAMETER *params = obj->parameters;
+
                 server_update(server, protocol, monuser, monpw);
+
+                /*
+                 * Update the routing weight parameters of the server in
+                 * place, new routing decisions will use the new values.
+                 */
+                while (params)
+                {
+                    if (!is_normal_server_parameter(params->name))
+                    {
+                        server_update_parameter(server, params->name,
+                                                params->value);
+                    }
+                    params = params->next;
+                }
                 obj->element = server;
             }
             else
             {
+                /*
+                 * The address or port of the server has changed, this is
+                 * a new server as far as the monitors and services are
+                 * concerned and it must be created afresh.
+                 */
                 create_new_server(obj);
             }
         }
@@ -1527,6 +2055,13 @@ process_config_update(CONFIG_CONTEXT *context)
     while (obj)
     {
         char *type = config_get_value(obj->parameters, "type");
+        CONFIG_CONTEXT *applied = config_context_find(applied_context, obj->object);
+
+        if (applied && !config_params_changed(applied->parameters, obj->parameters))
+        {
+            obj = obj->next;
+            continue;
+        }
         if (type == NULL)
         {
             ;
@@ -2249,6 +2784,52 @@ int create_new_service(CONFIG_CONTEXT *obj)
         serviceSetTimeout(obj->element, atoi(connection_timeout));
     }
 
+    char *query_timeout = config_get_value(obj->parameters, "query_timeout");
+    if (query_timeout)
+    {
+        serviceSetQueryTimeout(obj->element, atoi(query_timeout));
+    }
+
+    char *rate_limit = config_get_value(obj->parameters, "rate_limit");
+    if (rate_limit)
+    {
+        char *rate_limit_burst = config_get_value(obj->parameters, "rate_limit_burst");
+
+        serviceSetRateLimit(obj->element, atoi(rate_limit),
+                            rate_limit_burst ? atoi(rate_limit_burst) : 0);
+    }
+
+    char *connection_pool_max = config_get_value(obj->parameters, "connection_pool_max");
+    if (connection_pool_max)
+    {
+        serviceSetConnectionPoolMax(obj->element, atoi(connection_pool_max));
+    }
+
+    char *read_batch_limit = config_get_value(obj->parameters, "read_batch_limit");
+    if (read_batch_limit)
+    {
+        serviceSetReadBatchLimit(obj->element, atoi(read_batch_limit));
+    }
+
+    char *thread_group = config_get_value(obj->parameters, "thread_group");
+    if (thread_group)
+    {
+        int first = -1;
+        int last = -1;
+
+        if (sscanf(thread_group, "%d-%d", &first, &last) == 1)
+        {
+            last = first;
+        }
+        if (!serviceSetThreadGroup(obj->element, first, last))
+        {
+            MXS_ERROR("Invalid value '%s' for parameter 'thread_group' "
+                      "in service '%s'. Expected a polling thread number "
+                      "or an inclusive range, e.g. 0-3.",
+                      thread_group, obj->object);
+        }
+    }
+
     char *auth_all_servers = config_get_value(obj->parameters, "auth_all_servers");
     if (auth_all_servers)
     {
@@ -2531,6 +3112,18 @@ int create_new_server(CONFIG_CONTEXT *obj)
             }
         }
 
+        const char *inflight = config_get_value_string(obj->parameters, "max_inflight");
+        if (inflight)
+        {
+            server->max_inflight = strtol(inflight, &endptr, 0);
+            if (*endptr != '\0' || server->max_inflight < 0)
+            {
+                MXS_ERROR("Invalid value for 'max_inflight' for server %s: %s",
+                          server->unique_name, inflight);
+                server->max_inflight = 0;
+            }
+        }
+
         CONFIG_PARAMETER *params = obj->parameters;
 
         server->server_ssl = make_ssl_structure(obj, false, &error_count);
@@ -2569,7 +3162,8 @@ int configure_new_service(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj)
         if (servers)
         {
             char *lasts;
-            char *s = strtok_r(servers, ",", &lasts);
+            char *scopy = strdup(servers);
+            char *s = strtok_r(scopy, ",", &lasts);
             while (s)
             {
                 CONFIG_CONTEXT *obj1 = context;
@@ -2579,7 +3173,10 @@ int configure_new_service(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj)
                     if (strcmp(trim(s), obj1->object) == 0 && obj1->element)
                     {
                         found = 1;
-                        serviceAddBackend(service, obj1->element);
+                        if (!serviceHasBackend(service, obj1->element))
+                        {
+                            serviceAddBackend(service, obj1->element);
+                        }
                     }
                     obj1 = obj1->next;
                 }
@@ -2592,6 +3189,7 @@ int configure_new_service(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj)
                 }
                 s = strtok_r(NULL, ",", &lasts);
             }
+            free(scopy);
         }
         else if (servers == NULL && !is_internal_service(router))
         {
@@ -2603,20 +3201,25 @@ int configure_new_service(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj)
         if (roptions)
         {
             char *lasts;
-            char *s = strtok_r(roptions, ",", &lasts);
+            char *rcopy = strdup(roptions);
+            char *s = strtok_r(rcopy, ",", &lasts);
+            serviceClearRouterOptions(service);
             while (s)
             {
                 serviceAddRouterOption(service, s);
                 s = strtok_r(NULL, ",", &lasts);
             }
+            free(rcopy);
         }
 
         if (filters)
         {
-            if (!serviceSetFilters(service, filters))
+            char *fcopy = strdup(filters);
+            if (!serviceSetFilters(service, fcopy))
             {
                 error_count++;
             }
+            free(fcopy);
         }
     }
 
@@ -2705,7 +3308,8 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
 
         /* get the servers to monitor */
         char *s, *lasts;
-        s = strtok_r(servers, ",", &lasts);
+        char *scopy = strdup(servers);
+        s = strtok_r(scopy, ",", &lasts);
         while (s)
         {
             CONFIG_CONTEXT *obj1 = context;
@@ -2734,6 +3338,7 @@ int create_new_monitor(CONFIG_CONTEXT *context, CONFIG_CONTEXT *obj, HASHTABLE*
 
             s = strtok_r(NULL, ",", &lasts);
         }
+        free(scopy);
 
         char *user = config_get_value(obj->parameters, "user");
         char *passwd = config_get_value(obj->parameters, "passwd");
@@ -2854,12 +3459,14 @@ int create_new_filter(CONFIG_CONTEXT *obj)
             if (options)
             {
                 char *lasts;
-                char *s = strtok_r(options, ",", &lasts);
+                char *ocopy = strdup(options);
+                char *s = strtok_r(ocopy, ",", &lasts);
                 while (s)
                 {
                     filterAddOption(obj->element, s);
                     s = strtok_r(NULL, ",", &lasts);
                 }
+                free(ocopy);
             }
 
             CONFIG_PARAMETER *params = obj->parameters;
@@ -35,6 +35,16 @@
  * 03/10/14     Massimiliano Pinto  Added netmask to user@host authentication for wildcard in IPv4 hosts
  * 13/10/14     Massimiliano Pinto  Added (user@host)@db authentication
  * 04/12/14     Massimiliano Pinto  Added support for IPv$ wildcard hosts: a.%, a.%.% and a.b.%
+ * 10/05/16     Mark Riddoch        Refresh users incrementally by diffing against
+ *                                  the live table instead of replacing it
+ * 03/07/16     Mark Riddoch        Bump the service users_version when a reload
+ *                                  changes the table
+ * 03/07/16     Mark Riddoch        Share freshly loaded user data between
+ *                                  services with the same backends
+ * 03/07/16     Mark Riddoch        Wildcard host entries indexed by user name
+ *                                  so authentication needs two lookups at most
+ * 05/07/16     Mark Riddoch        Hashtable sized from the expected_users
+ *                                  capacity hint when one is configured
  *
  * @endverbatim
  */
@@ -53,6 +63,11 @@
 #include <mysql_client_server_protocol.h>
 #include <mysqld_error.h>
 #include <regex.h>
+#include <time.h>
+#include <unistd.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <maxconfig.h>
 
 /** Don't include the root user */
 #define USERS_QUERY_NO_ROOT " AND user.user NOT IN ('root')"
@@ -121,6 +136,10 @@ static int dbusers_valuewrite(int fd, void *value);
 static int get_all_users(SERVICE *service, USERS *users);
 static int get_databases(SERVICE *, MYSQL *);
 static int get_users(SERVICE *service, USERS *users);
+static int get_users_from_backend(SERVICE *service, USERS *users);
+static char *user_load_key(SERVICE *service);
+static int users_copy(USERS *to, USERS *from);
+static HASHTABLE *resource_copy(HASHTABLE *from);
 static MYSQL *gw_mysql_init(void);
 static int gw_mysql_set_timeouts(MYSQL* handle);
 static bool host_has_singlechar_wildcard(const char *host);
@@ -136,6 +155,8 @@ static void resource_free(HASHTABLE *resource);
 static int uh_cmpfun(void* v1, void* v2);
 static int uh_hfun(void* key);
 static void *uh_keydup(void* key);
+static void mysql_users_index_add(USERS *users, MYSQL_USER_HOST *key, char *auth);
+static void mysql_users_index_remove(USERS *users, MYSQL_USER_HOST *key);
 static void uh_keyfree(void* key);
 static int wildcard_db_grant(char* str);
 
@@ -278,9 +299,94 @@ reload_mysql_users(SERVICE *service)
 }
 
 /**
- * Replace the user/passwd form mysql.user table into the service users' hashtable
- * environment.
- * The replacement is succesful only if the users' table checksums differ
+ * Apply the difference between a freshly loaded users' table and the live
+ * one to the live table. Entries that are new or whose authentication data
+ * has changed are replaced and entries that no longer exist are removed;
+ * unchanged entries, normally the vast majority, are not touched at all.
+ *
+ * Each hashtable operation takes the table lock individually, so
+ * authentication against the live table proceeds throughout the refresh
+ * instead of stalling while thousands of entries are rebuilt and freed.
+ *
+ * @param to    The live users' table
+ * @param from  The newly loaded users' table
+ * @return      The number of entries changed or -1 on error
+ */
+static int
+users_apply_diff(USERS *to, USERS *from)
+{
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+    MYSQL_USER_HOST **doomed;
+    char *newval, *oldval;
+    int changed = 0;
+    int n_doomed = 0;
+    int i;
+
+    /* Add the new entries and replace the changed ones */
+    if ((iter = hashtable_iterator(from->data)) == NULL)
+    {
+        return -1;
+    }
+    while ((key = (MYSQL_USER_HOST *)hashtable_next(iter)) != NULL)
+    {
+        newval = hashtable_fetch(from->data, key);
+        oldval = hashtable_fetch(to->data, key);
+        if (oldval == NULL || strcmp(oldval, newval) != 0)
+        {
+            if (oldval)
+            {
+                atomic_add(&to->stats.n_deletes, 1);
+                mysql_users_index_remove(to, key);
+                atomic_add(&to->stats.n_entries,
+                           -hashtable_delete(to->data, key));
+            }
+            changed += mysql_users_add(to, key, newval);
+        }
+    }
+    hashtable_iterator_free(iter);
+
+    /*
+     * Collect the entries that have been removed. The deletions are done
+     * after the iteration as deleting entries would disturb the iterator.
+     */
+    if ((doomed = malloc((to->stats.n_entries + 1) * sizeof(MYSQL_USER_HOST *))) == NULL)
+    {
+        return -1;
+    }
+    if ((iter = hashtable_iterator(to->data)) == NULL)
+    {
+        free(doomed);
+        return -1;
+    }
+    while ((key = (MYSQL_USER_HOST *)hashtable_next(iter)) != NULL)
+    {
+        if (hashtable_fetch(from->data, key) == NULL)
+        {
+            doomed[n_doomed++] = key;
+        }
+    }
+    hashtable_iterator_free(iter);
+
+    for (i = 0; i < n_doomed; i++)
+    {
+        atomic_add(&to->stats.n_deletes, 1);
+        mysql_users_index_remove(to, doomed[i]);
+        atomic_add(&to->stats.n_entries,
+                   -hashtable_delete(to->data, doomed[i]));
+        changed++;
+    }
+    free(doomed);
+
+    return changed;
+}
+
+/**
+ * Refresh the user/passwd from the mysql.user table into the service
+ * users' hashtable environment.
+ * The refresh happens only if the users' table checksums differ. The first
+ * load publishes a new table pointer; subsequent refreshes diff the new
+ * data against the live table and apply only the changed entries.
  *
  * @param service   The current service
  * @return      -1 on any error or the number of users inserted (0 means no users at all)
@@ -324,25 +430,55 @@ replace_mysql_users(SERVICE *service)
         /* free the new table */
         users_free(newusers);
         i = 0;
+
+        /* free old resources */
+        resource_free(oldresources);
+
+        spinlock_release(&service->spin);
+
+        return i;
     }
-    else
+
+    if (oldusers == NULL)
     {
-        /* replace the service with effective new data */
-        MXS_DEBUG("%lu [replace_mysql_users] users' tables replaced, checksum differs",
-                  pthread_self());
+        /* first load, atomically publish the new table */
         service->users = newusers;
-    }
+        atomic_add(&service->users_version, 1);
 
-    /* free old resources */
-    resource_free(oldresources);
+        /* free old resources */
+        resource_free(oldresources);
 
+        spinlock_release(&service->spin);
+
+        return i;
+    }
     spinlock_release(&service->spin);
 
-    if (i && oldusers)
+    /*
+     * Apply only the changed entries to the live table; authentication
+     * carries on against it while the diff is applied entry by entry.
+     */
+    int changed = users_apply_diff(oldusers, newusers);
+
+    MXS_DEBUG("%lu [replace_mysql_users] users' tables refreshed, %d entries changed",
+              pthread_self(), changed);
+
+    if (changed >= 0)
     {
-        /* free the old table */
-        users_free(oldusers);
+        /* Leave the old checksum in place on error so that the
+         * next refresh tries the diff again. */
+        memcpy(oldusers->cksum, newusers->cksum, SHA_DIGEST_LENGTH);
     }
+    if (changed > 0)
+    {
+        /* Invalidate authentication data cached against the old table */
+        atomic_add(&service->users_version, 1);
+    }
+
+    users_free(newusers);
+
+    /* free old resources */
+    resource_free(oldresources);
 
     return i;
 }
@@ -1237,8 +1373,140 @@ cleanup:
 }
 
 /**
- * Load the user/passwd form mysql.user table into the service users' hashtable
- * environment.
+ * The cache of recently loaded user data.
+ *
+ * When several services point at the same set of backend servers with the
+ * same credentials, each used to run its own round of user loading queries
+ * against the master at startup and on every refresh. The result of each
+ * backend load is instead kept here for a short period, keyed on the
+ * backend set and the credentials, and services arriving within that
+ * period take a copy of the cached tables rather than querying the
+ * backend again. A service that finds another service's load of the same
+ * key in progress waits for that load instead of starting its own, so
+ * concurrently starting services do not stampede the master either.
+ *
+ * The entries themselves are never freed, only their contents replaced;
+ * the number of distinct backend set and credential combinations is
+ * small and bounded by the configuration.
+ */
+typedef struct user_load_entry
+{
+    char        *key;           /*< The backend set and credentials */
+    USERS       *users;         /*< Private copy of the loaded users' table */
+    HASHTABLE   *resources;     /*< Private copy of the database grants */
+    int         wildcard_match; /*< The localhost_match_wildcard_host setting
+                                 *  determined during the load */
+    int         result;         /*< The return value of the load */
+    int         loading;        /*< Non-zero while a load is in progress */
+    time_t      created;        /*< When the load completed */
+    struct user_load_entry *next;
+} USER_LOAD_ENTRY;
+
+/** The number of seconds for which a backend load may be shared */
+#define USER_LOAD_TTL   30
+
+static USER_LOAD_ENTRY *user_load_cache = NULL;
+static SPINLOCK user_load_lock = SPINLOCK_INIT;
+
+/**
+ * Build the user data cache key of a service: the name and port of every
+ * backend server followed by the credentials and the option settings
+ * that change the result of the load.
+ *
+ * @param service   The service to build the key for
+ * @return The malloc'd key or NULL on error
+ */
+static char *
+user_load_key(SERVICE *service)
+{
+    SERVER_REF *ref;
+    char *key, *ptr, *user = NULL, *passwd = NULL;
+    int len = 0;
+
+    if (serviceGetUser(service, &user, &passwd) == 0)
+    {
+        return NULL;
+    }
+    for (ref = service->dbref; ref; ref = ref->next)
+    {
+        len += strlen(ref->server->name) + 8;
+    }
+    len += strlen(user) + strlen(passwd) + 8;
+    if ((key = (char *)malloc(len + 1)) == NULL)
+    {
+        return NULL;
+    }
+    ptr = key;
+    for (ref = service->dbref; ref; ref = ref->next)
+    {
+        ptr += sprintf(ptr, "%s:%d;", ref->server->name, ref->server->port);
+    }
+    sprintf(ptr, "%s:%s:%d:%d", user, passwd,
+            service->enable_root, service->users_from_all);
+    return key;
+}
+
+/**
+ * Copy the entries of one users' table into another, including the
+ * checksum so that a subsequent refresh diffs against the right data.
+ *
+ * @param to    The table to copy into
+ * @param from  The table to copy from
+ * @return The number of entries copied or -1 on error
+ */
+static int
+users_copy(USERS *to, USERS *from)
+{
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+    int count = 0;
+
+    if ((iter = hashtable_iterator(from->data)) == NULL)
+    {
+        return -1;
+    }
+    while ((key = (MYSQL_USER_HOST *)hashtable_next(iter)) != NULL)
+    {
+        count += mysql_users_add(to, key, hashtable_fetch(from->data, key));
+    }
+    hashtable_iterator_free(iter);
+    memcpy(to->cksum, from->cksum, SHA_DIGEST_LENGTH);
+    return count;
+}
+
+/**
+ * Copy a database resources hashtable
+ *
+ * @param from  The hashtable to copy, may be NULL
+ * @return The copy or NULL if there was nothing to copy
+ */
+static HASHTABLE *
+resource_copy(HASHTABLE *from)
+{
+    HASHITERATOR *iter;
+    HASHTABLE *to;
+    char *key;
+
+    if (from == NULL || (to = resource_alloc()) == NULL)
+    {
+        return NULL;
+    }
+    if ((iter = hashtable_iterator(from)) == NULL)
+    {
+        resource_free(to);
+        return NULL;
+    }
+    while ((key = (char *)hashtable_next(iter)) != NULL)
+    {
+        resource_add(to, key, hashtable_fetch(from, key));
+    }
+    hashtable_iterator_free(iter);
+    return to;
+}
+
+/**
+ * Load the user data of a service, sharing the result of a recent backend
+ * load of the same backend set and credentials when one is available.
  *
  * @param service   The current service
  * @param users     The users table into which to load the users
@@ -1246,6 +1514,120 @@ cleanup:
  */
 static int
 get_users(SERVICE *service, USERS *users)
+{
+    USER_LOAD_ENTRY *entry;
+    char *key;
+    int rval;
+
+    if ((key = user_load_key(service)) == NULL)
+    {
+        return get_users_from_backend(service, users);
+    }
+
+    spinlock_acquire(&user_load_lock);
+    for (;;)
+    {
+        entry = user_load_cache;
+        while (entry && strcmp(entry->key, key) != 0)
+        {
+            entry = entry->next;
+        }
+        if (entry == NULL)
+        {
+            if ((entry = (USER_LOAD_ENTRY *)calloc(1, sizeof(USER_LOAD_ENTRY))) == NULL)
+            {
+                spinlock_release(&user_load_lock);
+                free(key);
+                return get_users_from_backend(service, users);
+            }
+            entry->key = key;
+            key = NULL;
+            entry->loading = 1;
+            entry->next = user_load_cache;
+            user_load_cache = entry;
+            break;
+        }
+        if (entry->loading)
+        {
+            /* Another service is loading the same data; wait for it
+             * rather than running a second round of queries */
+            spinlock_release(&user_load_lock);
+            while (entry->loading)
+            {
+                usleep(1000);
+            }
+            spinlock_acquire(&user_load_lock);
+            continue;
+        }
+        if (entry->users && time(NULL) - entry->created <= USER_LOAD_TTL &&
+            (rval = users_copy(users, entry->users)) >= 0)
+        {
+            service->resources = resource_copy(entry->resources);
+            service->localhost_match_wildcard_host = entry->wildcard_match;
+            rval = entry->result;
+            spinlock_release(&user_load_lock);
+            free(key);
+            MXS_DEBUG("%lu [get_users] Service %s reused the user data "
+                      "loaded for the same backends",
+                      pthread_self(), service->name);
+            return rval;
+        }
+        /* The cached data is stale, this service reloads it */
+        entry->loading = 1;
+        break;
+    }
+    spinlock_release(&user_load_lock);
+    free(key);
+
+    rval = get_users_from_backend(service, users);
+
+    spinlock_acquire(&user_load_lock);
+    if (rval > 0)
+    {
+        USERS *copy;
+
+        if (entry->users)
+        {
+            users_free(entry->users);
+            entry->users = NULL;
+        }
+        if (entry->resources)
+        {
+            resource_free(entry->resources);
+            entry->resources = NULL;
+        }
+        if ((copy = mysql_users_alloc()) != NULL)
+        {
+            if (users_copy(copy, users) >= 0)
+            {
+                entry->users = copy;
+                entry->resources = resource_copy(service->resources);
+                entry->wildcard_match = service->localhost_match_wildcard_host;
+                entry->result = rval;
+                entry->created = time(NULL);
+            }
+            else
+            {
+                users_free(copy);
+            }
+        }
+    }
+    entry->loading = 0;
+    spinlock_release(&user_load_lock);
+
+    return rval;
+}
+
+/**
+ * Load the user/passwd form mysql.user table into the service users' hashtable
+ * environment by querying one of the backend databases.
+ *
+ * @param service   The current service
+ * @param users     The users table into which to load the users
+ * @return          -1 on any error or the number of users inserted
+ */
+static int
+get_users_from_backend(SERVICE *service, USERS *users)
 {
     MYSQL *con = NULL;
     MYSQL_ROW row;
@@ -1711,6 +2093,230 @@ get_users(SERVICE *service, USERS *users)
     return total_users;
 }
 
+/**
+ * The wildcard host index
+ *
+ * User entries that can only match through a wildcard - a netmask below
+ * 32 or a hostname pattern - cannot be found with a single hashtable
+ * probe, as the probing key must be synthesized for every mask in turn.
+ * The index gathers these entries into a list per user name, so that
+ * authentication makes at most two lookups: one probe with the exact
+ * client address and one fetch of the wildcard list of the user, which
+ * rarely holds more than a handful of entries.
+ */
+typedef struct mysql_wildcard_entry
+{
+    MYSQL_USER_HOST *key;       /*< Copy of the user@host entry key */
+    char            *auth;      /*< Copy of the authentication data */
+    struct mysql_wildcard_entry *next;
+} MYSQL_WILDCARD_ENTRY;
+
+typedef struct
+{
+    SPINLOCK              lock; /*< Protects the list against reloads */
+    MYSQL_WILDCARD_ENTRY *head; /*< The wildcard entries of one user */
+} MYSQL_WILDCARD_LIST;
+
+/**
+ * Free a wildcard list and the entries it holds; the value free function
+ * of the wildcard index hashtable.
+ *
+ * @param value The wildcard list being removed from the index
+ * @return Always NULL
+ */
+static void *
+mysql_wildcard_list_free(void *value)
+{
+    MYSQL_WILDCARD_LIST *list = (MYSQL_WILDCARD_LIST *)value;
+    MYSQL_WILDCARD_ENTRY *entry;
+
+    while ((entry = list->head) != NULL)
+    {
+        list->head = entry->next;
+        uh_keyfree(entry->key);
+        free(entry->auth);
+        free(entry);
+    }
+    free(list);
+    return NULL;
+}
+
+/**
+ * Check whether a user entry must be tracked in the wildcard index.
+ *
+ * @param key The entry key
+ * @return True for wildcard entries
+ */
+static bool
+mysql_users_key_is_wildcard(MYSQL_USER_HOST *key)
+{
+    return key->netmask < 32 || key->hostname[0] != '\0';
+}
+
+/**
+ * Add a wildcard entry to the index of the users table.
+ *
+ * @param users The users table
+ * @param key   The entry key
+ * @param auth  The authentication data of the entry
+ */
+static void
+mysql_users_index_add(USERS *users, MYSQL_USER_HOST *key, char *auth)
+{
+    MYSQL_WILDCARD_LIST *list;
+    MYSQL_WILDCARD_ENTRY *entry;
+
+    if (users->wildcards == NULL || !mysql_users_key_is_wildcard(key))
+    {
+        return;
+    }
+    if ((list = hashtable_fetch(users->wildcards, key->user)) == NULL)
+    {
+        if ((list = calloc(1, sizeof(MYSQL_WILDCARD_LIST))) == NULL)
+        {
+            return;
+        }
+        spinlock_init(&list->lock);
+        if (hashtable_add(users->wildcards, key->user, list) == 0)
+        {
+            free(list);
+            return;
+        }
+    }
+    if ((entry = calloc(1, sizeof(MYSQL_WILDCARD_ENTRY))) == NULL)
+    {
+        return;
+    }
+    if ((entry->key = uh_keydup(key)) == NULL)
+    {
+        free(entry);
+        return;
+    }
+    entry->auth = auth ? strdup(auth) : NULL;
+    spinlock_acquire(&list->lock);
+    entry->next = list->head;
+    list->head = entry;
+    spinlock_release(&list->lock);
+}
+
+/**
+ * Remove a wildcard entry from the index of the users table. Called when
+ * a reload deletes or replaces an entry of the live table.
+ *
+ * @param users The users table
+ * @param key   The key of the entry being deleted
+ */
+static void
+mysql_users_index_remove(USERS *users, MYSQL_USER_HOST *key)
+{
+    MYSQL_WILDCARD_LIST *list;
+    MYSQL_WILDCARD_ENTRY **ptr, *entry;
+
+    if (users->wildcards == NULL || !mysql_users_key_is_wildcard(key))
+    {
+        return;
+    }
+    if ((list = hashtable_fetch(users->wildcards, key->user)) == NULL)
+    {
+        return;
+    }
+    spinlock_acquire(&list->lock);
+    ptr = &list->head;
+    while ((entry = *ptr) != NULL)
+    {
+        if (entry->key->netmask == key->netmask &&
+            entry->key->ipv4.sin_addr.s_addr == key->ipv4.sin_addr.s_addr &&
+            strcmp(entry->key->hostname, key->hostname) == 0 &&
+            ((entry->key->resource == NULL && key->resource == NULL) ||
+             (entry->key->resource && key->resource &&
+              strcmp(entry->key->resource, key->resource) == 0)))
+        {
+            *ptr = entry->next;
+            uh_keyfree(entry->key);
+            free(entry->auth);
+            free(entry);
+            break;
+        }
+        ptr = &entry->next;
+    }
+    spinlock_release(&list->lock);
+}
+
+/**
+ * Match a probing key against a wildcard entry. The probe carries the
+ * exact client address; it is masked here with the netmask of the stored
+ * entry so that uh_cmpfun applies the same matching rules - including
+ * the hostname patterns and the database grants - as a direct probe of
+ * the users table would.
+ *
+ * @param probe  The key built from the client connection
+ * @param stored The stored wildcard entry key
+ * @return 0 on a match, like uh_cmpfun
+ */
+static int
+uh_wildcard_cmp(MYSQL_USER_HOST *probe, MYSQL_USER_HOST *stored)
+{
+    MYSQL_USER_HOST masked = *probe;
+
+    switch (stored->netmask)
+    {
+    case 24:
+        masked.ipv4.sin_addr.s_addr &= 0x00FFFFFF;
+        break;
+    case 16:
+        masked.ipv4.sin_addr.s_addr &= 0x0000FFFF;
+        break;
+    case 8:
+        masked.ipv4.sin_addr.s_addr &= 0x000000FF;
+        break;
+    case 0:
+        masked.ipv4.sin_addr.s_addr = 0;
+        break;
+    default:
+        break;
+    }
+    return uh_cmpfun(&masked, stored);
+}
+
+/**
+ * Fetch the authentication data of a user through the wildcard host
+ * index. Tried when the probe with the exact client address found
+ * nothing; the wildcard entries of the user are walked once instead of
+ * re-probing the table with every masked address in turn.
+ *
+ * @param users The MySQL users table
+ * @param key   The key with the exact client address
+ * @return The authentication data or NULL when nothing matches
+ */
+char *
+mysql_users_fetch_wildcard(USERS *users, MYSQL_USER_HOST *key)
+{
+    MYSQL_WILDCARD_LIST *list;
+    MYSQL_WILDCARD_ENTRY *entry;
+    char *rval = NULL;
+
+    if (users->wildcards == NULL || key == NULL || key->user == NULL)
+    {
+        return NULL;
+    }
+    atomic_add(&users->stats.n_fetches, 1);
+    if ((list = hashtable_fetch(users->wildcards, key->user)) == NULL)
+    {
+        return NULL;
+    }
+    spinlock_acquire(&list->lock);
+    for (entry = list->head; entry; entry = entry->next)
+    {
+        if (uh_wildcard_cmp(key, entry->key) == 0)
+        {
+            rval = entry->auth;
+            break;
+        }
+    }
+    spinlock_release(&list->lock);
+    return rval;
+}
+
 /**
  * Allocate a new MySQL users table for mysql specific users@host as key
  *
@@ -1720,13 +2326,21 @@ USERS *
 mysql_users_alloc()
 {
     USERS *rval;
+    int   hashsize = USERS_HASHTABLE_DEFAULT_SIZE;
+
+    /* Size the table for the expected user population when the
+     * expected_users capacity hint has been configured. */
+    if (config_expected_users() > hashsize)
+    {
+        hashsize = config_expected_users();
+    }
 
     if ((rval = calloc(1, sizeof(USERS))) == NULL)
     {
         return NULL;
     }
 
-    if ((rval->data = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, uh_hfun,
+    if ((rval->data = hashtable_alloc(hashsize, uh_hfun,
                                       uh_cmpfun)) == NULL)
     {
         free(rval);
@@ -1743,6 +2357,15 @@ mysql_users_alloc()
                          (HASHMEMORYFN) strdup, (HASHMEMORYFN) uh_keyfree,
                          (HASHMEMORYFN) free);
 
+    if ((rval->wildcards = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE,
+                                           (int (*)(void *))simple_str_hash,
+                                           (int (*)(void *, void *))strcmp)) != NULL)
+    {
+        hashtable_memory_fns(rval->wildcards, (HASHMEMORYFN) strdup, NULL,
+                             (HASHMEMORYFN) free,
+                             (HASHMEMORYFN) mysql_wildcard_list_free);
+    }
+
     return rval;
 }
 
@@ -1768,6 +2391,11 @@ mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth)
     add = hashtable_add(users->data, key, auth);
     atomic_add(&users->stats.n_entries, add);
 
+    if (add)
+    {
+        mysql_users_index_add(users, key, auth);
+    }
+
     return add;
 }
 
@@ -63,6 +63,32 @@
  *                                      enhance SSL code
  * 07/02/2016   Martin Brampton         Make dcb_read_SSL & dcb_create_SSL internal,
  *                                      further small SSL logic changes
+ * 19/04/2016   Mark Riddoch            Gather the write queue into a single
+ *                                      writev call when draining
+ * 02/06/2016   Mark Riddoch            Persistent connections scoped by service
+ *                                      and bounded by the service pool size
+ * 20/06/2016   Mark Riddoch            Recycle DCB and protocol objects on
+ *                                      per-thread free lists
+ * 28/06/2016   Mark Riddoch            Write queue high/low water flow control
+ * 29/06/2016   Mark Riddoch            Backend response times recorded in the
+ *                                      server histogram
+ * 02/07/2016   Mark Riddoch            Replace the zombie bitmask mechanism with
+ *                                      epoch based reclamation
+ * 03/07/2016   Mark Riddoch            Coalesce the writes made while an event
+ *                                      handler is on the stack into one flush
+ * 03/07/2016   Mark Riddoch            Replace the list of all DCBs with a flat
+ *                                      table sized from the descriptor limit
+ * 03/07/2016   Mark Riddoch            Reads land in a receive buffer retained
+ *                                      on the DCB, upstream gets zero-copy views
+ * 03/07/2016   Mark Riddoch            Report heap allocations to the memory
+ *                                      accounting of memaccount.c
+ * 05/07/2016   Mark Riddoch            Count the bytes read and written on
+ *                                      each descriptor
+ * 05/07/2016   Mark Riddoch            Zombie stack sharded by owning thread;
+ *                                      a pinned DCB is reclaimed by its owner
+ *                                      without waiting on the other threads
+ * 05/07/2016   Mark Riddoch            DCB pool primed from the
+ *                                      expected_connections capacity hint
  *
  * @endverbatim
  */
@@ -80,6 +106,9 @@
 #include <modules.h>
 #include <router.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <limits.h>
 #include <gw.h>
 #include <maxscale/poll.h>
 #include <atomic.h>
@@ -87,17 +116,131 @@
 #include <log_manager.h>
 #include <hashtable.h>
 #include <hk_heartbeat.h>
+#include <memlog.h>
+#include <memaccount.h>
+#include <platform.h>
+#include <maxconfig.h>
 
 #define SSL_ERRBUF_LEN 140
 
-static  DCB             *allDCBs = NULL;        /* Diagnostics need a list of DCBs */
+/**
+ * The recycling pools for connection objects.
+ *
+ * Connect/disconnect churn makes the DCB and protocol object allocations
+ * one of the largest consumers of the heap allocator. Rather than return
+ * each object to the heap when a connection ends, a small number are kept
+ * on free lists so that the next connection can reuse them. As with the
+ * pooled buffer allocator, the free lists are per-thread so no lock is
+ * needed, and the number of entries on each list is capped so that a
+ * burst of connections does not pin memory for the life of the process.
+ *
+ * Protocol objects are opaque to the core - their size is known only to
+ * the protocol module that creates them - so they are pooled through the
+ * generic protocol_object_alloc/protocol_object_free pair, which records
+ * the allocation size in a hidden header ahead of the object. Each thread
+ * keeps one free list per distinct size seen.
+ */
+#define OBJPOOL_MAX_FREE        64      /*< Cap on free objects per list and thread */
+#define PROTOPOOL_CLASSES       4       /*< Number of distinct protocol object sizes pooled */
+
+typedef struct proto_block
+{
+    size_t              size;   /*< The size of the object area of this block */
+    struct proto_block  *next;  /*< Next free block of the same size */
+} PROTO_BLOCK;
+
+typedef struct
+{
+    size_t      size;           /*< Object size of this class, 0 if unused */
+    PROTO_BLOCK *blocks;        /*< Free list of blocks of this size */
+    int         n_blocks;       /*< Number of blocks on the free list */
+} PROTOPOOL_CLASS;
+
+static thread_local DCB *dcbpool = NULL;        /*< Free list of DCBs for this thread */
+static thread_local int n_dcbpool = 0;          /*< Number of DCBs on the free list */
+static thread_local PROTOPOOL_CLASS protopool[PROTOPOOL_CLASSES];
+
+/**
+ * The write coalescing state of the thread.
+ *
+ * A MySQL reply is typically written as several small dcb_write calls,
+ * header, fields, rows and EOF, each of which would otherwise make its
+ * own write system call. While an event handler is on the stack the
+ * polling thread corks the DCBs it writes to: the data accumulates in
+ * the write queue and the DCB is linked on a thread local list. When
+ * the handler returns the list is flushed and the whole reply leaves
+ * in a single writev, without enabling Nagle on the socket.
+ */
+static thread_local int dcb_cork_depth = 0;     /*< Event handler nesting depth */
+static thread_local DCB *dcb_corked_list = NULL; /*< DCBs with writes held for the flush */
+
+/**
+ * The flat table of all DCBs in the system, sized from the file
+ * descriptor limit of the process.
+ *
+ * Each DCB occupies one slot, claimed with a compare and swap when the
+ * DCB is allocated, so registration and removal are O(1) and never
+ * contend on a lock no matter how many connections there are. The
+ * diagnostic and foreach operations that used to walk a linked list
+ * under a global spinlock scan the array instead. A margin of slots
+ * beyond the descriptor limit covers DCBs that have no descriptor of
+ * their own, such as clones and internal DCBs. The spinlock is only
+ * taken by the iterating functions and when a slot is released in
+ * dcb_final_free, so that a DCB cannot be freed under an iterator;
+ * the allocation path never takes it.
+ */
+#define DCB_TABLE_EXTRA 1024            /*< Slots for DCBs without a descriptor */
+#define DCB_TABLE_MAX   1048576         /*< Sanity cap on the table size */
+static  DCB             **dcb_table = NULL;     /*< All DCBs, for the diagnostics */
+static  int             dcb_table_size = 0;
+static  unsigned int    dcb_slot_hint = 0;      /*< Round robin start for slot claims */
 static  int             nDCBs = 0;
 static  int             maxDCBs = 0;
 static  DCB             *zombies = NULL;
 static  int             nzombies = 0;
 static  int             maxzombies = 0;
 static  SPINLOCK        dcbspin = SPINLOCK_INIT;
-static  SPINLOCK        zombiespin = SPINLOCK_INIT;
+
+/**
+ * The epoch counters used to reclaim retired DCBs.
+ *
+ * The global epoch advances each time a DCB is retired. Each polling
+ * thread publishes the epoch it has reached at the quiescent point of
+ * its loop; a retired DCB may be freed once every active thread has
+ * published a later epoch than the one in which the DCB was retired.
+ * The zombies list itself is a lock free stack manipulated with
+ * compare and swap, so retirement and reclamation require no locks.
+ */
+#define DCB_EPOCH_INACTIVE      ((uint64_t)-1)  /*< Published by threads that are not polling */
+
+typedef struct
+{
+    uint64_t    epoch;      /*< The epoch last published by the thread */
+    uint64_t    pad[7];     /*< Pad to a cache line to avoid false sharing */
+} DCB_THREAD_EPOCH;
+
+/**
+ * The retired DCBs of one polling thread, a lock free stack padded to
+ * a cache line of its own. A pinned DCB is retired onto the stack of
+ * its owning thread and reclaimed by that thread alone: the owner is
+ * at the quiescent point of its loop when it processes the stack, so
+ * every event it could deliver to the DCB has been delivered and no
+ * other thread handles events for a pinned DCB. DCBs without an owning
+ * thread stay on the shared zombies stack and wait for every active
+ * thread to pass their retirement epoch, as before.
+ */
+typedef struct
+{
+    DCB         *head;      /*< Retired DCBs owned by the thread */
+    uint64_t    pad[7];     /*< Pad to a cache line to avoid false sharing */
+} DCB_ZOMBIE_SHARD;
+
+static uint64_t          dcb_global_epoch = 1;  /*< Advanced each time a DCB is retired */
+static DCB_THREAD_EPOCH  *thread_epochs = NULL; /*< The epochs published by the polling threads */
+static DCB_ZOMBIE_SHARD  *thread_zombies = NULL; /*< The retired DCBs of each polling thread */
+static int               n_epoch_threads = 0;   /*< Number of slots in thread_epochs */
+static int               zombie_reclaim_busy = 0; /*< Serialises reclamation passes of the
+                                                  *  shared zombies stack */
 
 static void dcb_final_free(DCB *dcb);
 static void dcb_call_callback(DCB *dcb, DCB_REASON reason);
@@ -106,8 +249,9 @@ static int  dcb_null_write(DCB *dcb, GWBUF *buf);
 static int  dcb_null_close(DCB *dcb);
 static int  dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf);
 static inline int  dcb_isvalid_nolock(DCB *dcb);
-static inline DCB * dcb_find_in_list(DCB *dcb);
+static void dcb_table_init(void);
 static inline void dcb_process_victim_queue(DCB *listofdcb);
+static void dcb_zombie_add(DCB *dcb);
 static void dcb_stop_polling_and_shutdown (DCB *dcb);
 static bool dcb_maybe_add_persistent(DCB *);
 static inline bool dcb_write_parameter_check(DCB *dcb, GWBUF *queue);
@@ -122,6 +266,9 @@ static inline void dcb_write_fake_code(DCB *dcb);
 #endif
 static void dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno);
 static inline void dcb_write_tidy_up(DCB *dcb, bool below_water);
+static void dcb_flow_suspend_source(DCB *dcb);
+static void dcb_flow_resume_source(DCB *dcb);
+static void dcb_flow_release(DCB *dcb);
 static int gw_write(DCB *dcb, bool *stop_writing);
 static int gw_write_SSL(DCB *dcb, bool *stop_writing);
 static void dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret);
@@ -161,6 +308,9 @@ bool dcb_get_ses_log_info(
 /**
  * Return the pointer to the list of zombie DCB's
  *
+ * Only the shared stack of DCBs without an owning thread is returned;
+ * DCBs pinned to a polling thread wait on the shard of that thread.
+ *
  * @return Zombies DCB list
  */
 DCB *
@@ -169,6 +319,37 @@ dcb_get_zombies(void)
     return zombies;
 }
 
+/**
+ * Prime the DCB pool of the calling thread with n free DCBs, up to the
+ * pool cap. Called by each polling thread at startup when the
+ * configuration carries an expected_connections capacity hint, so that
+ * the allocations are made before traffic arrives rather than during
+ * the connection ramp.
+ *
+ * @param n     The number of DCBs to place on the free list
+ */
+void
+dcb_pool_prime(int n)
+{
+    DCB *dcb;
+
+    if (n > OBJPOOL_MAX_FREE)
+    {
+        n = OBJPOOL_MAX_FREE;
+    }
+    while (n_dcbpool < n)
+    {
+        if ((dcb = (DCB *)calloc(1, sizeof(DCB))) == NULL)
+        {
+            return;
+        }
+        memacct_add(MEM_ACCT_DCB, sizeof(DCB));
+        dcb->next = dcbpool;
+        dcbpool = dcb;
+        n_dcbpool++;
+    }
+}
+
 /**
  * Allocate a new DCB.
  *
@@ -183,10 +364,20 @@ dcb_alloc(dcb_role_t role)
 {
     DCB *newdcb;
 
-    if ((newdcb = calloc(1, sizeof(DCB))) == NULL)
+    if ((newdcb = dcbpool) != NULL)
+    {
+        dcbpool = newdcb->next;
+        n_dcbpool--;
+        memset(newdcb, 0, sizeof(DCB));
+    }
+    else if ((newdcb = calloc(1, sizeof(DCB))) == NULL)
     {
         return NULL;
     }
+    else
+    {
+        memacct_add(MEM_ACCT_DCB, sizeof(DCB));
+    }
     newdcb->dcb_chk_top = CHK_NUM_DCB;
     newdcb->dcb_chk_tail = CHK_NUM_DCB;
 
@@ -204,19 +395,23 @@ dcb_alloc(dcb_role_t role)
     newdcb->polloutbusy = 0;
     newdcb->writecheck = 0;
     newdcb->fd = DCBFD_CLOSED;
+    newdcb->owner = -1;
 
     newdcb->evq.next = NULL;
-    newdcb->evq.prev = NULL;
     newdcb->evq.pending_events = 0;
+    newdcb->evq.queued = 0;
     newdcb->evq.processing = 0;
-    spinlock_init(&newdcb->evq.eventqlock);
 
     memset(&newdcb->stats, 0, sizeof(DCBSTATS));        // Zero the statistics
     newdcb->state = DCB_STATE_ALLOC;
-    bitmask_init(&newdcb->memdata.bitmask);
+    newdcb->memdata.retire_epoch = 0;
     newdcb->writeqlen = 0;
-    newdcb->high_water = 0;
-    newdcb->low_water = 0;
+    newdcb->cork_next = NULL;
+    newdcb->cork_pending = false;
+    newdcb->high_water = config_writeq_high_water();
+    newdcb->low_water = config_writeq_low_water();
+    newdcb->flow_suspended = NULL;
+    newdcb->flow_suspended_by = NULL;
     newdcb->session = NULL;
     newdcb->server = NULL;
     newdcb->service = NULL;
@@ -233,27 +428,79 @@ dcb_alloc(dcb_role_t role)
     newdcb->user = NULL;
     newdcb->flags = 0;
 
-    spinlock_acquire(&dcbspin);
-    if (allDCBs == NULL)
+    if (dcb_table == NULL)
     {
-        allDCBs = newdcb;
+        spinlock_acquire(&dcbspin);
+        if (dcb_table == NULL)
+        {
+            dcb_table_init();
+        }
+        spinlock_release(&dcbspin);
     }
-    else
+
+    /*<
+     * Claim a slot in the DCB table. The hint spreads the probes so
+     * that a free slot is normally found at the first attempt.
+     */
+    newdcb->dcb_slot = -1;
     {
-        DCB *ptr = allDCBs;
-        while (ptr->next)
-            ptr = ptr->next;
-        ptr->next = newdcb;
+        unsigned int start = (unsigned int)atomic_add((int *)&dcb_slot_hint, 1);
+        int n;
+
+        for (n = 0; n < dcb_table_size; n++)
+        {
+            int i = (int)((start + n) % (unsigned int)dcb_table_size);
+
+            if (dcb_table[i] == NULL &&
+                __sync_bool_compare_and_swap(&dcb_table[i], NULL, newdcb))
+            {
+                newdcb->dcb_slot = i;
+                break;
+            }
+        }
     }
-    nDCBs++;
+    atomic_add(&nDCBs, 1);
     if (nDCBs > maxDCBs)
     {
         maxDCBs = nDCBs;
     }
-    spinlock_release(&dcbspin);
     return newdcb;
 }
 
+/**
+ * Allocate the table that holds every DCB in the system.
+ *
+ * The table is sized from the file descriptor limit of the process,
+ * which bounds the number of DCBs with descriptors, plus a margin for
+ * those without one. Initialisation is deferred to the first
+ * dcb_alloc so that the limit set during startup is the one that is
+ * seen. Called with dcbspin held.
+ */
+static void
+dcb_table_init(void)
+{
+    struct rlimit rlim;
+    int size = DCB_TABLE_MAX;
+    DCB **table;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+        rlim.rlim_cur != RLIM_INFINITY &&
+        rlim.rlim_cur < DCB_TABLE_MAX)
+    {
+        size = (int)rlim.rlim_cur;
+    }
+    size += DCB_TABLE_EXTRA;
+    if ((table = calloc(size, sizeof(DCB *))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    dcb_table_size = size;
+    /*< The table must be fully visible before the pointer is published */
+    __sync_synchronize();
+    dcb_table = table;
+}
+
 
 /**
  * Provided only for consistency, simply calls dcb_close to guarantee
@@ -310,8 +557,8 @@ dcb_clone(DCB *orig)
 /**
  * Free a DCB and remove it from the chain of all DCBs
  *
- * NB This is called with the caller holding the zombie queue
- * spinlock
+ * NB This is only called for DCBs that epoch reclamation has proven
+ * to be unreachable from every polling thread
  *
  * @param dcb The DCB to free
  */
@@ -329,35 +576,23 @@ dcb_final_free(DCB *dcb)
         MXS_ERROR("dcb_final_free: DCB %p has outstanding events.", dcb);
     }
 
-    /*< First remove this DCB from the chain */
+    /*< Release the polling thread assignment of the DCB */
+    poll_unassign_dcb(dcb);
+
+    /*<
+     * Release the slot of the DCB in the table. The lock excludes the
+     * iterating functions so that the DCB is never freed under one of
+     * them.
+     */
     spinlock_acquire(&dcbspin);
-    if (allDCBs == dcb)
-    {
-        /*<
-         * Deal with the special case of removing the DCB at the head of
-         * the chain.
-         */
-        allDCBs = dcb->next;
-    }
-    else
+    if (dcb->dcb_slot >= 0 && dcb->dcb_slot < dcb_table_size &&
+        dcb_table[dcb->dcb_slot] == dcb)
     {
-        /*<
-         * We find the DCB that point to the one we are removing and then
-         * set the next pointer of that DCB to the next pointer of the
-         * DCB we are removing.
-         */
-        DCB *ptr = allDCBs;
-        while (ptr && ptr->next != dcb)
-        {
-            ptr = ptr->next;
-        }
-        if (ptr)
-        {
-            ptr->next = dcb->next;
-        }
+        dcb_table[dcb->dcb_slot] = NULL;
     }
-    nDCBs--;
+    dcb->dcb_slot = -1;
     spinlock_release(&dcbspin);
+    atomic_add(&nDCBs, -1);
 
     if (dcb->session) {
         /*<
@@ -400,7 +635,7 @@ dcb_free_all_memory(DCB *dcb)
 
     if (dcb->protocol && (!DCB_IS_CLONE(dcb)))
     {
-        free(dcb->protocol);
+        protocol_object_free(dcb->protocol);
     }
     if (dcb->protoname)
     {
@@ -431,6 +666,11 @@ dcb_free_all_memory(DCB *dcb)
         gwbuf_free(dcb->dcb_readqueue);
         dcb->dcb_readqueue = NULL;
     }
+    if (dcb->readbuf)
+    {
+        gwbuf_free(dcb->readbuf);
+        dcb->readbuf = NULL;
+    }
 
     spinlock_acquire(&dcb->cb_lock);
     while ((cb_dcb = dcb->callbacks) != NULL)
@@ -443,88 +683,342 @@ dcb_free_all_memory(DCB *dcb)
     {
         SSL_free(dcb->ssl);
     }
-    bitmask_free(&dcb->memdata.bitmask);
-    free(dcb);
+    if (n_dcbpool < OBJPOOL_MAX_FREE)
+    {
+        dcb->next = dcbpool;
+        dcbpool = dcb;
+        n_dcbpool++;
+    }
+    else
+    {
+        memacct_add(MEM_ACCT_DCB, -(int64_t)sizeof(DCB));
+        free(dcb);
+    }
+}
+
+/**
+ * Allocate a zeroed protocol object of the given size, reusing one from
+ * the free list of the calling thread when possible.
+ *
+ * The object is freed by the core when the owning DCB is finally
+ * destroyed, without knowledge of its type, so the allocation size is
+ * recorded in a header ahead of the object to allow it to be returned
+ * to the free list of the right size.
+ *
+ * @param size  Size of the protocol object to allocate
+ * @return The protocol object or NULL if memory could not be allocated
+ */
+void *
+protocol_object_alloc(size_t size)
+{
+    PROTO_BLOCK *block = NULL;
+    int i;
+
+    for (i = 0; i < PROTOPOOL_CLASSES; i++)
+    {
+        if (protopool[i].size == size)
+        {
+            if ((block = protopool[i].blocks) != NULL)
+            {
+                protopool[i].blocks = block->next;
+                protopool[i].n_blocks--;
+                memset(block + 1, 0, size);
+            }
+            break;
+        }
+        if (protopool[i].size == 0)
+        {
+            protopool[i].size = size;
+            break;
+        }
+    }
+    if (block == NULL)
+    {
+        if ((block = malloc(sizeof(PROTO_BLOCK) + size)) == NULL)
+        {
+            return NULL;
+        }
+        block->size = size;
+        memacct_add(MEM_ACCT_DCB, (int64_t)sizeof(PROTO_BLOCK) + size);
+        memset(block + 1, 0, size);
+    }
+    return (void *)(block + 1);
+}
+
+/**
+ * Free a protocol object allocated with protocol_object_alloc, returning
+ * it to the free list of the calling thread if there is room.
+ *
+ * @param obj   The protocol object to free
+ */
+void
+protocol_object_free(void *obj)
+{
+    PROTO_BLOCK *block = ((PROTO_BLOCK *)obj) - 1;
+    int i;
+
+    for (i = 0; i < PROTOPOOL_CLASSES; i++)
+    {
+        if (protopool[i].size == block->size)
+        {
+            if (protopool[i].n_blocks < OBJPOOL_MAX_FREE)
+            {
+                block->next = protopool[i].blocks;
+                protopool[i].blocks = block;
+                protopool[i].n_blocks++;
+                return;
+            }
+            break;
+        }
+    }
+    memacct_add(MEM_ACCT_DCB, -((int64_t)sizeof(PROTO_BLOCK) + block->size));
+    free(block);
+}
+
+/**
+ * Allocate the epoch slots of the polling threads.
+ *
+ * Called once from poll_init before the polling threads are started.
+ * Every slot starts as inactive; a thread only takes part in epoch
+ * tracking once it publishes its first epoch from the polling loop.
+ *
+ * @param nthreads      The number of polling threads
+ */
+void
+dcb_epoch_init(int nthreads)
+{
+    int i;
+
+    if ((thread_epochs = calloc(nthreads, sizeof(DCB_THREAD_EPOCH))) == NULL
+        || (thread_zombies = calloc(nthreads, sizeof(DCB_ZOMBIE_SHARD))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        thread_epochs[i].epoch = DCB_EPOCH_INACTIVE;
+    }
+    n_epoch_threads = nthreads;
+}
+
+/**
+ * Withdraw an exiting polling thread from epoch tracking.
+ *
+ * A thread that has left the polling loop never publishes again, so
+ * its slot must be marked inactive or it would hold back the
+ * reclamation of every subsequently retired DCB.
+ *
+ * @param threadid      The thread ID of the exiting thread
+ */
+void
+dcb_epoch_retire_thread(int threadid)
+{
+    if (thread_epochs && threadid < n_epoch_threads)
+    {
+        DCB *dcb, *head, *tail;
+
+        __sync_synchronize();
+        thread_epochs[threadid].epoch = DCB_EPOCH_INACTIVE;
+        /*
+         * Nothing will ever reclaim the zombie stack of the exiting
+         * thread, so hand its contents over to the shared stack where
+         * the remaining threads will pick them up.
+         */
+        do
+        {
+            dcb = thread_zombies[threadid].head;
+        }
+        while (dcb
+               && !__sync_bool_compare_and_swap(&thread_zombies[threadid].head,
+                                                dcb, NULL));
+        if (dcb)
+        {
+            for (tail = dcb; tail->memdata.next; tail = tail->memdata.next)
+            {
+                ;
+            }
+            do
+            {
+                head = zombies;
+                tail->memdata.next = head;
+            }
+            while (!__sync_bool_compare_and_swap(&zombies, head, dcb));
+        }
+    }
+}
+
+/**
+ * Retire a DCB into the zombie list.
+ *
+ * The DCB is stamped with the current global epoch, the epoch is
+ * advanced and the DCB is pushed onto the lock free zombie stack.
+ * It will be freed by a later reclamation pass once every active
+ * polling thread has published an epoch beyond the stamped one.
+ *
+ * @param dcb   The DCB to retire
+ */
+static void
+dcb_zombie_add(DCB *dcb)
+{
+    DCB *head;
+    DCB **stack = &zombies;
+
+    if (thread_zombies && dcb->owner >= 0 && dcb->owner < n_epoch_threads)
+    {
+        /* The DCB is pinned to a polling thread; it dies on the stack
+         * of that thread and is reclaimed by it alone. */
+        stack = &thread_zombies[dcb->owner].head;
+    }
+    dcb->memdata.retire_epoch = __sync_fetch_and_add(&dcb_global_epoch, 1);
+    do
+    {
+        head = *stack;
+        dcb->memdata.next = head;
+    }
+    while (!__sync_bool_compare_and_swap(stack, head, dcb));
+    atomic_add(&nzombies, 1);
+    if (nzombies > maxzombies)
+    {
+        maxzombies = nzombies;
+    }
 }
 
 /**
- * Process the DCB zombie queue
+ * Process the DCB zombie queues
  *
  * This routine is called by each of the polling threads with
- * the thread id of the polling thread. It must clear the bit in
- * the memdata bitmask for the polling thread that calls it. If the
- * operation of clearing this bit means that no bits are set in
- * the memdata.bitmask then the DCB is no longer able to be
- * referenced and it can be finally removed.
+ * the thread id of the polling thread. It publishes the epoch the
+ * thread has reached; the thread holds no DCB references at this
+ * point of the polling loop, so every DCB retired in an earlier
+ * epoch is unreachable from it.
+ *
+ * The thread then reclaims its own zombie shard. The DCBs on it are
+ * pinned to this thread, which delivers every event they can receive,
+ * so with the thread at its quiescent point they only wait on the
+ * event queue and SSL offload checks, never on the epochs of the
+ * other threads. DCBs without an owning thread go through the shared
+ * stack as before: one thread at a time reclaims those whose epoch
+ * has been passed by every active thread.
  *
  * @param       threadid        The thread ID of the caller
  */
 DCB *
 dcb_process_zombies(int threadid)
 {
-    DCB *zombiedcb;
-    DCB *previousdcb = NULL, *nextdcb;
-    DCB *listofdcb = NULL;
+    DCB *zombiedcb, *nextdcb, *head;
+    DCB *listofdcb = NULL, *requeue = NULL;
+    uint64_t safe_epoch;
+    int i;
 
-    /**
-     * Perform a dirty read to see if there is anything in the queue.
-     * This avoids threads hitting the queue spinlock when the queue
-     * is empty. This will really help when the only entry is being
-     * freed, since the queue is updated before the expensive call to
-     * dcb_final_free.
+    if (thread_epochs && threadid < n_epoch_threads)
+    {
+        thread_epochs[threadid].epoch = dcb_global_epoch;
+        __sync_synchronize();
+    }
+
+    /*
+     * Reclaim the local shard: the DCBs that died on this thread.
+     * The dirty read keeps the common empty case free of atomic
+     * operations; retirements from other threads racing the detach
+     * are caught on the next pass.
      */
-    if (!zombies)
+    if (thread_zombies && threadid >= 0 && threadid < n_epoch_threads
+        && thread_zombies[threadid].head)
     {
-        return NULL;
+        DCB *tail = NULL;
+
+        do
+        {
+            zombiedcb = thread_zombies[threadid].head;
+        }
+        while (!__sync_bool_compare_and_swap(&thread_zombies[threadid].head,
+                                             zombiedcb, NULL));
+        while (zombiedcb)
+        {
+            CHK_DCB(zombiedcb);
+            nextdcb = zombiedcb->memdata.next;
+            if (DCB_POLL_BUSY(zombiedcb) || zombiedcb->ssl_offload_queued)
+            {
+                zombiedcb->memdata.next = requeue;
+                requeue = zombiedcb;
+                if (tail == NULL)
+                {
+                    tail = zombiedcb;
+                }
+            }
+            else
+            {
+                atomic_add(&nzombies, -1);
+                zombiedcb->memdata.next = listofdcb;
+                listofdcb = zombiedcb;
+            }
+            zombiedcb = nextdcb;
+        }
+        /*
+         * Link the survivors back onto the shard in one operation;
+         * they are retried on the next pass of this thread.
+         */
+        if (requeue)
+        {
+            do
+            {
+                head = thread_zombies[threadid].head;
+                tail->memdata.next = head;
+            }
+            while (!__sync_bool_compare_and_swap(&thread_zombies[threadid].head,
+                                                 head, requeue));
+            requeue = NULL;
+        }
     }
 
     /*
-     * Process the zombie queue and create a list of DCB's that can be
-     * finally freed. This processing is down under a spinlock that
-     * will prevent new entries being added to the zombie queue. Therefore
-     * we do not want to do any expensive operations under this spinlock
-     * as it will block other threads. The expensive operations will be
-     * performed on the victim queue within holding the zombie queue
-     * spinlock.
+     * Reclaim the shared stack of DCBs that have no owning thread.
+     * Only one thread scans it at a time; the others merely publish
+     * their epoch above.
      */
-    spinlock_acquire(&zombiespin);
-    zombiedcb = zombies;
-    while (zombiedcb)
+    if (zombies && __sync_bool_compare_and_swap(&zombie_reclaim_busy, 0, 1))
     {
-        CHK_DCB(zombiedcb);
-        nextdcb = zombiedcb->memdata.next;
         /*
-         * Skip processing of DCB's that are
-         * in the event queue waiting to be processed.
+         * Find the oldest epoch published by any active polling
+         * thread. DCBs retired before it can no longer be referenced
+         * by any thread. Without polling threads, as in the unit
+         * tests, every retired DCB is immediately safe.
          */
-        if (zombiedcb->evq.next || zombiedcb->evq.prev)
+        safe_epoch = dcb_global_epoch;
+        for (i = 0; i < n_epoch_threads; i++)
         {
-            previousdcb = zombiedcb;
+            if (thread_epochs[i].epoch != DCB_EPOCH_INACTIVE
+                && thread_epochs[i].epoch < safe_epoch)
+            {
+                safe_epoch = thread_epochs[i].epoch;
+            }
         }
-        else
+
+        /*
+         * Detach the entire zombie stack and sort it into the DCBs
+         * that are now unreachable and those that must wait, either
+         * for a later epoch or because they are in the event queue or
+         * held by an SSL handshake offload thread.
+         */
+        do
         {
+            zombiedcb = zombies;
+        }
+        while (!__sync_bool_compare_and_swap(&zombies, zombiedcb, NULL));
 
-            if (bitmask_clear_without_spinlock(&zombiedcb->memdata.bitmask, threadid))
+        while (zombiedcb)
+        {
+            CHK_DCB(zombiedcb);
+            nextdcb = zombiedcb->memdata.next;
+            if (DCB_POLL_BUSY(zombiedcb) || zombiedcb->ssl_offload_queued
+                || zombiedcb->memdata.retire_epoch >= safe_epoch)
+            {
+                zombiedcb->memdata.next = requeue;
+                requeue = zombiedcb;
+            }
+            else
             {
-                /**
-                 * Remove the DCB from the zombie queue
-                 * and call the final free routine for the
-                 * DCB
-                 *
-                 * zombiedcb is the DCB we are processing
-                 * previousdcb is the previous DCB on the zombie
-                 * queue or NULL if the DCB is at the head of the
-                 * queue.  Remove zombiedcb from the zombies list.
-                 */
-                if (NULL == previousdcb)
-                {
-                    zombies = zombiedcb->memdata.next;
-                }
-                else
-                {
-                    previousdcb->memdata.next = zombiedcb->memdata.next;
-                }
-
                 MXS_DEBUG("%lu [%s] Remove dcb "
                           "%p fd %d in state %s from the "
                           "list of zombies.",
@@ -533,28 +1027,32 @@ dcb_process_zombies(int threadid)
                           zombiedcb,
                           zombiedcb->fd,
                           STRDCBSTATE(zombiedcb->state));
-                /*<
-                 * Move zombie dcb to linked list of victim dcbs.
-                 * The variable dcb is used to hold the last DCB
-                 * to have been added to the linked list, or NULL
-                 * if none has yet been added.  If the list
-                 * (listofdcb) is not NULL, then it follows that
-                 * dcb will also not be null.
-                 */
-                nzombies--;
+                atomic_add(&nzombies, -1);
                 zombiedcb->memdata.next = listofdcb;
                 listofdcb = zombiedcb;
             }
-            else
+            zombiedcb = nextdcb;
+        }
+
+        /*
+         * Push the survivors back onto the stack; dcb_close may have
+         * pushed new retirements while the stack was detached.
+         */
+        while (requeue)
+        {
+            nextdcb = requeue->memdata.next;
+            do
             {
-                /* Since we didn't remove this dcb from the zombies
-                   list, we need to advance the previous pointer */
-                previousdcb = zombiedcb;
+                head = zombies;
+                requeue->memdata.next = head;
             }
+            while (!__sync_bool_compare_and_swap(&zombies, head, requeue));
+            requeue = nextdcb;
         }
-        zombiedcb = nextdcb;
+
+        __sync_synchronize();
+        zombie_reclaim_busy = 0;
     }
-    spinlock_release(&zombiespin);
 
     if (listofdcb)
     {
@@ -611,17 +1109,10 @@ dcb_process_victim_queue(DCB *listofdcb)
                 {
                     DCB *nextdcb;
                     dcb_stop_polling_and_shutdown(dcb);
-                    spinlock_acquire(&zombiespin);
-                    bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
+                    /* Retire again with a fresh epoch, since removal
+                     * from the poll set has only just happened. */
                     nextdcb = dcb->memdata.next;
-                    dcb->memdata.next = zombies;
-                    zombies = dcb;
-                    nzombies++;
-                    if (nzombies > maxzombies)
-                    {
-                        maxzombies = nzombies;
-                    }
-                    spinlock_release(&zombiespin);
+                    dcb_zombie_add(dcb);
                     dcb = nextdcb;
                     continue;
                 }
@@ -727,7 +1218,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     {
         MXS_DEBUG("%lu [dcb_connect] Looking for persistent connection DCB "
                   "user %s protocol %s\n", pthread_self(), user, protocol);
-        dcb = server_get_persistent(server, user, protocol);
+        dcb = server_get_persistent(server, user, protocol, session->service);
         if (dcb)
         {
             /**
@@ -744,6 +1235,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
             MXS_DEBUG("%lu [dcb_connect] Reusing a persistent connection, dcb %p\n",
                       pthread_self(), dcb);
             dcb->persistentstart = 0;
+            dcb->service = session->service;
             return dcb;
         }
         else
@@ -819,6 +1311,10 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
      */
     dcb->server = server;
 
+    /** Record the service the connection was opened for, the persistent
+     * pool will only hand the connection back to sessions of this service */
+    dcb->service = session->service;
+
     /** Copy status field to DCB */
     dcb->dcb_server_status = server->status;
     dcb->dcb_port = server->port;
@@ -862,6 +1358,26 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
  * @param maxbytes  Maximum bytes to read (0 = no limit)
  * @return          -1 on error, otherwise the total number of bytes read
  */
+/**
+ * Record the backend round trip time of a DCB, if a measurement is in
+ * progress. The duration from the write stamped in dcb_write to the
+ * first data read back is recorded into the response time histogram of
+ * the server, and the stamp is then cleared until the next write.
+ *
+ * @param dcb   The DCB that data was read from
+ */
+static inline void
+dcb_sample_response_time(DCB *dcb)
+{
+    if (dcb->response_clock && dcb->server &&
+        dcb->server->stats.response_time)
+    {
+        histogram_record(dcb->server->stats.response_time,
+                         histogram_clock_us() - dcb->response_clock);
+    }
+    dcb->response_clock = 0;
+}
+
 int dcb_read(DCB   *dcb,
              GWBUF **head,
              int maxbytes)
@@ -901,6 +1417,7 @@ int dcb_read(DCB   *dcb,
         {
             GWBUF *buffer;
             dcb->last_read = hkheartbeat;
+            dcb_sample_response_time(dcb);
 
             buffer = dcb_basic_read(dcb, bytes_available, maxbytes, nreadtotal, &nsingleread);
             if (buffer)
@@ -915,8 +1432,10 @@ int dcb_read(DCB   *dcb,
                   STRDCBSTATE(dcb->state),
                   dcb->fd);
         /* </editor-fold> */
-                /*< Append read data to the gwbuf */
-                *head = gwbuf_append(*head, buffer);
+                /*< Append read data to the gwbuf; consecutive reads
+                 * land adjacently in the receive buffer and their
+                 * views fuse into one rather than forming a chain */
+                *head = gwbuf_append_coalesce(*head, buffer);
             }
             else
             {
@@ -992,9 +1511,96 @@ dcb_read_no_bytes_available(DCB *dcb, int nreadtotal)
     return nreadtotal;
 }
 
+/** Smallest receive buffer retained on a DCB */
+#define DCB_READBUF_MIN         1024
+/** Number of consecutive reads the retained receive buffer may be more
+ * than four times oversized for before it is replaced with a smaller one */
+#define DCB_READBUF_SHRINK      16
+
+/**
+ * Make room for a read of the given size in the retained receive buffer
+ * of the DCB.
+ *
+ * The buffer is reused in place when the DCB holds the only reference to
+ * it, that is when every view carved over it by earlier reads has been
+ * freed upstream; reuse is then nothing but pointer arithmetic. If views
+ * are still outstanding the old buffer is released to them and a fresh
+ * one is taken, and a buffer that stays far larger than the reads landing
+ * in it is replaced with a smaller one.
+ *
+ * The sizing follows the traffic seen on the DCB. A smoothed average of
+ * the single read sizes is kept and a new buffer is sized to the larger
+ * of the immediate need and that average, so a session streaming a large
+ * result set moves to a large allocation class once and stays there,
+ * while a session exchanging small packets sticks to the minimum sized
+ * buffer. The average also guards the shrink heuristic: one small read
+ * in a large transfer does not count the buffer as oversized.
+ *
+ * @param dcb       The DCB that is about to read
+ * @param bufsize   The number of bytes the read needs room for
+ * @return Pointer to the start of the receive space, or NULL on
+ *         allocation failure
+ */
+static uint8_t *
+dcb_reserve_read_space(DCB *dcb, int bufsize)
+{
+    int wanted = bufsize > dcb->readbuf_avg ? bufsize : dcb->readbuf_avg;
+
+    if (dcb->readbuf)
+    {
+        if (dcb->readbuf->sbuf->refcount == 1)
+        {
+            /* Every view handed out has been freed, reuse from the start */
+            dcb->readbuf_used = 0;
+            if (dcb->readbuf_size >= bufsize)
+            {
+                if (dcb->readbuf_size <= DCB_READBUF_MIN ||
+                    dcb->readbuf_size < 4 * wanted)
+                {
+                    dcb->readbuf_waste = 0;
+                    return (uint8_t *)GWBUF_DATA(dcb->readbuf);
+                }
+                if (++dcb->readbuf_waste < DCB_READBUF_SHRINK)
+                {
+                    return (uint8_t *)GWBUF_DATA(dcb->readbuf);
+                }
+                /* Oversized for too long, fall through and shrink */
+            }
+        }
+        else if (dcb->readbuf_size - dcb->readbuf_used >= bufsize)
+        {
+            /* Views are still outstanding but there is room behind the
+             * bytes they cover. The read lands right after the previous
+             * one, so the view over it coalesces with the previous view
+             * instead of adding a link to the chain. */
+            return (uint8_t *)GWBUF_DATA(dcb->readbuf) + dcb->readbuf_used;
+        }
+        gwbuf_free(dcb->readbuf);
+        dcb->readbuf = NULL;
+    }
+    if (wanted > MAX_BUFFER_SIZE)
+    {
+        wanted = MAX_BUFFER_SIZE;
+    }
+    dcb->readbuf_size = wanted < DCB_READBUF_MIN ? DCB_READBUF_MIN : wanted;
+    dcb->readbuf_waste = 0;
+    dcb->readbuf_used = 0;
+    if ((dcb->readbuf = gwbuf_alloc(dcb->readbuf_size)) == NULL)
+    {
+        dcb->readbuf_size = 0;
+        return NULL;
+    }
+    return (uint8_t *)GWBUF_DATA(dcb->readbuf);
+}
+
 /**
  * Basic read function to carry out a single read operation on the DCB socket.
  *
+ * The read lands in the retained receive buffer of the DCB and the
+ * buffer returned to the caller is a zero-copy view over the bytes that
+ * arrived. Code that needs to modify a shared view takes its own copy
+ * through gwbuf_make_writable.
+ *
  * @param dcb               The DCB to read from
  * @param bytesavailable    Pointer to linked list to append data to
  * @param maxbytes          Maximum bytes to read (0 = no limit)
@@ -1006,6 +1612,7 @@ static GWBUF *
 dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread)
 {
     GWBUF *buffer;
+    uint8_t *space;
 
     int bufsize = MIN(bytesavailable, MAX_BUFFER_SIZE);
     if (maxbytes)
@@ -1013,7 +1620,7 @@ dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *
         bufsize = MIN(bufsize, maxbytes-nreadtotal);
     }
 
-    if ((buffer = gwbuf_alloc(bufsize)) == NULL)
+    if ((space = dcb_reserve_read_space(dcb, bufsize)) == NULL)
     {
         /*<
          * This is a fatal error which should cause shutdown.
@@ -1030,31 +1637,47 @@ dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *
                       strerror_r(errno, errbuf, sizeof(errbuf)));
             /* </editor-fold> */
         *nsingleread = -1;
+        return NULL;
     }
-    else
+
+    *nsingleread = read(dcb->fd, space, bufsize);
+    dcb->stats.n_reads++;
+
+    if (*nsingleread > 0)
     {
-        *nsingleread = read(dcb->fd, GWBUF_DATA(buffer), bufsize);
-        dcb->stats.n_reads++;
+        dcb->stats.n_rbytes += *nsingleread;
+        /* Exponential moving average of the read sizes, gain 1/8 */
+        dcb->readbuf_avg += (*nsingleread - dcb->readbuf_avg) / 8;
+    }
 
-        if (*nsingleread <= 0)
+    if (*nsingleread <= 0)
+    {
+        if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
         {
-            if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-            {
-                char errbuf[STRERROR_BUFLEN];
-                /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-                MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
-                          "%s fd %d, due %d, %s.",
-                          pthread_self(),
-                          dcb,
-                          STRDCBSTATE(dcb->state),
-                          dcb->fd,
-                          errno,
-                          strerror_r(errno, errbuf, sizeof(errbuf)));
-                /* </editor-fold> */
-            }
-            gwbuf_free(buffer);
-            buffer = NULL;
+            char errbuf[STRERROR_BUFLEN];
+            /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
+            MXS_ERROR("%lu [dcb_read] Error : Read failed, dcb %p in state "
+                      "%s fd %d, due %d, %s.",
+                      pthread_self(),
+                      dcb,
+                      STRDCBSTATE(dcb->state),
+                      dcb->fd,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            /* </editor-fold> */
         }
+        /* Nothing arrived; the reserved space is kept for the next read */
+        return NULL;
+    }
+
+    if ((buffer = gwbuf_clone_portion(dcb->readbuf, dcb->readbuf_used,
+                                      *nsingleread)) == NULL)
+    {
+        *nsingleread = -1;
+    }
+    else
+    {
+        dcb->readbuf_used += *nsingleread;
     }
     return buffer;
 }
@@ -1094,6 +1717,7 @@ dcb_read_SSL(DCB *dcb, GWBUF **head)
     if (buffer)
     {
         nreadtotal += nsingleread;
+        dcb_sample_response_time(dcb);
         *head = gwbuf_append(*head, buffer);
 
         while (SSL_pending(dcb->ssl))
@@ -1110,6 +1734,10 @@ dcb_read_SSL(DCB *dcb, GWBUF **head)
     }
 
     ss_dassert(gwbuf_length(*head) == nreadtotal);
+    if (nreadtotal > 0)
+    {
+        dcb->stats.n_rbytes += nreadtotal;
+    }
     MXS_DEBUG("%lu Read a total of %d bytes from dcb %p in state %s fd %d.",
               pthread_self(),
               nreadtotal,
@@ -1295,6 +1923,14 @@ dcb_write(DCB *dcb, GWBUF *queue)
         return 0;
     }
 
+    if (dcb->server && dcb->response_clock == 0)
+    {
+        /* Stamp the start of the round trip completed in dcb_read */
+        dcb->response_clock = histogram_clock_us();
+    }
+
+    int queue_len = gwbuf_length(queue);
+
     spinlock_acquire(&dcb->writeqlock);
     empty_queue = (dcb->writeq == NULL);
     /*
@@ -1303,10 +1939,11 @@ dcb_write(DCB *dcb, GWBUF *queue)
      * If it did not already have data, we call the drain write queue
      * function immediately to attempt to write the data.
      */
-    atomic_add(&dcb->writeqlen, gwbuf_length(queue));
+    atomic_add(&dcb->writeqlen, queue_len);
     dcb->writeq = gwbuf_append(dcb->writeq, queue);
     spinlock_release(&dcb->writeqlock);
     dcb->stats.n_buffered++;
+    dcb->stats.n_wbytes += queue_len;
     MXS_DEBUG("%lu [dcb_write] Append to writequeue. %d writes "
               "buffered for dcb %p in state %s fd %d",
               pthread_self(),
@@ -1314,7 +1951,29 @@ dcb_write(DCB *dcb, GWBUF *queue)
               dcb,
               STRDCBSTATE(dcb->state),
               dcb->fd);
-    if (empty_queue) dcb_drain_writeq(dcb);
+    if (empty_queue)
+    {
+        if (dcb_cork_depth > 0)
+        {
+            /*
+             * An event handler of this thread is on the stack; hold the
+             * data in the write queue and link the DCB on the flush list
+             * so that the writes of one logical reply leave in a single
+             * writev when the handler returns. The compare and swap
+             * guards against two threads, each inside a handler that
+             * writes to this DCB, linking it on both of their lists.
+             */
+            if (__sync_bool_compare_and_swap(&dcb->cork_pending, false, true))
+            {
+                dcb->cork_next = dcb_corked_list;
+                dcb_corked_list = dcb;
+            }
+        }
+        else if (!dcb->cork_pending)
+        {
+            dcb_drain_writeq(dcb);
+        }
+    }
     dcb_write_tidy_up(dcb, below_water);
 
     return 1;
@@ -1475,6 +2134,87 @@ dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno)
     }
 }
 
+/**
+ * The write queue of a DCB has crossed its high water mark. If the event
+ * being processed is a read on another DCB of the same session - the
+ * normal case when a backend streams a large result set to a client that
+ * cannot keep up - suspend the read events of that DCB until this write
+ * queue has drained back below the low water mark. The unread data then
+ * backs up in the socket buffers and, through TCP flow control, on the
+ * server, so the memory used per session is bounded by the water marks
+ * rather than by the size of the result set.
+ *
+ * @param dcb   The DCB whose write queue crossed the high water mark
+ */
+static void
+dcb_flow_suspend_source(DCB *dcb)
+{
+    DCB *source = poll_current_dcb();
+    bool suspend = false;
+
+    if (source == NULL || source == dcb || source->session != dcb->session)
+    {
+        return;
+    }
+    spinlock_acquire(&dcb->writeqlock);
+    if (dcb->flow_suspended == NULL && source->flow_suspended_by == NULL &&
+        poll_suspend_read_events(source) == 0)
+    {
+        dcb->flow_suspended = source;
+        source->flow_suspended_by = dcb;
+    }
+    spinlock_release(&dcb->writeqlock);
+}
+
+/**
+ * The write queue of a DCB has drained below its low water mark; resume
+ * the reads of the DCB that was suspended on its behalf, if any.
+ *
+ * @param dcb   The DCB whose write queue drained below the low water mark
+ */
+static void
+dcb_flow_resume_source(DCB *dcb)
+{
+    DCB *source;
+
+    spinlock_acquire(&dcb->writeqlock);
+    if ((source = dcb->flow_suspended) != NULL)
+    {
+        dcb->flow_suspended = NULL;
+        source->flow_suspended_by = NULL;
+    }
+    spinlock_release(&dcb->writeqlock);
+    if (source)
+    {
+        poll_resume_read_events(source);
+    }
+}
+
+/**
+ * Release any flow control relationship a closing DCB is part of, in
+ * either direction: a DCB suspended on behalf of this write queue is
+ * resumed, and a blocker holding a reference to this DCB forgets it.
+ *
+ * @param dcb   The DCB being closed
+ */
+static void
+dcb_flow_release(DCB *dcb)
+{
+    DCB *blocker;
+
+    dcb_flow_resume_source(dcb);
+    if ((blocker = dcb->flow_suspended_by) != NULL)
+    {
+        spinlock_acquire(&blocker->writeqlock);
+        if (blocker->flow_suspended == dcb)
+        {
+            blocker->flow_suspended = NULL;
+            dcb->flow_suspended_by = NULL;
+        }
+        spinlock_release(&blocker->writeqlock);
+    }
+}
+
 /**
  * Last few things to do at end of a write
  *
@@ -1488,6 +2228,50 @@ dcb_write_tidy_up(DCB *dcb, bool below_water)
     {
         atomic_add(&dcb->stats.n_high_water, 1);
         dcb_call_callback(dcb, DCB_REASON_HIGH_WATER);
+        dcb_flow_suspend_source(dcb);
+    }
+}
+
+/**
+ * Hold the writes made by this thread in the write queues of the DCBs
+ * until the matching dcb_write_flush call. Called by the polling loop
+ * before an event handler is invoked.
+ */
+void
+dcb_write_cork()
+{
+    dcb_cork_depth++;
+}
+
+/**
+ * Flush the writes held since the matching dcb_write_cork call. The
+ * accumulated write queue of each corked DCB is drained once, so the
+ * pieces of a reply written separately by the event handler leave in
+ * a single writev.
+ */
+void
+dcb_write_flush()
+{
+    DCB *dcb;
+
+    if (--dcb_cork_depth > 0)
+    {
+        return;
+    }
+    while ((dcb = dcb_corked_list) != NULL)
+    {
+        dcb_corked_list = dcb->cork_next;
+        dcb->cork_next = NULL;
+        /*
+         * The flag is released before the drain so that a write made
+         * by another thread after the drain has picked up the queue
+         * corks the DCB afresh rather than relying on this flush.
+         */
+        __sync_bool_compare_and_swap(&dcb->cork_pending, true, false);
+        if (dcb->fd > 0 && !dcb->dcb_is_zombie)
+        {
+            dcb_drain_writeq(dcb);
+        }
     }
 }
 
@@ -1560,6 +2344,7 @@ dcb_drain_writeq(DCB *dcb)
     {
         atomic_add(&dcb->stats.n_low_water, 1);
         dcb_call_callback(dcb, DCB_REASON_LOW_WATER);
+        dcb_flow_resume_source(dcb);
     }
 
     return total_written;
@@ -1611,8 +2396,15 @@ dcb_close(DCB *dcb)
         return;
     }
 
-    spinlock_acquire(&zombiespin);
-    if (!dcb->dcb_is_zombie)
+    dcb_flow_release(dcb);
+
+    trace_event(TRC_DCB_CLOSE, (uintptr_t)dcb, dcb->fd);
+
+    /*
+     * The zombie marker guards against the DCB being retired twice;
+     * only the thread that wins the swap adds it to the zombie list.
+     */
+    if (__sync_bool_compare_and_swap(&dcb->dcb_is_zombie, false, true))
     {
         if (0 == dcb->persistentstart && dcb->server && DCB_STATE_POLLING == dcb->state)
         {
@@ -1624,23 +2416,8 @@ dcb_close(DCB *dcb)
                 dcb->user = strdup(user);
             }
         }
-        /*<
-         * Add closing dcb to the top of the list, setting zombie marker
-         */
-        dcb->dcb_is_zombie = true;
-        dcb->memdata.next = zombies;
-        zombies = dcb;
-        nzombies++;
-        if (nzombies > maxzombies) maxzombies = nzombies;
-        /*< Set bit for each maxscale thread. This should be done before
-         * the state is changed, so as to protect the DCB from premature
-         * destruction. */
-        if (dcb->server)
-        {
-            bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
-        }
+        dcb_zombie_add(dcb);
     }
-    spinlock_release(&zombiespin);
 }
 
 /**
@@ -1654,14 +2431,25 @@ static bool
 dcb_maybe_add_persistent(DCB *dcb)
 {
     int  poolcount = -1;
+    long poolmax = 0;
+
+    if (dcb->server)
+    {
+        /** A pool configured on the server takes precedence over the
+         * service level pool */
+        poolmax = dcb->server->persistpoolmax;
+        if (0 == poolmax && dcb->service)
+        {
+            poolmax = dcb->service->conn_pool_max;
+        }
+    }
     if (dcb->user != NULL
         && strlen(dcb->user)
-        && dcb->server
-        && dcb->server->persistpoolmax
+        && poolmax
         && (dcb->server->status & SERVER_RUNNING)
         && !dcb->dcb_errhandle_called
         && !(dcb->flags & DCBF_HUNG)
-        && (poolcount = dcb_persistent_clean_count(dcb, false)) < dcb->server->persistpoolmax)
+        && (poolcount = dcb_persistent_clean_count(dcb, false)) < poolmax)
     {
         DCB_CALLBACK *loopcallback;
         MXS_DEBUG("%lu [dcb_maybe_add_persistent] Adding DCB to persistent pool, user %s.\n",
@@ -1705,7 +2493,7 @@ dcb_maybe_add_persistent(DCB *dcb)
                   pthread_self(),
                   dcb,
                   dcb->user ? dcb->user : "",
-                  (dcb->server && dcb->server->persistpoolmax) ? dcb->server->persistpoolmax : 0,
+                  poolmax,
                   dcb->dcb_errhandle_called ? "true" : "false",
                   (dcb->flags & DCBF_HUNG) ? "true" : "false",
                   dcb->server ? dcb->server->status : 0,
@@ -1756,8 +2544,12 @@ printDCB(DCB *dcb)
     printf("\tStatistics:\n");
     printf("\t\tNo. of Reads:                       %d\n",
            dcb->stats.n_reads);
+    printf("\t\tBytes Read:                         %lu\n",
+           (unsigned long)dcb->stats.n_rbytes);
     printf("\t\tNo. of Writes:                      %d\n",
            dcb->stats.n_writes);
+    printf("\t\tBytes Written:                      %lu\n",
+           (unsigned long)dcb->stats.n_wbytes);
     printf("\t\tNo. of Buffered Writes:             %d\n",
            dcb->stats.n_buffered);
     printf("\t\tNo. of Accepts:                     %d\n",
@@ -1780,6 +2572,31 @@ spin_reporter(void *dcb, char *desc, int value)
     dcb_printf((DCB *)dcb, "\t\t%-40s  %d\n", desc, value);
 }
 
+/**
+ * Diagnostic to print the contention statistics of every spinlock in
+ * the registry. Only the long-lived global locks register themselves;
+ * the contention counters of the per-object locks are reported by the
+ * diagnostic routines of the objects that own them.
+ *
+ * @param pdcb  DCB to print results to
+ */
+void
+dprintAllSpinlocks(DCB *pdcb)
+{
+    SPINLOCK *lock;
+    const char *name;
+    int i = 0;
+
+    spinlock_register(&dcbspin, "DCB table");
+    dcb_printf(pdcb, " %-28s | %10s | %10s\n", "Lock", "Contended", "Sleeps");
+    dcb_printf(pdcb, "------------------------------+------------+------------\n");
+    while (spinlock_get_registered(i++, &lock, &name))
+    {
+        dcb_printf(pdcb, " %-28s | %10d | %10d\n", name,
+                   lock->n_contended, lock->n_sleeps);
+    }
+}
+
 
 /**
  * Diagnostic to print all DCB allocated in the system
@@ -1787,14 +2604,15 @@ spin_reporter(void *dcb, char *desc, int value)
  */
 void printAllDCBs()
 {
-    DCB *dcb;
+    int i;
 
     spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
-    while (dcb)
+    for (i = 0; i < dcb_table_size; i++)
     {
-        printDCB(dcb);
-        dcb = dcb->next;
+        if (dcb_table[i])
+        {
+            printDCB(dcb_table[i]);
+        }
     }
     spinlock_release(&dcbspin);
 }
@@ -1861,18 +2679,18 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
         dcb_printf(pdcb, "\tRole:                     %s\n", rolename);
         free(rolename);
     }
-    if (!bitmask_isallclear(&dcb->memdata.bitmask))
+    if (dcb->dcb_is_zombie)
     {
-        char *bitmasktext = bitmask_render_readable(&dcb->memdata.bitmask);
-        if (bitmasktext)
-        {
-            dcb_printf(pdcb, "\tBitMask:                %s\n", bitmasktext);
-            free(bitmasktext);
-        }
+        dcb_printf(pdcb, "\tRetired in epoch:         %lu\n",
+                   (unsigned long)dcb->memdata.retire_epoch);
     }
     dcb_printf(pdcb, "\tStatistics:\n");
     dcb_printf(pdcb, "\t\tNo. of Reads:             %d\n", dcb->stats.n_reads);
+    dcb_printf(pdcb, "\t\tBytes Read:               %lu\n",
+               (unsigned long)dcb->stats.n_rbytes);
     dcb_printf(pdcb, "\t\tNo. of Writes:            %d\n", dcb->stats.n_writes);
+    dcb_printf(pdcb, "\t\tBytes Written:            %lu\n",
+               (unsigned long)dcb->stats.n_wbytes);
     dcb_printf(pdcb, "\t\tNo. of Buffered Writes:   %d\n", dcb->stats.n_buffered);
     dcb_printf(pdcb, "\t\tNo. of Accepts:           %d\n", dcb->stats.n_accepts);
     dcb_printf(pdcb, "\t\tNo. of High Water Events: %d\n", dcb->stats.n_high_water);
@@ -1898,20 +2716,19 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
 void
 dprintAllDCBs(DCB *pdcb)
 {
-    DCB *dcb;
+    int i;
 
     spinlock_acquire(&dcbspin);
 #if SPINLOCK_PROFILE
-    dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
+    dcb_printf(pdcb, "DCB Table Spinlock Statistics:\n");
     spinlock_stats(&dcbspin, spin_reporter, pdcb);
-    dcb_printf(pdcb, "Zombie Queue Lock Statistics:\n");
-    spinlock_stats(&zombiespin, spin_reporter, pdcb);
 #endif
-    dcb = allDCBs;
-    while (dcb)
+    for (i = 0; i < dcb_table_size; i++)
     {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->next;
+        if (dcb_table[i])
+        {
+            dprintOneDCB(pdcb, dcb_table[i]);
+        }
     }
     spinlock_release(&dcbspin);
 }
@@ -1925,21 +2742,24 @@ void
 dListDCBs(DCB *pdcb)
 {
     DCB *dcb;
+    int i;
 
     spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
     dcb_printf(pdcb, "Descriptor Control Blocks\n");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
     dcb_printf(pdcb, " %-16s | %-26s | %-18s | %s\n",
                "DCB", "State", "Service", "Remote");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
-    while (dcb)
+    for (i = 0; i < dcb_table_size; i++)
     {
+        if ((dcb = dcb_table[i]) == NULL)
+        {
+            continue;
+        }
         dcb_printf(pdcb, " %-16p | %-26s | %-18s | %s\n",
                    dcb, gw_dcb_state2string(dcb->state),
                    ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
                    (dcb->remote ? dcb->remote : ""));
-        dcb = dcb->next;
     }
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n\n");
     spinlock_release(&dcbspin);
@@ -1954,16 +2774,20 @@ void
 dListClients(DCB *pdcb)
 {
     DCB *dcb;
+    int i;
 
     spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
     dcb_printf(pdcb, "Client Connections\n");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
     dcb_printf(pdcb, " %-15s | %-16s | %-20s | %s\n",
                "Client", "DCB", "Service", "Session");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
-    while (dcb)
+    for (i = 0; i < dcb_table_size; i++)
     {
+        if ((dcb = dcb_table[i]) == NULL)
+        {
+            continue;
+        }
         if (dcb_isclient(dcb) && dcb->dcb_role == DCB_ROLE_REQUEST_HANDLER)
         {
             dcb_printf(pdcb, " %-15s | %16p | %-20s | %10p\n",
@@ -1972,7 +2796,6 @@ dListClients(DCB *pdcb)
                              dcb->session->service->name : ""),
                        dcb->session);
         }
-        dcb = dcb->next;
     }
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n\n");
     spinlock_release(&dcbspin);
@@ -2033,8 +2856,12 @@ dprintDCB(DCB *pdcb, DCB *dcb)
     dcb_printf(pdcb, "\tStatistics:\n");
     dcb_printf(pdcb, "\t\tNo. of Reads:                     %d\n",
                dcb->stats.n_reads);
+    dcb_printf(pdcb, "\t\tBytes Read:                       %lu\n",
+               (unsigned long)dcb->stats.n_rbytes);
     dcb_printf(pdcb, "\t\tNo. of Writes:                    %d\n",
                dcb->stats.n_writes);
+    dcb_printf(pdcb, "\t\tBytes Written:                    %lu\n",
+               (unsigned long)dcb->stats.n_wbytes);
     dcb_printf(pdcb, "\t\tNo. of Buffered Writes:           %d\n",
                dcb->stats.n_buffered);
     dcb_printf(pdcb, "\t\tNo. of Accepts:                   %d\n",
@@ -2129,6 +2956,7 @@ dcb_printf(DCB *dcb, const char *fmt, ...)
     va_end(args);
 
     buf->end = GWBUF_DATA(buf) + strlen(GWBUF_DATA(buf));
+    buf->chlen = GWBUF_LENGTH(buf);
     dcb->func.write(dcb, buf);
 }
 
@@ -2246,9 +3074,22 @@ gw_write_SSL(DCB *dcb, bool *stop_writing)
     return written > 0 ? written : 0;
 }
 
+#if !defined(IOV_MAX)
+#define IOV_MAX         1024    /* Minimum value required by POSIX */
+#endif
+
+/** Number of iovec entries gathered into a single writev() call. Bounded
+ * both by the system limit and by the size of the on-stack array. */
+#define DCB_IOV_MAX     (IOV_MAX < 128 ? IOV_MAX : 128)
+
 /**
  * Write data to a DCB. The data is taken from the DCB's write queue.
  *
+ * Rather than issuing one write() per buffer in the chain, up to
+ * DCB_IOV_MAX chain links are gathered into a single writev() call.
+ * Result sets are queued as many small buffers, so this reduces the
+ * syscall rate considerably on read-heavy workloads.
+ *
  * @param dcb           The DCB to write buffer
  * @param stop_writing  Set to true if the caller should stop writing, false otherwise
  * @return              Number of written bytes
@@ -2260,8 +3101,18 @@ gw_write(DCB *dcb, bool *stop_writing)
     int fd = dcb->fd;
     size_t nbytes = GWBUF_LENGTH(dcb->writeq);
     void *buf = GWBUF_DATA(dcb->writeq);
+    struct iovec iov[DCB_IOV_MAX];
+    int iovcnt = 0;
+    GWBUF *next;
     int saved_errno;
 
+    for (next = dcb->writeq; next && iovcnt < DCB_IOV_MAX; next = next->next)
+    {
+        iov[iovcnt].iov_base = GWBUF_DATA(next);
+        iov[iovcnt].iov_len = GWBUF_LENGTH(next);
+        iovcnt++;
+    }
+
     errno = 0;
 
 #if defined(FAKE_CODE)
@@ -2278,12 +3129,12 @@ gw_write(DCB *dcb, bool *stop_writing)
     }
     else if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, iovcnt);
     }
 #else
     if (fd > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, iovcnt);
     }
 #endif /* FAKE_CODE */
 
@@ -2525,10 +3376,10 @@ dcb_call_callback(DCB *dcb, DCB_REASON reason)
 }
 
 /**
- * Check the passed DCB to ensure it is in the list of allDCBS
+ * Check the passed DCB to ensure it is in the table of all DCBs
  *
  * @param       dcb     The DCB to check
- * @return      1 if the DCB is in the list, otherwise 0
+ * @return      1 if the DCB is in the table, otherwise 0
  */
 int
 dcb_isvalid(DCB *dcb)
@@ -2546,42 +3397,22 @@ dcb_isvalid(DCB *dcb)
 }
 
 /**
- * Find a DCB in the list of all DCB's
- *
- * @param dcb       The DCB to find
- * @return          A pointer to the DCB or NULL if not in the list
- */
-static inline DCB *
-dcb_find_in_list (DCB *dcb)
-{
-    DCB *ptr = NULL;
-    if (dcb)
-    {
-        ptr = allDCBs;
-        while (ptr && ptr != dcb)
-        {
-            ptr = ptr->next;
-        }
-    }
-    return ptr;
-}
-
-/**
- * Check the passed DCB to ensure it is in the list of allDCBS.
- * Requires that the DCB list is already locked before call.
+ * Check the passed DCB to ensure it is in the table of all DCBs.
+ * Requires that the DCB table is already locked before call.
  *
  * @param       dcb     The DCB to check
- * @return      1 if the DCB is in the list, otherwise 0
+ * @return      1 if the DCB is in the table, otherwise 0
  */
 static inline int
 dcb_isvalid_nolock(DCB *dcb)
 {
-    return (dcb == dcb_find_in_list(dcb));
+    return (dcb->dcb_slot >= 0 && dcb->dcb_slot < dcb_table_size &&
+            dcb_table[dcb->dcb_slot] == dcb);
 }
 
 
 /**
- * Get the next DCB in the list of all DCB's
+ * Get the next DCB in the table of all DCB's
  *
  * @param dcb           The current DCB
  * @return      The pointer to the next DCB or NULL if this is the last
@@ -2589,14 +3420,25 @@ dcb_isvalid_nolock(DCB *dcb)
 static DCB *
 dcb_get_next(DCB *dcb)
 {
+    DCB *next = NULL;
+    int i = 0;
+
     spinlock_acquire(&dcbspin);
-    if (dcb) {
-        dcb = dcb_isvalid_nolock(dcb) ? dcb->next : NULL;
+    if (dcb)
+    {
+        i = dcb_isvalid_nolock(dcb) ? dcb->dcb_slot + 1 : dcb_table_size;
+    }
+    for (; i < dcb_table_size; i++)
+    {
+        if (dcb_table[i])
+        {
+            next = dcb_table[i];
+            break;
+        }
     }
-    else dcb = allDCBs;
     spinlock_release(&dcbspin);
 
-    return dcb;
+    return next;
 }
 
 /**
@@ -2618,11 +3460,15 @@ dcb_call_foreach(struct server* server, DCB_REASON reason)
     case DCB_REASON_NOT_RESPONDING:
     {
         DCB *dcb;
+        int i;
         spinlock_acquire(&dcbspin);
-        dcb = allDCBs;
 
-        while (dcb != NULL)
+        for (i = 0; i < dcb_table_size; i++)
         {
+            if ((dcb = dcb_table[i]) == NULL)
+            {
+                continue;
+            }
             spinlock_acquire(&dcb->dcb_initlock);
             if (dcb->state == DCB_STATE_POLLING && dcb->server &&
                 strcmp(dcb->server->unique_name,server->unique_name) == 0)
@@ -2630,7 +3476,6 @@ dcb_call_foreach(struct server* server, DCB_REASON reason)
                 dcb_call_callback(dcb, DCB_REASON_NOT_RESPONDING);
             }
             spinlock_release(&dcb->dcb_initlock);
-            dcb = dcb->next;
         }
         spinlock_release(&dcbspin);
         break;
@@ -2653,11 +3498,15 @@ dcb_hangup_foreach(struct server* server)
     MXS_DEBUG("%lu [dcb_hangup_foreach]", pthread_self());
 
     DCB *dcb;
+    int i;
     spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
 
-    while (dcb != NULL)
+    for (i = 0; i < dcb_table_size; i++)
     {
+        if ((dcb = dcb_table[i]) == NULL)
+        {
+            continue;
+        }
         spinlock_acquire(&dcb->dcb_initlock);
         if (dcb->state == DCB_STATE_POLLING && dcb->server &&
             strcmp(dcb->server->unique_name,server->unique_name) == 0)
@@ -2665,7 +3514,6 @@ dcb_hangup_foreach(struct server* server)
             poll_fake_hangup_event(dcb);
         }
         spinlock_release(&dcb->dcb_initlock);
-        dcb = dcb->next;
     }
     spinlock_release(&dcbspin);
 }
@@ -2798,11 +3646,15 @@ dcb_count_by_usage(DCB_USAGE usage)
 {
     int rval = 0;
     DCB *ptr;
+    int i;
 
     spinlock_acquire(&dcbspin);
-    ptr = allDCBs;
-    while (ptr)
+    for (i = 0; i < dcb_table_size; i++)
     {
+        if ((ptr = dcb_table[i]) == NULL)
+        {
+            continue;
+        }
         switch (usage)
         {
         case DCB_USAGE_CLIENT:
@@ -2840,7 +3692,6 @@ dcb_count_by_usage(DCB_USAGE usage)
             rval++;
             break;
         }
-        ptr = ptr->next;
     }
     spinlock_release(&dcbspin);
     return rval;
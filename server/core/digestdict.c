@@ -0,0 +1,200 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file digestdict.c  - Interned statement digest dictionary
+ *
+ * Every service has a dictionary that assigns each distinct canonical
+ * statement text a compact 32 bit identifier, allocated the first time
+ * the text is seen. The identifier is attached to the query buffer in
+ * the session routing path, so filters and routers that group, log or
+ * compare statements by shape work with integer identifiers instead of
+ * hashing and comparing kilobyte strings, and the text of each shape is
+ * stored once per service rather than once per consumer.
+ *
+ * The canonical form bounds the cardinality of the dictionary, since
+ * literal values are replaced in it; the cap below is a safety net for
+ * degenerate workloads, beyond which statements simply remain
+ * uninterned.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 04/07/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <digestdict.h>
+#include <spinlock.h>
+#include <hashtable.h>
+
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Buckets in the text to identifier map */
+#define DIGESTDICT_HASHSIZE     1024
+
+/** Cap on the identifiers assigned by one dictionary */
+#define DIGESTDICT_MAX          65536
+
+/** Initial size of the identifier to text array, doubled as needed */
+#define DIGESTDICT_INITIAL      256
+
+/**
+ * Allocate an empty dictionary.
+ *
+ * @return The dictionary or NULL if memory could not be allocated
+ */
+DIGESTDICT *
+digestdict_alloc()
+{
+    DIGESTDICT *dict;
+
+    if ((dict = (DIGESTDICT *)calloc(1, sizeof(DIGESTDICT))) == NULL)
+    {
+        return NULL;
+    }
+    if ((dict->ids = hashtable_alloc_str(DIGESTDICT_HASHSIZE)) == NULL)
+    {
+        free(dict);
+        return NULL;
+    }
+    spinlock_init(&dict->lock);
+    return dict;
+}
+
+/**
+ * Free a dictionary and every text interned in it.
+ *
+ * The caller must guarantee that no identifiers of the dictionary are
+ * resolved once the free has begun; in practice the dictionary is freed
+ * with the service that owns it.
+ *
+ * @param dict  The dictionary to free
+ */
+void
+digestdict_free(DIGESTDICT *dict)
+{
+    uint32_t i;
+
+    if (dict == NULL)
+    {
+        return;
+    }
+    hashtable_free(dict->ids);
+    for (i = 0; i < dict->n_texts; i++)
+    {
+        free(dict->texts[i]);
+    }
+    free(dict->texts);
+    free(dict);
+}
+
+/**
+ * Intern a canonical statement text, assigning an identifier on the
+ * first sight of the text and returning the same identifier on every
+ * subsequent call.
+ *
+ * @param dict          The dictionary
+ * @param canonical     The canonical statement text
+ * @return The identifier of the text, 0 if it could not be interned
+ */
+uint32_t
+digestdict_intern(DIGESTDICT *dict, const char *canonical)
+{
+    uint32_t id;
+    char *copy;
+
+    spinlock_acquire(&dict->lock);
+    id = (uint32_t)(uintptr_t)hashtable_fetch(dict->ids, (void *)canonical);
+    if (id == 0 && dict->n_texts < DIGESTDICT_MAX)
+    {
+        if (dict->n_texts == dict->size)
+        {
+            uint32_t newsize = dict->size ? 2 * dict->size
+                             : DIGESTDICT_INITIAL;
+            char **texts = (char **)realloc(dict->texts,
+                                            newsize * sizeof(char *));
+
+            if (texts == NULL)
+            {
+                spinlock_release(&dict->lock);
+                return 0;
+            }
+            dict->texts = texts;
+            dict->size = newsize;
+        }
+        if ((copy = strdup(canonical)) != NULL)
+        {
+            /* The hashtable stores the same allocation the text array
+             * references; neither copies the key. */
+            if (hashtable_add(dict->ids, copy,
+                              (void *)(uintptr_t)(dict->n_texts + 1)))
+            {
+                dict->texts[dict->n_texts] = copy;
+                dict->n_texts++;
+                id = dict->n_texts;
+            }
+            else
+            {
+                free(copy);
+            }
+        }
+    }
+    spinlock_release(&dict->lock);
+    return id;
+}
+
+/**
+ * Fetch the text of an interned identifier.
+ *
+ * The returned pointer remains valid for the lifetime of the
+ * dictionary; interned texts are never freed individually.
+ *
+ * @param dict  The dictionary
+ * @param id    The identifier to resolve
+ * @return The text of the identifier or NULL if it is not known
+ */
+const char *
+digestdict_text(DIGESTDICT *dict, uint32_t id)
+{
+    const char *text = NULL;
+
+    spinlock_acquire(&dict->lock);
+    if (id > 0 && id <= dict->n_texts)
+    {
+        text = dict->texts[id - 1];
+    }
+    spinlock_release(&dict->lock);
+    return text;
+}
+
+/**
+ * Return the number of identifiers a dictionary has assigned.
+ *
+ * @param dict  The dictionary
+ * @return The number of interned texts
+ */
+uint32_t
+digestdict_size(DIGESTDICT *dict)
+{
+    return dict ? dict->n_texts : 0;
+}
@@ -17,6 +17,32 @@
  */
 
 #include <externcmd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <thread.h>
+#include <spinlock.h>
+
+/** An executing command waiting to be reaped by the reaper thread */
+typedef struct extern_cmd_pending
+{
+    EXTERNCMD *cmd;             /*< The executing command */
+    time_t deadline;            /*< When the child is killed, 0 for no timeout */
+    int status;                 /*< Exit status once the child has been reaped */
+    EXTERNCMD_CB callback;      /*< Completion callback, may be NULL */
+    void *data;                 /*< User data passed to the callback */
+    struct extern_cmd_pending *next;
+} EXTERNCMD_PENDING;
+
+/** List of commands executing asynchronously */
+static EXTERNCMD_PENDING *pending_cmds = NULL;
+/** Spinlock that protects the pending command list */
+static SPINLOCK pending_lock = SPINLOCK_INIT;
+/** The reaper thread, started when the first asynchronous command is run */
+static THREAD reaper_thr_handle;
+static bool reaper_running = false;
+
+static void externcmd_reaper(void *data);
 
 /**
  * Tokenize a string into arguments suitable for a execvp call.
@@ -197,6 +223,137 @@ int externcmd_execute(EXTERNCMD* cmd)
     return rval;
 }
 
+/**
+ * The reaper thread.
+ *
+ * Polls the pending command list for children that have exited, reaping
+ * them with a non-blocking waitpid. A child that has run past its
+ * deadline is killed and reaped on the spot. Completion callbacks are
+ * invoked, and the commands freed, with the list lock released so that
+ * a callback may start further asynchronous commands.
+ *
+ * @param data Unused thread argument
+ */
+static void
+externcmd_reaper(void *data)
+{
+    EXTERNCMD_PENDING *ptr, *prev, *done;
+
+    while (true)
+    {
+        thread_millisleep(100);
+        done = NULL;
+        spinlock_acquire(&pending_lock);
+        ptr = pending_cmds;
+        prev = NULL;
+        while (ptr)
+        {
+            int status;
+            pid_t rc = waitpid(ptr->cmd->child, &status, WNOHANG);
+
+            if (rc == 0 && ptr->deadline != 0 && time(NULL) >= ptr->deadline)
+            {
+                MXS_WARNING("External command '%s' (pid %d) exceeded its "
+                            "timeout, killing it.",
+                            ptr->cmd->argv[0], ptr->cmd->child);
+                kill(ptr->cmd->child, SIGKILL);
+                rc = waitpid(ptr->cmd->child, &status, 0);
+            }
+
+            if (rc != 0)
+            {
+                if (prev)
+                {
+                    prev->next = ptr->next;
+                }
+                else
+                {
+                    pending_cmds = ptr->next;
+                }
+                EXTERNCMD_PENDING *next = ptr->next;
+                ptr->next = done;
+                ptr->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                done = ptr;
+                ptr = next;
+            }
+            else
+            {
+                prev = ptr;
+                ptr = ptr->next;
+            }
+        }
+        spinlock_release(&pending_lock);
+
+        while (done)
+        {
+            EXTERNCMD_PENDING *next = done->next;
+            if (done->callback)
+            {
+                done->callback(done->cmd, done->status, done->data);
+            }
+            externcmd_free(done->cmd);
+            free(done);
+            done = next;
+        }
+    }
+}
+
+/**
+ * Execute a command in a separate process without waiting for it.
+ *
+ * The command is handed over to the reaper thread, which collects the
+ * exit status of the child, kills it if it runs past the timeout and
+ * invokes the completion callback. Ownership of @c cmd passes to the
+ * reaper on success; the caller must not free or reuse it.
+ *
+ * @param cmd Command to execute
+ * @param timeout Seconds after which the child is killed, 0 for no timeout
+ * @param callback Completion callback, may be NULL
+ * @param data User data passed to the callback
+ * @return 0 on success, -1 on error
+ */
+int
+externcmd_execute_async(EXTERNCMD* cmd, int timeout, EXTERNCMD_CB callback, void* data)
+{
+    EXTERNCMD_PENDING *pending;
+
+    if ((pending = (EXTERNCMD_PENDING*)malloc(sizeof(EXTERNCMD_PENDING))) == NULL)
+    {
+        return -1;
+    }
+
+    spinlock_acquire(&pending_lock);
+    if (!reaper_running)
+    {
+        if (thread_start(&reaper_thr_handle, externcmd_reaper, NULL) == NULL)
+        {
+            spinlock_release(&pending_lock);
+            MXS_ERROR("Failed to start the external command reaper thread.");
+            free(pending);
+            return -1;
+        }
+        reaper_running = true;
+    }
+    spinlock_release(&pending_lock);
+
+    if (externcmd_execute(cmd) != 0)
+    {
+        free(pending);
+        return -1;
+    }
+
+    pending->cmd = cmd;
+    pending->deadline = timeout > 0 ? time(NULL) + timeout : 0;
+    pending->callback = callback;
+    pending->data = data;
+    spinlock_acquire(&pending_lock);
+    pending->next = pending_cmds;
+    pending_cmds = pending;
+    spinlock_release(&pending_lock);
+
+    return 0;
+}
+
 /**
  * Substitute all occurrences of @c match with @c replace in the arguments for @c cmd.
  * @param cmd External command
@@ -24,6 +24,10 @@
  *
  * Date         Who                     Description
  * 29/05/14     Mark Riddoch            Initial implementation
+ * 05/07/16     Mark Riddoch            Optional profiling of the time spent
+ *                                      in each filter of a chain
+ * 05/07/16     Mark Riddoch            Continuations for filters that offload
+ *                                      blocking work to helper threads
  *
  * @endverbatim
  */
@@ -37,11 +41,42 @@
 #include <spinlock.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <rdtsc.h>
+#include <statistics.h>
+#include <maxscale/poll.h>
 
 static SPINLOCK filter_spin = SPINLOCK_INIT;    /**< Protects the list of all filters */
 static FILTER_DEF *allFilters = NULL;           /**< The list of all filters */
+static int filter_profiling = 0;                /**< Filter profiling is active */
+
+/**
+ * The profiling probe of one filter within one session.
+ *
+ * When profiling is active a probe is interposed both above and below
+ * the filter in the chain: the entry points in the chain head and the
+ * downstream and upstream elements given to the filter all point at
+ * the probe, which forwards to the saved originals and accumulates
+ * the cycles spent in the call into the per-thread slots of the
+ * filter definition. Probes are drawn from the session arena, so they
+ * are freed with the session itself.
+ */
+typedef struct filter_probe
+{
+    FILTER_DEF *filter;    /**< The filter definition being profiled */
+    FILTER *instance;      /**< The filter instance */
+    void *session;         /**< The filter session */
+    int (*routeQuery)(FILTER *, void *, GWBUF *);
+                           /**< The routeQuery entry of the filter */
+    int (*clientReply)(FILTER *, void *, GWBUF *);
+                           /**< The clientReply entry of the filter */
+    DOWNSTREAM down;       /**< The real downstream of the filter */
+    UPSTREAM up;           /**< The real upstream of the filter */
+} FILTER_PROBE;
 
 static void filter_free_parameters(FILTER_DEF *filter);
+static FILTER_PROFILE_SLOT *filter_profile_slot(FILTER_DEF *filter);
+static void filter_print_profile(DCB *dcb, FILTER_DEF *filter, uint64_t total);
+static uint64_t filter_profile_self(FILTER_DEF *filter);
 
 /**
  * Allocate a new filter within MaxScale
@@ -67,6 +102,8 @@ filter_alloc(char *name, char *module)
     filter->options = NULL;
     filter->obj = NULL;
     filter->parameters = NULL;
+    filter->profile = (FILTER_PROFILE_SLOT *)calloc(FILTER_PROFILE_SLOTS,
+                                                    sizeof(FILTER_PROFILE_SLOT));
 
     spinlock_init(&filter->spin);
 
@@ -127,6 +164,7 @@ filter_free(FILTER_DEF *filter)
 
         filter_free_parameters(filter);
 
+        free(filter->profile);
         free(filter);
     }
 }
@@ -172,6 +210,97 @@ filter_standard_parameter(char *name)
     return 0;
 }
 
+/**
+ * Sum the self time of a filter over its per-thread profiling slots.
+ *
+ * The self time is the cycles spent in the entry points of the filter
+ * minus the cycles the filter spent calling the rest of the chain.
+ *
+ * @param filter        The filter to sum
+ * @return The profiled self time of the filter in cycles
+ */
+static uint64_t
+filter_profile_self(FILTER_DEF *filter)
+{
+    uint64_t route = 0, down = 0, reply = 0, up = 0;
+    int i;
+
+    if (filter->profile == NULL)
+    {
+        return 0;
+    }
+    for (i = 0; i < FILTER_PROFILE_SLOTS; i++)
+    {
+        route += filter->profile[i].v.route_cycles;
+        down += filter->profile[i].v.route_down;
+        reply += filter->profile[i].v.reply_cycles;
+        up += filter->profile[i].v.reply_up;
+    }
+    return (route > down ? route - down : 0)
+        + (reply > up ? reply - up : 0);
+}
+
+/**
+ * Print the profiling accumulators of a filter to a DCB.
+ *
+ * Nothing is printed for a filter that has not been called with
+ * profiling active.
+ *
+ * @param filter        The filter to print
+ * @param total         The summed self time of all filters, used to
+ *                      compute the share of this filter
+ */
+static void
+filter_print_profile(DCB *dcb, FILTER_DEF *filter, uint64_t total)
+{
+    uint64_t route = 0, down = 0, rcalls = 0;
+    uint64_t reply = 0, up = 0, pcalls = 0;
+    uint64_t self;
+    int i;
+
+    if (filter->profile == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < FILTER_PROFILE_SLOTS; i++)
+    {
+        route += filter->profile[i].v.route_cycles;
+        down += filter->profile[i].v.route_down;
+        rcalls += filter->profile[i].v.route_calls;
+        reply += filter->profile[i].v.reply_cycles;
+        up += filter->profile[i].v.reply_up;
+        pcalls += filter->profile[i].v.reply_calls;
+    }
+    if (rcalls == 0 && pcalls == 0)
+    {
+        return;
+    }
+    self = (route > down ? route - down : 0)
+        + (reply > up ? reply - up : 0);
+    dcb_printf(dcb, "\tProfile (cycles):\n");
+    if (rcalls)
+    {
+        dcb_printf(dcb,
+                   "\t\trouteQuery:  %20lu calls %20lu self (%lu per call)\n",
+                   (unsigned long)rcalls,
+                   (unsigned long)(route > down ? route - down : 0),
+                   (unsigned long)((route > down ? route - down : 0) / rcalls));
+    }
+    if (pcalls)
+    {
+        dcb_printf(dcb,
+                   "\t\tclientReply: %20lu calls %20lu self (%lu per call)\n",
+                   (unsigned long)pcalls,
+                   (unsigned long)(reply > up ? reply - up : 0),
+                   (unsigned long)((reply > up ? reply - up : 0) / pcalls));
+    }
+    if (total)
+    {
+        dcb_printf(dcb, "\t\tShare of filter self time: %lu%%\n",
+                   (unsigned long)((self * 100) / total));
+    }
+}
+
 /**
  * Print all filters to a DCB
  *
@@ -182,9 +311,14 @@ void
 dprintAllFilters(DCB *dcb)
 {
     FILTER_DEF *ptr;
+    uint64_t   total = 0;
     int        i;
 
     spinlock_acquire(&filter_spin);
+    for (ptr = allFilters; ptr; ptr = ptr->next)
+    {
+        total += filter_profile_self(ptr);
+    }
     ptr = allFilters;
     while (ptr)
     {
@@ -207,6 +341,7 @@ dprintAllFilters(DCB *dcb)
         {
             dcb_printf(dcb, "\tModule not loaded.\n");
         }
+        filter_print_profile(dcb, ptr, total);
         ptr = ptr->next;
     }
     spinlock_release(&filter_spin);
@@ -221,8 +356,17 @@ dprintAllFilters(DCB *dcb)
 void
 dprintFilter(DCB *dcb, FILTER_DEF *filter)
 {
+    FILTER_DEF *ptr;
+    uint64_t   total = 0;
     int i;
 
+    spinlock_acquire(&filter_spin);
+    for (ptr = allFilters; ptr; ptr = ptr->next)
+    {
+        total += filter_profile_self(ptr);
+    }
+    spinlock_release(&filter_spin);
+
     dcb_printf(dcb, "Filter %p (%s)\n", filter, filter->name);
     dcb_printf(dcb, "\tModule:      %s\n", filter->module);
     if (filter->options)
@@ -238,6 +382,7 @@ dprintFilter(DCB *dcb, FILTER_DEF *filter)
     {
         filter->obj->diagnostics(filter->filter, NULL, dcb);
     }
+    filter_print_profile(dcb, filter, total);
 }
 
 /**
@@ -395,23 +540,219 @@ bool filter_load(FILTER_DEF* filter)
     return rval;
 }
 
+/**
+ * Enable or disable the profiling of filter chains.
+ *
+ * Profiling applies to the filter chains of sessions created after the
+ * mode is enabled; the chains of existing sessions are left untouched.
+ * The accumulators of all filters are reset on enabling, so the shares
+ * reported by dprintFilter cover the period since the last enable.
+ *
+ * @param enable        Zero to disable profiling, non-zero to enable it
+ */
+void
+filterProfiling(int enable)
+{
+    FILTER_DEF *ptr;
+
+    if (enable)
+    {
+        spinlock_acquire(&filter_spin);
+        for (ptr = allFilters; ptr; ptr = ptr->next)
+        {
+            if (ptr->profile)
+            {
+                memset(ptr->profile, 0,
+                       FILTER_PROFILE_SLOTS * sizeof(FILTER_PROFILE_SLOT));
+            }
+        }
+        spinlock_release(&filter_spin);
+    }
+    filter_profiling = enable ? 1 : 0;
+}
+
+/**
+ * Report whether filter profiling is currently active
+ *
+ * @return      Non-zero if filter profiling is active
+ */
+int
+filterProfilingActive()
+{
+    return filter_profiling;
+}
+
+/**
+ * Return the profiling slot of the calling thread for a filter
+ *
+ * @param filter        The filter being profiled
+ * @return The per-thread profiling slot
+ */
+static FILTER_PROFILE_SLOT *
+filter_profile_slot(FILTER_DEF *filter)
+{
+    return &filter->profile[ts_stats_get_thread_id() % FILTER_PROFILE_SLOTS];
+}
+
+/**
+ * The routeQuery entry point of a profiling probe.
+ *
+ * Forwards to the routeQuery of the profiled filter, accumulating the
+ * cycles spent in the call. The time the filter itself spends passing
+ * the query downstream is recorded separately by the downstream probe,
+ * so the self time of the filter can be computed as the difference.
+ *
+ * @param instance      The profiling probe
+ * @param session       The filter session, unused
+ * @param queue         The query being routed
+ * @return The return value of the filter routeQuery
+ */
+static int
+filter_probe_routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    FILTER_PROBE *probe = (FILTER_PROBE *)instance;
+    FILTER_PROFILE_SLOT *slot = filter_profile_slot(probe->filter);
+    CYCLES start = rdtsc();
+    int rval;
+
+    rval = probe->routeQuery(probe->instance, probe->session, queue);
+    slot->v.route_cycles += rdtsc() - start;
+    slot->v.route_calls++;
+    return rval;
+}
+
+/**
+ * The routeQuery entry point of the downstream element a profiled
+ * filter passes its queries to.
+ *
+ * Forwards to the real downstream of the filter, accumulating the
+ * cycles the filter spent waiting on the rest of the chain.
+ *
+ * @param instance      The profiling probe
+ * @param session       The filter session, unused
+ * @param queue         The query being routed
+ * @return The return value of the downstream routeQuery
+ */
+static int
+filter_probe_down_routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    FILTER_PROBE *probe = (FILTER_PROBE *)instance;
+    FILTER_PROFILE_SLOT *slot = filter_profile_slot(probe->filter);
+    CYCLES start = rdtsc();
+    int rval;
+
+    rval = probe->down.routeQuery(probe->down.instance,
+                                  probe->down.session,
+                                  queue);
+    slot->v.route_down += rdtsc() - start;
+    return rval;
+}
+
+/**
+ * The clientReply entry point of a profiling probe.
+ *
+ * Forwards to the clientReply of the profiled filter, accumulating the
+ * cycles spent in the call.
+ *
+ * @param instance      The profiling probe
+ * @param session       The filter session, unused
+ * @param queue         The reply being returned
+ * @return The return value of the filter clientReply
+ */
+static int
+filter_probe_clientReply(FILTER *instance, void *session, GWBUF *queue)
+{
+    FILTER_PROBE *probe = (FILTER_PROBE *)instance;
+    FILTER_PROFILE_SLOT *slot = filter_profile_slot(probe->filter);
+    CYCLES start = rdtsc();
+    int rval;
+
+    rval = probe->clientReply(probe->instance, probe->session, queue);
+    slot->v.reply_cycles += rdtsc() - start;
+    slot->v.reply_calls++;
+    return rval;
+}
+
+/**
+ * The clientReply entry point of the upstream element a profiled
+ * filter passes its replies to.
+ *
+ * Forwards to the real upstream of the filter, accumulating the cycles
+ * the filter spent waiting on the rest of the chain.
+ *
+ * @param instance      The profiling probe
+ * @param session       The filter session, unused
+ * @param queue         The reply being returned
+ * @return The return value of the upstream clientReply
+ */
+static int
+filter_probe_up_clientReply(FILTER *instance, void *session, GWBUF *queue)
+{
+    FILTER_PROBE *probe = (FILTER_PROBE *)instance;
+    FILTER_PROFILE_SLOT *slot = filter_profile_slot(probe->filter);
+    CYCLES start = rdtsc();
+    int rval;
+
+    rval = probe->up.clientReply(probe->up.instance,
+                                 probe->up.session,
+                                 queue);
+    slot->v.reply_up += rdtsc() - start;
+    return rval;
+}
+
+/**
+ * The error entry point of the upstream element a profiled filter
+ * passes its replies to. Simply forwards to the real upstream.
+ *
+ * @param instance      The profiling probe
+ * @param session       The filter session, unused
+ * @param data          The error data
+ * @return The return value of the upstream error entry
+ */
+static int
+filter_probe_up_error(void *instance, void *session, void *data)
+{
+    FILTER_PROBE *probe = (FILTER_PROBE *)instance;
+
+    if (probe->up.error)
+    {
+        return probe->up.error(probe->up.instance, probe->up.session, data);
+    }
+    return 0;
+}
+
 /**
  * Connect the downstream filter chain for a filter.
  *
  * This will create the filter instance, loading the filter module, and
  * conenct the fitler into the downstream chain.
  *
+ * If filter profiling is active a profiling probe is allocated from
+ * the session arena and interposed on both sides of the filter: the
+ * returned element routes into the filter via the probe and the
+ * downstream the filter sees is the probe as well, so the cycles the
+ * filter spends before passing a query on can be attributed to it. The
+ * probe is returned through the probe parameter so that the caller can
+ * hand it back to filterUpstream when wiring the reply side.
+ *
  * @param filter        The filter to add into the chain
  * @param session       The client session
  * @param downstream    The filter downstream of this filter
+ * @param probe         Returns the profiling probe of the filter, or
+ *                      NULL when profiling is not active
  * @return              The downstream component for the next filter or NULL
  *                      if the filter could not be created
  */
 DOWNSTREAM *
-filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream)
+filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream, void **probe)
 {
     DOWNSTREAM *me;
+    FILTER_PROBE *fp;
 
+    if (probe)
+    {
+        *probe = NULL;
+    }
     if ((me = (DOWNSTREAM *)calloc(1, sizeof(DOWNSTREAM))) == NULL)
     {
         char errbuf[STRERROR_BUFLEN];
@@ -430,7 +771,33 @@ filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream)
         free(me);
         return NULL;
     }
-    filter->obj->setDownstream(me->instance, me->session, downstream);
+    if (filter_profiling && probe && filter->profile
+        && (fp = session_arena_alloc(session, sizeof(FILTER_PROBE))) != NULL)
+    {
+        DOWNSTREAM probed;
+
+        memset(fp, 0, sizeof(FILTER_PROBE));
+        fp->filter = filter;
+        fp->instance = filter->filter;
+        fp->session = me->session;
+        fp->routeQuery = filter->obj->routeQuery;
+        fp->clientReply = filter->obj->clientReply;
+        fp->down = *downstream;
+
+        /*< The filter copies the downstream element, so a local is fine */
+        probed.instance = (void *)fp;
+        probed.session = me->session;
+        probed.routeQuery = (void *)filter_probe_down_routeQuery;
+        filter->obj->setDownstream(me->instance, me->session, &probed);
+
+        me->instance = (void *)fp;
+        me->routeQuery = (void *)filter_probe_routeQuery;
+        *probe = fp;
+    }
+    else
+    {
+        filter->obj->setDownstream(me->instance, me->session, downstream);
+    }
 
     return me;
 }
@@ -443,15 +810,22 @@ filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream)
  * Note all filters require to be in the upstream chain, so this routine
  * may skip a filter if it does not provide an upstream interface.
  *
+ * If a profiling probe was created for the filter by filterApply it
+ * is passed in here and interposed on both sides of the reply path in
+ * the same fashion as on the query path.
+ *
  * @param filter        The fitler to add to the chain
  * @param fsession      The filter session
  * @param upstream      The filter that should be upstream of this filter
+ * @param probe         The profiling probe of the filter, or NULL when
+ *                      profiling is not active
  * @return              The upstream component for the next filter
  */
 UPSTREAM *
-filterUpstream(FILTER_DEF *filter, void *fsession, UPSTREAM *upstream)
+filterUpstream(FILTER_DEF *filter, void *fsession, UPSTREAM *upstream, void *probe)
 {
     UPSTREAM *me = NULL;
+    FILTER_PROBE *fp = (FILTER_PROBE *)probe;
 
     /*
      * The the filter has no setUpstream entry point then is does
@@ -471,7 +845,152 @@ filterUpstream(FILTER_DEF *filter, void *fsession, UPSTREAM *upstream)
         me->instance = filter->filter;
         me->session = fsession;
         me->clientReply = (void *)(filter->obj->clientReply);
-        filter->obj->setUpstream(me->instance, me->session, upstream);
+        if (fp)
+        {
+            UPSTREAM probed;
+
+            fp->up = *upstream;
+
+            /*< The filter copies the upstream element, so a local is fine */
+            probed.instance = (void *)fp;
+            probed.session = fsession;
+            probed.clientReply = (void *)filter_probe_up_clientReply;
+            probed.error = filter_probe_up_error;
+            filter->obj->setUpstream(me->instance, me->session, &probed);
+
+            me->instance = (void *)fp;
+            me->clientReply = (void *)filter_probe_clientReply;
+        }
+        else
+        {
+            filter->obj->setUpstream(me->instance, me->session, upstream);
+        }
     }
     return me;
 }
+
+/**
+ * The read entry point of the internal DCB of a filter continuation.
+ *
+ * This runs on a polling thread when filter_resume has injected the
+ * parked query as a fake read event, and routes the query to the
+ * downstream element that was captured when the query was parked. The
+ * continuation and its DCB are one-shot and are released here.
+ *
+ * @param dcb   The internal DCB of the continuation
+ * @return The return value of the downstream routeQuery
+ */
+static int
+filter_cont_read(DCB *dcb)
+{
+    FILTER_CONT *cont = (FILTER_CONT *)dcb->data;
+    GWBUF *queue = dcb->dcb_readqueue;
+    int rval = 1;
+
+    dcb->dcb_readqueue = NULL;
+    if (cont == NULL)
+    {
+        return rval;
+    }
+    dcb->data = NULL;
+
+    if (queue && cont->session->state == SESSION_STATE_ROUTER_READY)
+    {
+        rval = cont->down.routeQuery(cont->down.instance,
+                                     cont->down.session,
+                                     queue);
+    }
+    else
+    {
+        while (queue && (queue = gwbuf_consume(queue, gwbuf_length(queue))))
+        {
+            ;
+        }
+    }
+
+    dcb->session = NULL;
+    dcb_close(dcb);
+    free(cont);
+    return rval;
+}
+
+/**
+ * Park a query so that a filter can complete blocking work on a helper
+ * thread before the chain continues.
+ *
+ * The caller must return from its routeQuery without touching the query
+ * again; the continuation owns the buffer until it is resumed or
+ * discarded.
+ *
+ * @param session       The session the query belongs to
+ * @param down          The downstream element to resume the chain at
+ * @param queue         The query to park
+ * @return The continuation or NULL if memory allocation failed, in which
+ * case the query was not parked and remains owned by the caller
+ */
+FILTER_CONT *
+filter_park(SESSION *session, DOWNSTREAM *down, GWBUF *queue)
+{
+    FILTER_CONT *cont;
+    DCB *dcb;
+
+    if ((cont = (FILTER_CONT *)malloc(sizeof(FILTER_CONT))) == NULL)
+    {
+        return NULL;
+    }
+    if ((dcb = dcb_alloc(DCB_ROLE_REQUEST_HANDLER)) == NULL)
+    {
+        free(cont);
+        return NULL;
+    }
+    dcb->func.read = filter_cont_read;
+    dcb->state = DCB_STATE_POLLING;
+    dcb->session = session;
+    dcb->data = (void *)cont;
+    cont->session = session;
+    cont->down = *down;
+    cont->queue = queue;
+    cont->dcb = dcb;
+    return cont;
+}
+
+/**
+ * Resume the filter chain of a parked query.
+ *
+ * May be called from any thread; the parked query is added to the event
+ * queue of the polling system as a fake read event on the internal DCB
+ * of the continuation, so the downstream chain executes on a polling
+ * thread. The continuation is freed once the query has been routed.
+ *
+ * @param cont  The continuation returned by filter_park
+ */
+void
+filter_resume(FILTER_CONT *cont)
+{
+    GWBUF *queue = cont->queue;
+
+    cont->queue = NULL;
+    poll_add_epollin_event_to_dcb(cont->dcb, queue);
+}
+
+/**
+ * Discard a parked query without routing it, freeing the query buffer
+ * and the continuation. Used when the session is closed while work was
+ * outstanding on a helper thread.
+ *
+ * @param cont  The continuation returned by filter_park
+ */
+void
+filter_discard(FILTER_CONT *cont)
+{
+    while (cont->queue &&
+           (cont->queue = gwbuf_consume(cont->queue,
+                                        gwbuf_length(cont->queue))))
+    {
+        ;
+    }
+    cont->dcb->data = NULL;
+    cont->dcb->session = NULL;
+    dcb_close(cont->dcb);
+    free(cont);
+}
@@ -66,8 +66,10 @@
 #include <maxconfig.h>
 #include <maxscale/poll.h>
 #include <housekeeper.h>
+#include <shmstats.h>
 #include <service.h>
 #include <memlog.h>
+#include <memaccount.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -394,6 +396,20 @@ sigfatal_handler(int i)
 
     mxs_log_flush_sync();
 
+    /** Preserve the flight recorder rings alongside the core */
+    {
+        char path[PATH_MAX];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/maxscale.trace", get_datadir());
+        if ((fp = fopen(path, "w")) != NULL)
+        {
+            trace_dump(fp);
+            fclose(fp);
+            fprintf(stderr, "Flight recorder written to %s\n", path);
+        }
+    }
+
     /* re-raise signal to enforce core dump */
     fprintf(stderr, "\n\nWriting core dump\n");
     signal_set(i, SIG_DFL);
@@ -1940,6 +1956,29 @@ int main(int argc, char **argv)
      */
     hkinit();
 
+    /*<
+     * Create the statistics export segment for external monitoring
+     * agents, refreshed by a housekeeper task.
+     */
+    shmstats_init();
+
+    /*<
+     * Begin the periodic checks of memory usage against the configured
+     * memory budget.
+     */
+    memacct_set_budget(config_memory_budget());
+    memacct_init();
+
+    /*<
+     * Start the SSL handshake offload threads, if any are configured.
+     */
+    ssl_offload_init(config_ssl_offload_threads());
+
+    /*<
+     * Start the background resolver thread of the hostname cache.
+     */
+    dns_cache_init();
+
     /*<
      * Start the polling threads, note this is one less than is
      * configured as the main thread will also poll.
@@ -2031,6 +2070,7 @@ shutdown_server()
 {
     service_shutdown();
     poll_shutdown();
+    shmstats_shutdown();
     hkshutdown();
     memlog_flush_all();
     log_flush_shutdown();
@@ -27,6 +27,7 @@
  *
  * Date         Who                     Description
  * 02/02/16     Martin Brampton         Initial implementation
+ * 28/06/16     Martin Brampton         SSL handshake offload thread pool
  *
  * @endverbatim
  */
@@ -37,8 +38,185 @@
 #include <dcb.h>
 #include <service.h>
 #include <log_manager.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <skygw_utils.h>
+#include <maxscale/poll.h>
 #include <sys/ioctl.h>
 
+/**
+ * The SSL handshake offload queue. The CPU-heavy part of an SSL handshake,
+ * the asymmetric key operation performed by SSL_accept when the client key
+ * exchange arrives, can monopolise a polling thread for milliseconds. When a
+ * pool of offload threads has been configured (the "ssl_offload_threads"
+ * global parameter), DCBs in the SSL_HANDSHAKE_REQUIRED state are queued
+ * here instead of calling SSL_accept on the polling thread. An offload
+ * thread runs the handshake step and hands the DCB back to the poll loop
+ * with a faked read event once it has made progress.
+ *
+ * A DCB with ssl_offload_queued set is owned by the offload pool; the
+ * polling threads skip its read events and the zombie processing defers
+ * its final free until the flag is cleared.
+ */
+static SPINLOCK ssl_offload_lock = SPINLOCK_INIT;
+static DCB *ssl_offload_head = NULL;
+static DCB *ssl_offload_tail = NULL;
+static skygw_message_t *ssl_offload_mes = NULL;
+static int ssl_offload_nthreads = 0;
+
+static void ssl_offload_main(void *data);
+
+/**
+ * @brief Start the SSL handshake offload thread pool.
+ *
+ * Called once at startup, before the polling threads are started. If the
+ * requested thread count is zero the pool is not created and handshakes
+ * continue to run inline on the polling threads.
+ *
+ * @param nthreads Number of offload threads requested
+ * @return The number of threads actually started
+ */
+int
+ssl_offload_init(int nthreads)
+{
+    THREAD thread;
+    int started = 0;
+
+    if (nthreads <= 0)
+    {
+        return 0;
+    }
+    if ((ssl_offload_mes = skygw_message_init()) == NULL)
+    {
+        MXS_ERROR("Failed to initialise the SSL offload message; "
+                  "SSL handshakes will run on the polling threads.");
+        return 0;
+    }
+    while (started < nthreads)
+    {
+        if (thread_start(&thread, ssl_offload_main, NULL) == NULL)
+        {
+            MXS_ERROR("Failed to start SSL offload thread %d of %d.",
+                      started + 1, nthreads);
+            break;
+        }
+        started++;
+    }
+    ssl_offload_nthreads = started;
+    if (started)
+    {
+        MXS_NOTICE("Started %d SSL handshake offload thread%s.",
+                   started, started == 1 ? "" : "s");
+    }
+    return started;
+}
+
+/**
+ * @brief Queue a DCB for an SSL handshake step on an offload thread.
+ *
+ * Returns false if the offload pool is not running, in which case the
+ * caller must perform the handshake step itself by calling dcb_accept_SSL.
+ * If the DCB is already queued, or being processed by an offload thread,
+ * the call succeeds without queueing it a second time; the pending read
+ * data will be picked up by the next SSL_accept on the offload thread or
+ * by the faked read event that follows it.
+ *
+ * @param dcb The client DCB in the SSL_HANDSHAKE_REQUIRED state
+ * @return True if the handshake step will be run by the offload pool
+ */
+bool
+ssl_handshake_offload(DCB *dcb)
+{
+    if (0 == ssl_offload_nthreads)
+    {
+        return false;
+    }
+    spinlock_acquire(&ssl_offload_lock);
+    if (dcb->ssl_offload_queued)
+    {
+        spinlock_release(&ssl_offload_lock);
+        return true;
+    }
+    dcb->ssl_offload_queued = true;
+    dcb->ssl_offload_next = NULL;
+    if (ssl_offload_tail)
+    {
+        ssl_offload_tail->ssl_offload_next = dcb;
+    }
+    else
+    {
+        ssl_offload_head = dcb;
+    }
+    ssl_offload_tail = dcb;
+    spinlock_release(&ssl_offload_lock);
+    skygw_message_send(ssl_offload_mes);
+    return true;
+}
+
+/**
+ * The entry point of each SSL offload thread. Waits for work, then drains
+ * the queue, running one SSL_accept step for each queued DCB. A completed
+ * handshake is handed back to the poll loop with a faked read event so that
+ * the protocol read routine runs on a polling thread as usual; a handshake
+ * that is still waiting for data from the client is simply released, and
+ * the next real read event will queue it again. Failures need no action
+ * here because dcb_accept_SSL has already faked a hangup event.
+ *
+ * @param data Thread data, unused
+ */
+static void
+ssl_offload_main(void *data)
+{
+    DCB *dcb;
+    int rc;
+
+    while (true)
+    {
+        skygw_message_wait(ssl_offload_mes);
+        while (true)
+        {
+            spinlock_acquire(&ssl_offload_lock);
+            if ((dcb = ssl_offload_head) != NULL)
+            {
+                ssl_offload_head = dcb->ssl_offload_next;
+                if (NULL == ssl_offload_head)
+                {
+                    ssl_offload_tail = NULL;
+                }
+            }
+            spinlock_release(&ssl_offload_lock);
+            if (NULL == dcb)
+            {
+                break;
+            }
+            dcb->ssl_offload_next = NULL;
+            if (DCB_STATE_POLLING != dcb->state)
+            {
+                /* Closed while queued; just release it to the zombie processing */
+                dcb->ssl_offload_queued = false;
+                continue;
+            }
+            rc = dcb_accept_SSL(dcb);
+            dcb->ssl_offload_queued = false;
+            if (1 == rc)
+            {
+                poll_fake_read_event(dcb);
+            }
+            else if (0 == rc)
+            {
+                int b = 0;
+                /* A read event may have been consumed while the DCB was
+                 * queued; if data is waiting, hand it to the poll loop. */
+                ioctl(dcb->fd, FIONREAD, &b);
+                if (b != 0)
+                {
+                    poll_fake_read_event(dcb);
+                }
+            }
+        }
+    }
+}
+
 /**
  * @brief Check client's SSL capability and start SSL if appropriate.
  *
@@ -87,6 +265,12 @@ int ssl_authenticate_client(DCB *dcb, const char *user, bool is_capable)
          * will trigger dcb_accept_SSL. This situation does not result in a
          * negative return code - that indicates a real failure.
          */
+        if (ssl_handshake_offload(dcb))
+        {
+            MXS_INFO("User %s@%s connect to service '%s' with SSL queued to offload thread.",
+                user, remote, service);
+            return SSL_AUTH_CHECKS_OK;
+        }
         return_code = dcb_accept_SSL(dcb);
         if (return_code < 0)
         {
@@ -35,6 +35,8 @@
  * 06-02-2014   Mark Riddoch            Added parse_bindconfig
  * 10-02-2014   Massimiliano Pinto      Added return code to setipaddress
  * 02-09-2014   Martin Brampton         Replace C++ comment with C comment
+ * 30-06-2016   Mark Riddoch            Hostname cache with asynchronous
+ *                                      refresh added to setipaddress
  *
  *@endverbatim
  */
@@ -42,21 +44,249 @@
 #include <gw.h>
 #include <dcb.h>
 #include <session.h>
+#include <thread.h>
+#include <arpa/inet.h>
 
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 SPINLOCK tmplock = SPINLOCK_INIT;
 
+/**
+ * The hostname resolution cache.
+ *
+ * setipaddress is called on the polling threads for every backend
+ * connection made, and a getaddrinfo call there stalls all event
+ * processing on the thread for as long as the DNS server cares to take;
+ * stalls of several seconds have been seen from a single slow server.
+ *
+ * Resolved names are therefore cached with a TTL. A lookup that finds
+ * an expired entry returns the stale address immediately and hands the
+ * name to a resolver thread to refresh in the background, so once a
+ * name has been seen, no lookup of it ever blocks the caller again.
+ * Only the very first lookup of a name resolves synchronously.
+ */
+#define DNS_CACHE_HASHSIZE  64      /*< Number of hash chains in the cache */
+#define DNS_CACHE_TTL       300     /*< Seconds an entry stays fresh */
+
+typedef struct dns_entry
+{
+    char            *name;      /*< The hostname, the cache key */
+    struct in_addr  addr;       /*< The resolved address */
+    time_t          expires;    /*< The time at which the entry goes stale */
+    bool            refreshing; /*< An asynchronous refresh is in flight */
+    struct dns_entry *next;     /*< Next entry in the hash chain */
+    struct dns_entry *refresh_next; /*< Next entry in the refresh queue */
+} DNS_ENTRY;
+
+static SPINLOCK dns_cache_lock = SPINLOCK_INIT;
+static DNS_ENTRY *dns_cache[DNS_CACHE_HASHSIZE];
+
+/** The queue of entries awaiting refresh and the resolver thread */
+static DNS_ENTRY *dns_refresh_head = NULL;
+static DNS_ENTRY *dns_refresh_tail = NULL;
+static skygw_message_t *dns_refresh_mes = NULL;
+
+static int gw_resolve_hostname(struct in_addr *a, char *p);
+
+/**
+ * Hash a hostname onto a cache chain
+ *
+ * @param p     The hostname
+ * @return The chain index
+ */
+static unsigned int
+dns_cache_hash(const char *p)
+{
+    unsigned int hash = 5381;
+
+    while (*p)
+    {
+        hash = hash * 33 + *p++;
+    }
+
+    return hash % DNS_CACHE_HASHSIZE;
+}
+
+/**
+ * Find a cache entry for a hostname. The cache lock must be held by
+ * the caller.
+ *
+ * @param p     The hostname
+ * @return The entry or NULL if the name has never been resolved
+ */
+static DNS_ENTRY *
+dns_cache_find(const char *p)
+{
+    DNS_ENTRY *entry = dns_cache[dns_cache_hash(p)];
+
+    while (entry && strcmp(entry->name, p) != 0)
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/**
+ * The main loop of the resolver thread. Wait to be told of stale
+ * entries, resolve them with the blocking call this thread exists to
+ * absorb, and write the fresh addresses back into the cache. A failed
+ * refresh keeps the stale address and is retried when the entry next
+ * expires.
+ *
+ * @param data  Unused thread argument
+ */
+static void
+dns_refresh_main(void *data)
+{
+    DNS_ENTRY *entry;
+    struct in_addr addr;
+
+    while (1)
+    {
+        skygw_message_wait(dns_refresh_mes);
+        spinlock_acquire(&dns_cache_lock);
+        while ((entry = dns_refresh_head) != NULL)
+        {
+            if ((dns_refresh_head = entry->refresh_next) == NULL)
+            {
+                dns_refresh_tail = NULL;
+            }
+            entry->refresh_next = NULL;
+            spinlock_release(&dns_cache_lock);
+
+            if (gw_resolve_hostname(&addr, entry->name))
+            {
+                spinlock_acquire(&dns_cache_lock);
+                entry->addr = addr;
+            }
+            else
+            {
+                MXS_WARNING("Background refresh of hostname '%s' failed, "
+                            "the previously resolved address remains in use.",
+                            entry->name);
+                spinlock_acquire(&dns_cache_lock);
+            }
+            entry->expires = time(NULL) + DNS_CACHE_TTL;
+            entry->refreshing = false;
+        }
+        spinlock_release(&dns_cache_lock);
+    }
+}
+
+/**
+ * Start the background resolver thread of the hostname cache. Until
+ * this is called expired entries are simply refreshed synchronously.
+ */
+void
+dns_cache_init()
+{
+    THREAD thread;
+
+    if ((dns_refresh_mes = skygw_message_init()) == NULL ||
+        thread_start(&thread, dns_refresh_main, NULL) == NULL)
+    {
+        MXS_ERROR("Failed to start the hostname resolver thread; "
+                  "expired hostnames will be refreshed synchronously.");
+        dns_refresh_mes = NULL;
+    }
+}
+
 /*
  * Set IP address in socket structure in_addr
  *
+ * Answers come from the hostname cache whenever possible; see the
+ * description of the cache above for when a call may block.
+ *
  * @param a     Pointer to a struct in_addr into which the address is written
  * @param p     The hostname to lookup
  * @return      1 on success, 0 on failure
  */
 int
 setipaddress(struct in_addr *a, char *p)
+{
+    DNS_ENTRY *entry;
+    struct in_addr addr;
+    time_t now;
+
+    /* Literal addresses need no lookup and are not cached */
+    if (strcmp(p, "0.0.0.0") != 0 && inet_aton(p, a) != 0)
+    {
+        return 1;
+    }
+
+    spinlock_acquire(&dns_cache_lock);
+    if ((entry = dns_cache_find(p)) != NULL)
+    {
+        now = time(NULL);
+        *a = entry->addr;
+        if (entry->expires <= now && !entry->refreshing && dns_refresh_mes)
+        {
+            /* Serve the stale address and refresh in the background */
+            entry->refreshing = true;
+            entry->refresh_next = NULL;
+            if (dns_refresh_tail)
+            {
+                dns_refresh_tail->refresh_next = entry;
+            }
+            else
+            {
+                dns_refresh_head = entry;
+            }
+            dns_refresh_tail = entry;
+            spinlock_release(&dns_cache_lock);
+            skygw_message_send(dns_refresh_mes);
+            return 1;
+        }
+        spinlock_release(&dns_cache_lock);
+        return 1;
+    }
+    spinlock_release(&dns_cache_lock);
+
+    /* First sight of this name; resolve it synchronously and cache it */
+    if (!gw_resolve_hostname(&addr, p))
+    {
+        return 0;
+    }
+    *a = addr;
+
+    spinlock_acquire(&dns_cache_lock);
+    if ((entry = dns_cache_find(p)) == NULL)
+    {
+        if ((entry = (DNS_ENTRY *)calloc(1, sizeof(DNS_ENTRY))) != NULL)
+        {
+            if ((entry->name = strdup(p)) == NULL)
+            {
+                free(entry);
+                entry = NULL;
+            }
+            else
+            {
+                unsigned int chain = dns_cache_hash(p);
+
+                entry->next = dns_cache[chain];
+                dns_cache[chain] = entry;
+            }
+        }
+    }
+    if (entry)
+    {
+        entry->addr = addr;
+        entry->expires = time(NULL) + DNS_CACHE_TTL;
+    }
+    spinlock_release(&dns_cache_lock);
+    return 1;
+}
+
+/*
+ * Resolve a hostname to an IP address with the resolver library
+ *
+ * @param a     Pointer to a struct in_addr into which the address is written
+ * @param p     The hostname to lookup
+ * @return      1 on success, 0 on failure
+ */
+static int
+gw_resolve_hostname(struct in_addr *a, char *p)
 {
 #ifdef __USE_POSIX
     struct addrinfo *ai = NULL, hint;
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <gwbitmask.h>
+#include <atomic.h>
 
 /**
  * @file gwbitmask.c  Implementation of bitmask operations for the gateway
@@ -30,9 +31,17 @@
  * Bitmask growth happens in increments rather than via a single bit as
  * a time.
  *
+ * The bits are stored in an array of unsigned int words and the individual
+ * operations - set, clear, test and all-clear - use the atomic bitwise
+ * primitives in atomic.c rather than taking the bitmask spinlock. These
+ * operations sit on the per-event polling path via the DCB zombie
+ * bitmask, where a lock per operation caused measurable contention.
+ * The spinlock is retained solely to serialise the rare resize of the
+ * bit array and the wholesale replacement done by bitmask_copy.
+ *
  * Please note limitations to these mechanisms:
  *
- * 1. The initial size and increment size MUST be exact multiples of 8
+ * 1. The initial size and increment size MUST be exact multiples of 32
  * 2. Only suitable for a compact set of bit numbers i.e. the numbering
  * needs to start near to 0 and grow without sizeable gaps
  * 3. It is assumed that a bit number bigger than the current size can
@@ -41,6 +50,10 @@
  * created as the destination. This will test true for all bits clear, which
  * may be a serious error. However, the memory requirement is very small and
  * is only likely to fail in circumstances where a lot else is going wrong.
+ * 5. The all-clear test made after a clear is not atomic with respect to
+ * other concurrent clear operations; a caller that uses the result to
+ * decide whether to free a resource must serialise the callers itself,
+ * as the zombie processing in dcb.c does with the zombie spinlock.
  *
  * @verbatim
  * Revision History
@@ -51,20 +64,18 @@
  * 17/10/15     Martin Brampton     Added display of bitmask
  * 04/01/16     Martin Brampton     Changed bitmask_clear to not lock and return
  *                                  whether bitmask is clear; added bitmask_clear_with_lock.
+ * 14/06/16     Mark Riddoch        Reimplemented over an array of atomic words;
+ *                                  spinlock retained only for resize and copy
  *
  * @endverbatim
  */
 
+/** Number of bits in each word of the bit array */
+#define BITS_PER_WORD   ((int)(8 * sizeof(unsigned int)))
+
 static int bitmask_isset_without_spinlock(GWBITMASK *bitmask, int bit);
 static int bitmask_count_bits_set(GWBITMASK *bitmask);
 
-static const unsigned char bitmapclear[8] = {
-    255-1, 255-2, 255-4, 255-8, 255-16, 255-32, 255-64, 255-128
-};
-static const unsigned char bitmapset[8] = {
-    1, 2, 4, 8, 16, 32, 64, 128
-};
-
 /**
  * Initialise a bitmask
  *
@@ -75,8 +86,8 @@ void
 bitmask_init(GWBITMASK *bitmask)
 {
     bitmask->length = BIT_LENGTH_INITIAL;
-    bitmask->size = bitmask->length / 8;
-    if ((bitmask->bits = calloc(bitmask->size, 1)) == NULL)
+    bitmask->size = bitmask->length / BITS_PER_WORD;
+    if ((bitmask->bits = calloc(bitmask->size, sizeof(unsigned int))) == NULL)
     {
         bitmask->length = bitmask->size = 0;
     }
@@ -105,42 +116,51 @@ bitmask_free(GWBITMASK *bitmask)
  * by a single increment - the bit numbers used need to be a
  * fairly dense set.
  *
+ * Setting a bit that is within the current length is lock-free;
+ * the spinlock is taken only when the bit array must grow.
+ *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to set
  */
 void
 bitmask_set(GWBITMASK *bitmask, int bit)
 {
-    unsigned char *ptr = bitmask->bits;
-
-    spinlock_acquire(&bitmask->lock);
-    if (bit >= 8)
+    if (bit >= bitmask->length)
     {
+        spinlock_acquire(&bitmask->lock);
         while (bit >= bitmask->length)
         {
-            bitmask->bits = realloc(bitmask->bits,
-                                (bitmask->size + (BIT_LENGTH_INC / 8)));
-            memset(bitmask->bits + (bitmask->size), 0,
-               BIT_LENGTH_INC / 8);
+            int newsize = bitmask->size + (BIT_LENGTH_INC / BITS_PER_WORD);
+            unsigned int *newbits = calloc(newsize, sizeof(unsigned int));
+
+            if (newbits == NULL)
+            {
+                spinlock_release(&bitmask->lock);
+                return;
+            }
+            memcpy(newbits, bitmask->bits, bitmask->size * sizeof(unsigned int));
+            /* The superseded array is deliberately not freed; lock-free
+             * readers may still be traversing it. Growth only occurs if
+             * more than BIT_LENGTH_INITIAL threads are configured, so in
+             * practice nothing is ever leaked. The new pointer is
+             * published before the new size so that a concurrent reader
+             * never indexes the old array with the new bounds. */
+            bitmask->bits = newbits;
+            bitmask->size = newsize;
             bitmask->length += BIT_LENGTH_INC;
-            bitmask->size += (BIT_LENGTH_INC / 8);
         }
-
-        ptr += (bit / 8);
-        bit = bit % 8;
+        spinlock_release(&bitmask->lock);
     }
-    *ptr |= bitmapset[bit];
-    spinlock_release(&bitmask->lock);
+    atomic_or(&bitmask->bits[bit / BITS_PER_WORD],
+              1U << (bit % BITS_PER_WORD));
 }
 
 /**
  * Clear the bit at the specified bit position in the bitmask.
  * Bits beyond the bitmask length are always assumed to be clear, so no
  * action is needed if the bit parameter is beyond the length.
- * Note that this function does not lock the bitmask, but assumes that
- * it is under the exclusive control of the caller.  If you want to use the
- * bitmask spinlock to protect access while clearing the bit, then call
- * the alternative bitmask_clear.
+ * The clear itself is an atomic operation and needs no lock, but see
+ * caveat 5 above regarding the returned all-clear indication.
  *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to clear
@@ -149,22 +169,17 @@ bitmask_set(GWBITMASK *bitmask, int bit)
 int
 bitmask_clear_without_spinlock(GWBITMASK *bitmask, int bit)
 {
-    unsigned char *ptr = bitmask->bits;
+    unsigned int *ptr = bitmask->bits;
     int i;
 
     if (bit < bitmask->length)
     {
-        if (bit >= 8)
-        {
-            ptr += (bit / 8);
-            bit = bit % 8;
-        }
-        *ptr &= bitmapclear[bit];
+        atomic_and(&ptr[bit / BITS_PER_WORD],
+                   ~(1U << (bit % BITS_PER_WORD)));
     }
-    ptr = bitmask->bits;
     for (i = 0; i < bitmask->size; i++)
     {
-        if (*(ptr+i) != 0)
+        if (ptr[i] != 0)
         {
             return 0;
         }
@@ -173,8 +188,9 @@ bitmask_clear_without_spinlock(GWBITMASK *bitmask, int bit)
 }
 
 /**
- * Clear the bit at the specified bit position in the bitmask using a spinlock.
- * See bitmask_clear_without_spinlock for more details
+ * Clear the bit at the specified bit position in the bitmask.
+ * Retained as a separate entry point for compatibility; the operation
+ * is now lock-free and identical to bitmask_clear_without_spinlock.
  *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to clear
@@ -183,19 +199,14 @@ bitmask_clear_without_spinlock(GWBITMASK *bitmask, int bit)
 int
 bitmask_clear(GWBITMASK *bitmask, int bit)
 {
-    int result;
-
-    spinlock_acquire(&bitmask->lock);
-    result = bitmask_clear_without_spinlock(bitmask, bit);
-    spinlock_release(&bitmask->lock);
-    return result;
+    return bitmask_clear_without_spinlock(bitmask, bit);
 }
 
 /**
  * Return a non-zero value if the bit at the specified bit
  * position in the bitmask is set. If the specified bit is outside the
  * bitmask, it is assumed to be unset; the bitmask is not extended.
- * This function wraps bitmask_isset_without_spinlock with a spinlock.
+ * The test is a single atomic read and needs no lock.
  *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to test
@@ -203,18 +214,12 @@ bitmask_clear(GWBITMASK *bitmask, int bit)
 int
 bitmask_isset(GWBITMASK *bitmask, int bit)
 {
-    int result;
-
-    spinlock_acquire(&bitmask->lock);
-    result = bitmask_isset_without_spinlock(bitmask, bit);
-    spinlock_release(&bitmask->lock);
-    return result;
+    return bitmask_isset_without_spinlock(bitmask, bit);
 }
 
 /**
  * Return a non-zero value if the bit at the specified bit
- * position in the bitmask is set.  Should be called while holding a
- * lock on the bitmask or having control of it in some other way.
+ * position in the bitmask is set.
  *
  * Bits beyond the current length are deemed unset.
  *
@@ -224,18 +229,11 @@ bitmask_isset(GWBITMASK *bitmask, int bit)
 static int
 bitmask_isset_without_spinlock(GWBITMASK *bitmask, int bit)
 {
-    unsigned char *ptr = bitmask->bits;
-
     if (bit >= bitmask->length)
     {
         return 0;
     }
-    if (bit >= 8)
-    {
-        ptr += (bit / 8);
-        bit = bit % 8;
-    }
-    return *ptr & bitmapset[bit];
+    return bitmask->bits[bit / BITS_PER_WORD] & (1U << (bit % BITS_PER_WORD));
 }
 
 /**
@@ -244,28 +242,26 @@ bitmask_isset_without_spinlock(GWBITMASK *bitmask, int bit)
  * copy and there was insufficient memory when the copy was
  * made.
  *
+ * The scan reads each word once and needs no lock; see caveat 5
+ * above for the consequences of concurrent clear operations.
+ *
  * @param bitmask       Pointer the bitmask
  * @return              Non-zero if the bitmask has no bits set
  */
 int
 bitmask_isallclear(GWBITMASK *bitmask)
 {
-    unsigned char *ptr = bitmask->bits;
+    unsigned int *ptr = bitmask->bits;
     int i;
-    int result = 1;
 
-    spinlock_acquire(&bitmask->lock);
     for (i = 0; i < bitmask->size; i++)
     {
-        if (*(ptr+i) != 0)
+        if (ptr[i] != 0)
         {
-            result = 0;
-            break;
+            return 0;
         }
     }
-    spinlock_release(&bitmask->lock);
-
-    return result;
+    return 1;
 }
 
 /**
@@ -275,6 +271,11 @@ bitmask_isallclear(GWBITMASK *bitmask)
  * which could seriously undermine the logic.  Given the small size of the
  * bitmask, this is unlikely to happen.
  *
+ * The destination bit array is replaced wholesale, so the caller must
+ * ensure that no lock-free operations run against the destination
+ * concurrently; in practice the copy is done before a DCB is published
+ * on the zombie queue.
+ *
  * @param dest  Bitmap tp update
  * @param src   Bitmap to copy
  */
@@ -287,7 +288,7 @@ bitmask_copy(GWBITMASK *dest, GWBITMASK *src)
     {
         free(dest->bits);
     }
-    if ((dest->bits = malloc(src->size)) == NULL)
+    if ((dest->bits = malloc(src->size * sizeof(unsigned int))) == NULL)
     {
         dest->length = 0;
     }
@@ -295,7 +296,7 @@ bitmask_copy(GWBITMASK *dest, GWBITMASK *src)
     {
         dest->length = src->length;
         dest->size = src->size;
-        memcpy(dest->bits, src->bits, src->size);
+        memcpy(dest->bits, src->bits, src->size * sizeof(unsigned int));
     }
     spinlock_release(&dest->lock);
     spinlock_release(&src->lock);
@@ -377,7 +378,7 @@ bitmask_count_bits_set(GWBITMASK *bitmask)
     int result = 0;
     unsigned char *ptr, *eptr;
 
-    ptr = bitmask->bits;
+    ptr = (unsigned char *)bitmask->bits;
     eptr = ptr + (bitmask->length / 8);
     while (ptr < eptr)
     {
@@ -17,12 +17,14 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <hashtable.h>
+#include <memaccount.h>
 
 /**
  * @file hashtable.c General purpose hashtable routines
@@ -50,6 +52,12 @@
  * number of readers and writers counters when taking out locks. Releasing of
  * locks uses pure atomic actions and thus does not require spinlock protection.
  *
+ * The locks are striped: each table holds HASHTABLE_LOCK_STRIPES of the
+ * reader/writer counter pairs and a hash chain is mapped to a stripe by
+ * its chain index. Operations on different chains therefore proceed in
+ * parallel and only operations that touch the whole table, such as
+ * freeing it or gathering statistics, lock every stripe.
+ *
  * @verbatim
  * Revision History
  *
@@ -60,14 +68,96 @@
  *                                      it's possible to copy and free different data types via
  *                                      kcopyfn/kfreefn, vcopyfn/vfreefn
  * 06/02/2015   Mark Riddoch            Addition of hashtable_save and hashtable_load
+ * 26/05/2016   Mark Riddoch            Striped locks to allow concurrent access
+ *                                      to different hash chains
+ * 03/07/2016   Mark Riddoch            Report entry allocations to the memory
+ *                                      accounting of memaccount.c
+ * 03/07/2016   Mark Riddoch            Version word in the saved hashtable
+ *                                      format so stale caches are rejected
+ * 03/07/2016   Mark Riddoch            Built-in integer and string key modes
+ *                                      that avoid the indirect hash and compare
+ *                                      calls in the probe loops
+ * 05/07/2016   Mark Riddoch            Reference counted snapshots for
+ *                                      iteration without holding table locks,
+ *                                      used by hashtable_save
  *
  * @endverbatim
  */
 
-static  void hashtable_read_lock(HASHTABLE *table);
-static  void hashtable_read_unlock(HASHTABLE *table);
-static  void hashtable_write_lock(HASHTABLE *table);
-static  void hashtable_write_unlock(HASHTABLE *table);
+/** The lock stripe that protects the given hash chain */
+#define HASHTABLE_STRIPE(chain) ((chain) % HASHTABLE_LOCK_STRIPES)
+
+/**
+ * The multiplier used for Fibonacci hashing in the integer and string
+ * key modes, 2^64 divided by the golden ratio. Multiplying by it
+ * scatters consecutive key values, such as monotonically allocated
+ * session ids, evenly over the hash chains, and the high bits of the
+ * product are taken as they are the best mixed.
+ */
+#define HASHTABLE_FIB_MULT      0x9E3779B97F4A7C15ULL
+
+/**
+ * Hash a key according to the key mode of the table.
+ *
+ * For the built-in integer and string modes the hash is computed inline
+ * here, so the probe paths make no indirect call; only the custom mode
+ * dispatches to the user supplied function.
+ *
+ * @param table The hash table
+ * @param key   The key to hash
+ * @return The hash of the key, before reduction modulo the table size
+ */
+static inline unsigned int
+hashtable_key_hash(HASHTABLE *table, void *key)
+{
+    uint64_t h;
+
+    switch (table->kmode)
+    {
+    case HASHTABLE_KEY_INT:
+        return (unsigned int)(((uint64_t)(uintptr_t)key * HASHTABLE_FIB_MULT) >> 32);
+    case HASHTABLE_KEY_STR:
+        h = 0;
+        for (unsigned char *ptr = (unsigned char *)key; *ptr; ptr++)
+        {
+            h = h * 31 + *ptr;
+        }
+        return (unsigned int)((h * HASHTABLE_FIB_MULT) >> 32);
+    default:
+        return (unsigned int)table->hashfn(key);
+    }
+}
+
+/**
+ * Compare two keys according to the key mode of the table.
+ *
+ * @param table The hash table
+ * @param key1  The first key
+ * @param key2  The second key
+ * @return Zero if the keys are equal
+ */
+static inline int
+hashtable_key_cmp(HASHTABLE *table, void *key1, void *key2)
+{
+    switch (table->kmode)
+    {
+    case HASHTABLE_KEY_INT:
+        return key1 == key2 ? 0 : 1;
+    case HASHTABLE_KEY_STR:
+        return strcmp((char *)key1, (char *)key2);
+    default:
+        return table->cmpfn(key1, key2);
+    }
+}
+
+static  void hashtable_read_lock(HASHTABLE *table, int stripe);
+static  void hashtable_read_unlock(HASHTABLE *table, int stripe);
+static  void hashtable_write_lock(HASHTABLE *table, int stripe);
+static  void hashtable_write_unlock(HASHTABLE *table, int stripe);
+static  void hashtable_read_lock_all(HASHTABLE *table);
+static  void hashtable_read_unlock_all(HASHTABLE *table);
+static  void hashtable_write_lock_all(HASHTABLE *table);
+static  void hashtable_write_unlock_all(HASHTABLE *table);
 static HASHTABLE *hashtable_alloc_real(HASHTABLE* target,
                                        int size,
                                        int (*hashfn)(),
@@ -105,6 +195,52 @@ hashtable_alloc(int size, int (*hashfn)(), int (*cmpfn)())
     return hashtable_alloc_real(NULL, size, hashfn, cmpfn);
 }
 
+/**
+ * Allocate a new hash table with integer keys.
+ *
+ * The key of an entry is the value of the key pointer itself, so no key
+ * storage is needed and a key of zero can not be used. The keys are
+ * hashed with Fibonacci hashing and compared for equality inline,
+ * without the indirect calls of a user supplied hash function.
+ *
+ * @param size          The size of the hash table, must be > 0
+ * @return The hashtable table
+ */
+HASHTABLE *
+hashtable_alloc_int(int size)
+{
+    HASHTABLE *rval;
+
+    if ((rval = hashtable_alloc_real(NULL, size, NULL, NULL)) != NULL)
+    {
+        rval->kmode = HASHTABLE_KEY_INT;
+    }
+    return rval;
+}
+
+/**
+ * Allocate a new hash table with NUL terminated string keys.
+ *
+ * The keys are hashed and compared inline, without the indirect calls
+ * of a user supplied hash function. As with the general table the key
+ * pointers themselves are stored unless copy functions are registered
+ * with hashtable_memory_fns().
+ *
+ * @param size          The size of the hash table, must be > 0
+ * @return The hashtable table
+ */
+HASHTABLE *
+hashtable_alloc_str(int size)
+{
+    HASHTABLE *rval;
+
+    if ((rval = hashtable_alloc_real(NULL, size, NULL, NULL)) != NULL)
+    {
+        rval->kmode = HASHTABLE_KEY_STR;
+    }
+    return rval;
+}
+
 HASHTABLE* hashtable_alloc_flat(HASHTABLE* target,
                                 int size,
                                 int (*hashfn)(),
@@ -120,6 +256,7 @@ hashtable_alloc_real(HASHTABLE* target,
                      int (*cmpfn)())
 {
     HASHTABLE *rval;
+    int i;
 
     if (target == NULL)
     {
@@ -140,16 +277,20 @@ hashtable_alloc_real(HASHTABLE* target,
     rval->ht_chk_tail = CHK_NUM_HASHTABLE;
 #endif
     rval->hashsize = size > 0 ? size : 1;
+    rval->kmode = HASHTABLE_KEY_CUSTOM;
     rval->hashfn = hashfn;
     rval->cmpfn = cmpfn;
     rval->kcopyfn = nullfn;
     rval->vcopyfn = nullfn;
     rval->kfreefn = nullfn;
     rval->vfreefn = nullfn;
-    rval->n_readers = 0;
-    rval->writelock = 0;
     rval->n_elements = 0;
-    spinlock_init(&rval->spin);
+    for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
+    {
+        spinlock_init(&rval->locks[i].spin);
+        rval->locks[i].n_readers = 0;
+        rval->locks[i].writelock = 0;
+    }
     if ((rval->entries = (HASHENTRIES **)calloc(rval->hashsize, sizeof(HASHENTRIES *))) == NULL)
     {
         free(rval);
@@ -176,7 +317,7 @@ hashtable_free(HASHTABLE *table)
         return;
     }
 
-    hashtable_write_lock(table);
+    hashtable_write_lock_all(table);
     for (i = 0; i < table->hashsize; i++)
     {
         entry = table->entries[i];
@@ -185,13 +326,14 @@ hashtable_free(HASHTABLE *table)
             ptr = entry->next;
             table->kfreefn(entry->key);
             table->vfreefn(entry->value);
+            memacct_add(MEM_ACCT_HASHTABLE, -(int64_t)sizeof(HASHENTRIES));
             free(entry);
             entry = ptr;
         }
     }
     free(table->entries);
 
-    hashtable_write_unlock(table);
+    hashtable_write_unlock_all(table);
     if (!table->ht_isflat)
     {
         free(table);
@@ -259,18 +401,18 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
     }
     else
     {
-        hashkey = table->hashfn(key) % table->hashsize;
+        hashkey = hashtable_key_hash(table, key) % table->hashsize;
     }
-    hashtable_write_lock(table);
+    hashtable_write_lock(table, HASHTABLE_STRIPE(hashkey));
     entry = table->entries[hashkey % table->hashsize];
-    while (entry && table->cmpfn(key, entry->key) != 0)
+    while (entry && hashtable_key_cmp(table, key, entry->key) != 0)
     {
         entry = entry->next;
     }
-    if (entry && table->cmpfn(key, entry->key) == 0)
+    if (entry && hashtable_key_cmp(table, key, entry->key) == 0)
     {
         /* Duplicate key value */
-        hashtable_write_unlock(table);
+        hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
         return 0;
     }
     else
@@ -278,7 +420,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
         HASHENTRIES *ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES));
         if (ptr == NULL)
         {
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
             return 0;
         }
 
@@ -289,7 +431,7 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
         if (ptr->key  == NULL)
         {
             free(ptr);
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
 
             return 0;
         }
@@ -305,16 +447,17 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
             free(ptr);
 
             /* value not copied, return */
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
 
             return 0;
         }
 
         ptr->next = table->entries[hashkey % table->hashsize];
         table->entries[hashkey % table->hashsize] = ptr;
+        memacct_add(MEM_ACCT_HASHTABLE, sizeof(HASHENTRIES));
     }
-    table->n_elements++;
-    hashtable_write_unlock(table);
+    atomic_add(&table->n_elements, 1);
+    hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
 
     return 1;
 }
@@ -337,17 +480,17 @@ hashtable_delete(HASHTABLE *table, void *key)
         return 0;
     }
 
-    hashkey = table->hashfn(key) % table->hashsize;
-    hashtable_write_lock(table);
+    hashkey = hashtable_key_hash(table, key) % table->hashsize;
+    hashtable_write_lock(table, HASHTABLE_STRIPE(hashkey));
     entry = table->entries[hashkey % table->hashsize];
-    while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+    while (entry && entry->key && hashtable_key_cmp(table, key, entry->key) != 0)
     {
         entry = entry->next;
     }
     if (entry == NULL)
     {
         /* Not found */
-        hashtable_write_unlock(table);
+        hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
         return 0;
     }
 
@@ -368,6 +511,7 @@ hashtable_delete(HASHTABLE *table, void *key)
             entry->key = NULL;
             entry->value = NULL;
         }
+        memacct_add(MEM_ACCT_HASHTABLE, -(int64_t)sizeof(HASHENTRIES));
         free(entry);
     }
     else
@@ -379,17 +523,18 @@ hashtable_delete(HASHTABLE *table, void *key)
         }
         if (ptr == NULL)
         {
-            hashtable_write_unlock(table);
+            hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
             return 0;       /* This should never happen */
         }
         ptr->next = entry->next;
         table->kfreefn(entry->key);
         table->vfreefn(entry->value);
+        memacct_add(MEM_ACCT_HASHTABLE, -(int64_t)sizeof(HASHENTRIES));
         free(entry);
     }
-    table->n_elements--;
+    atomic_add(&table->n_elements, -1);
     assert(table->n_elements >= 0);
-    hashtable_write_unlock(table);
+    hashtable_write_unlock(table, HASHTABLE_STRIPE(hashkey));
     return 1;
 }
 
@@ -411,21 +556,21 @@ hashtable_fetch(HASHTABLE *table, void *key)
         return NULL;
     }
 
-    hashkey = table->hashfn(key) % table->hashsize;
-    hashtable_read_lock(table);
+    hashkey = hashtable_key_hash(table, key) % table->hashsize;
+    hashtable_read_lock(table, HASHTABLE_STRIPE(hashkey));
     entry = table->entries[hashkey % table->hashsize];
-    while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+    while (entry && entry->key && hashtable_key_cmp(table, key, entry->key) != 0)
     {
         entry = entry->next;
     }
     if (entry == NULL)
     {
-        hashtable_read_unlock(table);
+        hashtable_read_unlock(table, HASHTABLE_STRIPE(hashkey));
         return NULL;
     }
     else
     {
-        hashtable_read_unlock(table);
+        hashtable_read_unlock(table, HASHTABLE_STRIPE(hashkey));
         return entry->value;
     }
 }
@@ -449,7 +594,7 @@ hashtable_stats(HASHTABLE *table)
     printf("Hashtable: %p, size %d\n", table, table->hashsize);
     total = 0;
     longest = 0;
-    hashtable_read_lock(table);
+    hashtable_read_lock_all(table);
     for (i = 0; i < table->hashsize; i++)
     {
         j = 0;
@@ -463,7 +608,7 @@ hashtable_stats(HASHTABLE *table)
         if (j > longest)
             longest = j;
     }
-    hashtable_read_unlock(table);
+    hashtable_read_unlock_all(table);
     printf("\tNo. of entries:       %d\n", total);
     printf("\tAverage chain length: %.1f\n", (float)total / table->hashsize);
     printf("\tLongest chain length: %d\n", longest);
@@ -507,7 +652,7 @@ void hashtable_get_stats(void* table,
     {
         ht = (HASHTABLE *)table;
         CHK_HASHTABLE(ht);
-        hashtable_read_lock(ht);
+        hashtable_read_lock_all(ht);
 
         for (i = 0; i < ht->hashsize; i++)
         {
@@ -525,19 +670,19 @@ void hashtable_get_stats(void* table,
             }
         }
         *hashsize = ht->hashsize;
-        hashtable_read_unlock(ht);
+        hashtable_read_unlock_all(ht);
     }
 }
 
 
 /**
- * Take a read lock on the hashtable.
+ * Take a read lock on one stripe of the hashtable.
  *
- * The hashtable support multiple readers and a single writer,
+ * Each stripe supports multiple readers and a single writer,
  * we have a spinlock to protect the two counts, n_readers and
  * writelock.
  *
- * We take the hashtable spinlock and then check that writelock
+ * We take the stripe spinlock and then check that writelock
  * is set to zero. If not we release the spinlock and do dirty
  * reads of writelock until it goes to 0. Once it is zero we
  * acquire the spinlock again and test that writelock is still
@@ -547,41 +692,45 @@ void hashtable_get_stats(void* table,
  * spinlock still held.
  *
  * @param table         The hashtable to lock.
+ * @param stripe        The lock stripe to take
  */
 static void
-hashtable_read_lock(HASHTABLE *table)
+hashtable_read_lock(HASHTABLE *table, int stripe)
 {
-    spinlock_acquire(&table->spin);
-    while (table->writelock)
+    HASHLOCK *lock = &table->locks[stripe];
+
+    spinlock_acquire(&lock->spin);
+    while (lock->writelock)
     {
-        spinlock_release(&table->spin);
-        while (table->writelock)
+        spinlock_release(&lock->spin);
+        while (lock->writelock)
         {
             ;
         }
-        spinlock_acquire(&table->spin);
+        spinlock_acquire(&lock->spin);
     }
-    atomic_add(&table->n_readers, 1);
-    spinlock_release(&table->spin);
+    atomic_add(&lock->n_readers, 1);
+    spinlock_release(&lock->spin);
 }
 
 /**
  * Release a previously obtained readlock.
  *
- * Simply decrement the n_readers value for the hash table
+ * Simply decrement the n_readers value for the stripe
  *
  * @param table         The hash table to unlock
+ * @param stripe        The lock stripe to release
  */
 static void
-hashtable_read_unlock(HASHTABLE *table)
+hashtable_read_unlock(HASHTABLE *table, int stripe)
 {
-    atomic_add(&table->n_readers, -1);
+    atomic_add(&table->locks[stripe].n_readers, -1);
 }
 
 /**
- * Obtain an exclusive write lock for the hash table.
+ * Obtain an exclusive write lock on one stripe of the hash table.
  *
- * We acquire the hashtable spinlock, check for the number of
+ * We acquire the stripe spinlock, check for the number of
  * readers beign zero. If it is not we hold the spinlock and
  * loop waiting for the n_readers to reach zero. This will prevent
  * any new readers beign granted access but will not prevent current
@@ -593,38 +742,112 @@ hashtable_read_unlock(HASHTABLE *table)
  * locks do not require the spinlock to be acquired.
  *
  * @param table The table to lock for updates
+ * @param stripe The lock stripe to take
  */
 static void
-hashtable_write_lock(HASHTABLE *table)
+hashtable_write_lock(HASHTABLE *table, int stripe)
 {
+    HASHLOCK *lock = &table->locks[stripe];
     int available;
 
-    spinlock_acquire(&table->spin);
+    spinlock_acquire(&lock->spin);
     do
     {
-        while (table->n_readers)
+        while (lock->n_readers)
         {
             ;
         }
-        available = atomic_add(&table->writelock, 1);
+        available = atomic_add(&lock->writelock, 1);
         if (available != 0)
         {
-            atomic_add(&table->writelock, -1);
+            atomic_add(&lock->writelock, -1);
         }
     }
     while (available != 0);
-    spinlock_release(&table->spin);
+    spinlock_release(&lock->spin);
+}
+
+/**
+ * Release the write lock on one stripe of the hash table.
+ *
+ * @param table The hash table to unlock
+ * @param stripe The lock stripe to release
+ */
+static void
+hashtable_write_unlock(HASHTABLE *table, int stripe)
+{
+    atomic_add(&table->locks[stripe].writelock, -1);
+}
+
+/**
+ * Take a read lock on every stripe of the hashtable.
+ *
+ * Used by the operations that walk the whole table. The stripes are
+ * always taken in index order so that concurrent whole table
+ * operations can not deadlock against each other.
+ *
+ * @param table         The hashtable to lock.
+ */
+static void
+hashtable_read_lock_all(HASHTABLE *table)
+{
+    int i;
+
+    for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
+    {
+        hashtable_read_lock(table, i);
+    }
+}
+
+/**
+ * Release a read lock held on every stripe of the hashtable.
+ *
+ * @param table         The hash table to unlock
+ */
+static void
+hashtable_read_unlock_all(HASHTABLE *table)
+{
+    int i;
+
+    for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
+    {
+        hashtable_read_unlock(table, i);
+    }
+}
+
+/**
+ * Obtain an exclusive write lock on every stripe of the hash table.
+ *
+ * The stripes are always taken in index order so that concurrent
+ * whole table operations can not deadlock against each other.
+ *
+ * @param table The table to lock for updates
+ */
+static void
+hashtable_write_lock_all(HASHTABLE *table)
+{
+    int i;
+
+    for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
+    {
+        hashtable_write_lock(table, i);
+    }
 }
 
 /**
- * Release the write lock on the hash table.
+ * Release a write lock held on every stripe of the hash table.
  *
  * @param table The hash table to unlock
  */
 static void
-hashtable_write_unlock(HASHTABLE *table)
+hashtable_write_unlock_all(HASHTABLE *table)
 {
-    atomic_add(&table->writelock, -1);
+    int i;
+
+    for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
+    {
+        hashtable_write_unlock(table, i);
+    }
 }
 
 /**
@@ -667,7 +890,7 @@ hashtable_next(HASHITERATOR *iter)
     iter->depth++;
     while (iter->chain < iter->table->hashsize)
     {
-        hashtable_read_lock(iter->table);
+        hashtable_read_lock(iter->table, HASHTABLE_STRIPE(iter->chain));
         if ((entries = iter->table->entries[iter->chain]) != NULL)
         {
             i = 0;
@@ -676,13 +899,13 @@ hashtable_next(HASHITERATOR *iter)
                 entries = entries->next;
                 i++;
             }
-            hashtable_read_unlock(iter->table);
+            hashtable_read_unlock(iter->table, HASHTABLE_STRIPE(iter->chain));
             if (entries)
                 return entries->key;
         }
         else
         {
-            hashtable_read_unlock(iter->table);
+            hashtable_read_unlock(iter->table, HASHTABLE_STRIPE(iter->chain));
         }
         iter->depth = 0;
         iter->chain++;
@@ -701,6 +924,160 @@ hashtable_iterator_free(HASHITERATOR *iter)
     free(iter);
 }
 
+/**
+ * Build a frozen view of a hashtable.
+ *
+ * The table is walked one lock stripe at a time under a read lock and
+ * the entries are copied into a flat array using the copy functions of
+ * the table, so concurrent writers only wait for the stripe currently
+ * being copied. The snapshot is returned with one reference held;
+ * iterating it with hashtable_snapshot_next() touches no table locks.
+ *
+ * @param table         The table to snapshot
+ * @return A snapshot of the table or NULL on allocation failure
+ */
+HASHSNAPSHOT *
+hashtable_snapshot(HASHTABLE *table)
+{
+    HASHSNAPSHOT *snap;
+    HASHSNAPENTRY *grown;
+    HASHENTRIES *entry;
+    void *key, *value;
+    int i, size;
+
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    if ((snap = (HASHSNAPSHOT *)malloc(sizeof(HASHSNAPSHOT))) == NULL)
+    {
+        return NULL;
+    }
+    snap->n_entries = 0;
+    snap->refcount = 1;
+    snap->kfreefn = table->kfreefn;
+    snap->vfreefn = table->vfreefn;
+    /* n_elements may move while we copy, so the array is grown on
+     * demand from this initial estimate */
+    size = table->n_elements + 16;
+    if ((snap->entries = (HASHSNAPENTRY *)malloc(size * sizeof(HASHSNAPENTRY))) == NULL)
+    {
+        free(snap);
+        return NULL;
+    }
+
+    for (i = 0; i < table->hashsize; i++)
+    {
+        hashtable_read_lock(table, HASHTABLE_STRIPE(i));
+        for (entry = table->entries[i]; entry; entry = entry->next)
+        {
+            if (entry->key == NULL)
+            {
+                continue;
+            }
+            if (snap->n_entries == size)
+            {
+                size += size / 2;
+                grown = (HASHSNAPENTRY *)realloc(snap->entries,
+                                                 size * sizeof(HASHSNAPENTRY));
+                if (grown == NULL)
+                {
+                    hashtable_read_unlock(table, HASHTABLE_STRIPE(i));
+                    hashtable_snapshot_release(snap);
+                    return NULL;
+                }
+                snap->entries = grown;
+            }
+            key = table->kcopyfn(entry->key);
+            value = table->vcopyfn(entry->value);
+            if (key == NULL || value == NULL)
+            {
+                /* A failed copy drops the entry from the snapshot */
+                if (key)
+                {
+                    table->kfreefn(key);
+                }
+                if (value)
+                {
+                    table->vfreefn(value);
+                }
+                continue;
+            }
+            snap->entries[snap->n_entries].key = key;
+            snap->entries[snap->n_entries].value = value;
+            snap->n_entries++;
+        }
+        hashtable_read_unlock(table, HASHTABLE_STRIPE(i));
+    }
+    return snap;
+}
+
+/**
+ * Take an additional reference on a snapshot, allowing it to be shared
+ * between threads or retained after the creator has released it.
+ *
+ * @param snap  The snapshot
+ * @return The snapshot passed in
+ */
+HASHSNAPSHOT *
+hashtable_snapshot_get(HASHSNAPSHOT *snap)
+{
+    atomic_add(&snap->refcount, 1);
+    return snap;
+}
+
+/**
+ * Release a reference on a snapshot. When the last reference is
+ * released the copied keys and values are freed with the free
+ * functions captured from the table.
+ *
+ * @param snap  The snapshot to release
+ */
+void
+hashtable_snapshot_release(HASHSNAPSHOT *snap)
+{
+    int i;
+
+    if (snap == NULL)
+    {
+        return;
+    }
+    if (atomic_add(&snap->refcount, -1) != 1)
+    {
+        return;
+    }
+    for (i = 0; i < snap->n_entries; i++)
+    {
+        snap->kfreefn(snap->entries[i].key);
+        snap->vfreefn(snap->entries[i].value);
+    }
+    free(snap->entries);
+    free(snap);
+}
+
+/**
+ * Return the next key, and optionally the value, of a snapshot.
+ *
+ * @param snap          The snapshot to iterate
+ * @param position      Iteration position, initialised to zero by the
+ *                      caller and advanced by each call
+ * @param value         If not NULL, returns the value of the entry
+ * @return The key of the next entry or NULL at the end of the snapshot
+ */
+void *
+hashtable_snapshot_next(HASHSNAPSHOT *snap, int *position, void **value)
+{
+    if (snap == NULL || *position >= snap->n_entries)
+    {
+        return NULL;
+    }
+    if (value != NULL)
+    {
+        *value = snap->entries[*position].value;
+    }
+    return snap->entries[(*position)++].key;
+}
+
 /**
  * Save a hashtable to disk
  *
@@ -710,15 +1087,26 @@ hashtable_iterator_free(HASHITERATOR *iter)
  * @param valuewrite    Pointer to function that writes a single value
  * @return              Number of entries written or -1 on error
  */
+/**
+ * Version of the saved hashtable file format. It is written after the
+ * magic string and verified on load, so that a cache written by a release
+ * with a different key or value serialisation is rejected rather than
+ * misread. Bump this whenever the serialisation of any saved table
+ * changes.
+ */
+#define HASHTABLE_SAVE_VERSION  1
+
 int
 hashtable_save(HASHTABLE *table, const char *filename,
                int (*keywrite)(int, void*),
                int (*valuewrite)(int, void*))
 {
-    int fd, rval = 0;
-    HASHITERATOR *iter;
+    int fd, pos = 0, rval = 0;
+    HASHSNAPSHOT *snap;
     void *key, *value;
 
+    int version = HASHTABLE_SAVE_VERSION;
+
     if ((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
     {
         return -1;
@@ -728,36 +1116,44 @@ hashtable_save(HASHTABLE *table, const char *filename,
         close(fd);
         return -1;
     }
+    if (write(fd, &version, sizeof(version)) != sizeof(version))
+    {
+        close(fd);
+        return -1;
+    }
     write(fd, &rval, sizeof(rval)); // Write zero counter, will be overrwriten at end
-    if ((iter = hashtable_iterator(table)) != NULL)
+
+    /* The writes go against a frozen view of the table, so the file
+     * I/O holds no table locks and a consistent set of entries is
+     * written even if the table is updated meanwhile */
+    if ((snap = hashtable_snapshot(table)) != NULL)
     {
-        while ((key = hashtable_next(iter)) != NULL)
+        while ((key = hashtable_snapshot_next(snap, &pos, &value)) != NULL)
         {
             if (!(*keywrite)(fd, key))
             {
                 close(fd);
-                hashtable_iterator_free(iter);
+                hashtable_snapshot_release(snap);
                 return -1;
             }
-            if ((value = hashtable_fetch(table, key)) == NULL ||
-                (*valuewrite)(fd, value) == 0)
+            if ((*valuewrite)(fd, value) == 0)
             {
                 close(fd);
-                hashtable_iterator_free(iter);
+                hashtable_snapshot_release(snap);
                 return -1;
             }
             rval++;
         }
+        hashtable_snapshot_release(snap);
     }
 
     /* Now go back and write the count of entries */
-    if (lseek(fd, 7L, SEEK_SET) != -1)
+    if (lseek(fd, 7L + sizeof(version), SEEK_SET) != -1)
     {
         write(fd, &rval, sizeof(rval));
     }
 
     close(fd);
-    hashtable_iterator_free(iter);
     return rval;
 }
 
@@ -775,7 +1171,7 @@ hashtable_load(HASHTABLE *table, const char *filename,
                void *(*keyread)(int),
                void *(*valueread)(int))
 {
-    int fd, count, rval = 0;
+    int fd, count, version, rval = 0;
     void *key, *value;
     char buf[40];
 
@@ -793,6 +1189,14 @@ hashtable_load(HASHTABLE *table, const char *filename,
         close(fd);
         return -1;
     }
+    if (read(fd, &version, sizeof(version)) != sizeof(version) ||
+        version != HASHTABLE_SAVE_VERSION)
+    {
+        /* A file from an incompatible release; the caller falls back
+         * to rebuilding the table from its source. */
+        close(fd);
+        return -1;
+    }
     if (read(fd, &count, sizeof(count)) != sizeof(count))
     {
         close(fd);
@@ -822,8 +1226,7 @@ hashtable_load(HASHTABLE *table, const char *filename,
 int hashtable_size(HASHTABLE *table)
 {
     assert(table);
-    spinlock_acquire(&table->spin);
-    int rval = table->n_elements;
-    spinlock_release(&table->spin);
-    return rval;
+    /* n_elements is maintained with atomic operations so a plain
+     * read gives a consistent snapshot of the count. */
+    return table->n_elements;
 }
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <hint.h>
+#include <platform.h>
 
 /**
  * @file hint.c generic support routines for hints.
@@ -28,10 +29,49 @@
  *
  * Date         Who             Description
  * 25/07/14     Mark Riddoch    Initial implementation
+ * 03/07/16     Mark Riddoch    Recycle HINT structures on a per-thread
+ *                              free list
  *
  * @endverbatim
  */
 
+/**
+ * The recycling pool for HINT structures.
+ *
+ * Hints are created and freed per statement in the hint filter and the
+ * routers that consume them, so rather than return each structure to the
+ * heap a small number are kept on a thread local free list, in the same
+ * manner as the DCB pool. The data and value strings vary in size and
+ * are not pooled.
+ */
+#define HINT_POOL_MAX   64      /*< Maximum number of HINTs kept per thread */
+
+static thread_local HINT *hintpool = NULL;  /*< Free list of HINTs for this thread */
+static thread_local int n_hintpool = 0;     /*< Number of HINTs on the free list */
+
+/**
+ * Allocate a HINT structure, reusing one from the pool of the calling
+ * thread when possible.
+ *
+ * @return A HINT structure or NULL on allocation failure
+ */
+static HINT *
+hint_pool_get()
+{
+    HINT *hint;
+
+    if ((hint = hintpool) != NULL)
+    {
+        hintpool = hint->next;
+        n_hintpool--;
+    }
+    else
+    {
+        hint = (HINT *)malloc(sizeof(HINT));
+    }
+    return hint;
+}
+
 
 /**
  * Duplicate a list of hints
@@ -49,7 +89,7 @@ hint_dup(HINT *hint)
     ptr1 = hint;
     while (ptr1)
     {
-        if ((ptr2 = (HINT *)malloc(sizeof(HINT))) == NULL)
+        if ((ptr2 = hint_pool_get()) == NULL)
         {
             return nlhead;
         }
@@ -99,7 +139,7 @@ hint_create_route(HINT *head, HINT_TYPE type, char *data)
 {
     HINT *hint;
 
-    if ((hint = (HINT *)malloc(sizeof(HINT))) == NULL)
+    if ((hint = hint_pool_get()) == NULL)
     {
         return head;
     }
@@ -130,7 +170,7 @@ hint_create_parameter(HINT *head, char *pname, char *value)
 {
     HINT *hint;
 
-    if ((hint = (HINT *)malloc(sizeof(HINT))) == NULL)
+    if ((hint = hint_pool_get()) == NULL)
     {
         return head;
     }
@@ -144,6 +184,9 @@ hint_create_parameter(HINT *head, char *pname, char *value)
 /**
  * free_hint - free a hint
  *
+ * The structure is returned to the pool of the calling thread unless
+ * the pool is already full.
+ *
  * @param hint          The hint to free
  */
 void
@@ -157,7 +200,18 @@ hint_free(HINT *hint)
     {
         free(hint->value);
     }
-    free(hint);
+    if (n_hintpool < HINT_POOL_MAX)
+    {
+        hint->data = NULL;
+        hint->value = NULL;
+        hint->next = hintpool;
+        hintpool = hint;
+        n_hintpool++;
+    }
+    else
+    {
+        free(hint);
+    }
 }
 
 bool hint_exists(HINT**    p_hint,
@@ -0,0 +1,306 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file histogram.c  - Log-linear latency histograms
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 29/06/16     Mark Riddoch    Initial implementation
+ * 03/07/16     Mark Riddoch    Per-thread breakdown of a histogram
+ *
+ * @endverbatim
+ */
+#include <histogram.h>
+#include <statistics.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dcb.h>
+
+/** Each power-of-two magnitude is split into 2^HIST_SUBBUCKET_BITS
+ * linear sub-buckets, bounding the relative error of any recorded
+ * value to 1 / 2^HIST_SUBBUCKET_BITS. */
+#define HIST_SUBBUCKET_BITS 4
+#define HIST_SUBBUCKETS     (1 << HIST_SUBBUCKET_BITS)
+
+/** Values are clamped to just under 2^HIST_MAX_MAGNITUDE microseconds,
+ * a little over a minute; anything slower lands in the last bucket. */
+#define HIST_MAX_MAGNITUDE  26
+
+/** The number of buckets; one linear range below HIST_SUBBUCKETS and
+ * one set of sub-buckets for each remaining magnitude. */
+#define HIST_BUCKETS \
+    ((HIST_MAX_MAGNITUDE - HIST_SUBBUCKET_BITS + 1) * HIST_SUBBUCKETS)
+
+/** The number of per-thread slots. Histograms may be created before
+ * the configuration, and hence the thread count, is known, so a fixed
+ * number of slots is used and thread ids beyond it wrap around; the
+ * polling threads all have distinct ids well below the limit. */
+#define HIST_SLOTS 64
+
+typedef struct
+{
+    uint64_t total;                 /*< Sum of the recorded durations */
+    uint64_t max;                   /*< Largest recorded duration */
+    uint32_t buckets[HIST_BUCKETS]; /*< Sample counts per bucket */
+} HIST_SLOT;
+
+/**
+ * Return the bucket a duration is recorded into
+ *
+ * @param duration  Duration in microseconds
+ * @return The bucket index
+ */
+static inline int
+hist_bucket_of(uint64_t duration)
+{
+    int msb, shift;
+
+    if (duration < HIST_SUBBUCKETS)
+    {
+        return (int)duration;
+    }
+    if (duration >= ((uint64_t)1 << HIST_MAX_MAGNITUDE))
+    {
+        return HIST_BUCKETS - 1;
+    }
+    msb = 63 - __builtin_clzll(duration);
+    shift = msb - HIST_SUBBUCKET_BITS;
+    return ((shift + 1) << HIST_SUBBUCKET_BITS)
+        + (int)((duration >> shift) & (HIST_SUBBUCKETS - 1));
+}
+
+/**
+ * Return the lower bound of the value range of a bucket
+ *
+ * @param bucket    The bucket index
+ * @return The smallest duration recorded into the bucket
+ */
+static inline uint64_t
+hist_bucket_lower(int bucket)
+{
+    int shift;
+
+    if (bucket < HIST_SUBBUCKETS)
+    {
+        return (uint64_t)bucket;
+    }
+    shift = (bucket >> HIST_SUBBUCKET_BITS) - 1;
+    return ((uint64_t)(HIST_SUBBUCKETS + (bucket & (HIST_SUBBUCKETS - 1)))) << shift;
+}
+
+/**
+ * Create a new histogram
+ *
+ * @return New histogram or NULL if memory allocation failed
+ */
+histogram_t
+histogram_alloc()
+{
+    return calloc(HIST_SLOTS, sizeof(HIST_SLOT));
+}
+
+/**
+ * Free a histogram
+ *
+ * @param hist  Histogram to free
+ */
+void
+histogram_free(histogram_t hist)
+{
+    free(hist);
+}
+
+/**
+ * Record a duration into the slot of the calling thread
+ *
+ * @param hist      Histogram to record into
+ * @param duration  Duration in microseconds
+ */
+void
+histogram_record(histogram_t hist, uint64_t duration)
+{
+    HIST_SLOT *slot = &((HIST_SLOT *)hist)[ts_stats_get_thread_id() % HIST_SLOTS];
+
+    slot->buckets[hist_bucket_of(duration)]++;
+    slot->total += duration;
+    if (duration > slot->max)
+    {
+        slot->max = duration;
+    }
+}
+
+/**
+ * Return the number of durations recorded into a histogram
+ *
+ * @param hist  The histogram
+ * @return The total sample count over all threads
+ */
+uint64_t
+histogram_count(histogram_t hist)
+{
+    uint64_t count = 0;
+    int i, j;
+
+    for (i = 0; i < HIST_SLOTS; i++)
+    {
+        for (j = 0; j < HIST_BUCKETS; j++)
+        {
+            count += ((HIST_SLOT *)hist)[i].buckets[j];
+        }
+    }
+    return count;
+}
+
+/**
+ * Read the monotonic clock used for duration measurements
+ *
+ * @return Monotonic time in microseconds
+ */
+uint64_t
+histogram_clock_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Return the approximate duration below which the given fraction of
+ * the merged samples fall. The midpoint of the bucket holding the
+ * requested rank is reported.
+ *
+ * @param merged    The merged bucket counts
+ * @param count     Total sample count in the merged buckets
+ * @param pct       The percentile wanted, between 0 and 100
+ * @return The approximate percentile value in microseconds
+ */
+static uint64_t
+hist_percentile(uint32_t *merged, uint64_t count, int pct)
+{
+    uint64_t rank = (count * pct + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += merged[i];
+        if (seen >= rank)
+        {
+            return hist_bucket_lower(i)
+                + (hist_bucket_lower(i + 1) - hist_bucket_lower(i)) / 2;
+        }
+    }
+    return hist_bucket_lower(HIST_BUCKETS - 1);
+}
+
+/**
+ * Print a summary of a histogram to a DCB
+ *
+ * The per-thread buckets are merged here, on the reading thread; the
+ * recording threads are never synchronised with.
+ *
+ * @param dcb   DCB to print to
+ * @param hist  The histogram to print
+ */
+void
+dprintHistogram(DCB *dcb, histogram_t hist)
+{
+    uint32_t merged[HIST_BUCKETS];
+    uint64_t count = 0, total = 0, max = 0;
+    int i, j;
+
+    memset(merged, 0, sizeof(merged));
+    for (i = 0; i < HIST_SLOTS; i++)
+    {
+        HIST_SLOT *slot = &((HIST_SLOT *)hist)[i];
+
+        for (j = 0; j < HIST_BUCKETS; j++)
+        {
+            merged[j] += slot->buckets[j];
+            count += slot->buckets[j];
+        }
+        total += slot->total;
+        if (slot->max > max)
+        {
+            max = slot->max;
+        }
+    }
+    if (count == 0)
+    {
+        dcb_printf(dcb, "\tResponse time samples:              0\n");
+        return;
+    }
+    dcb_printf(dcb, "\tResponse time samples:              %lu\n",
+               (unsigned long)count);
+    dcb_printf(dcb, "\tResponse time average:              %.3f ms\n",
+               (double)total / count / 1000.0);
+    dcb_printf(dcb, "\tResponse time 50th percentile:      %.3f ms\n",
+               hist_percentile(merged, count, 50) / 1000.0);
+    dcb_printf(dcb, "\tResponse time 95th percentile:      %.3f ms\n",
+               hist_percentile(merged, count, 95) / 1000.0);
+    dcb_printf(dcb, "\tResponse time 99th percentile:      %.3f ms\n",
+               hist_percentile(merged, count, 99) / 1000.0);
+    dcb_printf(dcb, "\tResponse time maximum:              %.3f ms\n",
+               max / 1000.0);
+}
+
+/**
+ * Print a per-thread breakdown of a histogram to a DCB
+ *
+ * Since each recording thread uses its own slot, the slots give the
+ * distribution per thread directly; slots that hold no samples, i.e.
+ * thread ids that never recorded, are not printed.
+ *
+ * @param dcb   DCB to print to
+ * @param hist  The histogram to print
+ */
+void
+dprintHistogramThreads(DCB *dcb, histogram_t hist)
+{
+    uint64_t count;
+    int i, j;
+
+    dcb_printf(dcb, "Thread | Samples    | Average    | 50th       | 95th       | 99th       | Maximum\n");
+    dcb_printf(dcb, "-------+------------+------------+------------+------------+------------+-----------\n");
+    for (i = 0; i < HIST_SLOTS; i++)
+    {
+        HIST_SLOT *slot = &((HIST_SLOT *)hist)[i];
+
+        count = 0;
+        for (j = 0; j < HIST_BUCKETS; j++)
+        {
+            count += slot->buckets[j];
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+        dcb_printf(dcb, "%6d | %-10lu | %7.3f ms | %7.3f ms | %7.3f ms | %7.3f ms | %7.3f ms\n",
+                   i, (unsigned long)count,
+                   (double)slot->total / count / 1000.0,
+                   hist_percentile(slot->buckets, count, 50) / 1000.0,
+                   hist_percentile(slot->buckets, count, 95) / 1000.0,
+                   hist_percentile(slot->buckets, count, 99) / 1000.0,
+                   slot->max / 1000.0);
+    }
+}
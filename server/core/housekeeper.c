@@ -15,11 +15,15 @@
  *
  * Copyright MariaDB Corporation Ab 2014
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <housekeeper.h>
+#include <timerwheel.h>
 #include <thread.h>
 #include <spinlock.h>
+#include <maxscale/poll.h>
 #include <log_manager.h>
 
 /**
@@ -34,12 +38,19 @@
  * The housekeeper also maintains a global variable, hkheartbeat, that
  * is incremented every 100ms.
  *
+ * Tasks are scheduled via the timer wheel rather than by walking the
+ * task list every second; the list is retained only for name lookup
+ * and for the diagnostic output of hkshow_tasks.
+ *
  * @verbatim
  * Revision History
  *
  * Date         Who             Description
  * 29/08/14     Mark Riddoch    Initial implementation
  * 22/10/14     Mark Riddoch    Addition of one-shot tasks
+ * 12/05/16     Mark Riddoch    Tasks scheduled via the timer wheel
+ * 05/07/16     Mark Riddoch    Watchdog task that detects stalled polling
+ *                              threads
  *
  * @endverbatim
  */
@@ -58,6 +69,27 @@ long hkheartbeat = 0; /*< One heartbeat is 100 milliseconds */
 static THREAD hk_thr_handle;
 
 static void hkthread(void *);
+static void hktask_run(void *);
+static void hkwatchdog(void *);
+static void hkwatchdog_stack(int tid);
+
+/**
+ * How frequently, in seconds, the watchdog task samples the polling
+ * threads. A thread that spends a whole interval inside one event
+ * handler is reported as stalled.
+ */
+#define HKWATCHDOG_FREQ 10
+
+/**
+ * Per-thread sampling state of the polling thread watchdog
+ */
+typedef struct
+{
+    uint64_t cycles;    /*< Poll cycles of the thread at the last sample */
+    int stalled;        /*< Consecutive samples without progress */
+} HKWATCHDOG;
+
+static HKWATCHDOG *watchdog = NULL;
 
 /**
  * Initialise the housekeeper thread
@@ -65,10 +97,12 @@ static void hkthread(void *);
 void
 hkinit()
 {
+    tw_init();
     if (thread_start(&hk_thr_handle, hkthread, NULL) == NULL)
     {
         MXS_ERROR("Failed to start housekeeper thread.");
     }
+    hktask_add("poll_watchdog", hkwatchdog, NULL, HKWATCHDOG_FREQ);
 }
 
 /**
@@ -107,6 +141,7 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
     task->frequency = frequency;
     task->type = HK_REPEATED;
     task->nextdue = time(0) + frequency;
+    task->timer = NULL;
     task->next = NULL;
     spinlock_acquire(&tasklock);
     ptr = tasks;
@@ -138,6 +173,12 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
     }
     spinlock_release(&tasklock);
 
+    if ((task->timer = tw_add(frequency * 10L, hktask_run, task)) == NULL)
+    {
+        hktask_remove(name);
+        return 0;
+    }
+
     return task->nextdue;
 }
 
@@ -173,6 +214,7 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
     task->frequency = 0;
     task->type = HK_ONESHOT;
     task->nextdue = time(0) + when;
+    task->timer = NULL;
     task->next = NULL;
     spinlock_acquire(&tasklock);
     ptr = tasks;
@@ -197,6 +239,12 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
     }
     spinlock_release(&tasklock);
 
+    if ((task->timer = tw_add(when * 10L, hktask_run, task)) == NULL)
+    {
+        hktask_remove(name);
+        return 0;
+    }
+
     return task->nextdue;
 }
 
@@ -231,6 +279,7 @@ hktask_remove(const char *name)
 
     if (ptr)
     {
+        tw_remove(ptr->timer);
         free(ptr->name);
         free(ptr);
         return 1;
@@ -243,65 +292,62 @@ hktask_remove(const char *name)
 
 
 /**
- * The housekeeper thread implementation.
+ * Timer wheel expiry function for a housekeeper task.
  *
- * This function is responsible for executing the housekeeper tasks.
+ * The task function is called without any locks being held so it may
+ * freely manipulate the housekeeper task list. Repeated tasks
+ * reschedule their timer for the next period before returning, one-shot
+ * tasks remove themselves from the task list, which dooms the executing
+ * timer via tw_remove(). It is vital that the task->nextdue time is
+ * updated before the task is run.
  *
- * The implementation of the callng of the task functions is such that
- * the tasks are called without the tasklock spinlock being held. This
- * allows manipulation of the housekeeper task list during execution of
- * one of the tasks. The resutl is that upon completion of a task the
- * search for tasks to run must restart from the start of the queue.
- * It is vital that the task->nextdue tiem is updated before the task
- * is run.
+ * @param       data            The HKTASK that has become due
+ */
+static void
+hktask_run(void *data)
+{
+    HKTASK *task = (HKTASK *)data;
+    void (*taskfn)(void *) = task->task;
+    void *taskdata = task->data;
+    HKTASK_TYPE type = task->type;
+
+    if (type == HK_REPEATED)
+    {
+        task->nextdue = time(0) + task->frequency;
+    }
+    (*taskfn)(taskdata);
+    if (type == HK_REPEATED)
+    {
+        tw_reschedule(task->timer, task->frequency * 10L);
+    }
+    else
+    {
+        hktask_remove(task->name);
+    }
+}
+
+/**
+ * The housekeeper thread implementation.
+ *
+ * This thread is responsible for maintaining the hkheartbeat counter
+ * and for turning the timer wheel that drives both the housekeeper
+ * tasks and the DCB idle timeouts. Task functions are executed on this
+ * thread by the timer wheel expiry processing.
  *
  * @param       data            Unused, here to satisfy the thread system
  */
 void
 hkthread(void *data)
 {
-    HKTASK *ptr;
-    time_t now;
-    void (*taskfn)(void *);
-    void *taskdata;
-    int i;
-
     for (;;)
     {
-        for (i = 0; i < 10; i++)
+        if (do_shutdown)
         {
-            if (do_shutdown)
-            {
-                return;
-            }
-            thread_millisleep(100);
-            hkheartbeat++;
+            return;
         }
-        now = time(0);
-        spinlock_acquire(&tasklock);
-        ptr = tasks;
-        while (ptr)
-        {
-            if (ptr->nextdue <= now)
-            {
-                ptr->nextdue = now + ptr->frequency;
-                taskfn = ptr->task;
-                taskdata = ptr->data;
-                spinlock_release(&tasklock);
-                (*taskfn)(taskdata);
-                if (ptr->type == HK_ONESHOT)
-                {
-                    hktask_remove(ptr->name);
-                }
-                spinlock_acquire(&tasklock);
-                ptr = tasks;
-            }
-            else
-            {
-                ptr = ptr->next;
-            }
-        }
-        spinlock_release(&tasklock);
+        thread_millisleep(100);
+        hkheartbeat++;
+        tw_tick();
     }
 }
 
@@ -344,3 +390,126 @@ hkshow_tasks(DCB *pdcb)
     }
     spinlock_release(&tasklock);
 }
+
+/**
+ * The watchdog task of the polling threads.
+ *
+ * Each run samples the activity snapshot of every polling thread. A
+ * thread that is processing an event and whose poll cycle counter has
+ * not advanced since the previous sample has been stuck inside one
+ * event handler for at least the sample interval; the stall counter is
+ * incremented and the DCB, session and kernel stack of the thread are
+ * logged so that the blocking module or system call can be identified.
+ * Recovery from a stall is also logged, with the observed duration.
+ *
+ * @param data  Unused, here to satisfy the housekeeper task interface
+ */
+static void
+hkwatchdog(void *data)
+{
+    POLL_ACTIVITY activity;
+    int i, nthreads = poll_nthreads();
+
+    if (watchdog == NULL &&
+        (watchdog = (HKWATCHDOG *)calloc(nthreads, sizeof(HKWATCHDOG))) == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        if (poll_thread_activity(i, &activity) != 0)
+        {
+            continue;
+        }
+        if (activity.busy && activity.cycles == watchdog[i].cycles
+            && watchdog[i].cycles != 0)
+        {
+            watchdog[i].stalled++;
+            if (watchdog[i].stalled == 1)
+            {
+                poll_count_stall();
+                MXS_ERROR("Polling thread %d (tid %d) has been stuck in "
+                          "an event handler for at least %d seconds.",
+                          i, activity.tid, HKWATCHDOG_FREQ);
+                /*
+                 * The DCB of a stalled thread cannot be freed under the
+                 * watchdog; zombie processing runs on the polling
+                 * threads and the stalled thread has not returned from
+                 * its handler.
+                 */
+                if (activity.dcb)
+                {
+                    MXS_ERROR("Thread %d is processing event 0x%x of dcb %p, "
+                              "fd %d, state %s, session %p, client %s.",
+                              i, activity.event, activity.dcb,
+                              activity.dcb->fd,
+                              STRDCBSTATE(activity.dcb->state),
+                              activity.dcb->session,
+                              activity.dcb->remote
+                              ? activity.dcb->remote : "none");
+                }
+                hkwatchdog_stack(activity.tid);
+            }
+            else
+            {
+                MXS_ERROR("Polling thread %d (tid %d) is still stalled "
+                          "after %d seconds.",
+                          i, activity.tid,
+                          watchdog[i].stalled * HKWATCHDOG_FREQ);
+            }
+        }
+        else
+        {
+            if (watchdog[i].stalled)
+            {
+                MXS_NOTICE("Polling thread %d recovered after a stall of "
+                           "at least %d seconds.",
+                           i, watchdog[i].stalled * HKWATCHDOG_FREQ);
+            }
+            watchdog[i].stalled = 0;
+            watchdog[i].cycles = activity.cycles;
+        }
+    }
+}
+
+/**
+ * Log the kernel assisted stack capture of a stalled thread.
+ *
+ * The wait channel and kernel stack of the thread are read from
+ * /proc/self/task and written to the error log; the stack shows where a
+ * thread blocked in the kernel is waiting, e.g. a DNS lookup or a disk
+ * read. Reading the stack file needs CAP_SYS_ADMIN, when that is not
+ * available only the wait channel is logged.
+ *
+ * @param tid   The kernel task id of the stalled thread
+ */
+static void
+hkwatchdog_stack(int tid)
+{
+    char path[64], line[256];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/wchan", tid);
+    if ((fp = fopen(path, "r")) != NULL)
+    {
+        if (fgets(line, sizeof(line), fp) != NULL)
+        {
+            MXS_ERROR("Thread tid %d wait channel: %s", tid, line);
+        }
+        fclose(fp);
+    }
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stack", tid);
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        MXS_ERROR("Kernel stack of tid %d is not available: %s",
+                  tid, strerror(errno));
+        return;
+    }
+    MXS_ERROR("Kernel stack of tid %d:", tid);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        MXS_ERROR("    %s", line);
+    }
+    fclose(fp);
+}
@@ -29,6 +29,7 @@
  *
  * Date         Who                     Description
  * 26/01/16     Martin Brampton         Initial implementation
+ * 28/06/16     Martin Brampton         Enable SSL session resumption caching
  *
  * @endverbatim
  */
@@ -40,6 +41,13 @@
 #include <gw_protocol.h>
 #include <log_manager.h>
 
+/** Number of SSL sessions retained for resumption, per listener */
+#define SSL_SESSION_CACHE_SIZE 1024
+/** Seconds for which a cached SSL session remains valid */
+#define SSL_SESSION_TIMEOUT 3600
+
+static const unsigned char ssl_session_id_context[] = "MaxScale";
+
 static RSA *rsa_512 = NULL;
 static RSA *rsa_1024 = NULL;
 
@@ -62,6 +70,8 @@ listener_alloc(char *protocol, char *address, unsigned short port, char *authent
     if ((proto = (SERV_LISTENER *)malloc(sizeof(SERV_LISTENER))) != NULL)
     {
         proto->listener = NULL;
+        proto->shards = NULL;
+        proto->n_shards = 0;
         proto->protocol = strdup(protocol);
         proto->address = address ? strdup(address) : NULL;
         proto->port = port;
@@ -178,6 +188,19 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
         /** Enable all OpenSSL bug fixes */
         SSL_CTX_set_options(ssl_listener->ctx,SSL_OP_ALL);
 
+        /** Enable server side caching of SSL sessions, so that a client
+         * reconnecting can resume its session with an abbreviated handshake
+         * that avoids the expensive asymmetric key operations. The session
+         * id context must be set for resumption to be allowed when client
+         * certificates are being verified. Session tickets, for clients
+         * that support them, are enabled by default. */
+        SSL_CTX_set_session_id_context(ssl_listener->ctx,
+                                       ssl_session_id_context,
+                                       sizeof(ssl_session_id_context) - 1);
+        SSL_CTX_set_session_cache_mode(ssl_listener->ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ssl_listener->ctx, SSL_SESSION_CACHE_SIZE);
+        SSL_CTX_set_timeout(ssl_listener->ctx, SSL_SESSION_TIMEOUT);
+
         /** Generate the 512-bit and 1024-bit RSA keys */
         if (rsa_512 == NULL)
         {
@@ -30,6 +30,11 @@
  *                                      Also updated to call fixed GetModuleObject
  * 02/06/14     Mark Riddoch            Addition of module info
  * 26/02/15     Massimiliano Pinto      Addition of module_feedback_send
+ * 28/06/16     Mark Riddoch            Serialise module loading; services are
+ *                                      now started concurrently
+ * 01/07/16     Mark Riddoch            Hash the module registry by name
+ * 03/07/16     Mark Riddoch            Registry traversal made lock free with
+ *                                      epoch based protection
  *
  * @endverbatim
  */
@@ -50,9 +55,31 @@
 #include <openssl/sha.h>
 #include <gw.h>
 #include <gwdirs.h>
+#include <spinlock.h>
+#include <rcu.h>
 
 static MODULES *registered = NULL;
 
+/**
+ * The module registry hashed by module name. The linked list headed by
+ * registered is kept for the diagnostic routines that iterate over every
+ * module; lookups by name use the hash chains.
+ */
+#define MODULE_HASHSIZE 32
+
+static MODULES *module_hash[MODULE_HASHSIZE];
+
+/**
+ * Lock protecting writers to the module registry; services are started
+ * concurrently and may race to load the same protocol module. Readers
+ * traverse the registry without the lock inside an rcu_read_lock()
+ * section; modifications are published with rcu_assign_pointer() and an
+ * unregistered module is freed only after rcu_synchronize() has drained
+ * the readers that could still see it.
+ */
+static SPINLOCK modlock = SPINLOCK_INIT;
+
+static void *load_module_unlocked(const char *module, const char *type);
 static MODULES *find_module(const char *module);
 static void register_module(const char *module,
                             const char  *type,
@@ -112,6 +139,24 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
  */
 void *
 load_module(const char *module, const char *type)
+{
+    void *modobj;
+
+    spinlock_acquire(&modlock);
+    modobj = load_module_unlocked(module, type);
+    spinlock_release(&modlock);
+    return modobj;
+}
+
+/**
+ * The real work of load_module, run with the module registry locked.
+ *
+ * @param module        Name of the module to load
+ * @param type          Type of module, used purely for registration
+ * @return              The module specific entry point structure or NULL
+ */
+static void *
+load_module_unlocked(const char *module, const char *type)
 {
     char *home, *version;
     char fname[MAXPATHLEN+1];
@@ -252,15 +297,18 @@ load_module(const char *module, const char *type)
 void
 unload_module(const char *module)
 {
-    MODULES *mod = find_module(module);
+    MODULES *mod;
     void *handle;
 
-    if (!mod)
+    spinlock_acquire(&modlock);
+    if ((mod = find_module(module)) == NULL)
     {
+        spinlock_release(&modlock);
         return;
     }
     handle = mod->handle;
     unregister_module(module);
+    spinlock_release(&modlock);
     dlclose(handle);
 }
 
@@ -271,10 +319,22 @@ unload_module(const char *module)
  * @param module        The name of the module
  * @return              The module handle or NULL if it was not found
  */
+static unsigned int
+module_hash_key(const char *module)
+{
+    unsigned int hash = 5381;
+
+    while (*module)
+    {
+        hash = ((hash << 5) + hash) + *module++;
+    }
+    return hash % MODULE_HASHSIZE;
+}
+
 static MODULES *
 find_module(const char *module)
 {
-    MODULES *mod = registered;
+    MODULES *mod = module_hash[module_hash_key(module)];
 
     while (mod)
     {
@@ -284,7 +344,7 @@ find_module(const char *module)
         }
         else
         {
-            mod = mod->next;
+            mod = mod->hash_next;
         }
     }
     return NULL;
@@ -310,6 +370,7 @@ register_module(const char *module,
                 MODULE_INFO *mod_info)
 {
     MODULES *mod;
+    unsigned int key;
 
     if ((mod = malloc(sizeof(MODULES))) == NULL)
     {
@@ -322,7 +383,12 @@ register_module(const char *module,
     mod->modobj = modobj;
     mod->next = registered;
     mod->info = mod_info;
-    registered = mod;
+    /* The entry must be fully initialised before lock free readers can
+     * reach it through either list head. */
+    rcu_assign_pointer(registered, mod);
+    key = module_hash_key(module);
+    mod->hash_next = module_hash[key];
+    rcu_assign_pointer(module_hash[key], mod);
 }
 
 /**
@@ -335,6 +401,7 @@ unregister_module(const char *module)
 {
     MODULES *mod = find_module(module);
     MODULES *ptr;
+    unsigned int key;
 
     if (!mod)
     {
@@ -362,9 +429,32 @@ unregister_module(const char *module)
     }
 
     /*<
-     * The module is now not in the linked list and all
-     * memory related to it can be freed
+     * Remove the module from its registry hash chain as well.
+     */
+    key = module_hash_key(module);
+    if (module_hash[key] == mod)
+    {
+        module_hash[key] = mod->hash_next;
+    }
+    else
+    {
+        ptr = module_hash[key];
+        while (ptr && ptr->hash_next != mod)
+        {
+            ptr = ptr->hash_next;
+        }
+        if (ptr && (ptr->hash_next == mod))
+        {
+            ptr->hash_next = mod->hash_next;
+        }
+    }
+
+    /*<
+     * The module is now not in the linked list; wait until no lock free
+     * reader can still be traversing it, after which all memory related
+     * to it can be freed.
      */
+    rcu_synchronize();
     dlclose(mod->handle);
     free(mod->module);
     free(mod->type);
@@ -395,15 +485,18 @@ unload_all_modules()
 void
 printModules()
 {
-    MODULES *ptr = registered;
+    MODULES *ptr;
 
     printf("%-15s | %-11s | Version\n", "Module Name", "Module Type");
     printf("-----------------------------------------------------\n");
+    rcu_read_lock();
+    ptr = rcu_dereference(registered);
     while (ptr)
     {
         printf("%-15s | %-11s | %s\n", ptr->module, ptr->type, ptr->version);
         ptr = ptr->next;
     }
+    rcu_read_unlock();
 }
 
 /**
@@ -414,8 +507,10 @@ printModules()
 void
 dprintAllModules(DCB *dcb)
 {
-    MODULES *ptr = registered;
+    MODULES *ptr;
 
+    rcu_read_lock();
+    ptr = rcu_dereference(registered);
     dcb_printf(dcb, "Modules.\n");
     dcb_printf(dcb, "----------------+-------------+---------+-------+-------------------------\n");
     dcb_printf(dcb, "%-15s | %-11s | Version | API   | Status\n", "Module Name", "Module Type");
@@ -441,6 +536,7 @@ dprintAllModules(DCB *dcb)
         dcb_printf(dcb, "\n");
         ptr = ptr->next;
     }
+    rcu_read_unlock();
     dcb_printf(dcb, "----------------+-------------+---------+-------+-------------------------\n\n");
 }
 
@@ -453,10 +549,16 @@ void
 moduleShowFeedbackReport(DCB *dcb)
 {
     GWBUF *buffer;
-    MODULES *modules_list = registered;
+    MODULES *modules_list;
     FEEDBACK_CONF *feedback_config = config_get_feedback_data();
+    int report_ok;
 
-    if (!module_create_feedback_report(&buffer, modules_list, feedback_config))
+    rcu_read_lock();
+    modules_list = rcu_dereference(registered);
+    report_ok = module_create_feedback_report(&buffer, modules_list, feedback_config);
+    rcu_read_unlock();
+
+    if (!report_ok)
     {
         MXS_ERROR("Error in module_create_feedback_report(): gwbuf_alloc() failed to allocate memory");
 
@@ -482,7 +584,8 @@ moduleRowCallback(RESULTSET *set, void *data)
     RESULT_ROW *row;
     MODULES *ptr;
 
-    ptr = registered;
+    rcu_read_lock();
+    ptr = rcu_dereference(registered);
     while (i < *rowno && ptr)
     {
         i++;
@@ -490,6 +593,7 @@ moduleRowCallback(RESULTSET *set, void *data)
     }
     if (ptr == NULL)
     {
+        rcu_read_unlock();
         free(data);
         return NULL;
     }
@@ -513,6 +617,7 @@ moduleRowCallback(RESULTSET *set, void *data)
                                ? "GA"
                                : (ptr->info->status == MODULE_EXPERIMENTAL
                                   ? "Experimental" : "Unknown")))));
+    rcu_read_unlock();
     return row;
 }
 
@@ -554,7 +659,7 @@ moduleGetList()
 void
 module_feedback_send(void* data)
 {
-    MODULES *modules_list = registered;
+    MODULES *modules_list;
     CURL *curl = NULL;
     CURLcode res;
     struct curl_httppost *formpost=NULL;
@@ -569,6 +674,7 @@ module_feedback_send(void* data)
     int n_mod=0;
     char hex_setup_info[2 * SHA_DIGEST_LENGTH + 1]="";
     int http_send = 0;
+    int report_ok;
 
     now = time(NULL);
     struct tm now_result;
@@ -628,7 +734,12 @@ module_feedback_send(void* data)
     MXS_INFO("module_feedback_send(): task now runs: hour is [%d], last_action [%d]",
              hour, feedback_config->feedback_last_action);
 
-    if (!module_create_feedback_report(&buffer, modules_list, feedback_config))
+    rcu_read_lock();
+    modules_list = rcu_dereference(registered);
+    report_ok = module_create_feedback_report(&buffer, modules_list, feedback_config);
+    rcu_read_unlock();
+
+    if (!report_ok)
     {
         MXS_ERROR("Error in module_create_feedback_report(): gwbuf_alloc() failed to allocate memory");
 
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <syslog.h>
 #include <atomic.h>
+#include <platform.h>
 
 #include <mlist.h>
 #include <skygw_debug.h>
@@ -117,6 +118,35 @@ static struct
     false                     // use_stdout
 };
 
+/**
+ * Rate limiting of duplicate messages. A failing backend can cause the
+ * identical error to be logged tens of thousands of times per second,
+ * at which point the logging itself becomes part of the outage. Each
+ * logging call site, identified by the file name literal and line number
+ * that the MXS_LOG_MESSAGE macro passes in, is hashed into a fixed table
+ * of sites. A site may log at most LM_SUPPRESS_BURST messages within a
+ * window of LM_SUPPRESS_WINDOW seconds; the excess is dropped and the
+ * first message of the following window is annotated with the number of
+ * messages that were suppressed. Two call sites hashing to the same slot
+ * simply disables suppression for both, so a collision can never lose
+ * messages.
+ */
+#define LM_SUPPRESS_SLOTS  256  /**< Must be a power of two */
+#define LM_SUPPRESS_WINDOW 10   /**< Length of the rate window in seconds */
+#define LM_SUPPRESS_BURST  20   /**< Messages allowed per site in a window */
+
+typedef struct message_site
+{
+    const char *ms_file;       /**< File name literal of the call site */
+    int         ms_line;       /**< Line number of the call site */
+    int         ms_lock;       /**< Protects the fields below */
+    time_t      ms_window;     /**< Start of the current rate window */
+    uint32_t    ms_count;      /**< Messages seen in the current window */
+    uint64_t    ms_suppressed; /**< Total messages suppressed for the site */
+} message_site_t;
+
+static message_site_t message_sites[LM_SUPPRESS_SLOTS];
+
 /**
  * Variable holding the enabled priorities information.
  * Used from logging macros.
@@ -210,6 +240,18 @@ typedef struct blockbuf
 #endif
 } blockbuf_t;
 
+/**
+ * Each thread caches the block buffer it last wrote to. As long as the
+ * cached buffer has space the log writer appends to it without touching
+ * the shared buffer list at all; the only lock taken is the buffer's own
+ * mutex, which is contended merely by the flusher thread. The shared list
+ * is consulted only when the cached buffer has filled up. The generation
+ * count invalidates the cached pointers when the buffer list is freed.
+ */
+static thread_local blockbuf_t* tls_blockbuf = NULL;
+static thread_local int tls_blockbuf_gen = 0;
+static int blockbuf_gen = 1;
+
 /**
  * logfile object corresponds to physical file(s) where
  * certain log is written.
@@ -863,6 +905,39 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
     CHK_LOGFILE(lf);
     bb_list = &lf->lf_blockbuf_list;
 
+    /** Try the block buffer cached by this thread first. */
+    if ((bb = tls_blockbuf) != NULL && tls_blockbuf_gen == blockbuf_gen)
+    {
+        simple_mutex_lock(&bb->bb_mutex, true);
+
+        if (bb->bb_state == BB_CLEARED)
+        {
+            /** The flusher has written the buffer out and reset it */
+            bb->bb_state = BB_READY;
+        }
+        if (bb->bb_state == BB_READY && bb->bb_buf_left >= str_len)
+        {
+            blockbuf_register(bb);
+            *p_bb = bb;
+            pos = &bb->bb_buf[bb->bb_buf_used];
+            bb->bb_buf_used += str_len;
+            bb->bb_buf_left -= str_len;
+            bb->bb_state = (flush == true ? BB_FULL : bb->bb_state);
+            simple_mutex_unlock(&bb->bb_mutex);
+            return pos;
+        }
+        /**
+         * The cached buffer has no room; mark it for the flusher and
+         * fall back to the shared list to find or create another one.
+         */
+        if (bb->bb_state == BB_READY)
+        {
+            bb->bb_state = BB_FULL;
+        }
+        simple_mutex_unlock(&bb->bb_mutex);
+        tls_blockbuf = NULL;
+    }
+
     /** Lock list */
     simple_mutex_lock(&bb_list->mlist_mutex, true);
     CHK_MLIST(bb_list);
@@ -1097,6 +1172,12 @@ static char* blockbuf_get_writepos(blockbuf_t** p_bb,
 
     /** Unlock buffer */
     simple_mutex_unlock(&bb->bb_mutex);
+
+    /** Cache the buffer so that the next write of this thread can append
+     * to it without walking the shared list. */
+    tls_blockbuf = bb;
+    tls_blockbuf_gen = blockbuf_gen;
+
     return pos;
 }
 
@@ -1964,6 +2045,8 @@ static void logfile_done(logfile_t* lf)
         /** Test if list is initialized before freeing it */
         if (lf->lf_blockbuf_list.mlist_versno != 0)
         {
+            /** Invalidate the block buffers cached by the threads */
+            atomic_add(&blockbuf_gen, 1);
             mlist_done(&lf->lf_blockbuf_list);
         }
         logfile_free_memory(lf);
@@ -2722,6 +2805,93 @@ static enum log_flush priority_to_flush(int priority)
     }
 }
 
+/**
+ * Apply the duplicate message rate limit to a logging call site.
+ *
+ * @param file     The file name literal of the call site.
+ * @param line     The line number of the call site.
+ * @param repeated On return, the number of messages that were suppressed
+ *                 in the window that has just closed, to be announced
+ *                 along with this message. Zero if there were none.
+ *
+ * @return True if the message should be dropped.
+ */
+static bool message_suppress(const char* file, int line, uint64_t* repeated)
+{
+    size_t slot = (((uintptr_t)file >> 4) ^ ((uint32_t)line * 2654435761U)) &
+        (LM_SUPPRESS_SLOTS - 1);
+    message_site_t* ms = &message_sites[slot];
+    bool suppress = false;
+
+    *repeated = 0;
+
+    acquire_lock(&ms->ms_lock);
+
+    if (ms->ms_file == NULL)
+    {
+        ms->ms_file = file;
+        ms->ms_line = line;
+        ms->ms_window = time(NULL);
+        ms->ms_count = 1;
+    }
+    else if (ms->ms_file == file && ms->ms_line == line)
+    {
+        time_t now = time(NULL);
+
+        if (now - ms->ms_window >= LM_SUPPRESS_WINDOW)
+        {
+            if (ms->ms_count > LM_SUPPRESS_BURST)
+            {
+                *repeated = ms->ms_count - LM_SUPPRESS_BURST;
+            }
+            ms->ms_window = now;
+            ms->ms_count = 1;
+        }
+        else if (++ms->ms_count > LM_SUPPRESS_BURST)
+        {
+            ms->ms_suppressed++;
+            suppress = true;
+        }
+    }
+    /**
+     * A different call site occupies the slot; log the message without
+     * any rate limiting.
+     */
+
+    release_lock(&ms->ms_lock);
+
+    return suppress;
+}
+
+/**
+ * Iterate over the call sites that have had messages suppressed and
+ * report each one through the given callback. Used by maxadmin to make
+ * the suppression counters visible.
+ *
+ * @param cb       Callback invoked once per call site with suppressed messages.
+ * @param userdata Opaque pointer passed through to the callback.
+ */
+void mxs_log_suppression_stats(void (*cb)(void* userdata, const char* file,
+                                          int line, uint64_t suppressed),
+                               void* userdata)
+{
+    for (int i = 0; i < LM_SUPPRESS_SLOTS; i++)
+    {
+        message_site_t* ms = &message_sites[i];
+
+        acquire_lock(&ms->ms_lock);
+        const char* file = ms->ms_file;
+        int line = ms->ms_line;
+        uint64_t suppressed = ms->ms_suppressed;
+        release_lock(&ms->ms_lock);
+
+        if (file && suppressed)
+        {
+            cb(userdata, file, line, suppressed);
+        }
+    }
+}
+
 /**
  * Log a message of a particular priority.
  *
@@ -2745,6 +2915,12 @@ int mxs_log_message(int priority,
         if (MXS_LOG_PRIORITY_IS_ENABLED(priority))
         {
             va_list valist;
+            uint64_t repeated = 0;
+
+            if (message_suppress(file, line, &repeated))
+            {
+                return 0;
+            }
 
             /**
              * Find out the length of log string (to be formatted str).
@@ -2775,14 +2951,26 @@ int mxs_log_message(int priority,
                     break;
                 }
 
-                int buffer_len = prefix.len + augmentation_len + message_len + 1; // Trailing NULL
+                static const char FORMAT_SUPPRESSION[] =
+                    " (message repeated %lu times in the last %d seconds)";
+
+                char suffix[sizeof(FORMAT_SUPPRESSION) + 32];
+                int suffix_len = 0;
+
+                if (repeated)
+                {
+                    suffix_len = sprintf(suffix, FORMAT_SUPPRESSION,
+                                         (unsigned long)repeated, LM_SUPPRESS_WINDOW);
+                }
+
+                int buffer_len = prefix.len + augmentation_len + message_len + suffix_len + 1; // Trailing NULL
 
                 if (buffer_len > MAX_LOGSTRLEN)
                 {
                     message_len -= (buffer_len - MAX_LOGSTRLEN);
                     buffer_len = MAX_LOGSTRLEN;
 
-                    assert(prefix.len + augmentation_len + message_len + 1 == buffer_len);
+                    assert(prefix.len + augmentation_len + message_len + suffix_len + 1 == buffer_len);
                 }
 
                 char buffer[buffer_len];
@@ -2790,6 +2978,7 @@ int mxs_log_message(int priority,
                 char *prefix_text = buffer;
                 char *augmentation_text = buffer + prefix.len;
                 char *message_text = buffer + prefix.len + augmentation_len;
+                char *suffix_text = buffer + prefix.len + augmentation_len + message_len;
 
                 strcpy(prefix_text, prefix.text);
 
@@ -2814,6 +3003,11 @@ int mxs_log_message(int priority,
                 vsnprintf(message_text, message_len + 1, format, valist);
                 va_end(valist);
 
+                if (suffix_len)
+                {
+                    memcpy(suffix_text, suffix, suffix_len + 1);
+                }
+
                 enum log_flush flush = priority_to_flush(priority);
 
                 err = log_write(priority, file, line, function, prefix.len, buffer_len, buffer, flush);
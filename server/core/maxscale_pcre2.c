@@ -26,10 +26,13 @@
  *
  * Date       Who           Description
  * 30-10-2015 Markus Makela Initial implementation
+ * 09-06-2016 Markus Makela Added mxs_pcre2_jit_enable
  * @endverbatim
  */
 
 #include <maxscale_pcre2.h>
+#include <atomic.h>
+#include <log_manager.h>
 
 /**
  * Utility wrapper for PCRE2 library function call pcre2_substitute.
@@ -137,3 +140,32 @@ mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subje
     }
     return rval;
 }
+
+/**
+ * JIT compile a previously compiled pattern.
+ *
+ * Patterns that are matched repeatedly should be JIT compiled after the call
+ * to pcre2_compile, the JIT compiled form is then used transparently by
+ * pcre2_match. If the PCRE2 library was built without JIT support the pattern
+ * is left in its interpretive form and matching still works, so a failure
+ * does not need to be treated as an error by the caller.
+ *
+ * @param re Compiled pattern to JIT compile
+ * @return True if the pattern was JIT compiled
+ */
+bool mxs_pcre2_jit_enable(pcre2_code *re)
+{
+    static int warned = 0;
+
+    if (pcre2_jit_compile(re, PCRE2_JIT_COMPLETE) == 0)
+    {
+        return true;
+    }
+
+    if (atomic_add(&warned, 1) == 0)
+    {
+        MXS_NOTICE("PCRE2 JIT compilation is not available, "
+                   "falling back to interpreted matching.");
+    }
+    return false;
+}
@@ -0,0 +1,295 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file memaccount.c - Per subsystem memory accounting
+ *
+ * The major consumers of memory report their heap allocations and
+ * releases here so that a per subsystem total is available with the
+ * maxadmin "show memory" command and an overall memory budget can be
+ * enforced. A subsystem calls memacct_add() with a positive byte count
+ * when memory is taken from the heap and a negative count when it is
+ * returned; objects held on the recycling pools remain counted, so the
+ * totals reflect the memory the process actually holds. The updates go
+ * to a per-thread, cache line sized slot in the style of statistics.c
+ * so that the hot allocation paths do not contend on a shared counter.
+ *
+ * A housekeeper task periodically sums the slots and, if a budget has
+ * been set with the global 'memory_budget' configuration parameter,
+ * invokes the registered pressure callbacks while the total exceeds
+ * the budget. Caching subsystems register a callback that sheds their
+ * entries, reclaiming memory without affecting correctness.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 03/07/16     Mark Riddoch            Initial implementation
+ *
+ * @endverbatim
+ */
+#include <memaccount.h>
+#include <housekeeper.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <platform.h>
+#include <skygw_debug.h>
+#include <log_manager.h>
+
+/** Defined in statistics.c; the slot index of the calling thread.
+ * Threads that have not been given an id of their own share slot zero,
+ * which is why the slots are updated with atomic operations. */
+extern thread_local int current_thread_id;
+
+/** The slots of a counter are padded out to a cache line each so that
+ * the threads do not invalidate the lines of their neighbours. */
+#define MEMACCT_CACHE_LINE   64
+
+/** Number of per-thread slots of each counter. The thread id is folded
+ * into this range, so the array needs no sizing against the configured
+ * thread count and the counters are usable before the configuration
+ * has been processed. */
+#define MEMACCT_THREAD_SLOTS 64
+
+/** How often the housekeeper checks the total against the budget, in
+ * seconds */
+#define MEMACCT_CHECK_FREQ   5
+
+/** Maximum number of registerable pressure callbacks */
+#define MEMACCT_MAX_PRESSURE 8
+
+typedef union
+{
+    int64_t value;                   /*< The per-thread component of the total */
+    char    pad[MEMACCT_CACHE_LINE]; /*< Pad the slot to a full cache line */
+} MEMACCT_SLOT;
+
+static MEMACCT_SLOT totals[MEM_ACCT_MAX][MEMACCT_THREAD_SLOTS];
+
+static const char *subsys_names[MEM_ACCT_MAX] =
+{
+    "Buffers",
+    "Descriptors",
+    "Sessions",
+    "Hashtables",
+    "Result cache"
+};
+
+/** The registered pressure callbacks. Entries are only ever appended,
+ * under the lock; the check task reads the count without it. */
+static struct
+{
+    void (*fn)(void *); /*< The callback */
+    void *arg;          /*< Caller supplied argument */
+} pressure[MEMACCT_MAX_PRESSURE];
+
+static int      n_pressure = 0;
+static SPINLOCK memacct_lock = SPINLOCK_INIT;
+static uint64_t memacct_budget = 0;      /*< The budget in bytes, 0 = no budget */
+static bool     over_budget = false;     /*< Was the budget exceeded at the last check */
+static int      n_pressure_events = 0;   /*< Number of checks that found the budget exceeded */
+
+/**
+ * Record an allocation or release of memory by a subsystem.
+ *
+ * @param subsys        The subsystem the memory belongs to
+ * @param bytes         Number of bytes allocated, negative for a release
+ */
+void
+memacct_add(MEMACCT_SUBSYS subsys, int64_t bytes)
+{
+    ss_dassert(subsys < MEM_ACCT_MAX);
+    __sync_fetch_and_add(&totals[subsys][current_thread_id % MEMACCT_THREAD_SLOTS].value,
+                         bytes);
+}
+
+/**
+ * Return the number of bytes currently held by a subsystem.
+ *
+ * @param subsys        The subsystem to sum
+ * @return The total number of bytes
+ */
+int64_t
+memacct_total(MEMACCT_SUBSYS subsys)
+{
+    int64_t sum = 0;
+    int     i;
+
+    ss_dassert(subsys < MEM_ACCT_MAX);
+    for (i = 0; i < MEMACCT_THREAD_SLOTS; i++)
+    {
+        sum += totals[subsys][i].value;
+    }
+    return sum;
+}
+
+/**
+ * Return the number of bytes held by all accounted subsystems together.
+ *
+ * @return The total number of bytes
+ */
+int64_t
+memacct_grand_total()
+{
+    int64_t sum = 0;
+    int     i;
+
+    for (i = 0; i < MEM_ACCT_MAX; i++)
+    {
+        sum += memacct_total(i);
+    }
+    return sum;
+}
+
+/**
+ * Return the printable name of a subsystem.
+ *
+ * @param subsys        The subsystem
+ * @return The name of the subsystem
+ */
+const char *
+memacct_subsys_name(MEMACCT_SUBSYS subsys)
+{
+    ss_dassert(subsys < MEM_ACCT_MAX);
+    return subsys_names[subsys];
+}
+
+/**
+ * Set the memory budget that the periodic check enforces.
+ *
+ * @param bytes         The budget in bytes, 0 to disable the check
+ */
+void
+memacct_set_budget(uint64_t bytes)
+{
+    memacct_budget = bytes;
+}
+
+/**
+ * Register a callback that is invoked when the memory budget has been
+ * exceeded. The callback should release memory the owner can afford to
+ * lose, typically by shedding cached data; it is called from the
+ * housekeeper thread and must do its own locking.
+ *
+ * @param fn            The callback to invoke
+ * @param arg           An argument passed to the callback
+ * @return 1 if the callback was registered, 0 if the table was full
+ */
+int
+memacct_register_pressure(void (*fn)(void *), void *arg)
+{
+    int rval = 0;
+
+    spinlock_acquire(&memacct_lock);
+    if (n_pressure < MEMACCT_MAX_PRESSURE)
+    {
+        pressure[n_pressure].fn = fn;
+        pressure[n_pressure].arg = arg;
+        atomic_add(&n_pressure, 1);
+        rval = 1;
+    }
+    spinlock_release(&memacct_lock);
+    return rval;
+}
+
+/**
+ * The housekeeper task that compares the accounted total against the
+ * configured budget and applies pressure to the registered subsystems
+ * while the budget is exceeded.
+ *
+ * @param data          The housekeeper task data, unused
+ */
+static void
+memacct_check(void *data)
+{
+    int64_t total;
+    int     i, n;
+
+    if (memacct_budget == 0)
+    {
+        return;
+    }
+    total = memacct_grand_total();
+    if (total > 0 && (uint64_t)total > memacct_budget)
+    {
+        if (!over_budget)
+        {
+            MXS_WARNING("Memory usage %lu bytes exceeds the configured "
+                        "budget of %lu bytes, applying memory pressure.",
+                        (unsigned long)total,
+                        (unsigned long)memacct_budget);
+            over_budget = true;
+        }
+        n_pressure_events++;
+        n = n_pressure;
+        for (i = 0; i < n; i++)
+        {
+            pressure[i].fn(pressure[i].arg);
+        }
+    }
+    else if (over_budget)
+    {
+        MXS_NOTICE("Memory usage %lu bytes is back below the configured "
+                   "budget of %lu bytes.",
+                   (unsigned long)(total > 0 ? total : 0),
+                   (unsigned long)memacct_budget);
+        over_budget = false;
+    }
+}
+
+/**
+ * Start the periodic budget check. Called once at startup, after the
+ * housekeeper has been initialised.
+ */
+void
+memacct_init()
+{
+    hktask_add("memory_budget", memacct_check, NULL, MEMACCT_CHECK_FREQ);
+}
+
+/**
+ * Print the memory usage of the subsystems to a DCB. Used by the
+ * maxadmin "show memory" command.
+ *
+ * @param dcb           DCB to print the report to
+ */
+void
+dprintMemory(DCB *dcb)
+{
+    int i;
+
+    dcb_printf(dcb, "Memory usage by subsystem:\n");
+    for (i = 0; i < MEM_ACCT_MAX; i++)
+    {
+        dcb_printf(dcb, "\t%-16s %12ld bytes\n",
+                   subsys_names[i], (long)memacct_total(i));
+    }
+    dcb_printf(dcb, "\t%-16s %12ld bytes\n", "Total",
+               (long)memacct_grand_total());
+    if (memacct_budget)
+    {
+        dcb_printf(dcb, "Memory budget:           %12lu bytes\n",
+                   (unsigned long)memacct_budget);
+        dcb_printf(dcb, "Budget exceeded at %d of the periodic checks\n",
+                   n_pressure_events);
+    }
+    else
+    {
+        dcb_printf(dcb, "No memory budget has been configured\n");
+    }
+}
@@ -24,14 +24,18 @@
  *
  * Date         Who             Description
  * 26/09/14     Mark Riddoch    Initial implementation
+ * 03/07/16     Mark Riddoch    Flight recorder of binary trace events in
+ *                              per thread rings
  *
  * @endverbatim
  */
 #include <memlog.h>
+#include <dcb.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 
 static MEMLOG *memlogs = NULL;
 static SPINLOCK memlock = SPINLOCK_INIT;
@@ -269,3 +273,175 @@ memlog_flush(MEMLOG *log)
     log->offset = 0;
     fclose(fp);
 }
+
+/**
+ * The list of the trace rings of every thread, protected by memlock. A
+ * ring is created the first time a thread records an event and is never
+ * removed; the threads of MaxScale live for the lifetime of the process.
+ */
+static TRACE_RING *trace_rings = NULL;
+static __thread TRACE_RING *trace_ring = NULL;
+
+/** Printable names for the trace event types, indexed by TRACE_EVENT_TYPE */
+static const char *trace_event_names[] =
+{
+    "UNKNOWN",
+    "SESSION_START",
+    "SESSION_END",
+    "ROUTE_QUERY",
+    "POLL_EVENT",
+    "POLL_ERROR",
+    "DCB_CLOSE"
+};
+
+#define TRACE_N_EVENT_NAMES \
+    ((int)(sizeof(trace_event_names) / sizeof(trace_event_names[0])))
+
+/**
+ * Create and register the trace ring of the calling thread.
+ *
+ * @return The new ring or NULL if memory allocation failed
+ */
+static TRACE_RING *
+trace_ring_create()
+{
+    TRACE_RING *ring;
+
+    if ((ring = (TRACE_RING *)calloc(1, sizeof(TRACE_RING))) == NULL)
+    {
+        return NULL;
+    }
+    if ((ring->events = (TRACE_EVENT *)calloc(TRACE_RING_EVENTS,
+                                              sizeof(TRACE_EVENT))) == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->tid = (unsigned long)pthread_self();
+
+    spinlock_acquire(&memlock);
+    ring->next = trace_rings;
+    trace_rings = ring;
+    spinlock_release(&memlock);
+
+    return ring;
+}
+
+/**
+ * Record an event into the flight recorder ring of the calling thread.
+ *
+ * The ring is thread local so no locking is needed; the cost of a call
+ * is a time-stamp counter read and three stores, making it cheap enough
+ * to leave enabled in production.
+ *
+ * @param event The TRACE_EVENT_TYPE of the event
+ * @param arg1  Event specific argument, typically a pointer
+ * @param arg2  Event specific argument
+ */
+void
+trace_event(unsigned int event, uintptr_t arg1, uintptr_t arg2)
+{
+    TRACE_RING *ring;
+    TRACE_EVENT *ev;
+
+    if ((ring = trace_ring) == NULL)
+    {
+        if ((ring = trace_ring_create()) == NULL)
+        {
+            return;
+        }
+        trace_ring = ring;
+    }
+    ev = &ring->events[ring->offset];
+    ev->tsc = rdtsc();
+    ev->event = event;
+    ev->arg1 = arg1;
+    ev->arg2 = arg2;
+    if (++ring->offset == TRACE_RING_EVENTS)
+    {
+        ring->offset = 0;
+        ring->wrapped = 1;
+    }
+}
+
+/**
+ * Write the recorded events of one ring, oldest first.
+ *
+ * @param fp    The file to write to
+ * @param ring  The ring to dump
+ */
+static void
+trace_dump_ring(FILE *fp, TRACE_RING *ring)
+{
+    int i, n, start;
+
+    n = ring->wrapped ? TRACE_RING_EVENTS : (int)ring->offset;
+    start = ring->wrapped ? (int)ring->offset : 0;
+
+    fprintf(fp, "Thread %lx: %d events\n", ring->tid, n);
+    for (i = 0; i < n; i++)
+    {
+        TRACE_EVENT *ev = &ring->events[(start + i) % TRACE_RING_EVENTS];
+        const char *name = (int)ev->event < TRACE_N_EVENT_NAMES ?
+            trace_event_names[ev->event] : trace_event_names[0];
+
+        fprintf(fp, "%20llu %-14s 0x%016lx 0x%08lx\n",
+                (unsigned long long)ev->tsc, name,
+                (unsigned long)ev->arg1, (unsigned long)ev->arg2);
+    }
+}
+
+/**
+ * Dump the flight recorder rings of every thread to a file.
+ *
+ * The rings are read while other threads may still be recording into
+ * them, so an event being written at the moment of the dump can appear
+ * torn; this is accepted in exchange for not slowing the recording
+ * path, and it also allows the dump to be taken from the fatal signal
+ * handler.
+ *
+ * @param fp    The file to write to
+ */
+void
+trace_dump(FILE *fp)
+{
+    TRACE_RING *ring;
+
+    for (ring = trace_rings; ring; ring = ring->next)
+    {
+        trace_dump_ring(fp, ring);
+    }
+}
+
+/**
+ * Print the flight recorder rings of every thread to a DCB, for the
+ * maxadmin "show trace" command.
+ *
+ * @param dcb   The DCB to print to
+ */
+void
+dprintTraceRings(struct dcb *dcb)
+{
+    TRACE_RING *ring;
+    int i, n, start;
+
+    spinlock_acquire(&memlock);
+    for (ring = trace_rings; ring; ring = ring->next)
+    {
+        n = ring->wrapped ? TRACE_RING_EVENTS : (int)ring->offset;
+        start = ring->wrapped ? (int)ring->offset : 0;
+
+        dcb_printf(dcb, "Thread %lx: %d events\n", ring->tid, n);
+        for (i = 0; i < n; i++)
+        {
+            TRACE_EVENT *ev = &ring->events[(start + i) % TRACE_RING_EVENTS];
+            const char *name = (int)ev->event < TRACE_N_EVENT_NAMES ?
+                trace_event_names[ev->event] : trace_event_names[0];
+
+            dcb_printf(dcb, "%20llu %-14s 0x%016lx 0x%08lx\n",
+                       (unsigned long long)ev->tsc, name,
+                       (unsigned long)ev->arg1, (unsigned long)ev->arg2);
+        }
+    }
+    spinlock_release(&memlock);
+}
@@ -26,6 +26,12 @@
  * 04/06/14     Mark Riddoch            Initial implementation
  * 24/10/14     Massimiliano Pinto      Added modutil_send_mysql_err_packet, modutil_create_mysql_err_msg
  * 04/01/16     Martin Brampton         Streamline code in modutil_get_complete_packets
+ * 01/07/16     Mark Riddoch            Zero-copy paths in modutil_get_next_MySQL_packet
+ *                                      and copy-on-write in modutil_replace_SQL
+ * 03/07/16     Mark Riddoch            Scan packet boundaries with the buffer
+ *                                      iterator instead of linearising the chain
+ * 03/07/16     Mark Riddoch            Batch packet boundary scanner,
+ *                                      modutil_packet_offsets
  *
  * @endverbatim
  */
@@ -225,6 +231,12 @@ modutil_replace_SQL(GWBUF *orig, char *sql)
     {
         return NULL;
     }
+    /* The buffer may share its data area with a zero-copy clone, so take
+     * a private copy before the packet is modified in place. */
+    if (gwbuf_make_writable(orig) == NULL)
+    {
+        return NULL;
+    }
     ptr = GWBUF_DATA(orig);
     length = *ptr++;
     length += (*ptr++ << 8);
@@ -278,7 +290,8 @@ modutil_get_SQL(GWBUF *buf)
 {
     unsigned int len, length;
     unsigned char *ptr;
-    char *dptr, *rval = NULL;
+    char *rval = NULL;
+    GWBUF_ITERATOR iter;
 
     if (modutil_is_SQL(buf) || modutil_is_SQL_prepare(buf) || MYSQL_IS_COM_INIT_DB(buf))
     {
@@ -289,25 +302,13 @@ modutil_get_SQL(GWBUF *buf)
 
         if ((rval = (char *) malloc(length + 1)))
         {
-            dptr = rval;
-            ptr += 2; // Skip sequence id  and COM_QUERY byte
-            len = GWBUF_LENGTH(buf) - 5;
-
-            while (buf && length > 0)
-            {
-                int clen = length > len ? len : length;
-                memcpy(dptr, ptr, clen);
-                dptr += clen;
-                length -= clen;
-                buf = buf->next;
-
-                if (buf)
-                {
-                    ptr = GWBUF_DATA(buf);
-                    len = GWBUF_LENGTH(buf);
-                }
-            }
-            *dptr = 0;
+            /** Copy the SQL text with the buffer iterator, reading across
+             * the links of the chain, skipping the sequence id and the
+             * command byte */
+            gwbuf_iterator_init(&iter, buf);
+            gwbuf_iterator_skip(&iter, 5);
+            len = gwbuf_iterator_copy(&iter, (uint8_t *)rval, length - 1);
+            rval[len] = 0;
         }
     }
     return rval;
@@ -487,6 +488,11 @@ int modutil_send_mysql_err_packet(DCB        *dcb,
  * Buffer contains at least one of the following:
  * complete [complete] [partial] mysql packet
  *
+ * In the common cases, where the first buffer in the chain is exactly one
+ * packet or contains the whole of the first packet, the packet is detached
+ * or shared with the read buffer rather than copied. Only a packet that
+ * spans multiple buffers in the chain is assembled with a copy.
+ *
  * return pointer to gwbuf containing a complete packet or
  *   NULL if no complete packet was found.
  */
@@ -526,6 +532,27 @@ GWBUF* modutil_get_next_MySQL_packet(GWBUF** p_readbuf)
         goto return_packetbuf;
     }
 
+    buflen = GWBUF_LENGTH(readbuf);
+
+    if (packetlen == buflen)
+    {
+        /** The first buffer is exactly one packet, detach and return it */
+        packetbuf = gwbuf_detach_head(readbuf, p_readbuf);
+        goto return_packetbuf;
+    }
+
+    if (packetlen < buflen)
+    {
+        /** The packet is wholly within the first buffer; share the data
+         * area between the packet and the remainder of the read buffer
+         * instead of copying it. */
+        if ((packetbuf = gwbuf_clone_portion(readbuf, 0, packetlen)) != NULL)
+        {
+            *p_readbuf = gwbuf_consume(readbuf, packetlen);
+        }
+        goto return_packetbuf;
+    }
+
     packetbuf = gwbuf_alloc(packetlen);
     target    = GWBUF_DATA(packetbuf);
     packetbuf->gwbuf_type = readbuf->gwbuf_type; /*< Copy the type too */
@@ -561,8 +588,9 @@ return_packetbuf:
 GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
 {
     GWBUF *complete_part = NULL;
-    uint8_t *ptr;
+    uint8_t header[3];
     uint32_t len, blen, total = 0;
+    GWBUF_ITERATOR iter;
 
     /** Give up if the parameter is not a pointer to a pointer or
      * the total buffer length is less than the 3 bytes needed to
@@ -573,15 +601,19 @@ GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
         return NULL;
     }
 
-    *p_readbuf = gwbuf_make_contiguous(*p_readbuf);
-    ptr = (uint8_t*)(*p_readbuf)->start;
+    /** Scan the packet boundaries in place with the buffer iterator; the
+     * chain is only made contiguous once it is known that there is something
+     * worth returning. */
+    gwbuf_iterator_init(&iter, *p_readbuf);
+    gwbuf_iterator_copy(&iter, header, 3);
 
     /** We need at least 3 bytes of the packet header to know how long the next
      * packet is going to be, if we are going to cycle round again. */
-    while (total + (len = gw_mysql_get_byte3(ptr) + 4) < (blen - 3))
+    while (total + (len = gw_mysql_get_byte3(header) + 4) < (blen - 3))
     {
-        ptr += len;
         total += len;
+        gwbuf_iterator_skip(&iter, len - 3);
+        gwbuf_iterator_copy(&iter, header, 3);
     }
 
     total += len;
@@ -590,16 +622,29 @@ GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
     {
         return NULL;
     }
-    /** Full packets only, return original and null the passed buffer */
+    /** Full packets only, return original and null the passed buffer. The
+     * callers expect a single buffer; when the data arrived in one buffer,
+     * which is the common case, no copy is made. */
     if (total == blen)
     {
-        GWBUF *packet = *p_readbuf;
+        GWBUF *packet = gwbuf_make_contiguous(*p_readbuf);
         *p_readbuf = NULL;
         return packet;
     }
 
-    /** The next packet is a partial, split into complete and partial packets */
-    if ((complete_part = gwbuf_clone_portion(*p_readbuf, 0, total)) == NULL)
+    /** The next packet is a partial, split into complete and partial packets.
+     * Only the complete part is copied; the partial tail stays where it is
+     * rather than being linearised along with it on every read event. */
+    if ((*p_readbuf)->next == NULL)
+    {
+        complete_part = gwbuf_clone_portion(*p_readbuf, 0, total);
+    }
+    else if ((complete_part = gwbuf_alloc(total)) != NULL)
+    {
+        complete_part->gwbuf_type = (*p_readbuf)->gwbuf_type;
+        gwbuf_copy_data(*p_readbuf, 0, total, GWBUF_DATA(complete_part));
+    }
+    if (complete_part == NULL)
     {
         MXS_ERROR("Failed to partially clone buffer while extracting complete packets.");
         return NULL;
@@ -608,11 +653,60 @@ GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
     return complete_part;
 }
 
+/** Number of packet offsets gathered per scanner call */
+#define MODUTIL_PACKET_BATCH    128
+
+/**
+ * Scan a contiguous run of MySQL packets once and record the offset of
+ * every complete packet.
+ *
+ * The framing is length prefixed so the scan reads only the four byte
+ * header of each packet and jumps from frame to frame; callers that
+ * need to process every packet of a large result set can then consume
+ * the precomputed offsets instead of re-parsing the lengths.
+ *
+ * @param data          Start of the contiguous packet data
+ * @param len           Number of bytes of data
+ * @param offsets       Array the packet start offsets are written to
+ * @param max_offsets   Capacity of the offsets array
+ * @param bytes         If non-NULL, set to the number of bytes covered
+ *                      by the returned packets
+ * @return The number of complete packets found, at most max_offsets
+ */
+int
+modutil_packet_offsets(uint8_t *data, uint32_t len, uint32_t *offsets,
+                       int max_offsets, uint32_t *bytes)
+{
+    uint32_t offset = 0, pktlen;
+    int n = 0;
+
+    while (n < max_offsets && offset + 4 <= len)
+    {
+        pktlen = MYSQL_GET_PACKET_LEN(data + offset) + 4;
+        if (offset + pktlen > len)
+        {
+            break;
+        }
+        offsets[n++] = offset;
+        offset += pktlen;
+    }
+    if (bytes)
+    {
+        *bytes = offset;
+    }
+    return n;
+}
+
 /**
  * Count the number of EOF, OK or ERR packets in the buffer. Only complete
  * packets are inspected and the buffer is assumed to only contain whole packets.
  * If partial packets are in the buffer, they are ignored. The caller must handle the
  * detection of partial packets in buffers.
+ *
+ * The packet boundaries are precomputed in batches with
+ * modutil_packet_offsets rather than re-deriving them while inspecting
+ * the packets.
+ *
  * @param reply Buffer to use
  * @param use_ok Whether the DEPRECATE_EOF flag is set
  * @param n_found If there were previous packets found
@@ -621,40 +715,87 @@ GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
 int
 modutil_count_signal_packets(GWBUF *reply, int use_ok,  int n_found, int* more)
 {
-    unsigned char* ptr = (unsigned char*) reply->start;
+    unsigned char* base = (unsigned char*) reply->start;
     unsigned char* end = (unsigned char*) reply->end;
-    unsigned char* prev = ptr;
-    int pktlen, eof = 0, err = 0;
+    unsigned char* ptr = base;
+    unsigned char* prev = base;
+    uint32_t offsets[MODUTIL_PACKET_BATCH];
+    uint32_t used;
+    int i, n, pktlen, eof = 0, err = 0;
     int errlen = 0, eoflen = 0;
     int iserr = 0, iseof = 0;
     bool moreresults = false;
-    while (ptr < end)
+    bool done = false;
+
+    while (!done)
     {
-        pktlen = MYSQL_GET_PACKET_LEN(ptr) + 4;
+        n = modutil_packet_offsets(base, end - base, offsets,
+                                   MODUTIL_PACKET_BATCH, &used);
 
-        if ((iserr = PTR_IS_ERR(ptr)) || (iseof = PTR_IS_EOF(ptr)))
+        for (i = 0; i < n; i++)
         {
-            if (iserr)
+            ptr = base + offsets[i];
+            pktlen = MYSQL_GET_PACKET_LEN(ptr) + 4;
+
+            if ((iserr = PTR_IS_ERR(ptr)) || (iseof = PTR_IS_EOF(ptr)))
             {
-                err++;
-                errlen = pktlen;
+                if (iserr)
+                {
+                    err++;
+                    errlen = pktlen;
+                }
+                else if (iseof)
+                {
+                    eof++;
+                    eoflen = pktlen;
+                }
             }
-            else if (iseof)
+
+            if ((eof + n_found) >= 2)
             {
-                eof++;
-                eoflen = pktlen;
+                moreresults = PTR_EOF_MORE_RESULTS(ptr);
+                ptr = prev;
+                done = true;
+                break;
             }
+
+            prev = ptr;
         }
 
-        if ((ptr + pktlen) > end || (eof + n_found) >= 2)
+        if (!done)
         {
-            moreresults = PTR_EOF_MORE_RESULTS(ptr);
-            ptr = prev;
-            break;
+            base += used;
+            if (n < MODUTIL_PACKET_BATCH)
+            {
+                /** All complete packets scanned; inspect the header of a
+                 * trailing partial packet the way the byte walk did. */
+                if (base + 5 <= end)
+                {
+                    ptr = base;
+                    pktlen = MYSQL_GET_PACKET_LEN(ptr) + 4;
+                    if ((iserr = PTR_IS_ERR(ptr)) || (iseof = PTR_IS_EOF(ptr)))
+                    {
+                        if (iserr)
+                        {
+                            err++;
+                            errlen = pktlen;
+                        }
+                        else if (iseof)
+                        {
+                            eof++;
+                            eoflen = pktlen;
+                        }
+                    }
+                    moreresults = PTR_EOF_MORE_RESULTS(ptr);
+                    ptr = prev;
+                }
+                else
+                {
+                    ptr = base;
+                }
+                done = true;
+            }
         }
-
-        prev = ptr;
-        ptr += pktlen;
     }
 
 
@@ -829,8 +829,36 @@ mon_print_fail_status(MONITOR_SERVERS* mon_srv)
     return (SERVER_IS_DOWN(mon_srv->server) && mon_srv->mon_err_count == 0);
 }
 
+/**
+ * Completion callback for a monitor script.
+ *
+ * Called from the external command reaper thread once the script has
+ * exited, so the monitor thread has carried on probing in the meantime.
+ *
+ * @param cmd The completed command
+ * @param status Exit status of the script, -1 if it was killed
+ * @param data Unused
+ */
+static void
+monitor_script_done(EXTERNCMD* cmd, int status, void* data)
+{
+    if (status != 0)
+    {
+        MXS_ERROR("Monitor script '%s' returned %d.", cmd->argv[0], status);
+    }
+    else
+    {
+        MXS_NOTICE("Monitor script '%s' completed successfully.", cmd->argv[0]);
+    }
+}
+
 /**
  * Launch a script
+ *
+ * The script is executed asynchronously; the monitor thread does not
+ * wait for it to complete but continues monitoring while it runs. A
+ * script that runs longer than MON_SCRIPT_TIMEOUT seconds is killed.
+ *
  * @param mon Owning monitor
  * @param ptr The server which has changed state
  * @param script Script to execute
@@ -891,12 +919,12 @@ monitor_launch_script(MONITOR* mon, MONITOR_SERVERS* ptr, char* script)
         externcmd_substitute_arg(cmd, "[$]SYNCEDLIST", nodelist);
     }
 
-    if (externcmd_execute(cmd))
+    if (externcmd_execute_async(cmd, MON_SCRIPT_TIMEOUT, monitor_script_done, NULL))
     {
         MXS_ERROR("Failed to execute script '%s' on server state change event %s.",
                   script, mon_get_event_name(ptr));
+        externcmd_free(cmd);
     }
-    externcmd_free(cmd);
 }
 
 /**
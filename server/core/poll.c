@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <maxscale/poll.h>
 #include <dcb.h>
@@ -36,14 +38,19 @@
 #include <mysql.h>
 #include <resultset.h>
 #include <session.h>
+#include <service.h>
 #include <statistics.h>
+#include <histogram.h>
+#include <platform.h>
+#include <math.h>
 #include <query_classifier.h>
 
+#include <memlog.h>
+
 #define         PROFILE_POLL    0
 
 #if PROFILE_POLL
 #include <rdtsc.h>
-#include <memlog.h>
 
 extern unsigned long hkheartbeat;
 MEMLOG  *plog;
@@ -74,7 +81,40 @@ int max_poll_sleep;
  * 07/07/15     Martin Brampton Simplified add and remove DCB, improve error handling.
  * 23/08/15     Martin Brampton Added test so only DCB with a session link can be added to the poll list
  * 07/02/16     Martin Brampton Added a small piece of SSL logic to EPOLLIN
- * 
+ * 15/03/16     Mark Riddoch    Optional thread local epoll instances with DCBs
+ *                              pinned to a polling thread
+ * 29/03/16     Mark Riddoch    Replaced the spinlock protected event queue with
+ *                              a lock-free stack of DCBs with pending events
+ * 28/06/16     Mark Riddoch    Batched dequeue from the event stack with a
+ *                              deadline on the claimed batch
+ * 01/07/16     Mark Riddoch    Polling threads may be pinned to CPUs with the
+ *                              thread_affinity configuration parameter
+ * 02/07/16     Mark Riddoch    Threads publish reclamation epochs rather than
+ *                              scanning the zombie queue bitmasks
+ * 02/07/16     Mark Riddoch    Uncontended DCBs are dispatched directly after
+ *                              epoll_wait, bypassing the event stack
+ * 03/07/16     Mark Riddoch    Writes made by an event handler are corked and
+ *                              flushed once when the handler returns
+ * 03/07/16     Mark Riddoch    Services may pin their client DCBs to a
+ *                              group of polling threads
+ * 03/07/16     Mark Riddoch    Adaptive poll sleep controller and eventfd
+ *                              wakeup of blocked polling threads
+ * 03/07/16     Mark Riddoch    Histogram of the queue wait of each event,
+ *                              shown per thread in the event statistics
+ * 04/07/16     Mark Riddoch    Exponentially decayed per thread load averages
+ *                              at 100ms, 1s and 10s horizons
+ * 05/07/16     Mark Riddoch    Support for pinning SO_REUSEPORT listener
+ *                              shards to individual polling threads
+ * 05/07/16     Mark Riddoch    Polling thread status available as a result
+ *                              set for the HTTP statistics endpoint
+ * 05/07/16     Mark Riddoch    Per-thread pools primed from the capacity
+ *                              hints of the configuration at thread start
+ * 05/07/16     Mark Riddoch    Optional accept threads own listeners and
+ *                              unauthenticated clients; a client is promoted
+ *                              to a serving thread once it authenticates
+ * 05/07/16     Mark Riddoch    Per thread activity snapshots and a stall
+ *                              counter for the housekeeper watchdog
+ *
  * @endverbatim
  */
 
@@ -86,19 +126,49 @@ int max_poll_sleep;
 #define MUTEX_EPOLL     0
 
 static int epoll_fd = -1;    /*< The epoll file descriptor */
+static int *epoll_fds = NULL; /*< Per-thread epoll descriptors, if thread local polling is used */
+static int thread_local_polls = 0; /*< Use a private epoll instance per polling thread */
+static int n_accept_threads = 0; /*< Leading polling threads dedicated to connection setup */
+static int next_epoll_owner = 0; /*< Round-robin assignment of DCBs to polling threads */
 static int do_shutdown = 0;  /*< Flag the shutdown of the poll subsystem */
 static GWBITMASK poll_mask;
 #if MUTEX_EPOLL
 static simple_mutex_t epoll_wait_mutex; /*< serializes calls to epoll_wait */
 #endif
 static int n_waiting = 0;    /*< No. of threads in epoll_wait */
+static int *wakeup_fds = NULL; /*< Eventfds used to wake a thread blocked in
+                                * epoll_wait, one per thread with thread local
+                                * polling, otherwise a single shared one */
+static thread_local int current_thread_id = -1; /*< The polling thread id of
+                                                 * this thread, -1 on threads
+                                                 * that do not poll */
 
 static int process_pollq(int thread_id);
+static int process_evq_entry(int thread_id, DCB *dcb);
+
+/** Histogram of the time each event spent between queue insert, or epoll
+ * readiness on the direct dispatch path, and the start of its handler.
+ * Each polling thread records into its own slot of the histogram, so the
+ * per-thread distributions can be shown separately. */
+static histogram_t queue_wait_hist;
+static void process_dcb_events(int thread_id, DCB *dcb, uint32_t ev);
+static int poll_dcb_fd(DCB *dcb);
+static int poll_least_loaded_thread(int first, int last);
+static void evq_push(DCB *dcb);
+static void poll_queue_dcb(DCB *dcb, uint32_t ev);
 static void poll_add_event_to_dcb(DCB* dcb, GWBUF* buf, __uint32_t ev);
 static bool poll_dcb_session_check(DCB *dcb, const char *);
 
-DCB *eventq = NULL;
-SPINLOCK pollqlock = SPINLOCK_INIT;
+/**
+ * The lock-free multi-producer stack of DCBs that have pending events.
+ *
+ * Producers push DCBs with a compare-and-swap loop on the stack head and
+ * the evq.queued flag in the DCB guarantees that a DCB is linked into the
+ * stack at most once. Consumers take the entire stack with an atomic
+ * exchange, claim the first DCB and push the remainder back for the other
+ * polling threads, so no lock is ever taken on the event dispatch path.
+ */
+static DCB *eventq = NULL;
 
 /**
  * Thread load average, this is the average number of descriptors in each
@@ -135,11 +205,22 @@ typedef enum
 typedef struct
 {
     THREAD_STATE state; /*< Current thread state */
+    int tid;            /*< Kernel task id of the thread */
+    uint64_t cycles;    /*< Number of poll cycles the thread has completed */
     int n_fds;          /*< No. of descriptors thread is processing */
+    int n_dcbs;         /*< No. of DCBs assigned to the thread */
     DCB *cur_dcb;       /*< Current DCB being processed */
     uint32_t event;     /*< Current event being processed */
+    uint64_t load_last_us; /*< Clock of the last load accounting update */
+    POLL_LOAD load;     /*< Decayed event rate and busy fraction averages */
 } THREAD_DATA;
 
+/** Decay time constants of the thread load averages, in microseconds */
+static const double load_horizon_us[POLL_LOAD_HORIZONS] =
+{
+    100000.0, 1000000.0, 10000000.0
+};
+
 static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
 
 /**
@@ -172,17 +253,33 @@ static struct
     int evq_pending;            /*< Number of pending descriptors in event queue */
     int evq_max;                /*< Maximum event queue length */
     int wake_evqpending;        /*< Woken from epoll_wait with pending events in queue */
+    int n_stalls;               /*< Number of thread stalls detected by the watchdog */
     ts_stats_t *blockingpolls;  /*< Number of epoll_waits with a timeout specified */
 } pollStats;
 
 #define N_QUEUE_TIMES   30
+
+/**
+ * Number of queued DCBs a thread claims from the shared event stack in one
+ * atomic exchange before it returns to epoll. Claiming a batch cuts the
+ * contention on the stack head proportionally.
+ */
+#define POLL_BATCH_SIZE 8
+
+/**
+ * Deadline, in housekeeper heartbeats (100ms), after which a thread stops
+ * working through its claimed batch and returns the remainder to the shared
+ * stack so that long running events cannot starve the DCBs queued behind
+ * them.
+ */
+#define POLL_BATCH_DEADLINE 1
 /**
  * The event queue statistics
  */
 static struct
 {
-    unsigned int qtimes[N_QUEUE_TIMES+1];
-    unsigned int exectimes[N_QUEUE_TIMES+1];
+    stats_counter_t qtimes[N_QUEUE_TIMES+1];    /*< Histogram of queue times */
+    stats_counter_t exectimes[N_QUEUE_TIMES+1]; /*< Histogram of execution times */
     unsigned long maxqtime;
     unsigned long maxexectime;
 } queueStats;
@@ -225,11 +322,74 @@ poll_init()
     memset(&queueStats, 0, sizeof(queueStats));
     bitmask_init(&poll_mask);
     n_threads = config_threadcount();
+    thread_local_polls = config_thread_local_polls();
+    n_accept_threads = config_accept_threads();
+    if (n_accept_threads > 0 && !thread_local_polls)
+    {
+        MXS_WARNING("The accept_threads parameter requires thread local "
+                    "polling, connection setup will share all threads.");
+        n_accept_threads = 0;
+    }
+    if (n_accept_threads >= n_threads)
+    {
+        MXS_WARNING("The accept_threads parameter must leave at least one "
+                    "serving thread, connection setup will share all threads.");
+        n_accept_threads = 0;
+    }
+    if (thread_local_polls)
+    {
+        if ((epoll_fds = (int *)malloc(n_threads * sizeof(int))) == NULL)
+        {
+            perror("Fatal error: Memory allocation failed.");
+            exit(-1);
+        }
+        for (i = 0; i < n_threads; i++)
+        {
+            if ((epoll_fds[i] = epoll_create(MAX_EVENTS)) == -1)
+            {
+                perror("epoll_create");
+                exit(-1);
+            }
+        }
+    }
     if ((thread_data = (THREAD_DATA *)malloc(n_threads * sizeof(THREAD_DATA))) != NULL)
     {
         for (i = 0; i < n_threads; i++)
         {
             thread_data[i].state = THREAD_STOPPED;
+            thread_data[i].tid = 0;
+            thread_data[i].cycles = 0;
+            thread_data[i].n_dcbs = 0;
+            thread_data[i].load_last_us = 0;
+            memset(&thread_data[i].load, 0, sizeof(POLL_LOAD));
+        }
+    }
+    dcb_epoch_init(n_threads);
+
+    /*
+     * Create the eventfds used to wake threads that are blocked in
+     * epoll_wait when work is queued for them from another thread. The
+     * descriptors are registered with a NULL data pointer, which is how
+     * the event loop tells a wakeup from a DCB event.
+     */
+    if ((wakeup_fds = (int *)malloc((thread_local_polls ? n_threads : 1)
+                                    * sizeof(int))) != NULL)
+    {
+        for (i = 0; i < (thread_local_polls ? n_threads : 1); i++)
+        {
+            if ((wakeup_fds[i] = eventfd(0, EFD_NONBLOCK)) != -1)
+            {
+                struct epoll_event ev;
+
+                ev.events = EPOLLIN | EPOLLET;
+                ev.data.ptr = NULL;
+                if (epoll_ctl(thread_local_polls ? epoll_fds[i] : epoll_fd,
+                              EPOLL_CTL_ADD, wakeup_fds[i], &ev) == -1)
+                {
+                    close(wakeup_fds[i]);
+                    wakeup_fds[i] = -1;
+                }
+            }
         }
     }
 
@@ -248,6 +408,22 @@ poll_init()
         exit(-1);
     }
 
+    for (i = 0; i <= N_QUEUE_TIMES; i++)
+    {
+        if ((queueStats.qtimes[i] = stats_counter_alloc()) == NULL ||
+            (queueStats.exectimes[i] = stats_counter_alloc()) == NULL)
+        {
+            perror("Fatal error: Memory allocation failed.");
+            exit(-1);
+        }
+    }
+
+    if ((queue_wait_hist = histogram_alloc()) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+
 #if MUTEX_EPOLL
     simple_mutex_init(&epoll_wait_mutex, "epoll_wait_mutex");
 #endif
@@ -273,6 +449,62 @@ poll_init()
 #endif
 }
 
+/**
+ * Return the polling thread with the fewest DCBs currently assigned
+ * to it, considering only the threads of the given inclusive range.
+ * Services pinned to a thread group pass the bounds of their group,
+ * everything else the full set of threads.
+ *
+ * The per-thread counts are read without locking; assignments racing
+ * with one another may both pick the same thread but the counts remain
+ * accurate and the imbalance is corrected by subsequent assignments.
+ * If the thread data is not available the threads are used round-robin.
+ *
+ * @param first The first thread of the range to choose from
+ * @param last  The last thread of the range to choose from
+ * @return      The identifier of the least loaded polling thread
+ */
+static int
+poll_least_loaded_thread(int first, int last)
+{
+    int i, thread = first;
+
+    if (thread_data == NULL)
+    {
+        return first + atomic_add(&next_epoll_owner, 1) % (last - first + 1);
+    }
+    for (i = first + 1; i <= last; i++)
+    {
+        if (thread_data[i].n_dcbs < thread_data[thread].n_dcbs)
+        {
+            thread = i;
+        }
+    }
+    return thread;
+}
+
+/**
+ * Release the polling thread assignment of a DCB.
+ *
+ * Decrements the active DCB count of the owning thread; called when a
+ * DCB is finally freed so that the least loaded thread selection in
+ * poll_add_dcb reflects the connections that are actually alive.
+ *
+ * @param dcb   The DCB being released
+ */
+void
+poll_unassign_dcb(DCB *dcb)
+{
+    if (thread_local_polls && dcb->owner >= 0)
+    {
+        if (thread_data)
+        {
+            atomic_add(&thread_data[dcb->owner].n_dcbs, -1);
+        }
+        dcb->owner = -1;
+    }
+}
+
 /**
  * Add a DCB to the set of descriptors within the polling
  * environment.
@@ -334,12 +566,61 @@ poll_add_dcb(DCB *dcb)
                   STRDCBSTATE(dcb->state));
     }
     dcb->state = new_state;
+    /*
+     * In thread local mode the DCB is pinned to a single polling thread
+     * when it is first added to the poll set. Listeners always belong to
+     * thread 0, client DCBs are assigned to the thread with the fewest
+     * active DCBs and backend DCBs inherit the thread of the client side
+     * of the session so that all events for one session are handled by
+     * the same thread. A service may be pinned to a group of threads with
+     * the thread_group parameter, in which case its client DCBs are
+     * assigned within the group only.
+     */
+    if (thread_local_polls && dcb->owner < 0)
+    {
+        if (dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
+        {
+            dcb->owner = 0;
+        }
+        else if (dcb->session && dcb->session->client_dcb &&
+                 dcb->session->client_dcb != dcb &&
+                 dcb->session->client_dcb->owner >= 0)
+        {
+            dcb->owner = dcb->session->client_dcb->owner;
+        }
+        else
+        {
+            int first = 0;
+            int last = n_threads - 1;
+
+            if (dcb->service && dcb->service->thread_group_first >= 0 &&
+                dcb->service->thread_group_first < n_threads)
+            {
+                first = dcb->service->thread_group_first;
+                last = MIN(dcb->service->thread_group_last, n_threads - 1);
+            }
+            else if (n_accept_threads > 0 && dcb->session == NULL)
+            {
+                /*
+                 * A freshly accepted client that has not authenticated
+                 * yet; it is handled by an accept thread until the
+                 * protocol module promotes it with poll_promote_dcb.
+                 */
+                last = n_accept_threads - 1;
+            }
+            dcb->owner = poll_least_loaded_thread(first, last);
+        }
+        if (thread_data)
+        {
+            atomic_add(&thread_data[dcb->owner].n_dcbs, 1);
+        }
+    }
     spinlock_release(&dcb->dcb_initlock);
     /*
      * The only possible failure that will not cause a crash is
      * running out of system resources.
      */
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
+    rc = epoll_ctl(poll_dcb_fd(dcb), EPOLL_CTL_ADD, dcb->fd, &ev);
     if (rc)
     {
         /* Some errors are actually considered acceptable */
@@ -403,7 +684,7 @@ poll_remove_dcb(DCB *dcb)
     spinlock_release(&dcb->dcb_initlock);
     if (dcbfd > 0)
     {
-        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
+        rc = epoll_ctl(poll_dcb_fd(dcb), EPOLL_CTL_DEL, dcbfd, &ev);
         /**
          * The poll_resolve_error function will always
          * return 0 or crash.  So if it returns non-zero result,
@@ -495,10 +776,561 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
     return -1;
 }
 
+/**
+ * Return the epoll descriptor that a DCB belongs to. In the default mode
+ * this is the shared epoll descriptor, in thread local mode it is the
+ * epoll instance of the polling thread that owns the DCB.
+ *
+ * @param dcb   The DCB being added to or removed from the poll set
+ * @return The epoll file descriptor to use
+ */
+static int
+poll_dcb_fd(DCB *dcb)
+{
+    if (thread_local_polls && dcb->owner >= 0)
+    {
+        return epoll_fds[dcb->owner];
+    }
+    return epoll_fd;
+}
+
+/**
+ * Suspend the delivery of read events for a DCB.
+ *
+ * Used by the write queue flow control in dcb.c: when the peer of the
+ * DCB within the session cannot drain its write queue, the reads of
+ * this DCB are removed from the epoll interest set. The data then backs
+ * up in the kernel socket buffers and, through TCP flow control, on the
+ * sending server, rather than in MaxScale's memory.
+ *
+ * @param dcb   The DCB whose read events should be suspended
+ * @return 0 on success
+ */
+int
+poll_suspend_read_events(DCB *dcb)
+{
+    struct epoll_event ev;
+
+    if (dcb->state != DCB_STATE_POLLING || dcb->fd <= 0)
+    {
+        return -1;
+    }
+#ifdef EPOLLRDHUP
+    ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET;
+#else
+    ev.events = EPOLLOUT | EPOLLHUP | EPOLLET;
+#endif
+    ev.data.ptr = dcb;
+    return epoll_ctl(poll_dcb_fd(dcb), EPOLL_CTL_MOD, dcb->fd, &ev);
+}
+
+/**
+ * Resume the delivery of read events for a DCB whose reads were
+ * suspended with poll_suspend_read_events.
+ *
+ * As the poll set is edge triggered, data that arrived while the reads
+ * were suspended would never be reported, so a fake read event is
+ * delivered to the DCB once it is back in the interest set.
+ *
+ * @param dcb   The DCB whose read events should be resumed
+ * @return 0 on success
+ */
+int
+poll_resume_read_events(DCB *dcb)
+{
+    struct epoll_event ev;
+    int rc;
+
+    if (dcb->state != DCB_STATE_POLLING || dcb->fd <= 0)
+    {
+        return -1;
+    }
+#ifdef EPOLLRDHUP
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET;
+#else
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLET;
+#endif
+    ev.data.ptr = dcb;
+    if ((rc = epoll_ctl(poll_dcb_fd(dcb), EPOLL_CTL_MOD, dcb->fd, &ev)) == 0)
+    {
+        poll_fake_event(dcb, EPOLLIN);
+    }
+    return rc;
+}
+
+/** The DCB whose events the thread is currently processing */
+static thread_local DCB *current_dcb = NULL;
+
+/**
+ * Return the DCB whose events the calling thread is currently
+ * processing, or NULL if the thread is not processing events. This
+ * identifies the DCB whose read generated any write being made from
+ * within the event handlers.
+ *
+ * @return The DCB being processed by this thread
+ */
+DCB *
+poll_current_dcb()
+{
+    return current_dcb;
+}
+
+/**
+ * Push a DCB onto the lock-free event stack. The caller must have claimed
+ * the evq.queued flag of the DCB with a successful compare-and-swap.
+ *
+ * @param dcb   The DCB to push
+ */
+static void
+evq_push(DCB *dcb)
+{
+    DCB *head;
+    int len;
+
+    do
+    {
+        head = eventq;
+        dcb->evq.next = head;
+    }
+    while (!__sync_bool_compare_and_swap(&eventq, head, dcb));
+    len = atomic_add(&pollStats.evq_length, 1) + 1;
+    if (len > pollStats.evq_max)
+    {
+        pollStats.evq_max = len;
+    }
+}
+
+/**
+ * Push a chain of DCBs back onto the lock-free event stack in a single
+ * compare-and-swap. The entries remain accounted for in the queue length,
+ * they were never removed from it.
+ *
+ * @param chain The first DCB of the chain to push
+ */
+static void
+evq_push_chain(DCB *chain)
+{
+    DCB *tail = chain;
+    DCB *head;
+
+    while (tail->evq.next)
+    {
+        tail = tail->evq.next;
+    }
+    do
+    {
+        head = eventq;
+        tail->evq.next = head;
+    }
+    while (!__sync_bool_compare_and_swap(&eventq, head, chain));
+}
+
+/**
+ * Record pending events for a DCB and queue it for processing.
+ *
+ * This may be called concurrently from any thread. The event bits are
+ * merged atomically into the pending events of the DCB and the DCB is
+ * pushed onto the event stack unless it is already linked there, in which
+ * case the merged bits will be picked up by the thread that processes the
+ * queued entry.
+ *
+ * @param dcb   The DCB that the events relate to
+ * @param ev    The event bits to add
+ */
+/**
+ * Wake the polling thread that will pick up the queued events of a DCB.
+ *
+ * Without the wakeup, work queued from another thread - a fake event from
+ * a monitor or the housekeeper, or a cross-thread write completion - sits
+ * until the blocking epoll_wait of the target thread times out, which the
+ * adaptive sleep controller may have stretched to max_poll_sleep on an
+ * idle thread. Writing the eventfd makes the epoll_wait return at once.
+ * A thread never needs to wake itself: it processes the event queue
+ * before its next blocking call.
+ *
+ * @param dcb   The DCB whose events were queued
+ */
+static void
+poll_wakeup(DCB *dcb)
+{
+    uint64_t one = 1;
+    int fd = -1;
+
+    if (wakeup_fds == NULL)
+    {
+        return;
+    }
+    if (thread_local_polls)
+    {
+        if (dcb->owner >= 0 && dcb->owner != current_thread_id)
+        {
+            fd = wakeup_fds[dcb->owner];
+        }
+    }
+    else if (current_thread_id < 0)
+    {
+        fd = wakeup_fds[0];
+    }
+    if (fd != -1 && write(fd, &one, sizeof(one)) == -1)
+    {
+        /* Nothing to be done, the thread wakes on its timeout */
+    }
+}
+
+static void
+poll_queue_dcb(DCB *dcb, uint32_t ev)
+{
+    if (__sync_fetch_and_or(&dcb->evq.pending_events, ev) == 0)
+    {
+        dcb->evq.inserted = hkheartbeat;
+        dcb->evq.inserted_us = histogram_clock_us();
+        atomic_add(&pollStats.evq_pending, 1);
+    }
+    if (__sync_bool_compare_and_swap(&dcb->evq.queued, 0, 1))
+    {
+        evq_push(dcb);
+        poll_wakeup(dcb);
+    }
+}
+
 #define BLOCKINGPOLL 0  /*< Set BLOCKING POLL to 1 if using a single thread and to make
                          *  debugging easier.
                          */
 
+/**
+ * The adaptive poll sleep controller
+ *
+ * Each polling thread keeps an exponential moving average of the time
+ * between the epoll completions it sees and chooses its waiting strategy
+ * from it. While events arrive back to back the thread stays in the spin
+ * mode, repeating the non-blocking poll; a moderately busy thread blocks
+ * with a short timeout so that it reacts quickly when traffic resumes;
+ * an idle thread blocks for the full max_poll_sleep, relying on the
+ * eventfd wakeup for work queued from other threads.
+ */
+#define POLL_SPIN_GAP_US   200   /*< Events closer than this keep the thread spinning */
+#define POLL_BUSY_GAP_US   5000  /*< Below this the short blocking timeout is used */
+#define POLL_SHORT_SLEEP   1     /*< The short blocking timeout in milliseconds */
+#define POLL_SPIN_BOOST    100   /*< Spin count multiplier in the spin mode */
+
+/**
+ * Number of non-blocking polls to make before blocking, given the average
+ * event inter-arrival time of the thread.
+ *
+ * @param gap_avg  Average microseconds between epoll completions
+ * @return The number of spins to make before a blocking call
+ */
+static int
+poll_spin_limit(uint64_t gap_avg)
+{
+    if (gap_avg > 0 && gap_avg < POLL_SPIN_GAP_US)
+    {
+        return number_poll_spins * POLL_SPIN_BOOST;
+    }
+    return number_poll_spins;
+}
+
+/**
+ * The timeout for a blocking epoll_wait call, given the average event
+ * inter-arrival time of the thread. Between the busy and idle extremes
+ * the timeout follows the inter-arrival time itself, bounded by the
+ * configured max_poll_sleep.
+ *
+ * @param gap_avg  Average microseconds between epoll completions
+ * @return The timeout in milliseconds
+ */
+static int
+poll_sleep_ms(uint64_t gap_avg)
+{
+    int sleep_ms;
+
+    if (gap_avg == 0)
+    {
+        return max_poll_sleep;
+    }
+    if (gap_avg < POLL_BUSY_GAP_US)
+    {
+        return POLL_SHORT_SLEEP;
+    }
+    sleep_ms = (int)(gap_avg / 1000);
+    if (sleep_ms > max_poll_sleep)
+    {
+        sleep_ms = max_poll_sleep;
+    }
+    return sleep_ms;
+}
+
+/**
+ * Fold one poll cycle into the decayed load averages of the thread.
+ *
+ * The averages are exponentially decayed over each of the horizons in
+ * load_horizon_us, using the elapsed time since the previous update as
+ * the decay interval so that irregular cycle lengths are weighted
+ * correctly. The values are plain doubles written by the owning thread
+ * only; readers through poll_thread_load() see a slightly stale but
+ * consistent enough snapshot.
+ *
+ * @param thread_id     The polling thread to account for
+ * @param now_us        The current clock in microseconds
+ * @param busy_us       Microseconds of the cycle spent processing events
+ * @param nevents       Number of descriptor events the cycle processed
+ */
+static void
+poll_load_update(int thread_id, uint64_t now_us, uint64_t busy_us, int nevents)
+{
+    THREAD_DATA *td;
+    uint64_t dt;
+    int h;
+
+    if (thread_data == NULL)
+    {
+        return;
+    }
+    td = &thread_data[thread_id];
+    dt = now_us - td->load_last_us;
+
+    if (td->load_last_us == 0 || dt > 60000000)
+    {
+        /* First update, or so long since the last one that the
+         * averages have fully decayed; start afresh. */
+        td->load_last_us = now_us;
+        memset(&td->load, 0, sizeof(POLL_LOAD));
+        return;
+    }
+    if (dt == 0)
+    {
+        return;
+    }
+    td->load_last_us = now_us;
+
+    double rate = (double)nevents * 1000000.0 / (double)dt;
+    double busy = (double)busy_us / (double)dt;
+
+    if (busy > 1.0)
+    {
+        busy = 1.0;
+    }
+    for (h = 0; h < POLL_LOAD_HORIZONS; h++)
+    {
+        double alpha = 1.0 - exp(-(double)dt / load_horizon_us[h]);
+
+        td->load.event_rate[h] += alpha * (rate - td->load.event_rate[h]);
+        td->load.busy_fraction[h] += alpha * (busy - td->load.busy_fraction[h]);
+    }
+}
+
+/**
+ * Return the number of polling threads.
+ *
+ * @return The number of polling threads
+ */
+int
+poll_nthreads()
+{
+    return n_threads;
+}
+
+/**
+ * Return the number of listening sockets that should be created for each
+ * port a service listens on.
+ *
+ * When a private epoll instance is used per polling thread a single
+ * listening socket pins all accept processing to thread 0. With
+ * SO_REUSEPORT the kernel allows several sockets to be bound to the same
+ * address and distributes incoming connections between them, so one
+ * socket per polling thread, each added to a different epoll instance,
+ * spreads a connection storm across all of the threads. Without thread
+ * local polling, or on kernels without SO_REUSEPORT, a single socket is
+ * used as before.
+ *
+ * @return The number of listening sockets to create per port
+ */
+int
+poll_listener_shards()
+{
+#ifdef SO_REUSEPORT
+    if (thread_local_polls && n_accept_threads > 0)
+    {
+        /* Listeners live only on the dedicated accept threads */
+        return n_accept_threads;
+    }
+    if (thread_local_polls && n_threads > 1)
+    {
+        return n_threads;
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Pin a DCB to a particular polling thread before it is added to the
+ * poll set.
+ *
+ * Used by the listener sharding code to place one listening socket in
+ * the epoll instance of each polling thread rather than letting
+ * poll_add_dcb assign the DCB to thread 0 as it does for listeners by
+ * default. The active DCB count of the chosen thread is incremented so
+ * that poll_unassign_dcb balances when the DCB is freed. A no-op when
+ * thread local polling is not in use or the DCB already has an owner.
+ *
+ * @param dcb           The DCB to pin
+ * @param thread        The polling thread to pin it to
+ */
+void
+poll_pin_dcb(DCB *dcb, int thread)
+{
+    if (thread_local_polls && dcb->owner < 0 &&
+        thread >= 0 && thread < n_threads)
+    {
+        dcb->owner = thread;
+        if (thread_data)
+        {
+            atomic_add(&thread_data[thread].n_dcbs, 1);
+        }
+    }
+}
+
+/**
+ * Promote an authenticated client DCB from its accept thread to a
+ * serving thread.
+ *
+ * Called by the protocol module once authentication has completed, from
+ * the read handler of the DCB on the accept thread, so no other thread
+ * is processing the DCB while it moves. The descriptor is withdrawn
+ * from the epoll instance of the accept thread and registered with the
+ * least loaded serving thread, or the least loaded thread of the
+ * service's thread group when one is configured. Adding a readable
+ * descriptor to an epoll instance raises an edge, so input that arrived
+ * during the move is reported on the new thread.
+ *
+ * The promotion happens before the router session is created so that
+ * the backend DCBs of the session inherit the serving thread rather
+ * than the accept thread. A no-op when no accept threads are configured
+ * or the DCB is not owned by one.
+ *
+ * @param dcb   The client DCB that completed authentication
+ */
+void
+poll_promote_dcb(DCB *dcb)
+{
+    struct epoll_event ev;
+    int first, last, owner;
+
+    if (!thread_local_polls || n_accept_threads == 0 ||
+        dcb->owner < 0 || dcb->owner >= n_accept_threads)
+    {
+        return;
+    }
+#ifdef EPOLLRDHUP
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET;
+#else
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLET;
+#endif
+    ev.data.ptr = dcb;
+
+    if (epoll_ctl(epoll_fds[dcb->owner], EPOLL_CTL_DEL, dcb->fd, &ev) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("%lu [poll_promote_dcb] Failed to withdraw dcb %p "
+                  "from the accept thread: %d, %s",
+                  pthread_self(),
+                  dcb,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return;
+    }
+    if (thread_data)
+    {
+        atomic_add(&thread_data[dcb->owner].n_dcbs, -1);
+    }
+
+    first = n_accept_threads;
+    last = n_threads - 1;
+    if (dcb->service && dcb->service->thread_group_first >= 0 &&
+        dcb->service->thread_group_first < n_threads)
+    {
+        first = dcb->service->thread_group_first;
+        last = MIN(dcb->service->thread_group_last, n_threads - 1);
+    }
+    owner = poll_least_loaded_thread(first, last);
+    dcb->owner = owner;
+    if (thread_data)
+    {
+        atomic_add(&thread_data[owner].n_dcbs, 1);
+    }
+    if (epoll_ctl(epoll_fds[owner], EPOLL_CTL_ADD, dcb->fd, &ev) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("%lu [poll_promote_dcb] Failed to add dcb %p to "
+                  "serving thread %d: %d, %s",
+                  pthread_self(),
+                  dcb,
+                  owner,
+                  errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+}
+
+/**
+ * Fetch a snapshot of the load averages of a polling thread.
+ *
+ * @param thread        The thread to report on
+ * @param load          The structure the snapshot is copied into
+ */
+void
+poll_thread_load(int thread, POLL_LOAD *load)
+{
+    if (thread_data && thread >= 0 && thread < n_threads)
+    {
+        *load = thread_data[thread].load;
+    }
+    else
+    {
+        memset(load, 0, sizeof(POLL_LOAD));
+    }
+}
+
+/**
+ * Fetch a snapshot of the current activity of a polling thread.
+ *
+ * The cycles member is incremented by the thread at the start of every
+ * pass of its polling loop; a busy thread whose cycle count does not
+ * advance between two snapshots has been stuck in an event handler for
+ * the whole interval. The snapshot is taken without locking, a stall
+ * leaves the values static so a stalled thread is always reported
+ * consistently.
+ *
+ * @param thread        The thread to report on
+ * @param activity      The structure the snapshot is copied into
+ * @return 0 if the snapshot was taken, -1 if the thread does not exist
+ */
+int
+poll_thread_activity(int thread, POLL_ACTIVITY *activity)
+{
+    if (thread_data == NULL || thread < 0 || thread >= n_threads)
+    {
+        return -1;
+    }
+    activity->busy = thread_data[thread].state == THREAD_PROCESSING
+        || thread_data[thread].state == THREAD_ZPROCESSING;
+    activity->tid = thread_data[thread].tid;
+    activity->cycles = thread_data[thread].cycles;
+    activity->dcb = thread_data[thread].cur_dcb;
+    activity->event = thread_data[thread].event;
+    return 0;
+}
+
+/**
+ * Record the detection of a stalled polling thread. Called by the
+ * housekeeper watchdog task, the count is reported in the polling
+ * statistics.
+ */
+void
+poll_count_stall()
+{
+    atomic_add(&pollStats.n_stalls, 1);
+}
+
 /**
  * The main polling loop
  *
@@ -541,12 +1373,12 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
  * collect events is only made if there are no pending events to be processed on the
  * event queue.
  *
- * Also introduced a "timeout bias" mechanism. This mechansim control the length of
- * of timeout passed to epoll_wait in blocking calls based on previous behaviour.
- * The initial call will block for 10% of the define timeout peroid, this will be
- * increased in increments of 10% until the full timeout value is used. If at any
- * point there is an event to be processed then the value will be reduced to 10% again
- * for the next blocking call.
+ * The length of the timeout passed to the blocking epoll_wait calls, and
+ * the number of non-blocking polls made before blocking at all, are chosen
+ * by the adaptive sleep controller from the average event inter-arrival
+ * time of the thread; see poll_spin_limit and poll_sleep_ms above. Work
+ * queued for a blocked thread wakes it immediately through its eventfd,
+ * so a long timeout on an idle thread adds no latency.
  *
  * @param arg   The thread ID passed as a void * to satisfy the threading package
  */
@@ -554,29 +1386,74 @@ void
 poll_waitevents(void *arg)
 {
     struct epoll_event events[MAX_EVENTS];
-    int i, nfds, timeout_bias = 1;
+    int i, nfds;
     intptr_t thread_id = (intptr_t)arg;
     int poll_spins = 0;
+    int wait_fd = thread_local_polls ? epoll_fds[thread_id] : epoll_fd;
+    int cpu;
+    uint64_t last_event_us = histogram_clock_us();
+    uint64_t event_gap_avg = 0; /*< Average microseconds between completions */
+    uint64_t cycle_start_us = 0; /*< Clock at the start of a busy cycle */
+    int cycle_events = 0;       /*< Descriptor events seen in the cycle */
+    long last_load_hb = hkheartbeat;
 
     ts_stats_set_thread_id(thread_id);
+    current_thread_id = thread_id;
+
+    /*
+     * Pin the thread to its configured CPU, if the thread_affinity
+     * parameter was set. The per-thread buffer, DCB and session pools
+     * are allocated by the owning thread, so with the first-touch
+     * placement policy of the kernel the pinning also keeps those pools
+     * on the NUMA node local to the thread.
+     */
+    if ((cpu = config_thread_affinity(thread_id)) >= 0)
+    {
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+        {
+            MXS_WARNING("Failed to bind polling thread %d to CPU %d.",
+                        (int)thread_id, cpu);
+        }
+        else
+        {
+            MXS_NOTICE("Polling thread %d bound to CPU %d.",
+                       (int)thread_id, cpu);
+        }
+    }
+
+    /*
+     * Prime the pools of this thread with its share of the capacity
+     * hints of the configuration, so that the allocation cost of the
+     * steady state population is paid now, before traffic arrives,
+     * rather than during the connection ramp. Without hints the primes
+     * are no-ops and the pools grow on demand as before.
+     */
+    dcb_pool_prime(config_expected_connections() / n_threads);
+    session_pool_prime(config_expected_sessions() / n_threads);
+    gwbuf_pool_prime(config_expected_connections() / n_threads);
 
     /** Add this thread to the bitmask of running polling threads */
     bitmask_set(&poll_mask, thread_id);
     if (thread_data)
     {
+        thread_data[thread_id].tid = (int)syscall(SYS_gettid);
         thread_data[thread_id].state = THREAD_IDLE;
     }
 
     while (1)
     {
-        if (pollStats.evq_pending == 0 && timeout_bias < 10)
+        if (thread_data)
         {
-            timeout_bias++;
+            /* Only ever written by this thread, read by the watchdog */
+            thread_data[thread_id].cycles++;
         }
-
         atomic_add(&n_waiting, 1);
 #if BLOCKINGPOLL
-        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        nfds = epoll_wait(wait_fd, events, MAX_EVENTS, -1);
         atomic_add(&n_waiting, -1);
 #else /* BLOCKINGPOLL */
 #if MUTEX_EPOLL
@@ -588,7 +1465,7 @@ poll_waitevents(void *arg)
         }
 
         ts_stats_add(pollStats.n_polls, 1);
-        if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0)) == -1)
+        if ((nfds = epoll_wait(wait_fd, events, MAX_EVENTS, 0)) == -1)
         {
             atomic_add(&n_waiting, -1);
             int eno = errno;
@@ -608,13 +1485,14 @@ poll_waitevents(void *arg)
          * We calculate a timeout bias to alter the length of the blocking
          * call based on the time since we last received an event to process
          */
-        else if (nfds == 0 && pollStats.evq_pending == 0 && poll_spins++ > number_poll_spins)
+        else if (nfds == 0 && pollStats.evq_pending == 0 &&
+                 poll_spins++ > poll_spin_limit(event_gap_avg))
         {
             ts_stats_add(pollStats.blockingpolls, 1);
-            nfds = epoll_wait(epoll_fd,
+            nfds = epoll_wait(wait_fd,
                               events,
                               MAX_EVENTS,
-                              (max_poll_sleep * timeout_bias) / 10);
+                              poll_sleep_ms(event_gap_avg));
             if (nfds == 0 && pollStats.evq_pending)
             {
                 atomic_add(&pollStats.wake_evqpending, 1);
@@ -636,7 +1514,18 @@ poll_waitevents(void *arg)
 #endif /* BLOCKINGPOLL */
         if (nfds > 0)
         {
-            timeout_bias = 1;
+            uint64_t now_us = histogram_clock_us();
+            uint64_t gap = now_us - last_event_us;
+
+            last_event_us = now_us;
+            cycle_start_us = now_us;
+            cycle_events = nfds;
+            if (gap == 0)
+            {
+                gap = 1;
+            }
+            event_gap_avg = event_gap_avg == 0 ? gap
+                          : (7 * event_gap_avg + gap) / 8;
             if (poll_spins <= number_poll_spins + 1)
             {
                 ts_stats_add(pollStats.n_nbpollev, 1);
@@ -675,41 +1564,58 @@ poll_waitevents(void *arg)
                 DCB *dcb = (DCB *)events[i].data.ptr;
                 __uint32_t ev = events[i].events;
 
-                spinlock_acquire(&pollqlock);
-                if (DCB_POLL_BUSY(dcb))
+                /*
+                 * A NULL data pointer marks a wakeup through the
+                 * eventfd of the thread; drain it and carry on to
+                 * process the event queue.
+                 */
+                if (dcb == NULL)
                 {
-                    if (dcb->evq.pending_events == 0)
+                    uint64_t val;
+                    int wfd = wakeup_fds[thread_local_polls ? thread_id : 0];
+
+                    while (read(wfd, &val, sizeof(val)) > 0)
                     {
-                        pollStats.evq_pending++;
-                        dcb->evq.inserted = hkheartbeat;
                     }
-                    dcb->evq.pending_events |= ev;
+                    continue;
                 }
-                else
+
+                /*
+                 * Direct dispatch fast path.
+                 *
+                 * In thread local mode the events are for DCBs owned by
+                 * this thread alone, so they can be processed in place
+                 * without passing through the shared event stack. The
+                 * stack is then only used for fake events. With the
+                 * shared epoll instance the same applies to any DCB
+                 * that is not contended: if it has no pending events,
+                 * is not linked in the event stack and the processing
+                 * flag can be claimed, no other thread can be working
+                 * on it and the queue insert and remove are skipped.
+                 * If the DCB is being processed by another thread,
+                 * which can happen if a fake event for it is being
+                 * executed, fall back to queueing the events.
+                 */
+                if ((thread_local_polls ||
+                     (dcb->evq.pending_events == 0 && dcb->evq.queued == 0)) &&
+                    __sync_bool_compare_and_swap(&dcb->evq.processing, 0, 1))
                 {
-                    dcb->evq.pending_events = ev;
-                    if (eventq)
-                    {
-                        dcb->evq.prev = eventq->evq.prev;
-                        eventq->evq.prev->evq.next = dcb;
-                        eventq->evq.prev = dcb;
-                        dcb->evq.next = eventq;
-                    }
-                    else
-                    {
-                        eventq = dcb;
-                        dcb->evq.prev = dcb;
-                        dcb->evq.next = dcb;
-                    }
-                    pollStats.evq_length++;
-                    pollStats.evq_pending++;
                     dcb->evq.inserted = hkheartbeat;
-                    if (pollStats.evq_length > pollStats.evq_max)
+                    dcb->evq.started = hkheartbeat;
+                    dcb->evq.inserted_us = histogram_clock_us();
+                    histogram_record(queue_wait_hist, 0);
+                    process_dcb_events(thread_id, dcb, ev);
+                    __sync_synchronize();
+                    dcb->evq.processing = 0;
+                    if (dcb->evq.pending_events != 0 &&
+                        __sync_bool_compare_and_swap(&dcb->evq.queued, 0, 1))
                     {
-                        pollStats.evq_max = pollStats.evq_length;
+                        evq_push(dcb);
                     }
+                    continue;
                 }
-                spinlock_release(&pollqlock);
+
+                poll_queue_dcb(dcb, ev);
             }
         }
 
@@ -719,14 +1625,18 @@ poll_waitevents(void *arg)
          * precautionary measure to avoid issues if the house keeping
          * of the count goes wrong.
          */
-        if (process_pollq(thread_id))
+        if (cycle_start_us == 0 && pollStats.evq_pending != 0)
         {
-            timeout_bias = 1;
+            cycle_start_us = histogram_clock_us();
         }
-
-        if (check_timeouts && hkheartbeat >= next_timeout_check)
+        if (process_pollq(thread_id))
         {
-            process_idle_sessions();
+            uint64_t now_us = histogram_clock_us();
+            uint64_t gap = now_us - last_event_us;
+
+            last_event_us = now_us;
+            event_gap_avg = event_gap_avg == 0 ? MAX(gap, 1)
+                          : (7 * event_gap_avg + MAX(gap, 1)) / 8;
         }
 
         if (thread_data)
@@ -739,6 +1649,24 @@ poll_waitevents(void *arg)
             thread_data[thread_id].state = THREAD_IDLE;
         }
 
+        if (cycle_start_us != 0)
+        {
+            uint64_t end_us = histogram_clock_us();
+
+            poll_load_update(thread_id, end_us, end_us - cycle_start_us,
+                             cycle_events);
+            cycle_start_us = 0;
+            cycle_events = 0;
+            last_load_hb = hkheartbeat;
+        }
+        else if (hkheartbeat != last_load_hb)
+        {
+            /* Decay the averages while idle, at most once per heartbeat
+             * so that an idle thread stays cheap. */
+            poll_load_update(thread_id, histogram_clock_us(), 0, 0);
+            last_load_hb = hkheartbeat;
+        }
+
         if (do_shutdown)
         {
             /*<
@@ -750,6 +1678,7 @@ poll_waitevents(void *arg)
                 thread_data[thread_id].state = THREAD_STOPPED;
             }
             bitmask_clear(&poll_mask, thread_id);
+            dcb_epoch_retire_thread(thread_id);
             return;
         }
         if (thread_data)
@@ -790,13 +1719,16 @@ poll_set_maxwait(unsigned int maxwait)
 /**
  * Process of the queue of DCB's that have outstanding events
  *
- * The first event on the queue will be chosen to be executed by this thread,
- * all other events will be left on the queue and may be picked up by other
- * threads. When the processing is complete the thread will take the DCB off the
- * queue if there are no pending events that have arrived since the thread started
- * to process the DCB. If there are pending events the DCB will be moved to the
- * back of the queue so that other DCB's will have a share of the threads to
- * execute events for them.
+ * The entire event stack is claimed with an atomic exchange and reversed so
+ * that the longest waiting DCB comes first. Up to POLL_BATCH_SIZE entries
+ * are kept for this thread and processed in order; the remainder is pushed
+ * back in a single operation so that the other threads may pick the other
+ * DCBs up. If the batch consumes a full heartbeat before it is exhausted
+ * the unprocessed entries are returned to the stack as well. If events
+ * arrive for a DCB while it is being processed they are merged into its
+ * pending events and the DCB is queued again once the processing completes,
+ * so that other DCB's will have a share of the threads to execute events
+ * for them.
  *
  * Including session id to log entries depends on this function. Assumption is
  * that when maxscale thread starts processing of an event it processes one
@@ -812,73 +1744,128 @@ poll_set_maxwait(unsigned int maxwait)
 static int
 process_pollq(int thread_id)
 {
-    DCB *dcb;
-    int found = 0;
-    uint32_t ev;
-    unsigned long qtime;
+    DCB *batch, *dcb, *prev, *next;
+    int nbatch;
+    unsigned long batch_start;
+    int rval = 0;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    if ((batch = __sync_lock_test_and_set(&eventq, NULL)) == NULL)
     {
         /* Nothing to process */
-        spinlock_release(&pollqlock);
         return 0;
     }
-    dcb = eventq;
-    if (dcb->evq.next == dcb->evq.prev && dcb->evq.processing == 0)
+
+    /*
+     * The stack is in last-in-first-out order; reverse the claimed chain
+     * so that the DCB that has waited longest is processed first.
+     */
+    prev = NULL;
+    while (batch)
+    {
+        next = batch->evq.next;
+        batch->evq.next = prev;
+        prev = batch;
+        batch = next;
+    }
+    batch = prev;
+
+    /*
+     * Keep at most POLL_BATCH_SIZE entries for this thread and push the
+     * remainder straight back for the other threads.
+     */
+    nbatch = 1;
+    dcb = batch;
+    while (dcb->evq.next && nbatch < POLL_BATCH_SIZE)
     {
-        found = 1;
-        dcb->evq.processing = 1;
+        dcb = dcb->evq.next;
+        nbatch++;
     }
-    else if (dcb->evq.next == dcb->evq.prev)
+    if (dcb->evq.next)
     {
-        /* Only item in queue is being processed */
-        spinlock_release(&pollqlock);
-        return 0;
+        evq_push_chain(dcb->evq.next);
+        dcb->evq.next = NULL;
     }
-    else
+
+    batch_start = hkheartbeat;
+
+    while ((dcb = batch) != NULL)
     {
-        do
-        {
-            dcb = dcb->evq.next;
-        }
-        while (dcb != eventq && dcb->evq.processing == 1);
+        batch = dcb->evq.next;
+        dcb->evq.next = NULL;
+
+        rval |= process_evq_entry(thread_id, dcb);
 
-        if (dcb->evq.processing == 0)
+        /*
+         * Deadline check: if this batch has consumed a full heartbeat
+         * already, hand the unprocessed remainder back to the shared
+         * stack so that neither the queued DCBs of other threads nor
+         * the remainder itself is starved behind long running events.
+         */
+        if (batch != NULL && hkheartbeat - batch_start >= POLL_BATCH_DEADLINE)
         {
-            /* Found DCB to process */
-            dcb->evq.processing = 1;
-            found = 1;
+            evq_push_chain(batch);
+            break;
         }
     }
-    if (found)
+
+    return rval;
+}
+
+/**
+ * Execute the pending events of one DCB taken from the event stack.
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @param dcb           The DCB popped from the event stack
+ * @return              1 if events were processed for the DCB
+ */
+static int
+process_evq_entry(int thread_id, DCB *dcb)
+{
+    uint32_t ev;
+    unsigned long qtime;
+
+    atomic_add(&pollStats.evq_length, -1);
+
+    /*
+     * Release the queued flag before claiming the DCB for processing;
+     * producers that add events from here on will queue the DCB again.
+     */
+    dcb->evq.queued = 0;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&dcb->evq.processing, 0, 1))
     {
-        ev = dcb->evq.pending_events;
-        dcb->evq.processing_events = ev;
-        dcb->evq.pending_events = 0;
-        pollStats.evq_pending--;
-        ss_dassert(pollStats.evq_pending >= 0);
+        /*
+         * Another thread is still executing events for this DCB. It
+         * will queue the DCB again when it completes if events are
+         * still pending, so the events cannot be lost.
+         */
+        return 0;
     }
-    spinlock_release(&pollqlock);
-
-    if (found == 0)
+    ev = __sync_lock_test_and_set(&dcb->evq.pending_events, 0);
+    if (ev == 0)
     {
+        /* The pending events were consumed by an earlier entry */
+        dcb->evq.processing = 0;
         return 0;
     }
+    dcb->evq.processing_events = ev;
+    atomic_add(&pollStats.evq_pending, -1);
+    ss_dassert(pollStats.evq_pending >= 0);
 
 #if PROFILE_POLL
     memlog_log(plog, hkheartbeat - dcb->evq.inserted);
 #endif
     qtime = hkheartbeat - dcb->evq.inserted;
     dcb->evq.started = hkheartbeat;
+    histogram_record(queue_wait_hist, histogram_clock_us() - dcb->evq.inserted_us);
 
     if (qtime > N_QUEUE_TIMES)
     {
-        queueStats.qtimes[N_QUEUE_TIMES]++;
+        stats_counter_increment(queueStats.qtimes[N_QUEUE_TIMES]);
     }
     else
     {
-        queueStats.qtimes[qtime]++;
+        stats_counter_increment(queueStats.qtimes[qtime]);
     }
     if (qtime > queueStats.maxqtime)
     {
@@ -886,7 +1873,53 @@ process_pollq(int thread_id)
     }
 
 
+    process_dcb_events(thread_id, dcb, ev);
+
+    qtime = hkheartbeat - dcb->evq.started;
+
+    if (qtime > N_QUEUE_TIMES)
+    {
+        stats_counter_increment(queueStats.exectimes[N_QUEUE_TIMES]);
+    }
+    else
+    {
+        stats_counter_increment(queueStats.exectimes[qtime % N_QUEUE_TIMES]);
+    }
+    if (qtime > queueStats.maxexectime)
+    {
+        queueStats.maxexectime = qtime;
+    }
+
+    dcb->evq.processing_events = 0;
+    __sync_synchronize();
+    dcb->evq.processing = 0;
+    /*
+     * If events arrived while the DCB was being processed it must be
+     * queued again, unless a producer has already done so.
+     */
+    if (dcb->evq.pending_events != 0 &&
+        __sync_bool_compare_and_swap(&dcb->evq.queued, 0, 1))
+    {
+        evq_push(dcb);
+    }
+
+    return 1;
+}
+
+/**
+ * Process the events reported for a DCB. This is the single dispatch point
+ * for both the shared event queue and the thread local polling mode, in
+ * which events are processed directly as they are collected.
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @param dcb           The DCB that the events relate to
+ * @param ev            The epoll event bits to process
+ */
+static void
+process_dcb_events(int thread_id, DCB *dcb, uint32_t ev)
+{
     CHK_DCB(dcb);
+    current_dcb = dcb;
     if (thread_data)
     {
         thread_data[thread_id].state = THREAD_PROCESSING;
@@ -912,10 +1945,18 @@ process_pollq(int thread_id)
     /* ss_dassert(dcb->state != DCB_STATE_DISCONNECTED); */
     if (DCB_STATE_DISCONNECTED == dcb->state)
     {
-        return 0;
+        current_dcb = NULL;
+        return;
     }
     ss_debug(spinlock_release(&dcb->dcb_initlock));
 
+    /*
+     * Cork the writes made while the handlers below are on the stack;
+     * they are flushed in one operation per DCB before returning to
+     * the polling loop.
+     */
+    dcb_write_cork();
+
     MXS_DEBUG("%lu [poll_waitevents] event %d dcb %p "
               "role %s",
               pthread_self(),
@@ -923,6 +1964,8 @@ process_pollq(int thread_id)
               dcb,
               STRDCBROLE(dcb->dcb_role));
 
+    trace_event(TRC_POLL_EVENT, (uintptr_t)dcb, ev);
+
     if (ev & EPOLLOUT)
     {
         int eno = 0;
@@ -992,7 +2035,16 @@ process_pollq(int thread_id)
                  * until it return 1 for success or -1 for error */
                 if (dcb->ssl_state == SSL_HANDSHAKE_REQUIRED)
                 {
-                    return_code = dcb_accept_SSL(dcb);
+                    if (ssl_handshake_offload(dcb))
+                    {
+                        /* An offload thread owns the handshake; it will fake
+                         * a read event when the DCB is ready for the poll loop */
+                        return_code = 0;
+                    }
+                    else
+                    {
+                        return_code = dcb_accept_SSL(dcb);
+                    }
                 }
                 if (1 == return_code)
                 {
@@ -1028,6 +2080,7 @@ process_pollq(int thread_id)
                       strerror_r(eno, errbuf, sizeof(errbuf)));
         }
         ts_stats_add(pollStats.n_error, 1);
+        trace_event(TRC_POLL_ERROR, (uintptr_t)dcb, eno);
         /** Read session id to thread's local storage */
         dcb_get_ses_log_info(dcb,
                              &mxs_log_tls.li_sesid,
@@ -1053,6 +2106,7 @@ process_pollq(int thread_id)
                   eno,
                   strerror_r(eno, errbuf, sizeof(errbuf)));
         ts_stats_add(pollStats.n_hup, 1);
+        trace_event(TRC_POLL_ERROR, (uintptr_t)dcb, eno);
         spinlock_acquire(&dcb->dcb_initlock);
         if ((dcb->flags & DCBF_HUNG) == 0)
         {
@@ -1089,6 +2143,7 @@ process_pollq(int thread_id)
                   eno,
                   strerror_r(eno, errbuf, sizeof(errbuf)));
         ts_stats_add(pollStats.n_hup, 1);
+        trace_event(TRC_POLL_ERROR, (uintptr_t)dcb, eno);
         spinlock_acquire(&dcb->dcb_initlock);
         if ((dcb->flags & DCBF_HUNG) == 0)
         {
@@ -1110,72 +2165,10 @@ process_pollq(int thread_id)
         }
     }
 #endif
-    qtime = hkheartbeat - dcb->evq.started;
-
-    if (qtime > N_QUEUE_TIMES)
-    {
-        queueStats.exectimes[N_QUEUE_TIMES]++;
-    }
-    else
-    {
-        queueStats.exectimes[qtime % N_QUEUE_TIMES]++;
-    }
-    if (qtime > queueStats.maxexectime)
-    {
-        queueStats.maxexectime = qtime;
-    }
-
-    spinlock_acquire(&pollqlock);
-    dcb->evq.processing_events = 0;
-
-    if (dcb->evq.pending_events == 0)
-    {
-        /* No pending events so remove from the queue */
-        if (dcb->evq.prev != dcb)
-        {
-            dcb->evq.prev->evq.next = dcb->evq.next;
-            dcb->evq.next->evq.prev = dcb->evq.prev;
-            if (eventq == dcb)
-                eventq = dcb->evq.next;
-        }
-        else
-        {
-            eventq = NULL;
-        }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
-    }
-    else
-    {
-        /*
-         * We have a pending event, move to the end of the queue
-         * if there are any other DCB's in the queue.
-         *
-         * If we are the first item on the queue this is easy, we
-         * just bump the eventq pointer.
-         */
-        if (dcb->evq.prev != dcb)
-        {
-            if (eventq == dcb)
-                eventq = dcb->evq.next;
-            else
-            {
-                dcb->evq.prev->evq.next = dcb->evq.next;
-                dcb->evq.next->evq.prev = dcb->evq.prev;
-                dcb->evq.prev = eventq->evq.prev;
-                dcb->evq.next = eventq;
-                eventq->evq.prev = dcb;
-                dcb->evq.prev->evq.next = dcb;
-            }
-        }
-    }
-    dcb->evq.processing = 0;
+    dcb_write_flush();
+    current_dcb = NULL;
     /** Reset session id from thread's local storage */
     mxs_log_tls.li_sesid = 0;
-    spinlock_release(&pollqlock);
-
-    return 1;
 }
 
 /**
@@ -1226,19 +2219,6 @@ poll_bitmask()
     return &poll_mask;
 }
 
-/**
- * Display an entry from the spinlock statistics data
- *
- * @param       dcb     The DCB to print to
- * @param       desc    Description of the statistic
- * @param       value   The statistic value
- */
-static void
-spin_reporter(void *dcb, char *desc, int value)
-{
-    dcb_printf((DCB *)dcb, "\t%-40s  %d\n", desc, value);
-}
-
 /**
  * Debug routine to print the polling statistics
  *
@@ -1278,6 +2258,8 @@ dprintPollStats(DCB *dcb)
                pollStats.evq_pending);
     dcb_printf(dcb, "No. of wakeups with pending queue:             %d\n",
                pollStats.wake_evqpending);
+    dcb_printf(dcb, "No. of stalled threads detected:               %d\n",
+               pollStats.n_stalls);
 
     dcb_printf(dcb, "No of poll completions with descriptors\n");
     dcb_printf(dcb, "\tNo. of descriptors\tNo. of poll completions.\n");
@@ -1288,10 +2270,6 @@ dprintPollStats(DCB *dcb)
     dcb_printf(dcb, "\t>= %d\t\t\t%d\n", MAXNFDS,
                pollStats.n_fds[MAXNFDS-1]);
 
-#if SPINLOCK_PROFILE
-    dcb_printf(dcb, "Event queue lock statistics:\n");
-    spinlock_stats(&pollqlock, spin_reporter, dcb);
-#endif
 }
 
 /**
@@ -1417,8 +2395,8 @@ dShowThreads(DCB *dcb)
     {
         return;
     }
-    dcb_printf(dcb, " ID | State      | # fds  | Descriptor       | Running  | Event\n");
-    dcb_printf(dcb, "----+------------+--------+------------------+----------+---------------\n");
+    dcb_printf(dcb, " ID | State      | # DCBs | # fds  | Descriptor       | Running  | Event\n");
+    dcb_printf(dcb, "----+------------+--------+--------+------------------+----------+---------------\n");
     for (i = 0; i < n_threads; i++)
     {
         switch (thread_data[i].state)
@@ -1442,14 +2420,14 @@ dShowThreads(DCB *dcb)
         if (thread_data[i].state != THREAD_PROCESSING)
         {
             dcb_printf(dcb,
-                       " %2d | %-10s |        |                  |          |\n",
-                       i, state);
+                       " %2d | %-10s | %6d |        |                  |          |\n",
+                       i, state, thread_data[i].n_dcbs);
         }
         else if (thread_data[i].cur_dcb == NULL)
         {
             dcb_printf(dcb,
-                       " %2d | %-10s | %6d |                  |          |\n",
-                       i, state, thread_data[i].n_fds);
+                       " %2d | %-10s | %6d | %6d |                  |          |\n",
+                       i, state, thread_data[i].n_dcbs, thread_data[i].n_fds);
         }
         else
         {
@@ -1466,8 +2444,8 @@ dShowThreads(DCB *dcb)
                 from_heap = true;
             }
             dcb_printf(dcb,
-                       " %2d | %-10s | %6d | %-16p | <%3d00ms | %s\n",
-                       i, state, thread_data[i].n_fds,
+                       " %2d | %-10s | %6d | %6d | %-16p | <%3d00ms | %s\n",
+                       i, state, thread_data[i].n_dcbs, thread_data[i].n_fds,
                        thread_data[i].cur_dcb, 1 + hkheartbeat - dcb->evq.started,
                        event_string);
 
@@ -1477,6 +2455,29 @@ dShowThreads(DCB *dcb)
             }
         }
     }
+
+    /*
+     * The decayed per-thread load averages in a machine readable,
+     * one line per thread format so that scripts driven through
+     * maxadmin can parse them without tracking the table layout.
+     */
+    dcb_printf(dcb, "\nDecayed per thread load averages:\n");
+    for (i = 0; i < n_threads; i++)
+    {
+        POLL_LOAD load;
+
+        poll_thread_load(i, &load);
+        dcb_printf(dcb,
+                   "thread_load: id=%d rate_100ms=%.1f rate_1s=%.1f "
+                   "rate_10s=%.1f busy_100ms=%.3f busy_1s=%.3f busy_10s=%.3f\n",
+                   i,
+                   load.event_rate[POLL_LOAD_100MS],
+                   load.event_rate[POLL_LOAD_1S],
+                   load.event_rate[POLL_LOAD_10S],
+                   load.busy_fraction[POLL_LOAD_100MS],
+                   load.busy_fraction[POLL_LOAD_1S],
+                   load.busy_fraction[POLL_LOAD_10S]);
+    }
 }
 
 /**
@@ -1543,43 +2544,8 @@ static void poll_add_event_to_dcb(DCB*       dcb,
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buf);
     spinlock_release(&dcb->authlock);
 
-    spinlock_acquire(&pollqlock);
-
-    /** Set event to DCB */
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        /** Add DCB to eventqueue if it isn't already there */
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    /** Set event to DCB and add it to the event stack */
+    poll_queue_dcb(dcb, ev);
 }
 
 /*
@@ -1636,60 +2602,7 @@ poll_fake_read_event(DCB *dcb)
 void
 poll_fake_event(DCB *dcb, uint32_t ev)
 {
-
-    spinlock_acquire(&pollqlock);
-    /*
-     * If the DCB is already on the queue, there are no pending events and
-     * there are other events on the queue, then
-     * take it off the queue. This stops the DCB hogging the threads.
-     */
-    if (DCB_POLL_BUSY(dcb) && dcb->evq.pending_events == 0 && dcb->evq.prev != dcb)
-    {
-        dcb->evq.prev->evq.next = dcb->evq.next;
-        dcb->evq.next->evq.prev = dcb->evq.prev;
-        if (eventq == dcb)
-        {
-            eventq = dcb->evq.next;
-        }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
-    }
-
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    poll_queue_dcb(dcb, ev);
 }
 
 /*
@@ -1708,41 +2621,7 @@ poll_fake_hangup_event(DCB *dcb)
     uint32_t ev = EPOLLHUP;
 #endif
 
-    spinlock_acquire(&pollqlock);
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    poll_queue_dcb(dcb, ev);
 }
 
 /**
@@ -1755,20 +2634,24 @@ dShowEventQ(DCB *pdcb)
 {
     DCB *dcb;
     char *tmp1, *tmp2;
+    int n = 0;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    /*
+     * The event stack is traversed without any locking, so this is only
+     * a best effort snapshot; the polling threads may push and claim
+     * entries while the walk is in progress. The walk is bounded to
+     * protect against the stack changing underneath us.
+     */
+    if ((dcb = eventq) == NULL)
     {
         /* Nothing to process */
-        spinlock_release(&pollqlock);
         return;
     }
-    dcb = eventq;
     dcb_printf(pdcb, "\nEvent Queue.\n");
     dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
                "Pending Events");
     dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
-    do
+    while (dcb && n++ < pollStats.evq_max)
     {
         dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
                    dcb->evq.processing ? "Processing" : "Pending",
@@ -1778,8 +2661,6 @@ dShowEventQ(DCB *pdcb)
         free(tmp2);
         dcb = dcb->evq.next;
     }
-    while (dcb != eventq);
-    spinlock_release(&pollqlock);
 }
 
 
@@ -1803,14 +2684,20 @@ dShowEventStats(DCB *pdcb)
     dcb_printf(pdcb, "Duration       | Queued     | Executed\n");
     dcb_printf(pdcb, "---------------+------------+-----------\n");
     dcb_printf(pdcb, " < 100ms       | %-10d | %-10d\n",
-               queueStats.qtimes[0], queueStats.exectimes[0]);
+               stats_counter_sum(queueStats.qtimes[0]),
+               stats_counter_sum(queueStats.exectimes[0]));
     for (i = 1; i < N_QUEUE_TIMES; i++)
     {
         dcb_printf(pdcb, " %2d00 - %2d00ms | %-10d | %-10d\n", i, i + 1,
-                   queueStats.qtimes[i], queueStats.exectimes[i]);
+                   stats_counter_sum(queueStats.qtimes[i]),
+                   stats_counter_sum(queueStats.exectimes[i]));
     }
     dcb_printf(pdcb, " > %2d00ms      | %-10d | %-10d\n", N_QUEUE_TIMES,
-               queueStats.qtimes[N_QUEUE_TIMES], queueStats.exectimes[N_QUEUE_TIMES]);
+               stats_counter_sum(queueStats.qtimes[N_QUEUE_TIMES]),
+               stats_counter_sum(queueStats.exectimes[N_QUEUE_TIMES]));
+    dcb_printf(pdcb, "\n");
+    dcb_printf(pdcb, "Queue wait per thread, from readiness to handler start.\n");
+    dprintHistogramThreads(pdcb, queue_wait_hist);
 }
 
 /**
@@ -1844,6 +2731,8 @@ poll_get_stat(POLL_STAT stat)
         return (int)queueStats.maxqtime;
     case POLL_STAT_MAX_EXECTIME:
         return (int)queueStats.maxexectime;
+    case POLL_STAT_STALL:
+        return pollStats.n_stalls;
     }
     return 0;
 }
@@ -1884,10 +2773,10 @@ eventTimesRowCallback(RESULTSET *set, void *data)
         buf[39] = '\0';
         resultset_row_set(row, 0, buf);
     }
-    snprintf(buf,39, "%u", queueStats.qtimes[*rowno]);
+    snprintf(buf,39, "%d", stats_counter_sum(queueStats.qtimes[*rowno]));
     buf[39] = '\0';
     resultset_row_set(row, 1, buf);
-    snprintf(buf,39, "%u", queueStats.exectimes[*rowno]);
+    snprintf(buf,39, "%d", stats_counter_sum(queueStats.exectimes[*rowno]));
     buf[39] = '\0';
     resultset_row_set(row, 2, buf);
     (*rowno)++;
@@ -1921,3 +2810,96 @@ eventTimesGetList()
 
     return set;
 }
+
+/**
+ * Provide a row to the result set that describes one polling thread
+ *
+ * @param set   The result set
+ * @param data  The index of the thread to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+pollThreadsRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    char buf[40];
+    char *state;
+    POLL_LOAD load;
+    RESULT_ROW *row;
+
+    if (thread_data == NULL || *rowno >= n_threads)
+    {
+        free(data);
+        return NULL;
+    }
+    row = resultset_make_row(set);
+    snprintf(buf, 39, "%d", *rowno);
+    buf[39] = '\0';
+    resultset_row_set(row, 0, buf);
+    switch (thread_data[*rowno].state)
+    {
+    case THREAD_STOPPED:
+        state = "Stopped";
+        break;
+    case THREAD_IDLE:
+        state = "Idle";
+        break;
+    case THREAD_POLLING:
+        state = "Polling";
+        break;
+    case THREAD_PROCESSING:
+        state = "Processing";
+        break;
+    case THREAD_ZPROCESSING:
+        state = "Collecting";
+        break;
+    default:
+        state = "Unknown";
+        break;
+    }
+    resultset_row_set(row, 1, state);
+    snprintf(buf, 39, "%d", thread_data[*rowno].n_dcbs);
+    buf[39] = '\0';
+    resultset_row_set(row, 2, buf);
+    poll_thread_load(*rowno, &load);
+    snprintf(buf, 39, "%.2f", load.event_rate[POLL_LOAD_1S]);
+    buf[39] = '\0';
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, 39, "%.2f", load.busy_fraction[POLL_LOAD_1S]);
+    buf[39] = '\0';
+    resultset_row_set(row, 4, buf);
+    (*rowno)++;
+    return row;
+}
+
+/**
+ * Return a result set with a row per polling thread; the state and DCB
+ * count of each thread and the decayed one second averages of its event
+ * rate and busy fraction from the load tracking.
+ *
+ * @return A Result set
+ */
+RESULTSET *
+pollThreadsGetList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(pollThreadsRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Thread", 4, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "State", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "No. DCBs", 8, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Events/sec", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Busy", 8, COL_TYPE_VARCHAR);
+
+    return set;
+}
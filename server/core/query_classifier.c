@@ -25,6 +25,11 @@
 #include <query_classifier.h>
 #include <log_manager.h>
 #include <modules.h>
+#include <modutil.h>
+#include <platform.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 
 //#define QC_TRACE_ENABLED
 #undef QC_TRACE_ENABLED
@@ -39,6 +44,310 @@ static const char default_qc_name[] = "qc_mysqlembedded";
 
 static QUERY_CLASSIFIER* classifier;
 
+/**
+ * Classification result cache.
+ *
+ * Parsing a statement with the embedded parser costs considerably more
+ * than routing it, yet an application typically emits only a few hundred
+ * distinct statement shapes. The results of qc_get_type() and
+ * qc_get_operation() are therefore cached, keyed on the canonicalized
+ * statement text which the plugins produce without parsing. The cache is
+ * a per-thread, direct-mapped table; colliding statements simply evict
+ * each other, which keeps it bounded without any list maintenance or
+ * locking.
+ */
+#define QC_CACHE_SIZE 1024      /*< Entries per thread, must be a power of two */
+
+typedef struct
+{
+    char            *canonical;     /*< Canonicalized statement, the cache key */
+    uint32_t        type;           /*< Cached qc_get_type result */
+    qc_query_op_t   op;             /*< Cached qc_get_operation result */
+    bool            type_valid;     /*< Whether type has been computed */
+    bool            op_valid;       /*< Whether op has been computed */
+} QC_CACHE_ENTRY;
+
+static thread_local QC_CACHE_ENTRY qc_cache[QC_CACHE_SIZE];
+
+/**
+ * Simple string hash for cache slot selection.
+ *
+ * @param str   The canonicalized statement
+ * @return A hash of the string
+ */
+static unsigned int
+qc_cache_hash(const char* str)
+{
+    unsigned int hash = 5381;
+
+    while (*str)
+    {
+        hash = hash * 33 + *str++;
+    }
+
+    return hash;
+}
+
+/**
+ * Find the cache entry for a query, evicting any colliding entry.
+ *
+ * On return the entry holds the canonical form of the query; the valid
+ * flags tell which results are already present. Queries that cannot be
+ * canonicalized, e.g. buffers that do not contain a COM_QUERY packet,
+ * are not cached and NULL is returned.
+ *
+ * @param query A buffer containing a query
+ * @return The cache entry for the query or NULL if it is not cacheable
+ */
+static QC_CACHE_ENTRY*
+qc_cache_find(GWBUF* query)
+{
+    char* canonical = classifier->qc_get_canonical(query);
+    QC_CACHE_ENTRY* entry;
+
+    if (canonical == NULL)
+    {
+        return NULL;
+    }
+
+    entry = &qc_cache[qc_cache_hash(canonical) & (QC_CACHE_SIZE - 1)];
+
+    if (entry->canonical && strcmp(entry->canonical, canonical) == 0)
+    {
+        free(canonical);
+        return entry;
+    }
+
+    free(entry->canonical);
+    entry->canonical = canonical;
+    entry->type_valid = false;
+    entry->op_valid = false;
+
+    return entry;
+}
+
+
+/**
+ * Pre-parse classification.
+ *
+ * For the bulk of the statements an application sends, the operation and
+ * often the read/write typing follow from the leading keyword alone; a
+ * complete parse merely confirms what the first word already said. The
+ * table below drives a scanner that skips leading whitespace, comments
+ * and parentheses, reads the first keyword and resolves whatever that
+ * keyword settles unambiguously. Anything the keyword does not settle -
+ * an unknown leading word, an executable /%! comment, a multi-table
+ * UPDATE or DELETE whose operation code differs from the single table
+ * form - falls through to the plugin parser as before, so the fast path
+ * can only ever agree with the full parse.
+ */
+typedef struct
+{
+    const char      *keyword;       /*< The leading keyword, lower case */
+    qc_query_op_t   op;             /*< Operation the keyword maps to */
+    uint32_t        type;           /*< Type bits the keyword maps to */
+    bool            op_valid;       /*< The keyword settles the operation */
+    bool            type_valid;     /*< The keyword settles the type */
+    bool            single_table;   /*< Operation holds only for the single
+                                     *  table form of the statement */
+} QC_KEYWORD;
+
+static const QC_KEYWORD qc_keywords[] =
+{
+    { "select",   QUERY_OP_SELECT,   QUERY_TYPE_UNKNOWN, true,  false, false },
+    { "insert",   QUERY_OP_INSERT,   QUERY_TYPE_WRITE,   true,  true,  false },
+    { "update",   QUERY_OP_UPDATE,   QUERY_TYPE_WRITE,   true,  true,  true  },
+    { "delete",   QUERY_OP_DELETE,   QUERY_TYPE_WRITE,   true,  true,  true  },
+    { "truncate", QUERY_OP_TRUNCATE, QUERY_TYPE_UNKNOWN, true,  false, false },
+    { NULL,       QUERY_OP_UNDEFINED, QUERY_TYPE_UNKNOWN, false, false, false }
+};
+
+/**
+ * Advance over whitespace, comments and opening parentheses to the first
+ * character of the leading keyword.
+ *
+ * @param ptr   Current position in the SQL text
+ * @param end   End of the SQL text
+ * @return Position of the first keyword character or NULL if the scanner
+ *         cannot resolve it, e.g. for an executable comment
+ */
+static char *
+qc_preparse_skip(char *ptr, char *end)
+{
+    for (;;)
+    {
+        while (ptr < end && (isspace((unsigned char)*ptr) || *ptr == '('))
+        {
+            ptr++;
+        }
+        if (ptr + 1 < end && ptr[0] == '/' && ptr[1] == '*')
+        {
+            if (ptr + 2 < end && ptr[2] == '!')
+            {
+                /* Executable comment, only the parser understands these */
+                return NULL;
+            }
+            ptr += 2;
+            while (ptr + 1 < end && !(ptr[0] == '*' && ptr[1] == '/'))
+            {
+                ptr++;
+            }
+            if (ptr + 1 >= end)
+            {
+                return NULL;
+            }
+            ptr += 2;
+        }
+        else if (ptr < end &&
+                 (*ptr == '#' ||
+                  (ptr + 2 < end && ptr[0] == '-' && ptr[1] == '-' &&
+                   isspace((unsigned char)ptr[2]))))
+        {
+            while (ptr < end && *ptr != '\n')
+            {
+                ptr++;
+            }
+            if (ptr >= end)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            return ptr < end ? ptr : NULL;
+        }
+    }
+}
+
+/**
+ * Check that a statement is the single table form of an UPDATE or
+ * DELETE. The scan runs from after the leading keyword to the given
+ * stop keyword; a comma, a quoted identifier or any join keyword means
+ * the statement may be the multi table form, whose operation code
+ * differs, and the caller must fall back to the full parse.
+ *
+ * @param ptr           Position after the leading keyword
+ * @param end           End of the SQL text
+ * @param stop          Keyword ending the scanned part, lower case
+ * @param at_end_ok     Whether running out of text without meeting the
+ *                      stop keyword still qualifies
+ * @return True if the statement is certainly the single table form
+ */
+static bool
+qc_preparse_single_table(char *ptr, char *end, const char *stop, bool at_end_ok)
+{
+    char word[16];
+    int w = 0;
+
+    while (ptr < end)
+    {
+        if (*ptr == ',' || *ptr == '`' || *ptr == '"')
+        {
+            return false;
+        }
+        if (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '$')
+        {
+            /* Words overflowing the buffer match no keyword, which is
+             * safe, they can only cause a fall back to the parser */
+            if (w < (int)sizeof(word) - 1)
+            {
+                word[w++] = tolower((unsigned char)*ptr);
+            }
+        }
+        else
+        {
+            word[w] = '\0';
+            if (w > 0)
+            {
+                if (strcmp(word, stop) == 0)
+                {
+                    return true;
+                }
+                if (strstr(word, "join") != NULL || strcmp(word, "using") == 0)
+                {
+                    return false;
+                }
+            }
+            w = 0;
+        }
+        ptr++;
+    }
+    word[w] = '\0';
+    return strcmp(word, stop) == 0 || at_end_ok;
+}
+
+/**
+ * Attempt to classify a statement from its leading keyword without
+ * parsing it.
+ *
+ * @param query         A buffer containing a query
+ * @param op            Returns the operation when *op_valid is set
+ * @param op_valid      Returns whether the operation was resolved
+ * @param type          Returns the type bits when *type_valid is set
+ * @param type_valid    Returns whether the type bits were resolved
+ */
+static void
+qc_preparse(GWBUF *query, qc_query_op_t *op, bool *op_valid,
+            uint32_t *type, bool *type_valid)
+{
+    char *sql, *ptr, *end;
+    char word[12];
+    int len, i, w = 0;
+
+    *op_valid = false;
+    *type_valid = false;
+
+    if (!modutil_extract_SQL(query, &sql, &len))
+    {
+        return;
+    }
+    end = sql + len;
+    if ((ptr = qc_preparse_skip(sql, end)) == NULL)
+    {
+        return;
+    }
+    while (ptr < end && w < (int)sizeof(word) - 1 &&
+           (isalpha((unsigned char)*ptr) || *ptr == '_'))
+    {
+        word[w++] = tolower((unsigned char)*ptr);
+        ptr++;
+    }
+    word[w] = '\0';
+    if (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_'))
+    {
+        /* Keyword longer than any in the table */
+        return;
+    }
+
+    for (i = 0; qc_keywords[i].keyword; i++)
+    {
+        if (strcmp(word, qc_keywords[i].keyword) == 0)
+        {
+            *type = qc_keywords[i].type;
+            *type_valid = qc_keywords[i].type_valid;
+            *op = qc_keywords[i].op;
+            *op_valid = qc_keywords[i].op_valid;
+            if (qc_keywords[i].single_table && *op_valid)
+            {
+                if (*op == QUERY_OP_UPDATE)
+                {
+                    /* Multi table UPDATEs join their tables before SET */
+                    *op_valid = qc_preparse_single_table(ptr, end, "set",
+                                                         false);
+                }
+                else
+                {
+                    /* DELETE t1, t2 FROM ... and DELETE FROM t1, t2
+                     * USING ... are the multi table forms; both show a
+                     * comma or the USING keyword before any WHERE */
+                    *op_valid = qc_preparse_single_table(ptr, end, "where",
+                                                         true);
+                }
+            }
+            return;
+        }
+    }
+}
 
 bool qc_init(const char* plugin_name)
 {
@@ -106,6 +415,14 @@ void qc_thread_end(void)
     QC_TRACE();
     ss_dassert(classifier);
 
+    for (int i = 0; i < QC_CACHE_SIZE; i++)
+    {
+        free(qc_cache[i].canonical);
+        qc_cache[i].canonical = NULL;
+        qc_cache[i].type_valid = false;
+        qc_cache[i].op_valid = false;
+    }
+
     return classifier->qc_thread_end();
 }
 
@@ -114,6 +431,11 @@ void qc_thread_end(void)
  * The result should be tested against specific qc_query_type_t values
  * using the bitwise & operator, never using the == operator.
  *
+ * Statements whose typing follows from their leading keyword are
+ * resolved by the pre-parse scanner without parsing at all; the result
+ * of the rest is cached keyed on the canonical form of the query, so
+ * each distinct statement shape is parsed only once per thread.
+ *
  * @param query A buffer containing a query.
  *
  * @return A bitmask of type bits.
@@ -123,7 +445,31 @@ uint32_t qc_get_type(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_type(query);
+    qc_query_op_t op;
+    uint32_t type;
+    bool op_valid, type_valid;
+
+    qc_preparse(query, &op, &op_valid, &type, &type_valid);
+
+    if (type_valid)
+    {
+        return type;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_find(query);
+
+    if (entry == NULL)
+    {
+        return classifier->qc_get_type(query);
+    }
+
+    if (!entry->type_valid)
+    {
+        entry->type = classifier->qc_get_type(query);
+        entry->type_valid = true;
+    }
+
+    return entry->type;
 }
 
 qc_query_op_t qc_get_operation(GWBUF* query)
@@ -131,7 +477,31 @@ qc_query_op_t qc_get_operation(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_operation(query);
+    qc_query_op_t op;
+    uint32_t type;
+    bool op_valid, type_valid;
+
+    qc_preparse(query, &op, &op_valid, &type, &type_valid);
+
+    if (op_valid)
+    {
+        return op;
+    }
+
+    QC_CACHE_ENTRY* entry = qc_cache_find(query);
+
+    if (entry == NULL)
+    {
+        return classifier->qc_get_operation(query);
+    }
+
+    if (!entry->op_valid)
+    {
+        entry->op = classifier->qc_get_operation(query);
+        entry->op_valid = true;
+    }
+
+    return entry->op;
 }
 
 char* qc_get_created_table_name(GWBUF* query)
@@ -0,0 +1,385 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file querystats.c  - Per query shape execution statistics
+ *
+ * The digest is kept in per-thread, direct-mapped tables keyed on the
+ * canonical form of the statement, the same scheme the classification
+ * cache in query_classifier.c uses. When two shapes collide in a slot
+ * the newcomer evicts the older shape and, in the manner of the
+ * space-saving algorithm, inherits its execution count, so a genuinely
+ * hot shape can never be kept out of the digest by collisions; the
+ * inherited portion is tracked separately as the error bound of the
+ * count. The latency figures are reset on eviction and thus only ever
+ * describe samples of the shape they are reported against.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 29/06/16     Mark Riddoch    Initial implementation
+ * 02/07/16     Mark Riddoch    Use the statement digest computed in the
+ *                              session routing path for slot selection
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <querystats.h>
+#include <service.h>
+#include <spinlock.h>
+#include <dcb.h>
+#include <platform.h>
+
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Slots per thread table, must be a power of two */
+#define QUERYSTATS_SLOTS 1024
+
+/** The number of shapes the diagnostic commands print */
+#define QUERYSTATS_TOP 20
+
+typedef struct
+{
+    char            *canonical; /*< Canonical statement, the table key */
+    struct service  *service;   /*< The service the statement was routed by */
+    uint64_t        count;      /*< Estimated execution count of the shape */
+    uint64_t        nerr;       /*< Portion of count inherited on eviction */
+    uint64_t        samples;    /*< Latency samples taken of this shape */
+    uint64_t        total;      /*< Sum of the sampled latencies (us) */
+    uint64_t        max;        /*< Largest sampled latency (us) */
+} QUERYSTATS_ENTRY;
+
+/**
+ * The digest table of one thread. The lock is all but uncontended; it
+ * is taken by the owning thread for each update and by the thread
+ * running a diagnostic command while it copies the table out.
+ */
+typedef struct querystats_table
+{
+    SPINLOCK        lock;       /*< Serialises updates with diagnostic reads */
+    QUERYSTATS_ENTRY entries[QUERYSTATS_SLOTS];
+    struct querystats_table *next; /*< Next table in the global list */
+} QUERYSTATS_TABLE;
+
+static thread_local QUERYSTATS_TABLE *querystats_table = NULL;
+
+/** The tables of all threads, linked for the diagnostic commands */
+static SPINLOCK table_list_lock = SPINLOCK_INIT;
+static QUERYSTATS_TABLE *table_list = NULL;
+
+/**
+ * Simple string hash for slot selection, the same used by the
+ * classification cache.
+ *
+ * @param str   The canonical statement
+ * @return A hash of the string
+ */
+static unsigned int
+querystats_hash(const char *str)
+{
+    unsigned int hash = 5381;
+
+    while (*str)
+    {
+        hash = hash * 33 + *str++;
+    }
+
+    return hash;
+}
+
+/**
+ * Return the digest table of the calling thread, creating it on the
+ * first call and linking it into the global list for the diagnostic
+ * commands.
+ *
+ * @return The table of the calling thread or NULL on allocation failure
+ */
+static QUERYSTATS_TABLE *
+querystats_get_table()
+{
+    QUERYSTATS_TABLE *table;
+
+    if ((table = querystats_table) == NULL)
+    {
+        if ((table = (QUERYSTATS_TABLE *)calloc(1, sizeof(QUERYSTATS_TABLE))) == NULL)
+        {
+            return NULL;
+        }
+        spinlock_init(&table->lock);
+        querystats_table = table;
+        spinlock_acquire(&table_list_lock);
+        table->next = table_list;
+        table_list = table;
+        spinlock_release(&table_list_lock);
+    }
+    return table;
+}
+
+/**
+ * Record one execution of a query shape
+ *
+ * Ownership of the canonical string passes to the digest; it is either
+ * stored in the table or freed here.
+ *
+ * @param service   The service that routed the statement
+ * @param canonical The canonical form of the statement
+ * @param digest    Digest of the statement computed in the routing path,
+ *                  0 if the caller has not computed one
+ * @param duration  Time from routing to the first reply in microseconds
+ */
+void
+querystats_record(struct service *service, char *canonical, uint64_t digest,
+                  uint64_t duration)
+{
+    QUERYSTATS_TABLE *table;
+    QUERYSTATS_ENTRY *entry;
+
+    if (canonical == NULL)
+    {
+        return;
+    }
+    if ((table = querystats_get_table()) == NULL)
+    {
+        free(canonical);
+        return;
+    }
+    if (digest == 0)
+    {
+        digest = querystats_hash(canonical);
+    }
+    entry = &table->entries[digest & (QUERYSTATS_SLOTS - 1)];
+    spinlock_acquire(&table->lock);
+    if (entry->canonical && entry->service == service &&
+        strcmp(entry->canonical, canonical) == 0)
+    {
+        free(canonical);
+    }
+    else
+    {
+        /*
+         * Evict the colliding shape. The newcomer inherits its count,
+         * so the slot always holds at least the count of the most
+         * frequent shape hashing to it; the inherited portion is kept
+         * in nerr as the error bound of the estimate.
+         */
+        free(entry->canonical);
+        entry->canonical = canonical;
+        entry->service = service;
+        entry->nerr = entry->count;
+        entry->samples = 0;
+        entry->total = 0;
+        entry->max = 0;
+    }
+    entry->count++;
+    entry->samples++;
+    entry->total += duration;
+    if (duration > entry->max)
+    {
+        entry->max = duration;
+    }
+    spinlock_release(&table->lock);
+}
+
+/**
+ * Copy the tables of every thread into a single merged array,
+ * aggregating entries that hold the same shape for the same service.
+ * Each table lock is held only while that table is copied out.
+ *
+ * @param nentries  Set to the number of merged entries on return
+ * @return The merged entries, to be freed with querystats_merge_free
+ */
+static QUERYSTATS_ENTRY *
+querystats_merge(int *nentries)
+{
+    QUERYSTATS_TABLE *table;
+    QUERYSTATS_ENTRY *merged = NULL, *entry, *slot;
+    int used = 0, capacity = 0, i, j;
+
+    spinlock_acquire(&table_list_lock);
+    for (table = table_list; table; table = table->next)
+    {
+        spinlock_acquire(&table->lock);
+        for (i = 0; i < QUERYSTATS_SLOTS; i++)
+        {
+            slot = &table->entries[i];
+            if (slot->canonical == NULL)
+            {
+                continue;
+            }
+            entry = NULL;
+            for (j = 0; j < used; j++)
+            {
+                if (merged[j].service == slot->service &&
+                    strcmp(merged[j].canonical, slot->canonical) == 0)
+                {
+                    entry = &merged[j];
+                    break;
+                }
+            }
+            if (entry == NULL)
+            {
+                if (used == capacity)
+                {
+                    QUERYSTATS_ENTRY *bigger;
+
+                    capacity = capacity ? capacity * 2 : 256;
+                    if ((bigger = realloc(merged, capacity * sizeof(QUERYSTATS_ENTRY))) == NULL)
+                    {
+                        break;
+                    }
+                    merged = bigger;
+                }
+                entry = &merged[used];
+                memset(entry, 0, sizeof(QUERYSTATS_ENTRY));
+                if ((entry->canonical = strdup(slot->canonical)) == NULL)
+                {
+                    break;
+                }
+                entry->service = slot->service;
+                used++;
+            }
+            entry->count += slot->count;
+            entry->nerr += slot->nerr;
+            entry->samples += slot->samples;
+            entry->total += slot->total;
+            if (slot->max > entry->max)
+            {
+                entry->max = slot->max;
+            }
+        }
+        spinlock_release(&table->lock);
+    }
+    spinlock_release(&table_list_lock);
+
+    *nentries = used;
+    return merged;
+}
+
+/**
+ * Free the result of querystats_merge
+ *
+ * @param merged    The merged entries
+ * @param nentries  The number of merged entries
+ */
+static void
+querystats_merge_free(QUERYSTATS_ENTRY *merged, int nentries)
+{
+    int i;
+
+    for (i = 0; i < nentries; i++)
+    {
+        free(merged[i].canonical);
+    }
+    free(merged);
+}
+
+/**
+ * qsort comparator ordering entries by descending execution count
+ */
+static int
+querystats_cmp_count(const void *a, const void *b)
+{
+    uint64_t ca = ((const QUERYSTATS_ENTRY *)a)->count;
+    uint64_t cb = ((const QUERYSTATS_ENTRY *)b)->count;
+
+    return ca < cb ? 1 : (ca > cb ? -1 : 0);
+}
+
+/**
+ * qsort comparator ordering entries by descending average latency
+ */
+static int
+querystats_cmp_latency(const void *a, const void *b)
+{
+    const QUERYSTATS_ENTRY *ea = (const QUERYSTATS_ENTRY *)a;
+    const QUERYSTATS_ENTRY *eb = (const QUERYSTATS_ENTRY *)b;
+    double la = ea->samples ? (double)ea->total / ea->samples : 0.0;
+    double lb = eb->samples ? (double)eb->total / eb->samples : 0.0;
+
+    return la < lb ? 1 : (la > lb ? -1 : 0);
+}
+
+/**
+ * Print the merged digest to a DCB, sorted by the given comparator
+ *
+ * @param dcb       DCB to print to
+ * @param cmp       The ordering to apply
+ * @param heading   Heading describing the ordering
+ */
+static void
+querystats_print(DCB *dcb, int (*cmp)(const void *, const void *), const char *heading)
+{
+    QUERYSTATS_ENTRY *merged;
+    int nentries, i, top;
+
+    merged = querystats_merge(&nentries);
+    if (nentries == 0)
+    {
+        dcb_printf(dcb, "No queries have been recorded.\n");
+        querystats_merge_free(merged, nentries);
+        return;
+    }
+    qsort(merged, nentries, sizeof(QUERYSTATS_ENTRY), cmp);
+    top = nentries < QUERYSTATS_TOP ? nentries : QUERYSTATS_TOP;
+
+    dcb_printf(dcb, "%s (%d of %d shapes)\n\n", heading, top, nentries);
+    dcb_printf(dcb, "%-10s %-10s %-10s %-16s %s\n",
+               "Count", "Avg (ms)", "Max (ms)", "Service", "Query");
+    for (i = 0; i < top; i++)
+    {
+        QUERYSTATS_ENTRY *entry = &merged[i];
+
+        dcb_printf(dcb, "%-10lu %-10.3f %-10.3f %-16s %s\n",
+                   (unsigned long)entry->count,
+                   entry->samples ? (double)entry->total / entry->samples / 1000.0 : 0.0,
+                   entry->max / 1000.0,
+                   entry->service ? entry->service->name : "",
+                   entry->canonical);
+    }
+    querystats_merge_free(merged, nentries);
+}
+
+/**
+ * Diagnostic entry point for the "show hotqueries" command; print the
+ * query shapes with the highest execution counts.
+ *
+ * @param dcb   DCB to print to
+ */
+void
+dprintHotQueries(DCB *dcb)
+{
+    querystats_print(dcb, querystats_cmp_count,
+                     "Query shapes by execution count");
+}
+
+/**
+ * Diagnostic entry point for the "show latency" command; print the
+ * query shapes with the highest average latency.
+ *
+ * @param dcb   DCB to print to
+ */
+void
+dprintQueryLatency(DCB *dcb)
+{
+    querystats_print(dcb, querystats_cmp_latency,
+                     "Query shapes by average latency");
+}
@@ -27,15 +27,19 @@
  *
  * Date         Who             Description
  * 26/08/15     Martin Brampton Initial implementation
+ * 05/07/16     Mark Riddoch    Per-thread generator state and a bulk fill
+ *                              entry point for the scramble generation
  *
  * @endverbatim
  */
 
 #include <stdbool.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <platform.h>
 #include <spinlock.h>
 #include <random_jkiss.h>
 
@@ -49,18 +53,29 @@ static bool init = false;
 
 static SPINLOCK random_jkiss_spinlock = SPINLOCK_INIT;
 
+/* Per-thread generator state. Each thread runs its own JKISS generator,
+ * seeded once from the locked global generator, so drawing a random
+ * number on the hot path - a scramble for every client handshake -
+ * involves no synchronisation at all.
+ */
+static thread_local unsigned int tls_x, tls_y, tls_z, tls_c;
+static thread_local bool tls_init = false;
+
 static unsigned int random_jkiss_devrand(void);
 static void random_init_jkiss(void);
+static void random_init_jkiss_thread(void);
 
 /***
  *
- * Return a pseudo-random number that satisfies major tests for random sequences
+ * Return a pseudo-random number from the global generator, which is
+ * shared by all threads and guarded by a spinlock. Only used to seed
+ * the per-thread generators.
  *
  * @return  uint    Random number
  *
  */
-unsigned int
-random_jkiss(void)
+static unsigned int
+random_jkiss_locked(void)
 {
     unsigned long long t;
     unsigned int result;
@@ -72,6 +87,7 @@ random_jkiss(void)
         init = true;
         spinlock_release(&random_jkiss_spinlock);
         random_init_jkiss();
+        spinlock_acquire(&random_jkiss_spinlock);
     }
     x = 314527869 * x + 1234567;
     y ^= y << 5;
@@ -85,6 +101,63 @@ random_jkiss(void)
     return result;
 }
 
+/***
+ *
+ * Return a pseudo-random number that satisfies major tests for random sequences
+ *
+ * @return  uint    Random number
+ *
+ */
+unsigned int
+random_jkiss(void)
+{
+    unsigned long long t;
+
+    if (!tls_init)
+    {
+        random_init_jkiss_thread();
+    }
+    tls_x = 314527869 * tls_x + 1234567;
+    tls_y ^= tls_y << 5;
+    tls_y ^= tls_y >> 7;
+    tls_y ^= tls_y << 22;
+    t = 4294584393ULL * tls_z + tls_c;
+    tls_c = t >> 32;
+    tls_z = t;
+    return tls_x + tls_y + tls_z;
+}
+
+/***
+ *
+ * Fill a buffer with pseudo-random bytes from the generator of the
+ * calling thread. Used for the 20 byte scrambles of the handshake,
+ * where it replaces a call per byte with a call per four bytes and
+ * takes no locks.
+ *
+ * @param buf   The buffer to fill
+ * @param len   Number of bytes to fill
+ *
+ */
+void
+random_jkiss_fill(void *buf, unsigned int len)
+{
+    unsigned char *ptr = (unsigned char *)buf;
+    unsigned int r;
+
+    while (len >= sizeof(r))
+    {
+        r = random_jkiss();
+        memcpy(ptr, &r, sizeof(r));
+        ptr += sizeof(r);
+        len -= sizeof(r);
+    }
+    if (len > 0)
+    {
+        r = random_jkiss();
+        memcpy(ptr, &r, len);
+    }
+}
+
 /* Own code adapted from http://www0.cs.ucl.ac.uk/staff/d.jones/GoodPracticeRNG.pdf */
 
 /***
@@ -149,6 +222,28 @@ random_init_jkiss(void)
     /* "Warm up" our random number generator */
     for (i = 0; i < 100; i++)
     {
-        random_jkiss();
+        random_jkiss_locked();
+    }
+}
+
+/***
+ *
+ * Initialise the generator of the calling thread with seeds drawn from
+ * the global generator.
+ *
+ */
+static void
+random_init_jkiss_thread(void)
+{
+    /* Must set the flag first, the global generator initialisation
+     * warms itself up with calls into the generator */
+    tls_init = true;
+    tls_x = random_jkiss_locked();
+    do
+    {
+        tls_y = random_jkiss_locked();
     }
+    while (tls_y == 0);     /* y must never be set to zero */
+    tls_z = random_jkiss_locked();
+    tls_c = random_jkiss_locked() % 698769068 + 1; /* Should be less than 698769069 */
 }
@@ -0,0 +1,178 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file rcu.c Epoch based protection for read-mostly data structures
+ *
+ * The implementation keeps a global epoch counter and one announcement
+ * slot per reader thread. A thread entering a read side section announces
+ * the current epoch in its slot; a thread leaving the section clears the
+ * slot. rcu_synchronize() advances the epoch and then waits for every
+ * slot to either be clear or hold the new epoch, at which point no reader
+ * can still see data that was unlinked before the epoch was advanced.
+ *
+ * Slots are assigned to threads on first use and are never returned; the
+ * set of threads within MaxScale is essentially static after startup. If
+ * more threads than slots ever appear the surplus threads fall back to a
+ * lock shared with rcu_synchronize(), which is correct but serialises
+ * those readers against writers.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 03/07/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+#include <rcu.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <thread.h>
+#include <platform.h>
+#include <skygw_debug.h>
+
+/** Maximum number of threads that can hold a reader announcement slot */
+#define RCU_MAX_READERS 1024
+
+/** The global epoch; never zero, as zero marks a quiescent reader slot */
+static volatile int rcu_epoch = 1;
+
+/** The per thread announcement slots */
+static volatile int rcu_reader_epoch[RCU_MAX_READERS];
+
+/** Next announcement slot to assign */
+static int rcu_next_slot = 0;
+
+/** Fallback lock for readers that could not be assigned a slot */
+static SPINLOCK rcu_fallback_lock = SPINLOCK_INIT;
+
+/** The slot of the calling thread, -1 until first use */
+static thread_local int rcu_slot = -1;
+
+/** Read side section nesting depth of the calling thread */
+static thread_local int rcu_nesting = 0;
+
+/**
+ * Enter a read side section.
+ *
+ * Within the section the reader may traverse structures published with
+ * rcu_assign_pointer() without further synchronisation; nothing the
+ * reader can reach through such a pointer is freed until the section has
+ * been left. Sections may be nested and must be kept short; a writer in
+ * rcu_synchronize() waits for all of them to drain.
+ */
+void
+rcu_read_lock()
+{
+    if (rcu_nesting++ > 0)
+    {
+        return;
+    }
+    if (rcu_slot < 0)
+    {
+        int slot = atomic_add(&rcu_next_slot, 1);
+
+        if (slot < RCU_MAX_READERS)
+        {
+            rcu_slot = slot;
+        }
+    }
+    if (rcu_slot < 0)
+    {
+        /* The slot table is exhausted; serialise against writers. */
+        spinlock_acquire(&rcu_fallback_lock);
+        return;
+    }
+    for (;;)
+    {
+        int epoch = rcu_epoch;
+
+        rcu_reader_epoch[rcu_slot] = epoch;
+        /* The announcement must be visible before anything within the
+         * section is read; re-read the epoch afterwards so that an
+         * announcement racing with an epoch advance is never trusted. */
+        __sync_synchronize();
+        if (epoch == rcu_epoch)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Leave a read side section.
+ *
+ * Once the outermost section of the thread has been left the thread must
+ * not use any pointer it obtained within it.
+ */
+void
+rcu_read_unlock()
+{
+    ss_dassert(rcu_nesting > 0);
+
+    if (--rcu_nesting > 0)
+    {
+        return;
+    }
+    if (rcu_slot < 0)
+    {
+        spinlock_release(&rcu_fallback_lock);
+        return;
+    }
+    /* All reads within the section must complete before the slot is
+     * cleared and a writer is allowed to reclaim the old version. */
+    __sync_synchronize();
+    rcu_reader_epoch[rcu_slot] = 0;
+}
+
+/**
+ * Wait until every read side section that was entered before the call
+ * has been left.
+ *
+ * A writer publishes the new version of a structure first, calls this and
+ * may then free the old version: every reader still running afterwards
+ * entered its section after the publication and thus sees the new
+ * version. Must not be called from within a read side section, and
+ * concurrent writers must be serialised by a lock of their own.
+ */
+void
+rcu_synchronize()
+{
+    int target = atomic_add((int *)&rcu_epoch, 1) + 1;
+    int nslots = rcu_next_slot;
+    int i;
+
+    ss_dassert(rcu_nesting == 0);
+
+    if (nslots > RCU_MAX_READERS)
+    {
+        nslots = RCU_MAX_READERS;
+    }
+    for (i = 0; i < nslots; i++)
+    {
+        while (rcu_reader_epoch[i] != 0 &&
+               rcu_reader_epoch[i] - target < 0)
+        {
+            thread_millisleep(1);
+        }
+    }
+    /* Drain any readers that are holding the fallback lock. */
+    spinlock_acquire(&rcu_fallback_lock);
+    spinlock_release(&rcu_fallback_lock);
+}
@@ -24,6 +24,8 @@
  *
  * Date         Who             Description
  * 17/02/15     Mark Riddoch    Initial implementation
+ * 22/06/16     Mark Riddoch    Serialise the MySQL encoding into large
+ *                              shared buffers with incremental flushing
  *
  * @endverbatim
  */
@@ -34,11 +36,34 @@
 #include <buffer.h>
 #include <dcb.h>
 
+/**
+ * The MySQL encoding of a result set previously allocated a fresh buffer
+ * for every packet, so a large result set - "show sessions" with tens of
+ * thousands of sessions for instance - was fully materialised as a long
+ * chain of small buffers on the DCB write queue. The encoder now packs
+ * consecutive packets into a single large buffer and hands it to the DCB
+ * once it fills, amortising the allocation over many rows and letting the
+ * poll loop drain the data while the remaining rows are still being
+ * fetched.
+ */
+#define RESULTSET_BLOCK_SIZE    32768   /*< Size of the encoder accumulation buffer */
+
+/**
+ * The streaming encoder state
+ */
+typedef struct
+{
+    DCB     *dcb;       /*< The connection the result set is streamed to */
+    GWBUF   *buffer;    /*< The accumulation buffer, NULL if none is held */
+    int     used;       /*< Number of bytes of the buffer in use */
+} RESULT_ENCODER;
 
-static int mysql_send_fieldcount(DCB *, int);
-static int mysql_send_columndef(DCB *, char *, int, int, uint8_t);
-static int mysql_send_eof(DCB *, int);
-static int mysql_send_row(DCB *, RESULT_ROW *, int);
+static int mysql_send_fieldcount(RESULT_ENCODER *, int);
+static int mysql_send_columndef(RESULT_ENCODER *, char *, int, int, uint8_t);
+static int mysql_send_eof(RESULT_ENCODER *, int);
+static int mysql_send_row(RESULT_ENCODER *, RESULT_ROW *, int);
+static uint8_t *resultset_reserve(RESULT_ENCODER *, int);
+static int resultset_flush(RESULT_ENCODER *);
 
 
 /**
@@ -246,56 +271,128 @@ resultset_stream_mysql(RESULTSET *set, DCB *dcb)
 {
     RESULT_COLUMN *col;
     RESULT_ROW *row;
+    RESULT_ENCODER encoder;
     uint8_t seqno = 2;
 
-    mysql_send_fieldcount(dcb, set->n_cols);
+    encoder.dcb = dcb;
+    encoder.buffer = NULL;
+    encoder.used = 0;
+
+    mysql_send_fieldcount(&encoder, set->n_cols);
 
     col = set->column;
     while (col)
     {
-        mysql_send_columndef(dcb, col->name, col->type, col->len, seqno++);
+        mysql_send_columndef(&encoder, col->name, col->type, col->len, seqno++);
         col = col->next;
     }
-    mysql_send_eof(dcb, seqno++);
+    mysql_send_eof(&encoder, seqno++);
     while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
     {
-        mysql_send_row(dcb, row, seqno++);
+        mysql_send_row(&encoder, row, seqno++);
         resultset_free_row(row);
     }
-    mysql_send_eof(dcb, seqno);
+    mysql_send_eof(&encoder, seqno);
+    resultset_flush(&encoder);
+}
+
+/**
+ * Reserve space for a packet in the accumulation buffer of the encoder.
+ *
+ * If the packet does not fit in the remaining space of the current buffer
+ * the buffer is first flushed to the connection. A fresh buffer is at
+ * least RESULTSET_BLOCK_SIZE bytes so that many rows are packed into each
+ * allocation; a packet larger than the block size gets a buffer of its
+ * own size.
+ *
+ * @param encoder       The streaming encoder
+ * @param len           Number of bytes required
+ * @return Pointer to the reserved bytes or NULL on allocation failure
+ */
+static uint8_t *
+resultset_reserve(RESULT_ENCODER *encoder, int len)
+{
+    uint8_t *ptr;
+
+    if (encoder->buffer &&
+        encoder->used + len > (int)GWBUF_LENGTH(encoder->buffer))
+    {
+        resultset_flush(encoder);
+    }
+    if (encoder->buffer == NULL)
+    {
+        int size = len > RESULTSET_BLOCK_SIZE ? len : RESULTSET_BLOCK_SIZE;
+
+        if ((encoder->buffer = gwbuf_alloc(size)) == NULL)
+        {
+            return NULL;
+        }
+        encoder->used = 0;
+    }
+    ptr = GWBUF_DATA(encoder->buffer) + encoder->used;
+    encoder->used += len;
+    return ptr;
+}
+
+/**
+ * Flush the accumulation buffer of the encoder to the connection,
+ * trimming the unused tail of the buffer first. Ownership of the buffer
+ * passes to the DCB write queue, so the next packet will start a new one.
+ *
+ * @param encoder       The streaming encoder
+ * @return The return value of the protocol write, or non-zero if there
+ *         was nothing to flush
+ */
+static int
+resultset_flush(RESULT_ENCODER *encoder)
+{
+    GWBUF *buffer = encoder->buffer;
+    int rval = 1;
+
+    if (buffer)
+    {
+        int unused = GWBUF_LENGTH(buffer) - encoder->used;
+
+        if (unused > 0)
+        {
+            gwbuf_rtrim(buffer, unused);
+        }
+        encoder->buffer = NULL;
+        encoder->used = 0;
+        rval = encoder->dcb->func.write(encoder->dcb, buffer);
+    }
+    return rval;
 }
 
 /**
  * Send the field count packet in a response packet sequence.
  *
- * @param dcb           DCB of connection to send result set to
+ * @param encoder       Encoder of the connection to send the result set to
  * @param count         Number of columns in the result set
  * @return              Non-zero on success
  */
 static int
-mysql_send_fieldcount(DCB *dcb, int count)
+mysql_send_fieldcount(RESULT_ENCODER *encoder, int count)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(5)) == NULL)
+    if ((ptr = resultset_reserve(encoder, 5)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     *ptr++ = 0x01;                  // Payload length
     *ptr++ = 0x00;
     *ptr++ = 0x00;
     *ptr++ = 0x01;                  // Sequence number in response
     *ptr++ = count;                 // Length of result string
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 
 /**
  * Send the column definition packet in a response packet sequence.
  *
- * @param dcb           The DCB of the connection
+ * @param encoder       Encoder of the connection
  * @param name          Name of the column
  * @param type          Column type
  * @param len           Column length
@@ -303,17 +400,15 @@ mysql_send_fieldcount(DCB *dcb, int count)
  * @return              Non-zero on success
  */
 static int
-mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
+mysql_send_columndef(RESULT_ENCODER *encoder, char *name, int type, int len, uint8_t seqno)
 {
-    GWBUF *pkt;
     uint8_t *ptr;
     int plen;
 
-    if ((pkt = gwbuf_alloc(26 + strlen(name))) == NULL)
+    if ((ptr = resultset_reserve(encoder, 26 + strlen(name))) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     plen = 22 + strlen(name);
     *ptr++ = plen & 0xff;
     *ptr++ = (plen >> 8) & 0xff;
@@ -352,28 +447,26 @@ mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
     *ptr++= 0;
     *ptr++= 0;
     *ptr++= 0;
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 
 /**
  * Send an EOF packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param encoder       Encoder of the client connection
  * @param seqno         The sequence number of the EOF packet
  * @return              Non-zero on success
  */
 static int
-mysql_send_eof(DCB *dcb, int seqno)
+mysql_send_eof(RESULT_ENCODER *encoder, int seqno)
 {
-    GWBUF   *pkt;
     uint8_t *ptr;
 
-    if ((pkt = gwbuf_alloc(9)) == NULL)
+    if ((ptr = resultset_reserve(encoder, 9)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     *ptr++ = 0x05;
     *ptr++ = 0x00;
     *ptr++ = 0x00;
@@ -383,7 +476,7 @@ mysql_send_eof(DCB *dcb, int seqno)
     *ptr++ = 0x00;
     *ptr++ = 0x02;                          // Autocommit enabled
     *ptr++ = 0x00;
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 
@@ -391,15 +484,14 @@ mysql_send_eof(DCB *dcb, int seqno)
 /**
  * Send a row packet in a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param encoder       Encoder of the client connection
  * @param row           The row to send
  * @param seqno         The sequence number of the EOF packet
  * @return              Non-zero on success
  */
 static int
-mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
+mysql_send_row(RESULT_ENCODER *encoder, RESULT_ROW *row, int seqno)
 {
-    GWBUF *pkt;
     int i, len = 4;
     uint8_t *ptr;
 
@@ -412,11 +504,10 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         len++;
     }
 
-    if ((pkt = gwbuf_alloc(len)) == NULL)
+    if ((ptr = resultset_reserve(encoder, len)) == NULL)
     {
         return 0;
     }
-    ptr = GWBUF_DATA(pkt);
     len -= 4;
     *ptr++ = len & 0xff;
     *ptr++ = (len >> 8) & 0xff;
@@ -437,7 +528,7 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         }
     }
 
-    return dcb->func.write(dcb, pkt);
+    return 1;
 }
 
 /**
@@ -21,12 +21,28 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #include <mysql_client_server_protocol.h>
 #include <gwdirs.h>
 #include <random_jkiss.h>
+#include <spinlock.h>
 
 #include "gw.h"
 
+/**
+ * The secrets file and the AES key schedule derived from it are read
+ * once and cached for the lifetime of the process. Before the cache was
+ * added every decryptPassword call opened and read the .secrets file
+ * and ran AES_set_decrypt_key, a cost paid per monitor poll and per
+ * backend user fetch, which adds up during the reconnect storm that
+ * follows a failover. The cached key material is locked into memory so
+ * that it is never written to swap.
+ */
+static MAXKEYS *secrets_cached_keys = NULL;
+static AES_KEY secrets_decrypt_schedule;
+static int secrets_cache_loaded = 0;
+static SPINLOCK secrets_cache_lock = SPINLOCK_INIT;
+
 /**
  * Generate a random printable character
  *
@@ -317,6 +333,49 @@ int secrets_writeKeys(const char *path)
     return 0;
 }
 
+/**
+ * Fetch the cached secrets keys, reading the .secrets file and setting
+ * up the AES decryption key schedule on the first call.
+ *
+ * The result of the first read is cached even when no .secrets file
+ * exists, so installing one into a running MaxScale requires a restart,
+ * as does replacing the keys; both were already true in practice since
+ * passwords encrypted with new keys cannot be decrypted with old ones.
+ * The key material and the derived schedule are locked into memory with
+ * mlock so they cannot be paged out to swap; failure to lock is logged
+ * but not fatal.
+ *
+ * @return The keys structure or NULL if no secrets file is available
+ */
+static MAXKEYS *
+secrets_cached_readKeys()
+{
+    spinlock_acquire(&secrets_cache_lock);
+    if (!secrets_cache_loaded)
+    {
+        secrets_cache_loaded = 1;
+        if ((secrets_cached_keys = secrets_readKeys(NULL)) != NULL)
+        {
+            AES_set_decrypt_key(secrets_cached_keys->enckey,
+                                8 * MAXSCALE_KEYLEN,
+                                &secrets_decrypt_schedule);
+            if (mlock(secrets_cached_keys, sizeof(MAXKEYS)) != 0 ||
+                mlock(&secrets_decrypt_schedule,
+                      sizeof(secrets_decrypt_schedule)) != 0)
+            {
+                char errbuf[STRERROR_BUFLEN];
+                MXS_WARNING("Failed to lock the encryption key cache "
+                            "into memory, the key material may be "
+                            "written to swap. Error %d, %s.",
+                            errno,
+                            strerror_r(errno, errbuf, sizeof(errbuf)));
+            }
+        }
+    }
+    spinlock_release(&secrets_cache_lock);
+    return secrets_cached_keys;
+}
+
 /**
  * Decrypt a password that is stored inthe MaxScale configuration file.
  * If the password is not encrypted, ie is not a HEX string, then the
@@ -332,13 +391,13 @@ char *
 decryptPassword(const char *crypt)
 {
     MAXKEYS *keys;
-    AES_KEY aeskey;
     unsigned char *plain;
     const char *ptr;
     unsigned char encrypted[80];
+    unsigned char initvector[MAXSCALE_IV_LEN];
     int enlen;
 
-    keys = secrets_readKeys(NULL);
+    keys = secrets_cached_readKeys();
     if (!keys)
     {
         return strdup(crypt);
@@ -351,7 +410,6 @@ decryptPassword(const char *crypt)
     {
         if (!isxdigit(*ptr))
         {
-            free(keys);
             return strdup(crypt);
         }
     }
@@ -361,14 +419,14 @@ decryptPassword(const char *crypt)
 
     if ((plain = (unsigned char *) malloc(80)) == NULL)
     {
-        free(keys);
         return NULL;
     }
 
-    AES_set_decrypt_key(keys->enckey, 8 * MAXSCALE_KEYLEN, &aeskey);
-
-    AES_cbc_encrypt(encrypted, plain, enlen, &aeskey, keys->initvector, AES_DECRYPT);
-    free(keys);
+    /* AES_cbc_encrypt advances the init vector it is given, so the
+     * cached one is copied for each decryption. */
+    memcpy(initvector, keys->initvector, sizeof(initvector));
+    AES_cbc_encrypt(encrypted, plain, enlen, &secrets_decrypt_schedule,
+                    initvector, AES_DECRYPT);
 
     return(char *) plain;
 }
@@ -34,6 +34,15 @@
  * 30/10/14     Massimiliano Pinto      Addition of SERVER_MASTER_STICKINESS description
  * 01/06/15     Massimiliano Pinto      Addition of server_update_address/port
  * 19/06/15     Martin Brampton         Extra code for persistent connections
+ * 28/06/16     Martin Brampton         Publication of server status transitions
+ * 29/06/16     Mark Riddoch            Response time histogram per server
+ * 03/07/16     Mark Riddoch            Interpolated replication lag readings
+ * 03/07/16     Mark Riddoch            Atomically published status snapshots
+ * 03/07/16     Mark Riddoch            In place update of server parameters
+ *                                      on configuration reload
+ * 03/07/16     Mark Riddoch            Server statistics published in the
+ *                                      statistics export segment
+ * 03/07/16     Mark Riddoch            Added the max_inflight operation limit
  *
  * @endverbatim
  */
@@ -45,14 +54,27 @@
 #include <spinlock.h>
 #include <dcb.h>
 #include <maxscale/poll.h>
+#include <shmstats.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 static SPINLOCK server_spin = SPINLOCK_INIT;
 static SERVER *allServers = NULL;
 
+/** Subscribers to server status transitions */
+typedef struct
+{
+    SERVER_STATUS_CB cb;       /*< Callback to invoke on a status transition */
+    void             *userdata;/*< Opaque context passed back to the callback */
+} STATUS_SUBSCRIBER;
+
+static SPINLOCK subscriber_spin = SPINLOCK_INIT;
+static STATUS_SUBSCRIBER status_subscribers[SERVER_STATUS_SUBSCRIBER_MAX];
+static int n_status_subscribers = 0;
+
 static void spin_reporter(void *, char *, int);
 static void server_parameter_free(SERVER_PARAM *tofree);
+static void server_status_publish(SERVER *server, unsigned int old_status);
 
 /**
  * Allocate a new server withn the gateway
@@ -69,6 +91,7 @@ server_alloc(char *servname, char *protocol, unsigned short port)
 {
     SERVER *server;
 
+    spinlock_register(&server_spin, "Server list");
     if ((server = (SERVER *)calloc(1, sizeof(SERVER))) == NULL)
     {
         return NULL;
@@ -81,18 +104,22 @@ server_alloc(char *servname, char *protocol, unsigned short port)
     server->protocol = strdup(protocol);
     server->port = port;
     server->status = SERVER_RUNNING;
+    server->status_gen = 0;
     server->node_id = -1;
     server->rlag = -2;
+    server->rlag_rate = 0.0;
     server->master_id = -1;
     server->depth = -1;
     server->slaves = NULL;
     server->parameters = NULL;
     server->server_string = NULL;
+    server->stats.response_time = histogram_alloc();
     spinlock_init(&server->lock);
     server->persistent = NULL;
     server->persistmax = 0;
     server->persistmaxtime = 0;
     server->persistpoolmax = 0;
+    server->max_inflight = 0;
     spinlock_init(&server->persistlock);
 
     spinlock_acquire(&server_spin);
@@ -141,6 +168,7 @@ server_free(SERVER *tofreeserver)
     free(tofreeserver->unique_name);
     free(tofreeserver->server_string);
     free(tofreeserver->slaves);
+    histogram_free(tofreeserver->stats.response_time);
     server_parameter_free(tofreeserver->parameters);
 
     if (tofreeserver->persistent)
@@ -157,9 +185,10 @@ server_free(SERVER *tofreeserver)
  * @param       server      The server to set the name on
  * @param       user        The name of the user needing the connection
  * @param       protocol    The name of the protocol needed for the connection
+ * @param       service     The service the connection will be used by
  */
 DCB *
-server_get_persistent(SERVER *server, char *user, const char *protocol)
+server_get_persistent(SERVER *server, char *user, const char *protocol, const struct service *service)
 {
     DCB *dcb, *previous = NULL;
 
@@ -176,6 +205,7 @@ server_get_persistent(SERVER *server, char *user, const char *protocol)
                 && dcb->protoname
                 && !dcb-> dcb_errhandle_called
                 && !(dcb->flags & DCBF_HUNG)
+                && dcb->service == service
                 && 0 == strcmp(dcb->user, user)
                 && 0 == strcmp(dcb->protoname, protocol))
             {
@@ -576,6 +606,14 @@ dprintServer(DCB *dcb, SERVER *server)
     dcb_printf(dcb, "\tCurrent no. of conns:                %d\n",
                server->stats.n_current);
     dcb_printf(dcb, "\tCurrent no. of operations:   %d\n", server->stats.n_current_ops);
+    if (server->max_inflight)
+    {
+        dcb_printf(dcb, "\tMax in-flight operations:    %ld\n", server->max_inflight);
+    }
+    if (server->stats.response_time)
+    {
+        dprintHistogram(dcb, server->stats.response_time);
+    }
     if (server->persistpoolmax)
     {
         dcb_printf(dcb, "\tPersistent pool size:            %d\n",
@@ -730,6 +768,99 @@ server_status(SERVER *server)
     return status;
 }
 
+/**
+ * Subscribe to server status transitions
+ *
+ * The callback is invoked from the thread that changes the status, typically
+ * a monitor thread, whenever the status bits of any server actually change.
+ * Callbacks should do no more than note the change and return; any heavier
+ * work belongs in the subscriber's own context.
+ *
+ * @param cb            The callback to invoke on status transitions
+ * @param userdata      Opaque context passed back to the callback
+ * @return              0 on success, -1 if the subscriber table is full
+ */
+int
+server_status_subscribe(SERVER_STATUS_CB cb, void *userdata)
+{
+    int rval = -1;
+
+    spinlock_acquire(&subscriber_spin);
+    if (n_status_subscribers < SERVER_STATUS_SUBSCRIBER_MAX)
+    {
+        status_subscribers[n_status_subscribers].cb = cb;
+        status_subscribers[n_status_subscribers].userdata = userdata;
+        n_status_subscribers++;
+        rval = 0;
+    }
+    spinlock_release(&subscriber_spin);
+
+    if (rval != 0)
+    {
+        MXS_ERROR("Too many server status subscribers, limit is %d.",
+                  SERVER_STATUS_SUBSCRIBER_MAX);
+    }
+    return rval;
+}
+
+/**
+ * Remove a previously registered server status subscription
+ *
+ * @param cb            The callback given to server_status_subscribe
+ * @param userdata      The context given to server_status_subscribe
+ */
+void
+server_status_unsubscribe(SERVER_STATUS_CB cb, void *userdata)
+{
+    int i;
+
+    spinlock_acquire(&subscriber_spin);
+    for (i = 0; i < n_status_subscribers; i++)
+    {
+        if (status_subscribers[i].cb == cb &&
+            status_subscribers[i].userdata == userdata)
+        {
+            n_status_subscribers--;
+            status_subscribers[i] = status_subscribers[n_status_subscribers];
+            break;
+        }
+    }
+    spinlock_release(&subscriber_spin);
+}
+
+/**
+ * Notify the subscribers of a server status transition
+ *
+ * The subscriber table is copied under the lock and the callbacks are invoked
+ * outside it so that a callback may itself subscribe or unsubscribe.
+ *
+ * @param server        The server whose status changed
+ * @param old_status    The status bits before the change
+ */
+static void
+server_status_publish(SERVER *server, unsigned int old_status)
+{
+    STATUS_SUBSCRIBER local[SERVER_STATUS_SUBSCRIBER_MAX];
+    unsigned int new_status = server->status;
+    int n;
+    int i;
+
+    if (old_status == new_status)
+    {
+        return;
+    }
+
+    spinlock_acquire(&subscriber_spin);
+    n = n_status_subscribers;
+    memcpy(local, status_subscribers, n * sizeof(STATUS_SUBSCRIBER));
+    spinlock_release(&subscriber_spin);
+
+    for (i = 0; i < n; i++)
+    {
+        local[i].cb(server, old_status, new_status, local[i].userdata);
+    }
+}
+
 /**
  * Set a status bit in the server
  *
@@ -739,13 +870,21 @@ server_status(SERVER *server)
 void
 server_set_status(SERVER *server, int bit)
 {
-    server->status |= bit;
+    unsigned int old_status = server->status;
+    unsigned int new_status = old_status | bit;
+
+    if (new_status != old_status)
+    {
+        server->status = new_status;
+        atomic_add(&server->status_gen, 1);
+    }
 
     /** clear error logged flag before the next failure */
     if (SERVER_IS_MASTER(server))
     {
         server->master_err_is_logged = false;
     }
+    server_status_publish(server, old_status);
 }
 
 /**
@@ -758,6 +897,8 @@ server_set_status(SERVER *server, int bit)
 void
 server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
 {
+    unsigned int old_status = server->status;
+
     /** clear error logged flag before the next failure */
     if ((bits_to_set & SERVER_MASTER) && ((server->status & SERVER_MASTER) == 0))
     {
@@ -767,7 +908,9 @@ server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
     if ((server->status & specified_bits) != bits_to_set)
     {
         server->status = (server->status & ~specified_bits) | bits_to_set;
+        atomic_add(&server->status_gen, 1);
     }
+    server_status_publish(server, old_status);
 }
 
 /**
@@ -779,7 +922,15 @@ server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
 void
 server_clear_status(SERVER *server, int bit)
 {
-    server->status &= ~bit;
+    unsigned int old_status = server->status;
+    unsigned int new_status = old_status & ~bit;
+
+    if (new_status != old_status)
+    {
+        server->status = new_status;
+        atomic_add(&server->status_gen, 1);
+    }
+    server_status_publish(server, old_status);
 }
 
 /**
@@ -791,7 +942,15 @@ server_clear_status(SERVER *server, int bit)
 void
 server_transfer_status(SERVER *dest_server, SERVER *source_server)
 {
-    dest_server->status = source_server->status;
+    unsigned int old_status = dest_server->status;
+    unsigned int new_status = source_server->status;
+
+    if (new_status != old_status)
+    {
+        dest_server->status = new_status;
+        atomic_add(&dest_server->status_gen, 1);
+    }
+    server_status_publish(dest_server, old_status);
 }
 
 /**
@@ -825,7 +984,7 @@ serverAddMonUser(SERVER *server, char *user, char *passwd)
 void
 server_update(SERVER *server, char *protocol, char *user, char *passwd)
 {
-    if (!strcmp(server->protocol, protocol))
+    if (protocol != NULL && strcmp(server->protocol, protocol) != 0)
     {
         MXS_NOTICE("Update server protocol for server %s to protocol %s.",
                    server->name,
@@ -836,8 +995,9 @@ server_update(SERVER *server, char *protocol, char *user, char *passwd)
 
     if (user != NULL && passwd != NULL)
     {
-        if (strcmp(server->monuser, user) == 0 ||
-            strcmp(server->monpw, passwd) == 0)
+        if (server->monuser == NULL || server->monpw == NULL ||
+            strcmp(server->monuser, user) != 0 ||
+            strcmp(server->monpw, passwd) != 0)
         {
             MXS_NOTICE("Update server monitor credentials for server %s",
                        server->name);
@@ -884,6 +1044,49 @@ serverAddParameter(SERVER *server, char *name, char *value)
     server->parameters = param;
 }
 
+/**
+ * Update a server parameter, adding it if it is not yet present.
+ *
+ * The parameter value is replaced with a single pointer store so that
+ * routing threads that are reading the parameters see either the old
+ * or the new value; a reload of the configuration does not disturb
+ * the connections that are currently using the server.
+ *
+ * @param       server  The server to update
+ * @param       name    The parameter name
+ * @param       value   The new parameter value
+ */
+void
+server_update_parameter(SERVER *server, char *name, char *value)
+{
+    SERVER_PARAM    *param = server->parameters;
+    char            *oldval, *newval;
+
+    while (param)
+    {
+        if (strcmp(param->name, name) == 0)
+        {
+            if (strcmp(param->value, value) != 0)
+            {
+                if ((newval = strdup(value)) == NULL)
+                {
+                    return;
+                }
+                MXS_NOTICE("Update server parameter %s of server %s to %s.",
+                           name,
+                           server->name,
+                           value);
+                oldval = param->value;
+                param->value = newval;
+                free(oldval);
+            }
+            return;
+        }
+        param = param->next;
+    }
+    serverAddParameter(server, name, value);
+}
+
 /**
  * Free a list of server parameters
  * @param tofree Parameter list to free
@@ -902,6 +1105,45 @@ static void server_parameter_free(SERVER_PARAM *tofree)
     }
 }
 
+/**
+ * Fill the server slots of the statistics export segment
+ *
+ * Called by the housekeeper task of the statistics export, see
+ * shmstats.c, with the generation count of the segment already marking
+ * a refresh in progress.
+ *
+ * @param       slots   The array of slots to fill
+ * @param       nslots  The number of slots available
+ * @return      The number of slots filled
+ */
+int
+server_fill_shmstats(SHMSTATS_SERVER *slots, int nslots)
+{
+    SERVER  *server;
+    int     n = 0;
+
+    spinlock_acquire(&server_spin);
+    server = allServers;
+    while (server && n < nslots)
+    {
+        SHMSTATS_SERVER *slot = &slots[n];
+        char *name = server->unique_name ? server->unique_name : server->name;
+
+        snprintf(slot->name, SHMSTATS_NAME_LEN, "%s", name);
+        slot->status = server->status;
+        slot->n_connections = server->stats.n_connections;
+        slot->n_current = server->stats.n_current;
+        slot->n_current_ops = server->stats.n_current_ops;
+        slot->n_persistent = server->stats.n_persistent;
+        slot->rlag = server->rlag;
+        n++;
+        server = server->next;
+    }
+    spinlock_release(&server_spin);
+
+    return n;
+}
+
 /**
  * Retrieve a parameter value from a server
  *
@@ -1095,3 +1337,80 @@ bool server_set_version_string(SERVER* server, const char* string)
     spinlock_release(&server->lock);
     return rval;
 }
+
+/**
+ * Return the replication lag of the server interpolated to the current
+ * time.
+ *
+ * The monitors sample the lag once per cycle; between samples the lag is
+ * extrapolated using the rate at which it changed between the last two
+ * samples, so that a slave observed to be catching up is not shunned on
+ * the basis of a stale whole-cycle reading. The extrapolation is bounded
+ * so that a stalled monitor does not project the lag without limit.
+ *
+ * @param server        The server to return the lag of
+ * @return The interpolated lag in seconds, or the raw rlag value when
+ *         no interpolation is possible
+ */
+int
+server_interpolated_rlag(SERVER *server)
+{
+    double rlag;
+    time_t elapsed;
+
+    if (server->rlag < 0 || server->node_ts == 0 || server->rlag_rate == 0.0)
+    {
+        return server->rlag;
+    }
+    elapsed = time(NULL) - (time_t)server->node_ts;
+    if (elapsed < 0)
+    {
+        elapsed = 0;
+    }
+    else if (elapsed > SERVER_RLAG_MAX_INTERPOLATION)
+    {
+        elapsed = SERVER_RLAG_MAX_INTERPOLATION;
+    }
+    rlag = server->rlag + server->rlag_rate * (double)elapsed;
+    if (rlag < 0.0)
+    {
+        rlag = 0.0;
+    }
+    return (int)rlag;
+}
+
+/**
+ * Take a consistent snapshot of the status word of a server.
+ *
+ * The monitor threads publish a changed status word with a single store,
+ * so one load yields a consistent set of status bits; the routers should
+ * take one snapshot per routing decision rather than reading the status
+ * bit by bit while it may be changing under them. The generation counter,
+ * returned when generation is not NULL, changes whenever the word does,
+ * so a decision made against an earlier snapshot can be revalidated
+ * without comparing the status bits themselves.
+ *
+ * @param server        The server to read
+ * @param generation    Where to return the generation of the snapshot,
+ *                      or NULL if it is not wanted
+ * @return The status word of the server
+ */
+unsigned int
+server_status_snapshot(SERVER *server, int *generation)
+{
+    int gen;
+    unsigned int status;
+
+    do
+    {
+        gen = server->status_gen;
+        status = server->status;
+    }
+    while (gen != server->status_gen);
+
+    if (generation)
+    {
+        *generation = gen;
+    }
+    return status;
+}
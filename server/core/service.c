@@ -38,6 +38,31 @@
  * 18/02/15     Mark Riddoch            Added result set management
  * 03/03/15     Massimiliano Pinto      Added config_enable_feedback_task() call in serviceStartAll
  * 19/06/15     Martin Brampton         More meaningful names for temp variables
+ * 28/06/16     Mark Riddoch            Services are started concurrently in
+ *                                      worker threads
+ * 29/06/16     Mark Riddoch            Latency histogram added to the service
+ *                                      statistics
+ * 01/07/16     Mark Riddoch            Router modules are resolved lazily when
+ *                                      the service is first started
+ * 03/07/16     Mark Riddoch            Generation counter on the server list
+ * 03/07/16     Mark Riddoch            Per service read batch limit
+ * 03/07/16     Mark Riddoch            Per service polling thread group
+ * 03/07/16     Mark Riddoch            Service statistics published in the
+ *                                      statistics export segment
+ * 03/07/16     Mark Riddoch            Filter list replacement protected by
+ *                                      epoch based reclamation
+ * 03/07/16     Mark Riddoch            Users cache file loaded before the
+ *                                      backend is contacted so that clients
+ *                                      can authenticate immediately; the
+ *                                      cache is reconciled in the background
+ * 05/07/16     Mark Riddoch            Listeners sharded with SO_REUSEPORT
+ *                                      across the polling threads
+ * 05/07/16     Mark Riddoch            Token bucket query rate limiting per
+ *                                      client of a service
+ * 05/07/16     Mark Riddoch            Session counters aggregated into a
+ *                                      seqlock protected block by a
+ *                                      housekeeper task so that diagnostic
+ *                                      readers need no locks
 
  * @endverbatim
  */
@@ -64,9 +89,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <housekeeper.h>
+#include <thread.h>
+#include <mysql.h>
 #include <resultset.h>
 #include <gw.h>
 #include <gwdirs.h>
+#include <shmstats.h>
+#include <rcu.h>
+#include <digestdict.h>
 #include <math.h>
 #include <version.h>
 
@@ -94,11 +124,16 @@ typelib_t sqlvar_target_type =
 static SPINLOCK service_spin = SPINLOCK_INIT;
 static SERVICE  *allServices = NULL;
 
+/** Seconds between refreshes of the aggregated session counters */
+#define SERVICE_STATS_FREQ 1
+
 static int find_type(typelib_t* tl, const char* needle, int maxlen);
 
 static void service_add_qualified_param(SERVICE*          svc,
                                         CONFIG_PARAMETER* param);
 static void service_internal_restart(void *data);
+static void serviceShardListener(SERVICE *service, SERV_LISTENER *port);
+static void service_stats_task(void *data);
 
 /**
  * Allocate a new service for the gateway to support
@@ -114,28 +149,18 @@ service_alloc(const char *servname, const char *router)
 {
     SERVICE *service;
 
+    spinlock_register(&service_spin, "Service list");
     if ((service = (SERVICE *)calloc(1, sizeof(SERVICE))) == NULL)
     {
         return NULL;
     }
-    if ((service->router = load_module(router, MODULE_ROUTER)) == NULL)
-    {
-        char* home = get_libdir();
-        char* ldpath = getenv("LD_LIBRARY_PATH");
-
-        MXS_ERROR("Unable to load %s module \"%s\".\n\t\t\t"
-                  "      Ensure that lib%s.so exists in one of the "
-                  "following directories :\n\t\t\t      "
-                  "- %s\n%s%s",
-                  MODULE_ROUTER,
-                  router,
-                  router,
-                  home,
-                  ldpath?"\t\t\t      - ":"",
-                  ldpath?ldpath:"");
-        free(service);
-        return NULL;
-    }
+    /*
+     * The router module is not loaded here; it is resolved lazily in
+     * serviceStart, so that configuration processing does not wait for
+     * every module to be read from disk and the loads happen in the
+     * concurrent service start phase.
+     */
+    service->router = NULL;
     service->name = strdup(servname);
     service->routerModule = strdup(router);
     service->users_from_all = false;
@@ -143,6 +168,16 @@ service_alloc(const char *servname, const char *router)
     service->localhost_match_wildcard_host = SERVICE_PARAM_UNINIT;
     service->retry_start = true;
     service->conn_idle_timeout = SERVICE_NO_SESSION_TIMEOUT;
+    service->query_timeout = 0;
+    service->digest_dict = NULL;
+    service->conn_pool_max = 0;
+    service->read_batch_limit = SERVICE_DEFAULT_READ_BATCH;
+    service->qps_limit = 0;
+    service->qps_burst = 0;
+    service->qps_buckets = NULL;
+    spinlock_init(&service->qps_lock);
+    service->thread_group_first = -1;
+    service->thread_group_last = -1;
     service->weightby = NULL;
     service->credentials.authdata = NULL;
     service->credentials.name = NULL;
@@ -162,11 +197,28 @@ service_alloc(const char *servname, const char *router)
     }
     service->stats.started = time(0);
     service->stats.n_failed_starts = 0;
+    if ((service->stats.n_sessions = stats_counter_alloc()) == NULL ||
+        (service->stats.n_current = stats_counter_alloc()) == NULL ||
+        (service->stats.latency = histogram_alloc()) == NULL)
+    {
+        stats_counter_free(service->stats.n_sessions);
+        stats_counter_free(service->stats.n_current);
+        free(service->name);
+        free(service->routerModule);
+        free(service);
+        return NULL;
+    }
     service->state = SERVICE_STATE_ALLOC;
     spinlock_init(&service->spin);
     spinlock_init(&service->users_table_spin);
 
     spinlock_acquire(&service_spin);
+    if (allServices == NULL)
+    {
+        /** First service; start refreshing the aggregated counters */
+        hktask_add("service_stats", service_stats_task, NULL,
+                   SERVICE_STATS_FREQ);
+    }
     service->next = allServices;
     allServices = service;
     spinlock_release(&service_spin);
@@ -174,6 +226,71 @@ service_alloc(const char *servname, const char *router)
     return service;
 }
 
+/**
+ * The housekeeper task that refreshes the aggregated session counters
+ * of every service.
+ *
+ * The aggregate block of a service is protected by a sequence count:
+ * it is incremented to an odd value before the sums are written and to
+ * an even one afterwards, with full barriers between, so a reader that
+ * sees the same even count on both sides of its reads has a consistent
+ * pair of values. This task is the only writer of the blocks.
+ *
+ * @param data  Unused
+ */
+static void
+service_stats_task(void *data)
+{
+    SERVICE *service;
+
+    spinlock_acquire(&service_spin);
+    for (service = allServices; service; service = service->next)
+    {
+        service->stats.agg.seq++;
+        __sync_synchronize();
+        service->stats.agg.n_sessions =
+            stats_counter_sum(service->stats.n_sessions);
+        service->stats.agg.n_current =
+            stats_counter_sum(service->stats.n_current);
+        __sync_synchronize();
+        service->stats.agg.seq++;
+    }
+    spinlock_release(&service_spin);
+}
+
+/**
+ * Read a consistent snapshot of the aggregated session counters of a
+ * service.
+ *
+ * The read takes no locks: it retries while the housekeeper task is
+ * mid-update or has run between the reads, which it does for only a
+ * few instructions once a second, so the retry loop is all but never
+ * taken. The values lag the per-thread counter slots by up to the
+ * refresh interval of the task.
+ *
+ * @param service       The service to read the counters of
+ * @param n_sessions    Returns the total number of sessions
+ * @param n_current     Returns the current number of sessions
+ */
+void
+service_stats_read(SERVICE *service, int *n_sessions, int *n_current)
+{
+    unsigned int seq;
+
+    do
+    {
+        while ((seq = service->stats.agg.seq) & 1)
+        {
+            ;
+        }
+        __sync_synchronize();
+        *n_sessions = service->stats.agg.n_sessions;
+        *n_current = service->stats.agg.n_current;
+        __sync_synchronize();
+    }
+    while (service->stats.agg.seq != seq);
+}
+
 /**
  * Check to see if a service pointer is valid
  *
@@ -208,6 +325,159 @@ service_isvalid(SERVICE *service)
  * @param port          The port to start
  * @return              The number of listeners started
  */
+/** Seconds between retries of the asynchronous reconciliation of cached
+ * user data with the backend */
+#define USERS_RECONCILE_RETRY   10
+
+/**
+ * Build the pathname of the file in which the authentication data of a
+ * service is cached between runs.
+ *
+ * @param service       The service
+ * @param path          Buffer for the pathname
+ * @param size          Size of the buffer
+ */
+static void
+service_users_cache_path(SERVICE *service, char *path, int size)
+{
+    strncpy(path, get_cachedir(), size - 1);
+    path[size - 1] = '\0';
+    strncat(path, "/", size - 1);
+    strncat(path, service->name, size - 1);
+    strncat(path, "/.cache/dbusers", size - 1);
+}
+
+/**
+ * Load the authentication data of a service from the cache file written
+ * on a previous run.
+ *
+ * @param service       The service to populate
+ * @return              The number of users loaded or -1 if no usable
+ *                      cache file exists
+ */
+static int
+service_load_users_cache(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+
+    service_users_cache_path(service, path, sizeof(path));
+    return dbusers_load(service->users, path);
+}
+
+/**
+ * Save the authentication data of a service to its cache file, creating
+ * the cache directory hierarchy as needed.
+ *
+ * @param service       The service to save
+ */
+static void
+service_save_users_cache(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+    int mkdir_rval = 0;
+
+    strncpy(path, get_cachedir(), PATH_MAX);
+    path[PATH_MAX] = '\0';
+    strncat(path, "/", PATH_MAX);
+    strncat(path, service->name, PATH_MAX);
+    if (access(path, R_OK) == -1)
+    {
+        mkdir_rval = mkdir(path, 0777);
+    }
+
+    if (mkdir_rval)
+    {
+        if (errno != EEXIST)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                      path,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+        mkdir_rval = 0;
+    }
+
+    strncat(path, "/.cache", PATH_MAX);
+    if (access(path, R_OK) == -1)
+    {
+        mkdir_rval = mkdir(path, 0777);
+    }
+
+    if (mkdir_rval)
+    {
+        if (errno != EEXIST)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                      path,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+        mkdir_rval = 0;
+    }
+    strncat(path, "/dbusers", PATH_MAX);
+    dbusers_save(service->users, path);
+}
+
+/**
+ * Housekeeper task that reconciles cached authentication data with the
+ * backend.
+ *
+ * A service whose listener was started from the users cache file serves
+ * clients with the credentials of the previous run until this task has
+ * fetched the current ones. replace_mysql_users() swaps the user table
+ * only when the fetched data differs from the cached data, so a cache
+ * that is still current costs nothing beyond the fetch. If the backend
+ * cannot be reached the task re-arms itself; the cached data remains in
+ * use in the meantime.
+ *
+ * @param data  The service to reconcile
+ */
+static void
+service_users_reconcile(void *data)
+{
+    SERVICE *service = (SERVICE *)data;
+    bool retry = false;
+
+    if (spinlock_acquire_nowait(&service->users_table_spin))
+    {
+        if (replace_mysql_users(service) < 0)
+        {
+            retry = true;
+        }
+        else
+        {
+            service_save_users_cache(service);
+            MXS_NOTICE("%s: Cached user credentials reconciled with "
+                       "the backend.",
+                       service->name);
+        }
+        spinlock_release(&service->users_table_spin);
+    }
+    else
+    {
+        retry = true;
+    }
+
+    if (retry)
+    {
+        char taskname[strlen(service->name) + 64];
+
+        MXS_WARNING("%s: Reconciliation of cached users with the backend "
+                    "failed, retrying in %d seconds.",
+                    service->name,
+                    USERS_RECONCILE_RETRY);
+        /* The name carries a timestamp as the housekeeper refuses to
+         * add a task with the name of one that is still listed, which
+         * includes the currently executing one. */
+        snprintf(taskname, sizeof(taskname), "%s_users_reconcile_%ld",
+                 service->name, (long)time(NULL));
+        hktask_oneshot(taskname, service_users_reconcile, service,
+                       USERS_RECONCILE_RETRY);
+    }
+}
+
 static int
 serviceStartPort(SERVICE *service, SERV_LISTENER *port)
 {
@@ -242,7 +512,30 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
              */
             service->users = mysql_users_alloc();
 
-            if ((loaded = load_mysql_users(service)) < 0)
+            /*
+             * Load the authentication data saved by the previous run
+             * before the backend is contacted: the cache file is read in
+             * milliseconds whereas the first fetch from the backend can
+             * take seconds when the master is slow, and clients cannot
+             * authenticate until the table is populated. When the cache
+             * is usable the listener starts serving at once and a
+             * housekeeper task fetches the current data from the backend
+             * and reconciles the table in the background.
+             */
+            if ((loaded = service_load_users_cache(service)) >= 0)
+            {
+                char taskname[strlen(service->name) + 64];
+
+                MXS_NOTICE("%s: Using cached credential information "
+                           "until the backend has been contacted.",
+                           service->name);
+                snprintf(taskname, sizeof(taskname),
+                         "%s_users_reconcile_%ld",
+                         service->name, (long)time(NULL));
+                hktask_oneshot(taskname, service_users_reconcile,
+                               service, 1);
+            }
+            else if ((loaded = load_mysql_users(service)) < 0)
             {
                 MXS_ERROR("Unable to load users for "
                           "service %s listening at %s:%d.",
@@ -250,74 +543,16 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
                           (port->address == NULL ? "0.0.0.0" : port->address),
                           port->port);
 
-                {
-                    /* Try loading authentication data from file cache */
-                    char *ptr, path[PATH_MAX + 1];
-                    strncpy(path, get_cachedir(), sizeof(path) - 1);
-                    strncat(path, "/", sizeof(path) - 1);
-                    strncat(path, service->name, sizeof(path) - 1);
-                    strncat(path, "/.cache/dbusers", sizeof(path) - 1);
-                    loaded = dbusers_load(service->users, path);
-                    if (loaded != -1)
-                    {
-                        MXS_ERROR("Using cached credential information.");
-                    }
-                }
-                if (loaded == -1)
-                {
-                    users_free(service->users);
-                    service->users = NULL;
-                    dcb_close(port->listener);
-                    port->listener = NULL;
-                    goto retblock;
-                }
+                users_free(service->users);
+                service->users = NULL;
+                dcb_close(port->listener);
+                port->listener = NULL;
+                goto retblock;
             }
             else
             {
                 /* Save authentication data to file cache */
-                char *ptr, path[PATH_MAX + 1];
-                int mkdir_rval = 0;
-                strncpy(path, get_cachedir(), PATH_MAX);
-                strncat(path, "/", 4096);
-                strncat(path, service->name, PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-
-                strncat(path, "/.cache", PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-                strncat(path, "/dbusers", PATH_MAX);
-                dbusers_save(service->users, path);
+                service_save_users_cache(service);
             }
             if (loaded == 0)
             {
@@ -378,6 +613,7 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
         {
             port->listener->session->state = SESSION_STATE_LISTENER;
             listeners += 1;
+            serviceShardListener(service, port);
         }
         else
         {
@@ -408,6 +644,113 @@ retblock:
     return listeners;
 }
 
+/**
+ * Create the SO_REUSEPORT listener shards of a started port.
+ *
+ * With thread local polling every listener DCB is pinned to thread 0, so
+ * a connection storm is accepted, authenticated and assigned to threads
+ * by a single polling thread while the others sit idle. When the protocol
+ * module bound its socket with SO_REUSEPORT set, additional sockets can
+ * be bound to the same address and the kernel balances incoming
+ * connections between their accept queues. This routine creates one such
+ * socket for every polling thread beyond the first, wraps each in its
+ * own listener DCB pinned to that thread and stores them in the
+ * SERV_LISTENER so that serviceStop and serviceRestart can manage them
+ * alongside the primary listener.
+ *
+ * The address to bind is recovered from the primary socket with
+ * getsockname, so the routine works for every protocol module without
+ * knowing how the module parsed its bind configuration. UNIX domain
+ * sockets are left unsharded as SO_REUSEPORT does not balance them.
+ * Failure to create a shard is logged and the remaining threads simply
+ * share the sockets that were created; the service still listens.
+ *
+ * @param service       The service being started
+ * @param port          The port whose primary listener is running
+ */
+static void
+serviceShardListener(SERVICE *service, SERV_LISTENER *port)
+{
+#ifdef SO_REUSEPORT
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int shards = poll_listener_shards();
+    int i, so, one = 1;
+    DCB *dcb;
+
+    if (shards < 2 || port->shards != NULL)
+    {
+        return;
+    }
+    if (getsockname(port->listener->fd,
+                    (struct sockaddr *)&addr, &addrlen) != 0 ||
+        addr.ss_family == AF_UNIX)
+    {
+        return;
+    }
+    if ((port->shards = (DCB **)calloc(shards - 1, sizeof(DCB *))) == NULL)
+    {
+        return;
+    }
+    for (i = 1; i < shards; i++)
+    {
+        if ((so = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+        {
+            break;
+        }
+        setsockopt(so, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+        if (setsockopt(so, SOL_SOCKET, SO_REUSEPORT,
+                       (char *)&one, sizeof(one)) != 0 ||
+            setnonblocking(so) != 0 ||
+            bind(so, (struct sockaddr *)&addr, addrlen) < 0 ||
+            listen(so, 10 * SOMAXCONN) != 0)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to create listener shard for "
+                      "polling thread %d: %d, %s",
+                      service->name,
+                      i,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            close(so);
+            break;
+        }
+        if ((dcb = dcb_alloc(DCB_ROLE_SERVICE_LISTENER)) == NULL)
+        {
+            close(so);
+            break;
+        }
+        memcpy(&(dcb->func), &(port->listener->func), sizeof(GWPROTOCOL));
+        dcb->listen_ssl = port->listener->listen_ssl;
+        dcb->fd = so;
+        if ((dcb->session = session_alloc(service, dcb)) == NULL)
+        {
+            dcb_close(dcb);
+            break;
+        }
+        dcb->session->state = SESSION_STATE_LISTENER;
+        /* Pin the shard to its thread before adding it to the poll set,
+         * otherwise poll_add_dcb would place it on thread 0 with the
+         * primary listener. */
+        poll_pin_dcb(dcb, i);
+        if (poll_add_dcb(dcb) != 0)
+        {
+            dcb->session->state = SESSION_STATE_LISTENER_STOPPED;
+            dcb_close(dcb);
+            break;
+        }
+        port->shards[port->n_shards++] = dcb;
+    }
+    if (port->n_shards > 0)
+    {
+        MXS_NOTICE("%s: Listening with %d SO_REUSEPORT shards on port %d.",
+                   service->name,
+                   port->n_shards + 1,
+                   port->port);
+    }
+#endif
+}
+
 /**
  * Start all ports for a service.
  * serviceStartAllPorts will try to start all listeners associated with the service.
@@ -474,6 +817,30 @@ serviceStart(SERVICE *service)
 {
     int listeners = 0;
 
+    /*
+     * Resolve the router module on the first start of the service.
+     */
+    if (service->router == NULL &&
+        (service->router = load_module(service->routerModule,
+                                       MODULE_ROUTER)) == NULL)
+    {
+        char* home = get_libdir();
+        char* ldpath = getenv("LD_LIBRARY_PATH");
+
+        MXS_ERROR("Unable to load %s module \"%s\".\n\t\t\t"
+                  "      Ensure that lib%s.so exists in one of the "
+                  "following directories :\n\t\t\t      "
+                  "- %s\n%s%s",
+                  MODULE_ROUTER,
+                  service->routerModule,
+                  service->routerModule,
+                  home,
+                  ldpath?"\t\t\t      - ":"",
+                  ldpath?ldpath:"");
+        service->state = SERVICE_STATE_FAILED;
+        return 0;
+    }
+
     if (check_service_permissions(service))
     {
         if ((service->router_instance = service->router->createInstance(
@@ -521,31 +888,117 @@ serviceStartProtocol(SERVICE *service, char *protocol, int port)
 }
 
 
+/**
+ * A service start request handed to a worker thread by serviceStartAll
+ */
+typedef struct
+{
+    SERVICE *service;   /*< The service to start */
+    THREAD  thread;     /*< The worker thread starting the service */
+    int     threaded;   /*< Whether a worker thread was started */
+    int     listeners;  /*< Number of listeners the start created */
+} SERVICE_START;
+
+/**
+ * Worker thread entry point for starting a single service. The user
+ * data is fetched with the embedded library so the worker needs a
+ * thread context of its own.
+ *
+ * @param data  The service start request
+ */
+static void
+serviceStartWorker(void *data)
+{
+    SERVICE_START *start = (SERVICE_START *)data;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("%s: mysql_thread_init failed in service start thread.",
+                  start->service->name);
+        return;
+    }
+    start->listeners = serviceStart(start->service);
+    mysql_thread_end();
+}
+
 /**
  * Start all the services
  *
+ * Each service is started in a worker thread of its own. The dominant
+ * cost of starting a service is fetching its user data from a backend,
+ * so starting the services concurrently makes the startup time of the
+ * whole configuration that of the slowest service rather than the sum
+ * over all of them.
+ *
  * @return Return the number of services started
  */
 int
 serviceStartAll()
 {
     SERVICE *ptr;
-    int n = 0,i;
+    SERVICE_START *starts;
+    int n = 0, n_services = 0, i;
 
     config_enable_feedback_task();
 
-    ptr = allServices;
-    while (ptr && !ptr->svc_do_shutdown)
+    for (ptr = allServices; ptr; ptr = ptr->next)
+    {
+        n_services++;
+    }
+    if (n_services == 0)
     {
-        n += (i = serviceStart(ptr));
+        return 0;
+    }
 
-        if (i == 0)
+    if ((starts = (SERVICE_START *)calloc(n_services, sizeof(SERVICE_START))) == NULL)
+    {
+        /** Fall back to starting the services one at a time */
+        ptr = allServices;
+        while (ptr && !ptr->svc_do_shutdown)
         {
-            MXS_ERROR("Failed to start service '%s'.", ptr->name);
+            n += (i = serviceStart(ptr));
+
+            if (i == 0)
+            {
+                MXS_ERROR("Failed to start service '%s'.", ptr->name);
+            }
+
+            ptr = ptr->next;
         }
+        return n;
+    }
 
+    i = 0;
+    ptr = allServices;
+    while (ptr && !ptr->svc_do_shutdown)
+    {
+        starts[i].service = ptr;
+        if (thread_start(&starts[i].thread, serviceStartWorker, &starts[i]) != NULL)
+        {
+            starts[i].threaded = 1;
+        }
+        else
+        {
+            /** Thread creation failed; start the service in this thread */
+            starts[i].listeners = serviceStart(ptr);
+        }
+        i++;
         ptr = ptr->next;
     }
+
+    while (i-- > 0)
+    {
+        if (starts[i].threaded)
+        {
+            thread_wait(starts[i].thread);
+        }
+        n += starts[i].listeners;
+        if (starts[i].listeners == 0)
+        {
+            MXS_ERROR("Failed to start service '%s'.", starts[i].service->name);
+        }
+    }
+    free(starts);
     return n;
 }
 
@@ -574,6 +1027,16 @@ serviceStop(SERVICE *service)
                 listeners++;
             }
         }
+        for (int i = 0; i < port->n_shards; i++)
+        {
+            DCB *shard = port->shards[i];
+
+            if (shard->session->state == SESSION_STATE_LISTENER &&
+                poll_remove_dcb(shard) == 0)
+            {
+                shard->session->state = SESSION_STATE_LISTENER_STOPPED;
+            }
+        }
         port = port->next;
     }
     service->state = SERVICE_STATE_STOPPED;
@@ -606,6 +1069,16 @@ serviceRestart(SERVICE *service)
                 listeners++;
             }
         }
+        for (int i = 0; i < port->n_shards; i++)
+        {
+            DCB *shard = port->shards[i];
+
+            if (shard->session->state == SESSION_STATE_LISTENER_STOPPED &&
+                poll_add_dcb(shard) == 0)
+            {
+                shard->session->state = SESSION_STATE_LISTENER;
+            }
+        }
         port = port->next;
     }
     service->state = SERVICE_STATE_STARTED;
@@ -624,7 +1097,7 @@ service_free(SERVICE *service)
 {
     SERVICE *ptr;
     SERVER_REF *srv;
-    if (service->stats.n_current)
+    if (stats_counter_sum(service->stats.n_current))
     {
         return 0;
     }
@@ -662,6 +1135,10 @@ service_free(SERVICE *service)
     free(service->version_string);
     free(service->credentials.name);
     free(service->credentials.authdata);
+    stats_counter_free(service->stats.n_sessions);
+    stats_counter_free(service->stats.n_current);
+    histogram_free(service->stats.latency);
+    digestdict_free(service->digest_dict);
 
     free_config_parameter(service->svc_config_param);
     users_free(service->users);
@@ -744,6 +1221,7 @@ serviceAddBackend(SERVICE *service, SERVER *server)
         sref->next = service->dbref;
         sref->server = server;
         service->dbref = sref;
+        atomic_add(&service->dbref_gen, 1);
     }
     spinlock_release(&service->spin);
 }
@@ -989,6 +1467,328 @@ serviceSetTimeout(SERVICE *service, int val)
     return 1;
 }
 
+/**
+ * Sets the query timeout for the service.
+ *
+ * A query that has been in flight for longer than the timeout without
+ * any reply traffic has its session closed, tearing down the backend
+ * connections of the session and freeing the backend capacity the stuck
+ * query was holding.
+ *
+ * @param service Service to configure
+ * @param val Timeout in seconds, 0 to disable
+ * @return 1 on success, 0 when the value is invalid
+ */
+int
+serviceSetQueryTimeout(SERVICE *service, int val)
+{
+    if (val < 0)
+    {
+        return 0;
+    }
+
+    service->query_timeout = val;
+
+    return 1;
+}
+
+/**
+ * Sets the query rate limit for the service.
+ *
+ * Each client, a user and host pair, of the service is allowed the given
+ * number of queries per second, enforced with a token bucket shared by
+ * every session of the client. The burst is the capacity of the bucket,
+ * i.e. how far above the rate an idle client may briefly go; it defaults
+ * to one second worth of tokens.
+ *
+ * @param service Service to configure
+ * @param rate Queries per second allowed to each client, 0 to disable
+ * @param burst Token bucket capacity, 0 for the default
+ * @return 1 on success, 0 when the values are invalid
+ */
+int
+serviceSetRateLimit(SERVICE *service, int rate, int burst)
+{
+    if (rate < 0 || burst < 0)
+    {
+        return 0;
+    }
+
+    service->qps_limit = rate;
+    service->qps_burst = burst ? burst : rate;
+
+    if (rate > 0 && service->qps_buckets == NULL)
+    {
+        HASHTABLE *buckets;
+
+        if ((buckets = hashtable_alloc(101, simple_str_hash, strcmp)) == NULL)
+        {
+            service->qps_limit = 0;
+            return 0;
+        }
+        hashtable_memory_fns(buckets, (HASHMEMORYFN)strdup, NULL,
+                             (HASHMEMORYFN)free, (HASHMEMORYFN)free);
+        service->qps_buckets = buckets;
+    }
+
+    return 1;
+}
+
+/**
+ * Check the query rate limit of the session's client before a query is
+ * routed.
+ *
+ * The session spends tokens from its local cache without any locking and
+ * only touches the shared bucket of the client when the cache is empty,
+ * drawing SERVICE_RATE_CHUNK tokens at a time. The bucket is refilled
+ * from the wall clock, at qps_limit tokens per second up to qps_burst,
+ * whenever it is visited.
+ *
+ * @param session The session routing a query
+ * @return 1 if the query is within the rate limit, 0 if it must be
+ * rejected
+ */
+int
+service_rate_limit_check(SESSION *session)
+{
+    SERVICE *service = session->service;
+    SERVICE_RATE_BUCKET *bucket;
+    long now;
+    int chunk;
+
+    if (service->qps_limit == 0 || service->qps_buckets == NULL)
+    {
+        return 1;
+    }
+
+    if (session->rate_tokens > 0)
+    {
+        session->rate_tokens--;
+        return 1;
+    }
+
+    if ((bucket = session->rate_bucket) == NULL)
+    {
+        char key[MYSQL_USER_MAXLEN + MYSQL_HOST_MAXLEN + 2];
+
+        snprintf(key, sizeof(key), "%s@%s",
+                 session->client_dcb->user ? session->client_dcb->user : "",
+                 session->client_dcb->remote ? session->client_dcb->remote : "");
+        spinlock_acquire(&service->qps_lock);
+        if ((bucket = hashtable_fetch(service->qps_buckets, key)) == NULL)
+        {
+            if ((bucket = malloc(sizeof(SERVICE_RATE_BUCKET))) == NULL)
+            {
+                /* Running out of memory never blocks a query */
+                spinlock_release(&service->qps_lock);
+                return 1;
+            }
+            bucket->tokens = service->qps_burst;
+            bucket->last_refill = hkheartbeat;
+            spinlock_init(&bucket->lock);
+            if (hashtable_add(service->qps_buckets, key, bucket) == 0)
+            {
+                spinlock_release(&service->qps_lock);
+                free(bucket);
+                return 1;
+            }
+        }
+        spinlock_release(&service->qps_lock);
+        session->rate_bucket = bucket;
+    }
+
+    spinlock_acquire(&bucket->lock);
+    now = hkheartbeat;
+    if (now > bucket->last_refill)
+    {
+        /* One heartbeat is 100 milliseconds */
+        long refill = (now - bucket->last_refill) * service->qps_limit / 10;
+
+        if (refill > 0)
+        {
+            bucket->tokens = MIN(bucket->tokens + refill, service->qps_burst);
+            bucket->last_refill = now;
+        }
+    }
+    chunk = MIN(bucket->tokens, SERVICE_RATE_CHUNK);
+    bucket->tokens -= chunk;
+    spinlock_release(&bucket->lock);
+
+    if (chunk > 0)
+    {
+        session->rate_tokens = chunk - 1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Intern a canonical statement text in the digest dictionary of a
+ * service, allocating the dictionary on the first call. The returned
+ * identifier is stable for the lifetime of the service and can be
+ * stored and compared by filters and routers in place of the full
+ * statement text.
+ *
+ * @param service       The service the statement was routed by
+ * @param canonical     The canonical statement text
+ * @return The identifier of the text, 0 if it could not be interned
+ */
+uint32_t
+service_intern_digest(SERVICE *service, const char *canonical)
+{
+    if (service->digest_dict == NULL)
+    {
+        DIGESTDICT *dict = digestdict_alloc();
+
+        spinlock_acquire(&service->spin);
+        if (service->digest_dict == NULL)
+        {
+            service->digest_dict = dict;
+            dict = NULL;
+        }
+        spinlock_release(&service->spin);
+        digestdict_free(dict);
+        if (service->digest_dict == NULL)
+        {
+            return 0;
+        }
+    }
+    return digestdict_intern(service->digest_dict, canonical);
+}
+
+/**
+ * Fetch the text of an identifier interned in the digest dictionary of
+ * a service. The text remains valid for the lifetime of the service.
+ *
+ * @param service       The service that assigned the identifier
+ * @param id            The identifier to resolve
+ * @return The statement text or NULL if the identifier is not known
+ */
+const char *
+service_digest_text(SERVICE *service, uint32_t id)
+{
+    return service->digest_dict
+           ? digestdict_text(service->digest_dict, id) : NULL;
+}
+
+/**
+ * Set the maximum number of backend connections that the service will pool
+ * per server. The pool itself hangs from the SERVER structure, the service
+ * supplies the bound for servers that do not configure a persistent pool of
+ * their own and scopes the pooled connections so that a connection opened
+ * for one service is never handed to a session of another.
+ *
+ * @param service Service to configure
+ * @param val Maximum number of pooled connections per server
+ * @return 1 on success, 0 when the value is invalid
+ */
+int
+serviceSetConnectionPoolMax(SERVICE *service, int val)
+{
+    if (val < 0)
+    {
+        return 0;
+    }
+
+    service->conn_pool_max = val;
+
+    return 1;
+}
+
+/**
+ * Set the number of backend replies that a read event may process before
+ * the protocol module returns to the poll loop. A backend that streams a
+ * large result set is drained in batches of this many replies, saving the
+ * epoll wakeup and re-arm between each one, while the bound keeps a busy
+ * connection from starving the other descriptors on the thread.
+ *
+ * @param service Service to configure
+ * @param val Number of replies to process per read event
+ * @return 1 on success, 0 when the value is invalid
+ */
+int
+serviceSetReadBatchLimit(SERVICE *service, int val)
+{
+    if (val < 1)
+    {
+        return 0;
+    }
+
+    service->read_batch_limit = val;
+
+    return 1;
+}
+
+/**
+ * Pin the client connections of a service to a group of polling threads.
+ *
+ * The accepted DCBs of the service, and through owner inheritance the
+ * backend DCBs of their sessions, are then assigned only to threads in
+ * the given inclusive range. This gives scheduling isolation between
+ * services sharing one MaxScale: a service saturating its own threads
+ * cannot delay the events of a service pinned elsewhere. Only effective
+ * when thread local polling is in use.
+ *
+ * @param service Service to configure
+ * @param first First polling thread of the group
+ * @param last Last polling thread of the group
+ * @return 1 on success, 0 when the range is invalid
+ */
+int
+serviceSetThreadGroup(SERVICE *service, int first, int last)
+{
+    if (first < 0 || last < first)
+    {
+        return 0;
+    }
+
+    service->thread_group_first = first;
+    service->thread_group_last = last;
+
+    return 1;
+}
+
+/**
+ * Lease a backend connection for a session of this service.
+ *
+ * An idle connection is taken from the connection pool of the server when
+ * one is available for the session user; the session state is attached to
+ * the connection as part of the lease. A new connection is opened when the
+ * pool has nothing suitable, so the caller sees no difference between the
+ * two cases. The connection is returned to the pool, rather than closed,
+ * by service_pool_release_dcb provided it is still healthy and the pool
+ * is not full.
+ *
+ * @param service Service the connection is leased for
+ * @param server Server the connection must be made to
+ * @param session Session to attach to the connection
+ * @return The connected DCB or NULL on failure
+ */
+DCB *
+service_pool_lease_dcb(SERVICE *service, SERVER *server, SESSION *session)
+{
+    ss_dassert(session->service == service);
+
+    return dcb_connect(server, session, server->protocol);
+}
+
+/**
+ * Release a backend connection that was leased with service_pool_lease_dcb.
+ *
+ * The session state is detached from the connection and the connection is
+ * placed in the pool of its server if it qualifies, otherwise it is closed.
+ *
+ * @param service Service the connection was leased for
+ * @param dcb The backend connection to release
+ */
+void
+service_pool_release_dcb(SERVICE *service, DCB *dcb)
+{
+    ss_dassert(dcb->service == NULL || dcb->service == service);
+
+    dcb_close(dcb);
+}
+
 /**
  * Enable or disable the restarting of the service on failure.
  * @param service Service to configure
@@ -1089,8 +1889,23 @@ serviceSetFilters(SERVICE *service, char *filters)
 
     if (rval)
     {
-        service->filters = flist;
+        FILTER_DEF **oldlist = service->filters;
+
+        /**
+         * The list is published with a single pointer swap so that a
+         * session being set up concurrently sees either the old or the
+         * new chain in full; the chains are traversed to their NULL
+         * terminator without taking any lock. A replaced list can only
+         * be freed once every such traversal has drained.
+         */
         service->n_filters = n;
+        rcu_assign_pointer(service->filters, flist);
+
+        if (oldlist != NULL)
+        {
+            rcu_synchronize();
+            free(oldlist);
+        }
     }
     else
     {
@@ -1100,6 +1915,42 @@ serviceSetFilters(SERVICE *service, char *filters)
     return rval;
 }
 
+/**
+ * Fill the service slots of the statistics export segment
+ *
+ * Called by the housekeeper task of the statistics export, see
+ * shmstats.c, with the generation count of the segment already marking
+ * a refresh in progress.
+ *
+ * @param slots         The array of slots to fill
+ * @param nslots        The number of slots available
+ * @return The number of slots filled
+ */
+int
+service_fill_shmstats(SHMSTATS_SERVICE *slots, int nslots)
+{
+    SERVICE *service;
+    int     n = 0;
+
+    spinlock_acquire(&service_spin);
+    service = allServices;
+    while (service && n < nslots)
+    {
+        SHMSTATS_SERVICE *slot = &slots[n];
+        int n_sessions, n_current;
+
+        snprintf(slot->name, SHMSTATS_NAME_LEN, "%s", service->name);
+        service_stats_read(service, &n_sessions, &n_current);
+        slot->n_sessions = n_sessions;
+        slot->n_current = n_current;
+        n++;
+        service = service->next;
+    }
+    spinlock_release(&service_spin);
+
+    return n;
+}
+
 /**
  * Return a named service
  *
@@ -1135,6 +1986,7 @@ printService(SERVICE *service)
     struct tm result;
     char time_buf[30];
     int i;
+    int n_sessions, n_current;
 
     printf("Service %p\n", (void *)service);
     printf("\tService:                              %s\n", service->name);
@@ -1159,8 +2011,9 @@ printService(SERVICE *service)
         printf("\n");
     }
     printf("\tUsers data:           %p\n", (void *)service->users);
-    printf("\tTotal connections:    %d\n", service->stats.n_sessions);
-    printf("\tCurrently connected:  %d\n", service->stats.n_current);
+    service_stats_read(service, &n_sessions, &n_current);
+    printf("\tTotal connections:    %d\n", n_sessions);
+    printf("\tCurrently connected:  %d\n", n_current);
 }
 
 /**
@@ -1217,6 +2070,7 @@ void dprintService(DCB *dcb, SERVICE *service)
     struct tm result;
     char timebuf[30];
     int i;
+    int n_sessions, n_current;
 
     dcb_printf(dcb, "Service %p\n", service);
     dcb_printf(dcb, "\tService:                             %s\n",
@@ -1268,10 +2122,20 @@ void dprintService(DCB *dcb, SERVICE *service)
     }
     dcb_printf(dcb, "\tUsers data:                          %p\n",
                service->users);
+    service_stats_read(service, &n_sessions, &n_current);
     dcb_printf(dcb, "\tTotal connections:                   %d\n",
-               service->stats.n_sessions);
+               n_sessions);
     dcb_printf(dcb, "\tCurrently connected:                 %d\n",
-               service->stats.n_current);
+               n_current);
+    if (service->digest_dict)
+    {
+        dcb_printf(dcb, "\tInterned statement shapes:           %u\n",
+                   digestdict_size(service->digest_dict));
+    }
+    if (service->stats.latency)
+    {
+        dprintHistogram(dcb, service->stats.latency);
+    }
 }
 
 /**
@@ -1296,10 +2160,13 @@ dListServices(DCB *dcb)
     }
     while (service)
     {
-        ss_dassert(service->stats.n_current >= 0);
+        int n_sessions, n_current;
+
+        service_stats_read(service, &n_sessions, &n_current);
+        ss_dassert(n_current >= 0);
         dcb_printf(dcb, "%-25s | %-20s | %6d | %5d\n",
                    service->name, service->routerModule,
-                   service->stats.n_current, service->stats.n_sessions);
+                   n_current, n_sessions);
         service = service->next;
     }
     if (allServices)
@@ -1768,7 +2635,10 @@ serviceSessionCountAll()
     service = allServices;
     while (service)
     {
-        rval += service->stats.n_current;
+        int n_sessions, n_current;
+
+        service_stats_read(service, &n_sessions, &n_current);
+        rval += n_current;
         service = service->next;
     }
     spinlock_release(&service_spin);
@@ -1881,6 +2751,7 @@ serviceRowCallback(RESULTSET *set, void *data)
 {
     int *rowno = (int *)data;
     int i = 0;
+    int n_sessions, n_current;
     char buf[20];
     RESULT_ROW *row;
     SERVICE *service;
@@ -1899,12 +2770,13 @@ serviceRowCallback(RESULTSET *set, void *data)
         return NULL;
     }
     (*rowno)++;
+    service_stats_read(service, &n_sessions, &n_current);
     row = resultset_make_row(set);
     resultset_row_set(row, 0, service->name);
     resultset_row_set(row, 1, service->routerModule);
-    sprintf(buf, "%d", service->stats.n_current);
+    sprintf(buf, "%d", n_current);
     resultset_row_set(row, 2, buf);
-    sprintf(buf, "%d", service->stats.n_sessions);
+    sprintf(buf, "%d", n_sessions);
     resultset_row_set(row, 3, buf);
     spinlock_release(&service_spin);
     return row;
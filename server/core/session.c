@@ -28,6 +28,26 @@
  * 29/05/14     Mark Riddoch            Addition of filter mechanism
  * 23/08/15     Martin Brampton         Tidying; slight improvement in safety
  * 17/09/15     Martin Brampton         Keep failed session in existence - leave DCBs to close
+ * 20/06/16     Mark Riddoch            Recycle session objects on per-thread free lists
+ * 26/06/16     Mark Riddoch            Shard the session list to eliminate the
+ *                                      global session lock
+ * 29/06/16     Mark Riddoch            Record per-query latency across the
+ *                                      filter chain
+ * 02/07/16     Mark Riddoch            Compute the statement digest once per
+ *                                      query and attach it to the buffer
+ * 03/07/16     Mark Riddoch            Bump arena for session lifetime
+ *                                      allocations, freed in one operation
+ * 03/07/16     Mark Riddoch            Hash table from session id to session
+ *                                      for O(1) lookup by the admin commands
+ * 03/07/16     Mark Riddoch            Report heap allocations to the memory
+ *                                      accounting of memaccount.c
+ * 03/07/16     Mark Riddoch            Service and state predicates evaluated
+ *                                      while the session list is walked
+ * 03/07/16     Mark Riddoch            Filter chain of the service read
+ *                                      without locking when a session is
+ *                                      set up
+ * 05/07/16     Mark Riddoch            Top sessions view ranking the active
+ *                                      sessions by the per-session counters
  *
  * @endverbatim
  */
@@ -45,25 +65,276 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <housekeeper.h>
+#include <rcu.h>
+#include <platform.h>
+#include <histogram.h>
+#include <querystats.h>
+#include <query_classifier.h>
+#include <memlog.h>
+#include <memaccount.h>
+#include <hashtable.h>
+#include <maxconfig.h>
+
+/** Global session id; incremented atomically */
+static int session_id;
 
-/** Global session id; updated safely by holding session_spin */
-static size_t session_id;
+/**
+ * The list of all sessions, sharded by session id so that neither the
+ * linking of new sessions nor the walks made by the diagnostic commands
+ * ever serialise behind a single global lock. A walker holds at most one
+ * shard lock at a time, so a diagnostic command on a busy system only
+ * stalls the small fraction of sessions hashing to the shard in hand.
+ */
+#define SESSION_SHARDS  64      /*< Number of shards in the session list */
+
+typedef struct
+{
+    SPINLOCK    lock;   /*< Lock protecting this shard of the list */
+    SESSION     *head;  /*< The sessions whose id hashes to this shard */
+} SESSION_SHARD;
+
+static SESSION_SHARD allSessions[SESSION_SHARDS];
+
+#define SESSION_SHARD_OF(id)    (&allSessions[(id) % SESSION_SHARDS])
+
+/**
+ * Map from session id to session, so that looking a session up by id for
+ * the admin commands is a hash table fetch rather than a walk of the
+ * session list under its locks. The striped locking of the hash table
+ * keeps concurrent session creation and teardown from serialising on it.
+ */
+#define SESSION_IDMAP_SIZE      4096    /*< Buckets in the id to session map */
+
+static HASHTABLE *session_ids = NULL;
+
+/**
+ * One time initialisation of the session list, done on the first call.
+ * The shard locks are registered with the spinlock registry so that
+ * contention on the session list shows up in "show spinlocks", and the
+ * id to session map is allocated. The registry keeps a pointer to the
+ * name, hence the static name table.
+ */
+static void
+session_register_locks()
+{
+    static int registered = 0;
+    static char shard_names[SESSION_SHARDS][24];
+    int i, mapsize = SESSION_IDMAP_SIZE;
+
+    if (!registered && atomic_add(&registered, 1) == 0)
+    {
+        for (i = 0; i < SESSION_SHARDS; i++)
+        {
+            snprintf(shard_names[i], sizeof(shard_names[i]),
+                     "Session shard %d", i);
+            spinlock_register(&allSessions[i].lock, shard_names[i]);
+        }
+        /* With an expected_sessions capacity hint the id map is sized
+         * for the expected population up front, so the bucket chains
+         * stay short at steady state. */
+        if (config_expected_sessions() > mapsize)
+        {
+            mapsize = config_expected_sessions();
+        }
+        session_ids = hashtable_alloc_int(mapsize);
+    }
+}
+
+/**
+ * The recycling pool for session objects, the companion of the DCB pool
+ * in dcb.c.  Sessions freed by a thread are kept on a free list of that
+ * thread, capped in size, and reused by the next session_alloc call made
+ * on the same thread.
+ */
+#define SESSIONPOOL_MAX_FREE    64  /*< Cap on free sessions per thread */
+
+static thread_local SESSION *sessionpool = NULL;    /*< Free list of sessions */
+static thread_local int n_sessionpool = 0;          /*< Number of free sessions */
+
+/**
+ * Allocate a zeroed session object, reusing one from the free list of
+ * the calling thread if one is available.
+ *
+ * @return A session object or NULL if memory could not be allocated
+ */
+static SESSION *
+session_pool_alloc()
+{
+    SESSION *session;
 
-static SPINLOCK session_spin = SPINLOCK_INIT;
-static SESSION *allSessions = NULL;
+    if ((session = sessionpool) != NULL)
+    {
+        sessionpool = session->next;
+        n_sessionpool--;
+        memset(session, 0, sizeof(SESSION));
+    }
+    else if ((session = (SESSION *)calloc(1, sizeof(SESSION))) != NULL)
+    {
+        memacct_add(MEM_ACCT_SESSION, sizeof(SESSION));
+    }
+    return session;
+}
+
+/**
+ * Return a session object to the free list of the calling thread, or to
+ * the heap if the free list is full.
+ *
+ * @param session       The session to free
+ */
+static void
+session_pool_free(SESSION *session)
+{
+    while (session->ses_arena)
+    {
+        SESSION_ARENA_BLOCK *block = session->ses_arena;
+        session->ses_arena = block->next;
+        memacct_add(MEM_ACCT_SESSION,
+                    -((int64_t)sizeof(SESSION_ARENA_BLOCK) + block->size));
+        free(block);
+    }
+    if (session->ses_query_shape)
+    {
+        free(session->ses_query_shape);
+        session->ses_query_shape = NULL;
+    }
+    session->ses_query_digest = 0;
+    if (n_sessionpool < SESSIONPOOL_MAX_FREE)
+    {
+        session->next = sessionpool;
+        sessionpool = session;
+        n_sessionpool++;
+    }
+    else
+    {
+        memacct_add(MEM_ACCT_SESSION, -(int64_t)sizeof(SESSION));
+        free(session);
+    }
+}
+
+/**
+ * Prime the session pool of the calling thread with n free sessions, up
+ * to the pool cap. Called by each polling thread at startup when the
+ * configuration carries an expected_sessions capacity hint, so that the
+ * allocations are made before traffic arrives rather than during the
+ * connection ramp.
+ *
+ * @param n     The number of sessions to place on the free list
+ */
+void
+session_pool_prime(int n)
+{
+    SESSION *session;
+
+    if (n > SESSIONPOOL_MAX_FREE)
+    {
+        n = SESSIONPOOL_MAX_FREE;
+    }
+    while (n_sessionpool < n)
+    {
+        if ((session = (SESSION *)calloc(1, sizeof(SESSION))) == NULL)
+        {
+            return;
+        }
+        memacct_add(MEM_ACCT_SESSION, sizeof(SESSION));
+        session->next = sessionpool;
+        sessionpool = session;
+        n_sessionpool++;
+    }
+}
+
+/**
+ * The size of the blocks of the per session arena. A single block
+ * accommodates the usual router session with its backend references
+ * and a handful of filter sessions; an allocation larger than the
+ * block size gets a block of its own.
+ */
+#define SESSION_ARENA_BLOCK_SIZE 8192
+
+/**
+ * Allocate memory that lives for the rest of the lifetime of a session.
+ *
+ * The memory is drawn from the bump arena of the session and must not
+ * be freed by the caller; every arena block is returned when the
+ * session itself is freed. Intended for the session objects of routers
+ * and filters and the structures hanging from them, which were
+ * previously malloc'd and freed individually. The returned memory is
+ * not zeroed.
+ *
+ * @param session       The session the allocation belongs to
+ * @param size          Number of bytes to allocate
+ * @return The allocated memory or NULL if memory could not be allocated
+ */
+void *
+session_arena_alloc(SESSION *session, size_t size)
+{
+    SESSION_ARENA_BLOCK *block = session->ses_arena;
+    size_t aligned = (size + 7) & ~((size_t)7);
+    void *rval;
+
+    if (block == NULL || block->size - block->used < aligned)
+    {
+        size_t bsize = aligned > SESSION_ARENA_BLOCK_SIZE
+            ? aligned : SESSION_ARENA_BLOCK_SIZE;
+
+        if ((block = malloc(sizeof(SESSION_ARENA_BLOCK) + bsize)) == NULL)
+        {
+            return NULL;
+        }
+        memacct_add(MEM_ACCT_SESSION,
+                    (int64_t)sizeof(SESSION_ARENA_BLOCK) + bsize);
+        block->size = bsize;
+        block->used = 0;
+        if (bsize > SESSION_ARENA_BLOCK_SIZE && session->ses_arena)
+        {
+            /*< An oversized block is filled by this one allocation, so
+             * keep the current block at the head for the small ones */
+            block->next = session->ses_arena->next;
+            session->ses_arena->next = block;
+        }
+        else
+        {
+            block->next = session->ses_arena;
+            session->ses_arena = block;
+        }
+    }
+    rval = (char *)(block + 1) + block->used;
+    block->used += aligned;
+    return rval;
+}
+
+/**
+ * Duplicate a string into the arena of a session.
+ *
+ * @param session       The session the copy belongs to
+ * @param str           The string to copy
+ * @return The copy or NULL if memory could not be allocated
+ */
+char *
+session_arena_strdup(SESSION *session, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy;
+
+    if ((copy = session_arena_alloc(session, len)) != NULL)
+    {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
 
 static struct session session_dummy_struct;
 
 /**
- * These two are declared in session.h
+ * Declared in session.h
  */
 bool check_timeouts = false;
-long next_timeout_check = 0;
-
-static SPINLOCK timeout_lock = SPINLOCK_INIT;
 
 static int session_setup_filters(SESSION *session);
+static int session_route_query_record(void *instance, void *session, GWBUF *request);
+static int session_reply_direct(void *instance, void *session, GWBUF *data);
 static void session_simple_free(SESSION *session, DCB *dcb);
+static void session_idle_cb(void *data);
+static void session_query_timeout_cb(void *data);
 
 static void mysql_auth_free_client_data(DCB *dcb);
 
@@ -82,8 +353,10 @@ SESSION *
 session_alloc(SERVICE *service, DCB *client_dcb)
 {
     SESSION *session;
+    SESSION_SHARD *shard;
 
-    session = (SESSION *)calloc(1, sizeof(SESSION));
+    session_register_locks();
+    session = session_pool_alloc();
     ss_info_dassert(session != NULL, "Allocating memory for session failed.");
 
     if (session == NULL)
@@ -104,6 +377,9 @@ session_alloc(SERVICE *service, DCB *client_dcb)
     session->service = service;
     session->client_dcb = client_dcb;
     session->n_filters = 0;
+    session->query_deadline = service->query_timeout > 0;
+    session->rate_bucket = NULL;
+    session->rate_tokens = 0;
     memset(&session->stats, 0, sizeof(SESSION_STATS));
     session->stats.connect = time(0);
     session->state = SESSION_STATE_ALLOC;
@@ -155,9 +431,17 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 
         session->head.routeQuery = (void *)(service->router->routeQuery);
 
+        /*
+         * When the service records no latency histogram the reply path
+         * needs no bookkeeping, so the tail is wired to the direct
+         * variant that only hands the buffer to the client protocol.
+         * With no filters configured either, a reply then makes a
+         * single indirect call from the router to the protocol write.
+         */
         session->tail.instance = session;
         session->tail.session = session;
-        session->tail.clientReply = session_reply;
+        session->tail.clientReply = service->stats.latency
+                                  ? session_reply : session_reply_direct;
 
         if (SESSION_STATE_TO_BE_FREED != session->state
             && service->n_filters > 0
@@ -168,6 +452,21 @@ session_alloc(SERVICE *service, DCB *client_dcb)
                       "Terminating session %s.",
                       service->name);
         }
+
+        /*
+         * Wrap the head of the completed chain so that the time each
+         * query spends between routeQuery and the first clientReply,
+         * filters included, is recorded in the latency histogram of
+         * the service.
+         */
+        if (SESSION_STATE_TO_BE_FREED != session->state
+            && service->stats.latency)
+        {
+            session->ses_chain_head = session->head;
+            session->head.instance = session;
+            session->head.session = session;
+            session->head.routeQuery = session_route_query_record;
+        }
     }
 
     if (SESSION_STATE_TO_BE_FREED != session->state)
@@ -198,17 +497,40 @@ session_alloc(SERVICE *service, DCB *client_dcb)
                  session->client_dcb->user,
                  session->client_dcb->remote);
     }
-    spinlock_acquire(&session_spin);
-    /** Assign a session id and increase, insert session into list */
-    session->ses_id = ++session_id;
-    session->next = allSessions;
-    allSessions = session;
-    spinlock_release(&session_spin);
-    atomic_add(&service->stats.n_sessions, 1);
-    atomic_add(&service->stats.n_current, 1);
+    /** Assign a session id and increase, insert session into its shard */
+    session->ses_id = (size_t)(atomic_add(&session_id, 1) + 1);
+    shard = SESSION_SHARD_OF(session->ses_id);
+    spinlock_acquire(&shard->lock);
+    session->next = shard->head;
+    shard->head = session;
+    spinlock_release(&shard->lock);
+    if (session_ids)
+    {
+        hashtable_add(session_ids, (void *)session->ses_id, session);
+    }
+    stats_counter_increment(service->stats.n_sessions);
+    stats_counter_increment(service->stats.n_current);
     CHK_SESSION(session);
 
+    /*
+     * Arm the idle timeout timer for client sessions of services that
+     * have a connection idle timeout configured.
+     */
+    if (check_timeouts && service->conn_idle_timeout > 0 &&
+        SESSION_STATE_TO_BE_FREED != session->state &&
+        client_dcb->state != DCB_STATE_LISTENING &&
+        client_dcb->dcb_role != DCB_ROLE_INTERNAL)
+    {
+        session->idle_timer = tw_add(service->conn_idle_timeout * 10 + 1,
+                                     session_idle_cb, session);
+    }
+
     client_dcb->session = session;
+
+    if (SESSION_STATE_TO_BE_FREED != session->state)
+    {
+        trace_event(TRC_SESSION_START, (uintptr_t)session, session->ses_id);
+    }
     return SESSION_STATE_TO_BE_FREED == session->state ? NULL : session;
 }
 
@@ -368,7 +690,7 @@ session_simple_free(SESSION *session, DCB *dcb)
         session->state = SESSION_STATE_STOPPING;
     }
 
-    free(session);
+    session_pool_free(session);
 }
 
 /**
@@ -379,6 +701,8 @@ session_simple_free(SESSION *session, DCB *dcb)
 bool
 session_free(SESSION *session)
 {
+    SESSION_SHARD *shard;
+
     if (session && SESSION_STATE_DUMMY == session->state)
     {
         return true;
@@ -395,17 +719,19 @@ session_free(SESSION *session)
         return false;
     }
     session->state = SESSION_STATE_TO_BE_FREED;
+    trace_event(TRC_SESSION_END, (uintptr_t)session, session->ses_id);
 
-    /* First of all remove from the linked list */
-    spinlock_acquire(&session_spin);
-    if (allSessions == session)
+    /* First of all remove from the shard of the session list */
+    shard = SESSION_SHARD_OF(session->ses_id);
+    spinlock_acquire(&shard->lock);
+    if (shard->head == session)
     {
-        allSessions = session->next;
+        shard->head = session->next;
     }
     else
     {
         SESSION *chksession;
-        chksession = allSessions;
+        chksession = shard->head;
         while (chksession && chksession->next != session)
         {
             chksession = chksession->next;
@@ -415,8 +741,27 @@ session_free(SESSION *session)
             chksession->next = session->next;
         }
     }
-    spinlock_release(&session_spin);
-    atomic_add(&session->service->stats.n_current, -1);
+    spinlock_release(&shard->lock);
+    if (session_ids)
+    {
+        hashtable_delete(session_ids, (void *)session->ses_id);
+    }
+    stats_counter_decrement(session->service->stats.n_current);
+
+    /** Remove the idle timeout timer, waiting for a concurrently
+     * executing timeout callback to complete before going further. */
+    if (session->idle_timer)
+    {
+        tw_remove(session->idle_timer);
+        session->idle_timer = NULL;
+    }
+
+    /** Remove the query deadline timer in the same manner */
+    if (session->query_timer)
+    {
+        tw_remove(session->query_timer);
+        session->query_timer = NULL;
+    }
 
     /***
      *
@@ -457,7 +802,7 @@ session_free(SESSION *session)
                                                              session->filters[i].session);
             }
         }
-        free(session->filters);
+        /*< The filter array itself is in the arena of the session */
     }
 
     MXS_INFO("Stopped %s client session [%lu]",
@@ -471,7 +816,7 @@ session_free(SESSION *session)
     if (!session->ses_is_child)
     {
         session->state = SESSION_STATE_FREE;
-        free(session);
+        session_pool_free(session);
     }
     return true;
 }
@@ -487,19 +832,23 @@ session_isvalid(SESSION *session)
 {
     SESSION *list_session;
     int rval = 0;
+    int i;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (i = 0; i < SESSION_SHARDS && rval == 0; i++)
     {
-        if (list_session == session)
+        spinlock_acquire(&allSessions[i].lock);
+        list_session = allSessions[i].head;
+        while (list_session)
         {
-            rval = 1;
-            break;
+            if (list_session == session)
+            {
+                rval = 1;
+                break;
+            }
+            list_session = list_session->next;
         }
-        list_session = list_session->next;
+        spinlock_release(&allSessions[i].lock);
     }
-    spinlock_release(&session_spin);
 
     return rval;
 }
@@ -533,15 +882,19 @@ void
 printAllSessions()
 {
     SESSION *list_session;
+    int i;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (i = 0; i < SESSION_SHARDS; i++)
     {
-        printSession(list_session);
-        list_session = list_session->next;
+        spinlock_acquire(&allSessions[i].lock);
+        list_session = allSessions[i].head;
+        while (list_session)
+        {
+            printSession(list_session);
+            list_session = list_session->next;
+        }
+        spinlock_release(&allSessions[i].lock);
     }
-    spinlock_release(&session_spin);
 }
 
 
@@ -557,53 +910,60 @@ CheckSessions()
     SESSION *list_session;
     int noclients = 0;
     int norouter = 0;
+    int i;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (i = 0; i < SESSION_SHARDS; i++)
     {
-        if (list_session->state != SESSION_STATE_LISTENER ||
-            list_session->state != SESSION_STATE_LISTENER_STOPPED)
+        spinlock_acquire(&allSessions[i].lock);
+        list_session = allSessions[i].head;
+        while (list_session)
         {
-            if (list_session->client_dcb == NULL && list_session->refcount)
+            if (list_session->state != SESSION_STATE_LISTENER ||
+                list_session->state != SESSION_STATE_LISTENER_STOPPED)
             {
-                if (noclients == 0)
+                if (list_session->client_dcb == NULL && list_session->refcount)
                 {
-                    printf("Sessions without a client DCB.\n");
-                    printf("==============================\n");
+                    if (noclients == 0)
+                    {
+                        printf("Sessions without a client DCB.\n");
+                        printf("==============================\n");
+                    }
+                    printSession(list_session);
+                    noclients++;
                 }
-                printSession(list_session);
-                noclients++;
             }
+            list_session = list_session->next;
         }
-        list_session = list_session->next;
+        spinlock_release(&allSessions[i].lock);
     }
-    spinlock_release(&session_spin);
     if (noclients)
     {
         printf("%d Sessions have no clients\n", noclients);
     }
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (i = 0; i < SESSION_SHARDS; i++)
     {
-        if (list_session->state != SESSION_STATE_LISTENER ||
-            list_session->state != SESSION_STATE_LISTENER_STOPPED)
+        spinlock_acquire(&allSessions[i].lock);
+        list_session = allSessions[i].head;
+        while (list_session)
         {
-            if (list_session->router_session == NULL && list_session->refcount)
+            if (list_session->state != SESSION_STATE_LISTENER ||
+                list_session->state != SESSION_STATE_LISTENER_STOPPED)
             {
-                if (norouter == 0)
+                if (list_session->router_session == NULL && list_session->refcount)
                 {
-                    printf("Sessions without a router session.\n");
-                    printf("==================================\n");
+                    if (norouter == 0)
+                    {
+                        printf("Sessions without a router session.\n");
+                        printf("==================================\n");
+                    }
+                    printSession(list_session);
+                    norouter++;
                 }
-                printSession(list_session);
-                norouter++;
             }
+            list_session = list_session->next;
         }
-        list_session = list_session->next;
+        spinlock_release(&allSessions[i].lock);
     }
-    spinlock_release(&session_spin);
     if (norouter)
     {
         printf("%d Sessions have no router session\n", norouter);
@@ -624,37 +984,41 @@ dprintAllSessions(DCB *dcb)
     struct tm result;
     char timebuf[40];
     SESSION *list_session;
+    int i;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    for (i = 0; i < SESSION_SHARDS; i++)
     {
-        dcb_printf(dcb, "Session %d (%p)\n",list_session->ses_id, list_session);
-        dcb_printf(dcb, "\tState:               %s\n", session_state(list_session->state));
-        dcb_printf(dcb, "\tService:             %s (%p)\n", list_session->service->name, list_session->service);
-        dcb_printf(dcb, "\tClient DCB:          %p\n", list_session->client_dcb);
-
-        if (list_session->client_dcb && list_session->client_dcb->remote)
+        spinlock_acquire(&allSessions[i].lock);
+        list_session = allSessions[i].head;
+        while (list_session)
         {
-            dcb_printf(dcb, "\tClient Address:              %s%s%s\n",
-                       list_session->client_dcb->user?list_session->client_dcb->user:"",
-                       list_session->client_dcb->user?"@":"",
-                       list_session->client_dcb->remote);
-        }
+            dcb_printf(dcb, "Session %d (%p)\n",list_session->ses_id, list_session);
+            dcb_printf(dcb, "\tState:               %s\n", session_state(list_session->state));
+            dcb_printf(dcb, "\tService:             %s (%p)\n", list_session->service->name, list_session->service);
+            dcb_printf(dcb, "\tClient DCB:          %p\n", list_session->client_dcb);
 
-        dcb_printf(dcb, "\tConnected:           %s",
-                   asctime_r(localtime_r(&list_session->stats.connect, &result), timebuf));
+            if (list_session->client_dcb && list_session->client_dcb->remote)
+            {
+                dcb_printf(dcb, "\tClient Address:              %s%s%s\n",
+                           list_session->client_dcb->user?list_session->client_dcb->user:"",
+                           list_session->client_dcb->user?"@":"",
+                           list_session->client_dcb->remote);
+            }
 
-        if (list_session->client_dcb && list_session->client_dcb->state == DCB_STATE_POLLING)
-        {
-            double idle = (hkheartbeat - list_session->client_dcb->last_read);
-            idle = idle > 0 ? idle/10.0:0;
-            dcb_printf(dcb, "\tIdle:                            %.0f seconds\n",idle);
-        }
+            dcb_printf(dcb, "\tConnected:           %s",
+                       asctime_r(localtime_r(&list_session->stats.connect, &result), timebuf));
 
-        list_session = list_session->next;
+            if (list_session->client_dcb && list_session->client_dcb->state == DCB_STATE_POLLING)
+            {
+                double idle = (hkheartbeat - list_session->client_dcb->last_read);
+                idle = idle > 0 ? idle/10.0:0;
+                dcb_printf(dcb, "\tIdle:                            %.0f seconds\n",idle);
+            }
+
+            list_session = list_session->next;
+        }
+        spinlock_release(&allSessions[i].lock);
     }
-    spinlock_release(&session_spin);
 }
 
 /**
@@ -718,32 +1082,179 @@ void
 dListSessions(DCB *dcb)
 {
     SESSION *list_session;
+    int printed = 0;
+    int i;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    if (list_session)
+    for (i = 0; i < SESSION_SHARDS; i++)
     {
-        dcb_printf(dcb, "Sessions.\n");
-        dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
-        dcb_printf(dcb, "Session          | Client          | Service        | State\n");
-        dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
-    }
-    while (list_session)
-    {
-        dcb_printf(dcb, "%-16p | %-15s | %-14s | %s\n", list_session,
-                   ((list_session->client_dcb && list_session->client_dcb->remote)
-                    ? list_session->client_dcb->remote : ""),
-                   (list_session->service && list_session->service->name ? list_session->service->name
-                    : ""),
-                   session_state(list_session->state));
-        list_session = list_session->next;
+        spinlock_acquire(&allSessions[i].lock);
+        list_session = allSessions[i].head;
+        while (list_session)
+        {
+            if (printed == 0)
+            {
+                dcb_printf(dcb, "Sessions.\n");
+                dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
+                dcb_printf(dcb, "Session          | Client          | Service        | State\n");
+                dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
+            }
+            dcb_printf(dcb, "%-16p | %-15s | %-14s | %s\n", list_session,
+                       ((list_session->client_dcb && list_session->client_dcb->remote)
+                        ? list_session->client_dcb->remote : ""),
+                       (list_session->service && list_session->service->name ? list_session->service->name
+                        : ""),
+                       session_state(list_session->state));
+            printed++;
+            list_session = list_session->next;
+        }
+        spinlock_release(&allSessions[i].lock);
     }
-    if (allSessions)
+    if (printed)
     {
         dcb_printf(dcb,
                    "-----------------+-----------------+----------------+--------------------------\n\n");
     }
-    spinlock_release(&session_spin);
+}
+
+/** Number of sessions shown by the top sessions view */
+#define SESSION_TOP_N   10
+
+/**
+ * A row of the top sessions view, captured while the shard lock of the
+ * session was held so that the output never reads a dying session.
+ */
+typedef struct
+{
+    size_t      id;             /*< Session id */
+    char        client[40];     /*< user@host of the client */
+    char        service[40];    /*< Name of the service */
+    uint64_t    n_queries;      /*< Queries routed */
+    uint64_t    rbytes;         /*< Bytes read from the client */
+    uint64_t    wbytes;         /*< Bytes written to the client */
+    int         writeq;         /*< Current client write queue depth */
+    uint64_t    latency;        /*< Cumulative query latency in microseconds */
+    uint64_t    key;            /*< The value of the chosen metric */
+} SESSION_TOP_ROW;
+
+/**
+ * List the busiest client sessions in tabular form to a DCB, ranked by
+ * one of the per-session counters. The metrics are "queries", "in" and
+ * "out" for the bytes read from and written to the client, "writeq"
+ * for the current depth of the client write queue and "latency" for
+ * the cumulative query latency; the latency metric is only gathered
+ * for services that record a latency histogram.
+ *
+ * The session shards are walked one at a time as in dListSessions; the
+ * counters of each candidate are copied out under the shard lock, so
+ * the table is printed without holding any lock.
+ *
+ * @param dcb           DCB to print the session list to
+ * @param metric        The metric to rank the sessions by
+ */
+void
+dprintTopSessions(DCB *dcb, char *metric)
+{
+    SESSION_TOP_ROW rows[SESSION_TOP_N];
+    SESSION *session;
+    int n_rows = 0;
+    int i, j;
+
+    if (strcmp(metric, "queries") != 0 && strcmp(metric, "in") != 0
+        && strcmp(metric, "out") != 0 && strcmp(metric, "writeq") != 0
+        && strcmp(metric, "latency") != 0)
+    {
+        dcb_printf(dcb, "Unknown metric '%s'. Available metrics are "
+                   "queries, in, out, writeq and latency.\n", metric);
+        return;
+    }
+    for (i = 0; i < SESSION_SHARDS; i++)
+    {
+        spinlock_acquire(&allSessions[i].lock);
+        session = allSessions[i].head;
+        while (session)
+        {
+            DCB *client = session->client_dcb;
+
+            if (session->state == SESSION_STATE_ROUTER_READY && client)
+            {
+                SESSION_TOP_ROW row;
+
+                row.id = session->ses_id;
+                snprintf(row.client, sizeof(row.client), "%s%s%s",
+                         client->user ? client->user : "",
+                         client->user ? "@" : "",
+                         client->remote ? client->remote : "");
+                snprintf(row.service, sizeof(row.service), "%s",
+                         session->service->name);
+                row.n_queries = session->stats.n_queries;
+                row.rbytes = client->stats.n_rbytes;
+                row.wbytes = client->stats.n_wbytes;
+                row.writeq = client->writeqlen;
+                row.latency = session->stats.total_latency;
+                if (strcmp(metric, "queries") == 0)
+                {
+                    row.key = row.n_queries;
+                }
+                else if (strcmp(metric, "in") == 0)
+                {
+                    row.key = row.rbytes;
+                }
+                else if (strcmp(metric, "out") == 0)
+                {
+                    row.key = row.wbytes;
+                }
+                else if (strcmp(metric, "writeq") == 0)
+                {
+                    row.key = row.writeq;
+                }
+                else
+                {
+                    row.key = row.latency;
+                }
+                /* Insert the row into its rank ordered slot */
+                for (j = n_rows; j > 0 && rows[j - 1].key < row.key; j--)
+                {
+                    if (j < SESSION_TOP_N)
+                    {
+                        rows[j] = rows[j - 1];
+                    }
+                }
+                if (j < SESSION_TOP_N)
+                {
+                    rows[j] = row;
+                    if (n_rows < SESSION_TOP_N)
+                    {
+                        n_rows++;
+                    }
+                }
+            }
+            session = session->next;
+        }
+        spinlock_release(&allSessions[i].lock);
+    }
+    if (n_rows == 0)
+    {
+        dcb_printf(dcb, "No client sessions\n");
+        return;
+    }
+    dcb_printf(dcb, "Top %d sessions by %s.\n", n_rows, metric);
+    dcb_printf(dcb, "%-8s | %-25s | %-14s | %9s | %12s | %12s | %8s | %12s\n",
+               "Session", "Client", "Service", "Queries",
+               "Bytes In", "Bytes Out", "WriteQ", "Latency (us)");
+    dcb_printf(dcb, "---------+---------------------------+----------------+"
+               "-----------+--------------+--------------+----------+-------------\n");
+    for (i = 0; i < n_rows; i++)
+    {
+        dcb_printf(dcb, "%-8lu | %-25s | %-14s | %9lu | %12lu | %12lu | %8d | %12lu\n",
+                   (unsigned long)rows[i].id, rows[i].client, rows[i].service,
+                   (unsigned long)rows[i].n_queries,
+                   (unsigned long)rows[i].rbytes,
+                   (unsigned long)rows[i].wbytes,
+                   rows[i].writeq,
+                   (unsigned long)rows[i].latency);
+    }
+    dcb_printf(dcb, "---------+---------------------------+----------------+"
+               "-----------+--------------+--------------+----------+-------------\n\n");
 }
 
 /**
@@ -784,16 +1295,18 @@ session_state(int state)
 
 SESSION* get_session_by_router_ses(void* rses)
 {
-    SESSION* ses = allSessions;
-
-    while (ses->router_session != rses && ses->next != NULL)
-    {
-        ses = ses->next;
-    }
+    SESSION* ses = NULL;
+    int i;
 
-    if (ses->router_session != rses)
+    for (i = 0; i < SESSION_SHARDS && ses == NULL; i++)
     {
-        ses = NULL;
+        spinlock_acquire(&allSessions[i].lock);
+        ses = allSessions[i].head;
+        while (ses && ses->router_session != rses)
+        {
+            ses = ses->next;
+        }
+        spinlock_release(&allSessions[i].lock);
     }
     return ses;
 }
@@ -815,49 +1328,79 @@ static int
 session_setup_filters(SESSION *session)
 {
     SERVICE *service = session->service;
+    FILTER_DEF **flist;
     DOWNSTREAM *head;
     UPSTREAM *tail;
-    int i;
+    int n, i;
+
+    /**
+     * Snapshot the filter chain of the service inside a read side
+     * section: a configuration change may replace the list with a new
+     * one, in which case the array traversed here is freed only after
+     * the section has been left. The filter definitions themselves are
+     * never freed while the service is running, so the references taken
+     * into the snapshot remain valid after the section ends.
+     */
+    rcu_read_lock();
+    flist = rcu_dereference(service->filters);
+
+    for (n = 0; flist && flist[n]; n++)
+    {
+        ;
+    }
 
-    if ((session->filters = calloc(service->n_filters,
-                                   sizeof(SESSION_FILTER))) == NULL)
+    if (n == 0)
     {
+        rcu_read_unlock();
+        session->n_filters = 0;
+        return 1;
+    }
+
+    if ((session->filters = session_arena_alloc(session,
+                                                n * sizeof(SESSION_FILTER))) == NULL)
+    {
+        rcu_read_unlock();
         MXS_ERROR("Insufficient memory to allocate session filter "
                   "tracking.\n");
         return 0;
     }
-    session->n_filters = service->n_filters;
-    for (i = service->n_filters - 1; i >= 0; i--)
+    memset(session->filters, 0, n * sizeof(SESSION_FILTER));
+    session->n_filters = n;
+    for (i = 0; i < n; i++)
     {
-        if (service->filters[i] == NULL)
-        {
-            MXS_ERROR("Service '%s' contians an unresolved filter.", service->name);
-            return 0;
-        }
-        if ((head = filterApply(service->filters[i], session,
-                                &session->head)) == NULL)
+        session->filters[i].filter = flist[i];
+    }
+    rcu_read_unlock();
+
+    for (i = n - 1; i >= 0; i--)
+    {
+        if ((head = filterApply(session->filters[i].filter, session,
+                                &session->head,
+                                &session->filters[i].probe)) == NULL)
         {
             MXS_ERROR("Failed to create filter '%s' for "
                       "service '%s'.\n",
-                      service->filters[i]->name,
+                      session->filters[i].filter->name,
                       service->name);
             return 0;
         }
-        session->filters[i].filter = service->filters[i];
         session->filters[i].session = head->session;
-        session->filters[i].instance = head->instance;
+        /*< When profiling is active head->instance is the probe, so
+         * take the real instance from the filter definition */
+        session->filters[i].instance = session->filters[i].filter->filter;
         session->head = *head;
         free(head);
     }
 
-    for (i = 0; i < service->n_filters; i++)
+    for (i = 0; i < n; i++)
     {
-        if ((tail = filterUpstream(service->filters[i],
+        if ((tail = filterUpstream(session->filters[i].filter,
                                    session->filters[i].session,
-                                   &session->tail)) == NULL)
+                                   &session->tail,
+                                   session->filters[i].probe)) == NULL)
         {
             MXS_ERROR("Failed to create filter '%s' for service '%s'.",
-                      service->filters[i]->name,
+                      session->filters[i].filter->name,
                       service->name);
             return 0;
         }
@@ -890,48 +1433,131 @@ session_reply(void *instance, void *session, GWBUF *data)
 {
     SESSION *the_session = (SESSION *)session;
 
+    if (the_session->ses_query_start)
+    {
+        /*
+         * Complete the measurement begun in session_route_query_record.
+         * Only the first chunk of the reply is timed, so the figure is
+         * the time to the first byte of the response rather than the
+         * time to drain a large result set.
+         */
+        uint64_t duration = histogram_clock_us() - the_session->ses_query_start;
+
+        histogram_record(the_session->service->stats.latency, duration);
+        the_session->stats.total_latency += duration;
+        the_session->ses_query_start = 0;
+        if (the_session->ses_query_shape)
+        {
+            querystats_record(the_session->service,
+                              the_session->ses_query_shape,
+                              the_session->ses_query_digest, duration);
+            the_session->ses_query_shape = NULL;
+            the_session->ses_query_digest = 0;
+        }
+    }
     return the_session->client_dcb->func.write(the_session->client_dcb, data);
 }
 
 /**
- * Return the client connection address or name
+ * Entry point for the final element in the upstream filter chain of a
+ * session whose service records no latency histogram. The reply is
+ * handed straight to the client protocol write entry point without any
+ * bookkeeping.
  *
- * @param session       The session whose client address to return
+ * @param       instance        The "instance" data
+ * @param       session         The session
+ * @param       data            The buffer chain to write
  */
-char *
-session_get_remote(SESSION *session)
+static int
+session_reply_direct(void *instance, void *session, GWBUF *data)
 {
-    if (session && session->client_dcb)
+    SESSION *the_session = (SESSION *)session;
+
+    return the_session->client_dcb->func.write(the_session->client_dcb, data);
+}
+
+/**
+ * Compute the 64-bit digest of a canonical statement, the FNV-1a hash
+ * of the string.
+ *
+ * @param canonical     The canonical form of the statement
+ * @return The digest of the statement
+ */
+static uint64_t
+session_sql_digest(const char *canonical)
+{
+    uint64_t hash = 0xcbf29ce484222325UL;
+
+    while (*canonical)
     {
-        return session->client_dcb->remote;
+        hash ^= (unsigned char)*canonical++;
+        hash *= 0x100000001b3UL;
     }
-    return NULL;
+    return hash;
 }
 
-bool session_route_query(SESSION* ses, GWBUF* buf)
+/**
+ * Route a query into the filter chain, recording the time at which it
+ * entered. Installed as the head of the chain by session_alloc; the
+ * matching reply in session_reply completes the measurement. The
+ * timestamp is simply overwritten when a protocol routes several
+ * packets before a reply arrives, so pipelined clients time only their
+ * most recent query.
+ *
+ * @param instance      The session
+ * @param session       The session
+ * @param request       The query being routed
+ * @return The return of the wrapped routeQuery
+ */
+static int
+session_route_query_record(void *instance, void *session, GWBUF *request)
 {
-    bool succp;
+    SESSION *ses = (SESSION *)instance;
 
-    if (ses->head.routeQuery == NULL ||
-        ses->head.instance == NULL ||
-        ses->head.session == NULL)
+    ses->ses_query_start = histogram_clock_us();
+    /*
+     * Capture the shape of the statement for the query digest. The
+     * canonical form is produced without parsing and is NULL for
+     * buffers that do not hold a statement. The digest of the shape is
+     * computed once here and attached to the buffer so that every
+     * filter downstream can share it instead of re-canonicalizing the
+     * same query.
+     */
+    if (ses->ses_query_shape)
     {
-        succp = false;
-        goto return_succp;
+        free(ses->ses_query_shape);
     }
-
-    if (ses->head.routeQuery(ses->head.instance, ses->head.session, buf) == 1)
+    ses->ses_query_shape = qc_get_canonical(request);
+    if (ses->ses_query_shape)
     {
-        succp = true;
+        ses->ses_query_digest = session_sql_digest(ses->ses_query_shape);
+        request->digest = ses->ses_query_digest;
+        request->digest_id = service_intern_digest(ses->service,
+                                                   ses->ses_query_shape);
     }
     else
     {
-        succp = false;
+        ses->ses_query_digest = 0;
     }
-return_succp:
-    return succp;
+    return ses->ses_chain_head.routeQuery(ses->ses_chain_head.instance,
+                                          ses->ses_chain_head.session,
+                                          request);
 }
 
+/**
+ * Return the client connection address or name
+ *
+ * @param session       The session whose client address to return
+ */
+char *
+session_get_remote(SESSION *session)
+{
+    if (session && session->client_dcb)
+    {
+        return session->client_dcb->remote;
+    }
+    return NULL;
+}
 
 /**
  * Return the username of the user connected to the client side of the
@@ -946,12 +1572,33 @@ session_getUser(SESSION *session)
     return (session && session->client_dcb) ? session->client_dcb->user : NULL;
 }
 /**
- * Return the pointer to the list of all sessions.
- * @return Pointer to the list of all sessions.
+ * Find a session by its unique session id.
+ *
+ * The lookup is a fetch from the id to session map and is O(1) in the
+ * number of sessions; the shard list is only searched if the map could
+ * not be allocated at startup.
+ *
+ * @param id    The session id to look for
+ * @return The session or NULL if no session has the given id
  */
-SESSION *get_all_sessions()
+SESSION *session_get_by_id(size_t id)
 {
-    return allSessions;
+    SESSION_SHARD *shard;
+    SESSION *session;
+
+    if (session_ids)
+    {
+        return (SESSION *)hashtable_fetch(session_ids, (void *)id);
+    }
+    shard = SESSION_SHARD_OF(id);
+    spinlock_acquire(&shard->lock);
+    session = shard->head;
+    while (session && session->ses_id != id)
+    {
+        session = session->next;
+    }
+    spinlock_release(&shard->lock);
+    return session;
 }
 
 /**
@@ -966,36 +1613,133 @@ void enable_session_timeouts()
 }
 
 /**
- * Close sessions that have been idle for too long.
+ * Timer wheel expiry function for the session idle timeout.
+ *
+ * If the time since the session last sent data is greater than the set value
+ * in the service, it is disconnected, otherwise the timer is re-armed for
+ * the point at which the session may next become idle for too long. The
+ * connection timeout is disabled by default.
  *
- * If the time since a session last sent data is greater than the set value in the
- * service, it is disconnected. The connection timeout is disabled by default.
+ * The timer is removed in session_free(); tw_remove() guarantees that the
+ * session can not be freed under our feet while this callback executes.
+ *
+ * @param data          The session whose idle timer has expired
  */
-void process_idle_sessions()
+static void session_idle_cb(void *data)
 {
-    if (spinlock_acquire_nowait(&timeout_lock))
+    SESSION *session = (SESSION *)data;
+    DCB *client_dcb = session->client_dcb;
+    long timeout = session->service->conn_idle_timeout * 10;
+    long idle = hkheartbeat - client_dcb->last_read;
+
+    if (client_dcb->state == DCB_STATE_POLLING && idle > timeout)
     {
-        if (hkheartbeat >= next_timeout_check)
+        dcb_close(client_dcb);
+    }
+    else
+    {
+        /** Not idle for long enough yet, check again once it could be */
+        tw_reschedule(session->idle_timer, timeout - idle + 1);
+    }
+}
+
+/**
+ * Route a query from the client to the first element in the pipeline of
+ * filters and routers, arming the query deadline of the service.
+ *
+ * Protocol modules call this through the SESSION_ROUTE_QUERY macro,
+ * which only takes this path when the service had a query timeout
+ * configured at session creation; sessions with no deadline call the
+ * head of the chain in place. The routing time of the query is recorded
+ * and the deadline timer is armed on the first query of the session;
+ * thereafter the timer reschedules itself, so routing a query costs no
+ * more than two plain stores.
+ *
+ * @param session       The session the query arrived on
+ * @param buf           The query buffer
+ * @return The return value of the head routeQuery function
+ */
+int
+session_route_query(SESSION *session, GWBUF *buf)
+{
+    if (session->query_deadline)
+    {
+        session->query_start = hkheartbeat;
+        session->query_active = true;
+        if (session->query_timer == NULL)
         {
-            /** Because the resolution of the timeout is one second, we only need to
-             * check for it once per second. One heartbeat is 100 milliseconds. */
-            next_timeout_check = hkheartbeat + 10;
-            spinlock_acquire(&session_spin);
-            SESSION *all_session = get_all_sessions();
+            session->query_timer = tw_add(session->service->query_timeout * 10 + 1,
+                                          session_query_timeout_cb, session);
+        }
+    }
+    return (session->head.routeQuery)(session->head.instance,
+                                      session->head.session, buf);
+}
 
-            while (all_session)
-            {
-                if (all_session->service && all_session->client_dcb && all_session->client_dcb->state == DCB_STATE_POLLING &&
-                    hkheartbeat - all_session->client_dcb->last_read > all_session->service->conn_idle_timeout * 10)
-                {
-                    dcb_close(all_session->client_dcb);
-                }
+/**
+ * Route a reply from a router to the first element in the pipeline of
+ * filters and the protocol, clearing the query deadline of the session.
+ *
+ * Any reply traffic disarms the deadline; a query streaming a large
+ * result set is making progress and is not a stuck query. The
+ * SESSION_ROUTE_REPLY macro performs the same steps in place; this
+ * function remains for callers outside the macro.
+ *
+ * @param session       The session the reply belongs to
+ * @param buf           The reply buffer
+ * @return The return value of the tail clientReply function
+ */
+int
+session_route_reply(SESSION *session, GWBUF *buf)
+{
+    session->query_active = false;
+    return (session->tail.clientReply)(session->tail.instance,
+                                       session->tail.session, buf);
+}
 
-                all_session = all_session->next;
-            }
-            spinlock_release(&session_spin);
-        }
-        spinlock_release(&timeout_lock);
+/**
+ * Timer wheel expiry function for the query deadline.
+ *
+ * If a query has been in flight without any reply traffic for longer
+ * than the query timeout of the service, the session is closed; closing
+ * the client DCB tears down the backend connections of the session
+ * through the router, freeing the backend slots the stuck query was
+ * holding. Otherwise the timer is re-armed for the point at which the
+ * query in flight could next exceed the deadline.
+ *
+ * The timer is removed in session_free(); tw_remove() guarantees that
+ * the session can not be freed under our feet while this callback
+ * executes.
+ *
+ * @param data          The session whose query deadline has expired
+ */
+static void session_query_timeout_cb(void *data)
+{
+    SESSION *session = (SESSION *)data;
+    DCB *client_dcb = session->client_dcb;
+    long timeout = session->service->query_timeout * 10;
+    long ran = hkheartbeat - session->query_start;
+
+    if (session->query_active && ran > timeout &&
+        client_dcb->state == DCB_STATE_POLLING)
+    {
+        MXS_ERROR("%s: Query from %s@%s exceeded the query timeout of %ld "
+                  "seconds, closing the session.",
+                  session->service->name,
+                  client_dcb->user ? client_dcb->user : "",
+                  client_dcb->remote ? client_dcb->remote : "",
+                  session->service->query_timeout);
+        dcb_close(client_dcb);
+    }
+    else if (session->query_active)
+    {
+        /** Still within the deadline, check again once it could pass */
+        tw_reschedule(session->query_timer, timeout - ran + 1);
+    }
+    else
+    {
+        /** No query in flight, idle until one could next time out */
+        tw_reschedule(session->query_timer, timeout + 1);
     }
 }
 
@@ -1006,6 +1750,8 @@ typedef struct
 {
     int index;
     SESSIONLISTFILTER filter;
+    char *service;      /*< Service name the sessions must belong to, or NULL */
+    char *state;        /*< State description the sessions must be in, or NULL */
 } SESSIONFILTER;
 
 /**
@@ -1020,54 +1766,58 @@ sessionRowCallback(RESULTSET *set, void *data)
 {
     SESSIONFILTER *cbdata = (SESSIONFILTER *)data;
     int i = 0;
+    int shardno;
     char buf[20];
-    RESULT_ROW *row;
+    RESULT_ROW *row = NULL;
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    /* Skip to the first non-listener if not showing listeners */
-    while (list_session && cbdata->filter == SESSION_LIST_CONNECTION &&
-           list_session->state == SESSION_STATE_LISTENER)
+    /* Walk the shards in order counting the sessions that pass the
+     * filter until the requested row is reached. Only the lock of the
+     * shard in hand is ever held. */
+    for (shardno = 0; shardno < SESSION_SHARDS && row == NULL; shardno++)
     {
-        list_session = list_session->next;
-    }
-    while (i < cbdata->index && list_session)
-    {
-        if (cbdata->filter == SESSION_LIST_CONNECTION &&
-            list_session->state !=  SESSION_STATE_LISTENER)
+        spinlock_acquire(&allSessions[shardno].lock);
+        list_session = allSessions[shardno].head;
+        while (list_session)
         {
-            i++;
+            if ((cbdata->filter == SESSION_LIST_ALL ||
+                 list_session->state != SESSION_STATE_LISTENER) &&
+                (cbdata->service == NULL ||
+                 (list_session->service && list_session->service->name &&
+                  strcmp(list_session->service->name, cbdata->service) == 0)) &&
+                (cbdata->state == NULL ||
+                 strcasecmp(session_state(list_session->state),
+                            cbdata->state) == 0))
+            {
+                if (i == cbdata->index)
+                {
+                    break;
+                }
+                i++;
+            }
+            list_session = list_session->next;
         }
-        else if (cbdata->filter == SESSION_LIST_ALL)
+        if (list_session)
         {
-            i++;
+            cbdata->index++;
+            row = resultset_make_row(set);
+            snprintf(buf,19, "%p", list_session);
+            buf[19] = '\0';
+            resultset_row_set(row, 0, buf);
+            resultset_row_set(row, 1, ((list_session->client_dcb && list_session->client_dcb->remote)
+                                       ? list_session->client_dcb->remote : ""));
+            resultset_row_set(row, 2, (list_session->service && list_session->service->name
+                                       ? list_session->service->name : ""));
+            resultset_row_set(row, 3, session_state(list_session->state));
         }
-        list_session = list_session->next;
-    }
-    /* Skip to the next non-listener if not showing listeners */
-    while (list_session && cbdata->filter == SESSION_LIST_CONNECTION &&
-           list_session->state == SESSION_STATE_LISTENER)
-    {
-        list_session = list_session->next;
+        spinlock_release(&allSessions[shardno].lock);
     }
-    if (list_session == NULL)
+    if (row == NULL)
     {
-        spinlock_release(&session_spin);
+        free(cbdata->service);
+        free(cbdata->state);
         free(data);
-        return NULL;
     }
-    cbdata->index++;
-    row = resultset_make_row(set);
-    snprintf(buf,19, "%p", list_session);
-    buf[19] = '\0';
-    resultset_row_set(row, 0, buf);
-    resultset_row_set(row, 1, ((list_session->client_dcb && list_session->client_dcb->remote)
-                               ? list_session->client_dcb->remote : ""));
-    resultset_row_set(row, 2, (list_session->service && list_session->service->name
-                               ? list_session->service->name : ""));
-    resultset_row_set(row, 3, session_state(list_session->state));
-    spinlock_release(&session_spin);
     return row;
 }
 
@@ -1078,6 +1828,26 @@ sessionRowCallback(RESULTSET *set, void *data)
  */
 RESULTSET *
 sessionGetList(SESSIONLISTFILTER filter)
+{
+    return sessionGetFilteredList(filter, NULL, NULL);
+}
+
+/**
+ * Return a resultset that has the current set of sessions in it,
+ * restricted to the sessions of one service and/or in one state.
+ *
+ * The predicates are evaluated inside the row callback while the
+ * session list is walked, so only the matching sessions are ever
+ * turned into rows.
+ *
+ * @param filter    Which classes of session to include
+ * @param service   Name of the service the sessions must belong to, or NULL
+ * @param state     State description the sessions must be in, or NULL
+ * @return A Result set
+ */
+RESULTSET *
+sessionGetFilteredList(SESSIONLISTFILTER filter, const char *service,
+                       const char *state)
 {
     RESULTSET *set;
     SESSIONFILTER *data;
@@ -1088,8 +1858,12 @@ sessionGetList(SESSIONLISTFILTER filter)
     }
     data->index = 0;
     data->filter = filter;
+    data->service = service ? strdup(service) : NULL;
+    data->state = state ? strdup(state) : NULL;
     if ((set = resultset_create(sessionRowCallback, data)) == NULL)
     {
+        free(data->service);
+        free(data->state);
         free(data);
         return NULL;
     }
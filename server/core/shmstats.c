@@ -0,0 +1,197 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file shmstats.c - Publication of the core statistics in a memory
+ * mapped file
+ *
+ * The file is created in the MaxScale data directory and sized for a
+ * fixed number of server and service slots, see shmstats.h for the
+ * layout. A housekeeper task refreshes the counters once a second; the
+ * generation field of the header is incremented before and after each
+ * refresh so that an external reader can detect a refresh that is in
+ * progress and retry, giving consistent snapshots without any
+ * synchronisation with MaxScale itself.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 03-07-2016   Mark Riddoch            Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <shmstats.h>
+#include <server.h>
+#include <service.h>
+#include <maxscale/poll.h>
+#include <housekeeper.h>
+#include <gwdirs.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** The complete mapped segment, NULL until shmstats_init has run */
+static SHMSTATS_HEADER   *shm_header = NULL;
+static SHMSTATS_SERVER   *shm_servers = NULL;
+static SHMSTATS_SERVICE  *shm_services = NULL;
+static size_t            shm_size = 0;
+
+static void shmstats_refresh(void *data);
+
+/**
+ * Create and map the statistics export file and start the housekeeper
+ * task that refreshes it.
+ *
+ * A failure to create the segment is not fatal, the statistics are
+ * simply not exported.
+ *
+ * @return Non-zero if the segment was created
+ */
+int
+shmstats_init()
+{
+    char path[PATH_MAX];
+    int  fd;
+    void *map;
+
+    shm_size = sizeof(SHMSTATS_HEADER)
+        + SHMSTATS_MAX_SERVERS * sizeof(SHMSTATS_SERVER)
+        + SHMSTATS_MAX_SERVICES * sizeof(SHMSTATS_SERVICE);
+
+    snprintf(path, PATH_MAX, "%s/%s", get_datadir(), SHMSTATS_FILENAME);
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to create statistics export file '%s': %s",
+                  path, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return 0;
+    }
+
+    if (ftruncate(fd, shm_size) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to size statistics export file '%s': %s",
+                  path, strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to map statistics export file '%s': %s",
+                  path, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return 0;
+    }
+
+    memset(map, 0, shm_size);
+    shm_header = (SHMSTATS_HEADER *)map;
+    shm_servers = (SHMSTATS_SERVER *)(shm_header + 1);
+    shm_services = (SHMSTATS_SERVICE *)(shm_servers + SHMSTATS_MAX_SERVERS);
+
+    shm_header->version = SHMSTATS_VERSION;
+    shm_header->header_size = sizeof(SHMSTATS_HEADER);
+    shm_header->server_size = sizeof(SHMSTATS_SERVER);
+    shm_header->service_size = sizeof(SHMSTATS_SERVICE);
+    shm_header->max_servers = SHMSTATS_MAX_SERVERS;
+    shm_header->max_services = SHMSTATS_MAX_SERVICES;
+
+    shmstats_refresh(NULL);
+
+    /* The magic is written last, a reader that sees it sees a
+     * completely initialised segment. */
+    __sync_synchronize();
+    shm_header->magic = SHMSTATS_MAGIC;
+
+    hktask_add("stats_export", shmstats_refresh, NULL, 1);
+
+    MXS_NOTICE("Exporting statistics in '%s'.", path);
+    return 1;
+}
+
+/**
+ * Unmap the statistics export segment. The file itself is left behind
+ * so that an agent can read the final counters.
+ */
+void
+shmstats_shutdown()
+{
+    void *map = shm_header;
+
+    if (map)
+    {
+        hktask_remove("stats_export");
+        shm_header = NULL;
+        shm_servers = NULL;
+        shm_services = NULL;
+        munmap(map, shm_size);
+    }
+}
+
+/**
+ * The housekeeper task that refreshes the exported counters.
+ *
+ * The generation count in the header is odd for the duration of the
+ * refresh, readers that require a consistent snapshot retry when they
+ * observe an odd or changed generation.
+ *
+ * @param data  The housekeeper task data, unused
+ */
+static void
+shmstats_refresh(void *data)
+{
+    SHMSTATS_HEADER *hdr = shm_header;
+
+    if (hdr == NULL)
+    {
+        return;
+    }
+
+    hdr->generation++;
+    __sync_synchronize();
+
+    hdr->n_reads = poll_get_stat(POLL_STAT_READ);
+    hdr->n_writes = poll_get_stat(POLL_STAT_WRITE);
+    hdr->n_errors = poll_get_stat(POLL_STAT_ERROR);
+    hdr->n_hangups = poll_get_stat(POLL_STAT_HANGUP);
+    hdr->n_accepts = poll_get_stat(POLL_STAT_ACCEPT);
+    hdr->evq_length = poll_get_stat(POLL_STAT_EVQ_LEN);
+    hdr->evq_max = poll_get_stat(POLL_STAT_EVQ_MAX);
+    hdr->max_qtime = poll_get_stat(POLL_STAT_MAX_QTIME);
+    hdr->max_exectime = poll_get_stat(POLL_STAT_MAX_EXECTIME);
+
+    hdr->n_servers = server_fill_shmstats(shm_servers, SHMSTATS_MAX_SERVERS);
+    hdr->n_services = service_fill_shmstats(shm_services, SHMSTATS_MAX_SERVICES);
+    hdr->timestamp = time(NULL);
+
+    __sync_synchronize();
+    hdr->generation++;
+}
@@ -24,6 +24,9 @@
  *
  * Date         Who             Description
  * 10/06/13     Mark Riddoch    Initial implementation
+ * 28/06/16     Mark Riddoch    Adaptive locking; bounded spin with backoff
+ *                              followed by a futex sleep, contention
+ *                              counters and the lock registry
  *
  * @endverbatim
  */
@@ -31,6 +34,47 @@
 #include <spinlock.h>
 #include <atomic.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * The number of spin iterations performed before a waiting thread gives
+ * up its timeslice and sleeps on the futex. Lock hold times in MaxScale
+ * are short, so most contended acquisitions complete within the spin
+ * phase; the sleep exists to stop pathological contention from burning
+ * whole cores.
+ */
+#define SPINLOCK_SPIN_LIMIT     1000
+/** Maximum number of pause instructions executed per backoff round */
+#define SPINLOCK_BACKOFF_MAX    64
+
+/**
+ * The registry of the major global locks, used by dprintAllSpinlocks to
+ * report contention. Locks register themselves via spinlock_register;
+ * registration is optional and purely diagnostic.
+ */
+typedef struct
+{
+    SPINLOCK    *lock;          /*< The registered lock */
+    const char  *name;          /*< Displayable name of the lock */
+} SPINLOCK_REGISTRATION;
+
+static SPINLOCK_REGISTRATION registered_locks[SPINLOCK_REGISTER_MAX];
+static int n_registered_locks = 0;
+static SPINLOCK register_lock = SPINLOCK_INIT;
+
+/**
+ * Processor level pause within a spin loop; reduces the power used and
+ * the pressure on the cache line holding the lock.
+ */
+static inline void
+spin_pause()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__ ("pause");
+#endif
+}
 
 /**
  * Initialise a spinlock.
@@ -41,6 +85,8 @@ void
 spinlock_init(SPINLOCK *lock)
 {
     lock->lock = 0;
+    lock->n_contended = 0;
+    lock->n_sleeps = 0;
 #if SPINLOCK_PROFILE
     lock->spins = 0;
     lock->acquired = 0;
@@ -53,6 +99,13 @@ spinlock_init(SPINLOCK *lock)
 /**
  * Acquire a spinlock.
  *
+ * The lock word takes one of three values: 0 is free, 1 is held and 2
+ * is held with at least one thread asleep on the futex. Acquisition
+ * first spins for a bounded number of iterations with exponential
+ * backoff; only if the lock is still held after that does the thread
+ * sleep in the kernel. A release that finds the lock in state 2 wakes
+ * one sleeper.
+ *
  * @param lock The spinlock to acquire
  */
 void
@@ -65,18 +118,60 @@ spinlock_acquire(SPINLOCK *lock)
 #endif
 
 #ifdef __GNUC__
-    while (__sync_lock_test_and_set(&(lock->lock), 1))
-        while (lock->lock) {
+    if (__sync_val_compare_and_swap(&(lock->lock), 0, 1) != 0)
+    {
+        int backoff = 1;
+        int spun = 0;
+        int i;
+
+        atomic_add(&(lock->n_contended), 1);
+        while (spun < SPINLOCK_SPIN_LIMIT)
+        {
+            if (lock->lock == 0 &&
+                __sync_val_compare_and_swap(&(lock->lock), 0, 1) == 0)
+            {
+                goto acquired;
+            }
+            for (i = 0; i < backoff; i++)
+            {
+                spin_pause();
+            }
+            spun += backoff;
+            if (backoff < SPINLOCK_BACKOFF_MAX)
+            {
+                backoff <<= 1;
+            }
+#if SPINLOCK_PROFILE
+            atomic_add(&(lock->spins), 1);
+            spins++;
+#endif
+        }
+
+        /*
+         * The spin phase failed; mark the lock as contended so the
+         * holder will issue a wakeup on release and sleep on the
+         * futex. A lock acquired here is left in state 2, so the
+         * release that follows performs one spurious wakeup; that
+         * is harmless and cheaper than tracking the exact state.
+         */
+        while (__sync_lock_test_and_set(&(lock->lock), 2) != 0)
+        {
+            atomic_add(&(lock->n_sleeps), 1);
+            syscall(SYS_futex, &(lock->lock), FUTEX_WAIT_PRIVATE, 2,
+                    NULL, NULL, 0);
+        }
+    }
+acquired: ;
 #else
     while (atomic_add(&(lock->lock), 1) != 0)
     {
         atomic_add(&(lock->lock), -1);
-#endif
 #if SPINLOCK_PROFILE
         atomic_add(&(lock->spins), 1);
         spins++;
 #endif
-        }
+    }
+#endif
 #if SPINLOCK_PROFILE
     if (spins)
     {
@@ -102,7 +197,15 @@ int
 spinlock_acquire_nowait(SPINLOCK *lock)
 {
 #ifdef __GNUC__
-    if (__sync_lock_test_and_set(&(lock->lock), 1)) return FALSE;
+    /*
+     * A compare and swap rather than an unconditional exchange; an
+     * exchange on a lock in the contended state (2) would overwrite
+     * the mark and lose the wakeup owed to the sleeping threads.
+     */
+    if (__sync_val_compare_and_swap(&(lock->lock), 0, 1) != 0)
+    {
+        return FALSE;
+    }
 #else
     if (atomic_add(&(lock->lock), 1) != 0)
     {
@@ -133,14 +236,77 @@ spinlock_release(SPINLOCK *lock)
 #endif
 #ifdef __GNUC__
     __sync_synchronize(); /* Memory barrier. */
-    lock->lock = 0;
+    if (__sync_lock_test_and_set(&(lock->lock), 0) == 2)
+    {
+        syscall(SYS_futex, &(lock->lock), FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
+    }
 #else
     atomic_add(&(lock->lock), -1);
 #endif
 }
 
 /**
- * Report statistics on a spinlock. This only has an effect if the
+ * Register a lock with the spinlock registry so that it is included in
+ * the output of dprintAllSpinlocks. Only the long-lived global locks
+ * should be registered; the registry has a fixed capacity and holds a
+ * pointer to the name rather than a copy of it, so the name must remain
+ * valid for the lifetime of the process. Registering the same lock
+ * twice is a no-op.
+ *
+ * @param lock  The lock to register
+ * @param name  Displayable name of the lock
+ */
+void
+spinlock_register(SPINLOCK *lock, const char *name)
+{
+    int i;
+
+    spinlock_acquire(&register_lock);
+    for (i = 0; i < n_registered_locks; i++)
+    {
+        if (registered_locks[i].lock == lock)
+        {
+            spinlock_release(&register_lock);
+            return;
+        }
+    }
+    if (n_registered_locks < SPINLOCK_REGISTER_MAX)
+    {
+        registered_locks[n_registered_locks].lock = lock;
+        registered_locks[n_registered_locks].name = name;
+        n_registered_locks++;
+    }
+    spinlock_release(&register_lock);
+}
+
+/**
+ * Fetch an entry from the spinlock registry.
+ *
+ * @param idx   Index of the entry to fetch, starting from zero
+ * @param lock  Address to return the lock pointer in
+ * @param name  Address to return the name pointer in
+ * @return Non-zero if the entry existed, zero if idx is out of range
+ */
+int
+spinlock_get_registered(int idx, SPINLOCK **lock, const char **name)
+{
+    int found = FALSE;
+
+    spinlock_acquire(&register_lock);
+    if (idx >= 0 && idx < n_registered_locks)
+    {
+        *lock = registered_locks[idx].lock;
+        *name = registered_locks[idx].name;
+        found = TRUE;
+    }
+    spinlock_release(&register_lock);
+    return found;
+}
+
+/**
+ * Report statistics on a spinlock. The contention counters are always
+ * maintained; the more detailed figures are only available if the
  * spinlock code has been compiled with the SPINLOCK_PROFILE option set.
  *
  * NB A callback function is used to return the data rather than
@@ -155,6 +321,8 @@ spinlock_release(SPINLOCK *lock)
 void
 spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
 {
+    reporter(hdl, "Contended lock acquisitions", lock->n_contended);
+    reporter(hdl, "Sleeps while waiting for lock", lock->n_sleeps);
 #if SPINLOCK_PROFILE
     reporter(hdl, "Spinlock acquired", lock->acquired);
     if (lock->acquired)
@@ -20,6 +20,19 @@
 #include <maxconfig.h>
 #include <string.h>
 #include <platform.h>
+#include <atomic.h>
+
+/** The slots of adjacent threads previously sat next to each other in
+ * memory, so every update invalidated the cache line of the neighbouring
+ * threads as well. Each slot is now padded out to a cache line of its
+ * own. */
+#define STATS_CACHE_LINE 64
+
+typedef union
+{
+    int  value;                 /*< The per-thread component of the counter */
+    char pad[STATS_CACHE_LINE]; /*< Pad the slot to a full cache line */
+} STATS_SLOT;
 
 thread_local int current_thread_id = 0;
 
@@ -52,7 +65,7 @@ void ts_stats_end()
 ts_stats_t ts_stats_alloc()
 {
     ss_dassert(initialized);
-    return calloc(thread_count, sizeof(int));
+    return calloc(thread_count, sizeof(STATS_SLOT));
 }
 
 /**
@@ -78,6 +91,17 @@ void ts_stats_set_thread_id(int id)
     current_thread_id = id;
 }
 
+/**
+ * Get the current thread id
+ *
+ * Threads that never set an id of their own report thread id zero.
+ * @return Thread id of the calling thread
+ */
+int ts_stats_get_thread_id()
+{
+    return current_thread_id;
+}
+
 /**
  * Add @c value to @c stats
  *
@@ -87,7 +111,7 @@ void ts_stats_set_thread_id(int id)
 void ts_stats_add(ts_stats_t stats, int value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] += value;
+    ((STATS_SLOT*)stats)[current_thread_id].value += value;
 }
 
 /**
@@ -100,7 +124,7 @@ void ts_stats_add(ts_stats_t stats, int value)
 void ts_stats_set(ts_stats_t stats, int value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] = value;
+    ((STATS_SLOT*)stats)[current_thread_id].value = value;
 }
 
 /**
@@ -115,7 +139,90 @@ int ts_stats_sum(ts_stats_t stats)
     int sum = 0;
     for (int i = 0; i < thread_count; i++)
     {
-        sum += ((int*)stats)[i];
+        sum += ((STATS_SLOT*)stats)[i].value;
+    }
+    return sum;
+}
+
+/** The number of slots in a generic counter. Counters may be created
+ * before the configuration, and hence the thread count, is known, so a
+ * fixed number of slots is used and thread ids beyond it wrap around.
+ * The slot updates are atomic, so slot sharing is safe, merely slower. */
+#define STATS_COUNTER_SLOTS 64
+
+/**
+ * Create a new generic counter
+ *
+ * The counter shares the slot layout of ts_stats_t but is updated with
+ * atomic operations, so it may safely be modified by threads that have
+ * no thread id of their own; those all share slot zero.
+ *
+ * @return New counter or NULL if memory allocation failed
+ */
+stats_counter_t stats_counter_alloc()
+{
+    return calloc(STATS_COUNTER_SLOTS, sizeof(STATS_SLOT));
+}
+
+/**
+ * Free a counter
+ *
+ * @param counter Counter to free
+ */
+void stats_counter_free(stats_counter_t counter)
+{
+    free(counter);
+}
+
+/**
+ * Add @c value to the slot of the calling thread of @c counter
+ *
+ * @param counter Counter to add to
+ * @param value Value to add, may be negative
+ */
+void stats_counter_add(stats_counter_t counter, int value)
+{
+    int slot = current_thread_id % STATS_COUNTER_SLOTS;
+
+    atomic_add(&((STATS_SLOT*)counter)[slot].value, value);
+}
+
+/**
+ * Increment @c counter by one
+ *
+ * @param counter Counter to increment
+ */
+void stats_counter_increment(stats_counter_t counter)
+{
+    stats_counter_add(counter, 1);
+}
+
+/**
+ * Decrement @c counter by one
+ *
+ * The decrement need not be made on the thread that made the matching
+ * increment; the slot of the decrementing thread may go negative but
+ * the sum over all slots remains correct.
+ *
+ * @param counter Counter to decrement
+ */
+void stats_counter_decrement(stats_counter_t counter)
+{
+    stats_counter_add(counter, -1);
+}
+
+/**
+ * Read the total value of the counter
+ *
+ * @param counter Counter to read
+ * @return Value of the counter
+ */
+int stats_counter_sum(stats_counter_t counter)
+{
+    int sum = 0;
+    for (int i = 0; i < STATS_COUNTER_SLOTS; i++)
+    {
+        sum += ((STATS_SLOT*)counter)[i].value;
     }
     return sum;
 }
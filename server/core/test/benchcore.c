@@ -0,0 +1,336 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file benchcore.c - Microbenchmarks for the core hot paths
+ *
+ * Unlike the correctness tests in this directory these programs measure
+ * speed. Each benchmark runs a fixed number of iterations of one core
+ * operation and reports the cost in nanoseconds per operation, so that
+ * the figures can be compared from release to release. The benchmarks
+ * are built by the "benchmarks" target and are not part of the ctest
+ * run; absolute figures depend on the machine, only trends matter.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date		Who			Description
+ * 01/07/2016	Mark Riddoch		Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <buffer.h>
+#include <modutil.h>
+#include <hashtable.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <maxscale/poll.h>
+#include <dcb.h>
+#include <test_utils.h>
+
+/**
+ * Return a monotonic timestamp in nanoseconds.
+ */
+static uint64_t
+bench_clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Report the result of one benchmark.
+ *
+ * @param name	The name of the benchmark
+ * @param iters	Number of operations that were executed
+ * @param ns	Total elapsed wall time in nanoseconds
+ */
+static void
+bench_report(const char *name, uint64_t iters, uint64_t ns)
+{
+    printf("%-36s %12lu ops %10.1f ns/op\n",
+           name, (unsigned long)iters, (double)ns / (double)iters);
+}
+
+/**
+ * Benchmark gwbuf_alloc and gwbuf_free for a pooled and an unpooled
+ * payload size.
+ */
+static void
+bench_gwbuf_alloc()
+{
+    uint64_t start, i;
+    uint64_t iters = 1000000;
+    GWBUF *buf;
+
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        buf = gwbuf_alloc(128);
+        gwbuf_free(buf);
+    }
+    bench_report("gwbuf_alloc/free 128 bytes", iters, bench_clock_ns() - start);
+
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        buf = gwbuf_alloc(16384);
+        gwbuf_free(buf);
+    }
+    bench_report("gwbuf_alloc/free 16K bytes", iters, bench_clock_ns() - start);
+}
+
+/**
+ * Benchmark gwbuf_clone and the free of the clone.
+ */
+static void
+bench_gwbuf_clone()
+{
+    uint64_t start, i;
+    uint64_t iters = 1000000;
+    GWBUF *buf, *clone;
+
+    buf = gwbuf_alloc(512);
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        clone = gwbuf_clone(buf);
+        gwbuf_free(clone);
+    }
+    bench_report("gwbuf_clone/free", iters, bench_clock_ns() - start);
+    gwbuf_free(buf);
+}
+
+#define BENCH_HASH_ENTRIES 1024
+
+static int
+bench_hashfn(void *key)
+{
+    return *(int *)key;
+}
+
+static int
+bench_cmpfn(void *key1, void *key2)
+{
+    return *(int *)key1 != *(int *)key2;
+}
+
+/**
+ * Benchmark hashtable_fetch on a table holding 1024 integer keys.
+ */
+static void
+bench_hashtable_fetch()
+{
+    static int keys[BENCH_HASH_ENTRIES];
+    HASHTABLE *ht;
+    uint64_t start, i;
+    uint64_t iters = 1000000;
+    int n;
+
+    ht = hashtable_alloc(BENCH_HASH_ENTRIES / 4, bench_hashfn, bench_cmpfn);
+    for (n = 0; n < BENCH_HASH_ENTRIES; n++)
+    {
+        keys[n] = n;
+        hashtable_add(ht, (void *)&keys[n], (void *)&keys[n]);
+    }
+
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        if (hashtable_fetch(ht, (void *)&keys[i % BENCH_HASH_ENTRIES]) == NULL)
+        {
+            fprintf(stderr, "hashtable_fetch lost a key\n");
+            exit(1);
+        }
+    }
+    bench_report("hashtable_fetch 1024 keys", iters, bench_clock_ns() - start);
+    hashtable_free(ht);
+}
+
+#define BENCH_SPIN_THREADS 2
+
+static SPINLOCK bench_spinlock = SPINLOCK_INIT;
+static uint64_t bench_spin_shared = 0;
+static uint64_t bench_spin_iters;
+
+static void
+bench_spin_worker(void *data)
+{
+    uint64_t i;
+
+    for (i = 0; i < bench_spin_iters; i++)
+    {
+        spinlock_acquire(&bench_spinlock);
+        bench_spin_shared++;
+        spinlock_release(&bench_spinlock);
+    }
+}
+
+/**
+ * Benchmark spinlock_acquire and spinlock_release with two threads
+ * contending on the same lock.
+ */
+static void
+bench_spinlock_contended()
+{
+    THREAD threads[BENCH_SPIN_THREADS];
+    uint64_t start;
+    int n;
+
+    bench_spin_iters = 1000000;
+    start = bench_clock_ns();
+    for (n = 0; n < BENCH_SPIN_THREADS; n++)
+    {
+        thread_start(&threads[n], bench_spin_worker, NULL);
+    }
+    for (n = 0; n < BENCH_SPIN_THREADS; n++)
+    {
+        thread_wait(threads[n]);
+    }
+    bench_report("spinlock acquire/release contended",
+                 bench_spin_iters * BENCH_SPIN_THREADS,
+                 bench_clock_ns() - start);
+    if (bench_spin_shared != bench_spin_iters * BENCH_SPIN_THREADS)
+    {
+        fprintf(stderr, "spinlock benchmark lost updates\n");
+        exit(1);
+    }
+}
+
+/**
+ * Benchmark the extraction of the SQL text from a COM_QUERY packet,
+ * the operation underlying the filters that inspect query text.
+ */
+static void
+bench_modutil_get_sql()
+{
+    GWBUF *buf;
+    char *sql;
+    uint64_t start, i;
+    uint64_t iters = 1000000;
+
+    buf = modutil_create_query(
+        "SELECT a, b, c FROM t1 WHERE id = 12345 AND name = 'benchmark'");
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        if ((sql = modutil_get_SQL(buf)) == NULL)
+        {
+            fprintf(stderr, "modutil_get_SQL failed\n");
+            exit(1);
+        }
+        free(sql);
+    }
+    bench_report("modutil_get_SQL", iters, bench_clock_ns() - start);
+    gwbuf_free(buf);
+}
+
+/**
+ * Benchmark splitting a packet off a read buffer, the per-statement
+ * cost of every module that works packet by packet.
+ */
+static void
+bench_modutil_next_packet()
+{
+    GWBUF *buf, *chain, *packet;
+    uint64_t start, i;
+    uint64_t iters = 500000;
+
+    buf = modutil_create_query(
+        "INSERT INTO t1 VALUES (1, 'aaaa'), (2, 'bbbb'), (3, 'cccc')");
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        chain = gwbuf_clone(buf);
+        if ((packet = modutil_get_next_MySQL_packet(&chain)) == NULL)
+        {
+            fprintf(stderr, "modutil_get_next_MySQL_packet failed\n");
+            exit(1);
+        }
+        gwbuf_free(packet);
+        gwbuf_free(chain);
+    }
+    bench_report("modutil_get_next_MySQL_packet", iters,
+                 bench_clock_ns() - start);
+    gwbuf_free(buf);
+}
+
+/**
+ * Benchmark adding a DCB to and removing it from the polling system,
+ * the cost paid by every connection entering and leaving the poll set.
+ */
+static void
+bench_poll_add_remove()
+{
+    DCB *dcb;
+    uint64_t start, i;
+    uint64_t iters = 100000;
+    int eno;
+
+    if ((dcb = dcb_alloc(DCB_ROLE_REQUEST_HANDLER)) == NULL)
+    {
+        fprintf(stderr, "dcb_alloc failed\n");
+        exit(1);
+    }
+    if ((dcb->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        fprintf(stderr, "socket creation failed: %d\n", errno);
+        exit(1);
+    }
+
+    start = bench_clock_ns();
+    for (i = 0; i < iters; i++)
+    {
+        if ((eno = poll_add_dcb(dcb)) != 0 ||
+            (eno = poll_remove_dcb(dcb)) != 0)
+        {
+            fprintf(stderr, "poll add/remove failed: %d\n", eno);
+            exit(1);
+        }
+    }
+    bench_report("poll_add_dcb/poll_remove_dcb", iters,
+                 bench_clock_ns() - start);
+}
+
+int
+main(int argc, char **argv)
+{
+    init_test_env(NULL);
+
+    printf("MaxScale core microbenchmarks\n");
+    printf("-----------------------------\n");
+    bench_gwbuf_alloc();
+    bench_gwbuf_clone();
+    bench_hashtable_fetch();
+    bench_spinlock_contended();
+    bench_modutil_get_sql();
+    bench_modutil_next_packet();
+    bench_poll_add_remove();
+
+    return 0;
+}
@@ -45,22 +45,34 @@
 static void
 read_lock(HASHTABLE *table)
 {
-	spinlock_acquire(&table->spin);
-	while (table->writelock)
+	int i;
+
+	for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
 	{
-		spinlock_release(&table->spin);
-		while (table->writelock)
-			;
-		spinlock_acquire(&table->spin);
+		HASHLOCK *lock = &table->locks[i];
+
+		spinlock_acquire(&lock->spin);
+		while (lock->writelock)
+		{
+			spinlock_release(&lock->spin);
+			while (lock->writelock)
+				;
+			spinlock_acquire(&lock->spin);
+		}
+		lock->n_readers++;
+		spinlock_release(&lock->spin);
 	}
-	table->n_readers++;
-	spinlock_release(&table->spin);
 }
 
 static void
 read_unlock(HASHTABLE *table)
 {
-	atomic_add(&table->n_readers, -1);
+	int i;
+
+	for (i = 0; i < HASHTABLE_LOCK_STRIPES; i++)
+	{
+		atomic_add(&table->locks[i].n_readers, -1);
+	}
 }
 
 static int hfun(void* key);
@@ -0,0 +1,369 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <timerwheel.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <skygw_debug.h>
+
+/**
+ * @file timerwheel.c  A hierarchical timer wheel
+ *
+ * The wheel is made up of a number of levels, each of which holds 256
+ * slots. The lowest level has a resolution of one tick, i.e. one
+ * housekeeper heartbeat of 100 milliseconds, each higher level has a
+ * resolution 256 times coarser than the one below it. A timer is placed
+ * in the coarsest level that can represent its expiry time; as the wheel
+ * turns, timers cascade down into finer levels until they expire out of
+ * level zero. This gives constant time insertion, removal and expiry
+ * independent of the number of active timers.
+ *
+ * Timer callbacks are executed on the housekeeper thread with the wheel
+ * lock released, so a callback may freely add, remove or reschedule
+ * timers, including its own. A timer that has fired and has not been
+ * rescheduled remains valid, in the TW_EXPIRED state, until the owner
+ * removes it with tw_remove().
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 12/05/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+
+#define TW_SLOT_BITS    8                       /*< log2 of slots per level */
+#define TW_SLOTS        (1 << TW_SLOT_BITS)     /*< Slots in each level */
+#define TW_SLOT_MASK    (TW_SLOTS - 1)
+#define TW_LEVELS       4                       /*< Number of wheel levels */
+
+/**
+ * The timer wheel itself. A single instance is shared by the whole
+ * process; the wheel is turned by the housekeeper thread only but
+ * timers may be added and removed from any thread.
+ */
+static struct
+{
+    WTIMER *slots[TW_LEVELS][TW_SLOTS]; /*< The slot lists of each level */
+    long now;                           /*< The current wheel tick */
+    WTIMER *active;                     /*< Timer whose callback is running */
+    THREAD tick_thread;                 /*< The thread that turns the wheel */
+    SPINLOCK lock;                      /*< Protects the wheel structures */
+} wheel;
+
+static void tw_insert(WTIMER *timer);
+static void tw_unlink(WTIMER *timer, int level, int slot);
+static void tw_cascade(int level);
+
+/**
+ * Initialise the timer wheel. Must be called before any timers are
+ * added; the housekeeper calls this before starting its thread.
+ */
+void
+tw_init()
+{
+    memset(&wheel, 0, sizeof(wheel));
+    spinlock_init(&wheel.lock);
+}
+
+/**
+ * Insert a timer into the slot appropriate for its expiry tick.
+ *
+ * The wheel lock must be held by the caller. The level is chosen as the
+ * finest one whose span still covers the delay; timers placed in the
+ * coarser levels are cascaded towards level zero as the wheel turns.
+ *
+ * @param timer The timer to insert
+ */
+static void
+tw_insert(WTIMER *timer)
+{
+    long delta = timer->due - wheel.now;
+    int level, slot;
+
+    if (delta < 1)
+    {
+        delta = 1;
+    }
+    for (level = 0; level < TW_LEVELS - 1; level++)
+    {
+        if (delta < (1L << ((level + 1) * TW_SLOT_BITS)))
+        {
+            break;
+        }
+    }
+    slot = (timer->due >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+    timer->level = level;
+    timer->slot = slot;
+    timer->state = TW_PENDING;
+    timer->prev = NULL;
+    timer->next = wheel.slots[level][slot];
+    if (timer->next)
+    {
+        timer->next->prev = timer;
+    }
+    wheel.slots[level][slot] = timer;
+}
+
+/**
+ * Unlink a timer from the slot list it currently occupies.
+ *
+ * The wheel lock must be held by the caller.
+ *
+ * @param timer The timer to unlink
+ * @param level The level the timer is linked into
+ * @param slot  The slot within the level
+ */
+static void
+tw_unlink(WTIMER *timer, int level, int slot)
+{
+    if (timer->prev)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        wheel.slots[level][slot] = timer->next;
+    }
+    if (timer->next)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = timer->prev = NULL;
+}
+
+/**
+ * Add a new timer to the wheel.
+ *
+ * The expiry function will be called on the housekeeper thread once
+ * the given number of ticks has elapsed. One tick is one housekeeper
+ * heartbeat, i.e. 100 milliseconds. The returned timer remains valid
+ * after it has fired; the owner must either reschedule it, from within
+ * the callback or otherwise, or release it with tw_remove().
+ *
+ * @param ticks Number of ticks until expiry, values less than 1 are
+ *              treated as 1
+ * @param fn    The function to call on expiry
+ * @param data  Data to pass to the expiry function
+ * @return      The new timer or NULL if memory allocation failed
+ */
+WTIMER *
+tw_add(long ticks, void (*fn)(void *), void *data)
+{
+    WTIMER *timer;
+
+    if ((timer = (WTIMER *)malloc(sizeof(WTIMER))) == NULL)
+    {
+        return NULL;
+    }
+    timer->fn = fn;
+    timer->data = data;
+    spinlock_acquire(&wheel.lock);
+    timer->due = wheel.now + (ticks < 1 ? 1 : ticks);
+    tw_insert(timer);
+    spinlock_release(&wheel.lock);
+    return timer;
+}
+
+/**
+ * Remove a timer from the wheel and free it.
+ *
+ * May be called from any thread, including from within the timer's own
+ * expiry callback. If called from the callback itself the timer is
+ * marked as doomed and the wheel frees it once the callback returns.
+ * If called from another thread while the callback is executing, the
+ * call blocks until the callback has completed, so that on return the
+ * caller may safely free the data the callback operates on. In all
+ * other cases the timer is freed before this call returns and the
+ * pointer must not be used again.
+ *
+ * @param timer The timer to remove
+ */
+void
+tw_remove(WTIMER *timer)
+{
+    if (timer == NULL)
+    {
+        return;
+    }
+    spinlock_acquire(&wheel.lock);
+    while (timer->state == TW_RUNNING &&
+           !pthread_equal(wheel.tick_thread, thread_self()))
+    {
+        /* The callback is executing on the housekeeper thread; wait for
+         * it to complete so that the caller may free the callback data. */
+        spinlock_release(&wheel.lock);
+        thread_millisleep(1);
+        spinlock_acquire(&wheel.lock);
+    }
+    switch (timer->state)
+    {
+    case TW_PENDING:
+        tw_unlink(timer, timer->level, timer->slot);
+        spinlock_release(&wheel.lock);
+        free(timer);
+        break;
+    case TW_RUNNING:
+        timer->state = TW_DOOMED;
+        spinlock_release(&wheel.lock);
+        break;
+    case TW_EXPIRED:
+        spinlock_release(&wheel.lock);
+        free(timer);
+        break;
+    default:
+        ss_dassert(false);
+        spinlock_release(&wheel.lock);
+        break;
+    }
+}
+
+/**
+ * Reschedule a timer to expire the given number of ticks from now.
+ *
+ * The timer may be pending, in which case it is moved, expired, in
+ * which case it is re-armed, or currently executing its callback, in
+ * which case it is re-armed when the callback returns. This is the
+ * mechanism by which periodic timers are implemented: the callback
+ * simply reschedules its own timer before returning.
+ *
+ * @param timer The timer to reschedule
+ * @param ticks Number of ticks until the next expiry
+ * @return      1 if the timer was rescheduled, 0 if it had been doomed
+ *              by a concurrent tw_remove()
+ */
+int
+tw_reschedule(WTIMER *timer, long ticks)
+{
+    int rval = 1;
+
+    spinlock_acquire(&wheel.lock);
+    switch (timer->state)
+    {
+    case TW_PENDING:
+        tw_unlink(timer, timer->level, timer->slot);
+        timer->due = wheel.now + (ticks < 1 ? 1 : ticks);
+        tw_insert(timer);
+        break;
+    case TW_RUNNING:
+    case TW_EXPIRED:
+        /* A running timer is reinserted by tw_tick() when the callback
+         * returns and finds the state reset to TW_PENDING. */
+        timer->due = wheel.now + (ticks < 1 ? 1 : ticks);
+        if (timer->state == TW_EXPIRED)
+        {
+            tw_insert(timer);
+        }
+        else
+        {
+            timer->state = TW_PENDING;
+        }
+        break;
+    default:
+        rval = 0;
+        break;
+    }
+    spinlock_release(&wheel.lock);
+    return rval;
+}
+
+/**
+ * Cascade the current slot of the given level down into finer levels.
+ *
+ * The wheel lock must be held by the caller. Every timer in the slot is
+ * removed and reinserted; since its remaining delay has shrunk it lands
+ * in a finer level, or in the expiry slot of level zero.
+ *
+ * @param level The level to cascade from
+ */
+static void
+tw_cascade(int level)
+{
+    int slot = (wheel.now >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+    WTIMER *timer = wheel.slots[level][slot];
+
+    wheel.slots[level][slot] = NULL;
+    while (timer)
+    {
+        WTIMER *next = timer->next;
+        tw_insert(timer);
+        timer = next;
+    }
+}
+
+/**
+ * Advance the wheel by one tick and run any timers that have expired.
+ *
+ * Called by the housekeeper thread once per heartbeat. Callbacks are
+ * executed with the wheel lock released; a callback that reschedules
+ * its own timer keeps it alive, otherwise the timer is left in the
+ * TW_EXPIRED state for the owner to remove, or freed immediately if it
+ * was doomed by tw_remove() during the callback.
+ */
+void
+tw_tick()
+{
+    WTIMER *expired, *timer;
+    int level, slot;
+
+    spinlock_acquire(&wheel.lock);
+    wheel.tick_thread = thread_self();
+    wheel.now++;
+    for (level = 1; level < TW_LEVELS; level++)
+    {
+        if ((wheel.now & ((1L << (level * TW_SLOT_BITS)) - 1)) != 0)
+        {
+            break;
+        }
+        tw_cascade(level);
+    }
+    slot = wheel.now & TW_SLOT_MASK;
+    expired = wheel.slots[0][slot];
+    wheel.slots[0][slot] = NULL;
+
+    while (expired)
+    {
+        timer = expired;
+        expired = timer->next;
+        timer->next = timer->prev = NULL;
+        timer->state = TW_RUNNING;
+        wheel.active = timer;
+        spinlock_release(&wheel.lock);
+
+        (*timer->fn)(timer->data);
+
+        spinlock_acquire(&wheel.lock);
+        wheel.active = NULL;
+        if (timer->state == TW_DOOMED)
+        {
+            free(timer);
+        }
+        else if (timer->state == TW_PENDING)
+        {
+            /* Rescheduled from within the callback */
+            tw_insert(timer);
+        }
+        else
+        {
+            timer->state = TW_EXPIRED;
+        }
+    }
+    spinlock_release(&wheel.lock);
+}
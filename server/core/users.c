@@ -20,6 +20,7 @@
 #include <string.h>
 #include <users.h>
 #include <atomic.h>
+#include <maxconfig.h>
 #include <log_manager.h>
 
 /**
@@ -33,6 +34,8 @@
  * 08/01/2014   Massimiliano Pinto      In user_alloc now we can pass function pointers for
  *                                      copying/freeing keys and values independently via
  *                                      hashtable_memory_fns() routine
+ * 05/07/2016   Mark Riddoch            Hashtable sized from the expected_users
+ *                                      capacity hint when one is configured
  *
  * @endverbatim
  */
@@ -46,6 +49,15 @@ USERS *
 users_alloc()
 {
     USERS *rval;
+    int   hashsize = USERS_HASHTABLE_DEFAULT_SIZE;
+
+    /* With an expected_users capacity hint the table is sized for the
+     * expected population up front, keeping the hash chains short
+     * without any rehashing once the users have been loaded. */
+    if (config_expected_users() > hashsize)
+    {
+        hashsize = config_expected_users();
+    }
 
     if ((rval = calloc(1, sizeof(USERS))) == NULL)
     {
@@ -53,7 +65,7 @@ users_alloc()
         return NULL;
     }
 
-    if ((rval->data = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, simple_str_hash, strcmp)) == NULL)
+    if ((rval->data = hashtable_alloc(hashsize, simple_str_hash, strcmp)) == NULL)
     {
         MXS_ERROR("[%s:%d]: Memory allocation failed.", __FUNCTION__, __LINE__);
         free(rval);
@@ -87,6 +99,10 @@ users_free(USERS *users)
     {
         hashtable_free(users->data);
     }
+    if (users->wildcards)
+    {
+        hashtable_free(users->wildcards);
+    }
     free(users);
 }
 
@@ -30,12 +30,19 @@
  * 13-06-2013   Massimiliano Pinto      MaxScale local authentication
  *                                      basics
  * 02-09-2014   Martin Brampton         Replaced C++ comments by C comments
+ * 03-07-2016   Mark Riddoch            Added gw_accept_nonblocking and socket
+ *                                      option templates to trim the syscalls
+ *                                      made for every connection
+ * 05-07-2016   Mark Riddoch            SHA1 helpers write the digest straight
+ *                                      into the caller's buffer and gw_str_xor
+ *                                      writes exactly len bytes
  *
  * @endverbatim
  */
 
 
 #include <gw.h>
+#include <netinet/tcp.h>
 #include <dcb.h>
 #include <session.h>
 #include <openssl/sha.h>
@@ -86,6 +93,117 @@ int setnonblocking(int fd)
 }
 
 
+/**
+ * Accept a connection on a listening socket with the new socket already
+ * set non-blocking.
+ *
+ * Where accept4 is available the non-blocking flag is set as part of the
+ * accept itself, saving the F_GETFL/F_SETFL fcntl pair that would
+ * otherwise be made for every one of the thousands of connections
+ * accepted each second. On other systems it falls back to accept
+ * followed by setnonblocking.
+ *
+ * @param listener_fd   The listening socket
+ * @param addr          The address of the connecting client is returned here
+ * @param addrlen       The length of the address buffer
+ * @return The file descriptor of the accepted socket, or -1 with errno set
+ */
+int
+gw_accept_nonblocking(int listener_fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+#if defined(SOCK_NONBLOCK)
+    return accept4(listener_fd, addr, addrlen, SOCK_NONBLOCK);
+#else
+    int so = accept(listener_fd, addr, addrlen);
+
+    if (so != -1)
+    {
+        setnonblocking(so);
+    }
+    return so;
+#endif
+}
+
+/**
+ * The prepared socket option templates. The options every connection
+ * receives are decided once, at compile time, and a single call of
+ * gw_apply_socket_options applies the whole template rather than each
+ * accept and connect path repeating its own run of setsockopt blocks
+ * with their error handling.
+ *
+ * TCP_QUICKACK is only set where the platform provides it; the client
+ * sockets carry a request/response dialogue for which delaying the ACK
+ * gains nothing and costs a round trip on slow starts.
+ */
+GW_SOCKOPT_TEMPLATE gw_client_sockopts =
+{
+    GW_CLIENT_SO_SNDBUF,    /*< sndbuf */
+    GW_CLIENT_SO_RCVBUF,    /*< rcvbuf */
+    1,                      /*< nodelay */
+    1                       /*< quickack */
+};
+
+GW_SOCKOPT_TEMPLATE gw_backend_sockopts =
+{
+    GW_BACKEND_SO_SNDBUF,   /*< sndbuf */
+    GW_BACKEND_SO_RCVBUF,   /*< rcvbuf */
+    1,                      /*< nodelay */
+    1                       /*< quickack */
+};
+
+/**
+ * Apply a socket option template to a socket.
+ *
+ * Each failure is logged but the remaining options are still applied;
+ * a socket that ends up with the system default buffer sizes is worth
+ * keeping.
+ *
+ * @param so    The socket to set the options on
+ * @param tmpl  The option template to apply
+ * @return 0 if every option was applied, -1 if any of them failed
+ */
+int
+gw_apply_socket_options(int so, GW_SOCKOPT_TEMPLATE *tmpl)
+{
+    char errbuf[STRERROR_BUFLEN];
+    int one = 1;
+    int rv = 0;
+
+    if (tmpl->sndbuf &&
+        setsockopt(so, SOL_SOCKET, SO_SNDBUF,
+                   &tmpl->sndbuf, sizeof(tmpl->sndbuf)) != 0)
+    {
+        MXS_ERROR("Failed to set send buffer size of socket %d. Error %d: %s",
+                  so, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        rv = -1;
+    }
+    if (tmpl->rcvbuf &&
+        setsockopt(so, SOL_SOCKET, SO_RCVBUF,
+                   &tmpl->rcvbuf, sizeof(tmpl->rcvbuf)) != 0)
+    {
+        MXS_ERROR("Failed to set receive buffer size of socket %d. Error %d: %s",
+                  so, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        rv = -1;
+    }
+    if (tmpl->nodelay &&
+        setsockopt(so, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0)
+    {
+        MXS_ERROR("Failed to set TCP_NODELAY on socket %d. Error %d: %s",
+                  so, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        rv = -1;
+    }
+#if defined(TCP_QUICKACK)
+    if (tmpl->quickack &&
+        setsockopt(so, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) != 0)
+    {
+        MXS_ERROR("Failed to set TCP_QUICKACK on socket %d. Error %d: %s",
+                  so, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        rv = -1;
+    }
+#endif
+    return rv;
+}
+
 char *gw_strend(register const char *s)
 {
     while (*s++)
@@ -95,14 +213,6 @@ char *gw_strend(register const char *s)
     return (char*) (s - 1);
 }
 
-/*****************************************
- * generate a random char
- *****************************************/
-static char gw_randomchar()
-{
-    return (char)((random_jkiss() % 78) + 30);
-}
-
 /*****************************************
  * generate a random string
  * output must be pre allocated
@@ -111,9 +221,12 @@ int gw_generate_random_str(char *output, int len)
 {
     int i;
 
+    /* Bulk fill from the generator of this thread, then fold each
+     * byte into the printable range used by the scramble */
+    random_jkiss_fill(output, len);
     for (i = 0; i < len; ++i )
     {
-        output[i] = gw_randomchar();
+        output[i] = (char)(((unsigned char)output[i] % 78) + 30);
     }
 
     output[len] = '\0';
@@ -175,6 +288,10 @@ char *gw_bin2hex(char *out, const uint8_t *in, unsigned int len)
  * XOR between 2 equal len strings
  * note that XOR(str1, XOR(str1 CONCAT str2)) == str2
  * and that  XOR(str1, str2) == XOR(str2, str1)
+ *
+ * Exactly len bytes are written; the output is binary
+ * digest data, not a string, and the callers pass
+ * buffers of exactly len bytes.
  *****************************************************/
 void gw_str_xor(uint8_t *output, const uint8_t *input1, const uint8_t *input2, unsigned int len)
 {
@@ -185,8 +302,6 @@ void gw_str_xor(uint8_t *output, const uint8_t *input1, const uint8_t *input2, u
     {
         *output++ = *input1++ ^ *input2++;
     }
-
-    *output = '\0';
 }
 
 /**********************************************************
@@ -195,10 +310,7 @@ void gw_str_xor(uint8_t *output, const uint8_t *input1, const uint8_t *input2, u
  **********************************************************/
 void gw_sha1_str(const uint8_t *in, int in_len, uint8_t *out)
 {
-    unsigned char hash[SHA_DIGEST_LENGTH];
-
-    SHA1(in, in_len, hash);
-    memcpy(out, hash, SHA_DIGEST_LENGTH);
+    SHA1(in, in_len, out);
 }
 
 /********************************************************
@@ -208,14 +320,11 @@ void gw_sha1_str(const uint8_t *in, int in_len, uint8_t *out)
 void gw_sha1_2_str(const uint8_t *in, int in_len, const uint8_t *in2, int in2_len, uint8_t *out)
 {
     SHA_CTX context;
-    unsigned char hash[SHA_DIGEST_LENGTH];
 
     SHA1_Init(&context);
     SHA1_Update(&context, in, in_len);
     SHA1_Update(&context, in2, in2_len);
-    SHA1_Final(hash, &context);
-
-    memcpy(out, hash, SHA_DIGEST_LENGTH);
+    SHA1_Final(out, &context);
 }
 
 
@@ -27,13 +27,18 @@
  * Date         Who             Description
  * 10/06/13     Mark Riddoch    Initial implementation
  * 23/06/15     Martin Brampton Alternative for C++
+ * 14/06/16     Mark Riddoch    Added atomic_or and atomic_and
  *
  * @endverbatim
  */
 
 #ifdef __cplusplus
 extern "C" int atomic_add(int *variable, int value);
+extern "C" void atomic_or(unsigned int *variable, unsigned int bits);
+extern "C" void atomic_and(unsigned int *variable, unsigned int bits);
 #else
 extern int atomic_add(int *variable, int value);
+extern void atomic_or(unsigned int *variable, unsigned int bits);
+extern void atomic_and(unsigned int *variable, unsigned int bits);
 #endif
 #endif
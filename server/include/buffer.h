@@ -44,6 +44,29 @@
  *                                      Add more buffer handling macros
  *                                      Add gwbuf_rtrim (handle chains)
  * 09/11/2014   Martin Brampton         Add dprintAllBuffers (conditional compilation)
+ * 01/07/2016   Mark Riddoch            Add gwbuf_make_writable for copy-on-write
+ *                                      of shared buffer data
+ * 02/07/2016   Mark Riddoch            Statement digest field shared by the
+ *                                      filters of a session
+ * 03/07/2016   Mark Riddoch            Iterator for reading across the links
+ *                                      of a buffer chain
+ * 03/07/2016   Mark Riddoch            Record the data area size in the shared
+ *                                      buffer for memory accounting
+ * 03/07/2016   Mark Riddoch            Byte count of the whole chain cached on
+ *                                      the head buffer
+ * 03/07/2016   Mark Riddoch            Small payloads stored inline in the
+ *                                      buffer header allocation
+ * 05/07/2016   Mark Riddoch            Buffer count of the whole chain cached
+ *                                      on the head buffer
+ * 05/07/2016   Mark Riddoch            Pooled buffers record their home thread
+ *                                      and are returned to it when freed on
+ *                                      another thread
+ * 05/07/2016   Mark Riddoch            Buffer pools primed from the
+ *                                      expected_connections capacity hint
+ * 05/07/2016   Mark Riddoch            Contiguity recorded as a buffer type
+ *                                      flag at packet ingestion so the
+ *                                      routing chain reads a tag instead of
+ *                                      re-examining the chain
  *
  * @endverbatim
  */
@@ -67,6 +90,18 @@ typedef struct buf_property
     struct buf_property     *next;
 } BUF_PROPERTY;
 
+/**
+ * The well known buffer properties. A property whose name is known at
+ * compile time is stored in a fixed slot of the buffer and read with a
+ * plain array index; the linked list of named properties remains for
+ * extensions only.
+ */
+typedef enum
+{
+    GWBUF_PROP_URL = 0,         /*< Request URL of an HTTP request */
+    GWBUF_PROP_WELLKNOWN_MAX    /*< Number of well known properties */
+} gwbuf_wkprop_t;
+
 typedef enum
 {
     GWBUF_TYPE_UNDEFINED       = 0x00,
@@ -76,7 +111,12 @@ typedef enum
     GWBUF_TYPE_SESCMD_RESPONSE = 0x08,
     GWBUF_TYPE_RESPONSE_END    = 0x10,
     GWBUF_TYPE_SESCMD          = 0x20,
-    GWBUF_TYPE_HTTP            = 0x40
+    GWBUF_TYPE_HTTP            = 0x40,
+    GWBUF_TYPE_CONTIGUOUS      = 0x80 /*< The buffer is known to be a single
+                                       * link; set where packets are formed
+                                       * and cleared when a buffer is
+                                       * appended, so consumers can skip
+                                       * gwbuf_make_contiguous */
 } gwbuf_type_t;
 
 #define GWBUF_IS_TYPE_UNDEFINED(b)       (b->gwbuf_type == 0)
@@ -86,18 +126,48 @@ typedef enum
 #define GWBUF_IS_TYPE_SESCMD_RESPONSE(b) (b->gwbuf_type & GWBUF_TYPE_SESCMD_RESPONSE)
 #define GWBUF_IS_TYPE_RESPONSE_END(b)    (b->gwbuf_type & GWBUF_TYPE_RESPONSE_END)
 #define GWBUF_IS_TYPE_SESCMD(b)          (b->gwbuf_type & GWBUF_TYPE_SESCMD)
+#define GWBUF_IS_TYPE_CONTIGUOUS(b)      (b->gwbuf_type & GWBUF_TYPE_CONTIGUOUS)
+
+/** Test the single statement and session command flags with one read */
+#define GWBUF_IS_SESCMD_STMT(b) \
+        ((b->gwbuf_type & (GWBUF_TYPE_SINGLE_STMT | GWBUF_TYPE_SESCMD)) == \
+         (GWBUF_TYPE_SINGLE_STMT | GWBUF_TYPE_SESCMD))
 
 /**
  * A structure to encapsulate the data in a form that the data itself can be
  * shared between multiple GWBUF's without the need to make multiple copies
- * but still maintain separate data pointers.
+ * but still maintain separate data pointers. The reference count is
+ * manipulated with atomic operations, so clones of a buffer may be written
+ * and freed by different threads without any external locking.
+ *
+ * Shared buffers with a non-zero size class are allocated from the pooled
+ * allocator in buffer.c; the data area then follows the structure itself
+ * in the same allocation and the buffer is returned to a per-thread free
+ * list rather than the heap when the last reference is dropped.
  */
 typedef struct
 {
     unsigned char   *data;                  /*< Physical memory that was allocated */
     int             refcount;               /*< Reference count on the buffer */
+    int             sclass;                 /*< Pool size class + 1, 0 if not pooled or
+                                             *  GWBUF_SCLASS_REFERENCED for external data */
+    unsigned int    bsize;                  /*< Size of the data area, for memory accounting */
+    int             owner;                  /*< Id of the thread that allocated a pooled
+                                             *  or inline buffer; it is returned to the
+                                             *  free lists of that thread when freed */
 } SHARED_BUF;
 
+/** Size class of a shared buffer that references memory owned by someone
+ * else, e.g. a memory mapped file. The data is not freed with the buffer;
+ * instead the done function given to gwbuf_alloc_referenced is called when
+ * the last reference is dropped. */
+#define GWBUF_SCLASS_REFERENCED (-1)
+
+/** Size class of a shared buffer that is stored inline in the same
+ * allocation as the buffer header itself. The whole allocation is
+ * released when the last reference to the shared buffer is dropped. */
+#define GWBUF_SCLASS_INLINE (-2)
+
 typedef enum
 {
     GWBUF_INFO_NONE         = 0x0,
@@ -140,15 +210,34 @@ typedef struct gwbuf
 {
     SPINLOCK        gwbuf_lock;
     struct gwbuf    *next;  /*< Next buffer in a linked chain of buffers */
-    struct gwbuf    *tail;  /*< Last buffer in a linked chain of buffers */
+    struct gwbuf    *tail;  /*< Last buffer in a linked chain of buffers,
+                             *  only maintained on the head of the chain */
+    unsigned int    chlen;  /*< Bytes of data in the whole chain, only
+                             *  maintained on the head of the chain */
+    unsigned int    chcnt;  /*< Number of buffers in the whole chain, only
+                             *  maintained on the head of the chain */
     void            *start; /*< Start of the valid data */
     void            *end;   /*< First byte after the valid data */
     SHARED_BUF      *sbuf;  /*< The shared buffer with the real data */
+    int             gwbuf_inline; /*< Non-zero if an inline shared buffer
+                             *  follows this header in one allocation */
+    int             gwbuf_owner; /*< Id of the thread the header was
+                             *  allocated on; it is returned to the free
+                             *  list of that thread when freed */
     buffer_object_t *gwbuf_bufobj; /*< List of objects referred to by GWBUF */
     gwbuf_info_t    gwbuf_info; /*< Info bits */
     gwbuf_type_t    gwbuf_type; /*< buffer's data type information */
     HINT            *hint;  /*< Hint data for this buffer */
     BUF_PROPERTY    *properties; /*< Buffer properties */
+    char            *wkprops[GWBUF_PROP_WELLKNOWN_MAX]; /*< Well known
+                             *  property slots */
+    uint64_t        digest; /*< Digest of the canonical form of the statement
+                             *  held in the buffer, 0 if not computed. Set
+                             *  once in the session routing path and shared
+                             *  by every filter that needs the query shape */
+    uint32_t        digest_id; /*< Identifier of the statement shape in the
+                             *  digest dictionary of the service, 0 if the
+                             *  shape has not been interned */
 } GWBUF;
 
 /*<
@@ -184,15 +273,38 @@ typedef struct gwbuf
      (void *)((char *)(b)->end - (bytes)));
 
 #define GWBUF_TYPE(b) (b)->gwbuf_type
+
+/*< The digest of the statement in the buffer, 0 if it has not been computed */
+#define GWBUF_DIGEST(b) ((b)->digest)
+
+/*< The interned digest identifier of the statement, 0 if not interned */
+#define GWBUF_DIGEST_ID(b) ((b)->digest_id)
+
+/**
+ * An iterator over the data held in a chain of buffers.
+ *
+ * The iterator allows the data to be read sequentially, crossing the
+ * links of the chain, without first copying the chain into a single
+ * contiguous buffer with gwbuf_make_contiguous.
+ */
+typedef struct gwbuf_iterator
+{
+    GWBUF   *buffer;        /*< The buffer within the chain currently being read */
+    size_t  offset;         /*< Offset of the next byte within that buffer */
+} GWBUF_ITERATOR;
 /*<
  * Function prototypes for the API to maniplate the buffers
  */
 extern GWBUF            *gwbuf_alloc(unsigned int size);
 extern GWBUF            *gwbuf_alloc_and_load(unsigned int size, void *data);
+extern GWBUF            *gwbuf_alloc_referenced(void *data, unsigned int size,
+                                                void (*donefun)(void *), void *arg);
 extern void             gwbuf_free(GWBUF *buf);
 extern GWBUF            *gwbuf_clone(GWBUF *buf);
 extern GWBUF            *gwbuf_append(GWBUF *head, GWBUF *tail);
+extern GWBUF            *gwbuf_append_coalesce(GWBUF *head, GWBUF *tail);
 extern GWBUF            *gwbuf_consume(GWBUF *head, unsigned int length);
+extern GWBUF            *gwbuf_detach_head(GWBUF *head, GWBUF **remainder);
 extern GWBUF            *gwbuf_trim(GWBUF *head, unsigned int length);
 extern GWBUF            *gwbuf_rtrim(GWBUF *head, unsigned int length);
 extern unsigned int     gwbuf_length(GWBUF *head);
@@ -200,11 +312,22 @@ extern int              gwbuf_count(GWBUF *head);
 extern GWBUF            *gwbuf_clone_portion(GWBUF *head, size_t offset, size_t len);
 extern GWBUF            *gwbuf_clone_transform(GWBUF *head, gwbuf_type_t type);
 extern GWBUF            *gwbuf_clone_all(GWBUF* head);
+extern GWBUF            *gwbuf_make_writable(GWBUF *buf);
 extern void             gwbuf_set_type(GWBUF *head, gwbuf_type_t type);
 extern int              gwbuf_add_property(GWBUF *buf, char *name, char *value);
 extern char             *gwbuf_get_property(GWBUF *buf, char *name);
+extern char             *gwbuf_get_wellknown_property(GWBUF *buf, gwbuf_wkprop_t prop);
 extern GWBUF            *gwbuf_make_contiguous(GWBUF *);
+extern void             gwbuf_iterator_init(GWBUF_ITERATOR *iter, GWBUF *buf);
+extern bool             gwbuf_iterator_skip(GWBUF_ITERATOR *iter, size_t nbytes);
+extern size_t           gwbuf_iterator_copy(GWBUF_ITERATOR *iter, uint8_t *dest, size_t nbytes);
+extern size_t           gwbuf_copy_data(GWBUF *buf, size_t offset, size_t nbytes, uint8_t *dest);
 extern int              gwbuf_add_hint(GWBUF *, HINT *);
+extern void             gwbuf_pool_prime(int n);
+#if defined(SS_DEBUG)
+extern void             gwbuf_zero_copy_enter();
+extern void             gwbuf_zero_copy_exit();
+#endif
 
 void                    gwbuf_add_buffer_object(GWBUF* buf,
                                                 bufobj_id_t id,
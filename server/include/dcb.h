@@ -22,7 +22,6 @@
 #include <gw_protocol.h>
 #include <gw_ssl.h>
 #include <modinfo.h>
-#include <gwbitmask.h>
 #include <skygw_utils.h>
 #include <netinet/in.h>
 
@@ -60,6 +59,20 @@ struct service;
  * 19/06/2015   Martin Brampton         Provision of persistent connections
  * 20/01/2016   Martin Brampton         Moved GWPROTOCOL to gw_protocol.h
  * 01/02/2016   Martin Brampton         Added fields for SSL and authentication
+ * 20/06/2016   Mark Riddoch            Added pooled protocol object allocation
+ * 28/06/2016   Mark Riddoch            Write queue flow control fields
+ * 28/06/2016   Martin Brampton         SSL handshake offload queue fields
+ * 29/06/2016   Mark Riddoch            Response time stamp for backend DCBs
+ * 02/07/2016   Mark Riddoch            Epoch based reclamation of zombie DCBs
+ * 03/07/2016   Mark Riddoch            Write coalescing while an event handler
+ *                                      is on the stack
+ * 03/07/2016   Mark Riddoch            DCBs are kept in a flat table sized from
+ *                                      the descriptor limit
+ * 03/07/2016   Mark Riddoch            Retained receive buffer fields
+ * 05/07/2016   Mark Riddoch            Byte counters alongside the read and
+ *                                      write counts
+ * 05/07/2016   Mark Riddoch            DCB pool primed from the
+ *                                      expected_connections capacity hint
  *
  * @endverbatim
  */
@@ -70,25 +83,30 @@ struct dcb;
  * The event queue structure used in the polling loop to maintain a queue
  * of events that need to be processed for the DCB.
  *
- *      next                    The next DCB in the event queue
- *      prev                    The previous DCB in the event queue
+ * The structure is manipulated with atomic operations only; the DCB is
+ * linked at most once into the lock-free stack of DCBs with pending
+ * events, guarded by the queued flag.
+ *
+ *      next                    The next DCB in the event stack
  *      pending_events          The events that are pending processing
  *      processing_events       The evets currently being processed
+ *      queued                  Flag set while the DCB is linked in the event stack
  *      processing              Flag to indicate the processing status of the DCB
- *      eventqlock              Spinlock to protect this structure
  *      inserted                Insertion time for logging purposes
  *      started                 Time that the processign started
+ *      inserted_us             Microsecond clock reading at queue insert,
+ *                              used for the queue wait histogram
  */
 typedef struct
 {
     struct  dcb     *next;
-    struct  dcb     *prev;
     uint32_t        pending_events;
     uint32_t        processing_events;
+    int             queued;
     int             processing;
-    SPINLOCK        eventqlock;
     unsigned long   inserted;
     unsigned long   started;
+    uint64_t        inserted_us;
 } DCBEVENTQ;
 
 #define DCBFD_CLOSED -1
@@ -100,6 +118,8 @@ typedef struct dcbstats
 {
     int     n_reads;        /*< Number of reads on this descriptor */
     int     n_writes;       /*< Number of writes on this descriptor */
+    uint64_t n_rbytes;      /*< Number of bytes read on this descriptor */
+    uint64_t n_wbytes;      /*< Number of bytes accepted for writing */
     int     n_accepts;      /*< Number of accepts on this descriptor */
     int     n_buffered;     /*< Number of buffered writes */
     int     n_high_water;   /*< Number of crosses of high water mark */
@@ -117,16 +137,17 @@ typedef struct dcbstats
  * call, the is the only way we can be sure that no polling thread is pending a wakeup or
  * processing an event that will access the DCB.
  *
- * We solve this issue by making the dcb_free routine merely mark a DCB as a zombie and
- * place it on a special zombie list. Before placing the DCB on the zombie list we create
- * a bitmask with a bit set in it for each active polling thread. Each thread will call
- * a routine to process the zombie list at the end of the polling loop. This routine
- * will clear the bit value that corresponds to the calling thread. Once the bitmask
- * is completely cleared the DCB can finally be freed and removed from the zombie list.
+ * We solve this issue with epoch based reclamation. A global epoch counter is
+ * advanced each time a DCB is retired and the retiring epoch is recorded in the
+ * DCB. Each polling thread publishes the current epoch at the point in its loop
+ * at which it holds no DCB references. A retired DCB can be freed once every
+ * active polling thread has published an epoch later than the retiring epoch,
+ * as each thread has then passed through a quiescent point since the DCB was
+ * retired and can no longer be referencing it.
  */
 typedef struct
 {
-    GWBITMASK       bitmask;        /*< The bitmask of threads */
+    uint64_t        retire_epoch;   /*< The epoch in which the DCB was retired */
     struct dcb      *next;          /*< Next pointer for the zombie list */
 } DCBMM;
 
@@ -205,6 +226,7 @@ typedef struct dcb
     dcb_role_t      dcb_role;
     SPINLOCK        dcb_initlock;
     DCBEVENTQ       evq;            /**< The event queue for this DCB */
+    int             owner;          /**< The ID of the owning polling thread, -1 if unpinned */
     int             fd;             /**< The descriptor */
     dcb_state_t     state;          /**< Current descriptor state */
     SSL_STATE       ssl_state;      /**< Current state of SSL if in use */
@@ -221,14 +243,27 @@ typedef struct dcb
     int             writeqlen;      /**< Current number of byes in the write queue */
     SPINLOCK        writeqlock;     /**< Write Queue spinlock */
     GWBUF           *writeq;        /**< Write Data Queue */
+    struct dcb      *cork_next;     /**< Next DCB on the pending flush list of
+                                     * the thread holding writes for this DCB */
+    bool            cork_pending;   /**< Writes are held in the write queue
+                                     * until the event handler returns */
     SPINLOCK        delayqlock;     /**< Delay Backend Write Queue spinlock */
     GWBUF           *delayq;        /**< Delay Backend Write Data Queue */
     GWBUF           *dcb_readqueue; /**< read queue for storing incomplete reads */
+    GWBUF           *readbuf;       /**< Retained receive buffer that reads land in */
+    int             readbuf_size;   /**< Capacity of the retained receive buffer */
+    int             readbuf_used;   /**< Bytes of the receive buffer already
+                                     * covered by views handed out */
+    int             readbuf_waste;  /**< Consecutive reads the receive buffer has
+                                     * been far oversized for */
+    int             readbuf_avg;    /**< Smoothed size of single reads, used to
+                                     * pick the receive buffer size */
     SPINLOCK        authlock;       /**< Generic Authorization spinlock */
 
     DCBSTATS        stats;          /**< DCB related statistics */
     unsigned int    dcb_server_status; /*< the server role indicator from SERVER */
-    struct dcb      *next;          /**< Next DCB in the chain of allocated DCB's */
+    struct dcb      *next;          /**< Next DCB on the free list of the thread */
+    int             dcb_slot;       /**< Index of the DCB in the table of all DCBs */
     struct dcb      *nextpersistent;   /**< Next DCB in the persistent pool for SERVER */
     time_t          persistentstart;   /**< Time when DCB placed in persistent pool */
     struct service  *service;       /**< The related service */
@@ -246,12 +281,21 @@ typedef struct dcb
     unsigned long   last_read;      /*< Last time the DCB received data */
     unsigned int    high_water;     /**< High water mark */
     unsigned int    low_water;      /**< Low water mark */
+    struct dcb      *flow_suspended; /**< The DCB whose reads this DCB's full
+                                      * write queue has suspended */
+    struct dcb      *flow_suspended_by; /**< The DCB whose full write queue has
+                                         * suspended the reads of this DCB */
     struct server   *server;        /**< The associated backend server */
+    uint64_t        response_clock; /**< Monotonic time (us) of the oldest write
+                                     * still awaiting a response from the backend,
+                                     * zero when no response is outstanding */
     SSL*            ssl;            /*< SSL struct for connection */
     bool            ssl_read_want_read;    /*< Flag */
     bool            ssl_read_want_write;    /*< Flag */
     bool            ssl_write_want_read;    /*< Flag */
     bool            ssl_write_want_write;    /*< Flag */
+    struct dcb      *ssl_offload_next; /*< Next DCB in the SSL handshake offload queue */
+    bool            ssl_offload_queued; /*< Handshake queued for, or running on, an offload thread */
     int             dcb_port;       /**< port of target server */
     skygw_chk_t     dcb_chk_tail;
 } DCB;
@@ -284,26 +328,34 @@ int           fail_accept_errno;
 #define DCB_ISZOMBIE(x)                 ((x)->state == DCB_STATE_ZOMBIE)
 #define DCB_WRITEQLEN(x)                (x)->writeqlen
 #define DCB_SET_LOW_WATER(x, lo)        (x)->low_water = (lo);
-#define DCB_SET_HIGH_WATER(x, hi)       (x)->low_water = (hi);
+#define DCB_SET_HIGH_WATER(x, hi)       (x)->high_water = (hi);
 #define DCB_BELOW_LOW_WATER(x)          ((x)->low_water && (x)->writeqlen < (x)->low_water)
 #define DCB_ABOVE_HIGH_WATER(x)         ((x)->high_water && (x)->writeqlen > (x)->high_water)
 
-#define DCB_POLL_BUSY(x)                ((x)->evq.next != NULL)
+#define DCB_POLL_BUSY(x)                ((x)->evq.queued || (x)->evq.processing)
 
 DCB *dcb_get_zombies(void);
 int dcb_write(DCB *, GWBUF *);
 DCB *dcb_alloc(dcb_role_t);
+void dcb_pool_prime(int);
 void dcb_free(DCB *);
 void dcb_free_all_memory(DCB *dcb);
+void *protocol_object_alloc(size_t size);
+void protocol_object_free(void *obj);
 DCB *dcb_connect(struct server *, struct session *, const char *);
 DCB *dcb_clone(DCB *);
 int dcb_read(DCB *, GWBUF **, int);
 int dcb_drain_writeq(DCB *);
+void dcb_write_cork();                       /* Hold writes while an event handler runs */
+void dcb_write_flush();                      /* Flush the writes held by the thread */
 void dcb_close(DCB *);
-DCB *dcb_process_zombies(int);              /* Process Zombies except the one behind the pointer */
+DCB *dcb_process_zombies(int);              /* Publish the epoch of a thread and reclaim zombies */
+void dcb_epoch_init(int);                    /* Allocate the epoch slots of the polling threads */
+void dcb_epoch_retire_thread(int);           /* Withdraw an exiting thread from epoch tracking */
 void printAllDCBs();                         /* Debug to print all DCB in the system */
 void printDCB(DCB *);                        /* Debug print routine */
 void dprintAllDCBs(DCB *);                   /* Debug to print all DCB in the system */
+void dprintAllSpinlocks(DCB *);              /* Debug to print registered spinlock stats */
 void dprintOneDCB(DCB *, DCB *);             /* Debug to print one DCB */
 void dprintDCB(DCB *, DCB *);                /* Debug to print a DCB in the system */
 void dListDCBs(DCB *);                       /* List all DCBs in the system */
@@ -0,0 +1,58 @@
+#ifndef _DIGESTDICT_H
+#define _DIGESTDICT_H
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file digestdict.h  - Interned statement digest dictionary
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 04/07/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdint.h>
+#include <spinlock.h>
+#include <hashtable.h>
+
+/**
+ * A dictionary that interns canonical statement texts, assigning each
+ * distinct text a compact 32 bit identifier exactly once. Modules that
+ * would otherwise hash or compare full statement strings repeatedly can
+ * store and compare the identifiers instead; the text of an identifier
+ * can be fetched back for display. Identifiers start at 1, 0 meaning
+ * "not interned".
+ */
+typedef struct digest_dict
+{
+    SPINLOCK    lock;       /**< Serialises lookups and insertions */
+    HASHTABLE   *ids;       /**< Map of canonical text to identifier */
+    char        **texts;    /**< Text of each identifier, slot id - 1 */
+    uint32_t    n_texts;    /**< Number of identifiers assigned */
+    uint32_t    size;       /**< Allocated slots in the text array */
+} DIGESTDICT;
+
+extern DIGESTDICT   *digestdict_alloc();
+extern void         digestdict_free(DIGESTDICT *dict);
+extern uint32_t     digestdict_intern(DIGESTDICT *dict, const char *canonical);
+extern const char   *digestdict_text(DIGESTDICT *dict, uint32_t id);
+extern uint32_t     digestdict_size(DIGESTDICT *dict);
+#endif
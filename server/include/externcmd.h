@@ -35,10 +35,22 @@ typedef struct extern_cmd_t
   pid_t child; /*< PID of the child process */
 }EXTERNCMD;
 
+/**
+ * Completion callback for an asynchronously executed command. The callback
+ * is invoked from the reaper thread once the child process has exited; the
+ * command itself is freed after the callback returns.
+ *
+ * @param cmd Command that completed
+ * @param status Exit status of the command, -1 if it was killed
+ * @param data User data given to externcmd_execute_async
+ */
+typedef void (*EXTERNCMD_CB)(EXTERNCMD* cmd, int status, void* data);
+
 char* externcmd_extract_command(const char* argstr);
 EXTERNCMD* externcmd_allocate(char* argstr);
 void externcmd_free(EXTERNCMD* cmd);
 int externcmd_execute(EXTERNCMD* cmd);
+int externcmd_execute_async(EXTERNCMD* cmd, int timeout, EXTERNCMD_CB callback, void* data);
 bool externcmd_substitute_arg(EXTERNCMD* cmd, const char* re, const char* replace);
 bool externcmd_can_execute(const char* argstr);
 bool externcmd_matches(const EXTERNCMD* cmd, const char* match);
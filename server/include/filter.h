@@ -25,6 +25,12 @@
  *
  * Date         Who                     Description
  * 27/05/2014   Mark Riddoch            Initial implementation
+ * 05/07/2016   Mark Riddoch            Optional profiling of the time spent
+ *                                      in each filter of a chain
+ * 05/07/2016   Mark Riddoch            Continuations allow a filter to park
+ *                                      a query, complete blocking work on a
+ *                                      helper thread and resume the chain
+ *                                      on a polling thread
  *
  */
 #include <dcb.h>
@@ -89,6 +95,41 @@ typedef struct filter_object
  * file modinfo.h.
  */
 #define FILTER_VERSION  {1, 1, 0}
+
+/**
+ * The number of per-thread profiling slots of a filter.
+ *
+ * The slot of a thread is selected by its thread id modulo the number
+ * of slots; threads without an id of their own all share slot zero.
+ * The slot updates are plain additions, so two threads sharing a slot
+ * may occasionally lose an update, which merely costs a little
+ * precision in the diagnostic output.
+ */
+#define FILTER_PROFILE_SLOTS 64
+
+/**
+ * A per-thread profiling slot of a filter, padded to a cache line so
+ * that the threads do not contend for the lines of adjacent slots.
+ *
+ * The cycles spent in routeQuery and clientReply are recorded twice:
+ * once for the whole call and once for the portion the filter spent
+ * calling the next element of the chain, so the time spent in the
+ * filter itself is the difference of the two.
+ */
+typedef union filter_profile_slot
+{
+    struct
+    {
+        uint64_t route_cycles;  /**< Cycles spent in routeQuery calls */
+        uint64_t route_down;    /**< Cycles routeQuery spent downstream */
+        uint64_t route_calls;   /**< Number of routeQuery calls */
+        uint64_t reply_cycles;  /**< Cycles spent in clientReply calls */
+        uint64_t reply_up;      /**< Cycles clientReply spent upstream */
+        uint64_t reply_calls;   /**< Number of clientReply calls */
+    } v;
+    char pad[64];               /**< Pad the slot to a full cache line */
+} FILTER_PROFILE_SLOT;
+
 /**
  * The definition of a filter from the configuration file.
  * This is basically the link between a plugin to load and the
@@ -103,17 +144,51 @@ typedef struct filter_def
     FILTER filter;                 /**< The runtime filter */
     FILTER_OBJECT *obj;            /**< The "MODULE_OBJECT" for the filter */
     SPINLOCK spin;                 /**< Spinlock to protect the filter definition */
+    FILTER_PROFILE_SLOT *profile;  /**< Per-thread profiling accumulators */
     struct filter_def *next;       /**< Next filter in the chain of all filters */
 } FILTER_DEF;
 
+/**
+ * A parked query of a filter.
+ *
+ * A filter whose routeQuery needs to perform blocking work, e.g. a rule
+ * reload from disk or a call into an embedded interpreter, may park the
+ * query rather than stall the polling thread. filter_park captures the
+ * query and the downstream element at which the chain should resume;
+ * the filter then returns from routeQuery without calling downstream
+ * and hands the continuation to a helper thread. When the blocking work
+ * is complete the helper calls filter_resume, which injects the parked
+ * query back into the polling system so that the rest of the chain runs
+ * on a polling thread, never on the helper.
+ *
+ * The helper may rewrite the query by replacing the queue member before
+ * it resumes. Exactly one of filter_resume and filter_discard must be
+ * called for every continuation; a filter holding parked queries when
+ * its session is closed must discard them from its closeSession entry.
+ */
+typedef struct filter_continuation
+{
+    SESSION *session;       /**< The session the query belongs to */
+    DOWNSTREAM down;        /**< The chain element to resume into */
+    GWBUF *queue;           /**< The parked query */
+    DCB *dcb;               /**< Internal DCB that carries the query back
+                             * to a polling thread */
+} FILTER_CONT;
+
+FILTER_CONT *filter_park(SESSION *, DOWNSTREAM *, GWBUF *);
+void filter_resume(FILTER_CONT *);
+void filter_discard(FILTER_CONT *);
+
 FILTER_DEF *filter_alloc(char *, char *);
 void filter_free(FILTER_DEF *);
 bool filter_load(FILTER_DEF* filter);
 FILTER_DEF *filter_find(char *);
 void filterAddOption(FILTER_DEF *, char *);
 void filterAddParameter(FILTER_DEF *, char *, char *);
-DOWNSTREAM *filterApply(FILTER_DEF *, SESSION *, DOWNSTREAM *);
-UPSTREAM *filterUpstream(FILTER_DEF *, void *, UPSTREAM *);
+DOWNSTREAM *filterApply(FILTER_DEF *, SESSION *, DOWNSTREAM *, void **);
+UPSTREAM *filterUpstream(FILTER_DEF *, void *, UPSTREAM *, void *);
+void filterProfiling(int);
+int filterProfilingActive();
 int filter_standard_parameter(char *);
 void dprintAllFilters(DCB *);
 void dprintFilter(DCB *, FILTER_DEF *);
@@ -82,9 +82,28 @@ int  do_read_dcb(DCB *dcb);
 int  do_read_10(DCB *dcb, uint8_t *buffer);
 int  MySQLWrite(DCB *dcb, GWBUF *queue);
 int  setnonblocking(int fd);
+
+/**
+ * A prepared socket option template, applied to every socket of a class
+ * (accepted client sockets, backend connections) in a single call.
+ */
+typedef struct gw_sockopt_template
+{
+    int sndbuf;     /*< SO_SNDBUF size, 0 to leave the system default */
+    int rcvbuf;     /*< SO_RCVBUF size, 0 to leave the system default */
+    int nodelay;    /*< Set TCP_NODELAY on the socket */
+    int quickack;   /*< Set TCP_QUICKACK where the platform has it */
+} GW_SOCKOPT_TEMPLATE;
+
+extern GW_SOCKOPT_TEMPLATE gw_client_sockopts;
+extern GW_SOCKOPT_TEMPLATE gw_backend_sockopts;
+
+int  gw_accept_nonblocking(int listener_fd, struct sockaddr *addr, socklen_t *addrlen);
+int  gw_apply_socket_options(int so, GW_SOCKOPT_TEMPLATE *tmpl);
 int  gw_getsockerrno(int fd);
 int  parse_bindconfig(char *, unsigned short, struct sockaddr_in *);
 int setipaddress(struct in_addr *, char *);
+void dns_cache_init();
 char* get_libdir();
 long get_processor_count();
 void clean_up_pathname(char *path);
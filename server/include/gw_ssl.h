@@ -28,6 +28,7 @@
  *
  * Date         Who                     Description
  * 27/01/16     Martin Brampton         Initial implementation
+ * 28/06/16     Martin Brampton         SSL handshake offload thread pool
  *
  * @endverbatim
  */
@@ -76,6 +77,8 @@ typedef struct ssl_listener
     bool ssl_init_done;                 /*< If SSL has already been initialized for this service */
 } SSL_LISTENER;
 
+int ssl_offload_init(int nthreads);
+bool ssl_handshake_offload(struct dcb *dcb);
 int ssl_authenticate_client(struct dcb *dcb, const char *user, bool is_capable);
 bool ssl_is_connection_healthy(struct dcb *dcb);
 bool ssl_check_data_to_process(struct dcb *dcb);
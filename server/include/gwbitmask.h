@@ -28,23 +28,29 @@
  * Date         Who             Description
  * 28/06/13     Mark Riddoch    Initial implementation
  * 17/10/15     Martin Brampton Add bitmask_render_readable
+ * 14/06/16     Mark Riddoch    Bits held in atomic words; lock-free set,
+ *                              clear and test operations
  *
  * @endverbatim
  */
 
-/* Both these numbers MUST be exact multiples of 8 */
+/* Both these numbers MUST be exact multiples of 32 */
 #define BIT_LENGTH_INITIAL      256      /**< Initial number of bits in the bitmask */
 #define BIT_LENGTH_INC          256      /**< Number of bits to add on each increment */
 
 /**
  * The bitmask structure used to store an arbitrary large bitmask
+ *
+ * The bits are held in an array of unsigned int words that are only ever
+ * modified with the atomic operations in atomic.c, so the spinlock is
+ * required only when the array itself is resized or replaced.
  */
 typedef struct
 {
-    SPINLOCK lock;          /**< Lock to protect the bitmask */
-    unsigned char *bits;    /**< Pointer to the bits themselves */
+    SPINLOCK lock;          /**< Lock held only to resize or replace the bit array */
+    unsigned int *bits;     /**< Pointer to the words holding the bits */
     int length;          /**< The number of bits in the bitmask */
-    int size;            /**< The number of bytes in the bitmask */
+    int size;            /**< The number of words in the bitmask */
 
 } GWBITMASK;
 
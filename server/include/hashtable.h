@@ -30,6 +30,13 @@
  * 23/07/2013   Mark Riddoch            Addition of iterator mechanism
  * 08/01/2014   Massimiliano Pinto      Added function pointers for key/value copy and free
  *                                      the routine hashtable_memory_fns() changed accordingly
+ * 26/05/2016   Mark Riddoch            Striped locks to allow concurrent access
+ *                                      to different hash chains
+ * 03/07/2016   Mark Riddoch            Built-in integer and string key modes
+ *                                      that avoid the indirect hash and compare
+ *                                      calls in the probe loops
+ * 05/07/2016   Mark Riddoch            Reference counted snapshots for
+ *                                      iteration without holding table locks
  *
  * @endverbatim
  */
@@ -67,6 +74,74 @@ typedef struct hashiterator
  */
 typedef void *(*HASHMEMORYFN)(void *);
 
+/**
+ * An entry of a hashtable snapshot.
+ */
+typedef struct hashsnapentry
+{
+    void *key;              /**< The key of the entry */
+    void *value;            /**< The value associated with the key */
+} HASHSNAPENTRY;
+
+/**
+ * A frozen, reference counted view of a hashtable.
+ *
+ * A snapshot is built by walking the table one lock stripe at a time
+ * and copying the entries into a flat array with the copy functions of
+ * the table, so writers are only ever held up for the stripe currently
+ * being copied. Iterating the snapshot afterwards touches no table
+ * locks at all, which lets persistence and diagnostics walk a large
+ * table without blocking the threads using it.
+ *
+ * For a table without registered copy functions the snapshot holds the
+ * same pointers as the table, so the caller must not use it beyond the
+ * life of the entries, just as with the plain iterator.
+ */
+typedef struct hashsnapshot
+{
+    HASHSNAPENTRY *entries; /**< Flat array of the snapshotted entries */
+    int n_entries;          /**< Number of entries in the snapshot */
+    int refcount;           /**< References held on the snapshot */
+    HASHMEMORYFN kfreefn;   /**< Key free function captured from the table */
+    HASHMEMORYFN vfreefn;   /**< Value free function captured from the table */
+} HASHSNAPSHOT;
+
+/**
+ * The number of lock stripes in each hashtable.
+ *
+ * Hash chains are mapped onto the stripes by chain index modulo the
+ * number of stripes, so operations on different chains proceed in
+ * parallel rather than serialising on a single table lock.
+ */
+#define HASHTABLE_LOCK_STRIPES 16
+
+/**
+ * A single lock stripe, providing the multiple reader, single writer
+ * locking for the hash chains mapped onto it.
+ */
+typedef struct hashlock
+{
+    SPINLOCK spin;  /**< Protects the two counts below */
+    int n_readers;  /**< Number of clients reading the stripe */
+    int writelock;  /**< The stripe is locked by a writer */
+} HASHLOCK;
+
+/**
+ * The key handling mode of a hashtable.
+ *
+ * A table allocated with hashtable_alloc() uses the user supplied hash
+ * and comparison functions, an indirect call per probe. The integer and
+ * string modes hash and compare the keys with fixed inline code instead:
+ * an integer key is the key pointer value itself, hashed with Fibonacci
+ * hashing, and a string key is a NUL terminated string.
+ */
+typedef enum hashtable_key_mode
+{
+    HASHTABLE_KEY_CUSTOM = 0,   /**< User supplied hash and compare functions */
+    HASHTABLE_KEY_INT,          /**< The key is the pointer value itself */
+    HASHTABLE_KEY_STR           /**< The key is a NUL terminated string */
+} HASHKEYMODE;
+
 /**
  * The general purpose hashtable struct.
  */
@@ -77,15 +152,15 @@ typedef struct hashtable
 #endif
     int hashsize;                 /**< The number of HASHENTRIES */
     HASHENTRIES **entries;        /**< The entries themselves */
+    HASHKEYMODE kmode;            /**< How keys are hashed and compared */
     int (*hashfn)(void *);        /**< The hash function */
     int (*cmpfn)(void *, void *); /**< The key comparison function */
     HASHMEMORYFN kcopyfn;         /**< Optional key copy function */
     HASHMEMORYFN vcopyfn;         /**< Optional value copy function */
     HASHMEMORYFN kfreefn;         /**< Optional key free function */
     HASHMEMORYFN vfreefn;         /**< Optional value free function */
-    SPINLOCK spin;                /**< Internal spinlock for the hashtable */
-    int n_readers;                /**< Number of clients reading the table */
-    int writelock;                /**< The table is locked by a writer */
+    HASHLOCK locks[HASHTABLE_LOCK_STRIPES];
+                                  /**< Striped locks for the hash chains */
     bool ht_isflat;               /**< Indicates whether hashtable is in stack or heap */
     int n_elements;               /**< Number of added elements */
 #if defined(SS_DEBUG)
@@ -94,6 +169,10 @@ typedef struct hashtable
 } HASHTABLE;
 
 extern HASHTABLE *hashtable_alloc(int, int (*hashfn)(), int (*cmpfn)());
+extern HASHTABLE *hashtable_alloc_int(int size);
+/**< Allocate a hashtable with integer keys */
+extern HASHTABLE *hashtable_alloc_str(int size);
+/**< Allocate a hashtable with string keys */
 HASHTABLE *hashtable_alloc_flat(HASHTABLE* target,
                                 int size,
                                 int (*hashfn)(),
@@ -132,5 +211,13 @@ extern HASHITERATOR *hashtable_iterator(HASHTABLE *);
 extern void *hashtable_next(HASHITERATOR *);
 /**< Return the key of the hash table iterator */
 extern void hashtable_iterator_free(HASHITERATOR *);
+extern HASHSNAPSHOT *hashtable_snapshot(HASHTABLE *);
+/**< Build a frozen view of the hashtable */
+extern HASHSNAPSHOT *hashtable_snapshot_get(HASHSNAPSHOT *);
+/**< Take an additional reference on a snapshot */
+extern void hashtable_snapshot_release(HASHSNAPSHOT *);
+/**< Release a reference, freeing the snapshot on the last one */
+extern void *hashtable_snapshot_next(HASHSNAPSHOT *, int *, void **);
+/**< Return the next key, and optionally value, of a snapshot */
 extern int hashtable_size(HASHTABLE *table);
 #endif
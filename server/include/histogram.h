@@ -0,0 +1,63 @@
+#ifndef _HISTOGRAM_HG
+#define _HISTOGRAM_HG
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file histogram.h  - Log-linear latency histograms
+ *
+ * A histogram records microsecond durations into log-linear buckets:
+ * each power-of-two magnitude is divided into a fixed number of linear
+ * sub-buckets, giving a constant relative error over the whole value
+ * range at a fraction of the memory a linear histogram would need.
+ *
+ * Recording is lock free. Like the generic counters in statistics.h, a
+ * histogram holds one set of buckets per thread slot, so the polling
+ * threads increment their own buckets without any shared state; the
+ * per-thread buckets are merged only when the histogram is read for
+ * display.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 29/06/16     Mark Riddoch    Initial implementation
+ * 03/07/16     Mark Riddoch    Per-thread breakdown of a histogram
+ *
+ * @endverbatim
+ */
+
+#include <stdint.h>
+
+struct dcb;
+
+/**
+ * A log-linear histogram of microsecond durations, split into
+ * per-thread slots that are merged on read.
+ */
+typedef void *histogram_t;
+
+histogram_t histogram_alloc();
+void histogram_free(histogram_t hist);
+void histogram_record(histogram_t hist, uint64_t duration);
+uint64_t histogram_count(histogram_t hist);
+uint64_t histogram_clock_us();
+void dprintHistogram(struct dcb *dcb, histogram_t hist);
+void dprintHistogramThreads(struct dcb *dcb, histogram_t hist);
+
+#endif
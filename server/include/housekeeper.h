@@ -20,6 +20,7 @@
 #include <time.h>
 #include <dcb.h>
 #include <hk_heartbeat.h>
+#include <timerwheel.h>
 /**
  * @file housekeeper.h A mechanism to have task run periodically
  *
@@ -28,6 +29,7 @@
  *
  * Date         Who             Description
  * 29/08/14     Mark Riddoch    Initial implementation
+ * 12/05/16     Mark Riddoch    Tasks scheduled via the timer wheel
  *
  * @endverbatim
  */
@@ -49,6 +51,7 @@ typedef struct hktask
     int frequency;            /*< How often to call the tasks (seconds) */
     time_t nextdue;           /*< When the task should be next run */
     HKTASK_TYPE type;         /*< The task type */
+    WTIMER *timer;            /*< The timer wheel entry for the task */
     struct hktask *next;      /*< Next task in the list */
 } HKTASK;
 
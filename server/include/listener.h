@@ -28,6 +28,8 @@
  *
  * Date         Who                     Description
  * 19/01/16     Martin Brampton         Initial implementation
+ * 05/07/16     Mark Riddoch            Per thread SO_REUSEPORT listener
+ *                                      shards
  *
  * @endverbatim
  */
@@ -50,6 +52,10 @@ typedef struct servlistener
     char *authenticator;        /**< Name of authenticator */
     SSL_LISTENER *ssl;          /**< Structure of SSL data or NULL */
     DCB *listener;              /**< The DCB for the listener */
+    DCB **shards;               /**< Additional SO_REUSEPORT listening
+                                 * sockets, one per polling thread beyond
+                                 * the first, or NULL */
+    int n_shards;               /**< Number of entries in shards */
     struct  servlistener *next; /**< Next service protocol */
 } SERV_LISTENER;
 
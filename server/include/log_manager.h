@@ -19,6 +19,7 @@
 #define LOG_MANAGER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <syslog.h>
 #include <unistd.h>
 
@@ -93,6 +94,10 @@ int mxs_log_flush();
 int mxs_log_flush_sync();
 int mxs_log_rotate();
 
+void mxs_log_suppression_stats(void (*cb)(void* userdata, const char* file,
+                                          int line, uint64_t suppressed),
+                               void* userdata);
+
 int  mxs_log_set_priority_enabled(int priority, bool enabled);
 void mxs_log_set_syslog_enabled(bool enabled);
 void mxs_log_set_maxlog_enabled(bool enabled);
@@ -33,6 +33,13 @@
  * 23/05/14     Massimiliano Pinto      Added id to global configuration
  * 17/10/14     Mark Riddoch            Added poll tuning configuration parameters
  * 05/03/15     Massimiliano Pinto      Added sysname, release, sha1_mac to gateway struct
+ * 28/06/16     Mark Riddoch            Added write queue high and low water marks
+ * 01/07/16     Mark Riddoch            Added thread_affinity for pinning the
+ *                                      polling threads to CPUs
+ * 03/07/16     Mark Riddoch            Added memory_budget global parameter
+ * 05/07/16     Mark Riddoch            Added accept_threads global parameter
+ * 05/07/16     Mark Riddoch            Capacity hints for pre-sizing the user,
+ *                                      session and connection structures
  *
  * @endverbatim
  */
@@ -119,6 +126,12 @@ typedef struct
     unsigned long id;                                  /**< MaxScale ID */
     unsigned int  n_nbpoll;                            /**< Tune number of non-blocking polls */
     unsigned int  pollsleep;                           /**< Wait time in blocking polls */
+    int           thread_local_polls;                  /**< Use an epoll instance per polling thread */
+    int           *thread_affinity;                    /**< CPUs the polling threads are pinned to */
+    int           n_thread_affinity;                   /**< Number of CPUs in thread_affinity */
+    int           ssl_offload_threads;                 /**< Number of SSL handshake offload threads */
+    int           accept_threads;                      /**< Number of polling threads dedicated to
+                                                        * accepting and authenticating clients */
     int           syslog;                              /**< Log to syslog */
     int           maxlog;                              /**< Log to MaxScale's own logs */
     int           log_to_shm;                          /**< Write log-file to shared memory */
@@ -126,6 +139,12 @@ typedef struct
     unsigned int  auth_read_timeout;                   /**< Read timeout for the user authentication */
     unsigned int  auth_write_timeout;                  /**< Write timeout for the user authentication */
     char          qc_name[PATH_MAX];                   /**< The name of the query classifier to load */
+    unsigned int  writeq_high_water;                   /**< High water mark of dcb write queue */
+    unsigned int  writeq_low_water;                    /**< Low water mark of dcb write queue */
+    uint64_t      memory_budget;                       /**< Memory budget in bytes, 0 = no budget */
+    int           expected_sessions;                   /**< Capacity hint: steady state sessions, 0 = none */
+    int           expected_connections;                /**< Capacity hint: steady state connections, 0 = none */
+    int           expected_users;                      /**< Capacity hint: entries in the user tables, 0 = none */
 } GATEWAY_CONF;
 
 
@@ -157,8 +176,18 @@ int                 config_reload();
 bool                config_set_qualified_param(CONFIG_PARAMETER* param,
                                                void* val,
                                                config_param_type_t type);
+int                 config_accept_threads();
+int                 config_ssl_offload_threads();
 int                 config_threadcount();
+int                 config_thread_affinity(int thread_id);
+int                 config_thread_local_polls();
 int                 config_truth_value(char *);
+unsigned int        config_writeq_high_water();
+unsigned int        config_writeq_low_water();
+uint64_t            config_memory_budget();
+int                 config_expected_sessions();
+int                 config_expected_connections();
+int                 config_expected_users();
 void                free_config_parameter(CONFIG_PARAMETER* p1);
 bool                is_internal_service(const char *router);
 
@@ -30,6 +30,17 @@
  * Date         Who             Description
  * 19/06/13     Mark Riddoch    Initial implementation
  * 17/10/15     Martin Brampton Declare fake event functions
+ * 19/05/16     Mark Riddoch    Least loaded thread assignment of DCBs
+ * 28/06/16     Mark Riddoch    Suspension of read events for write queue
+ *                              flow control
+ * 04/07/16     Mark Riddoch    Per thread decayed load averages
+ * 05/07/16     Mark Riddoch    SO_REUSEPORT sharding of listeners across
+ *                              the polling threads
+ * 05/07/16     Mark Riddoch    Result set of the polling thread status
+ * 05/07/16     Mark Riddoch    Promotion of an authenticated client from
+ *                              an accept thread to a serving thread
+ * 05/07/16     Mark Riddoch    Per thread activity snapshots and a stall
+ *                              counter for the housekeeper watchdog
  *
  * @endverbatim
  */
@@ -49,12 +60,59 @@ typedef enum
     POLL_STAT_EVQ_PENDING,
     POLL_STAT_EVQ_MAX,
     POLL_STAT_MAX_QTIME,
-    POLL_STAT_MAX_EXECTIME
+    POLL_STAT_MAX_EXECTIME,
+    POLL_STAT_STALL
 } POLL_STAT;
 
+/** The decay horizons of the per-thread load tracking */
+#define POLL_LOAD_100MS 0
+#define POLL_LOAD_1S    1
+#define POLL_LOAD_10S   2
+#define POLL_LOAD_HORIZONS 3
+
+/**
+ * A snapshot of the load of one polling thread.
+ *
+ * Each polling thread maintains exponentially decayed averages of its
+ * event rate and of the fraction of wall time it spends processing
+ * events, at three horizons: 100 milliseconds, 1 second and 10 seconds.
+ * The short horizon reacts to bursts, the long one gives a stable
+ * baseline; subsystems such as thread rebalancing read them through
+ * poll_thread_load().
+ */
+typedef struct poll_load
+{
+    double event_rate[POLL_LOAD_HORIZONS];   /**< Descriptor events per second */
+    double busy_fraction[POLL_LOAD_HORIZONS]; /**< Fraction of time processing, 0.0 - 1.0 */
+} POLL_LOAD;
+
+/**
+ * A snapshot of the current activity of one polling thread, used by the
+ * housekeeper watchdog to detect threads that have been stuck in an
+ * event handler. The cycles counter advances at the start of every pass
+ * of the polling loop; a busy thread whose counter does not advance
+ * between two snapshots has made no progress in the interval.
+ */
+typedef struct poll_activity
+{
+    int      busy;      /**< The thread is processing an event or zombies */
+    int      tid;       /**< Kernel task id of the thread, for /proc access */
+    uint64_t cycles;    /**< Poll cycles the thread has completed */
+    DCB      *dcb;      /**< The DCB being processed, may be NULL */
+    uint32_t event;     /**< The epoll event bits being processed */
+} POLL_ACTIVITY;
+
 extern  void            poll_init();
+extern  int             poll_nthreads();
+extern  int             poll_listener_shards();
+extern  void            poll_pin_dcb(DCB *dcb, int thread);
+extern  void            poll_promote_dcb(DCB *dcb);
+extern  void            poll_thread_load(int thread, POLL_LOAD *load);
+extern  int             poll_thread_activity(int thread, POLL_ACTIVITY *activity);
+extern  void            poll_count_stall();
 extern  int             poll_add_dcb(DCB *);
 extern  int             poll_remove_dcb(DCB *);
+extern  void            poll_unassign_dcb(DCB *);
 extern  void            poll_waitevents(void *);
 extern  void            poll_shutdown();
 extern  GWBITMASK       *poll_bitmask();
@@ -67,8 +125,12 @@ extern  void            dShowEventQ(DCB *dcb);
 extern  void            dShowEventStats(DCB *dcb);
 extern  int             poll_get_stat(POLL_STAT stat);
 extern  RESULTSET       *eventTimesGetList();
+extern  RESULTSET       *pollThreadsGetList();
 extern  void            poll_fake_event(DCB *dcb, uint32_t ev);
 extern  void            poll_fake_hangup_event(DCB *dcb);
 extern  void            poll_fake_write_event(DCB *dcb);
 extern  void            poll_fake_read_event(DCB *dcb);
+extern  int             poll_suspend_read_events(DCB *dcb);
+extern  int             poll_resume_read_events(DCB *dcb);
+extern  DCB             *poll_current_dcb();
 #endif
@@ -24,6 +24,7 @@
 #endif
 
 #include <pcre2.h>
+#include <stdbool.h>
 
 /**
  * @file maxscale_pcre2.h - Utility functions for regular expression matching
@@ -34,6 +35,7 @@
  *
  * Date       Who           Description
  * 30-10-2015 Markus Makela Initial implementation
+ * 09-06-2016 Markus Makela Added mxs_pcre2_jit_enable
  * @endverbatim
  */
 
@@ -48,5 +50,6 @@ mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject,
                                         const char *replace, char** dest, size_t* size);
 mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subject,
                                           int options, int* error);
+bool mxs_pcre2_jit_enable(pcre2_code *re);
 
 #endif
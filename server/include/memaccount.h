@@ -0,0 +1,58 @@
+#ifndef _MEMACCOUNT_H
+#define _MEMACCOUNT_H
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+#include <stdint.h>
+#include <dcb.h>
+
+/**
+ * @file memaccount.h The memory accounting of the major subsystems
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 03/07/16     Mark Riddoch            Initial implementation
+ *
+ * @endverbatim
+ */
+
+/**
+ * The subsystems for which memory is accounted separately. Each
+ * subsystem reports its allocations and releases with memacct_add.
+ */
+typedef enum
+{
+    MEM_ACCT_BUFFER = 0,    /*< Buffer headers and shared data buffers */
+    MEM_ACCT_DCB,           /*< Descriptor control blocks */
+    MEM_ACCT_SESSION,       /*< Session objects and session arenas */
+    MEM_ACCT_HASHTABLE,     /*< Hash table entries */
+    MEM_ACCT_CACHE,         /*< Result sets held by the cache filter */
+    MEM_ACCT_MAX            /*< Number of accounted subsystems */
+} MEMACCT_SUBSYS;
+
+extern void         memacct_init();
+extern void         memacct_add(MEMACCT_SUBSYS subsys, int64_t bytes);
+extern int64_t      memacct_total(MEMACCT_SUBSYS subsys);
+extern int64_t      memacct_grand_total();
+extern const char   *memacct_subsys_name(MEMACCT_SUBSYS subsys);
+extern void         memacct_set_budget(uint64_t bytes);
+extern int          memacct_register_pressure(void (*fn)(void *), void *arg);
+extern void         dprintMemory(DCB *dcb);
+
+#endif
@@ -26,10 +26,15 @@
  *
  * Date         Who             Description
  * 26/09/14     Mark Riddoch    Initial implementation
+ * 03/07/16     Mark Riddoch    Flight recorder of binary trace events in
+ *                              per thread rings
  *
  * @endverbatim
  */
 #include <spinlock.h>
+#include <rdtsc.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef enum { ML_INT, ML_LONG, ML_LONGLONG, ML_STRING } MEMLOGTYPE;
 
@@ -64,4 +69,54 @@ extern void    memlog_log(MEMLOG *, void *);
 extern void    memlog_flush_all();
 extern void    memlog_flush(MEMLOG *);
 
+/**
+ * The flight recorder.
+ *
+ * Each thread records binary events into a fixed size ring of its own, so
+ * recording an event is a time-stamp counter read and three stores into
+ * thread local memory with no locking and no formatting. The rings can be
+ * dumped on demand with the maxadmin "show trace" command or are written to
+ * a file when MaxScale receives a fatal signal, giving the event history
+ * leading up to a latency incident or crash without the cost of running
+ * with MXS_INFO logging enabled.
+ */
+typedef enum
+{
+    TRC_SESSION_START = 1,  /*< A session was created, arg1 = session */
+    TRC_SESSION_END,        /*< A session was freed, arg1 = session */
+    TRC_ROUTE_QUERY,        /*< A query was handed to the router,
+                             * arg1 = session, arg2 = buffer length */
+    TRC_POLL_EVENT,         /*< A polled I/O event was processed,
+                             * arg1 = DCB, arg2 = epoll event bits */
+    TRC_POLL_ERROR,         /*< An error or hangup event was raised,
+                             * arg1 = DCB, arg2 = errno */
+    TRC_DCB_CLOSE           /*< A DCB was closed, arg1 = DCB */
+} TRACE_EVENT_TYPE;
+
+typedef struct
+{
+    CYCLES       tsc;       /*< Time-stamp counter when the event was recorded */
+    uint32_t     event;     /*< The TRACE_EVENT_TYPE of the event */
+    uintptr_t    arg1;      /*< Event specific argument, typically a pointer */
+    uintptr_t    arg2;      /*< Event specific argument */
+} TRACE_EVENT;
+
+/** Number of events retained in the ring of each thread */
+#define TRACE_RING_EVENTS 8192
+
+typedef struct trace_ring
+{
+    TRACE_EVENT       *events;  /*< The ring of recorded events */
+    unsigned int      offset;   /*< Index the next event is written at */
+    int               wrapped;  /*< The ring has wrapped at least once */
+    unsigned long     tid;      /*< The thread that owns this ring */
+    struct trace_ring *next;    /*< Next ring in the list of all rings */
+} TRACE_RING;
+
+struct dcb;
+
+extern void trace_event(unsigned int event, uintptr_t arg1, uintptr_t arg2);
+extern void trace_dump(FILE *fp);
+extern void dprintTraceRings(struct dcb *dcb);
+
 #endif
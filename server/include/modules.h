@@ -40,6 +40,7 @@ EXTERN_C_BLOCK_BEGIN
  *					shutdown
  * 19/02/15	Mark Riddoch		Addition of moduleGetList
  * 26/02/15	Massimiliano Pinto	Addition of module_feedback_send
+ * 01/07/16	Mark Riddoch		Hashed registry for module name lookups
  *
  * @endverbatim
  */
@@ -54,6 +55,8 @@ typedef struct modules {
 		*info;		/**< The module information */
 	struct	modules
 		*next;		/**< Next module in the linked list */
+	struct	modules
+		*hash_next;	/**< Next module in the same registry hash chain */
 } MODULES;
 
 /**
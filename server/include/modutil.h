@@ -28,6 +28,7 @@
  * 04/06/14     Mark Riddoch            Initial implementation
  * 24/06/14     Mark Riddoch            Add modutil_MySQL_Query to enable multipacket queries
  * 24/10/14     Massimiliano Pinto      Add modutil_send_mysql_err_packet to send a mysql ERR_Packet
+ * 03/07/16     Mark Riddoch            Add modutil_packet_offsets batch boundary scanner
  *
  * @endverbatim
  */
@@ -66,6 +67,8 @@ GWBUF*          modutil_create_mysql_err_msg(int             packet_number,
                                              const char      *statemsg,
                                              const char      *msg);
 int modutil_count_signal_packets(GWBUF*,int,int,int*);
+int modutil_packet_offsets(uint8_t *data, uint32_t len, uint32_t *offsets,
+                           int max_offsets, uint32_t *bytes);
 mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char* string);
 
 /** Character and token searching functions */
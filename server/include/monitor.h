@@ -123,6 +123,9 @@ typedef enum
 
 #define MON_ARG_MAX 8192
 
+/** Seconds a monitor script may run before it is killed */
+#define MON_SCRIPT_TIMEOUT 90
+
 #define DEFAULT_CONNECT_TIMEOUT 3
 #define DEFAULT_READ_TIMEOUT 1
 #define DEFAULT_WRITE_TIMEOUT 2
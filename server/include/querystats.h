@@ -0,0 +1,49 @@
+#ifndef _QUERYSTATS_HG
+#define _QUERYSTATS_HG
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file querystats.h  - Per query shape execution statistics
+ *
+ * An approximate, service-wide digest of the query shapes flowing
+ * through MaxScale. Each polling thread records into a table of its
+ * own, so the query path takes no shared locks; the per-thread tables
+ * are merged only when a diagnostic command reads the digest.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 29/06/16     Mark Riddoch    Initial implementation
+ * 02/07/16     Mark Riddoch    Slots selected by the shared statement digest
+ *
+ * @endverbatim
+ */
+
+#include <stdint.h>
+
+struct dcb;
+struct service;
+
+void querystats_record(struct service *service, char *canonical,
+                       uint64_t digest, uint64_t duration);
+void dprintHotQueries(struct dcb *dcb);
+void dprintQueryLatency(struct dcb *dcb);
+
+#endif
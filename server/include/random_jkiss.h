@@ -30,6 +30,7 @@ extern "C" {
 #endif
 
 extern unsigned int random_jkiss(void);
+extern void random_jkiss_fill(void *buf, unsigned int len);
 
 #ifdef	__cplusplus
 }
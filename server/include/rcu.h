@@ -0,0 +1,75 @@
+#ifndef _RCU_H
+#define _RCU_H
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file rcu.h Epoch based protection for read-mostly data structures
+ *
+ * Several shared structures within MaxScale, such as the module registry
+ * and the filter chains of the services, are read on every session or
+ * query but only ever modified by configuration changes. Guarding such
+ * structures with a lock makes every reader pay for a writer that almost
+ * never arrives.
+ *
+ * The scheme implemented here lets readers traverse the structure without
+ * taking any lock. A reader brackets its traversal with rcu_read_lock()
+ * and rcu_read_unlock(), which merely record the global epoch in a slot
+ * private to the calling thread. A writer makes its modification by
+ * building the new version of the data aside and publishing it with a
+ * single pointer assignment, then calls rcu_synchronize(), which advances
+ * the epoch and waits until no reader remains in a section that began
+ * before the change was published. After that no reader can hold a
+ * reference to the old version and it may be freed.
+ *
+ * Writers must serialise against each other with their own lock; the
+ * epoch machinery only orders readers against reclamation.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 03/07/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+
+/**
+ * Publish a pointer to a new version of a structure. The barrier ensures
+ * that the initialisation of the structure is visible to other processors
+ * before the pointer to it is.
+ */
+#define rcu_assign_pointer(p, v)                \
+        do {                                    \
+                __sync_synchronize();           \
+                (p) = (v);                      \
+        } while (0)
+
+/**
+ * Read a pointer published with rcu_assign_pointer() within a read side
+ * section. The volatile access forces the pointer to be re-read from
+ * memory rather than cached across the section by the compiler.
+ */
+#define rcu_dereference(p)                      \
+        (*(void * volatile *)&(p))
+
+extern void rcu_read_lock();
+extern void rcu_read_unlock();
+extern void rcu_synchronize();
+
+#endif
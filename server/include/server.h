@@ -19,6 +19,7 @@
  */
 #include <dcb.h>
 #include <resultset.h>
+#include <histogram.h>
 
 /**
  * @file service.h
@@ -45,12 +46,24 @@
  * 19/02/15     Mark Riddoch            Addition of serverGetList
  * 01/06/15     Massimiliano Pinto      Addition of server_update_address/port
  * 19/06/15     Martin Brampton         Extra fields for persistent connections, CHK_SERVER
+ * 02/06/16     Mark Riddoch            Persistent connections scoped by service
+ * 03/07/16     Mark Riddoch            Replication lag rate of change and
+ *                                      interpolated lag readings
+ * 03/07/16     Mark Riddoch            Status snapshots with a generation
+ *                                      counter for consistent routing decisions
+ * 03/07/16     Mark Riddoch            Added the max_inflight operation limit
  *
  * @endverbatim
  */
 
 #define MAX_SERVER_NAME_LEN 1024
 
+/**
+ * The longest period, in seconds, over which server_interpolated_rlag will
+ * extrapolate the replication lag beyond the last monitor sample.
+ */
+#define SERVER_RLAG_MAX_INTERPOLATION 60
+
 /**
  * The server parameters used for weighting routing decissions
  *
@@ -72,6 +85,7 @@ typedef struct
     int n_current;     /**< Current connections */
     int n_current_ops; /**< Current active operations */
     int n_persistent;  /**< Current persistent pool */
+    histogram_t response_time; /**< Round trip time from write to first read */
 } SERVER_STATS;
 
 /**
@@ -91,6 +105,9 @@ typedef struct server {
     char           *protocol;      /**< Protocol module to use */
     SSL_LISTENER   *server_ssl;    /**< SSL data structure for server, if any */
     unsigned int   status;         /**< Status flag bitmap for the server */
+    int            status_gen;     /**< Incremented whenever the status word
+                                    * changes, so that a snapshot taken by a
+                                    * router can be cheaply revalidated */
     char           *monuser;       /**< User name to use to monitor the db */
     char           *monpw;         /**< Password to use to monitor the db */
     SERVER_STATS   stats;          /**< The server statistics */
@@ -99,6 +116,9 @@ typedef struct server {
     char           *server_string; /**< Server version string, i.e. MySQL server version */
     long           node_id;        /**< Node id, server_id for M/S or local_index for Galera */
     int            rlag;           /**< Replication Lag for Master / Slave replication */
+    double         rlag_rate;      /**< Rate of change of rlag in seconds per second
+                                    * between the last two monitor samples, negative
+                                    * while the slave is catching up */
     unsigned long  node_ts;        /**< Last timestamp set from M/S monitor module */
     SERVER_PARAM   *parameters;    /**< Parameters of a server that may be used to weight routing decisions */
     long           master_id;      /**< Master server id of this node */
@@ -110,6 +130,7 @@ typedef struct server {
     long           persistpoolmax; /**< Maximum size of persistent connections pool */
     long           persistmaxtime; /**< Maximum number of seconds connection can live */
     int            persistmax;     /**< Maximum pool size actually achieved since startup */
+    long           max_inflight;   /**< Maximum concurrent operations, 0 for no limit */
 #if defined(SS_DEBUG)
     skygw_chk_t    server_chk_tail;
 #endif
@@ -185,6 +206,14 @@ typedef struct server {
  */
 #define SERVER_IN_MAINT(server)         ((server)->status & SERVER_MAINT)
 
+/**
+ * Has the server reached its configured limit of concurrent operations.
+ * Always false when no limit has been configured for the server.
+ */
+#define SERVER_AT_INFLIGHT_LIMIT(server)                                \
+    ((server)->max_inflight > 0 &&                                      \
+     (server)->stats.n_current_ops >= (server)->max_inflight)
+
 /** server is not master, slave or joined */
 #define SERVER_NOT_IN_CLUSTER(s) (((s)->status & (SERVER_MASTER|SERVER_SLAVE|SERVER_JOINED|SERVER_NDB)) == 0)
 
@@ -194,6 +223,17 @@ typedef struct server {
     (((server)->status & (SERVER_RUNNING|SERVER_MASTER|SERVER_SLAVE|SERVER_MAINT)) == \
      (SERVER_RUNNING|SERVER_MASTER|SERVER_SLAVE))
 
+/**
+ * Callback invoked when the status bits of a server change. Called from the
+ * thread applying the change, typically a monitor thread; implementations
+ * should only note the transition and return quickly.
+ */
+typedef void (*SERVER_STATUS_CB)(SERVER *server, unsigned int old_status,
+                                 unsigned int new_status, void *userdata);
+
+/** Maximum number of simultaneous server status subscribers */
+#define SERVER_STATUS_SUBSCRIBER_MAX 32
+
 extern SERVER *server_alloc(char *, char *, unsigned short);
 extern int server_free(SERVER *);
 extern SERVER *server_find_by_unique_name(char *);
@@ -210,16 +250,21 @@ extern void server_clear_set_status(SERVER *server, int specified_bits, int bits
 extern void server_set_status(SERVER *, int);
 extern void server_clear_status(SERVER *, int);
 extern void server_transfer_status(SERVER *dest_server, SERVER *source_server);
+extern int server_status_subscribe(SERVER_STATUS_CB cb, void *userdata);
+extern void server_status_unsubscribe(SERVER_STATUS_CB cb, void *userdata);
 extern void serverAddMonUser(SERVER *, char *, char *);
 extern void serverAddParameter(SERVER *, char *, char *);
+extern void server_update_parameter(SERVER *, char *, char *);
 extern char *serverGetParameter(SERVER *, char *);
 extern void server_update(SERVER *, char *, char *, char *);
 extern void server_set_unique_name(SERVER *, char *);
-extern DCB  *server_get_persistent(SERVER *, char *, const char *);
+extern DCB  *server_get_persistent(SERVER *, char *, const char *, const struct service *);
 extern void server_update_address(SERVER *, char *);
 extern void server_update_port(SERVER *,  unsigned short);
 extern RESULTSET *serverGetList();
 extern unsigned int server_map_status(char *str);
 extern bool server_set_version_string(SERVER* server, const char* string);
+extern int server_interpolated_rlag(SERVER *server);
+extern unsigned int server_status_snapshot(SERVER *server, int *generation);
 
 #endif
@@ -28,6 +28,8 @@
 #include <hashtable.h>
 #include <resultset.h>
 #include <maxconfig.h>
+#include <statistics.h>
+#include <histogram.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -53,6 +55,17 @@
  * 26/06/14     Mark Riddoch            Added WeightBy support
  * 09/09/14     Massimiliano Pinto      Added service option for localhost authentication
  * 09/10/14     Massimiliano Pinto      Added service resources via hashtable
+ * 02/06/16     Mark Riddoch            Backend connection pooling at the
+ *                                      service level
+ * 24/06/16     Mark Riddoch            Session counters converted to the
+ *                                      generic stats counter
+ * 03/07/16     Mark Riddoch            Version counter on the users table
+ * 03/07/16     Mark Riddoch            Generation counter on the server list
+ * 03/07/16     Mark Riddoch            Per service read batch limit
+ * 05/07/16     Mark Riddoch            Token bucket query rate limiting per
+ *                                      client of a service
+ * 05/07/16     Mark Riddoch            Seqlock protected aggregate of the
+ *                                      session counters for lock-free readers
  *
  * @endverbatim
  */
@@ -61,6 +74,23 @@ struct router;
 struct router_object;
 struct users;
 
+/**
+ * A seqlock protected aggregate of the session counters of a service.
+ *
+ * The per-thread slots of the counters are summed by a housekeeper
+ * task once a second and the sums published here. Readers retry while
+ * the sequence count is odd or has changed across their reads, so they
+ * always obtain a consistent pair of values without ever touching a
+ * lock the updater holds; the values merely lag the slots by up to the
+ * refresh interval. Only the housekeeper task may write the block.
+ */
+typedef struct
+{
+    volatile unsigned int seq; /**< Sequence count, odd while an update is in progress */
+    int n_sessions;            /**< Aggregated total number of sessions */
+    int n_current;             /**< Aggregated current number of sessions */
+} SERVICE_STATS_AGG;
+
 /**
  * The service statistics structure
  */
@@ -68,8 +98,10 @@ typedef struct
 {
     time_t started;         /**< The time when the service was started */
     int    n_failed_starts; /**< Number of times this service has failed to start */
-    int    n_sessions;      /**< Number of sessions created on service since start */
-    int    n_current;       /**< Current number of sessions */
+    stats_counter_t n_sessions; /**< Number of sessions created on service since start */
+    stats_counter_t n_current;  /**< Current number of sessions */
+    histogram_t latency;        /**< Query latency across the filter chain */
+    SERVICE_STATS_AGG agg;      /**< Aggregated counters for lock-free readers */
 } SERVICE_STATS;
 
 /**
@@ -105,6 +137,26 @@ typedef struct server_ref_t
 /** Value of service timeout if timeout checks are disabled */
 #define SERVICE_NO_SESSION_TIMEOUT LONG_MAX
 
+/** Default number of backend replies processed per read event */
+#define SERVICE_DEFAULT_READ_BATCH 4
+
+/**
+ * A token bucket for the query rate limit of one client, a user and host
+ * pair, of a service. The bucket is shared by every session of the client;
+ * sessions do not take a token per query but draw tokens in chunks of
+ * SERVICE_RATE_CHUNK into a session local cache, so the common case of an
+ * allowed query costs a decrement of a session field and no locking.
+ */
+typedef struct service_rate_bucket
+{
+    int tokens;                        /**< Tokens currently in the bucket */
+    long last_refill;                  /**< hkheartbeat of the last refill */
+    SPINLOCK lock;                     /**< Serialises refill and draw */
+} SERVICE_RATE_BUCKET;
+
+/** Tokens drawn from the shared bucket into a session at a time */
+#define SERVICE_RATE_CHUNK 8
+
 /**
  * Parameters that are automatically detected but can also be configured by the
  * user are initially set to this value.
@@ -131,10 +183,16 @@ typedef struct service
     void *router_instance;             /**< The router instance for this service */
     char *version_string;              /** version string for this service listeners */
     SERVER_REF *dbref;                 /** server references */
+    int dbref_gen;                     /**< Incremented whenever the server list
+                                        * changes, so that routers can detect a
+                                        * stale view of the list */
     SERVICE_USER credentials;          /**< The cedentials of the service user */
     SPINLOCK spin;                     /**< The service spinlock */
     SERVICE_STATS stats;               /**< The service statistics */
     struct users *users;               /**< The user data for this service */
+    int users_version;                 /**< Incremented whenever a reload changes
+                                        * the users table, so that cached
+                                        * authentication data can be discarded */
     int enable_root;                   /**< Allow root user  access */
     int localhost_match_wildcard_host; /**< Match localhost against wildcard */
     HASHTABLE *resources;              /**< hastable for service resources, i.e. database names */
@@ -151,6 +209,27 @@ typedef struct service
     FILTER_DEF **filters;              /**< Ordered list of filters */
     int n_filters;                     /**< Number of filters */
     long conn_idle_timeout;            /**< Session timeout in seconds */
+    long query_timeout;                /**< Per-query deadline in seconds, after which
+                                        * the session of a stuck query is closed,
+                                        * 0 = no query timeout */
+    struct digest_dict *digest_dict;   /**< Interned canonical statement texts,
+                                        * allocated on first use */
+    long conn_pool_max;                /**< Backend connections pooled per server for
+                                        * servers that configure no pool of their own,
+                                        * 0 = no service level pooling */
+    int read_batch_limit;              /**< Replies drained from a backend socket per
+                                        * read event before returning to the poll loop */
+    int qps_limit;                     /**< Queries per second allowed to each
+                                        * client, a user and host pair, of the
+                                        * service, 0 = no limit */
+    int qps_burst;                     /**< Capacity of the token buckets, i.e.
+                                        * the burst allowed above the rate */
+    HASHTABLE *qps_buckets;            /**< Token buckets keyed by user@host,
+                                        * NULL when no limit is configured */
+    SPINLOCK qps_lock;                 /**< Serialises creation of buckets */
+    int thread_group_first;            /**< First polling thread that client DCBs of
+                                        * this service may be assigned to, -1 = any */
+    int thread_group_last;             /**< Last polling thread of the group */
     char *weightby;
     struct service *next;              /**< The next service in the linked list */
     bool retry_start;                  /*< If starting of the service should be retried later */
@@ -194,6 +273,16 @@ extern int serviceSetSSLVerifyDepth(SERVICE* service, int depth);
 extern void serviceSetCertificates(SERVICE *service, char* cert,char* key, char* ca_cert);
 extern int serviceEnableRootUser(SERVICE *, int );
 extern int serviceSetTimeout(SERVICE *, int );
+extern int serviceSetQueryTimeout(SERVICE *, int);
+extern int serviceSetRateLimit(SERVICE *, int, int);
+extern int service_rate_limit_check(struct session *);
+extern uint32_t service_intern_digest(SERVICE *, const char *);
+extern const char *service_digest_text(SERVICE *, uint32_t);
+extern int serviceSetConnectionPoolMax(SERVICE *, int);
+extern int serviceSetReadBatchLimit(SERVICE *, int);
+extern int serviceSetThreadGroup(SERVICE *, int, int);
+extern DCB *service_pool_lease_dcb(SERVICE *, SERVER *, struct session *);
+extern void service_pool_release_dcb(SERVICE *, DCB *);
 extern void serviceSetRetryOnFailure(SERVICE *service, char* value);
 extern void serviceWeightBy(SERVICE *, char *);
 extern char *serviceGetWeightingParameter(SERVICE *);
@@ -217,6 +306,7 @@ extern void dListListeners(DCB *);
 extern char* service_get_name(SERVICE* svc);
 extern void service_shutdown();
 extern int serviceSessionCountAll();
+extern void service_stats_read(SERVICE *, int *, int *);
 extern RESULTSET *serviceGetList();
 extern RESULTSET *serviceGetListenerList();
 extern bool service_all_services_have_listeners();
@@ -34,9 +34,29 @@
  * 29-05-2014   Mark Riddoch            Support for filter mechanism
  *                                      added
  * 20-02-2015   Markus Mäkelä           Added session timeouts
+ * 12-05-2016   Mark Riddoch            Idle timeouts via the timer wheel
+ * 26-06-2016   Mark Riddoch            Sharded session list, get_all_sessions
+ *                                      replaced by session_get_by_id
+ * 29-06-2016   Mark Riddoch            Latency recording across the filter
+ *                                      chain
+ * 02-07-2016   Mark Riddoch            Statement digest computed once per query
+ * 03-07-2016   Mark Riddoch            Arena for session lifetime allocations
+ * 03-07-2016   Mark Riddoch            Session list filtered by service and
+ *                                      state for sessionGetFilteredList
+ * 04-07-2016   Mark Riddoch            Route macros call the chain in place
+ *                                      for sessions without a query deadline
+ * 05-07-2016   Mark Riddoch            Session local token cache for the
+ *                                      service query rate limit
+ * 05-07-2016   Mark Riddoch            Profiling probe tracked per filter
+ *                                      of the session
+ * 05-07-2016   Mark Riddoch            Query and latency counters kept per
+ *                                      session for the top sessions view
+ * 05-07-2016   Mark Riddoch            Session pool primed from the
+ *                                      expected_sessions capacity hint
  *
  * @endverbatim
  */
+#include <stdint.h>
 #include <time.h>
 #include <atomic.h>
 #include <buffer.h>
@@ -44,6 +64,7 @@
 #include <resultset.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <timerwheel.h>
 
 struct dcb;
 struct service;
@@ -55,6 +76,13 @@ struct filter_def;
 typedef struct
 {
     time_t          connect;        /**< Time when the session was started */
+    uint64_t        n_queries;      /**< Number of queries routed into the
+                                     * filter chain of the session */
+    uint64_t        total_latency;  /**< Cumulative query latency of the
+                                     * session in microseconds. Only recorded
+                                     * when the service keeps a latency
+                                     * histogram, as the measurement is made
+                                     * by the same wrapper */
 } SESSION_STATS;
 
 typedef enum
@@ -102,6 +130,9 @@ typedef struct
     struct filter_def *filter;
     void *instance;
     void *session;
+    void *probe;        /*< Profiling probe of the filter, or NULL when
+                         * profiling was not active when the session was
+                         * created */
 } SESSION_FILTER;
 
 /**
@@ -113,6 +144,25 @@ typedef enum
     SESSION_LIST_CONNECTION
 } SESSIONLISTFILTER;
 
+/**
+ * A block of the per session memory arena.
+ *
+ * Allocations that live for the whole of a session - the router and
+ * filter session objects and the structures hanging from them - can be
+ * drawn from a bump allocator of these blocks with session_arena_alloc
+ * and are returned in a single operation when the session is freed,
+ * instead of being malloc'd and freed individually. The block data
+ * follows the header; allocation is a pointer bump within the newest
+ * block. The arena is not locked, allocations are only made on the
+ * thread that is setting the session up.
+ */
+typedef struct session_arena_block
+{
+    struct session_arena_block *next;  /*< Next block in the chain */
+    size_t size;                       /*< Usable bytes in the block */
+    size_t used;                       /*< Bytes already allocated */
+} SESSION_ARENA_BLOCK;
+
 /**
  * The session status block
  *
@@ -137,9 +187,32 @@ typedef struct session
     SESSION_FILTER  *filters;         /*< The filters in use within this session */
     DOWNSTREAM      head;             /*< Head of the filter chain */
     UPSTREAM        tail;             /*< The tail of the filter chain */
+    DOWNSTREAM      ses_chain_head;   /*< The real chain head, called by the
+                                       *  latency recording wrapper in head */
+    uint64_t        ses_query_start;  /*< Monotonic time (us) at which the
+                                       *  query in flight entered the chain,
+                                       *  zero when no query is in flight */
+    char            *ses_query_shape; /*< Canonical form of the query in
+                                       *  flight, for the query digest */
+    uint64_t        ses_query_digest; /*< 64-bit digest of ses_query_shape,
+                                       *  zero when no query is in flight */
+    SESSION_ARENA_BLOCK *ses_arena;   /*< Session lifetime allocations, freed
+                                       *  in one operation with the session */
     struct session  *next;            /*< Linked list of all sessions */
     int             refcount;         /*< Reference count on the session */
     bool            ses_is_child;     /*< this is a child session */
+    WTIMER          *idle_timer;      /*< Idle timeout timer, NULL if not in use */
+    WTIMER          *query_timer;     /*< Query deadline timer, NULL if not in use */
+    long            query_start;      /*< Heartbeat when the query in flight was routed */
+    bool            query_active;     /*< A routed query is awaiting its reply */
+    bool            query_deadline;   /*< The service had a query timeout set
+                                       *  when the session was created */
+    struct service_rate_bucket *rate_bucket;
+                                      /*< Shared token bucket of the client if
+                                       *  the service rate limits queries,
+                                       *  resolved on the first query */
+    int             rate_tokens;      /*< Tokens drawn from the bucket but not
+                                       *  yet spent by this session */
 #if defined(SS_DEBUG)
     skygw_chk_t     ses_chk_tail;
 #endif
@@ -148,41 +221,53 @@ typedef struct session
 /** Whether to do session timeout checks */
 extern bool check_timeouts;
 
-/** When the next timeout check is done. This is compared to hkheartbeat in
- * hk_heartbeat.h */
-extern long next_timeout_check;
-
 #define SESSION_PROTOCOL(x, type)       DCB_PROTOCOL((x)->client_dcb, type)
 
 /**
  * A convenience macro that can be used by the protocol modules to route
  * the incoming data to the first element in the pipeline of filters and
- * routers.
+ * routers. When the service has no query deadline configured the head of
+ * the chain is called in place; with no filters the head entries are the
+ * routeQuery and instance of the router itself, so the common case costs
+ * a single indirect call. Otherwise the call goes through
+ * session_route_query, which arms the deadline timer.
  */
-#define SESSION_ROUTE_QUERY(sess, buf)                          \
-    ((sess)->head.routeQuery)((sess)->head.instance,            \
-                              (sess)->head.session, (buf))
+#define SESSION_ROUTE_QUERY(sess, buf)                                  \
+    ((sess)->stats.n_queries++,                                         \
+     (sess)->query_deadline                                             \
+     ? session_route_query((sess), (buf))                               \
+     : ((sess)->head.routeQuery)((sess)->head.instance,                 \
+                                 (sess)->head.session, (buf)))
 /**
  * A convenience macro that can be used by the router modules to route
  * the replies to the first element in the pipeline of filters and
- * the protocol.
+ * the protocol. The query deadline of the session is cleared with a
+ * plain store and the tail of the chain is called in place; with no
+ * filters the tail writes straight to the client protocol.
  */
-#define SESSION_ROUTE_REPLY(sess, buf)                          \
-    ((sess)->tail.clientReply)((sess)->tail.instance,           \
-                               (sess)->tail.session, (buf))
+#define SESSION_ROUTE_REPLY(sess, buf)                                  \
+    ((sess)->query_active = false,                                      \
+     ((sess)->tail.clientReply)((sess)->tail.instance,                  \
+                                (sess)->tail.session, (buf)))
 
-SESSION *get_all_sessions();
+SESSION *session_get_by_id(size_t);
 SESSION *session_alloc(struct service *, struct dcb *);
+void session_pool_prime(int);
+void *session_arena_alloc(SESSION *, size_t);
+char *session_arena_strdup(SESSION *, const char *);
 SESSION *session_set_dummy(struct dcb *);
 bool session_free(SESSION *);
 int session_isvalid(SESSION *);
 int session_reply(void *inst, void *session, GWBUF *data);
+int session_route_query(SESSION *, GWBUF *);
+int session_route_reply(SESSION *, GWBUF *);
 char *session_get_remote(SESSION *);
 char *session_getUser(SESSION *);
 void printAllSessions();
 void printSession(SESSION *);
 void dprintAllSessions(struct dcb *);
 void dprintSession(struct dcb *, SESSION *);
+void dprintTopSessions(struct dcb *, char *);
 void dListSessions(struct dcb *);
 char *session_state(int);
 bool session_link_dcb(SESSION *, struct dcb *);
@@ -191,6 +276,6 @@ SESSION* get_session_by_router_ses(void* rses);
 void session_enable_log_priority(SESSION* ses, int priority);
 void session_disable_log_priority(SESSION* ses, int priority);
 RESULTSET *sessionGetList(SESSIONLISTFILTER);
-void process_idle_sessions();
+RESULTSET *sessionGetFilteredList(SESSIONLISTFILTER, const char *, const char *);
 void enable_session_timeouts();
 #endif
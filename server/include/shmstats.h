@@ -0,0 +1,128 @@
+#ifndef _SHMSTATS_H
+#define _SHMSTATS_H
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file shmstats.h The statistics export segment
+ *
+ * The core statistics of MaxScale are published in a memory mapped file
+ * with a versioned binary layout so that external monitoring agents can
+ * map the file and read the counters at any frequency without making a
+ * connection into MaxScale.
+ *
+ * The file begins with a SHMSTATS_HEADER that describes the layout and
+ * holds the counters of the polling subsystem. It is followed by an
+ * array of SHMSTATS_SERVER slots and an array of SHMSTATS_SERVICE
+ * slots; the n_servers and n_services fields of the header give the
+ * number of slots that are in use.
+ *
+ * The counters are refreshed once a second by a housekeeper task. The
+ * generation field of the header is incremented before and after each
+ * refresh, so it is odd while a refresh is in progress; a reader that
+ * wants a consistent snapshot reads the generation, copies the segment
+ * and retries if the generation was odd or has changed.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who                     Description
+ * 03-07-2016   Mark Riddoch            Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdint.h>
+
+/** The magic number in the header, "MXST" when read as bytes */
+#define SHMSTATS_MAGIC          0x5453584dU
+
+/** The version of the layout described in this header */
+#define SHMSTATS_VERSION        1
+
+/** The space reserved for an object name, including the terminator */
+#define SHMSTATS_NAME_LEN       64
+
+/** The number of server slots in the segment */
+#define SHMSTATS_MAX_SERVERS    256
+
+/** The number of service slots in the segment */
+#define SHMSTATS_MAX_SERVICES   64
+
+/** The name of the file within the MaxScale data directory */
+#define SHMSTATS_FILENAME       "maxscale.stats"
+
+/**
+ * The published statistics of one backend server
+ */
+typedef struct
+{
+    char        name[SHMSTATS_NAME_LEN]; /*< Unique name of the server */
+    uint64_t    status;         /*< The status bits of the server */
+    int64_t     n_connections;  /*< Connections made to the server */
+    int64_t     n_current;      /*< Current number of connections */
+    int64_t     n_current_ops;  /*< Current number of active operations */
+    int64_t     n_persistent;   /*< Connections in the persistent pool */
+    int64_t     rlag;           /*< Replication lag in seconds, -1 if unknown */
+} SHMSTATS_SERVER;
+
+/**
+ * The published statistics of one service
+ */
+typedef struct
+{
+    char        name[SHMSTATS_NAME_LEN]; /*< Name of the service */
+    int64_t     n_sessions;     /*< Sessions created since the service started */
+    int64_t     n_current;      /*< Current number of sessions */
+} SHMSTATS_SERVICE;
+
+/**
+ * The header of the statistics export segment
+ */
+typedef struct
+{
+    uint32_t    magic;          /*< Always SHMSTATS_MAGIC */
+    uint32_t    version;        /*< The layout version, SHMSTATS_VERSION */
+    uint32_t    header_size;    /*< sizeof(SHMSTATS_HEADER) */
+    uint32_t    server_size;    /*< sizeof(SHMSTATS_SERVER) */
+    uint32_t    service_size;   /*< sizeof(SHMSTATS_SERVICE) */
+    uint32_t    max_servers;    /*< Number of server slots that follow */
+    uint32_t    max_services;   /*< Number of service slots that follow */
+    uint32_t    n_servers;      /*< Number of server slots in use */
+    uint32_t    n_services;     /*< Number of service slots in use */
+    uint32_t    pad;            /*< Reserved, keeps the layout aligned */
+    uint64_t    generation;     /*< Incremented before and after a refresh,
+                                 * odd while a refresh is in progress */
+    uint64_t    timestamp;      /*< Time of the last refresh */
+    int64_t     n_reads;        /*< Number of read events */
+    int64_t     n_writes;       /*< Number of write events */
+    int64_t     n_errors;       /*< Number of error events */
+    int64_t     n_hangups;      /*< Number of hangup events */
+    int64_t     n_accepts;      /*< Number of accept events */
+    int64_t     evq_length;     /*< Current event queue length */
+    int64_t     evq_max;        /*< Maximum event queue length */
+    int64_t     max_qtime;      /*< Maximum event queue time */
+    int64_t     max_exectime;   /*< Maximum event execution time */
+} SHMSTATS_HEADER;
+
+extern int  shmstats_init();
+extern void shmstats_shutdown();
+
+/* Implemented in server.c and service.c, fill the slots of the segment */
+extern int  server_fill_shmstats(SHMSTATS_SERVER *, int);
+extern int  service_fill_shmstats(SHMSTATS_SERVICE *, int);
+#endif
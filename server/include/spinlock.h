@@ -27,6 +27,14 @@
  * generally wasteful as any blocked threads will spin, consuming CPU cycles, waiting
  * for the lock to be released. However they are useful in that they do not involve
  * system calls and are light weight when the expected wait time for a lock is low.
+ *
+ * The locks are adaptive; a thread that fails to acquire a lock spins for a
+ * bounded number of iterations with exponential backoff and then sleeps in the
+ * kernel until the lock is released, so pathological contention degrades into
+ * blocking rather than burning cores. Every lock maintains counters of
+ * contended acquisitions and sleeps, and the major global locks may be
+ * registered by name so that "show spinlocks" can report where contention
+ * occurs.
  */
 #include <thread.h>
 #include <stdbool.h>
@@ -43,9 +51,13 @@
  * a number of profile related fields that count the number of spins, number
  * of waiting threads and the number of times the lock has been acquired.
  */
+#define SPINLOCK_REGISTER_MAX 96 /*< Capacity of the named lock registry */
+
 typedef struct spinlock
 {
-    int lock;         /*< Is the lock held? */
+    int lock;         /*< 0 - free, 1 - held, 2 - held with sleeping waiters */
+    int n_contended;  /*< No. of times acquisition was contended */
+    int n_sleeps;     /*< No. of times a waiting thread went to sleep */
 #if SPINLOCK_PROFILE
     int spins;        /*< Number of spins on this lock */
     int maxspins;     /*< Max no of spins to acquire lock */
@@ -64,11 +76,7 @@ typedef struct spinlock
 #define FALSE   false
 #endif
 
-#if SPINLOCK_PROFILE
-#define SPINLOCK_INIT { 0, 0, 0, 0, 0, 0, 0, 0 }
-#else
 #define SPINLOCK_INIT { 0 }
-#endif
 
 #define SPINLOCK_IS_LOCKED(l) ((l)->lock != 0 ? true : false)
 
@@ -77,5 +85,7 @@ extern void spinlock_acquire(SPINLOCK *lock);
 extern int spinlock_acquire_nowait(SPINLOCK *lock);
 extern void spinlock_release(SPINLOCK *lock);
 extern void spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl);
+extern void spinlock_register(SPINLOCK *lock, const char *name);
+extern int spinlock_get_registered(int idx, SPINLOCK **lock, const char **name);
 
 #endif
@@ -21,16 +21,35 @@
 /**
  * @file statistics.h  - Lock-free statistics gathering
  *
+ * The value of a counter is split into one slot per configured thread,
+ * each slot padded out to a cache line of its own so that threads
+ * updating adjacent slots do not bounce cache lines between each other.
+ * Summing the slots gives the value of the counter; the sum is only
+ * computed for diagnostic output, never on a hot path.
+ *
  * @verbatim
  * Revision History
  *
  * Date         Who              Description
  * 21/01/16     Markus Makela    Initial implementation
+ * 24/06/16     Mark Riddoch     Cache-line padded slots and the generic
+ *                               stats_counter_t interface
  * @endverbatim
  */
 
 typedef void* ts_stats_t;
 
+/**
+ * A generic counter split across per-thread, cache-line padded slots.
+ *
+ * Unlike the plain ts_stats_t, updates are made with atomic operations
+ * so a counter may also be modified by threads without a thread id of
+ * their own, and decrements may happen on a different thread than the
+ * matching increment; individual slots may go negative but the sum
+ * remains correct.
+ */
+typedef void* stats_counter_t;
+
 /** stats_init should be called only once */
 void ts_stats_init();
 
@@ -40,10 +59,20 @@ void ts_stats_end();
 /** Every thread should call set_current_thread_id only once */
 void ts_stats_set_thread_id(int id);
 
+/** Threads that never set an id report thread id zero */
+int ts_stats_get_thread_id();
+
 ts_stats_t ts_stats_alloc();
 void ts_stats_free(ts_stats_t stats);
 void ts_stats_add(ts_stats_t stats, int value);
 void ts_stats_set(ts_stats_t stats, int value);
 int ts_stats_sum(ts_stats_t stats);
 
+stats_counter_t stats_counter_alloc();
+void stats_counter_free(stats_counter_t counter);
+void stats_counter_add(stats_counter_t counter, int value);
+void stats_counter_increment(stats_counter_t counter);
+void stats_counter_decrement(stats_counter_t counter);
+int stats_counter_sum(stats_counter_t counter);
+
 #endif
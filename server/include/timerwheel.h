@@ -0,0 +1,79 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file timerwheel.h A hierarchical timer wheel for cheap timeout scheduling
+ *
+ * The timer wheel provides O(1) insertion, removal and expiry of timers
+ * with a resolution of one housekeeper heartbeat (100 milliseconds). It
+ * is used by the housekeeper for the periodic task list and by the
+ * session code for idle connection timeouts.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 12/05/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+
+/**
+ * The state of a wheel timer.
+ *
+ * A timer is PENDING while it sits in a wheel slot waiting to expire,
+ * RUNNING while its callback is being executed by the housekeeper thread
+ * and EXPIRED once the callback has returned without the timer being
+ * rescheduled. A timer that is removed while its callback is running is
+ * marked DOOMED and freed by the wheel once the callback returns.
+ */
+typedef enum
+{
+    TW_PENDING = 1,     /*< Queued in a wheel slot */
+    TW_RUNNING,         /*< Callback currently executing */
+    TW_EXPIRED,         /*< Fired, awaiting removal or rescheduling */
+    TW_DOOMED           /*< Removed during callback execution */
+} WTIMER_STATE;
+
+/**
+ * An individual timer within the wheel.
+ *
+ * Timers are kept in doubly linked lists hanging off the wheel slots so
+ * that removal of an arbitrary timer is a constant time operation.
+ */
+typedef struct wtimer
+{
+    void (*fn)(void *data); /*< The function to call on expiry */
+    void *data;             /*< Data to pass to the expiry function */
+    long due;               /*< The wheel tick at which the timer expires */
+    int level;              /*< The wheel level the timer is linked into */
+    int slot;               /*< The slot within the level */
+    WTIMER_STATE state;     /*< The current timer state */
+    struct wtimer *next;    /*< Next timer in the slot list */
+    struct wtimer *prev;    /*< Previous timer in the slot list */
+} WTIMER;
+
+extern void    tw_init();
+extern WTIMER *tw_add(long ticks, void (*fn)(void *), void *data);
+extern void    tw_remove(WTIMER *timer);
+extern int     tw_reschedule(WTIMER *timer, long ticks);
+extern void    tw_tick();
+
+#endif
@@ -33,6 +33,8 @@
  * 26/02/14     Massimiliano Pinto      Added checksum to users' table with SHA1
  * 27/02/14     Massimiliano Pinto      Added USERS_HASHTABLE_DEFAULT_SIZE
  * 28/02/14     Massimiliano Pinto      Added usersCustomUserFormat, optional username format routine
+ * 03/07/16     Mark Riddoch            Added the wildcard host index maintained
+ *                                      by the MySQL users table
  *
  * @endverbatim
  */
@@ -57,6 +59,9 @@ typedef struct
 typedef struct users
 {
     HASHTABLE *data;                        /**< The hashtable containing the actual data */
+    HASHTABLE *wildcards;                   /**< Index of the wildcard host entries by
+                                             * user name, maintained by the MySQL users
+                                             * table; NULL for plain users tables */
     char *(*usersCustomUserFormat)(void *); /**< Optional username format routine */
     USERS_STATS stats;                      /**< The statistics for the users table */
     unsigned char cksum[SHA_DIGEST_LENGTH]; /**< The users' table ckecksum */
@@ -26,13 +26,14 @@
  *
  * Date		Who			Description
  * 22/03/16	Martin Brampton 	Initial implementation
+ * 05/07/16	Mark Riddoch		Random strings bulk filled from the
+ *					per-thread generator
  *
  * @endverbatim
  */
 
 int setnonblocking(int fd);
 char  *gw_strend(register const char *s);
-static char gw_randomchar();
 int gw_generate_random_str(char *output, int len);
 int gw_hex2bin(uint8_t *out, const char *in, unsigned int len);
 char *gw_bin2hex(char *out, const uint8_t *in, unsigned int len);
@@ -0,0 +1,1129 @@
+/*
+ * This file is distributed as part of MaxScale by MariaDB Corporation.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file cachefilter.c - A result set cache
+ * @verbatim
+ *
+ * A filter that caches the complete result sets of SELECT statements and
+ * serves repeated executions of the same statement directly from the cache
+ * without routing them to a backend.
+ *
+ * The cache is shared by all sessions of the filter instance and is keyed
+ * on the exact SQL text of the statement. Only statements that are pure
+ * reads are cached and a session that has an open transaction bypasses the
+ * cache entirely, both for serving and for storing, since the result may
+ * depend on uncommitted changes.
+ *
+ * Entries are invalidated when their time to live expires. Each entry
+ * records the tables the statement read, as reported by the query
+ * classifier, and a statement that modifies data invalidates only the
+ * entries that read one of the tables it writes; when either side of
+ * that comparison yields no table names the invalidation falls back to
+ * flushing the whole cache, so the filter never serves a result it
+ * cannot prove untouched.
+ *
+ * In deployments with several MaxScale instances in front of the same
+ * databases, a write seen by one instance leaves stale entries in the
+ * caches of the others. The filter can therefore be given a list of
+ * peer instances: the tables invalidated by a locally observed write
+ * are also announced to every peer in a UDP datagram, and a listener
+ * thread applies the announcements received from peers to the local
+ * cache. Messages received from peers are not announced onwards, so
+ * there is no forwarding loop.
+ *
+ * The parameters that may be set in the filter configuration
+ *      ttl=<seconds a cached result set remains valid>
+ *      cachesize=<maximum number of cached result sets>
+ *      max_resultset_size=<largest result set that is cached, in bytes>
+ *      peers=<comma separated host:port list of peer MaxScale caches>
+ *      listen_port=<UDP port to accept peer invalidations on>
+ *
+ * Date         Who             Description
+ * 16/06/2016   Mark Riddoch    Initial implementation
+ * 03/07/2016   Mark Riddoch    Account the cached result sets and flush
+ *                              the cache under memory pressure
+ * 05/07/2016   Mark Riddoch    Invalidation by table name rather than
+ *                              flushing on every write, propagated to
+ *                              peer MaxScale instances over UDP
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <filter.h>
+#include <thread.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <hashtable.h>
+#include <memaccount.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_BETA_RELEASE,
+    FILTER_VERSION,
+    "A result set cache for repeated read only statements"
+};
+
+static char *version_str = "V1.0.0";
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/** Default time to live of a cached result set, in seconds */
+#define CACHE_DEFAULT_TTL 60
+
+/** Default maximum number of cached result sets */
+#define CACHE_DEFAULT_SIZE 1024
+
+/** Default largest result set that is cached, in bytes */
+#define CACHE_DEFAULT_MAX_RESULTSET 65536
+
+/** Size of the hashtable holding the cached result sets */
+#define CACHE_HASHSIZE 1021
+
+/** Magic prefix of a peer invalidation datagram */
+#define CACHE_PEER_MAGIC "MXSCACHE1"
+
+/** Largest peer invalidation datagram; a table list that does not fit
+ * is replaced by a full flush announcement */
+#define CACHE_PEER_MSGLEN 1400
+
+/**
+ * A cached result set
+ */
+typedef struct cache_entry
+{
+    GWBUF *reply; /*< The complete result set as it was sent to the client */
+    time_t expires; /*< The time when this entry ceases to be valid */
+    char **tables; /*< The tables the statement read, or NULL if unknown */
+    int n_tables; /*< Number of entries in the tables array */
+} CACHE_ENTRY;
+
+/**
+ * A peer MaxScale instance that invalidation messages are sent to
+ */
+typedef struct cache_peer
+{
+    char *name; /*< The host:port string of the peer, for diagnostics */
+    struct sockaddr_in addr; /*< The resolved address of the peer */
+    struct cache_peer *next; /*< The next peer in the list */
+} CACHE_PEER;
+
+/**
+ * The instance structure for the cache filter. The cache itself is
+ * held here and shared by all sessions of the instance.
+ */
+typedef struct
+{
+    HASHTABLE *cache; /*< Result sets hashed by statement text */
+    SPINLOCK lock; /*< Protects the cache against concurrent updates */
+    int ttl; /*< Seconds a cached result set remains valid */
+    int max_entries; /*< Maximum number of cached result sets */
+    int max_resultset; /*< Largest result set that is cached, in bytes */
+    CACHE_PEER *peers; /*< Peer instances sent invalidation messages */
+    int listen_port; /*< UDP port peer invalidations are accepted on */
+    int sockfd; /*< The UDP socket, -1 when no channel is configured */
+    THREAD listener; /*< The thread receiving peer invalidations */
+    int n_hits; /*< Number of statements served from the cache */
+    int n_misses; /*< Number of cachable statements not found in the cache */
+    int n_stored; /*< Number of result sets added to the cache */
+    int n_flushes; /*< Number of times the cache was flushed by a write */
+    int n_invalidated; /*< Number of entries invalidated by table name */
+    int n_peer_sent; /*< Number of invalidation messages sent to peers */
+    int n_peer_recv; /*< Number of invalidation messages received */
+} CACHE_INSTANCE;
+
+/**
+ * The session structure for the cache filter
+ */
+typedef struct
+{
+    DOWNSTREAM down; /*< The downstream filter */
+    UPSTREAM up; /*< The upstream filter */
+    SESSION *session; /*< The client session */
+    char *key; /*< Statement whose reply is being gathered, NULL if none */
+    char **tables; /*< Tables read by the statement being gathered */
+    int n_tables; /*< Number of entries in the tables array */
+    GWBUF *partial; /*< Received reply data that does not yet form complete packets */
+    GWBUF *gather; /*< Copy of the complete reply packets gathered so far */
+    int eof; /*< Number of EOF packets seen in the reply */
+    bool replied; /*< Has the first reply packet been seen */
+    bool in_trx; /*< The client has an open transaction */
+    bool active; /*< The session is active */
+} CACHE_SESSION;
+
+static void cache_entry_free(CACHE_ENTRY *entry);
+static void cache_flush(CACHE_INSTANCE *instance);
+static void cache_pressure(void *arg);
+static void session_reset_gather(CACHE_SESSION *ses);
+static void cache_free_tables(char **tables, int n_tables);
+static void cache_invalidate_tables(CACHE_INSTANCE *instance,
+                                    char **tables, int n_tables);
+static void cache_announce(CACHE_INSTANCE *instance,
+                           char **tables, int n_tables);
+static bool cache_parse_peers(CACHE_INSTANCE *instance, char *value);
+static void cache_peer_listener(void *arg);
+
+static int hashkeyfun(void *key)
+{
+    if (key == NULL)
+    {
+        return 0;
+    }
+    int hash = 0, c = 0;
+    char *ptr = (char*)key;
+    while ((c = *ptr++))
+    {
+        hash = c + (hash << 6) + (hash << 16) - hash;
+    }
+    return hash;
+}
+
+static int hashcmpfun(void *v1, void *v2)
+{
+    return strcmp((char*)v1, (char*)v2);
+}
+
+static void *hstrdup(void *fval)
+{
+    char *str = (char*)fval;
+    return strdup(str);
+}
+
+static void *hfree(void *fval)
+{
+    free(fval);
+    return NULL;
+}
+
+static void *hentryfree(void *fval)
+{
+    cache_entry_free((CACHE_ENTRY*)fval);
+    return NULL;
+}
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Free a cache entry and the result set it holds
+ *
+ * @param entry The entry to free
+ */
+static void
+cache_entry_free(CACHE_ENTRY *entry)
+{
+    if (entry)
+    {
+        memacct_add(MEM_ACCT_CACHE,
+                    -((int64_t)sizeof(CACHE_ENTRY)
+                      + (entry->reply ? gwbuf_length(entry->reply) : 0)));
+        gwbuf_free(entry->reply);
+        cache_free_tables(entry->tables, entry->n_tables);
+        free(entry);
+    }
+}
+
+/**
+ * Free a table name array as returned by qc_get_table_names
+ *
+ * @param tables        The table name array, may be NULL
+ * @param n_tables      Number of entries in the array
+ */
+static void
+cache_free_tables(char **tables, int n_tables)
+{
+    int i;
+
+    if (tables)
+    {
+        for (i = 0; i < n_tables; i++)
+        {
+            free(tables[i]);
+        }
+        free(tables);
+    }
+}
+
+/**
+ * Flush every entry from the cache. Called whenever a statement that
+ * modifies data passes through any session of the instance.
+ *
+ * @param instance The filter instance
+ */
+static void
+cache_flush(CACHE_INSTANCE *instance)
+{
+    HASHTABLE *cache;
+
+    spinlock_acquire(&instance->lock);
+    if (hashtable_size(instance->cache) > 0)
+    {
+        if ((cache = hashtable_alloc(CACHE_HASHSIZE, hashkeyfun, hashcmpfun)) != NULL)
+        {
+            hashtable_memory_fns(cache, hstrdup, NULL, hfree, (HASHMEMORYFN)hentryfree);
+            HASHTABLE *old = instance->cache;
+            instance->cache = cache;
+            instance->n_flushes++;
+            spinlock_release(&instance->lock);
+            hashtable_free(old);
+            return;
+        }
+    }
+    spinlock_release(&instance->lock);
+}
+
+/**
+ * The memory pressure callback registered with the memory accounting.
+ * Invoked from the housekeeper thread when the configured memory budget
+ * has been exceeded; sheds the cached result sets, which will be
+ * repopulated by the subsequent traffic.
+ *
+ * @param arg The filter instance
+ */
+static void
+cache_pressure(void *arg)
+{
+    CACHE_INSTANCE *instance = (CACHE_INSTANCE *)arg;
+
+    cache_flush(instance);
+}
+
+/**
+ * Invalidate every cached entry that read one of the given tables.
+ *
+ * Entries that have no table information recorded are invalidated by
+ * any write, since nothing proves them untouched. An empty table list
+ * flushes the whole cache for the same reason.
+ *
+ * @param instance      The filter instance
+ * @param tables        The tables written by a statement
+ * @param n_tables      Number of entries in the tables array
+ */
+static void
+cache_invalidate_tables(CACHE_INSTANCE *instance, char **tables, int n_tables)
+{
+    HASHITERATOR *iter;
+    CACHE_ENTRY *entry;
+    char **doomed;
+    char *key;
+    int n_doomed = 0, size, i, j, t;
+    bool match;
+
+    if (tables == NULL || n_tables == 0)
+    {
+        cache_flush(instance);
+        return;
+    }
+
+    spinlock_acquire(&instance->lock);
+    if ((size = hashtable_size(instance->cache)) == 0 ||
+        (doomed = (char **)malloc(size * sizeof(char *))) == NULL)
+    {
+        spinlock_release(&instance->lock);
+        return;
+    }
+    if ((iter = hashtable_iterator(instance->cache)) != NULL)
+    {
+        while (n_doomed < size && (key = hashtable_next(iter)) != NULL)
+        {
+            if ((entry = hashtable_fetch(instance->cache, key)) == NULL)
+            {
+                continue;
+            }
+            if (entry->tables == NULL)
+            {
+                match = true;
+            }
+            else
+            {
+                match = false;
+                for (i = 0; i < entry->n_tables && !match; i++)
+                {
+                    for (t = 0; t < n_tables && !match; t++)
+                    {
+                        if (strcasecmp(entry->tables[i], tables[t]) == 0)
+                        {
+                            match = true;
+                        }
+                    }
+                }
+            }
+            if (match)
+            {
+                doomed[n_doomed++] = strdup(key);
+            }
+        }
+        hashtable_iterator_free(iter);
+    }
+    for (j = 0; j < n_doomed; j++)
+    {
+        if (doomed[j])
+        {
+            hashtable_delete(instance->cache, doomed[j]);
+            free(doomed[j]);
+        }
+    }
+    instance->n_invalidated += n_doomed;
+    spinlock_release(&instance->lock);
+    free(doomed);
+}
+
+/**
+ * Announce the tables written by a locally observed statement to every
+ * configured peer instance.
+ *
+ * The message is a single UDP datagram carrying the magic prefix and
+ * the newline separated table names; a table list that does not fit in
+ * a datagram, or an empty one, is announced as a full flush with a '*'
+ * in place of the names. Loss of a datagram only means a peer serves a
+ * result up to its TTL longer, so no acknowledgement is attempted.
+ *
+ * @param instance      The filter instance
+ * @param tables        The tables written, may be NULL
+ * @param n_tables      Number of entries in the tables array
+ */
+static void
+cache_announce(CACHE_INSTANCE *instance, char **tables, int n_tables)
+{
+    char msg[CACHE_PEER_MSGLEN];
+    CACHE_PEER *peer;
+    int len, i;
+    bool full = (tables == NULL || n_tables == 0);
+
+    if (instance->peers == NULL || instance->sockfd == -1)
+    {
+        return;
+    }
+
+    len = snprintf(msg, sizeof(msg), "%s\n", CACHE_PEER_MAGIC);
+    for (i = 0; !full && i < n_tables; i++)
+    {
+        int n = snprintf(msg + len, sizeof(msg) - len, "%s\n", tables[i]);
+        if (n >= (int)sizeof(msg) - len)
+        {
+            full = true;
+        }
+        else
+        {
+            len += n;
+        }
+    }
+    if (full)
+    {
+        len = snprintf(msg, sizeof(msg), "%s\n*\n", CACHE_PEER_MAGIC);
+    }
+
+    for (peer = instance->peers; peer; peer = peer->next)
+    {
+        if (sendto(instance->sockfd, msg, len, 0,
+                   (struct sockaddr *)&peer->addr, sizeof(peer->addr)) != -1)
+        {
+            atomic_add(&instance->n_peer_sent, 1);
+        }
+    }
+}
+
+/**
+ * The listener thread accepting invalidation messages from peers.
+ *
+ * Each datagram carries the tables invalidated by a write observed at
+ * the sending instance and is applied to the local cache exactly as a
+ * local write would be, but without being announced onwards.
+ *
+ * @param arg The filter instance
+ */
+static void
+cache_peer_listener(void *arg)
+{
+    CACHE_INSTANCE *instance = (CACHE_INSTANCE *)arg;
+    char msg[CACHE_PEER_MSGLEN + 1];
+    char *tables[64];
+    char *ptr, *end;
+    int n, n_tables;
+
+    while ((n = recvfrom(instance->sockfd, msg, CACHE_PEER_MSGLEN,
+                         0, NULL, NULL)) != -1)
+    {
+        msg[n] = '\0';
+        if (strncmp(msg, CACHE_PEER_MAGIC "\n", sizeof(CACHE_PEER_MAGIC)) != 0)
+        {
+            continue;
+        }
+        atomic_add(&instance->n_peer_recv, 1);
+        ptr = msg + sizeof(CACHE_PEER_MAGIC);
+        n_tables = 0;
+        while (*ptr && n_tables < 64 && (end = strchr(ptr, '\n')) != NULL)
+        {
+            *end = '\0';
+            if (strcmp(ptr, "*") == 0)
+            {
+                n_tables = 0;
+                break;
+            }
+            tables[n_tables++] = ptr;
+            ptr = end + 1;
+        }
+        if (n_tables > 0)
+        {
+            cache_invalidate_tables(instance, tables, n_tables);
+        }
+        else
+        {
+            cache_flush(instance);
+        }
+    }
+}
+
+/**
+ * Parse the comma separated host:port list of the peers parameter and
+ * resolve each peer into the peer list of the instance.
+ *
+ * @param instance      The filter instance
+ * @param value         The parameter value
+ * @return True if every peer could be parsed and resolved
+ */
+static bool
+cache_parse_peers(CACHE_INSTANCE *instance, char *value)
+{
+    char *copy, *brkt, *item, *colon;
+    CACHE_PEER *peer;
+    struct hostent *hp;
+    int port;
+
+    if ((copy = strdup(value)) == NULL)
+    {
+        return false;
+    }
+    for (item = strtok_r(copy, ", ", &brkt); item;
+         item = strtok_r(NULL, ", ", &brkt))
+    {
+        if ((colon = strrchr(item, ':')) == NULL ||
+            (port = atoi(colon + 1)) <= 0)
+        {
+            MXS_ERROR("cachefilter: Peer '%s' is not of the form "
+                      "host:port.", item);
+            free(copy);
+            return false;
+        }
+        *colon = '\0';
+        if ((hp = gethostbyname(item)) == NULL)
+        {
+            MXS_ERROR("cachefilter: Unable to resolve peer address '%s'.",
+                      item);
+            free(copy);
+            return false;
+        }
+        if ((peer = (CACHE_PEER *)calloc(1, sizeof(CACHE_PEER))) == NULL)
+        {
+            free(copy);
+            return false;
+        }
+        peer->addr.sin_family = AF_INET;
+        peer->addr.sin_port = htons(port);
+        memcpy(&peer->addr.sin_addr, hp->h_addr, hp->h_length);
+        *colon = ':';
+        peer->name = strdup(item);
+        peer->next = instance->peers;
+        instance->peers = peer;
+    }
+    free(copy);
+    return true;
+}
+
+/**
+ * Discard the reply gathering state of a session, freeing any partially
+ * collected result set.
+ *
+ * @param ses The filter session
+ */
+static void
+session_reset_gather(CACHE_SESSION *ses)
+{
+    free(ses->key);
+    ses->key = NULL;
+    cache_free_tables(ses->tables, ses->n_tables);
+    ses->tables = NULL;
+    ses->n_tables = 0;
+    gwbuf_free(ses->gather);
+    ses->gather = NULL;
+    ses->eof = 0;
+    ses->replied = false;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    CACHE_INSTANCE *my_instance;
+    int i;
+
+    if ((my_instance = calloc(1, sizeof(CACHE_INSTANCE))) != NULL)
+    {
+        my_instance->ttl = CACHE_DEFAULT_TTL;
+        my_instance->max_entries = CACHE_DEFAULT_SIZE;
+        my_instance->max_resultset = CACHE_DEFAULT_MAX_RESULTSET;
+        my_instance->sockfd = -1;
+        spinlock_init(&my_instance->lock);
+
+        if (params)
+        {
+            for (i = 0; params[i]; i++)
+            {
+                if (!strcmp(params[i]->name, "ttl"))
+                {
+                    my_instance->ttl = atoi(params[i]->value);
+                }
+                else if (!strcmp(params[i]->name, "cachesize"))
+                {
+                    my_instance->max_entries = atoi(params[i]->value);
+                }
+                else if (!strcmp(params[i]->name, "max_resultset_size"))
+                {
+                    my_instance->max_resultset = atoi(params[i]->value);
+                }
+                else if (!strcmp(params[i]->name, "peers"))
+                {
+                    if (!cache_parse_peers(my_instance, params[i]->value))
+                    {
+                        free(my_instance);
+                        return NULL;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "listen_port"))
+                {
+                    my_instance->listen_port = atoi(params[i]->value);
+                }
+                else if (!filter_standard_parameter(params[i]->name))
+                {
+                    MXS_ERROR("cachefilter: Unexpected parameter '%s'.",
+                              params[i]->name);
+                }
+            }
+        }
+
+        if (my_instance->ttl <= 0 || my_instance->max_entries <= 0 ||
+            my_instance->max_resultset <= 0)
+        {
+            MXS_ERROR("cachefilter: 'ttl', 'cachesize' and 'max_resultset_size' "
+                      "must all be positive.");
+            free(my_instance);
+            return NULL;
+        }
+
+        if ((my_instance->cache = hashtable_alloc(CACHE_HASHSIZE,
+                                                  hashkeyfun, hashcmpfun)) == NULL)
+        {
+            free(my_instance);
+            return NULL;
+        }
+        hashtable_memory_fns(my_instance->cache, hstrdup, NULL,
+                             hfree, (HASHMEMORYFN)hentryfree);
+        memacct_register_pressure(cache_pressure, my_instance);
+
+        if (my_instance->peers != NULL || my_instance->listen_port > 0)
+        {
+            if ((my_instance->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+            {
+                MXS_ERROR("cachefilter: Unable to create the peer "
+                          "invalidation socket, peer invalidation is "
+                          "disabled.");
+            }
+            else if (my_instance->listen_port > 0)
+            {
+                struct sockaddr_in addr;
+
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl(INADDR_ANY);
+                addr.sin_port = htons(my_instance->listen_port);
+                if (bind(my_instance->sockfd, (struct sockaddr *)&addr,
+                         sizeof(addr)) == -1)
+                {
+                    MXS_ERROR("cachefilter: Unable to bind UDP port %d "
+                              "for peer invalidation, peer invalidations "
+                              "will not be received.",
+                              my_instance->listen_port);
+                }
+                else
+                {
+                    thread_start(&my_instance->listener,
+                                 cache_peer_listener, my_instance);
+                }
+            }
+        }
+    }
+    return (FILTER *)my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    CACHE_SESSION *my_session;
+
+    if ((my_session = calloc(1, sizeof(CACHE_SESSION))) != NULL)
+    {
+        my_session->session = session;
+        my_session->active = true;
+    }
+    return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *)session;
+
+    my_session->active = false;
+    session_reset_gather(my_session);
+    gwbuf_free(my_session->partial);
+    my_session->partial = NULL;
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    free(session);
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ * @param downstream    The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *)session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream component for this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ * @param upstream  The upstream filter or router
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *)session;
+
+    my_session->up = *upstream;
+}
+
+/**
+ * Check whether a statement may be served from and stored into the cache.
+ * Only plain SELECT statements that read database data qualify; anything
+ * that reads user or system variables, temporary tables or is bound to
+ * the master may give different results per connection and is passed
+ * through.
+ *
+ * @param qtype The classified type of the statement
+ * @param op    The operation of the statement
+ * @return True if the statement is cachable
+ */
+static bool
+statement_is_cachable(uint32_t qtype, qc_query_op_t op)
+{
+    return op == QUERY_OP_SELECT &&
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_TMP_TABLE);
+}
+
+/**
+ * Check whether a statement modifies data and so must flush the cache.
+ *
+ * @param qtype The classified type of the statement
+ * @param op    The operation of the statement
+ * @return True if the statement invalidates cached result sets
+ */
+static bool
+statement_is_write(uint32_t qtype, qc_query_op_t op)
+{
+    return QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) ||
+        (op & (QUERY_OP_UPDATE | QUERY_OP_INSERT | QUERY_OP_DELETE |
+               QUERY_OP_TRUNCATE | QUERY_OP_ALTER | QUERY_OP_CREATE |
+               QUERY_OP_DROP | QUERY_OP_LOAD)) != 0;
+}
+
+/**
+ * The routeQuery entry point. If the query is a cachable SELECT and an
+ * unexpired result set for the same statement text is in the cache, the
+ * cached reply is sent to the client directly and the backend is never
+ * touched. A cachable miss starts gathering the reply in clientReply and
+ * a write statement invalidates the entries that read the tables it
+ * writes, announcing the invalidation to any configured peers, before
+ * being routed.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *)instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *)session;
+    char *sql;
+
+    /** A new statement ends the gathering of any previous reply */
+    session_reset_gather(my_session);
+    gwbuf_free(my_session->partial);
+    my_session->partial = NULL;
+
+    if (modutil_is_SQL(queue) && (sql = modutil_get_SQL(queue)) != NULL)
+    {
+        uint32_t qtype = qc_get_type(queue);
+        qc_query_op_t op = qc_get_operation(queue);
+
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+        {
+            my_session->in_trx = true;
+        }
+        else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK) ||
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        {
+            my_session->in_trx = false;
+        }
+
+        if (statement_is_write(qtype, op))
+        {
+            int n_tables = 0;
+            char **tables = qc_get_table_names(queue, &n_tables, false);
+
+            cache_invalidate_tables(my_instance, tables, n_tables);
+            cache_announce(my_instance, tables, n_tables);
+            cache_free_tables(tables, n_tables);
+        }
+        else if (!my_session->in_trx && statement_is_cachable(qtype, op))
+        {
+            CACHE_ENTRY *entry;
+            GWBUF *reply = NULL;
+
+            spinlock_acquire(&my_instance->lock);
+            if ((entry = hashtable_fetch(my_instance->cache, sql)) != NULL)
+            {
+                if (entry->expires > time(NULL))
+                {
+                    reply = gwbuf_clone_all(entry->reply);
+                }
+                else
+                {
+                    hashtable_delete(my_instance->cache, sql);
+                }
+            }
+            spinlock_release(&my_instance->lock);
+
+            if (reply)
+            {
+                /** Serve the reply straight from the cache without
+                 * routing anything to a backend */
+                atomic_add(&my_instance->n_hits, 1);
+                free(sql);
+                gwbuf_free(queue);
+                return my_session->up.clientReply(my_session->up.instance,
+                                                  my_session->up.session,
+                                                  reply);
+            }
+
+            /** Start gathering the reply for this statement, noting
+             * the tables it reads for invalidation by later writes */
+            atomic_add(&my_instance->n_misses, 1);
+            my_session->key = sql;
+            my_session->tables = qc_get_table_names(queue,
+                                                    &my_session->n_tables,
+                                                    false);
+            sql = NULL;
+        }
+        free(sql);
+    }
+
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session,
+                                       queue);
+}
+
+/**
+ * The clientReply entry point. While a cachable statement is outstanding
+ * the complete packets of the reply are copied aside; when the terminating
+ * EOF packet arrives the gathered result set is stored in the cache. The
+ * reply data itself is forwarded unchanged.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The response data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *)instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *)session;
+    GWBUF *complete;
+    unsigned char *ptr;
+    int more = 0;
+
+    if (my_session->key == NULL)
+    {
+        return my_session->up.clientReply(my_session->up.instance,
+                                          my_session->up.session,
+                                          reply);
+    }
+
+    my_session->partial = gwbuf_append(my_session->partial, reply);
+    my_session->partial = gwbuf_make_contiguous(my_session->partial);
+    complete = modutil_get_complete_packets(&my_session->partial);
+
+    if (complete == NULL)
+    {
+        /** Wait for a complete packet before forwarding */
+        return 1;
+    }
+
+    complete = gwbuf_make_contiguous(complete);
+    ptr = (unsigned char*)complete->start;
+
+    if (!my_session->replied)
+    {
+        my_session->replied = true;
+        if (PTR_IS_ERR(ptr) || PTR_IS_OK(ptr) || PTR_IS_LOCAL_INFILE(ptr))
+        {
+            /** Not a result set, nothing to cache */
+            session_reset_gather(my_session);
+            return my_session->up.clientReply(my_session->up.instance,
+                                              my_session->up.session,
+                                              complete);
+        }
+    }
+
+    my_session->eof += modutil_count_signal_packets(complete, 0,
+                                                    my_session->eof > 0, &more);
+    my_session->gather = gwbuf_append(my_session->gather, gwbuf_clone(complete));
+
+    if (my_session->eof >= 2)
+    {
+        if (more)
+        {
+            /** A multi-result response cannot be replayed safely */
+            session_reset_gather(my_session);
+        }
+        else if (gwbuf_length(my_session->gather) > my_instance->max_resultset)
+        {
+            session_reset_gather(my_session);
+        }
+        else
+        {
+            CACHE_ENTRY *entry;
+
+            if ((entry = malloc(sizeof(CACHE_ENTRY))) != NULL)
+            {
+                entry->reply = my_session->gather;
+                entry->expires = time(NULL) + my_instance->ttl;
+                entry->tables = my_session->tables;
+                entry->n_tables = my_session->n_tables;
+                my_session->tables = NULL;
+                my_session->n_tables = 0;
+                my_session->gather = NULL;
+                memacct_add(MEM_ACCT_CACHE,
+                            (int64_t)sizeof(CACHE_ENTRY)
+                            + gwbuf_length(entry->reply));
+
+                spinlock_acquire(&my_instance->lock);
+                hashtable_delete(my_instance->cache, my_session->key);
+                if (hashtable_size(my_instance->cache) < my_instance->max_entries &&
+                    hashtable_add(my_instance->cache, my_session->key, entry))
+                {
+                    my_instance->n_stored++;
+                }
+                else
+                {
+                    cache_entry_free(entry);
+                }
+                spinlock_release(&my_instance->lock);
+            }
+            session_reset_gather(my_session);
+        }
+    }
+
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session,
+                                      complete);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb         The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *)instance;
+
+    dcb_printf(dcb, "\t\tTime to live:                   %d seconds\n",
+               my_instance->ttl);
+    dcb_printf(dcb, "\t\tMaximum entries:                %d\n",
+               my_instance->max_entries);
+    dcb_printf(dcb, "\t\tMaximum result set size:        %d bytes\n",
+               my_instance->max_resultset);
+    dcb_printf(dcb, "\t\tCached result sets:             %d\n",
+               hashtable_size(my_instance->cache));
+    dcb_printf(dcb, "\t\tCache hits:                     %d\n",
+               my_instance->n_hits);
+    dcb_printf(dcb, "\t\tCache misses:                   %d\n",
+               my_instance->n_misses);
+    dcb_printf(dcb, "\t\tResult sets stored:             %d\n",
+               my_instance->n_stored);
+    dcb_printf(dcb, "\t\tFlushes by write statements:    %d\n",
+               my_instance->n_flushes);
+    dcb_printf(dcb, "\t\tEntries invalidated by table:   %d\n",
+               my_instance->n_invalidated);
+    if (my_instance->peers)
+    {
+        CACHE_PEER *peer;
+
+        dcb_printf(dcb, "\t\tPeer instances:                 ");
+        for (peer = my_instance->peers; peer; peer = peer->next)
+        {
+            dcb_printf(dcb, "%s ", peer->name);
+        }
+        dcb_printf(dcb, "\n");
+        dcb_printf(dcb, "\t\tInvalidations sent to peers:    %d\n",
+                   my_instance->n_peer_sent);
+    }
+    if (my_instance->listen_port > 0)
+    {
+        dcb_printf(dcb, "\t\tPeer listen port:               %d\n",
+                   my_instance->listen_port);
+        dcb_printf(dcb, "\t\tInvalidations from peers:       %d\n",
+                   my_instance->n_peer_recv);
+    }
+}
@@ -78,8 +78,10 @@
 #include <spinlock.h>
 #include <skygw_types.h>
 #include <time.h>
+#include <ctype.h>
 #include <assert.h>
 #include <regex.h>
+#include <platform.h>
 #include <maxscale_pcre2.h>
 #include <dbfwfilter.h>
 #include <ruleparser.yy.h>
@@ -199,6 +201,7 @@ typedef struct rule_t
     bool allow; /*< Allow or deny the query if this rule matches */
     int times_matched; /*< Number of times this rule has been matched */
     TIMERANGE* active; /*< List of times when this rule is active */
+    HASHTABLE* cols; /*< Compiled column lookup table for column rules */
     struct rule_t *next;
 } RULE;
 
@@ -889,6 +892,7 @@ bool create_rule(void* scanner, const char* name)
         ruledef->active = NULL;
         ruledef->times_matched = 0;
         ruledef->data = NULL;
+        ruledef->cols = NULL;
         rstack->rule = ruledef;
     }
     else
@@ -921,6 +925,10 @@ static void free_rules(RULE* rule)
         {
             case RT_COLUMN:
                 strlink_free((STRLINK*) rule->data);
+                if (rule->cols)
+                {
+                    hashtable_free(rule->cols);
+                }
                 break;
 
             case RT_THROTTLE:
@@ -1315,6 +1323,62 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
  * @param instance Filter instance
  * @return True on success, false on error.
  */
+/**
+ * Compile the parsed ruleset into forms that evaluate in near constant
+ * time. Column rules get a hashtable of their lowercased column names,
+ * so matching a query touching n columns costs n lookups instead of a
+ * scan of the whole name list for every column, and regular expression
+ * rules are JIT compiled where PCRE2 supports it.
+ *
+ * @param rule  Head of the parsed rule list
+ * @return True if compilation succeeded
+ */
+static bool compile_rules(RULE* rule)
+{
+    while (rule)
+    {
+        if (rule->type == RT_COLUMN)
+        {
+            HASHTABLE *ht;
+            STRLINK *strln;
+
+            if ((ht = hashtable_alloc(17, simple_str_hash, strcmp)) == NULL)
+            {
+                return false;
+            }
+            hashtable_memory_fns(ht, (HASHMEMORYFN) strdup, NULL,
+                                 (HASHMEMORYFN) free, NULL);
+            for (strln = (STRLINK*) rule->data; strln; strln = strln->next)
+            {
+                char key[strlen(strln->value) + 1];
+                int i;
+
+                for (i = 0; strln->value[i]; i++)
+                {
+                    key[i] = tolower(strln->value[i]);
+                }
+                key[i] = '\0';
+                /** The original name is the value for use in messages;
+                 * duplicate names in the rule are simply redundant */
+                if (!hashtable_add(ht, key, strln->value) &&
+                    hashtable_fetch(ht, key) == NULL)
+                {
+                    hashtable_free(ht);
+                    return false;
+                }
+            }
+            rule->cols = ht;
+        }
+        else if (rule->type == RT_REGEX)
+        {
+            /** Failure means no JIT support; the interpreter is used */
+            pcre2_jit_compile((pcre2_code*) rule->data, PCRE2_JIT_COMPLETE);
+        }
+        rule = rule->next;
+    }
+    return true;
+}
+
 static bool process_rule_file(const char* filename, FW_INSTANCE* instance)
 {
     int rc = 1;
@@ -1342,7 +1406,8 @@ static bool process_rule_file(const char* filename, FW_INSTANCE* instance)
         dbfw_yylex_destroy(scanner);
         fclose(file);
 
-        if (rc == 0 && process_user_templates(instance, pstack.templates, pstack.rule))
+        if (rc == 0 && compile_rules(pstack.rule) &&
+            process_user_templates(instance, pstack.templates, pstack.rule))
         {
             instance->rules = pstack.rule;
         }
@@ -1653,13 +1718,84 @@ bool rule_is_active(RULE* rule)
     return true;
 }
 
+/**
+ * Per-query state shared by all the rules of one rule list walk. The
+ * affected fields of the query are resolved and tokenised at most once
+ * per query instead of once per column or wildcard rule.
+ */
+typedef struct
+{
+    GWBUF *queue; /*< The buffer containing the query */
+    char *query; /*< The query in null-terminated form */
+    bool fields_fetched; /*< Whether the affected fields have been resolved */
+    char *fields; /*< Lowercased affected fields, tokenised in place */
+    char **field_tok; /*< Pointers to the individual field names */
+    int n_fields; /*< Number of affected fields */
+    bool fields_wildcard; /*< Whether the fields contain a wildcard */
+} MATCH_CTX;
+
+/**
+ * Resolve the affected fields of the query into the match context on
+ * the first call; later calls for the same query are no-ops.
+ *
+ * @param ctx The match context to fill in
+ */
+static void match_ctx_fetch_fields(MATCH_CTX* ctx)
+{
+    char *ptr, *saveptr, *tok;
+    int cap = 1;
+
+    if (ctx->fields_fetched)
+    {
+        return;
+    }
+    ctx->fields_fetched = true;
+
+    if ((ctx->fields = qc_get_affected_fields(ctx->queue)) == NULL)
+    {
+        return;
+    }
+    ctx->fields_wildcard = strchr(ctx->fields, '*') != NULL;
+    for (ptr = ctx->fields; *ptr; ptr++)
+    {
+        if (*ptr == ' ' || *ptr == ',')
+        {
+            cap++;
+        }
+        *ptr = tolower(*ptr);
+    }
+    if ((ctx->field_tok = (char**) malloc(cap * sizeof(char*))) == NULL)
+    {
+        free(ctx->fields);
+        ctx->fields = NULL;
+        return;
+    }
+    tok = strtok_r(ctx->fields, " ,", &saveptr);
+    while (tok)
+    {
+        ctx->field_tok[ctx->n_fields++] = tok;
+        tok = strtok_r(NULL, " ,", &saveptr);
+    }
+}
+
+/**
+ * Release the memory held by a match context.
+ *
+ * @param ctx The match context to clean up
+ */
+static void match_ctx_free(MATCH_CTX* ctx)
+{
+    free(ctx->fields);
+    free(ctx->field_tok);
+}
+
 /**
  * Check if a query matches a single rule
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
  * @param queue The GWBUF containing the query
  * @param rulelist The rule to check
- * @param query Pointer to the null-terminated query string
+ * @param ctx The per-query match context
  * @return true if the query matches the rule
  */
 bool rule_matches(FW_INSTANCE* my_instance,
@@ -1667,15 +1803,13 @@ bool rule_matches(FW_INSTANCE* my_instance,
                   GWBUF *queue,
                   USER* user,
                   RULELIST *rulelist,
-                  char* query)
+                  MATCH_CTX* ctx)
 {
-    char *ptr, *where, *msg = NULL;
+    char *msg = NULL;
     char emsg[512];
 
-    unsigned char* memptr = (unsigned char*) queue->start;
     bool is_sql, is_real, matches;
     qc_query_op_t optype = QUERY_OP_UNDEFINED;
-    STRLINK* strln = NULL;
     QUERYSPEED* queryspeed = NULL;
     QUERYSPEED* rule_qs = NULL;
     time_t time_now;
@@ -1703,20 +1837,25 @@ bool rule_matches(FW_INSTANCE* my_instance,
                 break;
 
             case RT_REGEX:
-                if (query)
+                if (ctx->query)
                 {
-                    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(
-                                                                                   rulelist->rule->data, NULL);
+                    /** The match data block is reused for every match made
+                     * by this thread; captured substrings beyond its size
+                     * are discarded, which matching alone does not need. */
+                    static thread_local pcre2_match_data *mdata = NULL;
 
+                    if (mdata == NULL)
+                    {
+                        mdata = pcre2_match_data_create(16, NULL);
+                    }
                     if (mdata)
                     {
                         if (pcre2_match((pcre2_code*) rulelist->rule->data,
-                                        (PCRE2_SPTR) query, PCRE2_ZERO_TERMINATED,
+                                        (PCRE2_SPTR) ctx->query, PCRE2_ZERO_TERMINATED,
                                         0, 0, mdata, NULL) > 0)
                         {
                             matches = true;
                         }
-                        pcre2_match_data_free(mdata);
                         if (matches && !rulelist->rule->allow)
                         {
                             msg = strdup("Permission denied, query matched regular expression.");
@@ -1751,39 +1890,27 @@ bool rule_matches(FW_INSTANCE* my_instance,
             case RT_COLUMN:
                 if (is_sql && is_real)
                 {
-                    where = qc_get_affected_fields(queue);
-                    if (where != NULL)
+                    int i;
+                    char *column;
+
+                    match_ctx_fetch_fields(ctx);
+                    for (i = 0; i < ctx->n_fields; i++)
                     {
-                        char* saveptr;
-                        char* tok = strtok_r(where, " ", &saveptr);
-                        while (tok)
+                        if ((column = hashtable_fetch(rulelist->rule->cols,
+                                                      ctx->field_tok[i])) != NULL)
                         {
-                            strln = (STRLINK*) rulelist->rule->data;
-                            while (strln)
+                            matches = true;
+
+                            if (!rulelist->rule->allow)
                             {
-                                if (strcasecmp(tok, strln->value) == 0)
-                                {
-                                    matches = true;
-
-                                    if (!rulelist->rule->allow)
-                                    {
-                                        sprintf(emsg, "Permission denied to column '%s'.", strln->value);
-                                        MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
-                                                 rulelist->rule->name, strln->value);
-                                        msg = strdup(emsg);
-                                        free(where);
-                                        goto queryresolved;
-                                    }
-                                    else
-                                    {
-                                        break;
-                                    }
-                                }
-                                strln = strln->next;
+                                sprintf(emsg, "Permission denied to column '%s'.", column);
+                                MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
+                                         rulelist->rule->name, column);
+                                msg = strdup(emsg);
+                                goto queryresolved;
                             }
-                            tok = strtok_r(NULL, ",", &saveptr);
+                            break;
                         }
-                        free(where);
                     }
                 }
                 break;
@@ -1791,24 +1918,15 @@ bool rule_matches(FW_INSTANCE* my_instance,
             case RT_WILDCARD:
                 if (is_sql && is_real)
                 {
-                    char * strptr;
-                    where = qc_get_affected_fields(queue);
+                    match_ctx_fetch_fields(ctx);
 
-                    if (where != NULL)
+                    if (ctx->fields_wildcard)
                     {
-                        strptr = where;
-
-                        if (strchr(strptr, '*'))
-                        {
-
-                            matches = true;
-                            msg = strdup("Usage of wildcard denied.");
-                            MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
-                                     rulelist->rule->name);
-                            free(where);
-                            goto queryresolved;
-                        }
-                        free(where);
+                        matches = true;
+                        msg = strdup("Usage of wildcard denied.");
+                        MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
+                                 rulelist->rule->name);
+                        goto queryresolved;
                     }
                 }
                 break;
@@ -1954,7 +2072,9 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
         (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue) ||
          MYSQL_IS_COM_INIT_DB(queue)))
     {
-        char *fullquery = modutil_get_SQL(queue);
+        MATCH_CTX ctx = {0};
+        ctx.queue = queue;
+        ctx.query = modutil_get_SQL(queue);
         while (rulelist)
         {
             if (!rule_is_active(rulelist->rule))
@@ -1962,7 +2082,7 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
                 rulelist = rulelist->next;
                 continue;
             }
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (rule_matches(my_instance, my_session, queue, user, rulelist, &ctx))
             {
                 *rulename = rulelist->rule->name;
                 rval = true;
@@ -1971,7 +2091,8 @@ bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             rulelist = rulelist->next;
         }
 
-        free(fullquery);
+        free(ctx.query);
+        match_ctx_free(&ctx);
     }
     return rval;
 }
@@ -1993,7 +2114,9 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
 
     if (rulelist && (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue)))
     {
-        char *fullquery = modutil_get_SQL(queue);
+        MATCH_CTX ctx = {0};
+        ctx.queue = queue;
+        ctx.query = modutil_get_SQL(queue);
         rval = true;
         while (rulelist)
         {
@@ -2005,7 +2128,7 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
 
             have_active_rule = true;
 
-            if (!rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (!rule_matches(my_instance, my_session, queue, user, rulelist, &ctx))
             {
                 *rulename = rulelist->rule->name;
                 rval = false;
@@ -2022,7 +2145,8 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             /** No active rules */
             rval = false;
         }
-        free(fullquery);
+        free(ctx.query);
+        match_ctx_free(&ctx);
     }
 
     return rval;
@@ -158,9 +158,11 @@ HINTSTACK*      hint_stack;
                 ;
         /** Free stacked hints */
         hint_stack = my_session->stack;
-        
+
         while ((hint_stack = free_hint_stack(hint_stack)) != NULL)
                 ;
+        /** Free the memoised comment parses */
+        free_hint_cache(my_session);
 }
 
 /**
@@ -69,7 +69,12 @@ HINT_TOKEN kwords[] = {
 };
 */
 
-static HINT_TOKEN *hint_next_token(GWBUF **buf, char **ptr);
+static int hint_scan_maxscale(GWBUF *buf, char *ptr);
+static HINTCACHE_ENTRY *hint_cache_lookup(HINT_SESSION *session, GWBUF *buf,
+			char *ptr, unsigned int *hash, unsigned int *len);
+static void hint_cache_store(HINT_SESSION *session, unsigned int hash,
+			unsigned int len, GWBUF *buf, char *ptr, HINT *hints);
+static HINT_TOKEN *hint_next_token(GWBUF **buf, char **ptr, HINT_TOKEN *tok);
 static void hint_pop(HINT_SESSION *);
 static HINT *lookup_named_hint(HINT_SESSION *, char *);
 static void create_named_hint(HINT_SESSION *, char *, HINT *);
@@ -84,8 +89,8 @@ void token_free(HINT_TOKEN* token)
         if (token->value != NULL)
         {
                 free(token->value);
+                token->value = NULL;
         }
-        free(token);
 }
 
 
@@ -138,8 +143,13 @@ int		len, residual, state;
 int		found, escape, quoted, squoted;
 HINT		*rval = NULL;
 char		*pname, *lvalue, *hintname = NULL;
-GWBUF		*buf;
+GWBUF		*buf, *cbuf;
+char		*cptr;
+unsigned int	chash = 0, clen = 0;
+int		nomemo = 0;
+HINTCACHE_ENTRY	*cent;
 HINT_TOKEN	*tok;
+HINT_TOKEN	tokbuf;
 HINT_MODE	mode = HM_EXECUTE;
 
 	/* First look for any comment in the SQL */
@@ -222,24 +232,56 @@ HINT_MODE	mode = HM_EXECUTE;
 			goto retblock;
 	}
 
-	tok = hint_next_token(&buf, &ptr);
-        
+	/*
+	 * The outcome of parsing a comment depends only on its bytes, so
+	 * first check the per session memo of previously parsed comment
+	 * spans. Repeated identical comments - an ORM stamping the same
+	 * boilerplate on every statement is the common case - are then
+	 * answered with a single hash lookup. The memo belongs to the
+	 * session, so no locking is involved.
+	 */
+	cbuf = buf;
+	cptr = ptr;
+	if ((cent = hint_cache_lookup(session, buf, ptr, &chash, &clen)) != NULL)
+	{
+		if (cent->hints != NULL)
+		{
+			return hint_dup(cent->hints);
+		}
+		goto retblock;
+	}
+
+	/*
+	 * Almost every comment the filter sees is an ordinary SQL comment.
+	 * Reject those with a plain byte compare against the 'maxscale'
+	 * keyword before the tokeniser touches any memory, so a hint free
+	 * statement is processed without a single allocation.
+	 */
+	if (!hint_scan_maxscale(buf, ptr))
+	{
+		hint_cache_store(session, chash, clen, cbuf, cptr, NULL);
+		goto retblock;
+	}
+
+	tok = hint_next_token(&buf, &ptr, &tokbuf);
+
         if (tok == NULL)
         {
                 goto retblock;
         }
-        
+
         /** This is not MaxScale hint because it doesn't start with 'maxscale' */
 	if (tok->token != TOK_MAXSCALE)
 	{
 		token_free(tok);
+		hint_cache_store(session, chash, clen, cbuf, cptr, NULL);
 		goto retblock;
 	}
 	token_free(tok);
-        
+
 	state = HS_INIT;
-        
-	while ((tok = hint_next_token(&buf, &ptr)) != NULL
+
+	while ((tok = hint_next_token(&buf, &ptr, &tokbuf)) != NULL
 					&& tok->token != TOK_EOL)
 	{
 		switch (state)
@@ -257,6 +299,7 @@ HINT_MODE	mode = HM_EXECUTE;
 			case TOK_STOP:
 				/* Action: pop active hint */
 				hint_pop(session);
+				nomemo = 1;
 				state = HS_INIT;
 				break;
 			case TOK_START:
@@ -454,6 +497,16 @@ HINT_MODE	mode = HM_EXECUTE;
 		break;
 	}
 
+	/*
+	 * Only one-off results may be memoised; STOP, START and PREPARE
+	 * hints all change the session state, so replaying their result
+	 * from the memo would skip the state change.
+	 */
+	if (mode == HM_EXECUTE && nomemo == 0)
+	{
+		hint_cache_store(session, chash, clen, cbuf, cptr, rval);
+	}
+
 retblock:
 	if (rval == NULL)
 	{
@@ -466,26 +519,219 @@ retblock:
 	return rval;
 }
 
+/**
+ * Check, without allocating any memory, whether the comment starting at
+ * ptr begins with the keyword 'maxscale'. The comparison is a plain
+ * linear pass over the bytes, so hint free statements are rejected at
+ * close to memory speed.
+ *
+ * @param buf	The buffer the comment starts in
+ * @param ptr	Pointer to the first character of the comment body
+ * @return Non-zero if the comment begins with the maxscale keyword
+ */
+static int
+hint_scan_maxscale(GWBUF *buf, char *ptr)
+{
+static const char keyword[] = "maxscale";
+const char	*kp = keyword;
+
+	while (ptr < (char *)(buf->end) || buf->next)
+	{
+		if (ptr >= (char *)(buf->end))
+		{
+			buf = buf->next;
+			ptr = (char *)(buf->start);
+			continue;
+		}
+		if (*kp == '\0')
+		{
+			/* The keyword must end the word to match */
+			return isspace(*ptr) || *ptr == '=' ||
+				*ptr == '*' || *ptr == '/';
+		}
+		if (kp == keyword && (isspace(*ptr) || *ptr == '*'))
+		{
+			/* Leading white space or comment decoration */
+			ptr++;
+			continue;
+		}
+		if (tolower(*ptr) != *kp)
+		{
+			return 0;
+		}
+		kp++;
+		ptr++;
+	}
+	return *kp == '\0';
+}
+
+/**
+ * Look a comment span up in the session memo of parsed comments.
+ *
+ * The hash and length of the span, from the first comment character to
+ * the end of the statement, are computed in a single pass over the bytes
+ * and returned to the caller so that a newly parsed comment can later be
+ * stored with hint_cache_store. A span longer than HINT_CACHE_MAX_LEN is
+ * never memoised; a zero length is returned for it and hint_cache_store
+ * ignores it.
+ *
+ * @param session	The filter session
+ * @param buf		The buffer the comment starts in
+ * @param ptr		Pointer to the first character of the comment body
+ * @param hash		Returns the hash of the comment span
+ * @param len		Returns the length of the comment span
+ * @return The matching memo entry or NULL if there is none
+ */
+static HINTCACHE_ENTRY *
+hint_cache_lookup(HINT_SESSION *session, GWBUF *buf, char *ptr,
+			unsigned int *hash, unsigned int *len)
+{
+HINTCACHE_ENTRY	*entry;
+GWBUF		*cmp = buf;
+char		*cp = ptr;
+unsigned int	h = 2166136261U, n = 0, i;
+
+	*len = 0;
+	while (ptr < (char *)(buf->end) || buf->next)
+	{
+		if (ptr >= (char *)(buf->end))
+		{
+			buf = buf->next;
+			ptr = (char *)(buf->start);
+			continue;
+		}
+		if (++n > HINT_CACHE_MAX_LEN)
+		{
+			return NULL;
+		}
+		h = (h ^ (unsigned char)*ptr) * 16777619U;
+		ptr++;
+	}
+	*hash = h;
+	*len = n;
+	entry = &session->cache[h % HINT_CACHE_SIZE];
+	if (entry->comment == NULL || entry->hash != h || entry->len != n)
+	{
+		return NULL;
+	}
+	/* The hash matched, confirm with a byte compare of the span */
+	for (i = 0; i < n; i++)
+	{
+		while (cp >= (char *)(cmp->end))
+		{
+			cmp = cmp->next;
+			cp = (char *)(cmp->start);
+		}
+		if (*cp != entry->comment[i])
+		{
+			return NULL;
+		}
+		cp++;
+	}
+	return entry;
+}
+
+/**
+ * Memoise the parse result of a comment span. The entry takes private
+ * copies of both the comment bytes and the hint list; a NULL hints
+ * pointer records a comment that produced no hints, which is the common
+ * case. Whatever previously occupied the slot is evicted. A memory
+ * shortage simply skips the memoisation.
+ *
+ * @param session	The filter session
+ * @param hash		Hash of the span from hint_cache_lookup
+ * @param len		Length of the span from hint_cache_lookup
+ * @param buf		The buffer the comment starts in
+ * @param ptr		Pointer to the first character of the comment body
+ * @param hints		The parsed hints or NULL for no hints
+ */
+static void
+hint_cache_store(HINT_SESSION *session, unsigned int hash, unsigned int len,
+			GWBUF *buf, char *ptr, HINT *hints)
+{
+HINTCACHE_ENTRY	*entry;
+HINT		*hint;
+char		*copy, *dest;
+unsigned int	i;
+
+	if (len == 0 || (copy = (char *)malloc(len)) == NULL)
+	{
+		return;
+	}
+	dest = copy;
+	for (i = 0; i < len; i++)
+	{
+		while (ptr >= (char *)(buf->end))
+		{
+			buf = buf->next;
+			ptr = (char *)(buf->start);
+		}
+		*dest++ = *ptr++;
+	}
+	entry = &session->cache[hash % HINT_CACHE_SIZE];
+	if (entry->comment)
+	{
+		free(entry->comment);
+		while (entry->hints)
+		{
+			hint = entry->hints;
+			entry->hints = entry->hints->next;
+			hint_free(hint);
+		}
+	}
+	entry->hash = hash;
+	entry->len = len;
+	entry->comment = copy;
+	entry->hints = hints ? hint_dup(hints) : NULL;
+}
+
+/**
+ * Free the memoised comment parses of a hint session, called when the
+ * session is being closed.
+ *
+ * @param session	The filter session
+ */
+void
+free_hint_cache(HINT_SESSION *session)
+{
+HINT	*hint;
+int	i;
+
+	for (i = 0; i < HINT_CACHE_SIZE; i++)
+	{
+		if (session->cache[i].comment)
+		{
+			free(session->cache[i].comment);
+			session->cache[i].comment = NULL;
+		}
+		while (session->cache[i].hints)
+		{
+			hint = session->cache[i].hints;
+			session->cache[i].hints = session->cache[i].hints->next;
+			hint_free(hint);
+		}
+	}
+}
+
 /**
  * Return the next token in the inout stream
  *
  * @param buf	A pointer to the buffer point, will be updated if a
  *		new buffer is used.
  * @param ptr	The pointer within the buffer we are processing
+ * @param tok	Caller allocated token to fill in, so that the tokeniser
+ *		itself makes no allocations for keyword tokens
  * @return A HINT token
  */
 static HINT_TOKEN *
-hint_next_token(GWBUF **buf, char **ptr)
+hint_next_token(GWBUF **buf, char **ptr, HINT_TOKEN *tok)
 {
 char		word[100], *dest;
 int		inword = 0;
  int		endtag = 0;
 char		inquote = '\0';
 int		i, found;
-HINT_TOKEN	*tok;
 
-	if ((tok = (HINT_TOKEN *)malloc(sizeof(HINT_TOKEN))) == NULL)
-		return NULL;
 	tok->value = NULL;
 	dest = word;
 	while (*ptr < (char *)((*buf)->end) || (*buf)->next)
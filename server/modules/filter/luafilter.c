@@ -39,6 +39,16 @@
  * is defined and valid, the matching entry point function in Lua will be called.
  * The same holds true for session script apart from no calls to createInstance
  * or diagnostic being made for the session script.
+ *
+ * Both scripts are precompiled to bytecode when the instance is created. The
+ * session script is instantiated from the bytecode for each new session and the
+ * global script is used to initialise a pool of identical Lua states from which
+ * the per query calls, routeQuery and clientReply, check a state out and return
+ * it afterwards. The pool removes the instance wide lock from the query path;
+ * the cost is that the global script's routeQuery and clientReply run in
+ * whichever pooled state was free, so Lua globals they modify are per state
+ * rather than shared. The session lifecycle entry points and diagnostic still
+ * run in the single shared state of the global script.
  */
 
 #include <skygw_types.h>
@@ -128,6 +138,12 @@ static int id_gen(lua_State* state)
     return 1;
 }
 
+/** Maximum number of Lua states kept in the pool of an instance */
+#define LUA_POOL_MAX 16
+
+/** Number of pooled states created up front when an instance is created */
+#define LUA_POOL_PREFILL 4
+
 /**
  * The Lua filter instance.
  */
@@ -136,6 +152,17 @@ typedef struct
     lua_State* global_lua_state;
     char* global_script;
     char* session_script;
+    char* global_bytecode;      /*< Precompiled global script */
+    size_t global_bytecode_len; /*< Length of the global bytecode */
+    char* session_bytecode;     /*< Precompiled session script */
+    size_t session_bytecode_len;/*< Length of the session bytecode */
+    lua_State* state_pool[LUA_POOL_MAX]; /*< Pre-initialized states for the
+                                          * per query calls of the global
+                                          * script */
+    int n_pool;                 /*< Number of states in the pool */
+    SPINLOCK pool_lock;         /*< Lock protecting the pool, held only for
+                                 * the checkout and return, never while a
+                                 * script is executing */
     SPINLOCK lock;
 } LUA_INSTANCE;
 
@@ -160,6 +187,161 @@ ModuleInit()
 {
 }
 
+/**
+ * Buffer used to collect the output of lua_dump
+ */
+typedef struct
+{
+    char* data;   /*< The bytecode collected so far */
+    size_t len;   /*< Length of the bytecode */
+} LUA_DUMP_BUFFER;
+
+/**
+ * Writer callback for lua_dump, appends a chunk of bytecode to the buffer
+ * @param state Lua state
+ * @param p Chunk of bytecode
+ * @param sz Size of the chunk
+ * @param ud The LUA_DUMP_BUFFER to append to
+ * @return 0 on success, non-zero on memory allocation failure
+ */
+static int dump_writer(lua_State* state, const void* p, size_t sz, void* ud)
+{
+    LUA_DUMP_BUFFER* buf = (LUA_DUMP_BUFFER*) ud;
+    char* tmp = realloc(buf->data, buf->len + sz);
+
+    if (tmp == NULL)
+    {
+        return 1;
+    }
+    memcpy(tmp + buf->len, p, sz);
+    buf->data = tmp;
+    buf->len += sz;
+    return 0;
+}
+
+/**
+ * Compile a Lua script to bytecode
+ *
+ * The bytecode can be loaded into a fresh state with luaL_loadbuffer without
+ * the script being read and parsed again.
+ *
+ * @param script Path to the script to compile
+ * @param bytecode Pointer to where the bytecode is stored
+ * @param len Pointer to where the bytecode length is stored
+ * @return True if the script was compiled
+ */
+static bool precompile_script(const char* script, char** bytecode, size_t* len)
+{
+    lua_State* state;
+    LUA_DUMP_BUFFER buf = {NULL, 0};
+
+    if ((state = luaL_newstate()) == NULL)
+    {
+        return false;
+    }
+
+    if (luaL_loadfile(state, script) || lua_dump(state, dump_writer, &buf))
+    {
+        MXS_WARNING("luafilter: Failed to precompile script at '%s': %s.",
+                    script, lua_tostring(state, -1));
+        free(buf.data);
+        lua_close(state);
+        return false;
+    }
+    lua_close(state);
+    *bytecode = buf.data;
+    *len = buf.len;
+    return true;
+}
+
+/**
+ * Create a new Lua state initialized from the precompiled global script
+ *
+ * The bytecode of the global script is loaded and executed so that the entry
+ * point functions it defines exist in the new state.
+ *
+ * @param my_instance The filter instance
+ * @return The new state or NULL on failure
+ */
+static lua_State* lua_pool_state_new(LUA_INSTANCE* my_instance)
+{
+    lua_State* state;
+
+    if (my_instance->global_bytecode == NULL ||
+        (state = luaL_newstate()) == NULL)
+    {
+        return NULL;
+    }
+    luaL_openlibs(state);
+
+    if (luaL_loadbuffer(state, my_instance->global_bytecode,
+                        my_instance->global_bytecode_len,
+                        my_instance->global_script) ||
+        lua_pcall(state, 0, 0, 0))
+    {
+        MXS_ERROR("luafilter: Failed to initialize a pooled state from '%s': %s.",
+                  my_instance->global_script, lua_tostring(state, -1));
+        lua_close(state);
+        return NULL;
+    }
+    return state;
+}
+
+/**
+ * Check a Lua state out of the pool of the instance
+ *
+ * If the pool is empty a fresh state is created from the precompiled global
+ * script so that a query never waits for another query to release a state.
+ *
+ * @param my_instance The filter instance
+ * @return A state initialized with the global script or NULL if the global
+ * script could not be precompiled
+ */
+static lua_State* lua_pool_get(LUA_INSTANCE* my_instance)
+{
+    lua_State* state = NULL;
+
+    spinlock_acquire(&my_instance->pool_lock);
+    if (my_instance->n_pool > 0)
+    {
+        state = my_instance->state_pool[--my_instance->n_pool];
+    }
+    spinlock_release(&my_instance->pool_lock);
+
+    if (state == NULL)
+    {
+        state = lua_pool_state_new(my_instance);
+    }
+    return state;
+}
+
+/**
+ * Return a Lua state to the pool of the instance
+ *
+ * The stack of the state is cleared before it is pooled. If the pool is
+ * already full the state is closed.
+ *
+ * @param my_instance The filter instance
+ * @param state The state to return
+ */
+static void lua_pool_put(LUA_INSTANCE* my_instance, lua_State* state)
+{
+    lua_settop(state, 0);
+
+    spinlock_acquire(&my_instance->pool_lock);
+    if (my_instance->n_pool < LUA_POOL_MAX)
+    {
+        my_instance->state_pool[my_instance->n_pool++] = state;
+        state = NULL;
+    }
+    spinlock_release(&my_instance->pool_lock);
+
+    if (state)
+    {
+        lua_close(state);
+    }
+}
+
 /**
  * Create a new instance of the Lua filter.
  *
@@ -181,6 +363,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
     }
 
     spinlock_init(&my_instance->lock);
+    spinlock_init(&my_instance->pool_lock);
 
     for (int i = 0; params[i] && !error; i++)
     {
@@ -241,6 +424,38 @@ createInstance(char **options, FILTER_PARAMETER **params)
         }
     }
 
+    if (my_instance)
+    {
+        /*
+         * Precompile the scripts. If the precompilation fails a warning
+         * has been logged and the filter falls back to loading the script
+         * from the file and taking the instance lock for every query.
+         */
+        if (my_instance->global_script &&
+            precompile_script(my_instance->global_script,
+                              &my_instance->global_bytecode,
+                              &my_instance->global_bytecode_len))
+        {
+            while (my_instance->n_pool < LUA_POOL_PREFILL)
+            {
+                lua_State* state = lua_pool_state_new(my_instance);
+
+                if (state == NULL)
+                {
+                    break;
+                }
+                my_instance->state_pool[my_instance->n_pool++] = state;
+            }
+        }
+
+        if (my_instance->session_script)
+        {
+            precompile_script(my_instance->session_script,
+                              &my_instance->session_bytecode,
+                              &my_instance->session_bytecode_len);
+        }
+    }
+
     return(FILTER *) my_instance;
 }
 
@@ -275,10 +490,26 @@ static void * newSession(FILTER *instance, SESSION *session)
 
     if (my_instance->session_script)
     {
+        int rc;
+
         my_session->lua_state = luaL_newstate();
         luaL_openlibs(my_session->lua_state);
 
-        if (luaL_dofile(my_session->lua_state, my_instance->session_script))
+        if (my_instance->session_bytecode)
+        {
+            /* Instantiate the session script from the precompiled bytecode */
+            rc = luaL_loadbuffer(my_session->lua_state,
+                                 my_instance->session_bytecode,
+                                 my_instance->session_bytecode_len,
+                                 my_instance->session_script) ||
+                lua_pcall(my_session->lua_state, 0, 0, 0);
+        }
+        else
+        {
+            rc = luaL_dofile(my_session->lua_state, my_instance->session_script);
+        }
+
+        if (rc)
         {
             MXS_ERROR("luafilter: Failed to execute session script at '%s': %s.",
                       my_instance->session_script,
@@ -368,7 +599,10 @@ static void closeSession(FILTER *instance, void *session)
 static void freeSession(FILTER *instance, void *session)
 {
     LUA_SESSION *my_session = (LUA_SESSION *) session;
-    lua_close(my_session->lua_state);
+    if (my_session->lua_state)
+    {
+        lua_close(my_session->lua_state);
+    }
     free(my_session);
 }
 
@@ -425,14 +659,29 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
     }
     if (my_instance->global_lua_state)
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "clientReply");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_State *state = lua_pool_get(my_instance);
+
+        if (state)
         {
-            MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
-                      lua_tostring(my_session->lua_state, -1));
+            lua_getglobal(state, "clientReply");
+            if (lua_pcall(state, 0, 0, 0))
+            {
+                MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
+                          lua_tostring(state, -1));
+            }
+            lua_pool_put(my_instance, state);
+        }
+        else
+        {
+            spinlock_acquire(&my_instance->lock);
+            lua_getglobal(my_instance->global_lua_state, "clientReply");
+            if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+            {
+                MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
+                          lua_tostring(my_instance->global_lua_state, -1));
+            }
+            spinlock_release(&my_instance->lock);
         }
-        spinlock_release(&my_instance->lock);
     }
 
     return my_session->up.clientReply(my_session->up.instance,
@@ -501,31 +750,45 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
 
         if (my_instance->global_lua_state)
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "routeQuery");
-            lua_pushlstring(my_instance->global_lua_state, fullquery, strlen(fullquery));
-            if (lua_pcall(my_instance->global_lua_state, 1, 0, 0))
+            lua_State *state = lua_pool_get(my_instance);
+            bool pooled = state != NULL;
+
+            if (!pooled)
+            {
+                spinlock_acquire(&my_instance->lock);
+                state = my_instance->global_lua_state;
+            }
+            lua_getglobal(state, "routeQuery");
+            lua_pushlstring(state, fullquery, strlen(fullquery));
+            if (lua_pcall(state, 1, 0, 0))
             {
                 MXS_ERROR("luafilter: Global scope call to 'routeQuery' failed: '%s'.",
-                          lua_tostring(my_session->lua_state, -1));
+                          lua_tostring(state, -1));
             }
-            else if (lua_gettop(my_instance->global_lua_state))
+            else if (lua_gettop(state))
             {
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                if (lua_isstring(state, -1))
                 {
                     if (forward)
                     {
                         gwbuf_free(forward);
                     }
                     forward = modutil_create_query((char*)
-                                                   lua_tostring(my_instance->global_lua_state, -1));
+                                                   lua_tostring(state, -1));
                 }
-                else if (lua_isboolean(my_instance->global_lua_state, -1))
+                else if (lua_isboolean(state, -1))
                 {
-                    route = lua_toboolean(my_instance->global_lua_state, -1);
+                    route = lua_toboolean(state, -1);
                 }
             }
-            spinlock_release(&my_instance->lock);
+            if (pooled)
+            {
+                lua_pool_put(my_instance, state);
+            }
+            else
+            {
+                spinlock_release(&my_instance->lock);
+            }
         }
 
         free(fullquery);
@@ -589,5 +852,9 @@ static void diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         {
             dcb_printf(dcb, "Session script: %s\n", my_instance->session_script);
         }
+        if (my_instance->global_bytecode)
+        {
+            dcb_printf(dcb, "Pooled Lua states: %d\n", my_instance->n_pool);
+        }
     }
 }
@@ -0,0 +1,157 @@
+/*
+ * This file is distributed as part of MaxScale by MariaDB Corporation.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file maxqlalog.c  - Convert binary qlafilter log segments to text
+ *
+ * Reads one or more segment files written by the qlafilter with
+ * format=binary and prints the records as text, one line per record.
+ * Reading stops at the first record with a zero timestamp, which marks
+ * the zero filled tail of a segment that was not completely written.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date		Who		Description
+ * 03/07/16	Mark Riddoch	Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <qlabinlog.h>
+
+/**
+ * Print the records of a single segment file.
+ *
+ * @param path  The segment file to print
+ * @return Zero on success, non-zero if the file could not be read
+ */
+static int
+print_segment(const char *path)
+{
+    QLA_BIN_HEADER header;
+    struct stat st;
+    uint8_t *map;
+    size_t offset;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        fprintf(stderr, "maxqlalog: Failed to open %s\n", path);
+        return 1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(header))
+    {
+        fprintf(stderr, "maxqlalog: %s is too short to be a log segment\n",
+                path);
+        close(fd);
+        return 1;
+    }
+    if ((map = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "maxqlalog: Failed to map %s\n", path);
+        close(fd);
+        return 1;
+    }
+
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, QLA_BIN_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "maxqlalog: %s is not a binary qlafilter log\n",
+                path);
+        munmap(map, st.st_size);
+        close(fd);
+        return 1;
+    }
+    if (header.version != QLA_BIN_VERSION)
+    {
+        fprintf(stderr,
+                "maxqlalog: %s has format version %u, expected %u\n",
+                path, header.version, QLA_BIN_VERSION);
+        munmap(map, st.st_size);
+        close(fd);
+        return 1;
+    }
+
+    offset = (sizeof(header) + QLA_BIN_ALIGN - 1)
+        & ~(size_t)(QLA_BIN_ALIGN - 1);
+    while (offset + sizeof(QLA_BIN_RECORD) <= (size_t) st.st_size)
+    {
+        QLA_BIN_RECORD record;
+        time_t seconds;
+        struct tm t;
+        char tbuf[32];
+
+        memcpy(&record, map + offset, sizeof(record));
+        if (record.timestamp == 0)
+        {
+            /* The zero filled tail of a partially written segment */
+            break;
+        }
+        if (offset + QLA_BIN_RECLEN(record.sql_len) > (size_t) st.st_size)
+        {
+            fprintf(stderr, "maxqlalog: Truncated record in %s\n", path);
+            break;
+        }
+
+        seconds = record.timestamp / 1000000;
+        localtime_r(&seconds, &t);
+        strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &t);
+        printf("%s.%06u %02d/%02d/%d, session %lu, digest %08x, "
+               "duration %uus, %.*s%s\n",
+               tbuf, (unsigned) (record.timestamp % 1000000),
+               t.tm_mday, t.tm_mon + 1, 1900 + t.tm_year,
+               (unsigned long) record.session, record.digest,
+               record.duration,
+               (int) record.sql_len, (char *) (map + offset + sizeof(record)),
+               record.full_len > record.sql_len ? "..." : "");
+
+        offset += QLA_BIN_RECLEN(record.sql_len);
+    }
+
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, rval = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: maxqlalog <segment file> ...\n");
+        return 1;
+    }
+    for (i = 1; i < argc; i++)
+    {
+        rval += print_segment(argv[i]);
+    }
+    return rval ? 1 : 0;
+}
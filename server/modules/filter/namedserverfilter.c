@@ -25,6 +25,8 @@
 #include <string.h>
 #include <regex.h>
 #include <hint.h>
+#include <spinlock.h>
+#include <stdint.h>
 
 /**
  * @file namedserverfilter.c - a very simple regular expression based filter
@@ -41,6 +43,13 @@
  *
  * Date         Who             Description
  * 22/01/2015   Mark Riddoch    Written as example based on regex filter
+ * 03/07/2016   Mark Riddoch    Instances share one match set that is run in
+ *                              a single pass and memoized by the statement
+ *                              digest, so a chain of these filters no longer
+ *                              extracts and matches the SQL once per filter
+ * 05/07/2016   Mark Riddoch    Patterns that are an anchored literal or a
+ *                              plain substring are matched with string
+ *                              compares instead of regexec
  * @endverbatim
  */
 
@@ -76,6 +85,16 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+/**
+ * The config time classification of the match pattern. A pattern with
+ * no regex metacharacters, optionally anchored with a leading ^, does
+ * not need the regex library at all and is run as a prefix compare or a
+ * substring search, which is far cheaper per statement.
+ */
+#define REGEXHINT_LITERAL_NONE   0  /* The pattern needs regexec */
+#define REGEXHINT_LITERAL_PREFIX 1  /* Anchored literal, prefix compare */
+#define REGEXHINT_LITERAL_SUBSTR 2  /* Plain literal, substring search */
+
 /**
  * Instance structure
  */
@@ -86,8 +105,132 @@ typedef struct
     char *match; /* Regular expression to match */
     char *server; /* Server to route to */
     regex_t re; /* Compiled regex text */
+    int literal_type; /* One of the REGEXHINT_LITERAL_* classifications */
+    char *literal; /* Literal text of an anchored or substring pattern */
+    int literal_len; /* Length of the literal text */
+    int icase; /* The literal is matched case insensitively */
+    int set_index; /* Position in the shared match set, -1 if not a member */
 } REGEXHINT_INSTANCE;
 
+/**
+ * The shared match set and the result memo
+ *
+ * Tenant routing configurations chain tens of these filters, which used
+ * to mean one SQL extraction and one regex execution per filter for
+ * every query. All instances now join a process wide match set: the
+ * first filter of a chain that sees a statement extracts the SQL once,
+ * runs every pattern of the set over it in a single pass and memoizes
+ * the result bits under the digest of the statement. The filters behind
+ * it, and every later repetition of the statement, answer from the memo
+ * without touching the SQL at all.
+ *
+ * POSIX regexec cannot report which branch of a combined alternation
+ * matched, so the set is a pass over the individual compiled patterns
+ * rather than one merged automaton; the memo makes the pass a once per
+ * distinct statement cost.
+ */
+#define REGEXHINT_SET_MAX    64     /* Instances the shared set can hold */
+#define REGEXHINT_MEMO_SLOTS 1024   /* Memo slots, must be a power of two */
+
+typedef struct
+{
+    uint64_t digest;    /* Digest of the statement, 0 for an empty slot */
+    uint64_t matches;   /* One bit per instance of the match set */
+    int n_valid;        /* Instances evaluated when the slot was filled */
+} REGEXHINT_MEMO;
+
+static REGEXHINT_INSTANCE *regexhint_set[REGEXHINT_SET_MAX];
+static int regexhint_set_size = 0;
+static REGEXHINT_MEMO regexhint_memo[REGEXHINT_MEMO_SLOTS];
+static SPINLOCK regexhint_lock = SPINLOCK_INIT;
+
+/**
+ * Look up the memoized match result of an instance for a statement.
+ *
+ * @param digest  The digest of the statement
+ * @param index   The match set index of the instance
+ * @param matched Set to the memoized result on a hit
+ * @return True when the memo held the result
+ */
+static bool
+regexhint_memo_lookup(uint64_t digest, int index, bool *matched)
+{
+    REGEXHINT_MEMO *slot = &regexhint_memo[digest & (REGEXHINT_MEMO_SLOTS - 1)];
+    bool hit = false;
+
+    spinlock_acquire(&regexhint_lock);
+    if (slot->digest == digest && index < slot->n_valid)
+    {
+        *matched = ((slot->matches >> index) & 1) != 0;
+        hit = true;
+    }
+    spinlock_release(&regexhint_lock);
+    return hit;
+}
+
+/**
+ * Match one instance against a statement, using the literal fast path
+ * of the instance when its pattern was classified as one at config
+ * time and falling back to the regex library otherwise.
+ *
+ * @param inst The instance whose pattern is matched
+ * @param sql  The SQL text of the statement
+ * @return True when the pattern matches
+ */
+static bool
+regexhint_match(REGEXHINT_INSTANCE *inst, const char *sql)
+{
+    switch (inst->literal_type)
+    {
+    case REGEXHINT_LITERAL_PREFIX:
+        return (inst->icase
+                ? strncasecmp(sql, inst->literal, inst->literal_len)
+                : strncmp(sql, inst->literal, inst->literal_len)) == 0;
+    case REGEXHINT_LITERAL_SUBSTR:
+        return (inst->icase
+                ? strcasestr(sql, inst->literal)
+                : strstr(sql, inst->literal)) != NULL;
+    }
+    return regexec(&inst->re, sql, 0, NULL, 0) == 0;
+}
+
+/**
+ * Run the whole match set over a statement and memoize the results.
+ *
+ * @param digest The digest of the statement
+ * @param sql    The SQL text of the statement
+ * @param index  The match set index of the asking instance
+ * @return The match result of the asking instance
+ */
+static bool
+regexhint_evaluate_set(uint64_t digest, char *sql, int index)
+{
+    REGEXHINT_MEMO *slot;
+    uint64_t bits = 0;
+    int i, n;
+
+    spinlock_acquire(&regexhint_lock);
+    n = regexhint_set_size;
+    spinlock_release(&regexhint_lock);
+
+    for (i = 0; i < n; i++)
+    {
+        if (regexhint_match(regexhint_set[i], sql))
+        {
+            bits |= 1UL << i;
+        }
+    }
+
+    slot = &regexhint_memo[digest & (REGEXHINT_MEMO_SLOTS - 1)];
+    spinlock_acquire(&regexhint_lock);
+    slot->digest = digest;
+    slot->matches = bits;
+    slot->n_valid = n;
+    spinlock_release(&regexhint_lock);
+
+    return ((bits >> index) & 1) != 0;
+}
+
 /**
  * The session structuee for this regex filter
  */
@@ -154,6 +297,9 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->server = NULL;
         my_instance->source = NULL;
         my_instance->user = NULL;
+        my_instance->literal_type = REGEXHINT_LITERAL_NONE;
+        my_instance->literal = NULL;
+        my_instance->set_index = -1;
         bool error = false;
 
         for (int i = 0; params && params[i]; i++)
@@ -241,6 +387,52 @@ createInstance(char **options, FILTER_PARAMETER **params)
             free(my_instance);
             my_instance = NULL;
         }
+        else
+        {
+            /*
+             * Patterns without metacharacters, allowing a leading ^
+             * anchor, are run as string compares; the compiled regex is
+             * kept only as the validated fallback classification. The
+             * metacharacter set covers both the basic and the extended
+             * grammar so the classification is safe whichever one the
+             * options selected.
+             */
+            const char *text = my_instance->match;
+
+            if (*text == '^')
+            {
+                my_instance->literal_type = REGEXHINT_LITERAL_PREFIX;
+                text++;
+            }
+            else
+            {
+                my_instance->literal_type = REGEXHINT_LITERAL_SUBSTR;
+            }
+            if (*text == '\0' || strpbrk(text, "\\^$.[]|()?*+{}") != NULL
+                || (my_instance->literal = strdup(text)) == NULL)
+            {
+                my_instance->literal_type = REGEXHINT_LITERAL_NONE;
+            }
+            else
+            {
+                my_instance->literal_len = strlen(my_instance->literal);
+                my_instance->icase = (cflags & REG_ICASE) != 0;
+                MXS_INFO("namedserverfilter: Pattern '%s' is a literal %s "
+                         "and is matched without the regex library.",
+                         my_instance->match,
+                         my_instance->literal_type == REGEXHINT_LITERAL_PREFIX
+                         ? "prefix" : "substring");
+            }
+
+            /* Join the shared match set */
+            spinlock_acquire(&regexhint_lock);
+            if (regexhint_set_size < REGEXHINT_SET_MAX)
+            {
+                my_instance->set_index = regexhint_set_size;
+                regexhint_set[regexhint_set_size++] = my_instance;
+            }
+            spinlock_release(&regexhint_lock);
+        }
 
     }
     return(FILTER *) my_instance;
@@ -341,6 +533,8 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     REGEXHINT_INSTANCE *my_instance = (REGEXHINT_INSTANCE *) instance;
     REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) session;
     char *sql;
+    bool matched = false;
+    bool have_result = false;
 
     if (modutil_is_SQL(queue) && my_session->active)
     {
@@ -348,9 +542,34 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         {
             queue = gwbuf_make_contiguous(queue);
         }
-        if ((sql = modutil_get_SQL(queue)) != NULL)
+        /*
+         * Answer from the memo when the statement carries a digest,
+         * evaluating the whole match set once on a miss. Instances that
+         * did not fit in the match set match their own pattern as
+         * before.
+         */
+        if (my_instance->set_index >= 0 && GWBUF_DIGEST(queue) != 0)
         {
-            if (regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+            have_result = regexhint_memo_lookup(GWBUF_DIGEST(queue),
+                                                my_instance->set_index,
+                                                &matched);
+            if (!have_result && (sql = modutil_get_SQL(queue)) != NULL)
+            {
+                matched = regexhint_evaluate_set(GWBUF_DIGEST(queue), sql,
+                                                 my_instance->set_index);
+                have_result = true;
+                free(sql);
+            }
+        }
+        if (!have_result && (sql = modutil_get_SQL(queue)) != NULL)
+        {
+            matched = regexhint_match(my_instance, sql);
+            have_result = true;
+            free(sql);
+        }
+        if (have_result)
+        {
+            if (matched)
             {
                 queue->hint = hint_create_route(queue->hint,
                                                 HINT_ROUTE_TO_NAMED_SERVER,
@@ -361,7 +580,6 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
             {
                 my_session->n_undiverted++;
             }
-            free(sql);
         }
     }
     return my_session->down.routeQuery(my_session->down.instance,
@@ -31,16 +31,33 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * With format=binary the filter instead writes fixed format records for
+ * all sessions into preallocated, memory mapped segment files; see
+ * qlabinlog.h for the format and the maxqlalog tool for conversion back
+ * to text. The binary records are written with a pair of memory copies
+ * into the mapping, so no flusher thread is involved, and a mapped
+ * segment survives a crash of the process up to the last record written.
+ *
  * Date         Who             Description
  * 03/06/2014   Mark Riddoch    Initial implementation
  * 11/06/2014   Mark Riddoch    Addition of source and match parameters
  * 19/06/2014   Mark Riddoch    Addition of user parameter
+ * 26/04/2016   Mark Riddoch    Write the log asynchronously in a flusher
+ *                              thread rather than in routeQuery
+ * 03/07/2016   Mark Riddoch    Binary record format written into memory
+ *                              mapped preallocated segments
+ * 04/07/2016   Mark Riddoch    Binary records carry the interned statement
+ *                              digest identifier when one is available
  *
  * @endverbatim
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <filter.h>
 #include <modinfo.h>
@@ -52,6 +69,9 @@
 #include <regex.h>
 #include <string.h>
 #include <atomic.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <qlabinlog.h>
 
 MODULE_INFO info =
 {
@@ -61,7 +81,7 @@ MODULE_INFO info =
     "A simple query logging filter"
 };
 
-static char *version_str = "V1.1.1";
+static char *version_str = "V1.2.0";
 
 /*
  * The filter entry points
@@ -71,7 +91,9 @@ static void *newSession(FILTER *instance, SESSION *session);
 static void closeSession(FILTER *instance, void *session);
 static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *reply);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
 
 
@@ -82,12 +104,34 @@ static FILTER_OBJECT MyObject =
     closeSession,
     freeSession,
     setDownstream,
-    NULL, // No Upstream requirement
+    setUpstream,
     routeQuery,
-    NULL, // No client reply
+    clientReply, // Needed to measure the duration of the binary records
     diagnostic,
 };
 
+/** Maximum number of log records buffered before new records are dropped */
+#define QLA_QUEUE_MAX 4096
+
+/** How long the flusher thread sleeps when the queue is empty, in milliseconds */
+#define QLA_FLUSH_INTERVAL 10
+
+/** Default size of a binary log segment file */
+#define QLA_SEGMENT_SIZE_DEFAULT (16 * 1024 * 1024)
+
+/** Smallest allowed binary log segment, headers must always fit */
+#define QLA_SEGMENT_SIZE_MIN (64 * 1024)
+
+/**
+ * A formatted log record awaiting the flusher thread
+ */
+typedef struct qla_log_record
+{
+    FILE *fp; /* The file the record is written to */
+    char *text; /* The formatted log line */
+    struct qla_log_record *next; /* Next record in the queue */
+} QLA_LOG_RECORD;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -106,6 +150,20 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    SPINLOCK qlock; /* Protects the pending record queue */
+    QLA_LOG_RECORD *qhead; /* Oldest pending log record */
+    QLA_LOG_RECORD *qtail; /* Newest pending log record */
+    int qlen; /* Number of pending log records */
+    int dropped; /* Records dropped because the queue was full */
+    int flushing; /* Set while the flusher thread writes a batch */
+    THREAD flusher; /* The background flusher thread */
+    int binfmt; /* Log in the binary format rather than as text */
+    size_t segment_size; /* Size of a binary log segment file */
+    SPINLOCK binlock; /* Protects the binary segment state below */
+    int binfd; /* File descriptor of the current segment */
+    uint8_t *binmap; /* Mapping of the current segment */
+    size_t binoff; /* Write offset within the current segment */
+    int binseq; /* Sequence number of the current segment */
 } QLA_INSTANCE;
 
 /**
@@ -119,13 +177,270 @@ typedef struct
 typedef struct
 {
     DOWNSTREAM down;
+    UPSTREAM up;
     char *filename;
     FILE *fp;
     int active;
     char *user;
     char *remote;
+    uint64_t ses_id; /* Id of the client session, written into binary records */
+    int bin_pending; /* A binary record is awaiting its reply */
+    uint64_t pend_ts; /* Timestamp of the pending record */
+    uint32_t pend_digest; /* Digest of the pending statement */
+    uint16_t pend_len; /* Stored length of the pending statement */
+    uint16_t pend_full; /* Untruncated length of the pending statement */
+    char pend_sql[QLA_BIN_SQL_MAX]; /* Text of the pending statement */
 } QLA_SESSION;
 
+/**
+ * Write a list of log records and free them.
+ *
+ * @param records   The records to write
+ */
+static void
+qla_write_records(QLA_LOG_RECORD *records)
+{
+    while (records)
+    {
+        QLA_LOG_RECORD *next = records->next;
+
+        fputs(records->text, records->fp);
+        free(records->text);
+        free(records);
+        records = next;
+    }
+}
+
+/**
+ * The log flusher thread. Takes the whole pending queue in one go and
+ * writes it out, then sleeps until more records arrive. The flushing
+ * flag is raised under the queue lock before the batch is written so
+ * that closeSession can wait for any in-flight records before closing
+ * the session's file.
+ *
+ * @param data  The filter instance
+ */
+static void
+qla_flush_thread(void *data)
+{
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) data;
+    QLA_LOG_RECORD *records;
+
+    while (1)
+    {
+        spinlock_acquire(&my_instance->qlock);
+        records = my_instance->qhead;
+        my_instance->qhead = NULL;
+        my_instance->qtail = NULL;
+        my_instance->qlen = 0;
+        if (records)
+        {
+            my_instance->flushing = 1;
+        }
+        spinlock_release(&my_instance->qlock);
+
+        if (records)
+        {
+            qla_write_records(records);
+            my_instance->flushing = 0;
+        }
+        else
+        {
+            thread_millisleep(QLA_FLUSH_INTERVAL);
+        }
+    }
+}
+
+/**
+ * Queue a formatted log line for the flusher thread. If the queue has
+ * reached its bound the record is dropped rather than blocking the
+ * client's query; the number of dropped records is reported in the
+ * diagnostic output.
+ *
+ * @param my_instance   The filter instance
+ * @param fp            The file the record is written to
+ * @param text          The formatted log line, ownership is transferred
+ */
+static void
+qla_enqueue(QLA_INSTANCE *my_instance, FILE *fp, char *text)
+{
+    QLA_LOG_RECORD *record;
+
+    if ((record = malloc(sizeof(QLA_LOG_RECORD))) == NULL)
+    {
+        free(text);
+        atomic_add(&my_instance->dropped, 1);
+        return;
+    }
+    record->fp = fp;
+    record->text = text;
+    record->next = NULL;
+
+    spinlock_acquire(&my_instance->qlock);
+    if (my_instance->qlen >= QLA_QUEUE_MAX)
+    {
+        spinlock_release(&my_instance->qlock);
+        free(record->text);
+        free(record);
+        atomic_add(&my_instance->dropped, 1);
+        return;
+    }
+    if (my_instance->qtail)
+    {
+        my_instance->qtail->next = record;
+    }
+    else
+    {
+        my_instance->qhead = record;
+    }
+    my_instance->qtail = record;
+    my_instance->qlen++;
+    spinlock_release(&my_instance->qlock);
+}
+
+/**
+ * Compute the digest of a statement for a binary log record. This is a
+ * plain hash of the statement text; it groups exact repetitions of a
+ * statement rather than normalised forms, which keeps the cost of
+ * logging a query to a scan of the text. Used as the fallback when the
+ * session routing path has not interned an identifier for the shape of
+ * the statement.
+ *
+ * @param sql   The statement text
+ * @return The digest of the statement
+ */
+static uint32_t
+qla_bin_digest(const char *sql)
+{
+    uint32_t hash = 5381;
+
+    while (*sql)
+    {
+        hash = ((hash << 5) + hash) ^ (uint8_t) *sql++;
+    }
+    return hash;
+}
+
+/**
+ * Open and map the next binary log segment, unmapping the current one
+ * if there is one. The new segment is preallocated to the full segment
+ * size and zero filled, so a partially written segment is always
+ * readable up to the last record; the zero tail terminates the reader.
+ *
+ * Called with the binlock held.
+ *
+ * @param my_instance   The filter instance
+ * @return Zero on success, -1 if the segment could not be created
+ */
+static int
+qla_bin_rotate(QLA_INSTANCE *my_instance)
+{
+    char path[strlen(my_instance->filebase) + 32];
+    QLA_BIN_HEADER header;
+    uint8_t *map;
+    int fd;
+
+    sprintf(path, "%s.%06d.%s", my_instance->filebase,
+            my_instance->binseq, QLA_BIN_SUFFIX);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 ||
+        ftruncate(fd, my_instance->segment_size) == -1 ||
+        (map = (uint8_t *) mmap(NULL, my_instance->segment_size,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                fd, 0)) == MAP_FAILED)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("qlafilter: Failed to create log segment %s: %d, %s",
+                  path, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (my_instance->binmap)
+    {
+        munmap(my_instance->binmap, my_instance->segment_size);
+        close(my_instance->binfd);
+    }
+
+    memcpy(header.magic, QLA_BIN_MAGIC, sizeof(header.magic));
+    header.version = QLA_BIN_VERSION;
+    header.segment_size = my_instance->segment_size;
+    memcpy(map, &header, sizeof(header));
+
+    my_instance->binfd = fd;
+    my_instance->binmap = map;
+    my_instance->binoff = (sizeof(header) + QLA_BIN_ALIGN - 1)
+        & ~(size_t)(QLA_BIN_ALIGN - 1);
+    my_instance->binseq++;
+    return 0;
+}
+
+/**
+ * Write a single record into the current binary log segment, rotating
+ * to a new segment if the record does not fit. The write is two memory
+ * copies into the mapping under the segment lock; the kernel writes the
+ * dirty pages back asynchronously.
+ *
+ * @param my_instance   The filter instance
+ * @param my_session    The session the record belongs to
+ * @param duration      Microseconds until the first reply, or zero
+ */
+static void
+qla_bin_write(QLA_INSTANCE *my_instance, QLA_SESSION *my_session,
+              uint32_t duration)
+{
+    QLA_BIN_RECORD record;
+    size_t reclen = QLA_BIN_RECLEN(my_session->pend_len);
+
+    record.timestamp = my_session->pend_ts;
+    record.session = my_session->ses_id;
+    record.digest = my_session->pend_digest;
+    record.duration = duration;
+    record.sql_len = my_session->pend_len;
+    record.full_len = my_session->pend_full;
+
+    spinlock_acquire(&my_instance->binlock);
+    if (my_instance->binmap == NULL ||
+        my_instance->binoff + reclen > my_instance->segment_size)
+    {
+        if (qla_bin_rotate(my_instance) != 0)
+        {
+            spinlock_release(&my_instance->binlock);
+            atomic_add(&my_instance->dropped, 1);
+            return;
+        }
+    }
+    memcpy(my_instance->binmap + my_instance->binoff,
+           &record, sizeof(record));
+    memcpy(my_instance->binmap + my_instance->binoff + sizeof(record),
+           my_session->pend_sql, my_session->pend_len);
+    my_instance->binoff += reclen;
+    spinlock_release(&my_instance->binlock);
+}
+
+/**
+ * Write out the binary record the session is holding, if any. Called
+ * with the duration when the reply to the statement arrives and with a
+ * zero duration when the session ends, or another statement is routed,
+ * before a reply was seen.
+ *
+ * @param my_instance   The filter instance
+ * @param my_session    The session the record belongs to
+ * @param duration      Microseconds until the first reply, or zero
+ */
+static void
+qla_bin_flush_pending(QLA_INSTANCE *my_instance, QLA_SESSION *my_session,
+                      uint32_t duration)
+{
+    if (my_session->bin_pending)
+    {
+        my_session->bin_pending = 0;
+        qla_bin_write(my_instance, my_session, duration);
+    }
+}
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -182,6 +497,8 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
         my_instance->filebase = NULL;
+        my_instance->binfmt = 0;
+        my_instance->segment_size = QLA_SEGMENT_SIZE_DEFAULT;
         bool error = false;
 
         if (params)
@@ -208,6 +525,32 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->filebase = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "format"))
+                {
+                    if (!strcasecmp(params[i]->value, "binary"))
+                    {
+                        my_instance->binfmt = 1;
+                    }
+                    else if (strcasecmp(params[i]->value, "text"))
+                    {
+                        MXS_ERROR("qlafilter: Unsupported value '%s' for the "
+                                  "'format' parameter, expected 'text' or "
+                                  "'binary'.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "segment_size"))
+                {
+                    my_instance->segment_size = strtoul(params[i]->value,
+                                                        NULL, 0);
+                    if (my_instance->segment_size < QLA_SEGMENT_SIZE_MIN)
+                    {
+                        MXS_ERROR("qlafilter: The 'segment_size' parameter "
+                                  "must be at least %d bytes.",
+                                  QLA_SEGMENT_SIZE_MIN);
+                        error = true;
+                    }
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("qlafilter: Unexpected parameter '%s'.",
@@ -291,6 +634,27 @@ createInstance(char **options, FILTER_PARAMETER **params)
             free(my_instance);
             my_instance = NULL;
         }
+        else
+        {
+            spinlock_init(&my_instance->qlock);
+            my_instance->qhead = NULL;
+            my_instance->qtail = NULL;
+            my_instance->qlen = 0;
+            my_instance->dropped = 0;
+            my_instance->flushing = 0;
+            spinlock_init(&my_instance->binlock);
+            my_instance->binfd = -1;
+            my_instance->binmap = NULL;
+            my_instance->binoff = 0;
+            my_instance->binseq = 0;
+            if (!my_instance->binfmt)
+            {
+                /* The binary format writes into the mapped segment
+                 * directly, only the text format needs the flusher. */
+                thread_start(&my_instance->flusher, qla_flush_thread,
+                             my_instance);
+            }
+        }
     }
     return(FILTER *) my_instance;
 }
@@ -341,6 +705,7 @@ newSession(FILTER *instance, SESSION *session)
 
         my_session->user = userName;
         my_session->remote = remote;
+        my_session->ses_id = session->ses_id;
 
         sprintf(my_session->filename, "%s.%d",
                 my_instance->filebase,
@@ -349,7 +714,7 @@ newSession(FILTER *instance, SESSION *session)
         // Multiple sessions can try to update my_instance->sessions simultaneously
         atomic_add(&(my_instance->sessions), 1);
 
-        if (my_session->active)
+        if (my_session->active && !my_instance->binfmt)
         {
             my_session->fp = fopen(my_session->filename, "w");
 
@@ -388,10 +753,69 @@ newSession(FILTER *instance, SESSION *session)
 static void
 closeSession(FILTER *instance, void *session)
 {
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) session;
+    QLA_LOG_RECORD *mine = NULL, *mine_tail = NULL;
+    QLA_LOG_RECORD *record, *next, *prev = NULL;
+
+    if (my_instance->binfmt)
+    {
+        /* Write out any record whose reply never arrived */
+        qla_bin_flush_pending(my_instance, my_session, 0);
+        return;
+    }
 
     if (my_session->active && my_session->fp)
     {
+        /*
+         * Pull any records for this session out of the pending queue
+         * and write them ourselves, then wait for the flusher to finish
+         * any batch it may already have taken before closing the file.
+         */
+        spinlock_acquire(&my_instance->qlock);
+        for (record = my_instance->qhead; record; record = next)
+        {
+            next = record->next;
+            if (record->fp == my_session->fp)
+            {
+                if (prev)
+                {
+                    prev->next = next;
+                }
+                else
+                {
+                    my_instance->qhead = next;
+                }
+                if (my_instance->qtail == record)
+                {
+                    my_instance->qtail = prev;
+                }
+                my_instance->qlen--;
+                record->next = NULL;
+                if (mine_tail)
+                {
+                    mine_tail->next = record;
+                }
+                else
+                {
+                    mine = record;
+                }
+                mine_tail = record;
+            }
+            else
+            {
+                prev = record;
+            }
+        }
+        spinlock_release(&my_instance->qlock);
+
+        qla_write_records(mine);
+
+        while (my_instance->flushing)
+        {
+            thread_millisleep(1);
+        }
+
         fclose(my_session->fp);
     }
 }
@@ -428,6 +852,22 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
     my_session->down = *downstream;
 }
 
+/**
+ * Set the upstream filter or session to which replies will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    QLA_SESSION *my_session = (QLA_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
 /**
  * The routeQuery entry point. This is passed the query buffer
  * to which the filter should be applied. Once applied the
@@ -462,14 +902,51 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                  regexec(&my_instance->nore, ptr, 0, NULL, 0) != 0))
             {
                 gettimeofday(&tv, NULL);
-                localtime_r(&tv.tv_sec, &t);
-                fprintf(my_session->fp,
-                        "%02d:%02d:%02d.%-3d %d/%02d/%d, ",
-                        t.tm_hour, t.tm_min, t.tm_sec, (int) (tv.tv_usec / 1000),
-                        t.tm_mday, t.tm_mon + 1, 1900 + t.tm_year);
-                fprintf(my_session->fp, "%s@%s, ", my_session->user, my_session->remote);
-                fprintf(my_session->fp, "%s\n", ptr);
+                if (my_instance->binfmt)
+                {
+                    size_t sqllen = strlen(ptr);
+
+                    /*
+                     * If the previous statement never saw a reply, write
+                     * its record with a zero duration before holding the
+                     * new one back for its reply.
+                     */
+                    qla_bin_flush_pending(my_instance, my_session, 0);
+
+                    my_session->pend_ts = (uint64_t) tv.tv_sec * 1000000
+                        + tv.tv_usec;
+                    /*
+                     * Prefer the identifier interned by the session
+                     * routing path, which is shared by every module of
+                     * the service; hash the text only when the shape
+                     * was not interned.
+                     */
+                    my_session->pend_digest = GWBUF_DIGEST_ID(queue) != 0
+                        ? GWBUF_DIGEST_ID(queue) : qla_bin_digest(ptr);
+                    my_session->pend_full = sqllen > UINT16_MAX
+                        ? UINT16_MAX : sqllen;
+                    my_session->pend_len = sqllen > QLA_BIN_SQL_MAX
+                        ? QLA_BIN_SQL_MAX : sqllen;
+                    memcpy(my_session->pend_sql, ptr, my_session->pend_len);
+                    my_session->bin_pending = 1;
+                }
+                else
+                {
+                    char *text;
+                    size_t len = strlen(ptr) + strlen(my_session->user) +
+                        strlen(my_session->remote) + 64;
 
+                    localtime_r(&tv.tv_sec, &t);
+                    if ((text = malloc(len)) != NULL)
+                    {
+                        snprintf(text, len,
+                                 "%02d:%02d:%02d.%-3d %d/%02d/%d, %s@%s, %s\n",
+                                 t.tm_hour, t.tm_min, t.tm_sec, (int) (tv.tv_usec / 1000),
+                                 t.tm_mday, t.tm_mon + 1, 1900 + t.tm_year,
+                                 my_session->user, my_session->remote, ptr);
+                        qla_enqueue(my_instance, my_session->fp, text);
+                    }
+                }
             }
             free(ptr);
         }
@@ -479,6 +956,36 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                                        my_session->down.session, queue);
 }
 
+/**
+ * The clientReply entry point. The first reply to a statement completes
+ * the binary record held by the session; the duration from routing the
+ * statement to this reply is written into the record. The reply itself
+ * is passed upstream untouched.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The reply data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
+    QLA_SESSION *my_session = (QLA_SESSION *) session;
+    struct timeval tv;
+
+    if (my_session->bin_pending)
+    {
+        uint64_t now;
+
+        gettimeofday(&tv, NULL);
+        now = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+        qla_bin_flush_pending(my_instance, my_session,
+                              (uint32_t) (now - my_session->pend_ts));
+    }
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session, reply);
+}
+
 /**
  * Diagnostics routine
  *
@@ -496,11 +1003,22 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) fsession;
 
-    if (my_session)
+    if (my_session && !my_instance->binfmt)
     {
         dcb_printf(dcb, "\t\tLogging to file            %s.\n",
                    my_session->filename);
     }
+    if (my_instance->binfmt)
+    {
+        dcb_printf(dcb, "\t\tLogging binary records to  %s.*.%s\n",
+                   my_instance->filebase, QLA_BIN_SUFFIX);
+        dcb_printf(dcb, "\t\tSegment size               %lu\n",
+                   (unsigned long) my_instance->segment_size);
+        dcb_printf(dcb, "\t\tSegments written           %d\n",
+                   my_instance->binseq);
+        dcb_printf(dcb, "\t\tCurrent segment offset     %lu\n",
+                   (unsigned long) my_instance->binoff);
+    }
     if (my_instance->source)
     {
         dcb_printf(dcb, "\t\tLimit logging to connections from  %s\n",
@@ -521,4 +1039,11 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match     %s\n",
                    my_instance->nomatch);
     }
+    dcb_printf(dcb, "\t\tPending log records        %d\n",
+               my_instance->qlen);
+    if (my_instance->dropped)
+    {
+        dcb_printf(dcb, "\t\tDropped log records        %d\n",
+                   my_instance->dropped);
+    }
 }
@@ -25,6 +25,7 @@
 #include <log_manager.h>
 #include <string.h>
 #include <pcre2.h>
+#include <maxscale_pcre2.h>
 #include <atomic.h>
 #include "maxconfig.h"
 
@@ -42,6 +43,11 @@
  *
  * Date         Who             Description
  * 19/06/2014   Mark Riddoch    Addition of source and user parameters
+ * 09/06/2016   Markus Makela   JIT compilation of the pattern and per thread
+ *                              match data
+ * 05/07/2016   Mark Riddoch    Anchored literal and plain substring patterns
+ *                              are executed with string compares instead of
+ *                              the regex engine
  * @endverbatim
  */
 
@@ -79,6 +85,19 @@ static FILTER_OBJECT MyObject =
     diagnostic,
 };
 
+/**
+ * The classification of the match pattern, made once at config time.
+ *
+ * Most patterns in real configurations are an anchored literal, e.g.
+ * ^INSERT INTO audit_, or a plain substring with no regex metacharacters
+ * at all. Those are executed with a prefix compare or a substring search
+ * rather than pcre2_match, which is an order of magnitude cheaper per
+ * query; anything containing a metacharacter keeps the full regex path.
+ */
+#define REGEX_LITERAL_NONE   0  /*< The pattern needs the regex engine */
+#define REGEX_LITERAL_PREFIX 1  /*< Anchored literal, prefix compare */
+#define REGEX_LITERAL_SUBSTR 2  /*< Plain literal, substring search */
+
 /**
  * Instance structure
  */
@@ -89,11 +108,18 @@ typedef struct
     char *match; /*< Regular expression to match */
     char *replace; /*< Replacement text */
     pcre2_code *re; /*< Compiled regex text */
-    pcre2_match_data *match_data; /*< Matching data used by the compiled regex */
+    uint32_t ovec_size; /*< Ovector pairs needed by the compiled regex */
+    int literal_type; /*< One of the REGEX_LITERAL_* classifications */
+    char *literal; /*< The literal text of an anchored or substring pattern */
+    int literal_len; /*< Length of the literal text */
+    bool icase; /*< The literal is matched case insensitively */
     FILE* logfile; /*< Log file */
     bool log_trace; /*< Whether messages should be printed to tracelog */
 } REGEX_INSTANCE;
 
+static int regex_literal_pattern(const char *pattern, char **literal);
+static char *regex_literal_replace(REGEX_INSTANCE *instance, const char *sql);
+
 /**
  * The session structure for this regex filter
  */
@@ -109,6 +135,34 @@ typedef struct
 void log_match(REGEX_INSTANCE* inst, char* re, char* old, char* new);
 void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old);
 
+/** Per thread match data, shared by the filter instances on the thread.
+ * The JIT compiled pattern writes its results into the match data, so a
+ * single instance wide buffer would need a lock around every match. */
+static __thread pcre2_match_data *tls_match_data = NULL;
+static __thread uint32_t tls_match_size = 0;
+
+/**
+ * Get the match data of the current thread, growing it if the pattern of
+ * this instance needs more ovector pairs than any pattern seen so far.
+ *
+ * @param instance The filter instance
+ * @return The match data or NULL if memory allocation failed
+ */
+static pcre2_match_data *
+regex_thread_match_data(REGEX_INSTANCE *instance)
+{
+    if (tls_match_data == NULL || tls_match_size < instance->ovec_size)
+    {
+        if (tls_match_data)
+        {
+            pcre2_match_data_free(tls_match_data);
+        }
+        tls_match_data = pcre2_match_data_create(instance->ovec_size, NULL);
+        tls_match_size = tls_match_data ? instance->ovec_size : 0;
+    }
+    return tls_match_data;
+}
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -156,12 +210,8 @@ void free_instance(REGEX_INSTANCE *instance)
             pcre2_code_free(instance->re);
         }
 
-        if (instance->match_data)
-        {
-            pcre2_match_data_free(instance->match_data);
-        }
-
         free(instance->match);
+        free(instance->literal);
         free(instance->replace);
         free(instance->source);
         free(instance->user);
@@ -270,12 +320,40 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
-        if ((my_instance->re = pcre2_compile((PCRE2_SPTR) my_instance->match,
-                                             PCRE2_ZERO_TERMINATED,
-                                             cflags,
-                                             &errnumber,
-                                             &erroffset,
-                                             NULL)) == NULL)
+        /*
+         * Classify the pattern before compiling it. When the pattern is
+         * an anchored literal or a plain substring and the replacement
+         * carries no group references, the match and the substitution
+         * are done with string operations and the regex engine is never
+         * compiled for the instance.
+         */
+        my_instance->literal_type =
+            regex_literal_pattern(my_instance->match, &my_instance->literal);
+        if (my_instance->literal_type != REGEX_LITERAL_NONE
+            && strpbrk(my_instance->replace, "$\\") != NULL)
+        {
+            /* Group references need the match data of the engine */
+            free(my_instance->literal);
+            my_instance->literal = NULL;
+            my_instance->literal_type = REGEX_LITERAL_NONE;
+        }
+
+        if (my_instance->literal_type != REGEX_LITERAL_NONE)
+        {
+            my_instance->literal_len = strlen(my_instance->literal);
+            my_instance->icase = (cflags & PCRE2_CASELESS) != 0;
+            MXS_INFO("regexfilter: Pattern '%s' is a literal %s and is "
+                     "matched without the regex engine.",
+                     my_instance->match,
+                     my_instance->literal_type == REGEX_LITERAL_PREFIX
+                     ? "prefix" : "substring");
+        }
+        else if ((my_instance->re = pcre2_compile((PCRE2_SPTR) my_instance->match,
+                                                  PCRE2_ZERO_TERMINATED,
+                                                  cflags,
+                                                  &errnumber,
+                                                  &erroffset,
+                                                  NULL)) == NULL)
         {
             char errbuffer[1024];
             pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) & errbuffer, sizeof(errbuffer));
@@ -284,14 +362,15 @@ createInstance(char **options, FILTER_PARAMETER **params)
             free_instance(my_instance);
             return NULL;
         }
-
-        if ((my_instance->match_data =
-             pcre2_match_data_create_from_pattern(my_instance->re, NULL)) == NULL)
+        else
         {
-            MXS_ERROR("regexfilter: Failure to create PCRE2 matching data. "
-                      "This is most likely caused by a lack of available memory.");
-            free_instance(my_instance);
-            return NULL;
+            /** The pattern is matched against every query so JIT compilation
+             * is well worth the extra compile time */
+            mxs_pcre2_jit_enable(my_instance->re);
+
+            uint32_t capcount = 0;
+            pcre2_pattern_info(my_instance->re, PCRE2_INFO_CAPTURECOUNT, &capcount);
+            my_instance->ovec_size = capcount + 1;
         }
     }
     return(FILTER *) my_instance;
@@ -399,10 +478,19 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         }
         if ((sql = modutil_get_SQL(queue)) != NULL)
         {
-            newsql = regex_replace(sql,
-                                   my_instance->re,
-                                   my_instance->match_data,
-                                   my_instance->replace);
+            if (my_instance->literal_type != REGEX_LITERAL_NONE)
+            {
+                newsql = regex_literal_replace(my_instance, sql);
+            }
+            else
+            {
+                pcre2_match_data *mdata = regex_thread_match_data(my_instance);
+
+                newsql = mdata ? regex_replace(sql,
+                                               my_instance->re,
+                                               mdata,
+                                               my_instance->replace) : NULL;
+            }
             if (newsql)
             {
                 queue = modutil_replace_SQL(queue, newsql);
@@ -483,7 +571,8 @@ regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, con
     char *result = NULL;
     size_t result_size;
 
-    /** This should never fail with rc == 0 because we used pcre2_match_data_create_from_pattern() */
+    /** This should never fail with rc == 0 because the match data is sized
+     * from the capture count of the pattern */
     if (pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL))
     {
         result_size = strlen(sql) + strlen(replace);
@@ -507,6 +596,106 @@ regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, con
     return result;
 }
 
+/**
+ * Classify a match pattern, extracting the literal text when the
+ * pattern does not need the regex engine.
+ *
+ * A pattern qualifies when it contains none of the characters that are
+ * special to PCRE2; a single leading ^ is allowed and makes the pattern
+ * an anchored prefix. A trailing $ keeps the regex path, suffix matches
+ * are rare enough not to warrant a path of their own.
+ *
+ * @param   pattern The configured match pattern
+ * @param   literal The malloc'd literal text is returned here
+ * @return  The REGEX_LITERAL_* classification of the pattern
+ */
+static int
+regex_literal_pattern(const char *pattern, char **literal)
+{
+    int type = REGEX_LITERAL_SUBSTR;
+
+    if (*pattern == '^')
+    {
+        type = REGEX_LITERAL_PREFIX;
+        pattern++;
+    }
+    if (*pattern == '\0' || strpbrk(pattern, "\\^$.[]|()?*+{}") != NULL)
+    {
+        return REGEX_LITERAL_NONE;
+    }
+    if ((*literal = strdup(pattern)) == NULL)
+    {
+        return REGEX_LITERAL_NONE;
+    }
+    return type;
+}
+
+/**
+ * Perform the substitution of a literal pattern on the SQL.
+ *
+ * An anchored prefix is replaced at the start of the statement only, a
+ * substring pattern replaces every non-overlapping occurrence, matching
+ * the PCRE2_SUBSTITUTE_GLOBAL behaviour of the regex path.
+ *
+ * @param   instance The filter instance
+ * @param   sql The original SQL text
+ * @return  The replaced text or NULL if no replacement was done.
+ */
+static char *
+regex_literal_replace(REGEX_INSTANCE *instance, const char *sql)
+{
+    char *result, *dest;
+    const char *ptr, *hit;
+    size_t len = strlen(sql);
+    size_t rlen = strlen(instance->replace);
+    int n = 0;
+
+    if (instance->literal_type == REGEX_LITERAL_PREFIX)
+    {
+        if ((instance->icase
+             ? strncasecmp(sql, instance->literal, instance->literal_len)
+             : strncmp(sql, instance->literal, instance->literal_len)) != 0)
+        {
+            return NULL;
+        }
+        if ((result = malloc(len - instance->literal_len + rlen + 1)) != NULL)
+        {
+            memcpy(result, instance->replace, rlen);
+            strcpy(result + rlen, sql + instance->literal_len);
+        }
+        return result;
+    }
+
+    for (ptr = sql;
+         (hit = instance->icase ? strcasestr(ptr, instance->literal)
+          : strstr(ptr, instance->literal)) != NULL;
+         ptr = hit + instance->literal_len)
+    {
+        n++;
+    }
+    if (n == 0)
+    {
+        return NULL;
+    }
+    if ((result = malloc(len + (n * rlen) - (n * instance->literal_len) + 1)) == NULL)
+    {
+        return NULL;
+    }
+    dest = result;
+    for (ptr = sql;
+         (hit = instance->icase ? strcasestr(ptr, instance->literal)
+          : strstr(ptr, instance->literal)) != NULL;
+         ptr = hit + instance->literal_len)
+    {
+        memcpy(dest, ptr, hit - ptr);
+        dest += hit - ptr;
+        memcpy(dest, instance->replace, rlen);
+        dest += rlen;
+    }
+    strcpy(dest, ptr);
+    return result;
+}
+
 /**
  * Log a matching query to either MaxScale's trace log or a separate log file.
  * The old SQL and the new SQL statements are printed in the log.
@@ -25,6 +25,7 @@
 #include <hint.h>
 #include <query_classifier.h>
 #include <regex.h>
+#include "maxconfig.h"
 
 /**
  * @file slavelag.c - a very simple filter designed to send queries to the
@@ -40,6 +41,10 @@
  *      time=<time period>          Seconds to wait before queries are routed to slaves.
  *      match=<regex>               Regex for matching
  *      ignore=<regex>              Regex for ignoring
+ *      causal=<true|false>         Within the time window, route reads to any
+ *                                  slave whose replication lag shows it has
+ *                                  already applied the modification, rather
+ *                                  than pinning every read to the master.
  *
  * The filter also has two options:
  *     @c case, which makes the regex case-sensitive, and
@@ -47,6 +52,8 @@
  *
  * Date         Who             Description
  * 03/03/2015   Markus Mäkelä   Written for demonstrative purposes
+ * 03/07/2016   Mark Riddoch    Causal reads from the replication lag the
+ *                              monitor reports
  * @endverbatim
  */
 
@@ -86,6 +93,7 @@ typedef struct lagstats
 {
     int n_add_count;  /*< No. of statements diverted based on count */
     int n_add_time;   /*< No. of statements diverted based on time */
+    int n_causal;     /*< No. of statements released to caught up slaves */
     int n_modified;   /*< No. of statements not diverted */
 } LAGSTATS;
 
@@ -101,6 +109,9 @@ typedef struct
                       * is done. */
     int count;       /*< Number of hints to add after each operation
                      * that modifies data. */
+    int causal;      /*< Within the time window, allow reads on slaves that
+                      * have already applied the modification instead of
+                      * routing every read to the master. */
     LAGSTATS stats;
     regex_t re;      /* Compiled regex text of match */
     regex_t nore;    /* Compiled regex text of ignore */
@@ -171,8 +182,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
     {
         my_instance->count = 0;
         my_instance->time = 0;
+        my_instance->causal = 0;
         my_instance->stats.n_add_count = 0;
         my_instance->stats.n_add_time = 0;
+        my_instance->stats.n_causal = 0;
         my_instance->stats.n_modified = 0;
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
@@ -195,6 +208,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->nomatch = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "causal"))
+            {
+                my_instance->causal = config_truth_value(params[i]->value);
+            }
             else
             {
                 MXS_ERROR("lagfilter: Unexpected parameter '%s'.\n", params[i]->name);
@@ -254,7 +271,8 @@ newSession(FILTER *instance, SESSION *session)
     LAG_INSTANCE *my_instance = (LAG_INSTANCE *)instance;
     LAG_SESSION  *my_session;
 
-    if ((my_session = malloc(sizeof(LAG_SESSION))) != NULL)
+    /** Drawn from the arena of the session, freed with the session */
+    if ((my_session = session_arena_alloc(session, sizeof(LAG_SESSION))) != NULL)
     {
         my_session->active = 1;
         my_session->hints_left = 0;
@@ -285,7 +303,7 @@ closeSession(FILTER *instance, void *session)
 static void
 freeSession(FILTER *instance, void *session)
 {
-    free(session);
+    /** The session data is in the arena of the session */
 }
 
 /**
@@ -359,8 +377,31 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         }
         else if (difftime(now, my_session->last_modification) < my_instance->time)
         {
-            queue->hint = hint_create_route(queue->hint, HINT_ROUTE_TO_MASTER, NULL);
-            my_instance->stats.n_add_time++;
+            int elapsed = (int) difftime(now, my_session->last_modification);
+
+            if (my_instance->causal && elapsed >= 1)
+            {
+                /*
+                 * A slave that lags less than the age of the last
+                 * modification has already applied it, so the read can
+                 * be released to any such slave. The monitor reports
+                 * the lag of each slave and the router interpolates it
+                 * between samples; if no slave has caught up yet the
+                 * router falls back to the master.
+                 */
+                char lagstr[24];
+
+                snprintf(lagstr, sizeof(lagstr), "%d", elapsed - 1);
+                queue->hint = hint_create_parameter(queue->hint,
+                                                    "max_slave_replication_lag",
+                                                    lagstr);
+                my_instance->stats.n_causal++;
+            }
+            else
+            {
+                queue->hint = hint_create_route(queue->hint, HINT_ROUTE_TO_MASTER, NULL);
+                my_instance->stats.n_add_time++;
+            }
         }
     }
 
@@ -387,9 +428,11 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     LAG_SESSION  *my_session = (LAG_SESSION *)fsession;
 
     dcb_printf(dcb, "Configuration:\n\tCount: %d\n", my_instance->count);
-    dcb_printf(dcb, "\tTime: %d seconds\n\n", my_instance->time);
+    dcb_printf(dcb, "\tTime: %d seconds\n", my_instance->time);
+    dcb_printf(dcb, "\tCausal reads: %s\n\n", my_instance->causal ? "enabled" : "disabled");
     dcb_printf(dcb, "Statistics:\n");
     dcb_printf(dcb, "\tNo. of data modifications: %d\n", my_instance->stats.n_modified);
     dcb_printf(dcb, "\tNo. of hints added based on count: %d\n", my_instance->stats.n_add_count);
     dcb_printf(dcb, "\tNo. of hints added based on time: %d\n",  my_instance->stats.n_add_time);
+    dcb_printf(dcb, "\tNo. of reads released to caught up slaves: %d\n", my_instance->stats.n_causal);
 }
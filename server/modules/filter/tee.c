@@ -42,6 +42,8 @@
  * 20/06/2014	Mark Riddoch	Initial implementation
  * 24/06/2014	Mark Riddoch	Addition of support for multi-packet queries
  * 12/12/2014	Mark Riddoch	Add support for otehr packet types
+ * 01/07/2016	Mark Riddoch	Skip SQL text extraction when no match
+ *				patterns are configured
  *
  * @endverbatim
  */
@@ -594,7 +596,7 @@ newSession(FILTER *instance, SESSION *session)
             my_session->dummy_filterdef = dummy;
 
             if ((dummy_upstream = filterUpstream(
-                                                 dummy, my_session, &ses->tail)) == NULL)
+                                                 dummy, my_session, &ses->tail, NULL)) == NULL)
             {
                 filter_free(dummy);
                 closeSession(instance, (void*) my_session);
@@ -1237,6 +1239,16 @@ GWBUF* clone_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* bu
                 my_session->residual = 0;
             }
         }
+        else if (my_session->active &&
+                 my_instance->match == NULL && my_instance->nomatch == NULL &&
+                 modutil_is_SQL(buffer))
+        {
+            /* No patterns configured, so the SQL text is not needed;
+             * every statement is duplicated without extracting a copy
+             * of the query for the regular expression match. */
+            clone = gwbuf_clone_all(buffer);
+            my_session->residual = residual;
+        }
         else if (my_session->active && (ptr = modutil_get_SQL(buffer)) != NULL)
         {
             if ((my_instance->match == NULL ||
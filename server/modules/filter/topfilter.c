@@ -33,6 +33,8 @@
  *
  * Date         Who             Description
  * 18/06/2014   Mark Riddoch    Addition of source and user filters
+ * 04/07/2016   Mark Riddoch    Repeated executions of a shape deduplicated
+ *                              through the interned statement digest
  *
  * @endverbatim
  */
@@ -115,6 +117,8 @@ typedef struct topnq
 {
     struct timeval duration;
     char *sql;
+    uint32_t digest; /* Interned identifier of the statement shape, 0 if
+                      * the shape was not interned */
 } TOPNQ;
 
 /**
@@ -136,6 +140,7 @@ typedef struct
     int fd;
     struct timeval start;
     char *current;
+    uint32_t current_digest; /* Interned shape of the current statement */
     TOPNQ **top;
     int n_statements;
     struct timeval total;
@@ -545,6 +550,7 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
                 }
                 gettimeofday(&my_session->start, NULL);
                 my_session->current = ptr;
+                my_session->current_digest = GWBUF_DIGEST_ID(queue);
             }
             else
             {
@@ -586,14 +592,48 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
         timeradd(&(my_session->total), &diff, &(my_session->total));
 
         inserted = 0;
-        for (i = 0; i < my_instance->topN; i++)
+
+        /*
+         * If the shape of the statement was interned, an integer
+         * compare finds a repeated execution already on the list; the
+         * list then tracks the slowest execution of each shape rather
+         * than filling up with repetitions of one hot query.
+         */
+        if (my_session->current_digest != 0)
         {
-            if (my_session->top[i]->sql == NULL)
+            for (i = 0; i < my_instance->topN; i++)
             {
-                my_session->top[i]->sql = my_session->current;
-                my_session->top[i]->duration = diff;
-                inserted = 1;
-                break;
+                if (my_session->top[i]->sql != NULL &&
+                    my_session->top[i]->digest == my_session->current_digest)
+                {
+                    if (timercmp(&diff, &my_session->top[i]->duration, >))
+                    {
+                        free(my_session->top[i]->sql);
+                        my_session->top[i]->sql = my_session->current;
+                        my_session->top[i]->duration = diff;
+                    }
+                    else
+                    {
+                        free(my_session->current);
+                    }
+                    inserted = 1;
+                    break;
+                }
+            }
+        }
+
+        if (inserted == 0)
+        {
+            for (i = 0; i < my_instance->topN; i++)
+            {
+                if (my_session->top[i]->sql == NULL)
+                {
+                    my_session->top[i]->sql = my_session->current;
+                    my_session->top[i]->duration = diff;
+                    my_session->top[i]->digest = my_session->current_digest;
+                    inserted = 1;
+                    break;
+                }
             }
         }
 
@@ -602,6 +642,7 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
             free(my_session->top[my_instance->topN - 1]->sql);
             my_session->top[my_instance->topN - 1]->sql = my_session->current;
             my_session->top[my_instance->topN - 1]->duration = diff;
+            my_session->top[my_instance->topN - 1]->digest = my_session->current_digest;
             inserted = 1;
         }
 
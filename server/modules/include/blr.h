@@ -35,6 +35,26 @@
  * 24/06/15     Massimiliano Pinto      Added BLRM_UNCONFIGURED state
  * 05/08/15     Massimiliano Pinto      Initial implementation of transaction safety
  * 23/10/15     Markus Makela           Added current_safe_event
+ * 26/06/16     Mark Riddoch            Added the sparse binlog position index
+ * 28/06/16     Mark Riddoch            Added the in-memory binlog event cache
+ * 03/07/16     Mark Riddoch            Block compression of closed binlog files
+ * 03/07/16     Mark Riddoch            Added the BLRS_CDC slave state for change
+ *                                      data capture consumers
+ * 03/07/16     Mark Riddoch            Encryption of binlog files at rest
+ * 03/07/16     Mark Riddoch            Tiered binlog storage with the archivedir
+ *                                      and archive_files options
+ * 05/07/16     Mark Riddoch            GTID index mapping MariaDB 10 GTIDs to
+ *                                      binlog files and offsets for GTID slave
+ *                                      registration
+ * 05/07/16     Mark Riddoch            Append buffer coalescing binlog writes
+ *                                      and page cache hinting on written out
+ *                                      regions
+ * 05/07/16     Mark Riddoch            Event fields decoded with single
+ *                                      unaligned loads on little-endian hosts,
+ *                                      addition of EXTRACT64
+ * 05/07/16     Mark Riddoch            Wall clock bound on catchup bursts so a
+ *                                      slave being caught up yields the polling
+ *                                      thread within a fixed time slice
  *
  * @endverbatim
  */
@@ -42,6 +62,7 @@
 #include <buffer.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include <memlog.h>
 #include <zlib.h>
 #include <mysql_client_server_protocol.h>
@@ -55,6 +76,21 @@
 
 #define BINLOG_EVENT_HDR_LEN    19
 
+/** Maximum length of a binlog encryption key, a 256 bit AES key */
+#define BLR_ENC_KEY_MAXLEN      32
+
+/**
+ * The sparse position index maintained alongside each binlog file.
+ * The index file holds a magic number followed by a sequence of 8 byte
+ * little-endian positions of transaction safe events, with one entry
+ * written for every BINLOG_INDEX_INTERVAL events received.
+ */
+#define BINLOG_INDEX_SUFFIX     ".idx"
+#define BINLOG_INDEX_MAGIC      { 0x62, 0x6c, 0x69, 0x78 }
+#define BINLOG_INDEX_MAGIC_SIZE 4
+#define BINLOG_INDEX_ENTRY_LEN  8
+#define BINLOG_INDEX_INTERVAL   1000
+
 /**
  * Binlog event types
  */
@@ -143,6 +179,27 @@
 #define DEF_LONG_BURST          500
 #define DEF_BURST_SIZE          1024000 /* 1 Mb */
 
+/**
+ * Wall clock bound of one catchup burst, in housekeeper heartbeats of
+ * 100ms. A burst that is still running when the bound expires yields
+ * back to the polling loop and resumes on the next write event, so one
+ * catching-up slave cannot hold a polling thread for longer than the
+ * slice however slowly its events are read.
+ */
+#define BLR_SLICE_BEATS         2
+
+/**
+ * Group commit defaults, overridable with the sync_events and
+ * sync_interval router options. sync_events is the number of events
+ * that may be written to the binlog before a sync is issued, a value
+ * of 1 retains the original sync-per-flush behaviour. sync_interval
+ * is the longest time, in milliseconds, an unsynced event may wait
+ * for the sync that covers it.
+ */
+#define DEF_SYNC_EVENTS         1
+#define DEF_SYNC_INTERVAL       1000
+#define DEF_ARCHIVE_FILES       4
+
 /**
  * master reconnect backoff constants
  * BLR_MASTER_BACKOFF_TIME      The increments of the back off time (seconds)
@@ -273,12 +330,68 @@ typedef struct
     SPINLOCK        lock;           /*< The spinlock for the cache */
 } BLCACHE;
 
+/**
+ * A reference counted read-only memory mapping of a binlog file. Events
+ * served to catching-up slaves reference the mapped pages directly, so
+ * the mapping is kept alive until the file has been closed and the last
+ * buffer referencing it has been freed.
+ */
+typedef struct
+{
+    uint8_t         *ptr;           /*< Start of the mapped region */
+    size_t          len;            /*< Length of the mapped region */
+    int             refcnt;         /*< The file plus each outstanding buffer */
+} BLR_MAPPING;
+
+/**
+ * The compressed binlog file format. A closed binlog file may be replaced
+ * by a compressed copy, named with the BLRZ_SUFFIX appended, that holds
+ * this header followed by the block offset index and the blocks
+ * themselves, each a zlib compressed BLRZ_BLOCK_SIZE byte span of the
+ * original file. The file is a local cache and is written in the native
+ * byte order of the host.
+ */
+#define BLRZ_SUFFIX     ".blz"          /*< Suffix of compressed binlog files */
+#define BLRZ_MAGIC      0x5a524c42      /*< "BLRZ" */
+#define BLRZ_BLOCK_SIZE 0x100000        /*< Uncompressed bytes per block */
+
+typedef struct blrz_header
+{
+    uint32_t        magic;          /*< BLRZ_MAGIC */
+    uint32_t        block_size;     /*< Uncompressed bytes per block */
+    uint32_t        n_blocks;       /*< Number of compressed blocks */
+    uint32_t        spare;          /*< Unused, written as zero */
+    uint64_t        length;         /*< Uncompressed length of the binlog */
+} BLRZ_HEADER;
+
+/**
+ * The decompression state of an open compressed binlog file. The block
+ * offset index is held in memory along with the most recently
+ * decompressed block, so that the sequential reads of a catching-up
+ * slave decompress each block only once.
+ */
+typedef struct blr_zfile
+{
+    uint32_t        block_size;     /*< Uncompressed bytes per block */
+    uint32_t        n_blocks;       /*< Number of compressed blocks */
+    uint64_t        length;         /*< Uncompressed length of the binlog */
+    uint64_t        *offsets;       /*< Offset of each block in the compressed
+                                     *  file, with a final entry marking the
+                                     *  end of the last block */
+    uint8_t         *block;         /*< The most recently decompressed block */
+    uint32_t        block_no;       /*< Number of the block held above */
+    bool            block_valid;    /*< True when the block buffer is filled */
+} BLR_ZFILE;
+
 typedef struct blfile
 {
     char            binlogname[BINLOG_FNAMELEN+1];  /*< Name of the binlog file */
     int             fd;                             /*< Actual file descriptor */
     int             refcnt;                         /*< Reference count for file */
     BLCACHE         *cache;                         /*< Record cache for this file */
+    BLR_MAPPING     *map;                           /*< Memory mapping of the file, if any */
+    BLR_ZFILE       *zfile;                         /*< Decompression state if the file is
+                                                     *  a compressed binlog */
     SPINLOCK        lock;                           /*< The file lock */
     struct blfile   *next;                          /*< Next file in list */
 } BLFILE;
@@ -291,6 +404,7 @@ typedef struct
     int             n_events;       /*< Number of events sent */
     unsigned long   n_bytes;        /*< Number of bytes sent */
     int             n_bursts;       /*< Number of bursts sent */
+    int             n_sliced;       /*< Bursts cut short by the time slice */
     int             n_requests;     /*< Number of requests received */
     int             n_flows;        /*< Number of flow control restarts */
     int             n_queries;      /*< Number of SQL queries */
@@ -339,6 +453,9 @@ typedef struct router_slave
     SPINLOCK        catch_lock;     /*< Event catchup lock */
     unsigned int    cstate;         /*< Catch up state */
     bool            mariadb10_compat;/*< MariaDB 10.0 compatibility */
+    char            *mariadb_gtid;  /*< GTID position the slave sent in
+                                     * @slave_connect_state, NULL for a
+                                     * file and position registration */
     SPINLOCK        rses_lock;      /*< Protects rses_deleted */
     pthread_t       pthread;
     struct router_instance
@@ -408,6 +525,82 @@ typedef struct
     int             fde_len;        /*< Length of fde_event */
 } MASTER_RESPONSES;
 
+/**
+ * In-memory cache of the most recent binlog events.
+ *
+ * The cache is a large ring buffer mirroring the tail of the binlog file
+ * currently being written: the bytes at binlog position P are kept at
+ * offset P modulo the ring size, so a contiguous window [low, high) of at
+ * most the ring size is addressable at any time. Slaves lagging by no
+ * more than the window size are served from memory without touching the
+ * binlog file. The region is backed by huge pages when the system can
+ * supply them.
+ */
+typedef struct blr_event_cache
+{
+    uint8_t         *base;          /*< The ring buffer region */
+    uint64_t        size;           /*< Size of the region in bytes */
+    uint64_t        low;            /*< Lowest binlog position held */
+    uint64_t        high;           /*< Position following the newest byte held */
+    char            binlog_name[BINLOG_FNAMELEN+1]; /*< Binlog file the window belongs to */
+    int             hugepages;      /*< Non-zero if the region uses huge pages */
+    uint64_t        hits;           /*< Events served from the cache */
+    uint64_t        misses;         /*< Events that fell back to the file */
+    SPINLOCK        lock;           /*< Protects the window and the region */
+} BLR_EVENT_CACHE;
+
+/**
+ * One contiguous run of MariaDB 10 GTID sequence numbers replicated from a
+ * single domain and server, mapped to the binlog file and the offset of the
+ * GTID event that opens the run. A new interval is started when a stream is
+ * seen for the first time, when a sequence number arrives out of order, when
+ * the binlog file rotates and when the current interval reaches
+ * BLR_GTID_INTERVAL_SPAN transactions, so the exact offset of any indexed
+ * GTID can be found with a binary search followed by a file scan bounded by
+ * the span.
+ */
+typedef struct blr_gtid_interval
+{
+    uint32_t        domain_id;      /*< Replication domain of the run */
+    uint32_t        server_id;      /*< Server that generated the run */
+    uint64_t        seq_start;      /*< First sequence number in the run */
+    uint64_t        seq_end;        /*< Last sequence number in the run */
+    char            file[BINLOG_FNAMELEN+1];
+    /*< Binlog file holding the run */
+    uint64_t        pos;            /*< Offset of the GTID event of seq_start */
+} BLR_GTID_INTERVAL;
+
+/**
+ * The in-memory GTID index of the router. The intervals are held in an
+ * array sorted by domain, server and starting sequence number. The index
+ * is advisory in the same way as the binlog position index: a GTID that
+ * cannot be found only means the slave falls back to the file and position
+ * it requested, never that events are lost.
+ */
+typedef struct blr_gtid_index
+{
+    BLR_GTID_INTERVAL *intervals;   /*< Sorted array of intervals */
+    int             n_intervals;    /*< Number of intervals in use */
+    int             size;           /*< Allocated size of the array */
+    SPINLOCK        lock;           /*< Protects the array */
+} BLR_GTID_INDEX;
+
+#define BLR_GTID_INTERVAL_SPAN  1000
+
+/**
+ * The append buffer for binlog writes. Events received from the master
+ * are gathered in the buffer and written with a single system call when
+ * it fills, when a sync is due or when a slave needs to read past the
+ * buffered region, instead of one write() per replication event.
+ */
+#define BLR_WBUFFER_SIZE        65536   /*< Size of the binlog append buffer */
+#define BLR_WBUFFER_MAX_HOLD    2       /*< Max heartbeat ticks, of 100ms each,
+                                         *  a buffered event may wait before
+                                         *  the housekeeper flushes it */
+#define BLR_DONTNEED_CHUNK      (1024 * 1024)
+                                        /*< Granularity of the page cache
+                                         *  advice on written out regions */
+
 /**
  * The per instance data for the router.
  */
@@ -455,8 +648,43 @@ typedef struct router_instance
     int                     binlog_fd;      /*< File descriptor of the binlog
                                              *  file being written
                                              */
+    int                     index_fd;       /*< File descriptor of the position
+                                             *  index of the binlog file being
+                                             *  written, -1 if there is none
+                                             */
+    unsigned int      index_events; /*< Events written since the last index entry */
+    BLR_GTID_INDEX    gtid_index;   /*< Index from MariaDB 10 GTIDs to binlog
+                                     *  files and offsets
+                                     */
     uint64_t          last_written; /*< Position of the last write operation */
     uint64_t          last_event_pos;       /*< Position of last event written */
+    unsigned int      sync_events;  /*< No. of events written per binlog sync */
+    unsigned int      sync_interval; /*< Max ms an unsynced event may wait */
+    uint8_t           *wbuffer;     /*< Append buffer coalescing binlog writes,
+                                     *  allocated on the first write */
+    uint32_t          wbuffer_len;  /*< Bytes currently held in the buffer */
+    uint64_t          wbuffer_start; /*< File offset of the first buffered byte */
+    long              wbuffer_hb;   /*< Heartbeat at which the oldest buffered
+                                     *  byte was appended */
+    uint64_t          advised_pos;  /*< Offset below which the page cache has
+                                     *  been advised that writes are done */
+    BLR_EVENT_CACHE   *event_cache; /*< In-memory cache of recent events, or
+                                     *  NULL if the cache is not enabled */
+    uint64_t          event_cache_size; /*< Configured event cache size, bytes */
+    bool              compress_binlogs; /*< Compress binlog files when they are
+                                         *  closed by a rotate event */
+    char              *archivedir;  /*< Directory on the slow storage tier that
+                                     *  binlog files are moved to once they age
+                                     *  out of binlogdir, NULL for no archival */
+    int               archive_files; /*< Number of the most recent binlog files
+                                      *  kept in binlogdir when archival is
+                                      *  enabled */
+    int               encrypt_binlogs; /*< Encrypt binlog files at rest */
+    uint8_t           encryption_key[BLR_ENC_KEY_MAXLEN];
+    /*< AES key used to encrypt the binlog files */
+    int               encryption_key_len; /*< Length of the key in bytes */
+    unsigned int      pending_events; /*< Events written since the last sync */
+    long              last_sync;    /*< hkheartbeat at the time of the last sync */
     uint64_t          current_safe_event;
     /*< Position of the latest safe event being sent to slaves */
     char              prevbinlog[BINLOG_FNAMELEN+1];
@@ -482,6 +710,9 @@ typedef struct router_instance
     char              *set_master_uuid; /*< Send custom Master UUID to slaves */
     char              *set_master_server_id; /*< Send custom Master server_id to slaves */
     int               send_slave_heartbeat; /*< Enable sending heartbeat to slaves */
+    int               cdc_consumers; /*< Number of connected CDC consumers */
+    int               n_uptodate;   /*< Number of slaves at the head of the
+                                     * binlog, i.e. with CS_UPTODATE set */
     struct router_instance  *next;
 } ROUTER_INSTANCE;
 
@@ -530,12 +761,14 @@ static char *blrm_states[] =
 #define BLRS_REGISTERED         0x0002
 #define BLRS_DUMPING            0x0003
 #define BLRS_ERRORED            0x0004
+#define BLRS_CDC                0x0005
 
-#define BLRS_MAXSTATE           0x0004
+#define BLRS_MAXSTATE           0x0005
 
 static char *blrs_states[] =
 {
-    "Created", "Unregistered", "Registered", "Sending binlogs", "Errored"
+    "Created", "Unregistered", "Registered", "Sending binlogs", "Errored",
+    "Streaming change data"
 };
 
 /**
@@ -564,7 +797,49 @@ static char *blrs_states[] =
  */
 #define INLINE_EXTRACT          1       /* Set to 0 for debug purposes */
 
-#if INLINE_EXTRACT
+/*
+ * All numeric fields of the binlog are little-endian on the wire, so on
+ * a little-endian host a field can be fetched with a single unaligned
+ * load. The memcpy into a local variable is the portable spelling of
+ * that load and is compiled to a plain fetch; decoding the header of
+ * every replication event a byte at a time is measurable with the small,
+ * numerous events of row based replication. The shift-and-or forms are
+ * retained for big-endian hosts and for debugging with INLINE_EXTRACT
+ * disabled.
+ */
+#if INLINE_EXTRACT && defined(__BYTE_ORDER__) && \
+        __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+static inline uint16_t
+blr_load16(const void *x)
+{
+    uint16_t val;
+    memcpy(&val, x, sizeof(val));
+    return val;
+}
+
+static inline uint32_t
+blr_load32(const void *x)
+{
+    uint32_t val;
+    memcpy(&val, x, sizeof(val));
+    return val;
+}
+
+static inline uint64_t
+blr_load64(const void *x)
+{
+    uint64_t val;
+    memcpy(&val, x, sizeof(val));
+    return val;
+}
+
+#define EXTRACT16(x)            blr_load16(x)
+#define EXTRACT24(x)            (blr_load16(x) |                        \
+                                 ((uint32_t)*((uint8_t *)(x) + 2) << 16))
+#define EXTRACT32(x)            blr_load32(x)
+#define EXTRACT64(x)            blr_load64(x)
+#elif INLINE_EXTRACT
 #define EXTRACT16(x)            (*(uint8_t *)(x) | (*((uint8_t *)(x) + 1) << 8))
 #define EXTRACT24(x)            (*(uint8_t *)(x) |              \
                                  (*((uint8_t *)(x) + 1) << 8) | \
@@ -573,10 +848,14 @@ static char *blrs_states[] =
                                  (*((uint8_t *)(x) + 1) << 8) |         \
                                  (*((uint8_t *)(x) + 2) << 16) |        \
                                  (*((uint8_t *)(x) + 3) << 24))
+#define EXTRACT64(x)            ((uint64_t)EXTRACT32(x) |               \
+                                 ((uint64_t)EXTRACT32((uint8_t *)(x) + 4) << 32))
 #else
 #define EXTRACT16(x)            extract_field((x), 16)
 #define EXTRACT24(x)            extract_field((x), 24)
 #define EXTRACT32(x)            extract_field((x), 32)
+#define EXTRACT64(x)            ((uint64_t)extract_field((x), 32) |     \
+                                 ((uint64_t)extract_field((uint8_t *)(x) + 4, 32) << 32))
 #endif
 
 /*
@@ -586,16 +865,29 @@ extern void blr_start_master(void *);
 extern void blr_master_response(ROUTER_INSTANCE *, GWBUF *);
 extern void blr_master_reconnect(ROUTER_INSTANCE *);
 extern int blr_master_connected(ROUTER_INSTANCE *);
+extern void blr_gtid_record(ROUTER_INSTANCE *, uint32_t, uint32_t, uint64_t, char *, uint64_t);
+extern int blr_gtid_find_position(ROUTER_INSTANCE *, char *, char *, uint32_t *);
 
 extern int blr_slave_request(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern void blr_slave_rotate(ROUTER_INSTANCE *, ROUTER_SLAVE *, uint8_t *);
 extern int blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large);
+extern void blr_slave_set_uptodate(ROUTER_INSTANCE *, ROUTER_SLAVE *);
+extern void blr_slave_clear_uptodate(ROUTER_INSTANCE *, ROUTER_SLAVE *);
+extern void blr_cdc_distribute(ROUTER_INSTANCE *, REP_HEADER *, uint8_t *);
 extern void blr_init_cache(ROUTER_INSTANCE *);
+extern void blr_free_cache(ROUTER_INSTANCE *);
+extern void blr_cache_add_data(ROUTER_INSTANCE *, char *, uint64_t, uint8_t *, uint32_t);
+extern void blr_cache_invalidate(ROUTER_INSTANCE *);
+extern GWBUF *blr_cache_read_event(ROUTER_INSTANCE *, char *, unsigned long, REP_HEADER *);
 
 extern int  blr_file_init(ROUTER_INSTANCE *);
+extern int  blr_file_load_encryption_key(ROUTER_INSTANCE *, char *);
 extern int  blr_write_binlog_record(ROUTER_INSTANCE *, REP_HEADER *, uint32_t pos, uint8_t *);
 extern int  blr_file_rotate(ROUTER_INSTANCE *, char *, uint64_t);
 extern void blr_file_flush(ROUTER_INSTANCE *);
+extern void blr_file_force_flush(ROUTER_INSTANCE *);
+extern int  blr_file_append_flush(ROUTER_INSTANCE *);
+extern void blr_file_sync_task(void *);
 extern BLFILE *blr_open_binlog(ROUTER_INSTANCE *, char *);
 extern GWBUF *blr_read_binlog(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *, char *);
 extern void blr_close_binlog(ROUTER_INSTANCE *, BLFILE *);
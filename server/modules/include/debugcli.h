@@ -29,6 +29,7 @@
  *
  * Date		Who		Description
  * 18/06/13	Mark Riddoch	Initial implementation
+ * 03/07/16	Mark Riddoch	Addition of the command terminator
  *
  * @endverbatim
  */
@@ -58,6 +59,8 @@ typedef struct cli_session {
 	char		cmdbuf[cmdbuflen]; /*< The command buffer used to build up user commands */
 	int		mode;		   /*< The CLI Mode for this session */
 	SESSION		*session;	   /*< The gateway session */
+	char		*terminator;	   /*< Written to the client after the output
+					    * of a command, once it has completed */
 	struct cli_session
 			*next;		   /*< The next pointer for the list of sessions */
 } CLI_SESSION;
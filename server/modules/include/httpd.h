@@ -20,7 +20,9 @@
  * Revision History
  *
  * Date		Who			Description
- * 08-07-2013	Massimiliano Pinto	Added HTTPD protocol header file 
+ * 08-07-2013	Massimiliano Pinto	Added HTTPD protocol header file
+ * 03-07-2016	Mark Riddoch		Request buffering and response gathering
+ *					state for keep-alive connections
  */
 
 #include <stdio.h>
@@ -62,4 +64,10 @@ typedef struct httpd_session {
 	char *path_info;				/*< the Pathinfo, starts with /, is the extra path segments after the document name */
 	char *query_string;				/*< the Query string, starts with ?, after path_info and document name */
 	int headers_received;				/*< All the headers has been received, if 1 */
+	GWBUF *inbuf;					/*< Received data not yet parsed into a request */
+	GWBUF *response;				/*< Response body gathered while a request is routed */
+	int gathering;					/*< Router writes are being gathered into the response */
+	int keep_alive;					/*< Keep the connection open after the response */
+	int status;					/*< HTTP status code of the response */
+	const char *content_type;			/*< Content type of the response */
 } HTTPD_session;
@@ -0,0 +1,52 @@
+#ifndef _LINEREAD_H
+#define _LINEREAD_H
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file lineread.h The buffered line reader shared by the admin protocols
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date		Who		Description
+ * 04/07/16	Mark Riddoch	Initial implementation
+ *
+ * @endverbatim
+ */
+#include <buffer.h>
+
+/**
+ * The state of a buffered line reader.
+ *
+ * Buffers read from the network are appended with lineread_append and
+ * complete, newline terminated lines extracted with lineread_get. Data
+ * that does not yet form a complete line is carried over to the next
+ * read event, so a protocol using the reader never has to wait for the
+ * rest of a line inside an event handler.
+ */
+typedef struct lineread
+{
+    GWBUF   *pending;       /**< Data that does not yet form a complete line */
+} LINEREAD;
+
+extern void     lineread_append(LINEREAD *lr, GWBUF *buf);
+extern GWBUF    *lineread_get(LINEREAD *lr);
+extern GWBUF    *lineread_flush(LINEREAD *lr);
+extern void     lineread_free(LINEREAD *lr);
+#endif
@@ -29,6 +29,9 @@
  *
  * Date		Who		Description
  * 16/02/15	Mark Riddoch	Initial implementation
+ * 30/06/16	Mark Riddoch	Snapshot tables for the SHOW commands
+ * 03/07/16	Mark Riddoch	WHERE clause predicates pushed down into
+ *				the table iteration
  *
  * @endverbatim
  */
@@ -119,6 +122,7 @@ typedef struct maxinfo_tree {
 #define LT_CLEAR        12
 #define LT_SHUTDOWN     13
 #define LT_RESTART      14
+#define LT_WHERE        15
 
 
 /**
@@ -139,4 +143,21 @@ extern void 		maxinfo_send_parse_error(DCB *, char *, PARSE_ERROR);
 extern void		maxinfo_send_error(DCB *, int, char  *);
 extern RESULTSET	*maxinfo_variables();
 extern RESULTSET	*maxinfo_status();
+
+/**
+ * The diagnostic tables that are materialised into the periodic
+ * snapshot rather than walked live for every query
+ */
+typedef enum
+{
+	MAXINFO_TAB_SERVICES,
+	MAXINFO_TAB_LISTENERS,
+	MAXINFO_TAB_SESSIONS,
+	MAXINFO_TAB_CLIENTS,
+	MAXINFO_TAB_SERVERS,
+	MAXINFO_TAB_LAST
+} MAXINFO_TABLE;
+
+extern void		maxinfo_snapshot_init();
+extern RESULTSET	*maxinfo_snapshot_fetch(MAXINFO_TABLE);
 #endif
@@ -32,6 +32,7 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <housekeeper.h>
+#include <lineread.h>
 /**
  * The telnetd specific protocol structure to put in the DCB.
  */
@@ -39,6 +40,7 @@ typedef struct	maxscaled {
 	SPINLOCK	lock;		/**< Protocol structure lock */
 	int		state;		/**< The connection state */
 	char		*username;	/**< The login name of the user */
+	LINEREAD	line;		/**< Buffered reader for the commands */
 } MAXSCALED;
 
 #define	MAXSCALED_STATE_LOGIN	1	/**< Issued login prompt */
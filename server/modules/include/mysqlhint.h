@@ -23,6 +23,7 @@
  *
  * Date		Who		Description
  * 17-07-2014	Mark Riddoch	Initial implementation
+ * 05-07-2016	Mark Riddoch	Memoisation of parsed hint comments
  */
 #include <hint.h>
 
@@ -80,6 +81,25 @@ typedef struct {
 	int	sessions;
 } HINT_INSTANCE;
 
+/**
+ * A memoised hint comment parse result.
+ *
+ * The parse of a hint comment depends only on the comment bytes, so the
+ * result of parsing a comment span can be remembered and reused when the
+ * identical comment is seen again; ORM generated queries tend to carry
+ * the same boilerplate comment on every statement. A NULL hints pointer
+ * with a non-NULL comment records a comment that produced no hints.
+ */
+typedef struct {
+	unsigned int	hash;		/*< Hash of the comment bytes */
+	unsigned int	len;		/*< Length of the comment span */
+	char		*comment;	/*< Copy of the comment bytes */
+	HINT		*hints;		/*< Parsed hints, NULL for none */
+} HINTCACHE_ENTRY;
+
+#define	HINT_CACHE_SIZE		16	/*< Comment memo slots per session */
+#define	HINT_CACHE_MAX_LEN	512	/*< Longest comment span memoised */
+
 /**
  * A hint parser session structure
  */
@@ -89,6 +109,8 @@ typedef struct {
 	int		query_len;
 	HINTSTACK	*stack;
 	NAMEDHINTS	*named_hints;	/* The named hints defined in this session */
+	HINTCACHE_ENTRY	cache[HINT_CACHE_SIZE];
+					/* Memoised hint comment parses */
 } HINT_SESSION;
 
 /* Some useful macros */
@@ -108,6 +130,7 @@ typedef struct {
 extern HINT *hint_parser(HINT_SESSION *session, GWBUF *request);
 NAMEDHINTS* free_named_hint(NAMEDHINTS* named_hint);
 HINTSTACK*  free_hint_stack(HINTSTACK* hint_stack);
+void	    free_hint_cache(HINT_SESSION *session);
 
 
 
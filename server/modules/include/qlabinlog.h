@@ -0,0 +1,95 @@
+#ifndef _QLABINLOG_H
+#define _QLABINLOG_H
+/*
+ * This file is distributed as part of MaxScale by MariaDB Corporation.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+#include <stdint.h>
+
+/**
+ * @file qlabinlog.h The binary log format of the query log all filter
+ *
+ * The binary format of the qlafilter stores one fixed size record header
+ * per logged statement followed by the statement text, truncated to
+ * QLA_BIN_SQL_MAX bytes. Records are written sequentially into
+ * preallocated segment files of a fixed size, each beginning with a
+ * QLA_BIN_HEADER; the unused tail of a segment is zero filled, so a
+ * reader stops at the first record with a zero timestamp. Records are
+ * padded to an eight byte boundary so that the header structure is
+ * always naturally aligned within the mapped segment.
+ *
+ * The format is consumed by the maxqlalog conversion tool as well as
+ * written by the filter, so it is defined here rather than within the
+ * filter itself.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date		Who		Description
+ * 03/07/16	Mark Riddoch	Initial implementation
+ *
+ * @endverbatim
+ */
+
+/** Magic string at the start of every segment file */
+#define QLA_BIN_MAGIC           "QLABIN\0"
+
+/** Version of the record format within the segment */
+#define QLA_BIN_VERSION         1
+
+/** Maximum number of bytes of statement text stored in a record */
+#define QLA_BIN_SQL_MAX         256
+
+/** Alignment of the records within a segment */
+#define QLA_BIN_ALIGN           8
+
+/** Suffix of the segment files */
+#define QLA_BIN_SUFFIX          "qlb"
+
+/**
+ * The header at the start of every segment file
+ */
+typedef struct qla_bin_header
+{
+    char        magic[8];       /*< The magic string QLA_BIN_MAGIC */
+    uint32_t    version;        /*< Format version, QLA_BIN_VERSION */
+    uint32_t    segment_size;   /*< The preallocated size of the segment */
+} QLA_BIN_HEADER;
+
+/**
+ * The fixed size header of a single log record; sql_len bytes of
+ * statement text follow the header, then padding up to the next
+ * QLA_BIN_ALIGN boundary.
+ */
+typedef struct qla_bin_record
+{
+    uint64_t    timestamp;      /*< Microseconds since the epoch, never zero */
+    uint64_t    session;        /*< Id of the session that ran the statement */
+    uint32_t    digest;         /*< Interned identifier of the statement
+                                 * shape, or a hash of the untruncated
+                                 * statement text if it was not interned */
+    uint32_t    duration;       /*< Microseconds until the first reply
+                                 * arrived, zero when no reply was seen */
+    uint16_t    sql_len;        /*< Bytes of statement text in the record */
+    uint16_t    full_len;       /*< Length of the untruncated statement */
+} QLA_BIN_RECORD;
+
+/** The space a record with the given amount of statement text occupies */
+#define QLA_BIN_RECLEN(sql_len) \
+        ((sizeof(QLA_BIN_RECORD) + (sql_len) + QLA_BIN_ALIGN - 1) & \
+         ~(size_t)(QLA_BIN_ALIGN - 1))
+
+#endif
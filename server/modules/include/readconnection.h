@@ -27,6 +27,7 @@
  * Date		Who		Description
  * 14/06/13	Mark Riddoch	Initial implementation
  * 27/06/14	Mark Riddoch	Addition of server weight percentage
+ * 30/06/16	Mark Riddoch	Heap of eligible backends for O(1) selection
  *
  * @endverbatim
  */
@@ -42,6 +43,7 @@ typedef struct backend
     SERVER *server; /*< The server itself */
     int current_connection_count; /*< Number of connections to the server */
     int weight; /*< Desired routing weight */
+    int heap_pos; /*< Position in the instance load heap, -1 when not eligible */
 } BACKEND;
 
 /**
@@ -82,6 +84,12 @@ typedef struct router_instance
     ROUTER_CLIENT_SES *connections; /*< Link list of all the client connections  */
     SPINLOCK lock; /*< Spinlock for the instance data           */
     BACKEND **servers; /*< List of backend servers                  */
+    BACKEND **heap; /*< Min-heap of the eligible backends, ordered by
+                     * weighted connection load; rebuilt on server
+                     * status transitions, resifted on count changes */
+    int nheap; /*< Number of backends currently in the heap */
+    BACKEND *master_host; /*< The current root master, maintained on
+                           * server status transitions */
     unsigned int bitmask; /*< Bitmask to apply to server->status       */
     unsigned int bitvalue; /*< Required value of server->status         */
     ROUTER_STATS stats; /*< Statistics for this router               */
@@ -31,7 +31,10 @@
 
 #include <dcb.h>
 #include <hashtable.h>
+#include <timerwheel.h>
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
 
 #undef PREP_STMT_CACHING
 
@@ -117,6 +120,7 @@ typedef enum select_criteria {
         LEAST_BEHIND_MASTER,
         LEAST_CURRENT_OPERATIONS,
         DEFAULT_CRITERIA=LEAST_CURRENT_OPERATIONS,
+        ADAPTIVE_RESPONSE_TIME,   /*< EWMA of query response times */
         LAST_CRITERIA /*< not used except for an index */
 } select_criteria_t;
 
@@ -134,7 +138,9 @@ typedef enum select_criteria {
         strncmp(s,"LEAST_ROUTER_CONNECTIONS", strlen("LEAST_ROUTER_CONNECTIONS")) == 0 ?        \
         LEAST_ROUTER_CONNECTIONS : (                                                            \
         strncmp(s,"LEAST_CURRENT_OPERATIONS", strlen("LEAST_CURRENT_OPERATIONS")) == 0 ?        \
-        LEAST_CURRENT_OPERATIONS : UNDEFINED_CRITERIA))))
+        LEAST_CURRENT_OPERATIONS : (                                                            \
+        strncmp(s,"ADAPTIVE_RESPONSE_TIME", strlen("ADAPTIVE_RESPONSE_TIME")) == 0 ?            \
+        ADAPTIVE_RESPONSE_TIME : UNDEFINED_CRITERIA)))))
         
 /**
  * Session variable command
@@ -151,6 +157,11 @@ typedef struct mysql_sescmd_st {
                                        *  LOCAL_INFILE. Slave servers are compared to this
                                        *  when they return session command replies.*/
         int      position; /*< Position of this command */
+        char*    my_sescmd_key; /*< Compaction key; name of the variable or state
+                                 * the command sets, NULL if the command cannot
+                                 * be superseded by a later one */
+        bool     my_sescmd_read_only; /*< Prepared statement which may be
+                                       * executed on a slave server */
 #if defined(SS_DEBUG)
         skygw_chk_t        my_sescmd_chk_tail;
 #endif
@@ -186,16 +197,37 @@ typedef struct sescmd_cursor_st {
 	mysql_sescmd_t*    scmd_cur_cmd;          /*< pointer to current session command */
 	bool               scmd_cur_active;       /*< true if command is being executed */
         int      position; /*< Position of this cursor */
+        int      scmd_sent_pos; /*< Position of the last command written to the
+                                 * backend. The replay of the history is
+                                 * pipelined, so commands beyond the one the
+                                 * cursor waits a reply for may already be in
+                                 * flight; they must not be written again. */
 #if defined(SS_DEBUG)
 	skygw_chk_t        scmd_cur_chk_tail;
 #endif
 } sescmd_cursor_t;
 
+/**
+ * Per-backend routed query statistics, aggregated over all sessions of
+ * the router instance. The counters are accumulated without locking,
+ * so the individual values are only approximations and the totals may
+ * momentarily disagree with each other.
+ */
+typedef struct backend_stats_st {
+        int             n_queries;      /*< Number of queries routed to
+					 *  this backend
+					 */
+        int             n_reads;        /*< Queries routed as reads */
+        int             n_writes;       /*< Queries routed as writes */
+        int             n_sescmd;       /*< Session commands executed */
+        uint64_t        n_bytes;        /*< Bytes of query data sent */
+} BACKEND_STATS;
+
 /**
  * Internal structure used to define the set of backend servers we are routing
  * connections to. This provides the storage for routing module specific data
  * that is required for each of the backend servers.
- * 
+ *
  * Owned by router_instance, referenced by each routing session.
  */
 typedef struct backend_st {
@@ -213,15 +245,43 @@ typedef struct backend_st {
 					      *  load. Expressed in .1%
 					      * increments
 					      */
+        double          response_time;       /*< Exponentially weighted moving
+                                              *  average of the query response
+                                              *  time in seconds. Updated
+                                              *  without locking, so only an
+                                              *  approximation.
+                                              */
+        BACKEND_STATS   stats;               /*< Queries routed to this
+                                              *  backend, accumulated
+                                              *  lock-free over all sessions
+                                              */
 #if defined(SS_DEBUG)
         skygw_chk_t     be_chk_tail;
 #endif
 } BACKEND;
 
 
+/**
+ * Tracks MySQL packet boundaries in the response stream read from a
+ * backend, so that the number of complete responses to pipelined reads
+ * can be counted. The response chunks handed to clientReply may begin
+ * and end in the middle of a packet, so the parser keeps its state in
+ * the backend reference between calls.
+ */
+typedef struct bref_reply_parser_st {
+        uint8_t         header[4];      /*< Partially collected packet header */
+        uint8_t         nheader;        /*< Number of header bytes collected */
+        uint8_t         firstbyte;      /*< First payload byte of current packet */
+        bool            examined;       /*< First payload byte has been read */
+        bool            response_first; /*< Next packet starts a new response */
+        uint32_t        pktlen;         /*< Payload length of current packet */
+        uint32_t        payload_left;   /*< Payload bytes still to consume */
+        int             nsignals;       /*< EOF/ERR packets seen in current result set */
+} bref_reply_parser_t;
+
 /**
  * Reference to BACKEND.
- * 
+ *
  * Owned by router client session.
  */
 typedef struct backend_ref_st {
@@ -232,11 +292,18 @@ typedef struct backend_ref_st {
         DCB*            bref_dcb;
         bref_state_t    bref_state;
         int             bref_num_result_wait;
+        struct timespec bref_query_start; /*< When the active query was routed,
+                                           * for response time sampling */
         sescmd_cursor_t bref_sescmd_cur;
 	GWBUF*          bref_pending_cmd; /*< For stmt which can't be routed due active sescmd execution */
+	GWBUF*          bref_retry_stmt; /*< Copy of a plain read awaiting its reply,
+                                 * kept so the read can be replayed on another
+                                 * backend if this one fails before replying */
         unsigned char
 		reply_cmd;	/*< The reply the backend server sent to a session command.
                                  * Used to detect slaves that fail to execute session command. */
+        bref_reply_parser_t bref_reply_parser; /*< Response boundary tracking for
+                                                * pipelined reads */
 #if defined(SS_DEBUG)
         skygw_chk_t     bref_chk_tail;
 #endif
@@ -254,6 +321,16 @@ typedef struct rwsplit_config_st
     bool rw_master_reads; /*< Use master for reads */
     bool rw_strict_multi_stmt; /*< Force non-multistatement queries to be routed
                                 * to the master after a multistatement query. */
+    int rw_max_pipeline_reads; /*< Max consecutive reads routed to one slave
+                                * without waiting for the replies. Values less
+                                * than two disable pipelining. */
+    bool rw_hedged_reads; /*< Send a copy of a read that has waited too long
+                           * for its reply to a second slave and return
+                           * whichever response arrives first. */
+    bool rw_galera_split; /*< Route certification safe autocommit writes
+                           * across the synced nodes of a Galera cluster by
+                           * the hash of the target table, instead of sending
+                           * every write to the designated master. */
 } rwsplit_config_t;
 
 #if defined(PREP_STMT_CACHING)
@@ -275,6 +352,17 @@ typedef struct prep_stmt_st {
 
 #endif /*< PREP_STMT_CACHING */
 
+/**
+ * Routing class of a binary protocol prepared statement. An entry is added
+ * when the reply to a COM_STMT_PREPARE arrives and consulted when the
+ * statement is executed, so that COM_STMT_EXECUTE packets need no parsing.
+ */
+typedef struct rses_stmt_st {
+        uint32_t             stmt_id;   /*< Statement id assigned by the backend */
+        bool                 read_only; /*< True if the statement may run on a slave */
+        struct rses_stmt_st* next;
+} rses_stmt_t;
+
 /**
  * The client session structure used within this router.
  */
@@ -294,13 +382,44 @@ struct router_client_session {
         int              rses_nsescmd;  /*< Number of executed session commands */
         bool             rses_autocommit_enabled;
         bool             rses_transaction_active;
+        bool             rses_ro_trx_active; /*< An explicit READ ONLY transaction
+                                              * is currently open */
+        bool             rses_ro_trx_next;   /*< SET TRANSACTION READ ONLY was
+                                              * issued: the next transaction is
+                                              * read only */
+        bool             rses_ro_trx_session; /*< SET SESSION TRANSACTION READ ONLY
+                                               * was issued: every following
+                                               * transaction is read only */
+        backend_ref_t   *rses_ro_trx_bref;   /*< Backend serving the open read
+                                              * only transaction */
         bool             rses_load_active; /*< If LOAD DATA LOCAL INFILE is
                                             * being currently executed */
         bool             have_tmp_tables;
+        int              rses_n_tmp_tables; /*< Temporary tables currently in
+                                             * the session hash set; the checks
+                                             * are skipped when it is zero */
         uint64_t         rses_load_data_sent; /*< How much data has been sent */
+        uint8_t          rses_load_header[4]; /*< Partial packet header of the
+                                               * LOAD DATA stream */
+        int              rses_load_nheader; /*< Header bytes gathered so far */
+        uint32_t         rses_load_left;    /*< Payload bytes left of the current
+                                             * packet of the LOAD DATA stream */
         DCB* client_dcb;
         int             pos_generator;
         backend_ref_t          *forced_node; /*< Current server where all queries should be sent */
+        int              rses_pipeline_active; /*< Pipelined reads awaiting a reply */
+        backend_ref_t   *rses_pipeline_bref;   /*< Backend serving the pipelining window */
+        GWBUF           *rses_pipeline_queue;  /*< Statements serialized behind the window */
+        WTIMER          *rses_hedge_timer;  /*< Timer that fires when a read has
+                                             * waited too long for its reply */
+        backend_ref_t   *rses_hedge_bref;   /*< Backend the hedged read was
+                                             * routed to */
+        backend_ref_t   *rses_hedge_second; /*< Backend the speculative copy of
+                                             * the read was sent to, if any */
+        GWBUF           *rses_hedge_stmt;   /*< Copy of the read being hedged */
+        long             rses_hedge_due;    /*< Heartbeat at which the hedge
+                                             * timer was due to fire */
+        rses_stmt_t     *rses_stmts;           /*< Routing classes of prepared statements */
 #if defined(PREP_STMT_CACHING)
         HASHTABLE*       rses_prep_stmt[2];
 #endif
@@ -320,12 +439,37 @@ typedef struct {
 	int		n_master;	/*< Number of stmts sent to master */
 	int		n_slave;	/*< Number of stmts sent to slave  */
 	int		n_all;		/*< Number of stmts sent to all    */
+	int		n_hedged;	/*< Number of reads hedged to a
+					 *  second slave */
+	int		n_retried_reads; /*< Number of reads replayed on
+					 *  another backend after a failure */
+	int		n_galera_split;	/*< Number of writes split across the
+					 *  synced nodes of a Galera cluster */
 } ROUTER_STATS;
 
 
 /**
  * The per instance data for the router.
  */
+/**
+ * The routing decision table.
+ *
+ * The query type bits that influence the routing decision are compressed
+ * into a table index and the decision the if/else cascade would reach for
+ * that combination is precomputed when the configuration is read, one
+ * table for inside and one for outside of a transaction. The per query
+ * decision is then an indexed load; only queries carrying routing hints
+ * take the longer path.
+ */
+#define RT_TABLE_BITS           14              /*< Query type bits in the index */
+#define RT_TABLE_SIZE           (1 << RT_TABLE_BITS)
+
+/** A table entry holds the route target in the low bits plus flags */
+#define RT_ENTRY_TARGET         0x1F    /*< The route_target_t bits */
+#define RT_ENTRY_HINTABLE       0x20    /*< Routing hints may alter the decision */
+#define RT_ENTRY_WARN           0x40    /*< Warn about SELECT with variable writes */
+#define RT_ENTRY_DEFAULTED      0x80    /*< Target is the master by default only */
+
 typedef struct router_instance {
 	SERVICE*                service;     /*< Pointer to service                 */
 	ROUTER_CLIENT_SES*      connections; /*< List of client connections         */
@@ -340,6 +484,21 @@ typedef struct router_instance {
         struct router_instance* next;        /*< Next router on the list            */
 	bool			available_slaves;
 					    /*< The router has some slaves avialable */
+	HASHTABLE*              stmt_cache;  /*< Query types of prepared statements,
+					      * keyed by the statement text        */
+	BACKEND**               cand_slaves; /*< Slave and relay server candidates,
+					      * kept current by server status
+					      * events                             */
+	int                     cand_nslaves;/*< Number of slave candidates        */
+	BACKEND*                cand_master; /*< Current root master or NULL       */
+	int                     cand_valid;  /*< Zero after a status transition
+					      * until the candidate set has been
+					      * rebuilt                            */
+	SPINLOCK                cand_lock;   /*< Serializes candidate rebuilds     */
+	uint8_t                 rt_table[2][RT_TABLE_SIZE];
+					     /*< Precomputed routing decisions,
+					      * indexed by transaction state and
+					      * compressed query type            */
 } ROUTER_INSTANCE;
 
 #define BACKEND_TYPE(b) (SERVER_IS_MASTER((b)->backend_server) ? BE_MASTER :    \
@@ -34,6 +34,7 @@
 
 #include <dcb.h>
 #include <hashtable.h>
+#include <thread.h>
 #include <mysql_client_server_protocol.h>
 #include <pcre2.h>
 /**
@@ -64,6 +65,9 @@ enum shard_map_state
     SHMAP_STALE /*< The shard map has old data or has not been updated recently */
 };
 
+/** Size in bytes of the bloom filter kept in front of each shard map */
+#define SHARD_BLOOM_SIZE 512
+
 /**
  * A map of the shards tied to a single user.
  */
@@ -74,6 +78,12 @@ typedef struct shard_map
     SPINLOCK lock;
     time_t last_updated;
     enum shard_map_state state; /*< State of the shard map */
+    unsigned char bloom[SHARD_BLOOM_SIZE]; /*< Bloom filter over the database
+                                            * names in the hashtable. A clear
+                                            * bit proves the name is not in the
+                                            * map, so definite misses are
+                                            * rejected without taking the
+                                            * hashtable chain lock. */
 } shard_map_t;
 
 /** 
@@ -296,6 +306,8 @@ typedef struct {
         double          ses_average; /*< Average session length */
         int             shmap_cache_hit; /*< Shard map was found from the cache */
         int             shmap_cache_miss;/*< No shard map found from the cache */
+        int             shmap_scan_hit; /*< Session was seeded from the background
+                                         * shard scan instead of mapping inline */
 } ROUTER_STATS;
 
 /**
@@ -360,6 +372,21 @@ typedef struct router_instance {
                                            * not cause the session to be terminated
                                            * if they are found on more than one server. */
     pcre2_match_data*             ignore_match_data;
+    bool                    shmap_dirty; /*< The shard maps have changed since they
+                                          * were last written to the cache file */
+    shard_map_t*            svc_shardmap; /*< Shard map built by the background scan
+                                           * thread with the service credentials.
+                                           * Immutable once published, so sessions
+                                           * read it without taking any lock. */
+    shard_map_t*            svc_shardmap_old; /*< The previously published scan map,
+                                               * retired one scan cycle after it was
+                                               * replaced so that a session that picked
+                                               * up the old pointer can finish with it */
+    int                     svc_map_version; /*< Incremented every time the scan
+                                              * thread publishes a new map */
+    THREAD                  scan_thread; /*< Background shard scan thread */
+    bool                    scan_active; /*< The scan thread was started */
+    bool                    scan_shutdown; /*< Tells the scan thread to exit */
 
 } ROUTER_INSTANCE;
 
@@ -26,17 +26,20 @@
  *
  * Date		Who		Description
  * 17/07/13	Mark Riddoch	Initial implementation
+ * 04/07/16	Mark Riddoch	Buffered line reader for the input
  *
  * @endverbatim
  */
 #include <dcb.h>
 #include <housekeeper.h>
+#include <lineread.h>
 /**
  * The telnetd specific protocol structure to put in the DCB.
  */
 typedef struct	telnetd {
 	int	state;		/**< The connection state */
 	char	*username;	/**< The login name of the user */
+	LINEREAD line;		/**< Buffered reader for the command lines */
 } TELNETD;
 
 #define	TELNETD_STATE_LOGIN	1	/**< Issued login prompt */
@@ -36,6 +36,8 @@
  * 22/04/15     Martin Brampton         Addition of disableMasterRoleSetting
  * 08/05/15     Markus Makela           Addition of launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 02/07/16	Mark Riddoch		Probe all nodes in parallel and cache the
+ *					candidate master between membership changes
  *
  * @endverbatim
  */
@@ -44,6 +46,16 @@
 #include <galeramon.h>
 #include <dcb.h>
 
+/**
+ * Argument passed to each parallel probe thread
+ */
+typedef struct monitor_probe
+{
+    MONITOR *mon;               /**< The monitor the probe belongs to */
+    MONITOR_SERVERS *database;  /**< The server this probe examines */
+    THREAD thread;              /**< The thread running the probe */
+} MONITOR_PROBE;
+
 static void monitorMain(void *);
 
 static char *version_str = "V2.0.0";
@@ -136,6 +148,10 @@ startMonitor(void *arg, void* opt)
         handle->availableWhenDonor = 0;
         handle->disableMasterRoleSetting = 0;
         handle->master = NULL;
+        handle->candidate_master = NULL;
+        handle->member_status = NULL;
+        handle->member_node_ids = NULL;
+        handle->n_members = 0;
         handle->script = NULL;
         handle->use_priority = false;
         memset(handle->events, false, sizeof(handle->events));
@@ -445,6 +461,146 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     server_transfer_status(database->server, &temp_server);
 }
 
+/**
+ * The entry point of a probe thread, monitoring a single node.
+ *
+ * The libmysqld client requires every thread that uses it to initialise
+ * and release its thread specific data.  If the initialisation fails the
+ * probe is skipped; the node then simply retains the status it had on
+ * the previous round.
+ *
+ * @param arg	The MONITOR_PROBE for the node to examine
+ */
+static void
+monitorDatabaseThread(void *arg)
+{
+    MONITOR_PROBE *probe = (MONITOR_PROBE *) arg;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in monitor probe thread for %s:%d.",
+                  probe->database->server->name,
+                  probe->database->server->port);
+        return;
+    }
+    monitorDatabase(probe->mon, probe->database);
+    mysql_thread_end();
+}
+
+/**
+ * Probe all the nodes of the cluster in parallel.
+ *
+ * A thread is started for each node so that the complete cluster is
+ * examined in the time taken by the slowest individual probe rather
+ * than the sum of all of them; a single flaky node no longer stretches
+ * the monitor cycle for the whole cluster.  Each probe touches only its
+ * own MONITOR_SERVERS entry, so no locking is needed beyond joining the
+ * threads before the results are used.
+ *
+ * If there is only one node, or the probe array cannot be allocated,
+ * the nodes are probed serially as before.
+ *
+ * @param mon           The monitor containing the nodes
+ * @param num_servers	The number of nodes in the monitor
+ */
+static void
+monitorAllDatabases(MONITOR *mon, int num_servers)
+{
+    MONITOR_PROBE *probes;
+    MONITOR_SERVERS *ptr;
+    int i, started = 0;
+
+    if (num_servers < 2 ||
+        (probes = calloc(num_servers, sizeof(MONITOR_PROBE))) == NULL)
+    {
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
+        {
+            monitorDatabase(mon, ptr);
+        }
+        return;
+    }
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        probes[started].mon = mon;
+        probes[started].database = ptr;
+        if (thread_start(&probes[started].thread, monitorDatabaseThread,
+                         &probes[started]) == NULL)
+        {
+            /* Could not start a thread, probe this node inline */
+            monitorDatabase(mon, ptr);
+        }
+        else
+        {
+            started++;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        thread_wait(probes[i].thread);
+    }
+    free(probes);
+}
+
+/**
+ * Check whether the cluster membership has changed since the candidate
+ * master was last selected, refreshing the snapshot as a side effect.
+ *
+ * The candidate selection of get_candidate_master depends only on the
+ * joined and maintenance bits of each node, on its wsrep_local_index
+ * and on the static priority parameters, so the selection only needs
+ * to be repeated when one of the dynamic inputs changes.  If the
+ * snapshot cannot be allocated the membership is reported as changed
+ * on every call and the behaviour falls back to recomputation on each
+ * cycle.
+ *
+ * @param mon           The monitor containing the nodes
+ * @param num_servers	The number of nodes in the monitor
+ * @return		Non-zero if the membership has changed
+ */
+static int
+membership_changed(MONITOR *mon, int num_servers)
+{
+    GALERA_MONITOR *handle = (GALERA_MONITOR *) mon->handle;
+    MONITOR_SERVERS *ptr;
+    unsigned int state;
+    int i = 0, changed = 0;
+
+    if (handle->n_members != num_servers)
+    {
+        free(handle->member_status);
+        free(handle->member_node_ids);
+        handle->member_status = calloc(num_servers, sizeof(unsigned int));
+        handle->member_node_ids = calloc(num_servers, sizeof(long));
+        if (handle->member_status == NULL || handle->member_node_ids == NULL)
+        {
+            free(handle->member_status);
+            free(handle->member_node_ids);
+            handle->member_status = NULL;
+            handle->member_node_ids = NULL;
+            handle->n_members = 0;
+            return 1;
+        }
+        handle->n_members = num_servers;
+        changed = 1;
+    }
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next, i++)
+    {
+        state = ptr->server->status & (SERVER_JOINED | SERVER_MAINT);
+        if (handle->member_status[i] != state ||
+            handle->member_node_ids[i] != ptr->server->node_id)
+        {
+            handle->member_status[i] = state;
+            handle->member_node_ids[i] = ptr->server->node_id;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
 /**
  * The entry point for the monitoring module thread
  *
@@ -459,6 +615,7 @@ monitorMain(void *arg)
     size_t nrounds = 0;
     MONITOR_SERVERS *candidate_master = NULL;
     int master_stickiness;
+    int num_servers = 0;
     int is_cluster = 0;
     int log_no_members = 1;
     monitor_event_t evtype;
@@ -502,15 +659,24 @@ monitorMain(void *arg)
 
         /* reset cluster members counter */
         is_cluster = 0;
+        num_servers = 0;
 
         ptr = mon->databases;
 
         while (ptr)
         {
             ptr->mon_prev_status = ptr->server->status;
+            num_servers++;
+            ptr = ptr->next;
+        }
 
-            monitorDatabase(mon, ptr);
+        /* probe all the nodes in parallel */
+        monitorAllDatabases(mon, num_servers);
+
+        ptr = mon->databases;
 
+        while (ptr)
+        {
             /* Log server status change */
             if (mon_status_changed(ptr))
             {
@@ -547,10 +713,16 @@ monitorMain(void *arg)
          * it could be the candidate master following MIN(node_id) rule or
          * the server that was master in the previous monitor polling cycle
          * Decision depends on master_stickiness value set in configuration
+         *
+         * The candidate is cached between cycles and only recomputed
+         * when a node joins or leaves the cluster, changes its
+         * wsrep_local_index or moves in or out of maintenance mode.
          */
-
-        /* get the candidate master, following MIN(node_id) rule */
-        candidate_master = get_candidate_master(mon);
+        if (membership_changed(mon, num_servers))
+        {
+            handle->candidate_master = get_candidate_master(mon);
+        }
+        candidate_master = handle->candidate_master;
 
         /* Select the master, based on master_stickiness */
         if (1 == handle->disableMasterRoleSetting)
@@ -42,6 +42,7 @@
  *
  * Date      Who             Description
  * 07/05/15  Markus Makela   Initial Implementation of galeramon.h
+ * 02/07/16  Mark Riddoch    Cached candidate master and membership snapshot
  * @endverbatim
  */
 
@@ -59,6 +60,10 @@ typedef struct
     int availableWhenDonor; /**< Monitor flag for Galera Cluster Donor availability */
     int disableMasterRoleSetting; /**< Monitor flag to disable setting master role */
     MONITOR_SERVERS *master; /**< Master server for MySQL Master/Slave replication */
+    MONITOR_SERVERS *candidate_master; /**< Cached candidate master from the last membership change */
+    unsigned int *member_status; /**< Joined/maintenance bits at the last candidate selection */
+    long *member_node_ids; /**< wsrep_local_index values at the last candidate selection */
+    int n_members; /**< Number of entries in the membership snapshot */
     char* script;
     bool use_priority; /*< Use server priorities */
     bool events[MAX_MONITOR_EVENT]; /*< enabled events */
@@ -26,6 +26,8 @@
  * 08/09/14	Massimiliano Pinto	Initial implementation
  * 08/05/15     Markus Makela           Addition of launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 03/07/16	Mark Riddoch		Replication lag and its rate of change
+ *					sampled from SHOW SLAVE STATUS
  *
  * @endverbatim
  */
@@ -264,6 +266,7 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
     MYSQL_RES *result;
     int isslave = 0;
     int ismaster = 0;
+    int seconds_behind = -1;
     unsigned long int server_version = 0;
     char *server_string;
 
@@ -397,6 +400,12 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
                     }
                 }
 
+                /* Track the largest Seconds_Behind_Master of the connections */
+                if (row[34] && atoi(row[34]) > seconds_behind)
+                {
+                    seconds_behind = atoi(row[34]);
+                }
+
                 i++;
             }
             /* store master_id of current node */
@@ -470,6 +479,12 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
                         master_id = -1;
                     }
                 }
+
+                /* get the Seconds_Behind_Master value */
+                if (row[32])
+                {
+                    seconds_behind = atoi(row[32]);
+                }
             }
             /* store master_id of current node */
             memcpy(&database->server->master_id, &master_id, sizeof(long));
@@ -504,6 +519,35 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
         mysql_free_result(result);
     }
 
+    /*
+     * Update the replication lag and the rate at which it changed since
+     * the previous sample. The rate allows the routers to interpolate
+     * the lag between monitor cycles through server_interpolated_rlag
+     * rather than acting on a whole-cycle old reading.
+     */
+    if (seconds_behind >= 0)
+    {
+        time_t now = time(NULL);
+
+        if (database->server->rlag >= 0 && database->server->node_ts > 0 &&
+            now > (time_t)database->server->node_ts)
+        {
+            database->server->rlag_rate =
+                (double)(seconds_behind - database->server->rlag) /
+                (double)(now - (time_t)database->server->node_ts);
+        }
+        else
+        {
+            database->server->rlag_rate = 0.0;
+        }
+        database->server->rlag = seconds_behind;
+        database->server->node_ts = now;
+    }
+    else
+    {
+        database->server->rlag_rate = 0.0;
+    }
+
     /* Remove addition info */
     monitor_clear_pending_status(database, SERVER_STALE_STATUS);
 
@@ -48,6 +48,12 @@
  *					servers=server1 must be present in mysql_mon and in router sections as well.
  * 08/05/15     Markus Makela           Added launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 16/06/16	Mark Riddoch		Probe all servers in parallel so that one
+ *					unresponsive backend no longer delays the
+ *					status updates of the others
+ * 05/07/16	Mark Riddoch		Persistent connection pool of a failed
+ *					server is discarded as soon as the
+ *					failure is detected
  *
  * @endverbatim
  */
@@ -56,6 +62,16 @@
 #include <dcb.h>
 #include <modutil.h>
 
+/**
+ * Argument passed to each parallel probe thread
+ */
+typedef struct monitor_probe
+{
+    MONITOR *mon;               /**< The monitor the probe belongs to */
+    MONITOR_SERVERS *database;  /**< The server this probe examines */
+    THREAD thread;              /**< The thread running the probe */
+} MONITOR_PROBE;
+
 static void monitorMain(void *);
 
 static char *version_str = "V1.4.0";
@@ -739,6 +755,88 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
 
 }
 
+/**
+ * The entry point of a probe thread, monitoring a single server.
+ *
+ * The libmysqld client requires every thread that uses it to initialise
+ * and release its thread specific data.  If the initialisation fails the
+ * probe is skipped; the server then simply retains the status it had on
+ * the previous round.
+ *
+ * @param arg	The MONITOR_PROBE for the server to examine
+ */
+static void
+monitorDatabaseThread(void *arg)
+{
+    MONITOR_PROBE *probe = (MONITOR_PROBE *) arg;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in monitor probe thread for %s:%d.",
+                  probe->database->server->name,
+                  probe->database->server->port);
+        return;
+    }
+    monitorDatabase(probe->mon, probe->database);
+    mysql_thread_end();
+}
+
+/**
+ * Probe all the servers of a monitor in parallel.
+ *
+ * A thread is started for each server so that the complete cluster is
+ * examined in the time taken by the slowest individual probe rather than
+ * the sum of all of them.  Previously a single hung backend would hold up
+ * the status updates, and hence failure detection, for every other server.
+ * Each probe touches only its own MONITOR_SERVERS entry, so no locking is
+ * needed beyond joining the threads before the results are used.
+ *
+ * If there is only one server, or the probe array cannot be allocated,
+ * the servers are probed serially as before.
+ *
+ * @param mon           The monitor containing the servers
+ * @param num_servers	The number of servers in the monitor
+ */
+static void
+monitorAllDatabases(MONITOR *mon, int num_servers)
+{
+    MONITOR_PROBE *probes;
+    MONITOR_SERVERS *ptr;
+    int i, started = 0;
+
+    if (num_servers < 2 ||
+        (probes = calloc(num_servers, sizeof(MONITOR_PROBE))) == NULL)
+    {
+        for (ptr = mon->databases; ptr; ptr = ptr->next)
+        {
+            monitorDatabase(mon, ptr);
+        }
+        return;
+    }
+
+    for (ptr = mon->databases; ptr; ptr = ptr->next)
+    {
+        probes[started].mon = mon;
+        probes[started].database = ptr;
+        if (thread_start(&probes[started].thread, monitorDatabaseThread,
+                         &probes[started]) == NULL)
+        {
+            /* Could not start a thread, probe this server inline */
+            monitorDatabase(mon, ptr);
+        }
+        else
+        {
+            started++;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        thread_wait(probes[i].thread);
+    }
+    free(probes);
+}
+
 /**
  * The entry point for the monitoring module thread
  *
@@ -816,9 +914,18 @@ monitorMain(void *arg)
             /* copy server status into monitor pending_status */
             ptr->pending_status = ptr->server->status;
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+            num_servers++;
+
+            ptr = ptr->next;
+        }
+
+        /* monitor all the nodes in parallel */
+        monitorAllDatabases(mon, num_servers);
+
+        ptr = mon->databases;
 
+        while (ptr)
+        {
             /* reset the slave list of current node */
             if (ptr->server->slaves)
             {
@@ -827,8 +934,6 @@ monitorMain(void *arg)
             /* create a new slave list */
             ptr->server->slaves = (long *) calloc(MONITOR_MAX_NUM_SLAVES, sizeof(long));
 
-            num_servers++;
-
             if (mon_status_changed(ptr))
             {
                 if (SRV_MASTER_STATUS(ptr->mon_prev_status))
@@ -849,6 +954,17 @@ monitorMain(void *arg)
                     !(SERVER_IS_IN_CLUSTER(ptr->server)))
                 {
                     dcb_hangup_foreach(ptr->server);
+
+                    /* Discard the persistent connection pool of the
+                     * failed server immediately. Otherwise the dead
+                     * sockets are handed out as established
+                     * connections to the sessions reconnecting after
+                     * a failover, and each one discovers the failure
+                     * on its first write. */
+                    if (ptr->server->persistent)
+                    {
+                        dcb_persistent_clean_count(ptr->server->persistent, true);
+                    }
                 }
 
 
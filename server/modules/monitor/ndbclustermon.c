@@ -26,6 +26,8 @@
  * 25/07/14	Massimiliano Pinto	Initial implementation
  * 10/11/14	Massimiliano Pinto	Added setNetworkTimeout for connect,read,write
  * 08/05/15     Markus Makela           Addition of launchable scripts
+ * 03/07/16     Mark Riddoch            Single round trip probe on the
+ *                                      persistent monitor connection
  *
  * @endverbatim
  */
@@ -242,9 +244,20 @@ diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
+/** The single round trip probe, both status variables in one result set */
+static const char *ndb_probe_query =
+    "SHOW STATUS WHERE Variable_name IN "
+    "('Ndb_number_of_ready_data_nodes', 'Ndb_cluster_node_id')";
+
 /**
  * Monitor an individual server
  *
+ * The probe is issued directly on the persistent monitor connection, so
+ * a healthy server costs a single round trip per monitor interval. Only
+ * when the probe fails is mon_connect_to_db called to ping and, if
+ * needed, reconnect the connection, after which the probe is retried
+ * once.
+ *
  * @param database	The database to probe
  */
 static void
@@ -254,6 +267,7 @@ monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPassw
     MYSQL_RES *result;
     int isjoined = 0;
     char *server_string;
+    bool queried;
 
     /* Don't even probe server flagged as in maintenance */
     if (SERVER_IN_MAINT(database->server))
@@ -261,23 +275,31 @@ monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPassw
         return;
     }
 
-    connect_result_t rval = mon_connect_to_db(mon, database);
-    if (rval != MONITOR_CONN_OK)
-    {
-        server_clear_status(database->server, SERVER_RUNNING);
+    queried = database->con != NULL &&
+        mysql_query(database->con, ndb_probe_query) == 0;
 
-        if (mysql_errno(database->con) == ER_ACCESS_DENIED_ERROR)
+    if (!queried)
+    {
+        connect_result_t rval = mon_connect_to_db(mon, database);
+        if (rval != MONITOR_CONN_OK)
         {
-            server_set_status(database->server, SERVER_AUTH_ERROR);
-        }
+            server_clear_status(database->server, SERVER_RUNNING);
 
-        database->server->node_id = -1;
+            if (mysql_errno(database->con) == ER_ACCESS_DENIED_ERROR)
+            {
+                server_set_status(database->server, SERVER_AUTH_ERROR);
+            }
 
-        if (mon_status_changed(database) && mon_print_fail_status(database))
-        {
-            mon_log_connect_error(database, rval);
+            database->server->node_id = -1;
+
+            if (mon_status_changed(database) && mon_print_fail_status(database))
+            {
+                mon_log_connect_error(database, rval);
+            }
+            return;
         }
-        return;
+
+        queried = mysql_query(database->con, ndb_probe_query) == 0;
     }
 
     server_clear_status(database->server, SERVER_AUTH_ERROR);
@@ -291,50 +313,39 @@ monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPassw
         server_set_version_string(database->server, server_string);
     }
 
-    /* Check if the the SQL node is able to contact one or more data nodes */
-    if (mysql_query(database->con, "SHOW STATUS LIKE 'Ndb_number_of_ready_data_nodes'") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
-    {
-        if (mysql_field_count(database->con) < 2)
-        {
-            mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE "
-                      "'Ndb_number_of_ready_data_nodes'\". Expected 2 columns."
-                      " MySQL Version: %s", version_str);
-            return;
-        }
-
-        while ((row = mysql_fetch_row(result)))
-        {
-            if (atoi(row[1]) > 0)
-                isjoined = 1;
-        }
-        mysql_free_result(result);
-    }
-
-    /* Check the the SQL node id in the MySQL cluster */
-    if (mysql_query(database->con, "SHOW STATUS LIKE 'Ndb_cluster_node_id'") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    /* Read both status variables from the single probe result */
+    if (queried && (result = mysql_store_result(database->con)) != NULL)
     {
         if (mysql_field_count(database->con) < 2)
         {
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE 'Ndb_cluster_node_id'\". "
-                      "Expected 2 columns."
-                      " MySQL Version: %s", version_str);
+            MXS_ERROR("Unexpected result for \"%s\". Expected 2 columns."
+                      " MySQL Version: %s", ndb_probe_query, version_str);
             return;
         }
 
-        long cluster_node_id = -1;
         while ((row = mysql_fetch_row(result)))
         {
-            cluster_node_id = strtol(row[1], NULL, 10);
-            if ((errno == ERANGE && (cluster_node_id == LONG_MAX
-                                     || cluster_node_id == LONG_MIN)) || (errno != 0 && cluster_node_id == 0))
+            if (strcasecmp(row[0], "Ndb_number_of_ready_data_nodes") == 0)
+            {
+                /* Is the SQL node able to contact one or more data nodes */
+                if (atoi(row[1]) > 0)
+                    isjoined = 1;
+            }
+            else if (strcasecmp(row[0], "Ndb_cluster_node_id") == 0)
             {
-                cluster_node_id = -1;
+                /* The SQL node id in the MySQL cluster */
+                long cluster_node_id;
+
+                errno = 0;
+                cluster_node_id = strtol(row[1], NULL, 10);
+                if ((errno == ERANGE && (cluster_node_id == LONG_MAX
+                                         || cluster_node_id == LONG_MIN)) || (errno != 0 && cluster_node_id == 0))
+                {
+                    cluster_node_id = -1;
+                }
+                database->server->node_id = cluster_node_id;
             }
-            database->server->node_id = cluster_node_id;
         }
         mysql_free_result(result);
     }
@@ -28,11 +28,22 @@
  * internal data structures, however it may also be used to manage the
  * configuration of the gateway via REST interface.
  *
+ * The module is fully event driven; the requests are parsed from data
+ * buffered on the DCB as it arrives, so a request split across reads is
+ * simply resumed when the rest of it arrives and back to back pipelined
+ * requests are each processed in turn. Connections are persistent: the
+ * response carries a Content-Length header computed by gathering the
+ * router output, and the connection is only closed when the client asks
+ * for it with a Connection: close header or speaks HTTP/1.0 without
+ * requesting keep-alive.
+ *
  * @verbatim
  * Revision History
  * Date         Who                     Description
  * 08/07/2013   Massimiliano Pinto      Initial version
  * 09/07/2013   Massimiliano Pinto      Added /show?dcb|session for all dcbs|sessions
+ * 03/07/2016   Mark Riddoch            Event driven request parsing with
+ *                                      keep-alive and pipelining support
  *
  * @endverbatim
  */
@@ -40,6 +51,7 @@
 #include <httpd.h>
 #include <gw_protocol.h>
 #include <gw.h>
+#include <maxscale/poll.h>
 #include <modinfo.h>
 #include <log_manager.h>
 #include <resultset.h>
@@ -54,6 +66,10 @@ MODULE_INFO info =
 
 #define ISspace(x) isspace((int)(x))
 #define HTTP_SERVER_STRING "MaxScale(c) v.1.0.0"
+
+/** Cap on the size of a buffered request, headers and body together */
+#define HTTPD_MAX_REQUEST (HTTPD_REQUESTLINE_MAXLEN + HTTPD_FIELD_MAXLEN)
+
 static char *version_str = "V1.0.1";
 
 static int httpd_read_event(DCB* dcb);
@@ -64,8 +80,11 @@ static int httpd_hangup(DCB *dcb);
 static int httpd_accept(DCB *dcb);
 static int httpd_close(DCB *dcb);
 static int httpd_listen(DCB *dcb, char *config);
-static int httpd_get_line(int sock, char *buf, int size);
-static void httpd_send_headers(DCB *dcb, int final);
+static int httpd_process_request(DCB *dcb, char *request);
+static int httpd_header_value(char *request, const char *name,
+                              char *value, int size);
+static const char *httpd_content_type(const char *url);
+static void httpd_send_response(DCB *dcb);
 
 /**
  * The "module object" for the httpd protocol module.
@@ -119,71 +138,205 @@ GWPROTOCOL* GetModuleObject()
 /**
  * Read event for EPOLLIN on the httpd protocol module.
  *
+ * The available data is appended to the buffered input of the client and
+ * every complete request in the buffer is parsed and routed. Incomplete
+ * requests are left buffered until the rest of the data arrives.
+ *
  * @param dcb   The descriptor control block
- * @return
+ * @return The number of requests processed
  */
 static int httpd_read_event(DCB* dcb)
 {
-    SESSION *session = dcb->session;
-    ROUTER_OBJECT *router = session->service->router;
-    ROUTER *router_instance = session->service->router_instance;
-    void *rsession = session->router_session;
+    HTTPD_session *client_data = dcb->data;
+    GWBUF *data = NULL;
+    int n_requests = 0;
 
-    int numchars = 1;
-    char buf[HTTPD_REQUESTLINE_MAXLEN-1] = "";
-    char *query_string = NULL;
-    char method[HTTPD_METHOD_MAXLEN-1] = "";
+    if (dcb_read(dcb, &data, 0) < 0)
+    {
+        dcb_close(dcb);
+        return 0;
+    }
+    if (data == NULL)
+    {
+        /* Spurious wakeup, no data available */
+        return 0;
+    }
+    client_data->inbuf = gwbuf_append(client_data->inbuf, data);
+
+    /**
+     * Process every complete request that has been buffered; the requests
+     * of a keep-alive connection may arrive pipelined back to back and
+     * each one must be answered in order.
+     */
+    while (client_data->inbuf)
+    {
+        char request[HTTPD_MAX_REQUEST + 1];
+        unsigned int len = gwbuf_length(client_data->inbuf);
+        unsigned int hlen, total;
+        char clenbuf[32];
+        char *end;
+
+        if (len > HTTPD_MAX_REQUEST)
+        {
+            /* The client never completed a request of acceptable size */
+            dcb_close(dcb);
+            return n_requests;
+        }
+        gwbuf_copy_data(client_data->inbuf, 0, len, (uint8_t *)request);
+        request[len] = '\0';
+
+        /* Find the end of the request headers */
+        if ((end = strstr(request, "\r\n\r\n")) != NULL)
+        {
+            hlen = (end - request) + 4;
+        }
+        else if ((end = strstr(request, "\n\n")) != NULL)
+        {
+            hlen = (end - request) + 2;
+        }
+        else
+        {
+            /* The headers are not complete yet, wait for more data */
+            return n_requests;
+        }
+
+        /* A POST carries a body of Content-Length bytes after the headers */
+        total = hlen;
+        if (httpd_header_value(request, "Content-Length",
+                               clenbuf, sizeof(clenbuf)))
+        {
+            total += atoi(clenbuf);
+        }
+        if (len < total)
+        {
+            /* The body has not arrived in full yet */
+            return n_requests;
+        }
+
+        /* Consume the request from the buffered input */
+        while (total > 0 && client_data->inbuf)
+        {
+            unsigned int chunk = GWBUF_LENGTH(client_data->inbuf);
+
+            if (chunk > total)
+            {
+                chunk = total;
+            }
+            client_data->inbuf = gwbuf_consume(client_data->inbuf, chunk);
+            total -= chunk;
+        }
+        request[hlen] = '\0';
+
+        n_requests++;
+        if (!httpd_process_request(dcb, request))
+        {
+            /* The connection has been closed */
+            return n_requests;
+        }
+    }
+    return n_requests;
+}
+
+/**
+ * Parse and route a single request whose headers have been gathered into
+ * a contiguous, NULL terminated string. The output the router produces is
+ * gathered and sent as a response framed with a Content-Length header, so
+ * that the connection can be kept open for the next request.
+ *
+ * @param dcb           The client descriptor control block
+ * @param request       The request headers
+ * @return Zero if the connection was closed, 1 if it remains open
+ */
+static int httpd_process_request(DCB *dcb, char *request)
+{
+    SESSION *session = dcb->session;
+    HTTPD_session *client_data = dcb->data;
+    char method[HTTPD_METHOD_MAXLEN - 1] = "";
     char url[HTTPD_SMALL_BUFFER] = "";
+    char value[HTTPD_FIELD_MAXLEN];
+    char *query_string = NULL;
     size_t i, j;
-    int headers_read = 0;
-    HTTPD_session *client_data = NULL;
     GWBUF *uri;
 
-    client_data = dcb->data;
-
     /**
-     * get the request line
+     * Parse the request line
      * METHOD URL HTTP_VER\r\n
      */
-
-    numchars = httpd_get_line(dcb->fd, buf, sizeof(buf));
-
-    i = 0; j = 0;
-    while (!ISspace(buf[j]) && (i < sizeof(method) - 1))
+    i = 0;
+    j = 0;
+    while (!ISspace(request[j]) && request[j] != '\0' &&
+           (i < sizeof(method) - 1))
     {
-        method[i] = buf[j];
-        i++; j++;
+        method[i] = request[j];
+        i++;
+        j++;
     }
     method[i] = '\0';
 
     strcpy(client_data->method, method);
 
-    /* check allowed http methods */
-    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
+    i = 0;
+    while (ISspace(request[j]))
     {
-        //httpd_unimplemented(dcb->fd);
-        return 0;
+        j++;
     }
-
-    i = 0;
-
-    while ( (j < sizeof(buf)) && ISspace(buf[j]))
+    while (!ISspace(request[j]) && request[j] != '\0' &&
+           (i < sizeof(url) - 1))
     {
+        url[i] = request[j];
+        i++;
         j++;
     }
+    url[i] = '\0';
 
-    while ((j < sizeof(buf) - 1) && !ISspace(buf[j]) && (i < sizeof(url) - 1))
+    /* The protocol version that closes the request line decides the
+     * default connection behaviour: persistent for HTTP/1.1, one
+     * request per connection for HTTP/1.0. */
+    while (ISspace(request[j]))
     {
-        url[i] = buf[j];
-        i++; j++;
+        j++;
+    }
+    client_data->keep_alive = strncasecmp(&request[j], "HTTP/1.0", 8) != 0;
+    if (httpd_header_value(request, "Connection", value, sizeof(value)))
+    {
+        if (strcasecmp(value, "close") == 0)
+        {
+            client_data->keep_alive = 0;
+        }
+        else if (strcasecmp(value, "keep-alive") == 0)
+        {
+            client_data->keep_alive = 1;
+        }
+    }
+    if (httpd_header_value(request, "Hostname", value, sizeof(value)))
+    {
+        strncpy(client_data->hostname, value, HTTPD_HOSTNAME_MAXLEN - 1);
+        client_data->hostname[HTTPD_HOSTNAME_MAXLEN - 1] = '\0';
+    }
+    if (httpd_header_value(request, "User-Agent", value, sizeof(value)))
+    {
+        strncpy(client_data->useragent, value, HTTPD_USERAGENT_MAXLEN - 1);
+        client_data->useragent[HTTPD_USERAGENT_MAXLEN - 1] = '\0';
     }
+    client_data->headers_received = 1;
 
-    url[i] = '\0';
+    /* check allowed http methods */
+    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
+    {
+        client_data->status = 501;
+        client_data->content_type = "text/html";
+        httpd_send_response(dcb);
+        if (!client_data->keep_alive)
+        {
+            dcb_close(dcb);
+            return 0;
+        }
+        return 1;
+    }
 
     /**
      * Get the query string if availble
      */
-
     if (strcasecmp(method, "GET") == 0)
     {
         query_string = url;
@@ -199,85 +352,105 @@ static int httpd_read_event(DCB* dcb)
     }
 
     /**
-     * Get the request headers
+     * Route the request, gathering everything the router writes so that
+     * the response can be framed with a Content-Length header.
      */
-
-    while ((numchars > 0) && strcmp("\n", buf))
+    client_data->status = 200;
+    client_data->content_type = httpd_content_type(url);
+    client_data->gathering = 1;
+    if ((uri = gwbuf_alloc(strlen(url) + 1)) != NULL)
     {
-        char *value = NULL;
-        char *end = NULL;
-        numchars = httpd_get_line(dcb->fd, buf, sizeof(buf));
-        if ((value = strchr(buf, ':')))
-        {
-            *value = '\0';
-            value++;
-            end = &value[strlen(value) -1];
-            *end = '\0';
-
-            if (strncasecmp(buf, "Hostname", 6) == 0)
-            {
-                strcpy(client_data->hostname, value);
-            }
-            if (strncasecmp(buf, "useragent", 9) == 0)
-            {
-                strcpy(client_data->useragent, value);
-            }
-        }
+        strcpy((char *)GWBUF_DATA(uri), url);
+        gwbuf_set_type(uri, GWBUF_TYPE_HTTP);
+        SESSION_ROUTE_QUERY(session, uri);
     }
+    client_data->gathering = 0;
 
-    if (numchars)
+    if (dcb->state != DCB_STATE_POLLING)
     {
-        headers_read = 1;
-        memcpy(&client_data->headers_received, &headers_read, sizeof(int));
+        /* The router closed the connection */
+        return 0;
     }
+    httpd_send_response(dcb);
 
-    /**
-     * Now begins the server reply
-     */
+    if (!client_data->keep_alive)
+    {
+        dcb_close(dcb);
+        return 0;
+    }
+    return 1;
+}
 
-    /* send all the basic headers and close with \r\n */
-    httpd_send_headers(dcb, 1);
+/**
+ * Extract the value of a request header.
+ *
+ * @param request       The NULL terminated request headers
+ * @param name          The name of the header, matched case insensitively
+ * @param value         Buffer the value is copied into
+ * @param size          Size of the value buffer
+ * @return 1 if the header was found, 0 if not
+ */
+static int httpd_header_value(char *request, const char *name,
+                              char *value, int size)
+{
+    int namelen = strlen(name);
+    char *ptr = strchr(request, '\n');
+    char *end;
+    int len;
 
-#if 0
-    /**
-     * ToDO: launch proper content handling based on the requested URI, later REST interface
-     *
-     */
-    if (strcmp(url, "/show") == 0)
+    while (ptr)
     {
-        if (query_string && strlen(query_string))
+        ptr++;
+        if (strncasecmp(ptr, name, namelen) == 0 && ptr[namelen] == ':')
         {
-            if (strcmp(query_string, "dcb") == 0)
+            ptr += namelen + 1;
+            while (ISspace(*ptr))
+            {
+                ptr++;
+            }
+            if ((end = strchr(ptr, '\r')) == NULL &&
+                (end = strchr(ptr, '\n')) == NULL)
             {
-                dprintAllDCBs(dcb);
+                end = ptr + strlen(ptr);
             }
-            if (strcmp(query_string, "session") == 0)
+            len = end - ptr;
+            if (len > size - 1)
             {
-                dprintAllSessions(dcb);
+                len = size - 1;
             }
+            memcpy(value, ptr, len);
+            value[len] = '\0';
+            return 1;
         }
+        ptr = strchr(ptr, '\n');
     }
-    if (strcmp(url, "/services") == 0)
+    return 0;
+}
+
+/**
+ * Choose the content type of the response from the extension of the
+ * requested document. The REST style URLs carry no extension and get
+ * the JSON type the interface has always reported.
+ *
+ * @param url   The requested URL
+ * @return The content type
+ */
+static const char *httpd_content_type(const char *url)
+{
+    const char *ext = strrchr(url, '.');
+
+    if (ext)
     {
-        RESULTSET *set, *seviceGetList();
-        if ((set = serviceGetList()) != NULL)
+        if (strcasecmp(ext, ".css") == 0)
         {
-            resultset_stream_json(set, dcb);
-            resultset_free(set);
+            return "text/css";
+        }
+        if (strcasecmp(ext, ".html") == 0 || strcasecmp(ext, ".htm") == 0)
+        {
+            return "text/html";
         }
     }
-#endif
-    if ((uri = gwbuf_alloc(strlen(url) + 1)) != NULL)
-    {
-        strcpy((char *)GWBUF_DATA(uri), url);
-        gwbuf_set_type(uri, GWBUF_TYPE_HTTP);
-        SESSION_ROUTE_QUERY(session, uri);
-    }
-
-    /* force the client connecton close */
-    dcb_close(dcb);
-
-    return 0;
+    return "application/json";
 }
 
 /**
@@ -294,17 +467,24 @@ static int httpd_write_event(DCB *dcb)
 /**
  * Write routine for the HTTPD protocol module.
  *
- * Writes the content of the buffer queue to the socket
- * observing the non-blocking principles of the gateway.
+ * While a request is being routed the written data is gathered as the
+ * body of the response, so that it can be framed with a Content-Length
+ * header; at any other time the content of the buffer queue is written
+ * to the socket observing the non-blocking principles of the gateway.
  *
  * @param dcb   Descriptor Control Block for the socket
  * @param queue Linked list of buffes to write
  */
 static int httpd_write(DCB *dcb, GWBUF *queue)
 {
-    int rc;
-    rc = dcb_write(dcb, queue);
-    return rc;
+    HTTPD_session *client_data = dcb->data;
+
+    if (client_data && client_data->gathering)
+    {
+        client_data->response = gwbuf_append(client_data->response, queue);
+        return 1;
+    }
+    return dcb_write(dcb, queue);
 }
 
 /**
@@ -395,6 +575,16 @@ static int httpd_accept(DCB *dcb)
 
 static int httpd_close(DCB *dcb)
 {
+    HTTPD_session *client_data = dcb->data;
+
+    if (client_data)
+    {
+        gwbuf_free(client_data->inbuf);
+        client_data->inbuf = NULL;
+        gwbuf_free(client_data->response);
+        client_data->response = NULL;
+        client_data->gathering = 0;
+    }
     return 0;
 }
 
@@ -436,6 +626,13 @@ static int httpd_listen(DCB *listener, char *config)
                   errno, strerror_r(errno, errbuf, sizeof(errbuf)));
         return 0;
     }
+#ifdef SO_REUSEPORT
+    /* allow the core to shard the listener across the polling threads */
+    if (poll_listener_shards() > 1)
+    {
+        setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, (char *)&one, sizeof(one));
+    }
+#endif
     /* set NONBLOCKING mode */
     setnonblocking(listener->fd);
 
@@ -471,71 +668,67 @@ static int httpd_listen(DCB *listener, char *config)
 }
 
 /**
- * HTTPD get line from client
- */
-static int httpd_get_line(int sock, char *buf, int size)
-{
-    int i = 0;
-    char c = '\0';
-    int n;
-
-    while ((i < size - 1) && (c != '\n'))
-    {
-        n = recv(sock, &c, 1, 0);
-        /* DEBUG printf("%02X\n", c); */
-        if (n > 0)
-        {
-            if (c == '\r')
-            {
-                n = recv(sock, &c, 1, MSG_PEEK);
-                /* DEBUG printf("%02X\n", c); */
-                if ((n > 0) && (c == '\n'))
-                {
-                    if (recv(sock, &c, 1, 0) < 0)
-                    {
-                        c = '\n';
-                    }
-                }
-                else
-                {
-                    c = '\n';
-                }
-            }
-            buf[i] = c;
-            i++;
-        }
-        else
-        {
-            c = '\n';
-        }
-    }
-
-    buf[i] = '\0';
-
-    return i;
-}
-
-/**
- * HTTPD send basic headers with 200 OK
+ * Send the response to a request, framing the gathered router output
+ * with the HTTP headers. The Content-Length header lets the client
+ * detect the end of the body without the connection being closed, so
+ * the connection can be kept open for the next request.
+ *
+ * @param dcb   The client descriptor control block
  */
-static void httpd_send_headers(DCB *dcb, int final)
+static void httpd_send_response(DCB *dcb)
 {
+    HTTPD_session *client_data = dcb->data;
     char date[64] = "";
     const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
+    char headers[HTTPD_SMALL_BUFFER];
+    const char *status_text;
+    unsigned int blen;
+    GWBUF *hbuf;
     time_t httpd_current_time = time(NULL);
-
     struct tm tm;
+
     localtime_r(&httpd_current_time, &tm);
     strftime(date, sizeof(date), fmt, &tm);
 
-    dcb_printf(dcb,
-               "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: "
-               "close\r\nContent-Type: application/json\r\n",
-               date, HTTP_SERVER_STRING);
+    switch (client_data->status)
+    {
+    case 200:
+        status_text = "OK";
+        break;
+    case 404:
+        status_text = "Not Found";
+        break;
+    case 501:
+        status_text = "Not Implemented";
+        break;
+    default:
+        status_text = "Internal Server Error";
+        break;
+    }
 
-    /* close the headers */
-    if (final)
+    blen = client_data->response ? gwbuf_length(client_data->response) : 0;
+    snprintf(headers, sizeof(headers),
+             "HTTP/1.1 %d %s\r\n"
+             "Date: %s\r\n"
+             "Server: %s\r\n"
+             "Connection: %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %u\r\n"
+             "\r\n",
+             client_data->status, status_text, date, HTTP_SERVER_STRING,
+             client_data->keep_alive ? "keep-alive" : "close",
+             client_data->content_type ? client_data->content_type
+             : "application/json",
+             blen);
+
+    if ((hbuf = gwbuf_alloc(strlen(headers))) != NULL)
+    {
+        memcpy(GWBUF_DATA(hbuf), headers, strlen(headers));
+        dcb_write(dcb, hbuf);
+    }
+    if (client_data->response)
     {
-        dcb_printf(dcb, "\r\n");
+        dcb_write(dcb, client_data->response);
+        client_data->response = NULL;
     }
 }
@@ -0,0 +1,149 @@
+/*
+ * This file is distributed as part of the MariaDB Corporation MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+#include <string.h>
+#include <buffer.h>
+#include <lineread.h>
+
+/**
+ * @file lineread.c - Buffered line reader shared by the admin protocols
+ *
+ * The telnetd and maxscaled protocol modules both receive newline
+ * terminated commands over connections that deliver the bytes at an
+ * arbitrary pace; an interactive user may well type a character at a
+ * time. The reader buffers the data between read events and hands back
+ * one complete line at a time, locating the terminator with memchr
+ * rather than scanning byte by byte, so the event handlers process
+ * whatever has arrived and return to the polling loop without ever
+ * waiting for the rest of a line.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 04/07/16     Mark Riddoch    Initial implementation
+ *
+ * @endverbatim
+ */
+
+/**
+ * Append a buffer read from the network to the pending data of the
+ * reader. Ownership of the buffer chain passes to the reader.
+ *
+ * @param lr    The line reader
+ * @param buf   The buffer chain to append, may be NULL
+ */
+void
+lineread_append(LINEREAD *lr, GWBUF *buf)
+{
+    lr->pending = gwbuf_append(lr->pending, buf);
+}
+
+/**
+ * Extract the next complete, newline terminated line of the pending
+ * data.
+ *
+ * The returned buffer holds a single contiguous line, including the
+ * terminating newline. In the common case of a client writing one
+ * complete line per packet the pending buffer itself is returned
+ * without copying; a line typed a character at a time or split across
+ * packets is assembled into a fresh buffer.
+ *
+ * @param lr    The line reader
+ * @return One line of input or NULL if no complete line is buffered
+ */
+GWBUF *
+lineread_get(LINEREAD *lr)
+{
+    GWBUF *buf, *line;
+    unsigned int before = 0;
+    unsigned int linelen, left, n;
+    char *nl, *dest;
+
+    for (buf = lr->pending; buf; buf = buf->next)
+    {
+        if ((nl = memchr(GWBUF_DATA(buf), '\n', GWBUF_LENGTH(buf))) != NULL)
+        {
+            linelen = before + (nl - (char *)GWBUF_DATA(buf)) + 1;
+
+            if (lr->pending->next == NULL &&
+                linelen == GWBUF_LENGTH(lr->pending))
+            {
+                line = lr->pending;
+                lr->pending = NULL;
+                return line;
+            }
+            if ((line = gwbuf_alloc(linelen)) == NULL)
+            {
+                /* Leave the data pending; the next read event will
+                 * retry the extraction. */
+                return NULL;
+            }
+            dest = (char *)GWBUF_DATA(line);
+            left = linelen;
+            while (left > 0)
+            {
+                n = GWBUF_LENGTH(lr->pending);
+                if (n > left)
+                {
+                    n = left;
+                }
+                memcpy(dest, GWBUF_DATA(lr->pending), n);
+                dest += n;
+                left -= n;
+                lr->pending = gwbuf_consume(lr->pending, n);
+            }
+            return line;
+        }
+        before += GWBUF_LENGTH(buf);
+    }
+    return NULL;
+}
+
+/**
+ * Hand back all pending data of the reader, terminated or not, and
+ * leave the reader empty.
+ *
+ * This exists for the benefit of the maxscaled protocol, whose clients
+ * write each command as a single unterminated packet; the protocol
+ * drains complete lines first and then flushes the remainder as the
+ * final command of the read event, which keeps old clients working.
+ *
+ * @param lr    The line reader
+ * @return The pending buffer chain or NULL if nothing is buffered
+ */
+GWBUF *
+lineread_flush(LINEREAD *lr)
+{
+    GWBUF *buf = lr->pending;
+
+    lr->pending = NULL;
+    return buf;
+}
+
+/**
+ * Discard any pending data of the reader. Called when the connection
+ * the reader serves is being closed.
+ *
+ * @param lr    The line reader
+ */
+void
+lineread_free(LINEREAD *lr)
+{
+    gwbuf_free(lr->pending);
+    lr->pending = NULL;
+}
@@ -56,6 +56,10 @@ MODULE_INFO info =
  * Date         Who                     Description
  * 13/06/2014   Mark Riddoch            Initial implementation
  * 07/07/15     Martin Brampton         Correct failure handling
+ * 03/07/16     Mark Riddoch            Command completion marker written by
+ *                                      the CLI router, not after routing
+ * 04/07/16     Mark Riddoch            Input gathered through the shared
+ *                                      buffered line reader
  *
  * @endverbatim
  */
@@ -127,30 +131,79 @@ GWPROTOCOL* GetModuleObject()
  * @param dcb   The descriptor control block
  * @return
  */
+/**
+ * Fetch the next command from the line reader of the connection.
+ *
+ * Complete, newline terminated lines are drained first. The maxadmin
+ * client writes each command as a single packet with no terminator, so
+ * once the buffered lines are exhausted whatever data remains is
+ * flushed and treated as the final command of the read event; clients
+ * that do terminate their commands get correct framing even when a
+ * command is split across packets.
+ *
+ * @param maxscaled     The protocol structure of the connection
+ * @return The next command or NULL if the input is exhausted
+ */
+static GWBUF *maxscaled_next_command(MAXSCALED *maxscaled)
+{
+    GWBUF *line;
+
+    if ((line = lineread_get(&maxscaled->line)) == NULL)
+    {
+        line = lineread_flush(&maxscaled->line);
+    }
+    return line;
+}
+
 static int maxscaled_read_event(DCB* dcb)
 {
     int n;
     GWBUF *head = NULL;
+    GWBUF *line;
     SESSION *session = dcb->session;
     MAXSCALED *maxscaled = (MAXSCALED *)dcb->protocol;
-    char *password;
+    char *password, *t;
 
     if ((n = dcb_read(dcb, &head, 0)) != -1)
     {
         if (head)
         {
             if (GWBUF_LENGTH(head))
+            {
+                lineread_append(&maxscaled->line, head);
+            }
+            else
+            {
+                // Force the free of the buffer header
+                while ((head = gwbuf_consume(head, GWBUF_LENGTH(head))) != NULL)
+                {
+                    ;
+                }
+            }
+            while ((line = maxscaled_next_command(maxscaled)) != NULL)
             {
                 switch (maxscaled->state)
                 {
                 case MAXSCALED_STATE_LOGIN:
-                    maxscaled->username = strndup(GWBUF_DATA(head), GWBUF_LENGTH(head));
+                    maxscaled->username = strndup(GWBUF_DATA(line), GWBUF_LENGTH(line));
+                    /* Strip the terminator, if the client sent one */
+                    t = maxscaled->username + strlen(maxscaled->username);
+                    while (t > maxscaled->username &&
+                           (t[-1] == '\n' || t[-1] == '\r'))
+                    {
+                        *--t = 0;
+                    }
                     maxscaled->state = MAXSCALED_STATE_PASSWD;
                     dcb_printf(dcb, "PASSWORD");
-                    while ((head = gwbuf_consume(head, GWBUF_LENGTH(head))) != NULL);
+                    gwbuf_free(line);
                     break;
                 case MAXSCALED_STATE_PASSWD:
-                    password = strndup(GWBUF_DATA(head), GWBUF_LENGTH(head));
+                    password = strndup(GWBUF_DATA(line), GWBUF_LENGTH(line));
+                    t = password + strlen(password);
+                    while (t > password && (t[-1] == '\n' || t[-1] == '\r'))
+                    {
+                        *--t = 0;
+                    }
                     if (admin_verify(maxscaled->username, password))
                     {
                         dcb_printf(dcb, "OK----");
@@ -161,26 +214,19 @@ static int maxscaled_read_event(DCB* dcb)
                         dcb_printf(dcb, "FAILED");
                         maxscaled->state = MAXSCALED_STATE_LOGIN;
                     }
-                    while ((head = gwbuf_consume(head, GWBUF_LENGTH(head))) != NULL)
-                    {
-                        ;
-                    }
+                    gwbuf_free(line);
                     free(password);
                     break;
                 case MAXSCALED_STATE_DATA:
-                    SESSION_ROUTE_QUERY(session, head);
-                    dcb_printf(dcb, "OK");
+                    /*
+                     * The CLI router hands the command to the admin
+                     * executor thread and writes the OK terminator
+                     * itself once the command output is complete.
+                     */
+                    SESSION_ROUTE_QUERY(session, line);
                     break;
                 }
             }
-            else
-            {
-                // Force the free of the buffer header
-                while ((head = gwbuf_consume(head, GWBUF_LENGTH(head))) != NULL)
-                {
-                    ;
-                }
-            }
         }
     }
     return n;
@@ -272,7 +318,7 @@ static int maxscaled_accept(DCB *dcb)
             client_dcb->fd = so;
             client_dcb->remote = strdup(inet_ntoa(addr.sin_addr));
             memcpy(&client_dcb->func, &MyObject, sizeof(GWPROTOCOL));
-            if ((maxscaled_pr = (MAXSCALED *)malloc(sizeof(MAXSCALED))) == NULL)
+            if ((maxscaled_pr = (MAXSCALED *)protocol_object_alloc(sizeof(MAXSCALED))) == NULL)
             {
                 client_dcb->protocol = NULL;
                 close(so);
@@ -280,6 +326,7 @@ static int maxscaled_accept(DCB *dcb)
                 return n_connect;
             }
             maxscaled_pr->username = NULL;
+            maxscaled_pr->line.pending = NULL;
             spinlock_init(&maxscaled_pr->lock);
             client_dcb->protocol = (void *)maxscaled_pr;
 
@@ -320,6 +367,7 @@ static int maxscaled_close(DCB *dcb)
         free(maxscaled->username);
         maxscaled->username = NULL;
     }
+    lineread_free(&maxscaled->line);
     spinlock_release(&maxscaled->lock);
 
     return 0;
@@ -354,6 +402,13 @@ static int maxscaled_listen(DCB *listener, char *config)
     {
         MXS_ERROR("Unable to set SO_REUSEADDR on maxscale listener.");
     }
+#ifdef SO_REUSEPORT
+    // allow the core to shard the listener across the polling threads
+    if (poll_listener_shards() > 1)
+    {
+        setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, (char *)&one, sizeof(one));
+    }
+#endif
     // set NONBLOCKING mode
     setnonblocking(listener->fd);
     // bind address and port
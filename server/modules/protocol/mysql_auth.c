@@ -26,12 +26,146 @@
  * Revision History
  * Date         Who                     Description
  * 02/02/2016   Martin Brampton         Initial version
+ * 03/07/2016   Mark Riddoch            Cache the repository password hash per
+ *                                      user and client address
+ * 05/07/2016   Mark Riddoch            Scramble check fused to write the stage1
+ *                                      hash directly and token length validated
  *
  * @endverbatim
  */
 
 #include <mysql_auth.h>
 #include <mysql_client_server_protocol.h>
+#include <time.h>
+
+/**
+ * The client authentication cache
+ *
+ * Resolving a user against the repository walks the users hashtable with up
+ * to six host and netmask combinations; with a connection churn heavy client
+ * tier the same user@host pair repeats this walk on every connection. The
+ * cache remembers the SHA1(SHA1(password)) the repository resolved for a
+ * user, database and client address, so that a repeat connection goes
+ * straight to the scramble verification. Only the repository lookup is
+ * cached; the scramble check itself must run for every connection as the
+ * scramble is unique to it.
+ *
+ * Entries are dropped after MYSQL_AUTH_CACHE_TTL seconds and whenever a
+ * reload of the service users changes the table, detected through the
+ * users_version counter of the service.
+ */
+#define MYSQL_AUTH_CACHE_SLOTS  256     /*< Cache slots, must be a power of two */
+#define MYSQL_AUTH_CACHE_TTL    300     /*< Lifetime of a cache entry in seconds */
+
+typedef struct
+{
+    char        user[MYSQL_USER_MAXLEN + 1];    /*< The user name */
+    char        db[MYSQL_DATABASE_MAXLEN + 1];  /*< Default database requested */
+    in_addr_t   addr;           /*< IPv4 address of the client */
+    SERVICE     *service;       /*< The service the client connected to */
+    int         users_version;  /*< Version of the users table the entry
+                                 *  was resolved against */
+    time_t      created;        /*< Time at which the entry was cached */
+    uint8_t     sha1[SHA_DIGEST_LENGTH]; /*< SHA1(SHA1(password)) from the repository */
+    bool        valid;          /*< The slot holds an entry */
+} MYSQL_AUTH_CACHE_ENTRY;
+
+static MYSQL_AUTH_CACHE_ENTRY auth_cache[MYSQL_AUTH_CACHE_SLOTS];
+static SPINLOCK auth_cache_lock = SPINLOCK_INIT;
+
+/**
+ * Select the cache slot for a user, database and client address
+ *
+ * @param username  The user name
+ * @param db        The default database, may be an empty string
+ * @param addr      The IPv4 address of the client
+ * @return The slot the entry maps to
+ */
+static MYSQL_AUTH_CACHE_ENTRY *
+mysql_auth_cache_slot(const char *username, const char *db, in_addr_t addr)
+{
+    unsigned int hash = 5381;
+
+    while (*username)
+    {
+        hash = hash * 33 + *username++;
+    }
+    while (*db)
+    {
+        hash = hash * 33 + *db++;
+    }
+    hash = hash * 33 + (unsigned int)addr;
+
+    return &auth_cache[hash & (MYSQL_AUTH_CACHE_SLOTS - 1)];
+}
+
+/**
+ * Look for a cached repository password hash for the client of a DCB
+ *
+ * @param dcb       Request handler DCB connected to the client
+ * @param username  The user name in the authentication request
+ * @param password  Buffer of SHA_DIGEST_LENGTH bytes the hash is copied to
+ * @return True if a valid entry was found and copied
+ */
+static bool
+mysql_auth_cache_fetch(DCB *dcb, const char *username, uint8_t *password)
+{
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+    MYSQL_AUTH_CACHE_ENTRY *entry;
+    bool hit = false;
+
+    entry = mysql_auth_cache_slot(username, client_data->db,
+                                  dcb->ipv4.sin_addr.s_addr);
+    spinlock_acquire(&auth_cache_lock);
+    if (entry->valid &&
+        entry->service == dcb->service &&
+        entry->users_version == dcb->service->users_version &&
+        entry->addr == dcb->ipv4.sin_addr.s_addr &&
+        strcmp(entry->user, username) == 0 &&
+        strcmp(entry->db, client_data->db) == 0 &&
+        time(NULL) - entry->created <= MYSQL_AUTH_CACHE_TTL)
+    {
+        memcpy(password, entry->sha1, SHA_DIGEST_LENGTH);
+        hit = true;
+    }
+    spinlock_release(&auth_cache_lock);
+
+    return hit;
+}
+
+/**
+ * Cache the repository password hash of a successfully authenticated client
+ *
+ * An existing entry in the slot is simply overwritten; a colliding pair
+ * falls back to the repository lookup on its next connection.
+ *
+ * @param dcb       Request handler DCB connected to the client
+ * @param username  The authenticated user name
+ * @param password  The SHA1(SHA1(password)) resolved from the repository
+ */
+static void
+mysql_auth_cache_store(DCB *dcb, const char *username, uint8_t *password)
+{
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+    MYSQL_AUTH_CACHE_ENTRY *entry;
+
+    if (strlen(username) > MYSQL_USER_MAXLEN)
+    {
+        return;
+    }
+    entry = mysql_auth_cache_slot(username, client_data->db,
+                                  dcb->ipv4.sin_addr.s_addr);
+    spinlock_acquire(&auth_cache_lock);
+    strcpy(entry->user, username);
+    strcpy(entry->db, client_data->db);
+    entry->addr = dcb->ipv4.sin_addr.s_addr;
+    entry->service = dcb->service;
+    entry->users_version = dcb->service->users_version;
+    entry->created = time(NULL);
+    memcpy(entry->sha1, password, SHA_DIGEST_LENGTH);
+    entry->valid = true;
+    spinlock_release(&auth_cache_lock);
+}
 
 static int combined_auth_check(
     DCB             *dcb,
@@ -355,12 +489,11 @@ gw_check_mysql_scramble_data(DCB *dcb,
                                  uint8_t *stage1_hash)
 {
     uint8_t step1[GW_MYSQL_SCRAMBLE_SIZE]="";
-    uint8_t step2[GW_MYSQL_SCRAMBLE_SIZE +1]="";
     uint8_t check_hash[GW_MYSQL_SCRAMBLE_SIZE]="";
-    char hex_double_sha1[2 * GW_MYSQL_SCRAMBLE_SIZE + 1]="";
     uint8_t password[GW_MYSQL_SCRAMBLE_SIZE]="";
     /* The following can be compared using memcmp to detect a null password */
     uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN]="";
+    bool cached;
 
 
     if ((username == NULL) || (scramble == NULL) || (stage1_hash == NULL))
@@ -368,12 +501,22 @@ gw_check_mysql_scramble_data(DCB *dcb,
         return MYSQL_FAILED_AUTH;
     }
 
+    /* A mysql_native_password token is a SHA1 digest; a longer one would
+     * overrun the digest buffers below and cannot be valid. */
+    if (token_len > GW_MYSQL_SCRAMBLE_SIZE)
+    {
+        return MYSQL_FAILED_AUTH;
+    }
+
     /*<
-     * get the user's password from repository in SHA1(SHA1(real_password));
-     * please note 'real_password' is unknown!
+     * get the user's password in SHA1(SHA1(real_password)), from the cache
+     * of recently authenticated clients if possible and otherwise from the
+     * repository; please note 'real_password' is unknown!
      */
 
-    if (gw_find_mysql_user_password_sha1(username, password, dcb))
+    cached = mysql_auth_cache_fetch(dcb, username, password);
+
+    if (!cached && gw_find_mysql_user_password_sha1(username, password, dcb))
     {
         /* if password was sent, fill stage1_hash with at least 1 byte in order
          * to create right error message: (using password: YES|NO)
@@ -384,20 +527,18 @@ gw_check_mysql_scramble_data(DCB *dcb,
         return MYSQL_FAILED_AUTH;
     }
 
-    if (token && token_len)
-    {
-        /*<
-         * convert in hex format: this is the content of mysql.user table.
-         * The field password is without the '*' prefix and it is 40 bytes long
-         */
-
-        gw_bin2hex(hex_double_sha1, password, SHA_DIGEST_LENGTH);
-    }
-    else
+    if (token == NULL || token_len == 0)
     {
         /* check if the password is not set in the user table */
-        return memcmp(password, null_client_sha1, MYSQL_SCRAMBLE_LEN) ?
-            MYSQL_FAILED_AUTH : MYSQL_AUTH_SUCCEEDED;
+        if (memcmp(password, null_client_sha1, MYSQL_SCRAMBLE_LEN))
+        {
+            return MYSQL_FAILED_AUTH;
+        }
+        if (!cached)
+        {
+            mysql_auth_cache_store(dcb, username, password);
+        }
+        return MYSQL_AUTH_SUCCEEDED;
     }
 
     /*<
@@ -420,17 +561,16 @@ gw_check_mysql_scramble_data(DCB *dcb,
      *
      * token is transmitted form client and it's based on the handshake scramble and SHA1(real_passowrd)
      * step1 has been computed in the previous step
-     * the result STEP2 is SHA1(the_password_to_check) and is SHA_DIGEST_LENGTH long
-     */
-
-    gw_str_xor(step2, token, step1, token_len);
-
-    /*<
-     * copy the stage1_hash back to the caller
-     * stage1_hash will be used for backend authentication
+     * the result STEP2 is SHA1(the_password_to_check) and is SHA_DIGEST_LENGTH long.
+     * It is computed directly into stage1_hash, which carries it back to
+     * the caller for use in backend authentication.
      */
 
-    memcpy(stage1_hash, step2, SHA_DIGEST_LENGTH);
+    if (token_len < SHA_DIGEST_LENGTH)
+    {
+        memset(stage1_hash, 0, SHA_DIGEST_LENGTH);
+    }
+    gw_str_xor(stage1_hash, token, step1, token_len);
 
     /*<
      * step 3: prepare the check_hash
@@ -438,7 +578,7 @@ gw_check_mysql_scramble_data(DCB *dcb,
      * compute the SHA1(STEP2) that is SHA1(SHA1(the_password_to_check)), and is SHA_DIGEST_LENGTH long
      */
 
-    gw_sha1_str(step2, SHA_DIGEST_LENGTH, check_hash);
+    gw_sha1_str(stage1_hash, SHA_DIGEST_LENGTH, check_hash);
 
 
 #ifdef GW_DEBUG_CLIENT_AUTH
@@ -451,8 +591,15 @@ gw_check_mysql_scramble_data(DCB *dcb,
 #endif
 
     /* now compare SHA1(SHA1(gateway_password)) and check_hash: return 0 is MYSQL_AUTH_OK */
-    return (0 == memcmp(password, check_hash, SHA_DIGEST_LENGTH)) ?
-        MYSQL_AUTH_SUCCEEDED : MYSQL_FAILED_AUTH;
+    if (0 == memcmp(password, check_hash, SHA_DIGEST_LENGTH))
+    {
+        if (!cached)
+        {
+            mysql_auth_cache_store(dcb, username, password);
+        }
+        return MYSQL_AUTH_SUCCEEDED;
+    }
+    return MYSQL_FAILED_AUTH;
 }
 
 /**
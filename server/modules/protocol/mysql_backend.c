@@ -47,6 +47,10 @@
  * 19/06/2015   Martin Brampton         Persistent connection handling
  * 07/10/2015   Martin Brampton         Remove calls to dcb_close - should be done by routers
  * 27/10/2015   Martin Brampton         Test for RCAP_TYPE_NO_RSESSION before calling clientReply
+ * 03/07/2016   Mark Riddoch            Drain the backend socket per read event, bounded
+ *                                      by the read batch limit of the service
+ * 05/07/2016   Mark Riddoch            Session command statements detected with
+ *                                      a single read of the buffer type tag
  *
  */
 #include <modinfo.h>
@@ -63,6 +67,7 @@ MODULE_INFO info = {
 static char *version_str = "V2.0.0";
 static int gw_create_backend_connection(DCB *backend, SERVER *server, SESSION *in_session);
 static int gw_read_backend_event(DCB* dcb);
+static int gw_read_backend_reply(DCB *dcb, MYSQL_session *local_session);
 static int gw_write_backend_event(DCB *dcb);
 static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue);
 static int gw_error_backend_event(DCB *dcb);
@@ -157,6 +162,188 @@ static bool gw_get_shared_session_auth_info(DCB* dcb, MYSQL_session* session)
     return rval;
 }
 
+/**
+ * Read a batch of backend data and route the complete replies to the
+ * client. Called repeatedly from gw_read_backend_event to drain the
+ * socket within a single poll event.
+ *
+ * @param dcb           The backend Descriptor Control Block
+ * @param local_session Shared session authentication data
+ * @return 1 if a reply was routed, 0 when there was nothing to route
+ */
+static int gw_read_backend_reply(DCB *dcb, MYSQL_session *local_session)
+{
+    MySQLProtocol *client_protocol = NULL;
+    int rc = 0;
+
+    GWBUF *read_buffer = NULL;
+    ROUTER_OBJECT *router = NULL;
+    ROUTER *router_instance = NULL;
+    SESSION *session = dcb->session;
+    int nbytes_read = 0;
+
+    CHK_SESSION(session);
+    router = session->service->router;
+    router_instance = session->service->router_instance;
+
+    /* read available backend data */
+    rc = dcb_read(dcb, &read_buffer, 0);
+
+    if (rc < 0)
+    {
+        GWBUF* errbuf;
+        bool succp;
+#if defined(SS_DEBUG)
+        MXS_ERROR("Backend read error handling #2.");
+#endif
+        errbuf = mysql_create_custom_error(1,
+                                           0,
+                                           "Read from backend failed");
+
+        router->handleError(router_instance,
+                            session->router_session,
+                            errbuf,
+                            dcb,
+                            ERRACT_NEW_CONNECTION,
+                            &succp);
+        gwbuf_free(errbuf);
+
+        if (!succp)
+        {
+            spinlock_acquire(&session->ses_lock);
+            session->state = SESSION_STATE_STOPPING;
+            spinlock_release(&session->ses_lock);
+        }
+        rc = 0;
+        return rc;
+    }
+    nbytes_read = gwbuf_length(read_buffer);
+
+    if (nbytes_read == 0 && dcb->dcb_readqueue == NULL)
+    {
+        return rc;
+    }
+    else
+    {
+        ss_dassert(read_buffer != NULL || dcb->dcb_readqueue != NULL);
+    }
+
+    if (dcb->dcb_readqueue)
+    {
+        read_buffer = gwbuf_append(dcb->dcb_readqueue, read_buffer);
+    }
+
+    nbytes_read = gwbuf_length(read_buffer);
+
+    if (nbytes_read < 3)
+    {
+        dcb->dcb_readqueue = read_buffer;
+        rc = 0;
+        return rc;
+    }
+
+#if defined(SS_DEBUG)
+    /* When the read landed in a single buffer the forward path must be
+     * zero-copy: packet extraction returns non-owning views and the
+     * buffer flows to the client write queue untouched. The zone makes
+     * a copying buffer operation trip an assertion. */
+    bool single_buffer = (read_buffer->next == NULL);
+    if (single_buffer)
+    {
+        gwbuf_zero_copy_enter();
+    }
+#endif
+    {
+        GWBUF *tmp = modutil_get_complete_packets(&read_buffer);
+
+#if defined(SS_DEBUG)
+        if (single_buffer)
+        {
+            gwbuf_zero_copy_exit();
+        }
+#endif
+        if (tmp == NULL)
+        {
+            /** No complete packets */
+            dcb->dcb_readqueue = read_buffer;
+            rc = 0;
+            return rc;
+        }
+
+        dcb->dcb_readqueue = read_buffer;
+        read_buffer = tmp;
+    }
+
+    /**
+     * If protocol has session command set, concatenate whole
+     * response into one buffer.
+     */
+    if (protocol_get_srv_command((MySQLProtocol *) dcb->protocol, false) != MYSQL_COM_UNDEFINED)
+    {
+        read_buffer = process_response_data(dcb, read_buffer, gwbuf_length(read_buffer));
+        /**
+         * Received incomplete response to session command.
+         * Store it to readqueue and return.
+         */
+        if (!sescmd_response_complete(dcb))
+        {
+            rc = 0;
+            return rc;
+        }
+
+        if (!read_buffer)
+        {
+            MXS_NOTICE("%lu [gw_read_backend_event] "
+                       "Read buffer unexpectedly null, even though response "
+                       "not marked as complete. User: %s",
+                       pthread_self(),
+                       local_session->user);
+            rc = 0;
+            return rc;
+        }
+    }
+    /**
+     * Check that session is operable, and that client DCB is
+     * still listening the socket for replies.
+     */
+    if (dcb->session->state == SESSION_STATE_ROUTER_READY &&
+        dcb->session->client_dcb != NULL &&
+        dcb->session->client_dcb->state == DCB_STATE_POLLING &&
+        (session->router_session || router->getCapabilities() & RCAP_TYPE_NO_RSESSION))
+    {
+        client_protocol = SESSION_PROTOCOL(dcb->session,
+                                           MySQLProtocol);
+        if (client_protocol != NULL)
+        {
+            CHK_PROTOCOL(client_protocol);
+
+            if (client_protocol->protocol_auth_state == MYSQL_IDLE)
+            {
+                gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+
+                router->clientReply(router_instance,
+                                    session->router_session,
+                                    read_buffer,
+                                    dcb);
+                rc = 1;
+            }
+            return rc;
+        }
+        else if (dcb->session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
+        {
+            gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+            router->clientReply(router_instance, session->router_session, read_buffer, dcb);
+            rc = 1;
+        }
+    }
+    else /*< session is closing; replying to client isn't possible */
+    {
+        gwbuf_free(read_buffer);
+    }
+
+    return rc;
+}
+
 /**
  * Backend Read Event for EPOLLIN on the MySQL backend protocol module
  * @param dcb   The backend Descriptor Control Block
@@ -164,7 +351,6 @@ static bool gw_get_shared_session_auth_info(DCB* dcb, MYSQL_session* session)
  */
 static int gw_read_backend_event(DCB *dcb)
 {
-    MySQLProtocol *client_protocol = NULL;
     MySQLProtocol *backend_protocol = NULL;
     MYSQL_session local_session;
     int rc = 0;
@@ -442,153 +628,29 @@ static int gw_read_backend_event(DCB *dcb)
 
     /* reading MySQL command output from backend and writing to the client */
     {
-        GWBUF *read_buffer = NULL;
-        ROUTER_OBJECT *router = NULL;
-        ROUTER *router_instance = NULL;
-        SESSION *session = dcb->session;
-        int nbytes_read = 0;
-
-        CHK_SESSION(session);
-        router = session->service->router;
-        router_instance = session->service->router_instance;
-
-        /* read available backend data */
-        rc = dcb_read(dcb, &read_buffer, 0);
-
-        if (rc < 0)
-        {
-            GWBUF* errbuf;
-            bool succp;
-#if defined(SS_DEBUG)
-            MXS_ERROR("Backend read error handling #2.");
-#endif
-            errbuf = mysql_create_custom_error(1,
-                                               0,
-                                               "Read from backend failed");
-
-            router->handleError(router_instance,
-                                session->router_session,
-                                errbuf,
-                                dcb,
-                                ERRACT_NEW_CONNECTION,
-                                &succp);
-            gwbuf_free(errbuf);
-
-            if (!succp)
-            {
-                spinlock_acquire(&session->ses_lock);
-                session->state = SESSION_STATE_STOPPING;
-                spinlock_release(&session->ses_lock);
-            }
-            rc = 0;
-            goto return_rc;
-        }
-        nbytes_read = gwbuf_length(read_buffer);
-
-        if (nbytes_read == 0 && dcb->dcb_readqueue == NULL)
-        {
-            goto return_rc;
-        }
-        else
-        {
-            ss_dassert(read_buffer != NULL || dcb->dcb_readqueue != NULL);
-        }
-
-        if (dcb->dcb_readqueue)
-        {
-            read_buffer = gwbuf_append(dcb->dcb_readqueue, read_buffer);
-        }
-
-        nbytes_read = gwbuf_length(read_buffer);
-
-        if (nbytes_read < 3)
-        {
-            dcb->dcb_readqueue = read_buffer;
-            rc = 0;
-            goto return_rc;
-        }
-
-        {
-            GWBUF *tmp = modutil_get_complete_packets(&read_buffer);
-
-            if (tmp == NULL)
-            {
-                /** No complete packets */
-                dcb->dcb_readqueue = read_buffer;
-                rc = 0;
-                goto return_rc;
-            }
-
-            dcb->dcb_readqueue = read_buffer;
-            read_buffer = tmp;
-        }
+        int batch = dcb->session->service ?
+            dcb->session->service->read_batch_limit : SERVICE_DEFAULT_READ_BATCH;
+        int routed = 0;
 
         /**
-         * If protocol has session command set, concatenate whole
-         * response into one buffer.
+         * Drain the socket: data that arrived while a reply was being
+         * routed is processed within the same event, up to the read
+         * batch limit of the service, instead of waiting for another
+         * epoll wakeup. The loop ends as soon as a pass finds nothing
+         * more to route.
          */
-        if (protocol_get_srv_command((MySQLProtocol *) dcb->protocol, false) != MYSQL_COM_UNDEFINED)
+        do
         {
-            read_buffer = process_response_data(dcb, read_buffer, gwbuf_length(read_buffer));
-            /**
-             * Received incomplete response to session command.
-             * Store it to readqueue and return.
-             */
-            if (!sescmd_response_complete(dcb))
-            {
-                rc = 0;
-                goto return_rc;
-            }
+            rc = gw_read_backend_reply(dcb, &local_session);
 
-            if (!read_buffer)
+            if (rc == 1)
             {
-                MXS_NOTICE("%lu [gw_read_backend_event] "
-                           "Read buffer unexpectedly null, even though response "
-                           "not marked as complete. User: %s",
-                           pthread_self(),
-                           local_session.user);
-                rc = 0;
-                goto return_rc;
+                routed = 1;
             }
         }
-        /**
-         * Check that session is operable, and that client DCB is
-         * still listening the socket for replies.
-         */
-        if (dcb->session->state == SESSION_STATE_ROUTER_READY &&
-            dcb->session->client_dcb != NULL &&
-            dcb->session->client_dcb->state == DCB_STATE_POLLING &&
-            (session->router_session || router->getCapabilities() & RCAP_TYPE_NO_RSESSION))
-        {
-            client_protocol = SESSION_PROTOCOL(dcb->session,
-                                               MySQLProtocol);
-            if (client_protocol != NULL)
-            {
-                CHK_PROTOCOL(client_protocol);
+        while (rc == 1 && --batch > 0 && dcb->state == DCB_STATE_POLLING);
 
-                if (client_protocol->protocol_auth_state == MYSQL_IDLE)
-                {
-                    gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
-
-                    router->clientReply(router_instance,
-                                        session->router_session,
-                                        read_buffer,
-                                        dcb);
-                    rc = 1;
-                }
-                goto return_rc;
-            }
-            else if (dcb->session->client_dcb->dcb_role == DCB_ROLE_INTERNAL)
-            {
-                gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
-                router->clientReply(router_instance, session->router_session, read_buffer, dcb);
-                rc = 1;
-            }
-        }
-        else /*< session is closing; replying to client isn't possible */
-        {
-            gwbuf_free(read_buffer);
-        }
+        rc = routed ? 1 : rc;
     }
 
 return_rc:
@@ -743,8 +805,7 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
              * Server commands are stored to MySQLProtocol structure
              * if buffer always includes a single statement.
              */
-            if (GWBUF_IS_TYPE_SINGLE_STMT(queue) &&
-                GWBUF_IS_TYPE_SESCMD(queue))
+            if (GWBUF_IS_SESCMD_STMT(queue))
             {
                 /** Record the command to backend's protocol */
                 protocol_add_srv_command(backend_protocol, cmd);
@@ -767,8 +828,7 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
              * In case of session commands, store command to DCB's
              * protocol struct.
              */
-            if (GWBUF_IS_TYPE_SINGLE_STMT(queue) &&
-                GWBUF_IS_TYPE_SESCMD(queue))
+            if (GWBUF_IS_SESCMD_STMT(queue))
             {
                 uint8_t* ptr = GWBUF_DATA(queue);
                 int cmd = MYSQL_GET_COMMAND(ptr);
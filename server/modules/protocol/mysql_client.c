@@ -47,6 +47,17 @@
  * 11/01/2016   Martin Brampton         Remove SSL write code, now handled at lower level;
  *                                      replace gwbuf_consume by gwbuf_free (multiple).
  * 07/02/2016   Martin Brampton         Split off authentication and SSL.
+ * 03/07/2016   Mark Riddoch            Accept client connections non-blocking and
+ *                                      apply the socket option template in one call
+ * 03/07/2016   Mark Riddoch            Specialized read handler without the
+ *                                      handshake branches installed once a
+ *                                      client has authenticated
+ * 05/07/2016   Mark Riddoch            Packets tagged as contiguous at
+ *                                      ingestion so the routing chain need
+ *                                      not re-examine the buffer chain
+ * 05/07/2016   Mark Riddoch            Clients handled by an accept thread
+ *                                      are promoted to a serving thread once
+ *                                      they authenticate
  */
 #include <gw_protocol.h>
 #include <skygw_utils.h>
@@ -59,6 +70,7 @@
 #include <modinfo.h>
 #include <sys/stat.h>
 #include <modutil.h>
+#include <memlog.h>
 #include <netinet/tcp.h>
 
 MODULE_INFO info =
@@ -74,6 +86,9 @@ static char *version_str = "V1.0.0";
 static int gw_MySQLAccept(DCB *listener);
 static int gw_MySQLListener(DCB *listener, char *config_bind);
 static int gw_read_client_event(DCB* dcb);
+static int gw_read_client_event_established(DCB* dcb);
+static int gw_process_established(DCB *dcb, MySQLProtocol *protocol,
+                                  GWBUF *read_buffer, int nbytes_read, int rc);
 static int gw_write_client_event(DCB *dcb);
 static int gw_MySQLWrite_client(DCB *dcb, GWBUF *queue);
 static int gw_error_client_event(DCB *dcb);
@@ -522,6 +537,13 @@ int gw_read_client_event(DCB* dcb)
                 SESSION *session;
 
                 protocol->protocol_auth_state = MYSQL_AUTH_RECV;
+                /**
+                 * If a dedicated accept thread handled the handshake,
+                 * move the client to a serving thread now, before the
+                 * backend connections are created, so that they
+                 * inherit the serving thread.
+                 */
+                poll_promote_dcb(dcb);
                 /**
                  * Create session, and a router session for it.
                  * If successful, there will be backend connection(s)
@@ -541,6 +563,13 @@ int gw_read_client_event(DCB* dcb)
                      * packet sequence is # packet_number
                      */
                     mysql_send_ok(dcb, packet_number, 0, NULL);
+                    /**
+                     * The handshake states can never recur on this
+                     * connection, so swap in the specialized established
+                     * state read handler that carries none of the
+                     * authentication branches.
+                     */
+                    dcb->func.read = gw_read_client_event_established;
                 }
                 else
                 {
@@ -570,13 +599,62 @@ int gw_read_client_event(DCB* dcb)
          *
          */
     case MYSQL_IDLE:
-        {
+        /*
+         * Normally never reached; once authentication completes the read
+         * handler of the DCB is swapped to the specialized established
+         * state handler below. This handles any read event that was
+         * already queued for the DCB when the swap was made.
+         */
+        rc = gw_process_established(dcb, protocol, read_buffer, nbytes_read, rc);
+        read_buffer = NULL;
+        goto return_rc;
+
+    default:
+        break;
+    }
+    rc = 0;
+
+return_rc:
+#if defined(SS_DEBUG)
+    if (dcb->state == DCB_STATE_POLLING ||
+        dcb->state == DCB_STATE_NOPOLLING ||
+        dcb->state == DCB_STATE_ZOMBIE)
+    {
+        CHK_PROTOCOL(protocol);
+    }
+#endif
+    return rc;
+}
+
+/**
+ * Process a buffer of data read from an authenticated client connection.
+ *
+ * This is the path taken for every statement of an established session
+ * and contains none of the handshake handling. It is called both from
+ * the specialized established state read handler and from the generic
+ * read handler for any event that was queued between authentication
+ * completing and the handler swap.
+ *
+ * @param dcb           Descriptor control block
+ * @param protocol      The protocol structure of the DCB
+ * @param read_buffer   The data read from the client, ownership is taken
+ * @param nbytes_read   The number of bytes read
+ * @param rc            The return code of the read
+ * @return 0 if succeed, 1 otherwise
+ */
+static int
+gw_process_established(DCB *dcb, MySQLProtocol *protocol, GWBUF *read_buffer,
+                       int nbytes_read, int rc)
+{
     ROUTER_OBJECT *router = NULL;
     ROUTER *router_instance = NULL;
     void *rsession = NULL;
     uint8_t cap = 0;
     bool stmt_input = false; /*< router input type */
     SESSION *session = dcb->session;
+    uint8_t *payload = NULL;
+    session_state_t ses_state;
+
     if (session != NULL && SESSION_STATE_DUMMY != session->state)
     {
         CHK_SESSION(session);
@@ -592,7 +670,6 @@ int gw_read_client_event(DCB* dcb)
                                   0,
                                   "failed to create new session");
             gwbuf_free(read_buffer);
-            read_buffer = NULL;
             return 0;
         }
 
@@ -607,11 +684,10 @@ int gw_read_client_event(DCB* dcb)
         }
     }
 
-    /** If the router requires statement input or we are still authenticating
-     * we need to make sure that a complete SQL packet is read before continuing */
-    if (stmt_input || protocol->protocol_auth_state == MYSQL_AUTH_SENT)
+    /** If the router requires statement input we need to make sure that
+     * a complete SQL packet is read before continuing */
+    if (stmt_input)
     {
-
         if (!ensure_complete_packet(dcb, &read_buffer, nbytes_read))
         {
             return 0;
@@ -621,135 +697,170 @@ int gw_read_client_event(DCB* dcb)
     /**
      * Now there should be at least one complete mysql packet in read_buffer.
      */
-            uint8_t* payload = NULL;
-            session_state_t ses_state;
+    ss_dassert(session != NULL && SESSION_STATE_DUMMY != session->state);
 
-            session = dcb->session;
-            ss_dassert(session!= NULL && SESSION_STATE_DUMMY != session->state);
+    spinlock_acquire(&session->ses_lock);
+    ses_state = session->state;
+    spinlock_release(&session->ses_lock);
+    /* Now, we are assuming in the first buffer there is
+     * the information form mysql command */
+    payload = GWBUF_DATA(read_buffer);
 
-            if (session != NULL)
+    if (ses_state == SESSION_STATE_ROUTER_READY)
+    {
+        /** Route COM_QUIT to backend */
+        if (MYSQL_IS_COM_QUIT(payload))
+        {
+            /**
+             * Sends COM_QUIT packets since buffer is already
+             * created. A BREF_CLOSED flag is set so dcb_close won't
+             * send redundant COM_QUIT.
+             */
+            /* Temporarily suppressed: SESSION_ROUTE_QUERY(session, read_buffer); */
+            /* Replaced with freeing the read buffer. */
+            gwbuf_free(read_buffer);
+            read_buffer = NULL;
+            /**
+             * Close router session which causes closing of backends.
+             */
+            dcb_close(dcb);
+        }
+        else
+        {
+            /** Reset error handler when routing of the new query begins */
+            dcb->dcb_errhandle_called = false;
+
+            if (!service_rate_limit_check(session))
             {
-                CHK_SESSION(session);
+                /**
+                 * The client has exceeded the query rate limit of the
+                 * service. The query is dropped unrouted and the client
+                 * is told why, leaving it to decide whether to retry.
+                 */
+                gwbuf_free(read_buffer);
+                read_buffer = NULL;
+                mysql_send_custom_error(
+                    dcb, 1, 0,
+                    "Query rate limit of the service exceeded");
+                return 0;
             }
-            spinlock_acquire(&session->ses_lock);
-            ses_state = session->state;
-            spinlock_release(&session->ses_lock);
-            /* Now, we are assuming in the first buffer there is
-             * the information form mysql command */
-            payload = GWBUF_DATA(read_buffer);
 
-            if (ses_state == SESSION_STATE_ROUTER_READY)
+            if (stmt_input)
             {
-                /** Route COM_QUIT to backend */
-                if (MYSQL_IS_COM_QUIT(payload))
+                /**
+                 * Feed each statement completely and separately
+                 * to router.
+                 */
+                rc = route_by_statement(session, &read_buffer);
+
+                if (read_buffer != NULL)
                 {
-                    /**
-                     * Sends COM_QUIT packets since buffer is already
-                     * created. A BREF_CLOSED flag is set so dcb_close won't
-                     * send redundant COM_QUIT.
-                     */
-                    /* Temporarily suppressed: SESSION_ROUTE_QUERY(session, read_buffer); */
-                    /* Replaced with freeing the read buffer. */
-                    gwbuf_free(read_buffer);
+                    /** add incomplete mysql packet to read queue */
+                    dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, read_buffer);
                     read_buffer = NULL;
-                    /**
-                     * Close router session which causes closing of backends.
-                     */
-                    dcb_close(dcb);
-                }
-                else
-                {
-                    /** Reset error handler when routing of the new query begins */
-                    dcb->dcb_errhandle_called = false;
-
-                    if (stmt_input)
-                    {
-                        /**
-                         * Feed each statement completely and separately
-                         * to router.
-                         */
-                        rc = route_by_statement(session, &read_buffer);
-
-                        if (read_buffer != NULL)
-                        {
-                            /** add incomplete mysql packet to read queue */
-                            dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, read_buffer);
-                            read_buffer = NULL;
-                        }
-                    }
-                    else if (NULL != session->router_session || cap & RCAP_TYPE_NO_RSESSION)
-                    {
-                        /** Feed whole packet to router */
-                        rc = SESSION_ROUTE_QUERY(session, read_buffer);
-                        read_buffer = NULL;
-                    }
-                    else
-                    {
-                        rc = 0;
-                    }
-
-                    /** Routing succeed */
-                    if (rc)
-                    {
-                        rc = 0; /**< here '0' means success */
-                    }
-                    else
-                    {
-                        bool succp;
-                        GWBUF* errbuf;
-                        /**
-                         * Create error to be sent to client if session
-                         * can't be continued.
-                         */
-                        errbuf = mysql_create_custom_error(1,
-                                                           0,
-                                                           "Routing failed. Session is closed.");
-                        /**
-                         * Ensure that there are enough backends
-                         * available.
-                         */
-                        router->handleError(router_instance,
-                                            session->router_session,
-                                            errbuf,
-                                            dcb,
-                                            ERRACT_NEW_CONNECTION,
-                                            &succp);
-                        gwbuf_free(errbuf);
-                        /**
-                         * If there are not enough backends close
-                         * session
-                         */
-                        if (!succp)
-                        {
-                            MXS_ERROR("Routing the query failed. "
-                                      "Session will be closed.");
-
-                        }
-                        gwbuf_free(read_buffer);
-                        read_buffer = NULL;
-                    }
                 }
             }
+            else if (NULL != session->router_session || cap & RCAP_TYPE_NO_RSESSION)
+            {
+                /** Feed whole packet to router */
+                trace_event(TRC_ROUTE_QUERY, (uintptr_t)session,
+                            gwbuf_length(read_buffer));
+                rc = SESSION_ROUTE_QUERY(session, read_buffer);
+                read_buffer = NULL;
+            }
+            else
+            {
+                rc = 0;
+            }
+
+            /** Routing succeed */
+            if (rc)
+            {
+                rc = 0; /**< here '0' means success */
+            }
             else
             {
-                MXS_INFO("Session received a query in state %s",
-                         STRSESSIONSTATE(ses_state));
-                while ((read_buffer = GWBUF_CONSUME_ALL(read_buffer)) != NULL)
+                bool succp;
+                GWBUF* errbuf;
+                /**
+                 * Create error to be sent to client if session
+                 * can't be continued.
+                 */
+                errbuf = mysql_create_custom_error(1,
+                                                   0,
+                                                   "Routing failed. Session is closed.");
+                /**
+                 * Ensure that there are enough backends
+                 * available.
+                 */
+                router->handleError(router_instance,
+                                    session->router_session,
+                                    errbuf,
+                                    dcb,
+                                    ERRACT_NEW_CONNECTION,
+                                    &succp);
+                gwbuf_free(errbuf);
+                /**
+                 * If there are not enough backends close
+                 * session
+                 */
+                if (!succp)
                 {
-                    ;
+                    MXS_ERROR("Routing the query failed. "
+                              "Session will be closed.");
+
                 }
-                goto return_rc;
+                gwbuf_free(read_buffer);
+                read_buffer = NULL;
             }
-            goto return_rc;
-        } /*  MYSQL_IDLE */
-        break;
+        }
+    }
+    else
+    {
+        MXS_INFO("Session received a query in state %s",
+                 STRSESSIONSTATE(ses_state));
+        while ((read_buffer = GWBUF_CONSUME_ALL(read_buffer)) != NULL)
+        {
+            ;
+        }
+    }
+    return rc;
+}
 
-    default:
-        break;
+/**
+ * @brief Client read event for an established session, triggered by EPOLLIN
+ *
+ * Installed in place of gw_read_client_event once authentication has
+ * completed. The handshake states can never recur on the connection, so
+ * this, the hottest function on a loaded system, carries no checks for
+ * them and no SSL negotiation read limit.
+ *
+ * @param dcb   Descriptor control block
+ * @return 0 if succeed, 1 otherwise
+ */
+static int gw_read_client_event_established(DCB* dcb)
+{
+    MySQLProtocol *protocol = NULL;
+    GWBUF *read_buffer = NULL;
+    int rc = 0;
+    int nbytes_read = 0;
+
+    CHK_DCB(dcb);
+    protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
+    CHK_PROTOCOL(protocol);
+
+    rc = dcb_read(dcb, &read_buffer, 0);
+    if (rc < 0)
+    {
+        dcb_close(dcb);
+    }
+    if (0 == (nbytes_read = gwbuf_length(read_buffer)))
+    {
+        return rc;
     }
-    rc = 0;
 
-return_rc:
+    rc = gw_process_established(dcb, protocol, read_buffer, nbytes_read, rc);
+
 #if defined(SS_DEBUG)
     if (dcb->state == DCB_STATE_POLLING ||
         dcb->state == DCB_STATE_NOPOLLING ||
@@ -1001,6 +1112,18 @@ int gw_MySQLListener(DCB *listen_dcb, char *config_bind)
                       errno,
                       strerror_r(errno, errbuf, sizeof(errbuf)));
         }
+#ifdef SO_REUSEPORT
+        /* Allow further sockets to be bound to the same address so the
+         * listener can be sharded across the polling threads. Must be
+         * set before bind on every socket sharing the port. */
+        if (poll_listener_shards() > 1 &&
+            setsockopt(l_so, SOL_SOCKET, SO_REUSEPORT, (char *) &one, sizeof(one)) != 0)
+        {
+            MXS_ERROR("Failed to set SO_REUSEPORT. Error %d: %s",
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+#endif
     }
     // set NONBLOCKING mode
     if (setnonblocking(l_so) != 0)
@@ -1116,10 +1239,7 @@ int gw_MySQLAccept(DCB *listener)
     int c_sock;
     struct sockaddr client_conn;
     socklen_t client_len = sizeof(struct sockaddr_storage);
-    int sendbuf = GW_BACKEND_SO_SNDBUF;
-    socklen_t optlen = sizeof(sendbuf);
     int eno = 0;
-    int syseno = 0;
     int i = 0;
 
     CHK_DCB(listener);
@@ -1139,10 +1259,10 @@ int gw_MySQLAccept(DCB *listener)
         {
             fail_accept_errno = 0;
 #endif /* FAKE_CODE */
-            // new connection from client
-            c_sock = accept(listener->fd,
-                            (struct sockaddr *) &client_conn,
-                            &client_len);
+            // new connection from client, accepted non-blocking
+            c_sock = gw_accept_nonblocking(listener->fd,
+                                           (struct sockaddr *) &client_conn,
+                                           &client_len);
             eno = errno;
             errno = 0;
 #if defined(FAKE_CODE)
@@ -1223,24 +1343,8 @@ int gw_MySQLAccept(DCB *listener)
 #if defined(FAKE_CODE)
         conn_open[c_sock] = true;
 #endif /* FAKE_CODE */
-        /* set nonblocking  */
-        sendbuf = GW_CLIENT_SO_SNDBUF;
-        char errbuf[STRERROR_BUFLEN];
-
-        if ((syseno = setsockopt(c_sock, SOL_SOCKET, SO_SNDBUF, &sendbuf, optlen)) != 0)
-        {
-            MXS_ERROR("Failed to set socket options. Error %d: %s",
-                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-        }
-
-        sendbuf = GW_CLIENT_SO_RCVBUF;
-
-        if ((syseno = setsockopt(c_sock, SOL_SOCKET, SO_RCVBUF, &sendbuf, optlen)) != 0)
-        {
-            MXS_ERROR("Failed to set socket options. Error %d: %s",
-                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-        }
-        setnonblocking(c_sock);
+        /* the socket was accepted non-blocking; apply the client options */
+        gw_apply_socket_options(c_sock, &gw_client_sockopts);
 
         client_dcb = dcb_alloc(DCB_ROLE_REQUEST_HANDLER);
 
@@ -1522,7 +1626,19 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
              * sure it is set to each (MySQL) packet.
              */
             gwbuf_set_type(packetbuf, GWBUF_TYPE_SINGLE_STMT);
+            /**
+             * The packet extraction above always delivers a single
+             * link; validate that once here and tag the packet so
+             * that routers and filters read the tag instead of
+             * checking the chain again.
+             */
+            if (packetbuf->next == NULL)
+            {
+                gwbuf_set_type(packetbuf, GWBUF_TYPE_CONTIGUOUS);
+            }
             /** Route query */
+            trace_event(TRC_ROUTE_QUERY, (uintptr_t)session,
+                        gwbuf_length(packetbuf));
             rc = SESSION_ROUTE_QUERY(session, packetbuf);
         }
         else
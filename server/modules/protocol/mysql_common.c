@@ -43,12 +43,21 @@
  * 10/11/2014   Massimiliano Pinto      Charset at connect is passed to backend during authentication
  * 07/07/2015   Martin Brampton         Fix problem recognising null password
  * 07/02/2016   Martin Brampton         Remove authentication functions to mysql_auth.c
+ * 28/06/2016   Mark Riddoch            Zero-copy fast path in gw_MySQL_get_next_packet
+ * 03/07/2016   Mark Riddoch            Batch boundary scan in gw_MySQL_get_packets
+ * 03/07/2016   Mark Riddoch            User lookup through the wildcard host
+ *                                      index instead of the probe cascade
+ * 03/07/2016   Mark Riddoch            Create backend sockets non-blocking and apply
+ *                                      the socket option template in one call
+ * 05/07/2016   Mark Riddoch            Dead hex conversion of the double SHA1
+ *                                      removed from the scramble computations
  *
  */
 
 #include <gw.h>
 #include <utils.h>
 #include "mysql_client_server_protocol.h"
+#include <modutil.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -82,7 +91,7 @@ MySQLProtocol* mysql_protocol_init(DCB* dcb, int fd)
 {
     MySQLProtocol* p;
 
-    p = (MySQLProtocol *) calloc(1, sizeof(MySQLProtocol));
+    p = (MySQLProtocol *) protocol_object_alloc(sizeof(MySQLProtocol));
     ss_dassert(p != NULL);
 
     if (p == NULL)
@@ -539,7 +548,6 @@ int gw_send_authentication_to_backend(char *dbname,
     uint8_t client_capabilities[4];
     uint32_t server_capabilities = 0;
     uint32_t final_capabilities  = 0;
-    char dbpass[MYSQL_USER_MAXLEN + 1]="";
     GWBUF *buffer;
     DCB *dcb;
 
@@ -596,9 +604,6 @@ int gw_send_authentication_to_backend(char *dbname,
         // hash2 is the SHA1(input data), where input_data = SHA1(real_password)
         gw_sha1_str(hash1, GW_MYSQL_SCRAMBLE_SIZE, hash2);
 
-        // dbpass is the HEX form of SHA1(SHA1(real_password))
-        gw_bin2hex(dbpass, hash2, GW_MYSQL_SCRAMBLE_SIZE);
-
         // new_sha is the SHA1(CONCAT(scramble, hash2)
         gw_sha1_2_str(conn->scramble, GW_MYSQL_SCRAMBLE_SIZE, hash2, GW_MYSQL_SCRAMBLE_SIZE, new_sha);
 
@@ -756,11 +761,15 @@ int gw_do_connect_to_backend(char *host, int port, int *fd)
     struct sockaddr_in serv_addr;
     int rv;
     int so = 0;
-    int bufsize;
 
     memset(&serv_addr, 0, sizeof serv_addr);
     serv_addr.sin_family = AF_INET;
+#if defined(SOCK_NONBLOCK)
+    /* Create the socket non-blocking and save the fcntl pair */
+    so = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+#else
     so = socket(AF_INET,SOCK_STREAM,0);
+#endif
 
     if (so < 0)
     {
@@ -778,57 +787,19 @@ int gw_do_connect_to_backend(char *host, int port, int *fd)
     /* prepare for connect */
     setipaddress(&serv_addr.sin_addr, host);
     serv_addr.sin_port = htons(port);
-    bufsize = GW_BACKEND_SO_SNDBUF;
-
-    if (setsockopt(so, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) != 0)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to set socket options "
-                  "%s:%d failed.\n\t\t             Socket configuration failed "
-                  "due %d, %s.",
-                  host,
-                  port,
-                  errno,
-                  strerror_r(errno, errbuf, sizeof(errbuf)));
-        rv = -1;
-        /** Close socket */
-        goto close_so;
-    }
-    bufsize = GW_BACKEND_SO_RCVBUF;
 
-    if (setsockopt(so, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) != 0)
+    /* Apply the backend socket option template in one call */
+    if (gw_apply_socket_options(so, &gw_backend_sockopts) != 0)
     {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to set socket options "
-                  "%s:%d failed.\n\t\t             Socket configuration failed "
-                  "due %d, %s.",
-                  host,
-                  port,
-                  errno,
-                  strerror_r(errno, errbuf, sizeof(errbuf)));
-        rv = -1;
-        /** Close socket */
-        goto close_so;
-    }
-
-    int one = 1;
-    if (setsockopt(so, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0)
-    {
-        char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to set socket options "
-                  "%s:%d failed.\n\t\t             Socket configuration failed "
-                  "due %d, %s.",
-                  host,
-                  port,
-                  errno,
-                  strerror_r(errno, errbuf, sizeof(errbuf)));
         rv = -1;
         /** Close socket */
         goto close_so;
     }
 
+#if !defined(SOCK_NONBLOCK)
     /* set socket to as non-blocking here */
     setnonblocking(so);
+#endif
     rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
 
     if (rv != 0)
@@ -1099,7 +1070,6 @@ GWBUF* gw_create_change_user_packet(MYSQL_session*  mses,
     uint8_t client_scramble[GW_MYSQL_SCRAMBLE_SIZE];
     uint32_t server_capabilities = 0;
     uint32_t final_capabilities  = 0;
-    char dbpass[MYSQL_USER_MAXLEN + 1]="";
     char* curr_db = NULL;
     uint8_t* curr_passwd = NULL;
     unsigned int charset;
@@ -1148,9 +1118,6 @@ GWBUF* gw_create_change_user_packet(MYSQL_session*  mses,
          */
         gw_sha1_str(hash1, GW_MYSQL_SCRAMBLE_SIZE, hash2);
 
-        /** dbpass is the HEX form of SHA1(SHA1(real_password)) */
-        gw_bin2hex(dbpass, hash2, GW_MYSQL_SCRAMBLE_SIZE);
-
         /** new_sha is the SHA1(CONCAT(scramble, hash2) */
         gw_sha1_2_str(protocol->scramble,
                       GW_MYSQL_SCRAMBLE_SIZE,
@@ -1345,95 +1312,33 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
 
     if (!user_password)
     {
-        /* The user is not authenticated @ current IPv4 */
-
-        while (1)
+        /*
+         * The user is not authenticated @ current IPv4. Check the
+         * wildcard host index of the user unless the client is localhost
+         * and matching it against wildcard hosts is disabled.
+         */
+        if (!((key.ipv4.sin_addr.s_addr == 0x0100007F) &&
+              !dcb->service->localhost_match_wildcard_host))
         {
-            /*
-             * (1) Check for localhost first: 127.0.0.1 (IPv4 only)
-             */
-
-            if ((key.ipv4.sin_addr.s_addr == 0x0100007F) &&
-                !dcb->service->localhost_match_wildcard_host)
-            {
-                /* Skip the wildcard check and return 1 */
-                break;
-            }
-
-            /*
-             * (2) check for possible IPv4 class C,B,A networks
-             */
-
-            /* Class C check */
-            key.ipv4.sin_addr.s_addr &= 0x00FFFFFF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /* Class B check */
-            key.ipv4.sin_addr.s_addr &= 0x0000FFFF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /* Class A check */
-            key.ipv4.sin_addr.s_addr &= 0x000000FF;
-            key.netmask -= 8;
-
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            /*
-             * (3) Continue check for wildcard host, user@%
-             */
-
-            memset(&key.ipv4, 0, sizeof(struct sockaddr_in));
-            key.netmask = 0;
-
-            MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s] with "
-                      "wildcard host [%%]",
+            MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s] against "
+                      "the wildcard host entries",
                       pthread_self(),
                       key.user,
                       dcb->remote);
 
-            user_password = mysql_users_fetch(service->users, &key);
-
-            if (user_password)
-            {
-                break;
-            }
-
-            if (!user_password)
-            {
-                /*
-                 * user@% not found.
-                 */
-
-                MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
-                          pthread_self(),
-                          key.user,
-                          dcb->remote);
+            user_password = mysql_users_fetch_wildcard(service->users, &key);
+        }
 
-                MXS_INFO("Authentication Failed: user [%s@%s] not found.",
-                         key.user,
-                         dcb->remote);
-                break;
-            }
+        if (!user_password)
+        {
+            MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
+                      pthread_self(),
+                      key.user,
+                      dcb->remote);
 
+            MXS_INFO("Authentication Failed: user [%s@%s] not found.",
+                     key.user,
+                     dcb->remote);
         }
     }
 
@@ -1556,6 +1461,10 @@ int mysql_send_auth_error(DCB        *dcb,
  * Buffer contains at least one of the following:
  * complete [complete] [partial] mysql packet
  *
+ * If the first buffer of the chain contains exactly one complete packet
+ * that buffer is detached and returned without copying; otherwise the
+ * packet is assembled into a freshly allocated buffer.
+ *
  * @param p_readbuf     Address of read buffer pointer
  *
  * @return pointer to gwbuf containing a complete packet or
@@ -1597,6 +1506,20 @@ GWBUF* gw_MySQL_get_next_packet(GWBUF** p_readbuf)
         goto return_packetbuf;
     }
 
+    /**
+     * Fast path; the first buffer of the chain contains exactly one
+     * complete packet. This is overwhelmingly the common case, a query
+     * arriving one per read, so detach the buffer from the chain and
+     * return it as it is rather than allocating a new buffer and
+     * copying the packet into it. Reads that deliver several packets
+     * at once fall through to the copying path below.
+     */
+    if (packetlen == GWBUF_LENGTH(readbuf))
+    {
+        packetbuf = gwbuf_detach_head(readbuf, p_readbuf);
+        goto return_packetbuf;
+    }
+
     packetbuf = gwbuf_alloc(packetlen);
     target = GWBUF_DATA(packetbuf);
     packetbuf->gwbuf_type = readbuf->gwbuf_type; /*< Copy the type too */
@@ -1625,6 +1548,12 @@ return_packetbuf:
 
 /**
  * Move <npackets> from buffer pointed to by <*p_readbuf>.
+ *
+ * When the source is a single buffer the packet boundaries are scanned
+ * once with modutil_packet_offsets and the packets are split off as
+ * copy-on-write clones of the source, instead of each packet being
+ * assembled with its own walk of the buffer chain. Packets that span
+ * buffers of a chain fall back to gw_MySQL_get_next_packet.
  */
 GWBUF* gw_MySQL_get_packets(GWBUF** p_srcbuf,
                             int*    npackets)
@@ -1632,6 +1561,34 @@ GWBUF* gw_MySQL_get_packets(GWBUF** p_srcbuf,
     GWBUF* packetbuf;
     GWBUF* targetbuf = NULL;
 
+    if (*p_srcbuf != NULL && (*p_srcbuf)->next == NULL && *npackets > 0)
+    {
+        uint32_t offsets[128];
+        uint32_t used, next;
+        int      n, i;
+
+        n = modutil_packet_offsets(GWBUF_DATA(*p_srcbuf),
+                                   GWBUF_LENGTH(*p_srcbuf),
+                                   offsets,
+                                   MIN(*npackets, 128),
+                                   &used);
+        for (i = 0; i < n; i++)
+        {
+            next = (i + 1 < n) ? offsets[i + 1] : used;
+            if ((packetbuf = gwbuf_clone_portion(*p_srcbuf, offsets[i],
+                                                 next - offsets[i])) == NULL)
+            {
+                break;
+            }
+            targetbuf = gwbuf_append(targetbuf, packetbuf);
+            *npackets -= 1;
+        }
+        if (i > 0)
+        {
+            *p_srcbuf = gwbuf_consume(*p_srcbuf, (i == n) ? used : offsets[i]);
+        }
+    }
+
     while (*npackets > 0 && (packetbuf = gw_MySQL_get_next_packet(p_srcbuf)) != NULL)
     {
         targetbuf = gwbuf_append(targetbuf, packetbuf);
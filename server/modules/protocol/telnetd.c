@@ -65,6 +65,8 @@ MODULE_INFO info =
  * 17/06/2013   Mark Riddoch            Initial version
  * 17/07/2013   Mark Riddoch            Addition of login phase
  * 07/07/2015   Martin Brampton         Call unified dcb_close on error
+ * 04/07/2016   Mark Riddoch            Input gathered through the shared
+ *                                      buffered line reader
  *
  * @endverbatim
  */
@@ -143,6 +145,7 @@ static int telnetd_read_event(DCB* dcb)
 {
     int n;
     GWBUF *head = NULL;
+    GWBUF *line;
     SESSION *session = dcb->session;
     TELNETD *telnetd = (TELNETD *)dcb->protocol;
     char *password, *t;
@@ -152,7 +155,6 @@ static int telnetd_read_event(DCB* dcb)
         if (head)
         {
             unsigned char *ptr = GWBUF_DATA(head);
-            ptr = GWBUF_DATA(head);
             while (GWBUF_LENGTH(head) && *ptr == TELNET_IAC)
             {
                 telnetd_command(dcb, ptr + 1);
@@ -160,29 +162,45 @@ static int telnetd_read_event(DCB* dcb)
                 ptr = GWBUF_DATA(head);
             }
             if (GWBUF_LENGTH(head))
+            {
+                lineread_append(&telnetd->line, head);
+            }
+            else
+            {
+                // Force the free of the buffer header
+                gwbuf_consume(head, 0);
+            }
+
+            /*
+             * Process each complete line that has been received. A
+             * partial line, e.g. a user typing a character at a time,
+             * stays in the reader until the rest of it arrives.
+             */
+            while ((line = lineread_get(&telnetd->line)) != NULL)
             {
                 switch (telnetd->state)
                 {
                 case TELNETD_STATE_LOGIN:
-                    telnetd->username = strndup(GWBUF_DATA(head), GWBUF_LENGTH(head));
+                    telnetd->username = strndup(GWBUF_DATA(line), GWBUF_LENGTH(line));
                     /* Strip the cr/lf from the username */
-                    t = strstr(telnetd->username, "\r\n");
-                    if (t)
+                    t = telnetd->username + strlen(telnetd->username);
+                    while (t > telnetd->username &&
+                           (t[-1] == '\n' || t[-1] == '\r'))
                     {
-                        *t = 0;
+                        *--t = 0;
                     }
                     telnetd->state = TELNETD_STATE_PASSWD;
                     dcb_printf(dcb, "Password: ");
                     telnetd_echo(dcb, 0);
-                    gwbuf_consume(head, GWBUF_LENGTH(head));
+                    gwbuf_free(line);
                     break;
                 case TELNETD_STATE_PASSWD:
-                    password = strndup(GWBUF_DATA(head), GWBUF_LENGTH(head));
-                    /* Strip the cr/lf from the username */
-                    t = strstr(password, "\r\n");
-                    if (t)
+                    password = strndup(GWBUF_DATA(line), GWBUF_LENGTH(line));
+                    /* Strip the cr/lf from the password */
+                    t = password + strlen(password);
+                    while (t > password && (t[-1] == '\n' || t[-1] == '\r'))
                     {
-                        *t = 0;
+                        *--t = 0;
                     }
                     if (admin_verify(telnetd->username, password))
                     {
@@ -197,19 +215,14 @@ static int telnetd_read_event(DCB* dcb)
                         telnetd->state = TELNETD_STATE_LOGIN;
                         free(telnetd->username);
                     }
-                    gwbuf_consume(head, GWBUF_LENGTH(head));
+                    gwbuf_free(line);
                     free(password);
                     break;
                 case TELNETD_STATE_DATA:
-                    SESSION_ROUTE_QUERY(session, head);
+                    SESSION_ROUTE_QUERY(session, line);
                     break;
                 }
             }
-            else
-            {
-                // Force the free of the buffer header
-                gwbuf_consume(head, 0);
-            }
         }
     }
     return n;
@@ -308,7 +321,7 @@ static int telnetd_accept(DCB *dcb)
                 dcb_close(client_dcb);
                 return n_connect;
             }
-            telnetd_pr = (TELNETD *)malloc(sizeof(TELNETD));
+            telnetd_pr = (TELNETD *)protocol_object_alloc(sizeof(TELNETD));
             client_dcb->protocol = (void *)telnetd_pr;
 
             if (telnetd_pr == NULL)
@@ -325,6 +338,7 @@ static int telnetd_accept(DCB *dcb)
             n_connect++;
             telnetd_pr->state = TELNETD_STATE_LOGIN;
             telnetd_pr->username = NULL;
+            telnetd_pr->line.pending = NULL;
             dcb_printf(client_dcb, "MaxScale login: ");
         }
     }
@@ -342,9 +356,13 @@ static int telnetd_close(DCB *dcb)
 {
     TELNETD *telnetd = dcb->protocol;
 
-    if (telnetd && telnetd->username)
+    if (telnetd)
     {
-        free(telnetd->username);
+        if (telnetd->username)
+        {
+            free(telnetd->username);
+        }
+        lineread_free(&telnetd->line);
     }
 
     return 0;
@@ -385,6 +403,13 @@ static int telnetd_listen(DCB *listener, char *config)
                   errno, strerror_r(errno, errbuf, sizeof(errbuf)));
         return 0;
     }
+#ifdef SO_REUSEPORT
+    // allow the core to shard the listener across the polling threads
+    if (poll_listener_shards() > 1)
+    {
+        setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, (char *)&one, sizeof(one));
+    }
+#endif
     // set NONBLOCKING mode
     setnonblocking(listener->fd);
     // bind address and port
@@ -50,11 +50,21 @@
  * 30/09/2015   Massimiliano Pinto  Addition of send_slave_heartbeat option
  * 23/10/2015   Markus Makela       Added current_safe_event
  * 27/10/2015   Martin Brampton     Amend getCapabilities to return RCAP_TYPE_NO_RSESSION
+ * 28/06/2016   Mark Riddoch        Added the eventcache option and the in-memory
+ *                                  binlog event cache
+ * 03/07/2016   Mark Riddoch        Added the compress_binlogs option
+ * 03/07/2016   Mark Riddoch        Added the change data capture output stage
+ * 03/07/2016   Mark Riddoch        Added the encrypt_binlogs option
+ * 03/07/2016   Mark Riddoch        Added the archivedir and archive_files
+ *                                  options for tiered binlog storage
+ * 05/07/2016   Mark Riddoch        Added the GTID index for GTID slave
+ *                                  registration
  *
  * @endverbatim
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
@@ -245,8 +255,10 @@ createInstance(SERVICE *service, char **options)
     inst->files = NULL;
     spinlock_init(&inst->fileslock);
     spinlock_init(&inst->binlog_lock);
+    spinlock_init(&inst->gtid_index.lock);
 
     inst->binlog_fd = -1;
+    inst->index_fd = -1;
     inst->master_chksum = true;
     inst->master_uuid = NULL;
 
@@ -260,8 +272,18 @@ createInstance(SERVICE *service, char **options)
     inst->short_burst = DEF_SHORT_BURST;
     inst->long_burst = DEF_LONG_BURST;
     inst->burst_size = DEF_BURST_SIZE;
+    inst->sync_events = DEF_SYNC_EVENTS;
+    inst->sync_interval = DEF_SYNC_INTERVAL;
+    inst->pending_events = 0;
+    inst->last_sync = 0;
     inst->retry_backoff = 1;
     inst->binlogdir = NULL;
+    inst->event_cache_size = 0;
+    inst->compress_binlogs = false;
+    inst->archivedir = NULL;
+    inst->archive_files = DEF_ARCHIVE_FILES;
+    inst->encrypt_binlogs = 0;
+    inst->encryption_key_len = 0;
     inst->heartbeat = BLR_HEARTBEAT_DEFAULT_INTERVAL;
     inst->mariadb10_compat = false;
 
@@ -416,6 +438,22 @@ createInstance(SERVICE *service, char **options)
                 {
                     inst->trx_safe = config_truth_value(value);
                 }
+                else if (strcmp(options[i], "compress_binlogs") == 0)
+                {
+                    inst->compress_binlogs = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "encrypt_binlogs") == 0)
+                {
+                    inst->encrypt_binlogs = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "encryption_key_file") == 0)
+                {
+                    if (blr_file_load_encryption_key(inst, value) != 0)
+                    {
+                        free_instance(inst);
+                        return NULL;
+                    }
+                }
                 else if (strcmp(options[i], "lowwater") == 0)
                 {
                     inst->low_water = atoi(value);
@@ -458,6 +496,31 @@ createInstance(SERVICE *service, char **options)
                     inst->burst_size = size;
 
                 }
+                else if (strcmp(options[i], "eventcache") == 0)
+                {
+                    uint64_t size = atoi(value);
+                    char    *ptr = value;
+                    while (*ptr && isdigit(*ptr))
+                    {
+                        ptr++;
+                    }
+                    switch (*ptr)
+                    {
+                    case 'G':
+                    case 'g':
+                        size = size * 1024 * 1024 * 1024;
+                        break;
+                    case 'M':
+                    case 'm':
+                        size = size * 1024 * 1024;
+                        break;
+                    case 'K':
+                    case 'k':
+                        size = size * 1024;
+                        break;
+                    }
+                    inst->event_cache_size = size;
+                }
                 else if (strcmp(options[i], "heartbeat") == 0)
                 {
                     int h_val = (int)strtol(value, NULL, 10);
@@ -477,10 +540,59 @@ createInstance(SERVICE *service, char **options)
                 {
                     inst->send_slave_heartbeat = config_truth_value(value);
                 }
+                else if (strcmp(options[i], "sync_events") == 0)
+                {
+                    int n_events = atoi(value);
+
+                    if (n_events <= 0)
+                    {
+                        MXS_WARNING("Invalid sync_events value %s."
+                                    " Setting it to default value %d.",
+                                    value, DEF_SYNC_EVENTS);
+                    }
+                    else
+                    {
+                        inst->sync_events = n_events;
+                    }
+                }
+                else if (strcmp(options[i], "sync_interval") == 0)
+                {
+                    int interval = atoi(value);
+
+                    if (interval <= 0)
+                    {
+                        MXS_WARNING("Invalid sync_interval value %s."
+                                    " Setting it to default value %d ms.",
+                                    value, DEF_SYNC_INTERVAL);
+                    }
+                    else
+                    {
+                        inst->sync_interval = interval;
+                    }
+                }
                 else if (strcmp(options[i], "binlogdir") == 0)
                 {
                     inst->binlogdir = strdup(value);
                 }
+                else if (strcmp(options[i], "archivedir") == 0)
+                {
+                    inst->archivedir = strdup(value);
+                }
+                else if (strcmp(options[i], "archive_files") == 0)
+                {
+                    int n_files = atoi(value);
+
+                    if (n_files <= 0)
+                    {
+                        MXS_WARNING("Invalid archive_files value %s."
+                                    " Setting it to default value %d.",
+                                    value, DEF_ARCHIVE_FILES);
+                    }
+                    else
+                    {
+                        inst->archive_files = n_files;
+                    }
+                }
                 else
                 {
                     MXS_WARNING("Unsupported router "
@@ -534,6 +646,15 @@ createInstance(SERVICE *service, char **options)
         return NULL;
     }
 
+    if (inst->encrypt_binlogs && inst->encryption_key_len == 0)
+    {
+        MXS_ERROR("Service %s, encrypt_binlogs is enabled but no "
+                  "encryption_key_file has been configured.",
+                  service->name);
+        free_instance(inst);
+        return NULL;
+    }
+
     /**
      * If binlogdir is not found create it
      * On failure don't start the instance
@@ -556,6 +677,28 @@ createInstance(SERVICE *service, char **options)
         }
     }
 
+    /**
+     * If an archive directory has been configured create it as well
+     * On failure don't start the instance
+     */
+    if (inst->archivedir != NULL && access(inst->archivedir, R_OK) == -1)
+    {
+        int mkdir_rval;
+        mkdir_rval = mkdir(inst->archivedir, 0700);
+        if (mkdir_rval == -1)
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("Service %s, Failed to create binlog archive directory '%s': [%d] %s",
+                      service->name,
+                      inst->archivedir,
+                      errno,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+
+            free_instance(inst);
+            return NULL;
+        }
+    }
+
     /* Allocate dbusers for this router here instead of serviceStartPort() */
     if (service->users == NULL)
     {
@@ -699,6 +842,16 @@ createInstance(SERVICE *service, char **options)
     snprintf(task_name, BLRM_TASK_NAME_LEN, "%s stats", service->name);
     hktask_add(task_name, stats_func, inst, BLR_STATS_FREQ);
 
+    /*
+     * When group commit is in use, add a task that issues the covering
+     * sync for events left waiting when the master goes quiet.
+     */
+    if (inst->sync_events > 1)
+    {
+        snprintf(task_name, BLRM_TASK_NAME_LEN, "%s sync", service->name);
+        hktask_add(task_name, blr_file_sync_task, inst, 1);
+    }
+
     /* Log whether the transaction safety option value is on*/
     if (inst->trx_safe)
     {
@@ -751,6 +904,8 @@ free_instance(ROUTER_INSTANCE *instance)
     free(instance->set_master_hostname);
     free(instance->fileroot);
     free(instance->binlogdir);
+    free(instance->archivedir);
+    blr_free_cache(instance);
     free(instance);
 }
 
@@ -888,6 +1043,10 @@ static void freeSession(ROUTER* router_instance,
     {
         free(slave->passwd);
     }
+    if (slave->mariadb_gtid)
+    {
+        free(slave->mariadb_gtid);
+    }
     free(slave);
 }
 
@@ -953,12 +1112,26 @@ closeSession(ROUTER *instance, void *router_session)
                        slave->stats.n_queries);
         }
 
+        /*
+         * If this was a CDC consumer decrement the consumer count so
+         * that the distribution fast path can skip the encode stage
+         * once the last consumer has gone.
+         */
+        if (slave->state == BLRS_CDC)
+        {
+            atomic_add(&router->cdc_consumers, -1);
+        }
+
         /*
          * Mark the slave as unregistered to prevent the forwarding
          * of any more binlog records to this slave.
          */
         slave->state = BLRS_UNREGISTERED;
 
+        spinlock_acquire(&slave->catch_lock);
+        blr_slave_clear_uptodate(router, slave);
+        spinlock_release(&slave->catch_lock);
+
 #ifdef BLFILE_IN_SLAVE
         // TODO: Is it really certain the file can be closed here? If other
         // TODO: threads are using the slave instance, bag things will happen. [JWi].
@@ -1019,6 +1192,277 @@ static char *event_names_mariadb10[] =
     "GTID List Event"
 };
 
+/**
+ * The change data capture output stage.
+ *
+ * Alongside the normal binlog dump service the router can serve a stream
+ * of change records to CDC consumers. A consumer registers with the text
+ * command "REGISTER CDC" and from then on receives every binlog event the
+ * router reads from the master as a length prefixed JSON frame; a 4 byte
+ * little-endian length is followed by a JSON document with the decoded
+ * event header and, for the event types that carry them, the statement
+ * text, transaction ID or row images. The event is decoded and encoded
+ * exactly once per event and the resulting frame is cloned to every
+ * registered consumer, so the decode cost is amortised across the whole
+ * consumer population.
+ *
+ * The stream is live only; a consumer joining the stream receives events
+ * from the point of registration onwards and no catchup from the binlog
+ * files is performed.
+ */
+
+/** Maximum size of an encoded CDC frame, larger content is truncated */
+#define BLR_CDC_FRAME_MAX   16384
+
+/**
+ * Append formatted text to the JSON document being built for a CDC frame.
+ * The document is silently truncated if it would exceed BLR_CDC_FRAME_MAX.
+ *
+ * @param json  The document buffer, BLR_CDC_FRAME_MAX bytes long
+ * @param len   The current length of the document
+ * @param fmt   The printf format string to append
+ * @return The new length of the document
+ */
+static int
+blr_cdc_append(char *json, int len, const char *fmt, ...)
+{
+    va_list args;
+
+    if (len >= BLR_CDC_FRAME_MAX - 1)
+    {
+        return BLR_CDC_FRAME_MAX - 1;
+    }
+    va_start(args, fmt);
+    len += vsnprintf(json + len, BLR_CDC_FRAME_MAX - len, fmt, args);
+    va_end(args);
+    if (len >= BLR_CDC_FRAME_MAX)
+    {
+        len = BLR_CDC_FRAME_MAX - 1;
+    }
+    return len;
+}
+
+/**
+ * Copy a byte string into a buffer as a JSON string value, escaping the
+ * double quote and backslash characters and replacing control characters
+ * with spaces. The result is always null terminated.
+ *
+ * @param dest  The destination buffer
+ * @param space The size of the destination buffer
+ * @param src   The bytes to escape
+ * @param len   The number of bytes to escape
+ */
+static void
+blr_cdc_escape(char *dest, int space, uint8_t *src, int len)
+{
+    int i, j = 0;
+
+    for (i = 0; i < len && j < space - 2; i++)
+    {
+        if (src[i] == '"' || src[i] == '\\')
+        {
+            dest[j++] = '\\';
+            dest[j++] = src[i];
+        }
+        else if (src[i] < 0x20)
+        {
+            dest[j++] = ' ';
+        }
+        else
+        {
+            dest[j++] = src[i];
+        }
+    }
+    dest[j] = 0;
+}
+
+/**
+ * Encode a single binlog event as a length prefixed JSON frame for the
+ * CDC consumers. Every frame carries the decoded replication header;
+ * query, transaction ID, table map, row and rotate events additionally
+ * carry the payload fields a consumer needs to interpret the change.
+ * Row images are included as hexadecimal strings since the router has no
+ * knowledge of the table schemas needed for a column level decode.
+ *
+ * @param router    The router instance
+ * @param hdr       The replication event header
+ * @param ptr       The raw event, including the binlog event header
+ * @return An allocated frame ready to send, or NULL on failure
+ */
+static GWBUF *
+blr_cdc_encode_event(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
+{
+    GWBUF *frame;
+    uint8_t *body = ptr + BINLOG_EVENT_HDR_LEN;
+    uint8_t *data;
+    char json[BLR_CDC_FRAME_MAX], escape[BLR_CDC_FRAME_MAX];
+    char *name = "Unknown";
+    int bodylen = hdr->event_size - BINLOG_EVENT_HDR_LEN;
+    int len, space;
+
+    if (router->master_chksum && bodylen >= MYSQL_CHECKSUM_LEN)
+    {
+        bodylen -= MYSQL_CHECKSUM_LEN;
+    }
+
+    if (hdr->event_type <= MAX_EVENT_TYPE)
+    {
+        name = event_names[hdr->event_type];
+    }
+    else if (hdr->event_type >= MARIADB_NEW_EVENTS_BEGIN &&
+             hdr->event_type <= MAX_EVENT_TYPE_MARIADB10)
+    {
+        name = event_names_mariadb10[hdr->event_type - MARIADB_NEW_EVENTS_BEGIN];
+    }
+
+    len = blr_cdc_append(json, 0,
+                         "{\"event\": \"%s\", \"type\": %d, \"timestamp\": %u, "
+                         "\"server_id\": %u, \"position\": %lu, \"next_pos\": %u, "
+                         "\"size\": %u",
+                         name, hdr->event_type, hdr->timestamp, hdr->serverid,
+                         (unsigned long)(hdr->next_pos - hdr->event_size),
+                         hdr->next_pos, hdr->event_size);
+
+    switch (hdr->event_type)
+    {
+    case QUERY_EVENT:
+        if (bodylen > 13)
+        {
+            int dblen = body[8];
+            int statuslen = EXTRACT16(&body[11]);
+            int sqllen = bodylen - (13 + statuslen + dblen + 1);
+
+            if (sqllen >= 0)
+            {
+                blr_cdc_escape(escape, sizeof(escape), &body[13 + statuslen], dblen);
+                len = blr_cdc_append(json, len, ", \"database\": \"%s\"", escape);
+                space = BLR_CDC_FRAME_MAX - len - 16;
+                blr_cdc_escape(escape, space > 1 ? space : 1,
+                               &body[13 + statuslen + dblen + 1], sqllen);
+                len = blr_cdc_append(json, len, ", \"sql\": \"%s\"", escape);
+            }
+        }
+        break;
+    case XID_EVENT:
+        if (bodylen >= 8)
+        {
+            len = blr_cdc_append(json, len, ", \"xid\": %llu",
+                                 (unsigned long long)EXTRACT32(body) |
+                                 ((unsigned long long)EXTRACT32(&body[4]) << 32));
+        }
+        break;
+    case TABLE_MAP_EVENT:
+        if (bodylen > 10)
+        {
+            int dblen = body[8];
+            int tbllen = body[9 + dblen + 1];
+
+            len = blr_cdc_append(json, len, ", \"table_id\": %llu",
+                                 (unsigned long long)EXTRACT32(body) |
+                                 ((unsigned long long)EXTRACT16(&body[4]) << 32));
+            blr_cdc_escape(escape, sizeof(escape), &body[9], dblen);
+            len = blr_cdc_append(json, len, ", \"database\": \"%s\"", escape);
+            blr_cdc_escape(escape, sizeof(escape), &body[9 + dblen + 2], tbllen);
+            len = blr_cdc_append(json, len, ", \"table\": \"%s\"", escape);
+        }
+        break;
+    case WRITE_ROWS_EVENTv0:
+    case UPDATE_ROWS_EVENTv0:
+    case DELETE_ROWS_EVENTv0:
+    case WRITE_ROWS_EVENTv1:
+    case UPDATE_ROWS_EVENTv1:
+    case DELETE_ROWS_EVENTv1:
+    case WRITE_ROWS_EVENTv2:
+    case UPDATE_ROWS_EVENTv2:
+    case DELETE_ROWS_EVENTv2:
+        if (bodylen > 8)
+        {
+            int i;
+
+            len = blr_cdc_append(json, len,
+                                 ", \"table_id\": %llu, \"flags\": %u, \"rows\": \"",
+                                 (unsigned long long)EXTRACT32(body) |
+                                 ((unsigned long long)EXTRACT16(&body[4]) << 32),
+                                 EXTRACT16(&body[6]));
+            for (i = 8; i < bodylen && len < BLR_CDC_FRAME_MAX - 8; i++)
+            {
+                len = blr_cdc_append(json, len, "%02x", body[i]);
+            }
+            len = blr_cdc_append(json, len, "\"");
+        }
+        break;
+    case ROTATE_EVENT:
+        if (bodylen > 8)
+        {
+            blr_cdc_escape(escape, sizeof(escape), &body[8], bodylen - 8);
+            len = blr_cdc_append(json, len,
+                                 ", \"next_file\": \"%s\", \"next_file_pos\": %llu",
+                                 escape,
+                                 (unsigned long long)EXTRACT32(body) |
+                                 ((unsigned long long)EXTRACT32(&body[4]) << 32));
+        }
+        break;
+    default:
+        break;
+    }
+    len = blr_cdc_append(json, len, "}");
+
+    if ((frame = gwbuf_alloc(len + 4)) == NULL)
+    {
+        return NULL;
+    }
+    data = GWBUF_DATA(frame);
+    *data++ = len & 0xff;
+    *data++ = (len >> 8) & 0xff;
+    *data++ = (len >> 16) & 0xff;
+    *data++ = (len >> 24) & 0xff;
+    memcpy(data, json, len);
+    return frame;
+}
+
+/**
+ * Distribute a binlog event to the registered CDC consumers. The event is
+ * encoded once and a clone of the resulting frame is written to each
+ * consumer session. If no consumers are registered the encode stage is
+ * bypassed entirely, so the normal binlog dump path pays no more than a
+ * single integer test for the feature.
+ *
+ * @param router    The router instance
+ * @param hdr       The replication event header
+ * @param ptr       The raw event, including the binlog event header
+ */
+void
+blr_cdc_distribute(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
+{
+    GWBUF *frame, *clone;
+    ROUTER_SLAVE *slave;
+    unsigned int framelen;
+
+    if (router->cdc_consumers == 0)
+    {
+        return;
+    }
+    if ((frame = blr_cdc_encode_event(router, hdr, ptr)) == NULL)
+    {
+        return;
+    }
+    framelen = gwbuf_length(frame);
+    spinlock_acquire(&router->lock);
+    slave = router->slaves;
+    while (slave)
+    {
+        if (slave->state == BLRS_CDC && (clone = gwbuf_clone(frame)) != NULL)
+        {
+            slave->dcb->func.write(slave->dcb, clone);
+            slave->stats.n_events++;
+            slave->stats.n_bytes += framelen;
+        }
+        slave = slave->next;
+    }
+    spinlock_release(&router->lock);
+    gwbuf_free(frame);
+}
+
 /**
  * Display an entry from the spinlock statistics data
  *
@@ -1109,6 +1553,13 @@ diagnostics(ROUTER *router, DCB *dcb)
 
     dcb_printf(dcb, "\tBinlog directory:                            %s\n",
                router_inst->binlogdir);
+    if (router_inst->archivedir)
+    {
+        dcb_printf(dcb, "\tBinlog archive directory:                    %s\n",
+                   router_inst->archivedir);
+        dcb_printf(dcb, "\tBinlog files kept on the fast tier:          %d\n",
+                   router_inst->archive_files);
+    }
     dcb_printf(dcb, "\tHeartbeat period (seconds):                  %lu\n",
                router_inst->heartbeat);
     dcb_printf(dcb, "\tNumber of master connects:                   %d\n",
@@ -1135,6 +1586,16 @@ diagnostics(ROUTER *router, DCB *dcb)
                router_inst->stats.n_binlogs);
     dcb_printf(dcb, "\tNo. of bad CRC received from master:         %u\n",
                router_inst->stats.n_badcrc);
+    if (router_inst->event_cache)
+    {
+        dcb_printf(dcb, "\tEvent cache size:                            %lu MB%s\n",
+                   (unsigned long)(router_inst->event_cache->size / (1024 * 1024)),
+                   router_inst->event_cache->hugepages ? " (huge pages)" : "");
+        dcb_printf(dcb, "\tNo. of events served from the event cache:   %lu\n",
+                   (unsigned long)router_inst->event_cache->hits);
+        dcb_printf(dcb, "\tNo. of events read from the binlog files:    %lu\n",
+                   (unsigned long)router_inst->event_cache->misses);
+    }
     minno = router_inst->stats.minno - 1;
     if (minno == -1)
     {
@@ -1342,6 +1803,9 @@ diagnostics(ROUTER *router, DCB *dcb)
             dcb_printf(dcb,
                        "\t\tNo. bursts sent:                         %u\n",
                        session->stats.n_bursts);
+            dcb_printf(dcb,
+                       "\t\tNo. bursts cut by the time slice:        %u\n",
+                       session->stats.n_sliced);
             dcb_printf(dcb,
                        "\t\tNo. transitions to follow mode:          %u\n",
                        session->stats.n_bursts);
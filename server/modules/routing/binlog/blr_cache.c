@@ -33,6 +33,7 @@
  *
  * Date     Who     Description
  * 07/04/2014   Mark Riddoch        Initial implementation
+ * 28/06/2016   Mark Riddoch        In-memory binlog event cache
  *
  * @endverbatim
  */
@@ -47,20 +48,284 @@
 #include <blr.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <sys/mman.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
+/** The huge page size the cache region is rounded up to */
+#define BLR_CACHE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static void blr_cache_copy_out(BLR_EVENT_CACHE *cache, uint64_t pos,
+                               uint8_t *dst, uint32_t len);
 
 /**
- * Initialise the cache for this instanceof the binlog router. As a side
- * effect also determine the binlog file to read and the position to read
- * from.
+ * Initialise the in-memory binlog event cache for this instance of the
+ * binlog router. The cache is a ring buffer that mirrors the tail of the
+ * binlog file being written, so the common case - slaves lagging by
+ * seconds rather than hours - is served from memory without touching the
+ * binlog file.
+ *
+ * The region is allocated from huge pages when the system can supply
+ * them, eliminating TLB pressure when several slaves stream from the
+ * ring; if the reservation fails the cache falls back to normal pages.
+ * When no cache size has been configured with the eventcache router
+ * option no memory is allocated and the cache remains disabled.
  *
  * @param   router      The router instance
  */
 void
 blr_init_cache(ROUTER_INSTANCE *router)
 {
+    BLR_EVENT_CACHE *cache;
+    uint8_t *base;
+    uint64_t size = router->event_cache_size;
+    int hugepages = 1;
+
+    router->event_cache = NULL;
+
+    if (size == 0)
+    {
+        return;
+    }
+    /** Round the region up to a whole number of huge pages */
+    size = (size + BLR_CACHE_HUGEPAGE_SIZE - 1) & ~((uint64_t)BLR_CACHE_HUGEPAGE_SIZE - 1);
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        MXS_WARNING("%s: Failed to allocate %lu MB of huge pages for the "
+                    "binlog event cache, falling back to normal pages. "
+                    "Raise vm.nr_hugepages to provide the reservation.",
+                    router->service->name,
+                    (unsigned long)(size / (1024 * 1024)));
+        hugepages = 0;
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            MXS_ERROR("%s: Failed to allocate %lu MB for the binlog event "
+                      "cache. The cache is disabled.",
+                      router->service->name,
+                      (unsigned long)(size / (1024 * 1024)));
+            return;
+        }
+#if defined(MADV_HUGEPAGE)
+        /** Ask for transparent huge pages instead */
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    if ((cache = (BLR_EVENT_CACHE *)calloc(1, sizeof(BLR_EVENT_CACHE))) == NULL)
+    {
+        munmap(base, size);
+        return;
+    }
+    cache->base = base;
+    cache->size = size;
+    cache->hugepages = hugepages;
+    spinlock_init(&cache->lock);
+    router->event_cache = cache;
+
+    MXS_NOTICE("%s: Binlog event cache of %lu MB enabled%s.",
+               router->service->name,
+               (unsigned long)(size / (1024 * 1024)),
+               hugepages ? ", backed by huge pages" : "");
+}
+
+/**
+ * Release the event cache of a router instance, if one was allocated.
+ *
+ * @param   router      The router instance
+ */
+void
+blr_free_cache(ROUTER_INSTANCE *router)
+{
+    BLR_EVENT_CACHE *cache = router->event_cache;
+
+    if (cache)
+    {
+        router->event_cache = NULL;
+        munmap(cache->base, cache->size);
+        free(cache);
+    }
+}
+
+/**
+ * Add bytes written to the binlog file to the event cache. The cache
+ * mirrors the byte stream of the binlog file, so the caller need not
+ * respect event boundaries; events larger than 16MB arrive from the
+ * master in several chunks and each chunk is added as it is written.
+ *
+ * If the bytes do not continue the cached window - the binlog file has
+ * changed, or a write was retried at an earlier position - the window is
+ * restarted at the given position.
+ *
+ * @param   router      The router instance
+ * @param   binlog_name Name of the binlog file being written
+ * @param   pos         Position of the bytes in the binlog file
+ * @param   buf         The bytes written
+ * @param   size        Number of bytes written
+ */
+void
+blr_cache_add_data(ROUTER_INSTANCE *router, char *binlog_name, uint64_t pos,
+                   uint8_t *buf, uint32_t size)
+{
+    BLR_EVENT_CACHE *cache = router->event_cache;
+    uint64_t offset;
+    uint32_t first;
+
+    if (cache == NULL || size == 0)
+    {
+        return;
+    }
+    spinlock_acquire(&cache->lock);
+    if (size >= cache->size)
+    {
+        /** A single write larger than the ring; hold nothing and restart
+         * the window after it */
+        strncpy(cache->binlog_name, binlog_name, BINLOG_FNAMELEN);
+        cache->low = pos + size;
+        cache->high = pos + size;
+        spinlock_release(&cache->lock);
+        return;
+    }
+    if (strcmp(cache->binlog_name, binlog_name) != 0 || pos != cache->high)
+    {
+        /** New binlog file or a gap in the stream: restart the window */
+        strncpy(cache->binlog_name, binlog_name, BINLOG_FNAMELEN);
+        cache->low = pos;
+        cache->high = pos;
+    }
+    offset = pos % cache->size;
+    first = cache->size - offset < size ? cache->size - offset : size;
+    memcpy(cache->base + offset, buf, first);
+    if (size > first)
+    {
+        memcpy(cache->base, buf + first, size - first);
+    }
+    cache->high = pos + size;
+    if (cache->high - cache->low > cache->size)
+    {
+        cache->low = cache->high - cache->size;
+    }
+    spinlock_release(&cache->lock);
+}
+
+/**
+ * Invalidate the event cache. Called when the binlog file is truncated
+ * after a failed write, so that the cache cannot hand out bytes that are
+ * no longer part of the file.
+ *
+ * @param   router      The router instance
+ */
+void
+blr_cache_invalidate(ROUTER_INSTANCE *router)
+{
+    BLR_EVENT_CACHE *cache = router->event_cache;
+
+    if (cache)
+    {
+        spinlock_acquire(&cache->lock);
+        cache->low = 0;
+        cache->high = 0;
+        cache->binlog_name[0] = '\0';
+        spinlock_release(&cache->lock);
+    }
+}
+
+/**
+ * Copy bytes out of the ring buffer. The caller must hold the cache lock
+ * and have checked that the range [pos, pos + len) lies within the
+ * cached window.
+ *
+ * @param   cache       The event cache
+ * @param   pos         Binlog position of the first byte wanted
+ * @param   dst         Where to copy the bytes
+ * @param   len         Number of bytes to copy
+ */
+static void
+blr_cache_copy_out(BLR_EVENT_CACHE *cache, uint64_t pos, uint8_t *dst, uint32_t len)
+{
+    uint64_t offset = pos % cache->size;
+    uint32_t first = cache->size - offset < len ? cache->size - offset : len;
+
+    memcpy(dst, cache->base + offset, first);
+    if (len > first)
+    {
+        memcpy(dst + first, cache->base, len - first);
+    }
+}
+
+/**
+ * Read a binlog event from the event cache. On a hit the event is
+ * returned in a freshly allocated buffer and the replication header
+ * fields are filled in, exactly as blr_read_binlog would have done from
+ * the file. On a miss, or if the cached bytes fail the same sanity
+ * checks that the file path applies, NULL is returned and the caller
+ * falls back to reading the file.
+ *
+ * @param   router      The router instance
+ * @param   binlog_name Name of the binlog file the event is wanted from
+ * @param   pos         Position of the event in the binlog file
+ * @param   hdr         Replication header to be filled in
+ * @return  The event buffer, or NULL if the cache cannot serve the event
+ */
+GWBUF *
+blr_cache_read_event(ROUTER_INSTANCE *router, char *binlog_name,
+                     unsigned long pos, REP_HEADER *hdr)
+{
+    BLR_EVENT_CACHE *cache = router->event_cache;
+    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+    GWBUF *result;
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    spinlock_acquire(&cache->lock);
+    if (strcmp(cache->binlog_name, binlog_name) != 0 ||
+        pos < cache->low ||
+        pos + BINLOG_EVENT_HDR_LEN > cache->high)
+    {
+        cache->misses++;
+        spinlock_release(&cache->lock);
+        return NULL;
+    }
+    blr_cache_copy_out(cache, pos, hdbuf, BINLOG_EVENT_HDR_LEN);
+
+    hdr->timestamp = EXTRACT32(hdbuf);
+    hdr->event_type = hdbuf[4];
+    hdr->serverid = EXTRACT32(&hdbuf[5]);
+    hdr->event_size = extract_field(&hdbuf[9], 32);
+    hdr->next_pos = EXTRACT32(&hdbuf[13]);
+    hdr->flags = EXTRACT16(&hdbuf[17]);
+
+    /** Apply the same sanity checks as the file path; on any doubt let
+     * the file path produce the error message */
+    if (hdr->event_size == 0 ||
+        pos + hdr->event_size > cache->high ||
+        (hdr->next_pos != (pos + hdr->event_size) &&
+         hdr->event_type != ROTATE_EVENT))
+    {
+        cache->misses++;
+        spinlock_release(&cache->lock);
+        return NULL;
+    }
+    if ((result = gwbuf_alloc(hdr->event_size)) == NULL)
+    {
+        cache->misses++;
+        spinlock_release(&cache->lock);
+        return NULL;
+    }
+    blr_cache_copy_out(cache, pos, GWBUF_DATA(result), hdr->event_size);
+    cache->hits++;
+    spinlock_release(&cache->lock);
+
+    /* set OK indicator */
+    hdr->ok = SLAVE_POS_READ_OK;
+
+    return result;
 }
@@ -38,6 +38,22 @@
  *                                  MariaDB 10 transaction start point.
  *                                  It's no longer using QUERY_EVENT with BEGIN
  * 23/10/15     Markus Makela       Added current_safe_event
+ * 03/05/16     Mark Riddoch        Serve catch-up reads from a memory mapping
+ *                                  of the binlog file
+ * 26/06/16     Mark Riddoch        Maintain a sparse position index alongside
+ *                                  each binlog file
+ * 28/06/16     Mark Riddoch        Serve recent events from the in-memory
+ *                                  event cache
+ * 03/07/16     Mark Riddoch        Block compression of closed binlog files
+ * 03/07/16     Mark Riddoch        Encryption of binlog files at rest with
+ *                                  AES in counter mode
+ * 03/07/16     Mark Riddoch        Binlog files that age out of binlogdir are
+ *                                  moved to the archive directory
+ * 05/07/16     Mark Riddoch        GTID events seen in the startup scan are
+ *                                  recorded in the GTID index
+ * 05/07/16     Mark Riddoch        Binlog appends coalesced in a buffer and
+ *                                  written out regions advised to the page
+ *                                  cache
  *
  * @endverbatim
  */
@@ -45,8 +61,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -62,9 +80,45 @@
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <housekeeper.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+
+/** The zlib compression level used for binlog blocks; the low level
+ * trades a little compression ratio for cheap CPU on the rotation path */
+#define BLRZ_COMPRESS_LEVEL     1
+
+/**
+ * The data passed to the housekeeper task that compresses a binlog
+ * file once it has been closed by a rotate event.
+ */
+typedef struct blrz_task
+{
+    ROUTER_INSTANCE *router;                    /*< The binlog router instance */
+    char            binlog[BINLOG_FNAMELEN+1];  /*< The binlog file to compress */
+} BLRZ_TASK;
 
 static int  blr_file_create(ROUTER_INSTANCE *router, char *file);
 static void blr_log_header(int priority, char *msg, uint8_t *ptr);
+static void blr_index_open(ROUTER_INSTANCE *router, char *file, int create);
+static void blr_index_append(ROUTER_INSTANCE *router, uint64_t pos);
+static uint64_t blr_index_last_pos(ROUTER_INSTANCE *router);
+static BLR_MAPPING *blr_map_binlog(int fd, size_t len);
+static void blr_mapping_release(void *data);
+static BLR_ZFILE *blr_zfile_open(int fd);
+static void blr_zfile_free(BLR_ZFILE *zfile);
+static int blr_zread(BLFILE *file, uint8_t *dest, uint32_t nbytes, uint64_t pos);
+static int blr_file_read(BLFILE *file, uint8_t *dest, uint32_t nbytes, uint64_t pos);
+static void blr_compress_binlog(ROUTER_INSTANCE *router, char *binlog);
+static void blr_compress_task(void *data);
+static int  blr_archive_file(ROUTER_INSTANCE *router, char *name);
+static void blr_archive_old_binlogs(ROUTER_INSTANCE *router);
+static void blr_archive_task(void *data);
+static int blr_file_crypt(ROUTER_INSTANCE *router, char *binlog, uint64_t pos,
+                          uint8_t *buf, uint32_t len);
+static int blr_append_event(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size);
+static int blr_append_flush_nolock(ROUTER_INSTANCE *router);
+static void blr_file_advise(ROUTER_INSTANCE *router);
 void blr_cache_read_master_data(ROUTER_INSTANCE *router);
 int blr_file_get_next_binlogname(ROUTER_INSTANCE *router);
 int blr_file_new_binlog(ROUTER_INSTANCE *router, char *file);
@@ -164,226 +218,1365 @@ blr_file_init(ROUTER_INSTANCE *router)
             file_found = 0;
         }
     }
-    while (file_found);
-    n--;
-
-    if (n == 0)     // No binlog files found
+    while (file_found);
+    n--;
+
+    if (n == 0)     // No binlog files found
+    {
+        if (router->initbinlog)
+        {
+            snprintf(filename, PATH_MAX, BINLOG_NAMEFMT, router->fileroot,
+                     router->initbinlog);
+        }
+        else
+        {
+            snprintf(filename, PATH_MAX, BINLOG_NAMEFMT, router->fileroot, 1);
+        }
+        if (! blr_file_create(router, filename))
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        snprintf(filename, PATH_MAX, BINLOG_NAMEFMT, router->fileroot, n);
+        blr_file_append(router, filename);
+    }
+    return 1;
+}
+
+int
+blr_file_rotate(ROUTER_INSTANCE *router, char *file, uint64_t pos)
+{
+    if (router->compress_binlogs && router->binlog_name[0] != '\0')
+    {
+        BLRZ_TASK *task;
+
+        /*
+         * Compress the file being closed in the housekeeper rather than
+         * here, so that the rotation of the master stream is not held up
+         * behind the compression. The task is delayed so that slaves
+         * still draining the tail of the file are served from the
+         * uncompressed copy.
+         */
+        if ((task = (BLRZ_TASK *)malloc(sizeof(BLRZ_TASK))) != NULL)
+        {
+            char taskname[BINLOG_FNAMELEN + 10];
+
+            task->router = router;
+            strncpy(task->binlog, router->binlog_name, BINLOG_FNAMELEN);
+            task->binlog[BINLOG_FNAMELEN] = '\0';
+            snprintf(taskname, sizeof(taskname), "blrz %s", task->binlog);
+            hktask_oneshot(taskname, blr_compress_task, task, 60);
+        }
+    }
+    if (router->archivedir != NULL)
+    {
+        char taskname[BINLOG_FNAMELEN + 10];
+
+        /*
+         * Age closed files out of binlogdir in the housekeeper. The task
+         * is scheduled after the compression task so that a file which is
+         * both compressed and archived is moved in its compressed form.
+         */
+        snprintf(taskname, sizeof(taskname), "blrarch %s", file);
+        hktask_oneshot(taskname, blr_archive_task, router, 120);
+    }
+    return blr_file_create(router, file);
+}
+
+
+/**
+ * binlog files need an initial 4 magic bytes at the start. blr_file_add_magic()
+ * adds them.
+ *
+ * @param fd file descriptor to the open binlog file
+ * @return   True if the magic string could be written to the file.
+ */
+static bool
+blr_file_add_magic(int fd)
+{
+    static const unsigned char magic[] = BINLOG_MAGIC;
+
+    ssize_t written = write(fd, magic, BINLOG_MAGIC_SIZE);
+
+    return written == BINLOG_MAGIC_SIZE;
+}
+
+
+/**
+ * Create a new binlog file for the router to use.
+ *
+ * @param router        The router instance
+ * @param file          The binlog file name
+ * @return              Non-zero if the fie creation succeeded
+ */
+static int
+blr_file_create(ROUTER_INSTANCE *router, char *file)
+{
+    int created = 0;
+    char err_msg[STRERROR_BUFLEN];
+
+    char path[PATH_MAX + 1] = "";
+
+    strcpy(path, router->binlogdir);
+    strcat(path, "/");
+    strcat(path, file);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+
+    if (fd != -1)
+    {
+        if (blr_file_add_magic(fd))
+        {
+            if (router->binlog_fd != -1)
+            {
+                /* Cover the events of the old file before closing it */
+                blr_file_force_flush(router);
+            }
+            close(router->binlog_fd);
+            spinlock_acquire(&router->binlog_lock);
+            strncpy(router->binlog_name, file, BINLOG_FNAMELEN);
+            router->binlog_fd = fd;
+            router->current_pos = BINLOG_MAGIC_SIZE;     /* Initial position after the magic number */
+            router->binlog_position = BINLOG_MAGIC_SIZE;
+            router->current_safe_event = BINLOG_MAGIC_SIZE;
+            router->last_written = BINLOG_MAGIC_SIZE;
+            router->last_event_pos = 0;
+            router->advised_pos = 0;
+            spinlock_release(&router->binlog_lock);
+
+            blr_index_open(router, file, 1);
+
+            created = 1;
+        }
+        else
+        {
+            MXS_ERROR("%s: Failed to write magic string to created binlog file %s, %s.",
+                      router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+            close(fd);
+
+            if (!unlink(path))
+            {
+                MXS_ERROR("%s: Failed to delete file %s, %s.",
+                          router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+            }
+        }
+    }
+    else
+    {
+        MXS_ERROR("%s: Failed to create binlog file %s, %s.",
+                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+    }
+
+    return created;
+}
+
+/**
+ * Prepare an existing binlog file to be appended to.
+ *
+ * @param router    The router instance
+ * @param file      The binlog file name
+ */
+void
+blr_file_append(ROUTER_INSTANCE *router, char *file)
+{
+    char path[PATH_MAX + 1] = "";
+    int fd;
+
+    strcpy(path, router->binlogdir);
+    strcat(path, "/");
+    strcat(path, file);
+
+    if ((fd = open(path, O_RDWR | O_APPEND, 0666)) == -1)
+    {
+        MXS_ERROR("Failed to open binlog file %s for append.",
+                  path);
+        return;
+    }
+    fsync(fd);
+    if (router->binlog_fd != -1)
+    {
+        /* Cover the events of the old file before closing it */
+        blr_file_force_flush(router);
+    }
+    close(router->binlog_fd);
+    spinlock_acquire(&router->binlog_lock);
+    memmove(router->binlog_name, file, BINLOG_FNAMELEN);
+    router->current_pos = lseek(fd, 0L, SEEK_END);
+    if (router->current_pos < 4)
+    {
+        if (router->current_pos == 0)
+        {
+            if (blr_file_add_magic(fd))
+            {
+                router->current_pos = BINLOG_MAGIC_SIZE;
+                router->binlog_position = BINLOG_MAGIC_SIZE;
+                router->current_safe_event = BINLOG_MAGIC_SIZE;
+                router->last_written = BINLOG_MAGIC_SIZE;
+                router->last_event_pos = 0;
+            }
+            else
+            {
+                MXS_ERROR("%s: Could not write magic to binlog file.", router->service->name);
+            }
+        }
+        else
+        {
+            /* If for any reason the file's length is between 1 and 3 bytes
+             * then report an error. */
+            MXS_ERROR("%s: binlog file %s has an invalid length %lu.",
+                      router->service->name, path, router->current_pos);
+            close(fd);
+            spinlock_release(&router->binlog_lock);
+            return;
+        }
+    }
+    router->binlog_fd = fd;
+    router->advised_pos = 0;
+    spinlock_release(&router->binlog_lock);
+    blr_index_open(router, file, 0);
+}
+
+/**
+ * Open, and if need be create, the sparse position index that is
+ * maintained alongside a binlog file.
+ *
+ * The index holds a magic number followed by the 8 byte little-endian
+ * positions of transaction safe events, one entry written for every
+ * BINLOG_INDEX_INTERVAL events received. The index is advisory: it is
+ * only used to start scans of the binlog file closer to the end of the
+ * file, so a missing or damaged index merely costs time.
+ *
+ * @param router    The router instance
+ * @param file      The name of the binlog file the index covers
+ * @param create    Discard any existing content of the index
+ */
+static void
+blr_index_open(ROUTER_INSTANCE *router, char *file, int create)
+{
+    static const unsigned char magic[] = BINLOG_INDEX_MAGIC;
+    char path[PATH_MAX + 1] = "";
+    struct stat statb;
+    int fd;
+
+    if (router->index_fd != -1)
+    {
+        close(router->index_fd);
+        router->index_fd = -1;
+    }
+    router->index_events = 0;
+
+    strcpy(path, router->binlogdir);
+    strcat(path, "/");
+    strcat(path, file);
+    strcat(path, BINLOG_INDEX_SUFFIX);
+
+    if ((fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR | O_CREAT,
+                   0666)) == -1)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_WARNING("%s: Failed to open binlog index file %s, %s. "
+                    "Scans of the binlog file will read it from the start.",
+                    router->service->name, path,
+                    strerror_r(errno, err_msg, sizeof(err_msg)));
+        return;
+    }
+    if (fstat(fd, &statb) == 0 && statb.st_size == 0 &&
+        write(fd, magic, BINLOG_INDEX_MAGIC_SIZE) != BINLOG_INDEX_MAGIC_SIZE)
+    {
+        close(fd);
+        return;
+    }
+    lseek(fd, 0L, SEEK_END);
+    router->index_fd = fd;
+}
+
+/**
+ * Append an entry to the position index of the current binlog file.
+ *
+ * Only called at points where no transaction is open, so that every
+ * recorded position is one a reader may safely start parsing from.
+ *
+ * @param router    The router instance
+ * @param pos       The transaction safe position to record
+ */
+static void
+blr_index_append(ROUTER_INSTANCE *router, uint64_t pos)
+{
+    unsigned char entry[BINLOG_INDEX_ENTRY_LEN];
+    int i;
+
+    for (i = 0; i < BINLOG_INDEX_ENTRY_LEN; i++)
+    {
+        entry[i] = (pos >> (i * 8)) & 0xff;
+    }
+    if (write(router->index_fd, entry, BINLOG_INDEX_ENTRY_LEN)
+        != BINLOG_INDEX_ENTRY_LEN)
+    {
+        char err_msg[STRERROR_BUFLEN];
+        MXS_WARNING("%s: Failed to write binlog index entry for %s, %s. "
+                    "The index will not be extended further.",
+                    router->service->name, router->binlog_name,
+                    strerror_r(errno, err_msg, sizeof(err_msg)));
+        close(router->index_fd);
+        router->index_fd = -1;
+    }
+}
+
+/**
+ * Return the last position recorded in the index of the current binlog
+ * file, or the start of the file if the index is missing or empty.
+ *
+ * @param router    The router instance
+ * @return The last indexed transaction safe position
+ */
+static uint64_t
+blr_index_last_pos(ROUTER_INSTANCE *router)
+{
+    unsigned char entry[BINLOG_INDEX_ENTRY_LEN];
+    uint64_t pos = 0;
+    off_t len;
+    int i;
+
+    if (router->index_fd == -1 ||
+        (len = lseek(router->index_fd, 0L, SEEK_END)) <
+        BINLOG_INDEX_MAGIC_SIZE + BINLOG_INDEX_ENTRY_LEN)
+    {
+        return BINLOG_MAGIC_SIZE;
+    }
+    /* Ignore a trailing partial entry left by an interrupted write */
+    len -= (len - BINLOG_INDEX_MAGIC_SIZE) % BINLOG_INDEX_ENTRY_LEN;
+    if (pread(router->index_fd, entry, BINLOG_INDEX_ENTRY_LEN,
+              len - BINLOG_INDEX_ENTRY_LEN) != BINLOG_INDEX_ENTRY_LEN)
+    {
+        return BINLOG_MAGIC_SIZE;
+    }
+    for (i = 0; i < BINLOG_INDEX_ENTRY_LEN; i++)
+    {
+        pos |= (uint64_t)entry[i] << (i * 8);
+    }
+    return pos;
+}
+
+/**
+ * Write a binlog entry to disk.
+ *
+ * The event goes through the append buffer of the router, so a burst of
+ * small events from the master reaches the file in a single system call
+ * rather than one write() per event. The buffer is flushed when it
+ * fills, before any sync and whenever a slave needs to read past the
+ * buffered region.
+ *
+ * @param router The router instance
+ * @param buf    The binlog record
+ * @param len    The length of the binlog record
+ * @return       Return the number of bytes written
+ */
+int
+blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size, uint8_t *buf)
+{
+    uint64_t index_pos = 0;
+    uint8_t *wbuf = buf;
+    int n;
+
+    if (router->encrypt_binlogs)
+    {
+        /*
+         * Encrypt a copy of the event body; the caller's buffer is
+         * subsequently distributed to the slaves and mirrored into the
+         * event cache, so it must remain in clear.
+         */
+        if ((wbuf = (uint8_t *)malloc(size)) == NULL)
+        {
+            MXS_ERROR("%s: Failed to allocate memory to encrypt binlog "
+                      "record at %lu of %s.",
+                      router->service->name, router->last_written,
+                      router->binlog_name);
+            return 0;
+        }
+        memcpy(wbuf, buf, size);
+        if (size > BINLOG_EVENT_HDR_LEN &&
+            !blr_file_crypt(router, router->binlog_name, router->last_written,
+                            wbuf + BINLOG_EVENT_HDR_LEN,
+                            size - BINLOG_EVENT_HDR_LEN))
+        {
+            free(wbuf);
+            return 0;
+        }
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    if (!blr_append_event(router, wbuf, size))
+    {
+        spinlock_release(&router->binlog_lock);
+        if (wbuf != buf)
+        {
+            free(wbuf);
+        }
+        return 0;
+    }
+    spinlock_release(&router->binlog_lock);
+    if (wbuf != buf)
+    {
+        free(wbuf);
+    }
+    n = size;
+    /* Mirror the clear text of the event into the in-memory event cache */
+    blr_cache_add_data(router, router->binlog_name, router->last_written, buf, size);
+    spinlock_acquire(&router->binlog_lock);
+    router->current_pos = hdr->next_pos;
+    router->last_written += size;
+    router->last_event_pos = hdr->next_pos - hdr->event_size;
+    router->pending_events++;
+    if (router->index_fd != -1 &&
+        ++router->index_events >= BINLOG_INDEX_INTERVAL &&
+        router->pending_transaction == 0)
+    {
+        /* The next event starts on a transaction boundary, record
+         * its position in the index of the binlog file. */
+        router->index_events = 0;
+        index_pos = hdr->next_pos;
+    }
+    spinlock_release(&router->binlog_lock);
+    if (index_pos)
+    {
+        blr_index_append(router, index_pos);
+    }
+    return n;
+}
+
+/**
+ * Append an event to the binlog file through the append buffer.
+ *
+ * Called with the binlog lock held. Small events are coalesced in the
+ * buffer and reach the file in one write when it fills; an event larger
+ * than the buffer is written directly, after any buffered bytes have
+ * been flushed ahead of it. On a write failure the binlog file is
+ * truncated back to the last complete write and the event cache is
+ * invalidated, as it may hold events that never reached the file.
+ *
+ * @param router    The router instance
+ * @param buf       The event to append
+ * @param size      The size of the event
+ * @return Non-zero if the event was appended or written
+ */
+static int
+blr_append_event(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size)
+{
+    char err_msg[STRERROR_BUFLEN];
+
+    if (router->wbuffer == NULL)
+    {
+        /* First write of the instance; without a buffer the events
+         * are simply written directly as before */
+        router->wbuffer = (uint8_t *)malloc(BLR_WBUFFER_SIZE);
+    }
+    if (router->wbuffer == NULL || size >= BLR_WBUFFER_SIZE)
+    {
+        if (!blr_append_flush_nolock(router))
+        {
+            return 0;
+        }
+        if (pwrite(router->binlog_fd, buf, size,
+                   router->last_written) != size)
+        {
+            MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
+                      "Truncating to previous record.",
+                      router->service->name, router->last_written,
+                      router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            /* Remove any partial event that was written */
+            if (ftruncate(router->binlog_fd, router->last_written))
+            {
+                MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
+                          router->service->name, router->last_written,
+                          router->binlog_name,
+                          strerror_r(errno, err_msg, sizeof(err_msg)));
+            }
+            /* The cache may hold bytes of the partial event */
+            blr_cache_invalidate(router);
+            return 0;
+        }
+        return 1;
+    }
+    if (router->wbuffer_len + size > BLR_WBUFFER_SIZE &&
+        !blr_append_flush_nolock(router))
+    {
+        return 0;
+    }
+    if (router->wbuffer_len == 0)
+    {
+        router->wbuffer_start = router->last_written;
+        router->wbuffer_hb = hkheartbeat;
+    }
+    memcpy(router->wbuffer + router->wbuffer_len, buf, size);
+    router->wbuffer_len += size;
+    return 1;
+}
+
+/**
+ * Write out the append buffer of the router. Called with the binlog
+ * lock held.
+ *
+ * On success the written region is handed to the kernel for early
+ * writeback, so the pages are clean by the time the covering sync
+ * arrives and writeback does not build into bursts that compete with
+ * the catch-up reads of the slaves. On failure the binlog file is
+ * truncated back to the start of the buffered region and the event
+ * cache is invalidated.
+ *
+ * @param router    The router instance
+ * @return Non-zero if the buffer was written or was already empty
+ */
+static int
+blr_append_flush_nolock(ROUTER_INSTANCE *router)
+{
+    char err_msg[STRERROR_BUFLEN];
+    uint32_t len = router->wbuffer_len;
+
+    if (len == 0)
+    {
+        return 1;
+    }
+    router->wbuffer_len = 0;
+    if (pwrite(router->binlog_fd, router->wbuffer, len,
+               router->wbuffer_start) != len)
+    {
+        MXS_ERROR("%s: Failed to write %u buffered binlog bytes at %lu "
+                  "of %s, %s. Truncating to the last complete write.",
+                  router->service->name, len, router->wbuffer_start,
+                  router->binlog_name,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        if (ftruncate(router->binlog_fd, router->wbuffer_start))
+        {
+            MXS_ERROR("%s: Failed to truncate binlog %s at %lu, %s.",
+                      router->service->name, router->binlog_name,
+                      router->wbuffer_start,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+        /* The cache may hold events that never reached the file */
+        blr_cache_invalidate(router);
+        return 0;
+    }
+#if defined(SYNC_FILE_RANGE_WRITE)
+    sync_file_range(router->binlog_fd, router->wbuffer_start, len,
+                    SYNC_FILE_RANGE_WRITE);
+#endif
+    return 1;
+}
+
+/**
+ * Write out the append buffer of the router.
+ *
+ * Called by the readers before they read a region of the current
+ * binlog file that may still be sitting in the buffer, and by the
+ * sync paths before the covering fdatasync.
+ *
+ * @param router    The router instance
+ * @return Non-zero if the buffer was written or was already empty
+ */
+int
+blr_file_append_flush(ROUTER_INSTANCE *router)
+{
+    int rc;
+
+    spinlock_acquire(&router->binlog_lock);
+    rc = blr_append_flush_nolock(router);
+    spinlock_release(&router->binlog_lock);
+    return rc;
+}
+
+/**
+ * Flush the content of the binlog file to disk.
+ *
+ * The sync is subject to the group commit policy of the router: it is
+ * only issued once sync_events events have been written since the last
+ * sync or once the oldest unsynced event has waited for longer than
+ * sync_interval milliseconds. With the default settings of one event
+ * and no unsynced waiting this degenerates to a sync on every call.
+ *
+ * @param   router  The binlog router
+ */
+void
+blr_file_flush(ROUTER_INSTANCE *router)
+{
+    bool sync = false;
+
+    spinlock_acquire(&router->binlog_lock);
+    if (router->pending_events > 0 &&
+        (router->pending_events >= router->sync_events ||
+         hkheartbeat - router->last_sync >= router->sync_interval / 100))
+    {
+        router->pending_events = 0;
+        router->last_sync = hkheartbeat;
+        /* The sync must cover the buffered events as well */
+        blr_append_flush_nolock(router);
+        sync = true;
+    }
+    spinlock_release(&router->binlog_lock);
+    if (sync)
+    {
+        fdatasync(router->binlog_fd);
+    }
+}
+
+/**
+ * Flush the content of the binlog file to disk regardless of the
+ * group commit policy.
+ *
+ * Used at the points where the binlog file is about to be closed or
+ * replaced, when every event written so far must be covered by a sync.
+ *
+ * @param   router  The binlog router
+ */
+void
+blr_file_force_flush(ROUTER_INSTANCE *router)
+{
+    spinlock_acquire(&router->binlog_lock);
+    router->pending_events = 0;
+    router->last_sync = hkheartbeat;
+    if (router->binlog_fd != -1)
+    {
+        blr_append_flush_nolock(router);
+    }
+    spinlock_release(&router->binlog_lock);
+    if (router->binlog_fd != -1)
+    {
+        fdatasync(router->binlog_fd);
+    }
+}
+
+/**
+ * Housekeeper task that issues the covering sync for events that have
+ * been waiting longer than the configured sync_interval.
+ *
+ * Without this task a quiet master could leave the last few events of
+ * a burst unsynced indefinitely, as the sync policy is otherwise only
+ * evaluated when further events arrive.
+ *
+ * @param   data    The binlog router instance
+ */
+void
+blr_file_sync_task(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)data;
+
+    /* Events must not sit in the append buffer indefinitely when the
+     * master goes quiet, the buffer is otherwise only flushed by
+     * further events arriving */
+    if (router->wbuffer_len > 0 &&
+        hkheartbeat - router->wbuffer_hb >= BLR_WBUFFER_MAX_HOLD)
+    {
+        blr_file_append_flush(router);
+    }
+    if (router->pending_events > 0 &&
+        hkheartbeat - router->last_sync >= router->sync_interval / 100)
+    {
+        blr_file_force_flush(router);
+    }
+    blr_file_advise(router);
+}
+
+/**
+ * Advise the kernel that written out regions of the current binlog
+ * file, which every connected slave has already read past, are no
+ * longer needed. The dropped pages stop the relay writes from pushing
+ * the pages that lagging slaves are reading out of the page cache.
+ *
+ * Only the region below the slowest slave on the current file is
+ * advised; if any slave is still serving an earlier binlog file
+ * nothing is dropped, as that slave has yet to read the whole file.
+ *
+ * @param router    The router instance
+ */
+static void
+blr_file_advise(ROUTER_INSTANCE *router)
+{
+    ROUTER_SLAVE *slave;
+    uint64_t keep;
+
+    if (router->binlog_fd == -1)
+    {
+        return;
+    }
+    spinlock_acquire(&router->binlog_lock);
+    keep = router->wbuffer_len > 0 ? router->wbuffer_start
+                                   : router->last_written;
+    spinlock_release(&router->binlog_lock);
+
+    spinlock_acquire(&router->lock);
+    for (slave = router->slaves; slave; slave = slave->next)
+    {
+        if (slave->state != BLRS_DUMPING)
+        {
+            continue;
+        }
+        if (strcmp(slave->binlogfile, router->binlog_name) != 0)
+        {
+            /* The slave is still on an earlier file and has yet to
+             * read everything that could be dropped */
+            keep = 0;
+            break;
+        }
+        if (slave->binlog_pos < keep)
+        {
+            keep = slave->binlog_pos;
+        }
+    }
+    spinlock_release(&router->lock);
+
+    /* Advise in whole pages and only once a worthwhile amount of the
+     * file has been read past */
+    keep &= ~(uint64_t)4095;
+    if (keep > router->advised_pos + BLR_DONTNEED_CHUNK)
+    {
+        posix_fadvise(router->binlog_fd, router->advised_pos,
+                      keep - router->advised_pos, POSIX_FADV_DONTNEED);
+        router->advised_pos = keep;
+    }
+}
+
+/**
+ * Create a read-only memory mapping of a binlog file. The mapping holds
+ * one reference for the BLFILE; each buffer handed out that references
+ * the mapped pages takes a further reference.
+ *
+ * @param fd    The open binlog file descriptor
+ * @param len   The current size of the file
+ * @return The mapping or NULL if the file could not be mapped
+ */
+static BLR_MAPPING *
+blr_map_binlog(int fd, size_t len)
+{
+    BLR_MAPPING *map;
+
+    if ((map = (BLR_MAPPING *)malloc(sizeof(BLR_MAPPING))) == NULL)
+    {
+        return NULL;
+    }
+    map->ptr = (uint8_t *)mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->ptr == MAP_FAILED)
+    {
+        free(map);
+        return NULL;
+    }
+    madvise(map->ptr, len, MADV_SEQUENTIAL);
+    map->len = len;
+    map->refcnt = 1;
+    return map;
+}
+
+/**
+ * Drop a reference to a binlog file mapping, unmapping it when the last
+ * reference is gone. Used as the done function of the buffers created by
+ * gwbuf_alloc_referenced, so may be called from whichever thread frees
+ * the buffer.
+ *
+ * @param data  The mapping, passed as a void pointer
+ */
+static void
+blr_mapping_release(void *data)
+{
+    BLR_MAPPING *map = (BLR_MAPPING *)data;
+
+    if (atomic_add(&map->refcnt, -1) == 1)
+    {
+        munmap(map->ptr, map->len);
+        free(map);
+    }
+}
+
+/**
+ * Read the header and block offset index of a compressed binlog file
+ * and build the decompression state for it.
+ *
+ * @param fd    The open compressed binlog file
+ * @return The decompression state or NULL if the file is not a valid
+ * compressed binlog
+ */
+static BLR_ZFILE *
+blr_zfile_open(int fd)
+{
+    BLRZ_HEADER hdr;
+    BLR_ZFILE *zfile;
+    size_t idxlen;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != BLRZ_MAGIC || hdr.block_size == 0 || hdr.n_blocks == 0)
+    {
+        return NULL;
+    }
+    if ((zfile = (BLR_ZFILE *)calloc(1, sizeof(BLR_ZFILE))) == NULL)
+    {
+        return NULL;
+    }
+    zfile->block_size = hdr.block_size;
+    zfile->n_blocks = hdr.n_blocks;
+    zfile->length = hdr.length;
+    idxlen = (hdr.n_blocks + 1) * sizeof(uint64_t);
+    if ((zfile->offsets = (uint64_t *)malloc(idxlen)) == NULL ||
+        (zfile->block = (uint8_t *)malloc(hdr.block_size)) == NULL ||
+        pread(fd, zfile->offsets, idxlen, sizeof(hdr)) != (ssize_t)idxlen)
+    {
+        blr_zfile_free(zfile);
+        return NULL;
+    }
+    zfile->block_valid = false;
+    return zfile;
+}
+
+/**
+ * Free the decompression state of a compressed binlog file
+ *
+ * @param zfile The decompression state to free
+ */
+static void
+blr_zfile_free(BLR_ZFILE *zfile)
+{
+    free(zfile->offsets);
+    free(zfile->block);
+    free(zfile);
+}
+
+/**
+ * Read from a compressed binlog file as if it were the original
+ * uncompressed file, decompressing blocks on demand. The most recently
+ * decompressed block is cached in the file structure under the file
+ * lock, so the sequential reads of a catching-up slave decompress each
+ * block only once.
+ *
+ * @param file          The binlog file to read from
+ * @param dest          The destination for the uncompressed bytes
+ * @param nbytes        The number of bytes to read
+ * @param pos           Offset within the uncompressed file
+ * @return The number of bytes read, 0 at end of file or -1 on error
+ */
+static int
+blr_zread(BLFILE *file, uint8_t *dest, uint32_t nbytes, uint64_t pos)
+{
+    BLR_ZFILE *zfile = file->zfile;
+    uint32_t total = 0, blkno, offset, blklen, chunk;
+    uint64_t zlen;
+    uint8_t *zbuf;
+    uLongf dlen;
+
+    if (pos >= zfile->length)
+    {
+        return 0;
+    }
+    if (nbytes > zfile->length - pos)
+    {
+        nbytes = zfile->length - pos;
+    }
+
+    spinlock_acquire(&file->lock);
+    while (total < nbytes)
+    {
+        blkno = pos / zfile->block_size;
+        offset = pos % zfile->block_size;
+        if (!zfile->block_valid || zfile->block_no != blkno)
+        {
+            zlen = zfile->offsets[blkno + 1] - zfile->offsets[blkno];
+            if ((zbuf = (uint8_t *)malloc(zlen)) == NULL ||
+                pread(file->fd, zbuf, zlen, zfile->offsets[blkno]) != (ssize_t)zlen)
+            {
+                free(zbuf);
+                spinlock_release(&file->lock);
+                return -1;
+            }
+            dlen = zfile->block_size;
+            if (uncompress(zfile->block, &dlen, zbuf, zlen) != Z_OK)
+            {
+                free(zbuf);
+                zfile->block_valid = false;
+                spinlock_release(&file->lock);
+                MXS_ERROR("Corrupt compressed block %u in binlog file '%s'",
+                          blkno, file->binlogname);
+                return -1;
+            }
+            free(zbuf);
+            zfile->block_no = blkno;
+            zfile->block_valid = true;
+        }
+
+        /* The last block of the file may be short */
+        blklen = zfile->block_size;
+        if ((uint64_t)(blkno + 1) * zfile->block_size > zfile->length)
+        {
+            blklen = zfile->length - (uint64_t)blkno * zfile->block_size;
+        }
+        chunk = nbytes - total;
+        if (chunk > blklen - offset)
+        {
+            chunk = blklen - offset;
+        }
+        memcpy(dest + total, zfile->block + offset, chunk);
+        total += chunk;
+        pos += chunk;
+    }
+    spinlock_release(&file->lock);
+    return total;
+}
+
+/**
+ * Read a range of bytes from a binlog file, decompressing on demand
+ * when the file is a compressed binlog. The semantics match pread.
+ *
+ * @param file          The binlog file to read from
+ * @param dest          The destination for the bytes
+ * @param nbytes        The number of bytes to read
+ * @param pos           Offset within the binlog file
+ * @return The number of bytes read, 0 at end of file or -1 on error
+ */
+static int
+blr_file_read(BLFILE *file, uint8_t *dest, uint32_t nbytes, uint64_t pos)
+{
+    if (file->zfile)
+    {
+        return blr_zread(file, dest, nbytes, pos);
+    }
+    return pread(file->fd, dest, nbytes, pos);
+}
+
+/**
+ * Compress a closed binlog file, replacing it with a compressed copy
+ * that blr_open_binlog will recognise. The copy is built under a
+ * temporary name and renamed into place before the original file is
+ * removed, so a failure at any point leaves the original untouched.
+ * Slaves that hold the original file open keep reading it through
+ * their descriptor; new readers get the compressed copy.
+ *
+ * @param router        The binlog router instance
+ * @param binlog        The name of the binlog file to compress
+ */
+static void
+blr_compress_binlog(ROUTER_INSTANCE *router, char *binlog)
+{
+    char src[PATH_MAX + 1], dst[PATH_MAX + 1], tmp[PATH_MAX + 1];
+    int sfd = -1, dfd = -1;
+    struct stat statb;
+    uint32_t n_blocks, blkno;
+    uint64_t *offsets = NULL, written;
+    uint8_t *inbuf = NULL, *zbuf = NULL;
+    BLRZ_HEADER hdr;
+    ssize_t n;
+    uLongf zlen;
+
+    /* Never compress the binlog that is currently being written */
+    spinlock_acquire(&router->binlog_lock);
+    if (strcmp(router->binlog_name, binlog) == 0)
+    {
+        spinlock_release(&router->binlog_lock);
+        return;
+    }
+    spinlock_release(&router->binlog_lock);
+
+    snprintf(src, PATH_MAX, "%s/%s", router->binlogdir, binlog);
+    snprintf(dst, PATH_MAX, "%s/%s%s", router->binlogdir, binlog, BLRZ_SUFFIX);
+    snprintf(tmp, PATH_MAX, "%s.tmp", dst);
+
+    if ((sfd = open(src, O_RDONLY)) == -1 ||
+        fstat(sfd, &statb) != 0 || statb.st_size == 0)
+    {
+        if (sfd != -1)
+        {
+            close(sfd);
+        }
+        return;
+    }
+    n_blocks = (statb.st_size + BLRZ_BLOCK_SIZE - 1) / BLRZ_BLOCK_SIZE;
+    written = sizeof(BLRZ_HEADER) + (n_blocks + 1) * sizeof(uint64_t);
+
+    if ((dfd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1 ||
+        (offsets = (uint64_t *)malloc((n_blocks + 1) * sizeof(uint64_t))) == NULL ||
+        (inbuf = (uint8_t *)malloc(BLRZ_BLOCK_SIZE)) == NULL ||
+        (zbuf = (uint8_t *)malloc(compressBound(BLRZ_BLOCK_SIZE))) == NULL ||
+        lseek(dfd, written, SEEK_SET) == -1)
+    {
+        goto failed;
+    }
+
+    for (blkno = 0; blkno < n_blocks; blkno++)
+    {
+        if ((n = pread(sfd, inbuf, BLRZ_BLOCK_SIZE,
+                       (uint64_t)blkno * BLRZ_BLOCK_SIZE)) <= 0)
+        {
+            goto failed;
+        }
+        zlen = compressBound(BLRZ_BLOCK_SIZE);
+        if (compress2(zbuf, &zlen, inbuf, n, BLRZ_COMPRESS_LEVEL) != Z_OK)
+        {
+            goto failed;
+        }
+        offsets[blkno] = written;
+        if (write(dfd, zbuf, zlen) != (ssize_t)zlen)
+        {
+            goto failed;
+        }
+        written += zlen;
+    }
+    offsets[n_blocks] = written;
+
+    hdr.magic = BLRZ_MAGIC;
+    hdr.block_size = BLRZ_BLOCK_SIZE;
+    hdr.n_blocks = n_blocks;
+    hdr.spare = 0;
+    hdr.length = statb.st_size;
+    if (pwrite(dfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pwrite(dfd, offsets, (n_blocks + 1) * sizeof(uint64_t),
+               sizeof(hdr)) != (ssize_t)((n_blocks + 1) * sizeof(uint64_t)) ||
+        fsync(dfd) != 0)
+    {
+        goto failed;
+    }
+    close(dfd);
+    dfd = -1;
+    if (rename(tmp, dst) != 0)
+    {
+        goto failed;
+    }
+    unlink(src);
+    close(sfd);
+    free(offsets);
+    free(inbuf);
+    free(zbuf);
+    MXS_NOTICE("%s: compressed binlog file '%s', %lu bytes to %lu bytes.",
+               router->service->name, binlog,
+               (unsigned long)statb.st_size, (unsigned long)written);
+    return;
+
+failed:
+    MXS_ERROR("%s: failed to compress binlog file '%s', "
+              "the file is left uncompressed.",
+              router->service->name, binlog);
+    if (dfd != -1)
+    {
+        close(dfd);
+    }
+    unlink(tmp);
+    close(sfd);
+    free(offsets);
+    free(inbuf);
+    free(zbuf);
+}
+
+/**
+ * The housekeeper task that compresses a binlog file after a rotate
+ *
+ * @param data  The compression task data
+ */
+static void
+blr_compress_task(void *data)
+{
+    BLRZ_TASK *task = (BLRZ_TASK *)data;
+
+    blr_compress_binlog(task->router, task->binlog);
+    free(task);
+}
+
+/**
+ * Move a single file from the binlog directory to the archive directory.
+ *
+ * A rename is attempted first; when the archive directory is on a
+ * different filesystem, which is the expected deployment with the binlog
+ * directory on fast local storage, the file is copied and the original
+ * removed. A slave that still holds the file open is unaffected either
+ * way, it keeps reading from its open descriptor; the archived copy is
+ * found when the next file is opened.
+ *
+ * @param router    The binlog router instance
+ * @param name      Name of the file within the binlog directory
+ * @return          0 on success, -1 on failure
+ */
+static int
+blr_archive_file(ROUTER_INSTANCE *router, char *name)
+{
+    char src[PATH_MAX + 1], dst[PATH_MAX + 1], tmp[PATH_MAX + 1];
+    int sfd, dfd;
+    uint8_t *buf;
+    ssize_t n;
+
+    snprintf(src, PATH_MAX, "%s/%s", router->binlogdir, name);
+    snprintf(dst, PATH_MAX, "%s/%s", router->archivedir, name);
+
+    if (rename(src, dst) == 0)
+    {
+        return 0;
+    }
+    if (errno != EXDEV)
+    {
+        return -1;
+    }
+    snprintf(tmp, PATH_MAX, "%s.tmp", dst);
+
+    if ((sfd = open(src, O_RDONLY)) == -1)
+    {
+        return -1;
+    }
+    if ((dfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    {
+        close(sfd);
+        return -1;
+    }
+    if ((buf = (uint8_t *)malloc(BLRZ_BLOCK_SIZE)) == NULL)
+    {
+        close(sfd);
+        close(dfd);
+        unlink(tmp);
+        return -1;
+    }
+    while ((n = read(sfd, buf, BLRZ_BLOCK_SIZE)) > 0)
+    {
+        if (write(dfd, buf, n) != n)
+        {
+            n = -1;
+            break;
+        }
+    }
+    free(buf);
+    close(sfd);
+    if (n != 0 || fsync(dfd) != 0)
+    {
+        close(dfd);
+        unlink(tmp);
+        return -1;
+    }
+    close(dfd);
+    if (rename(tmp, dst) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    unlink(src);
+    return 0;
+}
+
+/**
+ * Move binlog files that have aged out of the fast storage tier into
+ * the archive directory.
+ *
+ * The most recent archive_files files, counting the binlog currently
+ * being written, stay in the binlog directory; everything older,
+ * whether a plain binlog file or a compressed copy, is moved. The
+ * position index files are left behind as they are only consulted for
+ * files in the binlog directory.
+ *
+ * @param router    The binlog router instance
+ */
+static void
+blr_archive_old_binlogs(ROUTER_INSTANCE *router)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    int root_len, current, limit, filenum;
+
+    root_len = strlen(router->fileroot);
+    spinlock_acquire(&router->binlog_lock);
+    if (strncmp(router->binlog_name, router->fileroot, root_len) != 0)
+    {
+        spinlock_release(&router->binlog_lock);
+        return;
+    }
+    current = atoi(router->binlog_name + root_len + 1);
+    spinlock_release(&router->binlog_lock);
+
+    limit = current - router->archive_files;
+    if (limit <= 0)
+    {
+        return;
+    }
+
+    if ((dirp = opendir(router->binlogdir)) == NULL)
+    {
+        char err_msg[BLRM_STRERROR_R_MSG_SIZE];
+        MXS_ERROR("%s: Unable to read the binlog directory %s, %s.",
+                  router->service->name, router->binlogdir,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+        return;
+    }
+    while ((dp = readdir(dirp)) != NULL)
     {
-        if (router->initbinlog)
+        if (strncmp(dp->d_name, router->fileroot, root_len) != 0 ||
+            dp->d_name[root_len] != '.')
         {
-            snprintf(filename, PATH_MAX, BINLOG_NAMEFMT, router->fileroot,
-                     router->initbinlog);
+            continue;
         }
-        else
+        filenum = atoi(dp->d_name + root_len + 1);
+        if (filenum == 0 || filenum > limit)
         {
-            snprintf(filename, PATH_MAX, BINLOG_NAMEFMT, router->fileroot, 1);
+            continue;
         }
-        if (! blr_file_create(router, filename))
+        if (blr_archive_file(router, dp->d_name) == 0)
         {
-            return 0;
+            MXS_NOTICE("%s: archived binlog file '%s' to %s.",
+                       router->service->name, dp->d_name,
+                       router->archivedir);
+        }
+        else
+        {
+            char err_msg[BLRM_STRERROR_R_MSG_SIZE];
+            MXS_ERROR("%s: failed to archive binlog file '%s' to %s, %s.",
+                      router->service->name, dp->d_name, router->archivedir,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
         }
     }
-    else
-    {
-        snprintf(filename, PATH_MAX, BINLOG_NAMEFMT, router->fileroot, n);
-        blr_file_append(router, filename);
-    }
-    return 1;
-}
-
-int
-blr_file_rotate(ROUTER_INSTANCE *router, char *file, uint64_t pos)
-{
-    return blr_file_create(router, file);
+    closedir(dirp);
 }
 
-
 /**
- * binlog files need an initial 4 magic bytes at the start. blr_file_add_magic()
- * adds them.
+ * The housekeeper task that ages binlog files out of the binlog
+ * directory after a rotate
  *
- * @param fd file descriptor to the open binlog file
- * @return   True if the magic string could be written to the file.
+ * @param data  The router instance
  */
-static bool
-blr_file_add_magic(int fd)
+static void
+blr_archive_task(void *data)
 {
-    static const unsigned char magic[] = BINLOG_MAGIC;
-
-    ssize_t written = write(fd, magic, BINLOG_MAGIC_SIZE);
-
-    return written == BINLOG_MAGIC_SIZE;
+    blr_archive_old_binlogs((ROUTER_INSTANCE *)data);
 }
 
-
 /**
- * Create a new binlog file for the router to use.
+ * Encrypt or decrypt the body of a binlog event in place.
  *
- * @param router        The router instance
- * @param file          The binlog file name
- * @return              Non-zero if the fie creation succeeded
+ * The events are encrypted with AES in counter mode, which the OpenSSL
+ * EVP layer executes with the AES-NI instructions when the processor
+ * provides them. The counter is derived from the number of the binlog
+ * file and the position of the event within it, so no two events are
+ * ever encrypted with the same key stream and no additional state needs
+ * to be stored in the file; the binlog file format and all the event
+ * positions are unchanged and the 19 byte event headers remain in clear
+ * so that the file can still be scanned and indexed. Counter mode is
+ * symmetrical, so the same routine performs encryption and decryption.
+ *
+ * @param   router  The router instance holding the encryption key
+ * @param   binlog  Name of the binlog file the event belongs to
+ * @param   pos     Position of the event within the binlog file
+ * @param   buf     The event body to encrypt or decrypt in place
+ * @param   len     Length of the event body
+ * @return  Non-zero on success
  */
 static int
-blr_file_create(ROUTER_INSTANCE *router, char *file)
+blr_file_crypt(ROUTER_INSTANCE *router, char *binlog, uint64_t pos,
+               uint8_t *buf, uint32_t len)
 {
-    int created = 0;
-    char err_msg[STRERROR_BUFLEN];
-
-    char path[PATH_MAX + 1] = "";
-
-    strcpy(path, router->binlogdir);
-    strcat(path, "/");
-    strcat(path, file);
-
-    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    EVP_CIPHER_CTX *ctx;
+    const EVP_CIPHER *cipher;
+    uint8_t iv[16];
+    uint64_t fileno = 0;
+    char *sptr;
+    int i, outlen;
 
-    if (fd != -1)
+    switch (router->encryption_key_len)
     {
-        if (blr_file_add_magic(fd))
-        {
-            close(router->binlog_fd);
-            spinlock_acquire(&router->binlog_lock);
-            strncpy(router->binlog_name, file, BINLOG_FNAMELEN);
-            router->binlog_fd = fd;
-            router->current_pos = BINLOG_MAGIC_SIZE;     /* Initial position after the magic number */
-            router->binlog_position = BINLOG_MAGIC_SIZE;
-            router->current_safe_event = BINLOG_MAGIC_SIZE;
-            router->last_written = BINLOG_MAGIC_SIZE;
-            router->last_event_pos = 0;
-            spinlock_release(&router->binlog_lock);
-
-            created = 1;
-        }
-        else
-        {
-            MXS_ERROR("%s: Failed to write magic string to created binlog file %s, %s.",
-                      router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
-            close(fd);
-
-            if (!unlink(path))
-            {
-                MXS_ERROR("%s: Failed to delete file %s, %s.",
-                          router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
-            }
-        }
+    case 16:
+        cipher = EVP_aes_128_ctr();
+        break;
+    case 24:
+        cipher = EVP_aes_192_ctr();
+        break;
+    default:
+        cipher = EVP_aes_256_ctr();
+        break;
     }
-    else
+
+    if ((sptr = strrchr(binlog, '.')) != NULL)
     {
-        MXS_ERROR("%s: Failed to create binlog file %s, %s.",
-                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        fileno = strtoul(sptr + 1, NULL, 10);
     }
 
-    return created;
-}
-
-/**
- * Prepare an existing binlog file to be appended to.
- *
- * @param router    The router instance
- * @param file      The binlog file name
- */
-void
-blr_file_append(ROUTER_INSTANCE *router, char *file)
-{
-    char path[PATH_MAX + 1] = "";
-    int fd;
-
-    strcpy(path, router->binlogdir);
-    strcat(path, "/");
-    strcat(path, file);
+    /*
+     * The high quadword of the counter is the binlog file number and
+     * the low quadword the event position. The counter advances by one
+     * per 16 byte block, so the blocks of an event stay below the
+     * position of the event that follows it and the key streams of the
+     * events in a file never overlap.
+     */
+    for (i = 0; i < 8; i++)
+    {
+        iv[i] = (fileno >> ((7 - i) * 8)) & 0xff;
+        iv[i + 8] = (pos >> ((7 - i) * 8)) & 0xff;
+    }
 
-    if ((fd = open(path, O_RDWR | O_APPEND, 0666)) == -1)
+    if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
     {
-        MXS_ERROR("Failed to open binlog file %s for append.",
-                  path);
-        return;
+        MXS_ERROR("%s: Failed to allocate a cipher context for the binlog "
+                  "encryption of %s.", router->service->name, binlog);
+        return 0;
     }
-    fsync(fd);
-    close(router->binlog_fd);
-    spinlock_acquire(&router->binlog_lock);
-    memmove(router->binlog_name, file, BINLOG_FNAMELEN);
-    router->current_pos = lseek(fd, 0L, SEEK_END);
-    if (router->current_pos < 4)
+    if (!EVP_EncryptInit_ex(ctx, cipher, NULL, router->encryption_key, iv) ||
+        !EVP_EncryptUpdate(ctx, buf, &outlen, buf, len))
     {
-        if (router->current_pos == 0)
-        {
-            if (blr_file_add_magic(fd))
-            {
-                router->current_pos = BINLOG_MAGIC_SIZE;
-                router->binlog_position = BINLOG_MAGIC_SIZE;
-                router->current_safe_event = BINLOG_MAGIC_SIZE;
-                router->last_written = BINLOG_MAGIC_SIZE;
-                router->last_event_pos = 0;
-            }
-            else
-            {
-                MXS_ERROR("%s: Could not write magic to binlog file.", router->service->name);
-            }
-        }
-        else
-        {
-            /* If for any reason the file's length is between 1 and 3 bytes
-             * then report an error. */
-            MXS_ERROR("%s: binlog file %s has an invalid length %lu.",
-                      router->service->name, path, router->current_pos);
-            close(fd);
-            spinlock_release(&router->binlog_lock);
-            return;
-        }
+        MXS_ERROR("%s: Binlog encryption failed for the event at %lu of %s.",
+                  router->service->name, (unsigned long)pos, binlog);
+        EVP_CIPHER_CTX_free(ctx);
+        return 0;
     }
-    router->binlog_fd = fd;
-    spinlock_release(&router->binlog_lock);
+    EVP_CIPHER_CTX_free(ctx);
+    return 1;
 }
 
 /**
- * Write a binlog entry to disk.
+ * Load the binlog encryption key of the router from a file.
  *
- * @param router The router instance
- * @param buf    The binlog record
- * @param len    The length of the binlog record
- * @return       Return the number of bytes written
+ * The file holds the key as a single line of hexadecimal digits; 32, 48
+ * or 64 digits for a 128, 192 or 256 bit AES key respectively.
+ *
+ * @param   router  The router instance to load the key into
+ * @param   path    Path of the key file
+ * @return  0 on success, -1 if the key could not be loaded
  */
 int
-blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size, uint8_t *buf)
+blr_file_load_encryption_key(ROUTER_INSTANCE *router, char *path)
 {
-    int n;
+    FILE *fp;
+    char hex[2 * BLR_ENC_KEY_MAXLEN + 2];
+    int i, len;
 
-    if ((n = pwrite(router->binlog_fd, buf, size,
-                    router->last_written)) != size)
+    if ((fp = fopen(path, "r")) == NULL)
     {
         char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
-                  router->binlog_name,
+        MXS_ERROR("%s: Failed to open the binlog encryption key file '%s': %s",
+                  router->service->name, path,
                   strerror_r(errno, err_msg, sizeof(err_msg)));
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->last_written))
+        return -1;
+    }
+    if (fgets(hex, sizeof(hex), fp) == NULL)
+    {
+        MXS_ERROR("%s: The binlog encryption key file '%s' is empty.",
+                  router->service->name, path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    len = strlen(hex);
+    while (len > 0 && isspace(hex[len - 1]))
+    {
+        hex[--len] = '\0';
+    }
+    if (len != 32 && len != 48 && len != 64)
+    {
+        MXS_ERROR("%s: The binlog encryption key in '%s' must be 32, 48 or "
+                  "64 hexadecimal digits.", router->service->name, path);
+        return -1;
+    }
+    for (i = 0; i < len; i += 2)
+    {
+        char byte[3] = { hex[i], hex[i + 1], '\0' };
+        char *endptr;
+
+        router->encryption_key[i / 2] = strtol(byte, &endptr, 16);
+        if (*endptr != '\0')
         {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->last_written,
-                      router->binlog_name,
-                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            MXS_ERROR("%s: Invalid hexadecimal digit in the binlog "
+                      "encryption key file '%s'.",
+                      router->service->name, path);
+            return -1;
         }
-        return 0;
     }
-    spinlock_acquire(&router->binlog_lock);
-    router->current_pos = hdr->next_pos;
-    router->last_written += size;
-    router->last_event_pos = hdr->next_pos - hdr->event_size;
-    spinlock_release(&router->binlog_lock);
-    return n;
-}
-
-/**
- * Flush the content of the binlog file to disk.
- *
- * @param   router  The binlog router
- */
-void
-blr_file_flush(ROUTER_INSTANCE *router)
-{
-    fsync(router->binlog_fd);
+    router->encryption_key_len = len / 2;
+    return 0;
 }
 
 /**
@@ -423,11 +1616,37 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     file->cache = 0;
     spinlock_init(&file->lock);
 
-    strncpy(path, router->binlogdir, PATH_MAX);
-    strncat(path, "/", PATH_MAX - strlen(path));
-    strncat(path, binlog, PATH_MAX - strlen(path));
-
-    if ((file->fd = open(path, O_RDONLY, 0666)) == -1)
+    /*
+     * Look for the file in the binlog directory first and then in the
+     * archive directory if one is configured, trying the plain file and
+     * then a compressed copy of a closed binlog file in each. This is
+     * what lets a catching-up slave chain from the archived tier back
+     * onto the fast tier without noticing the move.
+     */
+    const char *dirs[2];
+    int ndirs = 1, d;
+
+    dirs[0] = router->binlogdir;
+    if (router->archivedir != NULL)
+    {
+        dirs[ndirs++] = router->archivedir;
+    }
+    file->fd = -1;
+    for (d = 0; d < ndirs && file->fd == -1; d++)
+    {
+        snprintf(path, PATH_MAX, "%s/%s", dirs[d], binlog);
+        if ((file->fd = open(path, O_RDONLY, 0666)) == -1)
+        {
+            strncat(path, BLRZ_SUFFIX, PATH_MAX - strlen(path));
+            if ((file->fd = open(path, O_RDONLY, 0666)) != -1 &&
+                (file->zfile = blr_zfile_open(file->fd)) == NULL)
+            {
+                close(file->fd);
+                file->fd = -1;
+            }
+        }
+    }
+    if (file->fd == -1)
     {
         MXS_ERROR("Failed to open binlog file %s", path);
         free(file);
@@ -435,6 +1654,21 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
         return NULL;
     }
 
+    /*
+     * Map the file so that catch-up reads can be served straight from
+     * the mapped pages. The mapping covers the file size at open time;
+     * reads beyond it, i.e. of records written while this is the
+     * current binlog, fall back to pread. An encrypted binlog is never
+     * mapped since its events must be decrypted into a private copy
+     * before they can be sent to a slave.
+     */
+    struct stat statb;
+    if (file->zfile == NULL && router->encrypt_binlogs == 0 &&
+        fstat(file->fd, &statb) == 0 && statb.st_size > 0)
+    {
+        file->map = blr_map_binlog(file->fd, statb.st_size);
+    }
+
     file->next = router->files;
     router->files = file;
     spinlock_release(&router->fileslock);
@@ -474,8 +1708,23 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
         return NULL;
     }
 
+    /* The requested record may still be sitting in the append buffer
+     * of the router; write it out before looking at the file */
+    spinlock_acquire(&router->binlog_lock);
+    if (router->wbuffer_len > 0 &&
+        pos >= router->wbuffer_start &&
+        strcmp(file->binlogname, router->binlog_name) == 0)
+    {
+        blr_append_flush_nolock(router);
+    }
+    spinlock_release(&router->binlog_lock);
+
     spinlock_acquire(&file->lock);
-    if (fstat(file->fd, &statb) == 0)
+    if (file->zfile)
+    {
+        filelen = file->zfile->length;
+    }
+    else if (fstat(file->fd, &statb) == 0)
     {
         filelen = statb.st_size;
     }
@@ -548,8 +1797,24 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     spinlock_release(&file->lock);
     spinlock_release(&router->binlog_lock);
 
-    /* Read the header information from the file */
-    if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+    /* Serve the event from the in-memory event cache when it holds it */
+    if (router->event_cache &&
+        (result = blr_cache_read_event(router, file->binlogname, pos, hdr)) != NULL)
+    {
+        return result;
+    }
+
+    /* Read the header information from the mapping or the file */
+    if (file->map && pos + BINLOG_EVENT_HDR_LEN <= file->map->len)
+    {
+        memcpy(hdbuf, file->map->ptr + pos, BINLOG_EVENT_HDR_LEN);
+        n = BINLOG_EVENT_HDR_LEN;
+    }
+    else
+    {
+        n = blr_file_read(file, hdbuf, BINLOG_EVENT_HDR_LEN, pos);
+    }
+    if (n != BINLOG_EVENT_HDR_LEN)
     {
         switch (n)
         {
@@ -633,7 +1898,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                   pos, file->binlogname, filelen, router->binlog_position,
                   router->binlog_name);
 
-        if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_file_read(file, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -688,6 +1953,31 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                       "rereading");
         }
     }
+    /*
+     * When the whole event lies within the mapping, hand out a buffer
+     * that references the mapped pages directly rather than copying the
+     * event. The buffer takes its own reference on the mapping, which is
+     * dropped when the last clone of the buffer is freed.
+     */
+    if (file->map && pos + hdr->event_size <= file->map->len)
+    {
+        atomic_add(&file->map->refcnt, 1);
+        if ((result = gwbuf_alloc_referenced(file->map->ptr + pos, hdr->event_size,
+                                             blr_mapping_release, file->map)) == NULL)
+        {
+            blr_mapping_release(file->map);
+            snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
+                     "Failed to allocate memory for binlog entry, size %d, event at %lu in binlog file '%s'",
+                     hdr->event_size, pos, file->binlogname);
+            return NULL;
+        }
+
+        /* set OK indicator */
+        hdr->ok = SLAVE_POS_READ_OK;
+
+        return result;
+    }
+
     if ((result = gwbuf_alloc(hdr->event_size)) == NULL)
     {
         snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
@@ -700,8 +1990,9 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
 
     memcpy(data, hdbuf, BINLOG_EVENT_HDR_LEN);  // Copy the header in
 
-    if ((n = pread(file->fd, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
-                   pos + BINLOG_EVENT_HDR_LEN))
+    if ((n = blr_file_read(file, &data[BINLOG_EVENT_HDR_LEN],
+                           hdr->event_size - BINLOG_EVENT_HDR_LEN,
+                           pos + BINLOG_EVENT_HDR_LEN))
         != hdr->event_size - BINLOG_EVENT_HDR_LEN)  // Read the balance
     {
         if (n == -1)
@@ -735,6 +2026,14 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
         return NULL;
     }
 
+    /* Decrypt the event body when the binlog files are encrypted */
+    if (router->encrypt_binlogs && hdr->event_size > BINLOG_EVENT_HDR_LEN)
+    {
+        blr_file_crypt(router, file->binlogname, pos,
+                       &data[BINLOG_EVENT_HDR_LEN],
+                       hdr->event_size - BINLOG_EVENT_HDR_LEN);
+    }
+
     /* set OK indicator */
     hdr->ok = SLAVE_POS_READ_OK;
 
@@ -782,6 +2081,14 @@ blr_close_binlog(ROUTER_INSTANCE *router, BLFILE *file)
 
     if (file)
     {
+        if (file->map)
+        {
+            blr_mapping_release(file->map);
+        }
+        if (file->zfile)
+        {
+            blr_zfile_free(file->zfile);
+        }
         close(file->fd);
         file->fd = -1;
         free(file);
@@ -821,6 +2128,10 @@ blr_file_size(BLFILE *file)
 {
     struct stat statb;
 
+    if (file->zfile)
+    {
+        return file->zfile->length;
+    }
     if (fstat(file->fd, &statb) == 0)
     {
         return statb.st_size;
@@ -931,7 +2242,12 @@ blr_file_next_exists(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     sprintf(bigbuf, "%s/%s", router->binlogdir, buf);
     if (access(bigbuf, R_OK) == -1)
     {
-        return 0;
+        /* The next file may only exist as a compressed copy */
+        strcat(bigbuf, BLRZ_SUFFIX);
+        if (access(bigbuf, R_OK) == -1)
+        {
+            return 0;
+        }
     }
     return 1;
 }
@@ -996,6 +2312,24 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
         filelen = statb.st_size;
     }
 
+    /* Rather than parsing forward from the start of the file, resume
+     * from the last position recorded in the index of the binlog file.
+     * Every index entry was written on a transaction boundary, so it is
+     * a valid place to start parsing from; the transaction summary then
+     * only covers the events after the resume point. The debug flag
+     * forces a full scan. */
+    if (!debug && (pos = blr_index_last_pos(router)) > 4 && pos < filelen)
+    {
+        last_known_commit = pos;
+        MXS_NOTICE("%s: Resuming scan of binlog file %s from indexed "
+                   "position %llu.",
+                   router->service->name, router->binlog_name, pos);
+    }
+    else
+    {
+        pos = 4;
+    }
+
     router->current_pos = 4;
     router->binlog_position = 4;
     router->current_safe_event = 4;
@@ -1320,6 +2654,14 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
             return 1;
         }
 
+        /* Decrypt the event body when the binlog files are encrypted */
+        if (router->encrypt_binlogs && hdr.event_size > BINLOG_EVENT_HDR_LEN)
+        {
+            blr_file_crypt(router, router->binlog_name, pos,
+                           &data[BINLOG_EVENT_HDR_LEN],
+                           hdr.event_size - BINLOG_EVENT_HDR_LEN);
+        }
+
         /* check for pending transaction */
         if (pending_transaction == 0)
         {
@@ -1477,6 +2819,11 @@ blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug)
                 domainid = extract_field(ptr + 8, 32);
                 flags = *(ptr + 8 + 4);
 
+                /* Rebuild the in-memory GTID index for the current
+                 * binlog file as part of the startup scan */
+                blr_gtid_record(router, domainid, hdr.serverid,
+                                n_sequence, router->binlog_name, pos);
+
                 if (flags == 0)
                 {
                     if (pending_transaction > 0)
@@ -51,6 +51,16 @@
  *                                  It's no longer using QUERY_EVENT with BEGIN
  * 25/09/2015   Massimiliano Pinto  Addition of lastEventReceived for slaves
  * 23/10/15     Markus Makela       Added current_safe_event
+ * 03/07/2016   Mark Riddoch        Batch the events of a master read and distribute
+ *                                  each batch to the slaves in a single pass over
+ *                                  the slave list
+ * 03/07/2016   Mark Riddoch        Distribute events to the CDC output stage
+ * 05/07/2016   Mark Riddoch        MariaDB 10 GTID events recorded in the GTID
+ *                                  index so GTID registered slaves can be
+ *                                  seeked to a binlog file and offset
+ * 05/07/2016   Mark Riddoch        Fixed layout events decoded with unaligned
+ *                                  loads; BEGIN/COMMIT detected in place
+ *                                  without copying the query event payload
  *
  * @endverbatim
  */
@@ -88,6 +98,7 @@ void encode_value(unsigned char *data, unsigned int value, int len);
 void blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt);
 static int  blr_rotate_event(ROUTER_INSTANCE *router, uint8_t *pkt, REP_HEADER *hdr);
 void blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
+static void blr_wake_catchup_slaves(ROUTER_INSTANCE *router);
 static void *CreateMySQLAuthData(char *username, char *password, char *database);
 void blr_extract_header(uint8_t *pkt, REP_HEADER *hdr);
 static void blr_log_packet(int priority, char *msg, uint8_t *ptr, int len);
@@ -106,6 +117,48 @@ int blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8
 bool blr_send_event(ROUTER_SLAVE *slave, REP_HEADER *hdr, uint8_t *buf);
 void extract_checksum(ROUTER_INSTANCE* router, uint8_t *cksumptr, uint8_t len);
 
+/**
+ * A burst of replication events accumulated while processing one read from
+ * the master and distributed to the slaves in a single pass over the slave
+ * list, rather than taking the slave list lock once for every event. Row
+ * based replication of a busy master generates tens of thousands of small
+ * events per second and the repeated lock and list traversal dominated the
+ * distribution cost.
+ *
+ * The pointers handed to blr_handle_binlog_record point into the GWBUF
+ * chain being consumed, or into a temporary buffer that is freed as soon
+ * as the event has been processed, so an event is copied into the arena
+ * of the batch when it is queued. The positions the distribution logic
+ * compares the slave position against are recorded with each event, as
+ * the live values in the router will have moved on by the time the batch
+ * is flushed.
+ */
+#define BLR_BATCH_NEVENTS       64              /*< Maximum events held in a batch */
+#define BLR_BATCH_ARENA         (32 * 1024)     /*< Event data held in a batch */
+
+typedef struct
+{
+    REP_HEADER      hdr;            /*< The replication header of the event */
+    uint8_t         *ptr;           /*< The event data, within the batch arena */
+    uint64_t        safe_event;     /*< router->current_safe_event when queued */
+    uint64_t        last_pos;       /*< router->last_event_pos when queued */
+} BLR_BATCHED_EVENT;
+
+typedef struct
+{
+    BLR_BATCHED_EVENT   events[BLR_BATCH_NEVENTS];
+    int                 n_events;   /*< Number of events queued in the batch */
+    unsigned int        used;       /*< Bytes of the arena in use */
+    uint8_t             arena[BLR_BATCH_ARENA];
+} BLR_EVENT_BATCH;
+
+static void blr_batch_binlog_record(ROUTER_INSTANCE *router, BLR_EVENT_BATCH *batch,
+                                    REP_HEADER *hdr, uint8_t *ptr);
+static void blr_distribute_binlog_batch(ROUTER_INSTANCE *router, BLR_EVENT_BATCH *batch);
+static void blr_distribute_event_to_slave(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave,
+                                          REP_HEADER *hdr, uint8_t *ptr,
+                                          uint64_t safe_event, uint64_t last_pos);
+
 static int keepalive = 1;
 
 /**
@@ -702,6 +755,9 @@ blr_master_response(ROUTER_INSTANCE *router, GWBUF *buf)
         /* Log binlog router identity */
         blr_log_identity(router);
 
+        /* Restart any slave that went idle while the master was away */
+        blr_wake_catchup_slaves(router);
+
         break;
     case BLRM_BINLOGDUMP:
         /**
@@ -862,6 +918,10 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
     int preslen = -1;
     int prev_length = -1;
     int n_bufs = -1, pn_bufs = -1;
+    BLR_EVENT_BATCH batch;
+
+    batch.n_events = 0;
+    batch.used = 0;
 
     /*
      * Prepend any residual buffer to the buffer chain we have
@@ -1133,6 +1193,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                         {
                             pkt = GWBUF_CONSUME_ALL(pkt);
                         }
+                        blr_distribute_binlog_batch(router, &batch);
                         blr_master_close(router);
                         blr_master_delayed_connect(router);
                         return;
@@ -1187,6 +1248,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                                   "binlog %s @ %lu. Closing master connection.",
                                   router->service->name, router->binlog_name,
                                   router->current_pos);
+                        blr_distribute_binlog_batch(router, &batch);
                         blr_master_close(router);
                         blr_master_delayed_connect(router);
                         return;
@@ -1227,6 +1289,23 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                  * Only complete transactions should be sent to sleves
                 */
 
+                /*
+                 * Record MariaDB 10 GTID events in the GTID index as they
+                 * arrive, so that a GTID registered slave can later be
+                 * mapped to a binlog file and offset.
+                 */
+                if (router->mariadb10_compat &&
+                    router->master_event_state == BLR_EVENT_DONE &&
+                    hdr.event_type == MARIADB10_GTID_EVENT)
+                {
+                    uint64_t n_sequence = EXTRACT64(ptr + 4 + 20);
+                    uint32_t domainid = EXTRACT32(ptr + 4 + 20 + 8);
+
+                    blr_gtid_record(router, domainid, hdr.serverid,
+                                    n_sequence, router->binlog_name,
+                                    router->current_pos);
+                }
+
                 /* If MariaDB 10 compatibility:
                 * check for MARIADB10_GTID_EVENT with flags = 0
                   * This marks the transaction starts instead of
@@ -1241,8 +1320,8 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                             uint64_t n_sequence;
                             uint32_t domainid;
                             unsigned int flags;
-                            n_sequence = extract_field(ptr + 4 + 20, 64);
-                            domainid = extract_field(ptr + 4 + 20 + 8, 32);
+                            n_sequence = EXTRACT64(ptr + 4 + 20);
+                            domainid = EXTRACT32(ptr + 4 + 20 + 8);
                             flags = *(ptr + 4 + 20 + 8 + 4);
 
                             if (flags == 0)
@@ -1281,16 +1360,19 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                         db_name_len = ptr[4 + 20 + 4 + 4];
                         var_block_len = ptr[4 + 20 + 4 + 4 + 1 + 2];
 
+                        /* The statement is examined in place; only the
+                         * few leading bytes that distinguish BEGIN and
+                         * COMMIT are read, the bulk of the statement is
+                         * simply forwarded and is never copied.
+                         */
                         statement_len = len - (4 + 20 + 4 + 4 + 1 + 2 + 2 + var_block_len + 1 + db_name_len);
-                        statement_sql = calloc(1, statement_len + 1);
-                        strncpy(statement_sql,
-                                (char *)ptr + 4 + 20 + 4 + 4 + 1 + 2 + 2 + var_block_len + 1 + db_name_len,
-                                statement_len);
+                        statement_sql = (char *)ptr + 4 + 20 + 4 + 4 + 1 + 2 + 2 + var_block_len + 1 + db_name_len;
 
                         spinlock_acquire(&router->binlog_lock);
 
                         /* Check for BEGIN (it comes for START TRANSACTION too) */
-                        if (strncmp(statement_sql, "BEGIN", 5) == 0)
+                        if (statement_len >= 5 &&
+                            strncmp(statement_sql, "BEGIN", 5) == 0)
                         {
                             if (router->pending_transaction > 0)
                             {
@@ -1306,14 +1388,13 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                         }
 
                         /* Check for COMMIT in non transactional store engines */
-                        if (strncmp(statement_sql, "COMMIT", 6) == 0)
+                        if (statement_len >= 6 &&
+                            strncmp(statement_sql, "COMMIT", 6) == 0)
                         {
                             router->pending_transaction = 2;
                         }
 
                         spinlock_release(&router->binlog_lock);
-
-                        free(statement_sql);
                     }
 
                     /* Check for COMMIT in Transactional engines, i.e InnoDB */
@@ -1435,6 +1516,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                             {
                                 ;
                             }
+                            blr_distribute_binlog_batch(router, &batch);
                             blr_master_close(router);
                             blr_master_delayed_connect(router);
                             return;
@@ -1443,6 +1525,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                         /* Check for rotete event */
                         if (hdr.event_type == ROTATE_EVENT)
                         {
+                            blr_distribute_binlog_batch(router, &batch);
                             if (!blr_rotate_event(router, ptr, &hdr))
                             {
                                 /*
@@ -1485,7 +1568,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                                 if (record)
                                 {
                                     uint8_t *data = GWBUF_DATA(record);
-                                    blr_distribute_binlog_record(router, &hdr, data);
+                                    blr_batch_binlog_record(router, &batch, &hdr, data);
                                     gwbuf_free(record);
                                 }
                                 else
@@ -1498,7 +1581,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                             else
                             {
                                 /* Now distribute events */
-                                blr_distribute_binlog_record(router, &hdr, ptr);
+                                blr_batch_binlog_record(router, &batch, &hdr, ptr);
                             }
                         }
                         else
@@ -1537,7 +1620,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                                     raw_data = GWBUF_DATA(record);
 
                                     /* distribute event */
-                                    blr_distribute_binlog_record(router, &new_hdr, raw_data);
+                                    blr_batch_binlog_record(router, &batch, &new_hdr, raw_data);
 
                                     spinlock_acquire(&router->binlog_lock);
 
@@ -1555,6 +1638,9 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                                     gwbuf_free(record);
                                 }
 
+                                /* Deliver the transaction before any error message */
+                                blr_distribute_binlog_batch(router, &batch);
+
                                 /* Check whether binlog records has been read in previous loop */
                                 if (pos < router->current_pos)
                                 {
@@ -1622,6 +1708,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                         ptr += 5;
                         if (hdr.event_type == ROTATE_EVENT)
                         {
+                            blr_distribute_binlog_batch(router, &batch);
                             spinlock_acquire(&router->binlog_lock);
                             router->rotating = 1;
                             spinlock_release(&router->binlog_lock);
@@ -1713,6 +1800,7 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
     {
         ss_dassert(pkt_length == 0);
     }
+    blr_distribute_binlog_batch(router, &batch);
     blr_file_flush(router);
 }
 
@@ -1754,9 +1842,7 @@ blr_rotate_event(ROUTER_INSTANCE *router, uint8_t *ptr, REP_HEADER *hdr)
 
     ptr += 19;      // Skip event header
     len = hdr->event_size - 19; // Event size minus header
-    pos = extract_field(ptr + 4, 32);
-    pos <<= 32;
-    pos |= extract_field(ptr, 32);
+    pos = EXTRACT64(ptr);
     slen = len - (8 + 4);       // Allow for position and CRC
     if (router->master_chksum == 0)
     {
@@ -1833,7 +1919,55 @@ typedef enum
 } slave_event_action_t;
 
 /**
- * Distribute the binlog record we have just received to all the registered slaves.
+ * Wake up the slaves that are in catchup mode but have no catchup work
+ * scheduled.
+ *
+ * A slave in catchup mode keeps scheduling fake write events for itself
+ * only while the master connection is up. A slave that went idle while
+ * the master was away is restarted here when the binlog dump resumes;
+ * the distribution of incoming events no longer visits lagging slaves.
+ *
+ * @param   router      The router instance
+ */
+static void
+blr_wake_catchup_slaves(ROUTER_INSTANCE *router)
+{
+    ROUTER_SLAVE *slave;
+
+    spinlock_acquire(&router->lock);
+    slave = router->slaves;
+    while (slave)
+    {
+        if (slave->state == BLRS_DUMPING)
+        {
+            spinlock_acquire(&slave->catch_lock);
+            if ((slave->cstate & (CS_UPTODATE | CS_EXPECTCB | CS_BUSY)) == 0)
+            {
+                slave->cstate |= CS_EXPECTCB;
+                spinlock_release(&slave->catch_lock);
+                poll_fake_write_event(slave->dcb);
+            }
+            else
+            {
+                spinlock_release(&slave->catch_lock);
+            }
+        }
+        slave = slave->next;
+    }
+    spinlock_release(&router->lock);
+}
+
+/**
+ * Distribute the binlog record we have just received to the registered slaves
+ * that are at the head of the binlog.
+ *
+ * Only slaves with CS_UPTODATE set are visited; a slave that is behind
+ * serves itself from the binlog files through the catchup path, which
+ * keeps scheduling fake write events for itself until it reaches the
+ * head. When no slave is at the head the slave list is not walked nor
+ * locked at all. The cstate is peeked without the catch_lock here; a
+ * slave that loses the head between the peek and the locked check in
+ * blr_distribute_event_to_slave is simply forced into catchup.
  *
  * @param   router      The router instance
  * @param   hdr     The replication event header
@@ -1843,205 +1977,342 @@ void
 blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
 {
     ROUTER_SLAVE *slave;
-    int action;
-    unsigned int cstate;
+    uint64_t safe_event, last_pos;
+
+    spinlock_acquire(&router->binlog_lock);
+    safe_event = router->current_safe_event;
+    last_pos = router->last_event_pos;
+    spinlock_release(&router->binlog_lock);
+
+    blr_cdc_distribute(router, hdr, ptr);
+
+    if (router->n_uptodate == 0)
+    {
+        return;
+    }
 
     spinlock_acquire(&router->lock);
     slave = router->slaves;
     while (slave)
     {
-        if (slave->state != BLRS_DUMPING)
+        if (slave->state == BLRS_DUMPING && (slave->cstate & CS_UPTODATE))
         {
-            slave = slave->next;
-            continue;
+            blr_distribute_event_to_slave(router, slave, hdr, ptr,
+                                          safe_event, last_pos);
         }
-        spinlock_acquire(&slave->catch_lock);
-        if ((slave->cstate & (CS_UPTODATE | CS_BUSY)) == CS_UPTODATE)
+        slave = slave->next;
+    }
+    spinlock_release(&router->lock);
+}
+
+/**
+ * Queue a binlog record for distribution to the slaves.
+ *
+ * The event is copied into the arena of the batch together with the
+ * distribution positions of the router at the time it was queued; the
+ * whole batch is later delivered by blr_distribute_binlog_batch in a
+ * single pass over the slave list. An event too large for the arena is
+ * distributed immediately, after flushing the events queued before it
+ * so that the slaves see the events in order.
+ *
+ * @param   router      The router instance
+ * @param   batch       The batch the event is queued in
+ * @param   hdr     The replication event header
+ * @param   ptr     The raw replication event data
+ */
+static void
+blr_batch_binlog_record(ROUTER_INSTANCE *router, BLR_EVENT_BATCH *batch,
+                        REP_HEADER *hdr, uint8_t *ptr)
+{
+    BLR_BATCHED_EVENT *event;
+
+    if (hdr->event_size > BLR_BATCH_ARENA)
+    {
+        blr_distribute_binlog_batch(router, batch);
+        blr_distribute_binlog_record(router, hdr, ptr);
+        return;
+    }
+    if (batch->n_events == BLR_BATCH_NEVENTS ||
+        batch->used + hdr->event_size > BLR_BATCH_ARENA)
+    {
+        blr_distribute_binlog_batch(router, batch);
+    }
+
+    event = &batch->events[batch->n_events++];
+    memcpy(&event->hdr, hdr, sizeof(REP_HEADER));
+    event->ptr = &batch->arena[batch->used];
+    memcpy(event->ptr, ptr, hdr->event_size);
+    batch->used += hdr->event_size;
+
+    spinlock_acquire(&router->binlog_lock);
+    event->safe_event = router->current_safe_event;
+    event->last_pos = router->last_event_pos;
+    spinlock_release(&router->binlog_lock);
+}
+
+/**
+ * Distribute the queued binlog records of a batch to the registered
+ * slaves at the head of the binlog.
+ *
+ * The slave list lock is taken once for the whole batch and the events
+ * are applied to each slave in the order they arrived from the master.
+ * The polling loop corks the writes made by an event handler, so the
+ * events sent to a slave here leave its socket in a single writev when
+ * the handler returns.
+ *
+ * @param   router      The router instance
+ * @param   batch       The batch to distribute, empty on return
+ */
+static void
+blr_distribute_binlog_batch(ROUTER_INSTANCE *router, BLR_EVENT_BATCH *batch)
+{
+    ROUTER_SLAVE *slave;
+    int i;
+
+    if (batch->n_events == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < batch->n_events; i++)
+    {
+        blr_cdc_distribute(router, &batch->events[i].hdr, batch->events[i].ptr);
+    }
+
+    if (router->n_uptodate == 0)
+    {
+        batch->n_events = 0;
+        batch->used = 0;
+        return;
+    }
+
+    spinlock_acquire(&router->lock);
+    slave = router->slaves;
+    while (slave)
+    {
+        if (slave->state == BLRS_DUMPING && (slave->cstate & CS_UPTODATE))
         {
-            /*
-             * This slave is reporting it is to date with the binlog of the
-             * master running on this slave.
-             * It has no thread running currently that is sending binlog
-             * events.
+            for (i = 0; i < batch->n_events; i++)
+            {
+                BLR_BATCHED_EVENT *event = &batch->events[i];
+
+                blr_distribute_event_to_slave(router, slave, &event->hdr,
+                                              event->ptr, event->safe_event,
+                                              event->last_pos);
+            }
+        }
+        slave = slave->next;
+    }
+    spinlock_release(&router->lock);
+
+    batch->n_events = 0;
+    batch->used = 0;
+}
+
+/**
+ * Distribute one binlog record to a single slave. The caller must hold the
+ * slave list lock of the router.
+ *
+ * @param   router      The router instance
+ * @param   slave       The slave to distribute the event to
+ * @param   hdr     The replication event header
+ * @param   ptr     The raw replication event data
+ * @param   safe_event  current_safe_event of the router when the event was queued
+ * @param   last_pos    last_event_pos of the router when the event was queued
+ */
+static void
+blr_distribute_event_to_slave(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave,
+                              REP_HEADER *hdr, uint8_t *ptr,
+                              uint64_t safe_event, uint64_t last_pos)
+{
+    int action;
+    unsigned int cstate;
+
+    spinlock_acquire(&slave->catch_lock);
+    if ((slave->cstate & (CS_UPTODATE | CS_BUSY)) == CS_UPTODATE)
+    {
+        /*
+         * This slave is reporting it is to date with the binlog of the
+         * master running on this slave.
+         * It has no thread running currently that is sending binlog
+         * events.
+         */
+        action = 1;
+        slave->cstate |= CS_BUSY;
+    }
+    else if ((slave->cstate & (CS_UPTODATE | CS_BUSY)) == (CS_UPTODATE | CS_BUSY))
+    {
+        /*
+         * The slave is up to date with the binlog and a process is
+         * running on this slave to send binlog events.
+         */
+        slave->overrun = 1;
+        action = 2;
+    }
+    else if ((slave->cstate & CS_UPTODATE) == 0)
+    {
+        /* Slave is in catchup mode */
+        action = 3;
+    }
+    else
+    {
+        MXS_ERROR("slave->cstate does not contain a meaningful state %d", slave->cstate);
+        action = 0;
+    }
+    slave->stats.n_actions[action - 1]++;
+    spinlock_release(&slave->catch_lock);
+
+    if (action == 1)
+    {
+        spinlock_acquire(&router->binlog_lock);
+
+        slave_event_action_t slave_action = SLAVE_FORCE_CATCHUP;
+
+        if (router->trx_safe && slave->binlog_pos == safe_event &&
+            (strcmp(slave->binlogfile, router->binlog_name) == 0 ||
+             (hdr->event_type == ROTATE_EVENT &&
+              strcmp(slave->binlogfile, router->prevbinlog))))
+        {
+            /**
+             * Slave needs the current event being distributed
              */
-            action = 1;
-            slave->cstate |= CS_BUSY;
+            slave_action = SLAVE_SEND_EVENT;
         }
-        else if ((slave->cstate & (CS_UPTODATE | CS_BUSY)) == (CS_UPTODATE | CS_BUSY))
+        else if (slave->binlog_pos == last_pos &&
+                 (strcmp(slave->binlogfile, router->binlog_name) == 0 ||
+                  (hdr->event_type == ROTATE_EVENT &&
+                   strcmp(slave->binlogfile, router->prevbinlog))))
         {
-            /*
-             * The slave is up to date with the binlog and a process is
-             * running on this slave to send binlog events.
+            /**
+             * Transaction safety is off or there are no pending transactions
              */
-            slave->overrun = 1;
-            action = 2;
+
+            slave_action = SLAVE_SEND_EVENT;
         }
-        else if ((slave->cstate & CS_UPTODATE) == 0)
+        else if (slave->binlog_pos == hdr->next_pos
+                 && strcmp(slave->binlogfile, router->binlog_name) == 0)
         {
-            /* Slave is in catchup mode */
-            action = 3;
+            /*
+             * Slave has already read record from file, no
+             * need to distrbute this event
+             */
+            slave_action = SLAVE_EVENT_ALREADY_SENT;
         }
-        else
+        else if ((slave->binlog_pos > hdr->next_pos - hdr->event_size)
+                 && strcmp(slave->binlogfile, router->binlog_name) == 0)
         {
-            MXS_ERROR("slave->cstate does not contain a meaningful state %d", slave->cstate);
-            action = 0;
+            /*
+             * The slave is ahead of the master, this should never
+             * happen. Force the slave to catchup mode in order to
+             * try to resolve the issue.
+             */
+            MXS_ERROR("Slave %d is ahead of expected position %s@%lu. "
+                      "Expected position %d",
+                      slave->serverid, slave->binlogfile,
+                      (unsigned long)slave->binlog_pos,
+                      hdr->next_pos - hdr->event_size);
         }
-        slave->stats.n_actions[action - 1]++;
-        spinlock_release(&slave->catch_lock);
 
-        if (action == 1)
-        {
-            spinlock_acquire(&router->binlog_lock);
+        spinlock_release(&router->binlog_lock);
 
-            slave_event_action_t slave_action = SLAVE_FORCE_CATCHUP;
+        /*
+         * If slave_action is SLAVE_FORCE_CATCHUP then
+         * the slave is not at the position it should be. Force it into
+         * catchup mode rather than send this event.
+         */
+
+        switch (slave_action)
+        {
+        case SLAVE_SEND_EVENT:
+            /*
+             * The slave should be up to date, check that the binlog
+             * position matches the event we have to distribute or
+             * this is a rotate event. Send the event directly from
+             * memory to the slave.
+             */
+            slave->lastEventTimestamp = hdr->timestamp;
+            slave->lastEventReceived = hdr->event_type;
 
-            if (router->trx_safe && slave->binlog_pos == router->current_safe_event &&
-                (strcmp(slave->binlogfile, router->binlog_name) == 0 ||
-                 (hdr->event_type == ROTATE_EVENT &&
-                  strcmp(slave->binlogfile, router->prevbinlog))))
+            /* set lastReply */
+            if (router->send_slave_heartbeat)
             {
-                /**
-                 * Slave needs the current event being distributed
-                 */
-                slave_action = SLAVE_SEND_EVENT;
+                slave->lastReply = time(0);
             }
-            else if (slave->binlog_pos == router->last_event_pos &&
-                     (strcmp(slave->binlogfile, router->binlog_name) == 0 ||
-                      (hdr->event_type == ROTATE_EVENT &&
-                       strcmp(slave->binlogfile, router->prevbinlog))))
+
+            if (hdr->event_type == ROTATE_EVENT)
             {
-                /**
-                 * Transaction safety is off or there are no pending transactions
-                 */
+                blr_slave_rotate(router, slave, ptr);
+            }
+
+            blr_send_event(slave, hdr, ptr);
 
-                slave_action = SLAVE_SEND_EVENT;
+            spinlock_acquire(&slave->catch_lock);
+            if (hdr->event_type != ROTATE_EVENT)
+            {
+                slave->binlog_pos = hdr->next_pos;
             }
-            else if (slave->binlog_pos == hdr->next_pos
-                     && strcmp(slave->binlogfile, router->binlog_name) == 0)
+            if (slave->overrun)
             {
-                /*
-                 * Slave has already read record from file, no
-                 * need to distrbute this event
-                 */
-                slave_action = SLAVE_EVENT_ALREADY_SENT;
+                slave->stats.n_overrun++;
+                slave->overrun = 0;
+                poll_fake_write_event(slave->dcb);
             }
-            else if ((slave->binlog_pos > hdr->next_pos - hdr->event_size)
-                     && strcmp(slave->binlogfile, router->binlog_name) == 0)
+            else
             {
-                /*
-                 * The slave is ahead of the master, this should never
-                 * happen. Force the slave to catchup mode in order to
-                 * try to resolve the issue.
-                 */
-                MXS_ERROR("Slave %d is ahead of expected position %s@%lu. "
-                          "Expected position %d",
-                          slave->serverid, slave->binlogfile,
-                          (unsigned long)slave->binlog_pos,
-                          hdr->next_pos - hdr->event_size);
+                slave->cstate &= ~CS_BUSY;
             }
+            spinlock_release(&slave->catch_lock);
+            break;
 
-            spinlock_release(&router->binlog_lock);
-
-            /*
-             * If slave_action is SLAVE_FORCE_CATCHUP then
-             * the slave is not at the position it should be. Force it into
-             * catchup mode rather than send this event.
-             */
+        case SLAVE_EVENT_ALREADY_SENT:
+            spinlock_acquire(&slave->catch_lock);
+            slave->cstate &= ~CS_BUSY;
+            spinlock_release(&slave->catch_lock);
+            break;
 
-            switch (slave_action)
+        case SLAVE_FORCE_CATCHUP:
+            spinlock_acquire(&slave->catch_lock);
+            cstate = slave->cstate;
+            blr_slave_clear_uptodate(router, slave);
+            slave->cstate &= ~CS_BUSY;
+            slave->cstate |= CS_EXPECTCB;
+            spinlock_release(&slave->catch_lock);
+            if ((cstate & CS_UPTODATE) == CS_UPTODATE)
             {
-            case SLAVE_SEND_EVENT:
-                /*
-                 * The slave should be up to date, check that the binlog
-                 * position matches the event we have to distribute or
-                 * this is a rotate event. Send the event directly from
-                 * memory to the slave.
-                 */
-                slave->lastEventTimestamp = hdr->timestamp;
-                slave->lastEventReceived = hdr->event_type;
-
-                /* set lastReply */
-                if (router->send_slave_heartbeat)
-                {
-                    slave->lastReply = time(0);
-                }
-
-                if (hdr->event_type == ROTATE_EVENT)
-                {
-                    blr_slave_rotate(router, slave, ptr);
-                }
-
-                blr_send_event(slave, hdr, ptr);
-
-                spinlock_acquire(&slave->catch_lock);
-                if (hdr->event_type != ROTATE_EVENT)
-                {
-                    slave->binlog_pos = hdr->next_pos;
-                }
-                if (slave->overrun)
-                {
-                    slave->stats.n_overrun++;
-                    slave->overrun = 0;
-                    poll_fake_write_event(slave->dcb);
-                }
-                else
-                {
-                    slave->cstate &= ~CS_BUSY;
-                }
-                spinlock_release(&slave->catch_lock);
-                break;
-
-            case SLAVE_EVENT_ALREADY_SENT:
-                spinlock_acquire(&slave->catch_lock);
-                slave->cstate &= ~CS_BUSY;
-                spinlock_release(&slave->catch_lock);
-                break;
-
-            case SLAVE_FORCE_CATCHUP:
-                spinlock_acquire(&slave->catch_lock);
-                cstate = slave->cstate;
-                slave->cstate &= ~(CS_UPTODATE | CS_BUSY);
-                slave->cstate |= CS_EXPECTCB;
-                spinlock_release(&slave->catch_lock);
-                if ((cstate & CS_UPTODATE) == CS_UPTODATE)
-                {
 #ifdef STATE_CHANGE_LOGGING_ENABLED
-                    MXS_NOTICE("%s: Slave %s:%d, server-id %d transition from "
-                               "up-to-date to catch-up in blr_distribute_binlog_record, "
-                               "binlog file '%s', position %lu.",
-                               router->service->name,
-                               slave->dcb->remote,
-                               ntohs((slave->dcb->ipv4).sin_port),
-                               slave->serverid,
-                               slave->binlogfile, (unsigned long)slave->binlog_pos);
+                MXS_NOTICE("%s: Slave %s:%d, server-id %d transition from "
+                           "up-to-date to catch-up in blr_distribute_event_to_slave, "
+                           "binlog file '%s', position %lu.",
+                           router->service->name,
+                           slave->dcb->remote,
+                           ntohs((slave->dcb->ipv4).sin_port),
+                           slave->serverid,
+                           slave->binlogfile, (unsigned long)slave->binlog_pos);
 #endif
-                }
-                poll_fake_write_event(slave->dcb);
-                break;
             }
+            poll_fake_write_event(slave->dcb);
+            break;
         }
-        else if (action == 3)
+    }
+    else if (action == 3)
+    {
+        /* Slave is not up to date
+         * Check if it is either expecting a callback or
+         * is busy processing a callback
+         */
+        spinlock_acquire(&slave->catch_lock);
+        if ((slave->cstate & (CS_EXPECTCB | CS_BUSY)) == 0)
         {
-            /* Slave is not up to date
-             * Check if it is either expecting a callback or
-             * is busy processing a callback
-             */
-            spinlock_acquire(&slave->catch_lock);
-            if ((slave->cstate & (CS_EXPECTCB | CS_BUSY)) == 0)
-            {
-                slave->cstate |= CS_EXPECTCB;
-                spinlock_release(&slave->catch_lock);
-                poll_fake_write_event(slave->dcb);
-            }
-            else
-            {
-                spinlock_release(&slave->catch_lock);
-            }
+            slave->cstate |= CS_EXPECTCB;
+            spinlock_release(&slave->catch_lock);
+            poll_fake_write_event(slave->dcb);
+        }
+        else
+        {
+            spinlock_release(&slave->catch_lock);
         }
-
-        slave = slave->next;
     }
-    spinlock_release(&router->lock);
+
 }
 
 /**
@@ -2710,3 +2981,321 @@ void extract_checksum(ROUTER_INSTANCE* router, uint8_t *cksumptr, uint8_t len)
         router->partial_checksum_bytes++;
     }
 }
+
+/**
+ * Binary search of the GTID index for the last interval whose key, the
+ * domain, server and starting sequence number, does not exceed the given
+ * GTID.
+ *
+ * The index spinlock must be held by the caller.
+ *
+ * @param router    The router instance
+ * @param domain_id Replication domain of the GTID
+ * @param server_id Server that generated the GTID
+ * @param seqno     Sequence number of the GTID
+ * @return Index of the interval found, or -1 if every interval is beyond
+ * the given GTID
+ */
+static int
+blr_gtid_search(ROUTER_INSTANCE *router, uint32_t domain_id,
+                uint32_t server_id, uint64_t seqno)
+{
+    BLR_GTID_INDEX *index = &router->gtid_index;
+    int low = 0, high = index->n_intervals - 1, rval = -1;
+
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        BLR_GTID_INTERVAL *ivl = &index->intervals[mid];
+
+        if (ivl->domain_id < domain_id ||
+            (ivl->domain_id == domain_id && ivl->server_id < server_id) ||
+            (ivl->domain_id == domain_id && ivl->server_id == server_id &&
+             ivl->seq_start <= seqno))
+        {
+            rval = mid;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return rval;
+}
+
+/**
+ * Record a MariaDB 10 GTID in the GTID index.
+ *
+ * Called for every GTID event received from the master and for every GTID
+ * event seen when the current binlog file is scanned at startup. A GTID
+ * that continues the interval it was expected to extend merely widens that
+ * interval, so the index only grows when a stream is seen for the first
+ * time, a sequence number arrives out of order, the binlog file rotates or
+ * the interval span is reached.
+ *
+ * @param router    The router instance
+ * @param domain_id Replication domain of the GTID
+ * @param server_id Server that generated the GTID
+ * @param seqno     Sequence number of the GTID
+ * @param file      Binlog file the GTID event is stored in
+ * @param pos       Offset of the GTID event within the file
+ */
+void
+blr_gtid_record(ROUTER_INSTANCE *router, uint32_t domain_id,
+                uint32_t server_id, uint64_t seqno, char *file, uint64_t pos)
+{
+    BLR_GTID_INDEX *index = &router->gtid_index;
+    BLR_GTID_INTERVAL *ivl;
+    int at;
+
+    spinlock_acquire(&index->lock);
+    at = blr_gtid_search(router, domain_id, server_id, seqno);
+
+    if (at >= 0)
+    {
+        ivl = &index->intervals[at];
+        if (ivl->domain_id == domain_id && ivl->server_id == server_id)
+        {
+            if (seqno <= ivl->seq_end)
+            {
+                /* Already indexed, seen again after a master reconnect */
+                spinlock_release(&index->lock);
+                return;
+            }
+            if (seqno == ivl->seq_end + 1 &&
+                strcmp(ivl->file, file) == 0 &&
+                seqno - ivl->seq_start < BLR_GTID_INTERVAL_SPAN)
+            {
+                ivl->seq_end = seqno;
+                spinlock_release(&index->lock);
+                return;
+            }
+        }
+    }
+
+    if (index->n_intervals == index->size)
+    {
+        int newsize = index->size ? index->size * 2 : 64;
+        BLR_GTID_INTERVAL *intervals =
+            realloc(index->intervals, newsize * sizeof(BLR_GTID_INTERVAL));
+
+        if (intervals == NULL)
+        {
+            /* The index is advisory; an unrecorded GTID only means a
+             * slave registering with it falls back to file and position */
+            spinlock_release(&index->lock);
+            MXS_ERROR("%s: Insufficient memory to extend the GTID index.",
+                      router->service->name);
+            return;
+        }
+        index->intervals = intervals;
+        index->size = newsize;
+    }
+
+    at++;       /* The new interval follows the one found */
+    memmove(&index->intervals[at + 1], &index->intervals[at],
+            (index->n_intervals - at) * sizeof(BLR_GTID_INTERVAL));
+    ivl = &index->intervals[at];
+    ivl->domain_id = domain_id;
+    ivl->server_id = server_id;
+    ivl->seq_start = seqno;
+    ivl->seq_end = seqno;
+    strncpy(ivl->file, file, BINLOG_FNAMELEN);
+    ivl->file[BINLOG_FNAMELEN] = 0;
+    ivl->pos = pos;
+    index->n_intervals++;
+    spinlock_release(&index->lock);
+}
+
+/**
+ * Scan a binlog file forward from the start of an indexed interval for the
+ * first GTID event of the given stream with a sequence number at or beyond
+ * the target. Intervals never span more than BLR_GTID_INTERVAL_SPAN
+ * transactions, so the scan is bounded.
+ *
+ * @param router    The router instance
+ * @param file      The binlog file to scan
+ * @param start_pos Offset of the GTID event opening the interval
+ * @param domain_id Replication domain of the target GTID
+ * @param server_id Server that generated the target GTID
+ * @param seqno     Sequence number to seek to
+ * @param pos_out   The offset of the GTID event found
+ * @return 0 if the event was found, -1 otherwise
+ */
+static int
+blr_gtid_scan(ROUTER_INSTANCE *router, char *file, uint64_t start_pos,
+              uint32_t domain_id, uint32_t server_id, uint64_t seqno,
+              uint32_t *pos_out)
+{
+    BLFILE *binlog;
+    GWBUF *record;
+    REP_HEADER hdr;
+    char errmsg[BINLOG_ERROR_MSG_LEN + 1];
+    unsigned long pos = start_pos;
+    int rval = -1;
+
+    if ((binlog = blr_open_binlog(router, file)) == NULL)
+    {
+        return -1;
+    }
+    while ((record = blr_read_binlog(router, binlog, pos, &hdr, errmsg)) != NULL)
+    {
+        if (hdr.event_type == MARIADB10_GTID_EVENT &&
+            hdr.serverid == server_id)
+        {
+            uint8_t *body = GWBUF_DATA(record) + BINLOG_EVENT_HDR_LEN;
+            uint64_t n_sequence = extract_field(body, 64);
+            uint32_t domainid = extract_field(body + 8, 32);
+
+            if (domainid == domain_id && n_sequence >= seqno)
+            {
+                *pos_out = pos;
+                rval = 0;
+                gwbuf_free(record);
+                break;
+            }
+        }
+        gwbuf_free(record);
+        pos = hdr.next_pos;
+    }
+    blr_close_binlog(router, binlog);
+    return rval;
+}
+
+/**
+ * Map the GTID position a slave registered with to the binlog file and
+ * offset to start sending events from.
+ *
+ * The state is the comma separated list of domain-server-sequence GTIDs,
+ * one per replication domain, that a MariaDB 10 slave sends in
+ * @slave_connect_state. Each GTID is resolved to the offset of the first
+ * transaction of its stream beyond it and the oldest of the resolved
+ * positions is returned, so that no domain misses events.
+ *
+ * @param router    The router instance
+ * @param state     The GTID list the slave registered with
+ * @param file_out  At least BINLOG_FNAMELEN+1 bytes for the binlog name
+ * @param pos_out   The offset to start sending events from
+ * @return 0 on success, -1 if any of the GTIDs cannot be resolved
+ */
+int
+blr_gtid_find_position(ROUTER_INSTANCE *router, char *state,
+                       char *file_out, uint32_t *pos_out)
+{
+    BLR_GTID_INDEX *index = &router->gtid_index;
+    char *buf, *tok, *brkb;
+    char best_file[BINLOG_FNAMELEN + 1] = "";
+    uint32_t best_pos = 0;
+    bool found = false;
+
+    if ((buf = strdup(state)) == NULL)
+    {
+        return -1;
+    }
+
+    for (tok = strtok_r(buf, ",", &brkb); tok != NULL;
+         tok = strtok_r(NULL, ",", &brkb))
+    {
+        uint32_t domain_id, server_id;
+        uint64_t seqno, start_pos = 0;
+        char file[BINLOG_FNAMELEN + 1];
+        uint32_t pos = 0;
+        bool need_scan = false, use_head = false, resolved = false;
+        int at;
+
+        if (sscanf(tok, "%u-%u-%lu", &domain_id, &server_id, &seqno) != 3)
+        {
+            MXS_ERROR("%s: Unparseable GTID '%s' in slave connect "
+                      "state '%s'.",
+                      router->service->name, tok, state);
+            free(buf);
+            return -1;
+        }
+
+        spinlock_acquire(&index->lock);
+        at = blr_gtid_search(router, domain_id, server_id, seqno + 1);
+
+        if (at >= 0 &&
+            index->intervals[at].domain_id == domain_id &&
+            index->intervals[at].server_id == server_id)
+        {
+            BLR_GTID_INTERVAL *ivl = &index->intervals[at];
+
+            if (seqno + 1 <= ivl->seq_end)
+            {
+                /* The next transaction of the stream lies within the
+                 * interval; its exact offset is found by a bounded scan
+                 * from the interval start. */
+                strcpy(file, ivl->file);
+                start_pos = ivl->pos;
+                pos = ivl->pos;
+                need_scan = seqno + 1 > ivl->seq_start;
+                resolved = true;
+            }
+            else if (at + 1 < index->n_intervals &&
+                     index->intervals[at + 1].domain_id == domain_id &&
+                     index->intervals[at + 1].server_id == server_id)
+            {
+                /* The next transaction of the stream opens the
+                 * following interval */
+                strcpy(file, index->intervals[at + 1].file);
+                pos = index->intervals[at + 1].pos;
+                resolved = true;
+            }
+            else if (seqno == ivl->seq_end)
+            {
+                /* The slave has every recorded transaction of the
+                 * stream, it starts from the binlog head */
+                use_head = true;
+                resolved = true;
+            }
+        }
+        spinlock_release(&index->lock);
+
+        if (!resolved)
+        {
+            MXS_ERROR("%s: GTID %u-%u-%lu is not in the GTID index.",
+                      router->service->name, domain_id, server_id, seqno);
+            free(buf);
+            return -1;
+        }
+
+        if (use_head)
+        {
+            spinlock_acquire(&router->binlog_lock);
+            strcpy(file, router->binlog_name);
+            pos = router->binlog_position;
+            spinlock_release(&router->binlog_lock);
+        }
+        else if (need_scan &&
+                 blr_gtid_scan(router, file, start_pos, domain_id,
+                               server_id, seqno + 1, &pos) != 0)
+        {
+            MXS_ERROR("%s: GTID %u-%u-%lu is indexed but was not found "
+                      "scanning binlog file %s.",
+                      router->service->name, domain_id, server_id,
+                      seqno + 1, file);
+            free(buf);
+            return -1;
+        }
+
+        /* Keep the oldest of the per domain positions */
+        if (!found || strcmp(file, best_file) < 0 ||
+            (strcmp(file, best_file) == 0 && pos < best_pos))
+        {
+            strcpy(best_file, file);
+            best_pos = pos;
+            found = true;
+        }
+    }
+    free(buf);
+
+    if (!found)
+    {
+        return -1;
+    }
+    strcpy(file_out, best_file);
+    *pos_out = best_pos;
+    return 0;
+}
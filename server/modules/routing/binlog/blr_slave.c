@@ -61,6 +61,15 @@
  *                                  and heartbeat event might be sent to the affected slave.
  * 25/09/2015   Martin Brampton     Block callback processing when no router session in the DCB
  * 23/10/15 Markus Makela           Added current_safe_event
+ * 03/07/2016   Mark Riddoch        Added the REGISTER CDC command for change
+ *                                  data capture consumers
+ * 05/07/2016   Mark Riddoch        GTID registration of MariaDB 10 slaves:
+ *                                  @slave_connect_state is remembered and the
+ *                                  binlog dump position derived from the GTID
+ *                                  index
+ * 05/07/2016   Mark Riddoch        Catchup bursts bounded by a wall clock time
+ *                                  slice in addition to the event and byte
+ *                                  limits
  *
  * @endverbatim
  */
@@ -80,6 +89,8 @@
 #include <spinlock.h>
 #include <housekeeper.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -119,6 +130,7 @@ static int blr_slave_send_disconnected_server(ROUTER_INSTANCE *router, ROUTER_SL
                                               int found);
 static int blr_slave_disconnect_all(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_disconnect_server(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, int server_id);
+static int blr_slave_register_cdc(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_ok(ROUTER_INSTANCE* router, ROUTER_SLAVE* slave);
 static int blr_stop_slave(ROUTER_INSTANCE* router, ROUTER_SLAVE* slave);
 static int blr_start_slave(ROUTER_INSTANCE* router, ROUTER_SLAVE* slave);
@@ -159,6 +171,9 @@ static int blr_slave_send_columndef_with_status_schema(ROUTER_INSTANCE *router,
 static void blr_send_slave_heartbeat(void *inst);
 static int blr_slave_send_heartbeat(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 bool blr_send_event(ROUTER_SLAVE *slave, REP_HEADER *hdr, uint8_t *buf);
+static bool blr_send_event_zerocopy(ROUTER_SLAVE *slave, REP_HEADER *hdr, GWBUF *record);
+static bool blr_send_event_sendfile(ROUTER_SLAVE *slave, REP_HEADER *hdr,
+                                    BLFILE *file, GWBUF *record);
 
 void poll_fake_write_event(DCB *dcb);
 
@@ -732,6 +747,45 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
                 return blr_slave_send_ok(router, slave);
             }
         }
+        else if (strcasecmp(word, "@slave_connect_state") == 0)
+        {
+            /* A MariaDB 10 slave registering by GTID sends the GTID
+             * position it has applied. Remember it so that the
+             * COM_BINLOG_DUMP that follows can be mapped to a binlog
+             * file and offset through the GTID index. */
+            word = strtok_r(NULL, sep, &brkb);
+            if (word)
+            {
+                char *state;
+
+                /* The separator set splits a multi domain GTID list at
+                 * its commas, so rejoin the token with the unparsed
+                 * remainder of the statement. */
+                if (brkb && *brkb &&
+                    (state = malloc(strlen(word) + strlen(brkb) + 2)) != NULL)
+                {
+                    sprintf(state, "%s,%s", word, brkb);
+                }
+                else
+                {
+                    state = strdup(word);
+                }
+                if (state)
+                {
+                    int v_len = strlen(state);
+
+                    if (v_len > 1 && state[0] == '\'' && state[v_len - 1] == '\'')
+                    {
+                        state[v_len - 1] = '\0';
+                        memmove(state, state + 1, v_len - 1);
+                    }
+                    free(slave->mariadb_gtid);
+                    slave->mariadb_gtid = state;
+                }
+            }
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
         else if (strcasecmp(word, "@master_binlog_checksum") == 0)
         {
             word = strtok_r(NULL, sep, &brkb);
@@ -1065,6 +1119,19 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
             }
         }
     }
+    /* Register the client as a change data capture consumer */
+    else if (strcasecmp(query_text, "REGISTER") == 0)
+    {
+        if ((word = strtok_r(NULL, sep, &brkb)) == NULL)
+        {
+            MXS_ERROR("%s: Incomplete REGISTER command.", router->service->name);
+        }
+        else if (strcasecmp(word, "CDC") == 0)
+        {
+            free(query_text);
+            return blr_slave_register_cdc(router, slave);
+        }
+    }
 
     free(query_text);
 
@@ -1913,6 +1980,47 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
     strncpy(slave->binlogfile, (char *)ptr, binlognamelen);
     slave->binlogfile[binlognamelen] = 0;
 
+    /*
+     * A slave that registered by GTID is seeked through the GTID index
+     * rather than trusting the file and position in the dump request,
+     * which a MariaDB 10 GTID slave leaves empty.
+     */
+    if (slave->mariadb10_compat && slave->mariadb_gtid != NULL &&
+        *slave->mariadb_gtid != '\0')
+    {
+        char gtid_file[BINLOG_FNAMELEN + 1];
+        uint32_t gtid_pos;
+
+        if (blr_gtid_find_position(router, slave->mariadb_gtid,
+                                   gtid_file, &gtid_pos) == 0)
+        {
+            strcpy(slave->binlogfile, gtid_file);
+            slave->binlog_pos = gtid_pos;
+            MXS_NOTICE("%s: Slave %s:%i, server-id %d, GTID '%s' mapped "
+                       "to binlog '%s' @ %lu.",
+                       router->service->name,
+                       slave->dcb->remote,
+                       ntohs((slave->dcb->ipv4).sin_port),
+                       slave->serverid,
+                       slave->mariadb_gtid,
+                       slave->binlogfile,
+                       (unsigned long)slave->binlog_pos);
+        }
+        else
+        {
+            MXS_WARNING("%s: Slave %s:%i, server-id %d, GTID '%s' could "
+                        "not be resolved from the GTID index, using the "
+                        "requested binlog '%s' @ %lu.",
+                        router->service->name,
+                        slave->dcb->remote,
+                        ntohs((slave->dcb->ipv4).sin_port),
+                        slave->serverid,
+                        slave->mariadb_gtid,
+                        slave->binlogfile,
+                        (unsigned long)slave->binlog_pos);
+        }
+    }
+
     if (router->trx_safe)
     {
         /**
@@ -2041,7 +2149,7 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
         strcmp(slave->binlogfile, router->binlog_name) != 0)
     {
         spinlock_acquire(&slave->catch_lock);
-        slave->cstate &= ~CS_UPTODATE;
+        blr_slave_clear_uptodate(router, slave);
         slave->cstate |= CS_EXPECTCB;
         spinlock_release(&slave->catch_lock);
         poll_fake_write_event(slave->dcb);
@@ -2068,6 +2176,153 @@ encode_value(unsigned char *data, unsigned int value, int len)
 }
 
 
+/**
+ * Send a single replication event to a slave without copying the event data.
+ *
+ * The MySQL packet header and the OK byte are written into a small buffer
+ * of their own and the event payload is shared with the buffer that was
+ * read from the binlog file by cloning it, so sending the same event to N
+ * catching-up slaves does not make N copies of the data. The reference
+ * count of the shared buffer is manipulated atomically, so the clones may
+ * be freed by whichever thread drains the slave DCBs. Events that must be
+ * split across multiple MySQL packets fall back to blr_send_event().
+ *
+ * @param slave     Slave where the event is sent to
+ * @param hdr       Replication header
+ * @param record    The replication event as it was read from the disk
+ * @return True on success, false if memory allocation failed
+ */
+static bool
+blr_send_event_zerocopy(ROUTER_SLAVE *slave, REP_HEADER *hdr, GWBUF *record)
+{
+    GWBUF   *head, *payload;
+    uint8_t *data;
+
+    if (hdr->event_size + 1 >= MYSQL_PACKET_LENGTH_MAX)
+    {
+        return blr_send_event(slave, hdr, (uint8_t *)GWBUF_DATA(record));
+    }
+    if ((head = gwbuf_alloc(MYSQL_HEADER_LEN + 1)) == NULL)
+    {
+        MXS_ERROR("failed to allocate memory when writing an event header.");
+        return false;
+    }
+    data = GWBUF_DATA(head);
+    encode_value(data, hdr->event_size + 1, 24);
+    data += 3;
+    *data++ = slave->seqno++;
+    *data = 0;          // OK byte
+    if ((payload = gwbuf_clone_portion(record, 0, hdr->event_size)) == NULL)
+    {
+        gwbuf_free(head);
+        return false;
+    }
+    head = gwbuf_append(head, payload);
+    slave->stats.n_bytes += gwbuf_length(head);
+    return slave->dcb->func.write(slave->dcb, head) != 0;
+}
+
+/**
+ * Send a single replication event to a slave directly from the binlog
+ * file with sendfile().
+ *
+ * When the slave DCB has no queued data the MySQL packet header is
+ * written to the socket and the event payload is streamed from the
+ * binlog file by the kernel without the data ever entering userspace.
+ * If the socket blocks part way through, the remainder of the event is
+ * queued through the ordinary GWBUF path, which preserves the ordering
+ * as nothing was queued ahead of it. Rotate events, events that span
+ * multiple MySQL packets and slaves with pending output fall back to
+ * blr_send_event_zerocopy().
+ *
+ * @param slave     Slave where the event is sent to
+ * @param hdr       Replication header
+ * @param file      The binlog file the event was read from
+ * @param record    The replication event as it was read from the disk
+ * @return True on success, false if the send failed
+ */
+static bool
+blr_send_event_sendfile(ROUTER_SLAVE *slave, REP_HEADER *hdr, BLFILE *file, GWBUF *record)
+{
+    uint8_t  head[MYSQL_HEADER_LEN + 1];
+    GWBUF    *payload;
+    off_t    offset;
+    ssize_t  n;
+    uint32_t left;
+
+    if (hdr->event_type == ROTATE_EVENT || file == NULL || file->fd < 0 ||
+        slave->dcb->writeq != NULL ||
+        hdr->event_size + 1 >= MYSQL_PACKET_LENGTH_MAX ||
+        hdr->next_pos < hdr->event_size)
+    {
+        return blr_send_event_zerocopy(slave, hdr, record);
+    }
+
+    encode_value(head, hdr->event_size + 1, 24);
+    head[3] = slave->seqno;
+    head[4] = 0;        // OK byte
+
+    if ((n = write(slave->dcb->fd, head, sizeof(head))) <= 0)
+    {
+        /* Nothing was sent so the buffered path can send the whole event */
+        return blr_send_event_zerocopy(slave, hdr, record);
+    }
+    slave->seqno++;
+    slave->stats.n_bytes += hdr->event_size + sizeof(head);
+    if (n < (ssize_t)sizeof(head))
+    {
+        /*
+         * Part of the packet header was sent before the socket filled
+         * up; the rest of the header and the whole payload must now be
+         * queued to keep the stream intact.
+         */
+        GWBUF *rest;
+
+        if ((rest = gwbuf_alloc(sizeof(head) - n)) == NULL)
+        {
+            MXS_ERROR("failed to allocate memory when writing an event header.");
+            return false;
+        }
+        memcpy(GWBUF_DATA(rest), head + n, sizeof(head) - n);
+        if ((payload = gwbuf_clone_portion(record, 0, hdr->event_size)) == NULL)
+        {
+            gwbuf_free(rest);
+            return false;
+        }
+        rest = gwbuf_append(rest, payload);
+        return slave->dcb->func.write(slave->dcb, rest) != 0;
+    }
+
+    offset = hdr->next_pos - hdr->event_size;
+    left = hdr->event_size;
+    while (left > 0)
+    {
+        if ((n = sendfile(slave->dcb->fd, file->fd, &offset, left)) > 0)
+        {
+            left -= n;
+        }
+        else if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (left > 0)
+    {
+        /* The socket blocked part way through, queue the remainder */
+        if ((payload = gwbuf_clone_portion(record, hdr->event_size - left, left)) == NULL)
+        {
+            MXS_ERROR("failed to allocate memory when writing an event.");
+            return false;
+        }
+        return slave->dcb->func.write(slave->dcb, payload) != 0;
+    }
+    return true;
+}
+
 /**
  * Populate a header structure for a replication message from a GWBUF structure.
  *
@@ -2101,6 +2356,45 @@ blr_build_header(GWBUF  *pkt, REP_HEADER *hdr)
     return ptr;
 }
 
+/**
+ * Mark a slave as being at the head of the binlog.
+ *
+ * The CS_UPTODATE transitions are funnelled through here and its
+ * counterpart so that the router can keep a count of the slaves at
+ * the head; the distribution of incoming events only needs to visit
+ * those slaves, the rest serve themselves through the catchup path.
+ * The caller must hold the catch_lock of the slave.
+ *
+ * @param   router      The binlog router
+ * @param   slave       The slave that has caught up
+ */
+void
+blr_slave_set_uptodate(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    if ((slave->cstate & CS_UPTODATE) == 0)
+    {
+        slave->cstate |= CS_UPTODATE;
+        atomic_add(&router->n_uptodate, 1);
+    }
+}
+
+/**
+ * Mark a slave as no longer being at the head of the binlog. The caller
+ * must hold the catch_lock of the slave.
+ *
+ * @param   router      The binlog router
+ * @param   slave       The slave that has fallen behind
+ */
+void
+blr_slave_clear_uptodate(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    if (slave->cstate & CS_UPTODATE)
+    {
+        slave->cstate &= ~CS_UPTODATE;
+        atomic_add(&router->n_uptodate, -1);
+    }
+}
+
 /**
  * We have a registered slave that is behind the current leading edge of the
  * binlog. We must replay the log entries to bring this node up to speed.
@@ -2122,6 +2416,14 @@ blr_build_header(GWBUF  *pkt, REP_HEADER *hdr)
  * queue. This ensures that the slave callback for processing DCB write drain
  * will be called and future catchup requests will be handled on another thread.
  *
+ * The burst is additionally bounded by a wall clock time slice of
+ * BLR_SLICE_BEATS heartbeats. The event and byte limits bound the work when
+ * the events are hot in the cache, but a burst reading a cold or archived
+ * binlog can take arbitrarily long per event; when the slice expires the
+ * burst is cut short and the slave rescheduled with the same fake EPOLLOUT
+ * mechanism, so one catching-up slave cannot add more than the slice to the
+ * latency of the other sessions on the thread.
+ *
  * @param   router      The binlog router
  * @param   slave       The slave that is behind
  * @param   large       Send a long or short burst of events
@@ -2135,6 +2437,8 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
     int rval = 1, burst;
     int rotating = 0;
     long burst_size;
+    unsigned long slice_start = hkheartbeat;
+    int slice_expired = 0;
     char read_errmsg[BINLOG_ERROR_MSG_LEN + 1];
 
     read_errmsg[BINLOG_ERROR_MSG_LEN] = '\0';
@@ -2283,7 +2587,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             }
         }
 
-        if (blr_send_event(slave, &hdr, (uint8_t*) record->start))
+        if (blr_send_event_sendfile(slave, &hdr, file, record))
         {
             if (hdr.event_type != ROTATE_EVENT)
             {
@@ -2300,8 +2604,17 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
         {
             slave->lastReply = time(0);
         }
+
+        if (hkheartbeat - slice_start >= BLR_SLICE_BEATS)
+        {
+            /* The burst has held the polling thread for a full time
+             * slice, yield and resume on the next write event */
+            slave->stats.n_sliced++;
+            slice_expired = 1;
+            break;
+        }
     }
-    if (record == NULL)
+    if (record == NULL && !slice_expired)
     {
         slave->stats.n_failed_read++;
 
@@ -2385,7 +2698,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
     slave->cstate &= ~CS_BUSY;
     spinlock_release(&slave->catch_lock);
 
-    if (record)
+    if (record || slice_expired)
     {
         slave->stats.n_flows++;
         spinlock_acquire(&slave->catch_lock);
@@ -2410,7 +2723,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
         if (slave->binlog_pos != router->binlog_position ||
             strcmp(slave->binlogfile, router->binlog_name) != 0)
         {
-            slave->cstate &= ~CS_UPTODATE;
+            blr_slave_clear_uptodate(router, slave);
             slave->cstate |= CS_EXPECTCB;
             spinlock_release(&slave->catch_lock);
             spinlock_release(&router->binlog_lock);
@@ -2435,7 +2748,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             if ((slave->cstate & CS_UPTODATE) == 0)
             {
                 slave->stats.n_upd++;
-                slave->cstate |= CS_UPTODATE;
+                blr_slave_set_uptodate(router, slave);
                 spinlock_release(&slave->catch_lock);
                 spinlock_release(&router->binlog_lock);
                 state_change = 1;
@@ -2574,7 +2887,8 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
                 return 0;
             }
             cstate = slave->cstate;
-            slave->cstate &= ~(CS_UPTODATE | CS_EXPECTCB);
+            blr_slave_clear_uptodate(router, slave);
+            slave->cstate &= ~CS_EXPECTCB;
             slave->cstate |= CS_BUSY;
             spinlock_release(&slave->catch_lock);
 
@@ -3117,6 +3431,36 @@ blr_slave_disconnect_all(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     return 1;
 }
 
+/**
+ * Register the client session as a change data capture consumer.
+ *
+ * The session is moved into the BLRS_CDC state, in which it receives the
+ * length prefixed JSON change stream produced by blr_cdc_distribute
+ * rather than raw binlog records. The stream is live only and starts
+ * with the next event the router receives from the master.
+ *
+ * @param   router      The binlog router instance
+ * @param   slave       The client session to register
+ *
+ * @return  Non-zero if data was sent to the client
+ */
+static int
+blr_slave_register_cdc(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    spinlock_acquire(&router->lock);
+    if (slave->state != BLRS_CDC)
+    {
+        slave->state = BLRS_CDC;
+        atomic_add(&router->cdc_consumers, 1);
+    }
+    spinlock_release(&router->lock);
+
+    MXS_NOTICE("%s: Client %s@%s registered as a CDC consumer.",
+               router->service->name, slave->dcb->user, slave->dcb->remote);
+
+    return blr_slave_send_ok(router, slave);
+}
+
 /**
  * Send a MySQL OK packet to the slave backend
  *
@@ -31,6 +31,10 @@
  *                  Currently MariadDB 10 starting transactions
  *                  are detected checking GTID event
  *                  with flags = 0
+ * 05/07/2016   Mark Riddoch        Parallel verification mode that splits
+ *                  the file at the transaction safe positions
+ *                  of the binlog position index across worker
+ *                  threads
  *
  * @endverbatim
  */
@@ -62,6 +66,8 @@
 
 #include <version.h>
 #include <gwdirs.h>
+#include <thread.h>
+#include <fcntl.h>
 
 extern int blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug);
 extern uint32_t extract_field(uint8_t *src, int bits);
@@ -74,18 +80,407 @@ static struct option long_options[] =
     {"version",   no_argument,        0,  'V'},
     {"fix",   no_argument,        0,  'f'},
     {"mariadb10", no_argument,        0,  'M'},
+    {"parallel",  required_argument,  0,  'j'},
     {"help",  no_argument,        0,  '?'},
     {0, 0, 0, 0}
 };
 
 char *binlog_check_version = "1.1.0";
 
+/** Maximum number of worker threads of the parallel mode */
+#define CHECK_MAX_WORKERS 64
+
+/**
+ * One slice of the binlog file verified by a worker thread of the
+ * parallel mode. Every slice starts and ends on a transaction safe
+ * position taken from the binlog position index, except the final
+ * slice which ends at the end of the file.
+ */
+typedef struct
+{
+    int fd;                       /*< Descriptor of the binlog file */
+    int mariadb10;                /*< MariaDB 10 event types are valid */
+    int debug;                    /*< Print debug messages */
+    unsigned long long start;     /*< First event boundary of the slice */
+    unsigned long long end;       /*< Position one past the last event */
+    unsigned long events;         /*< Events verified */
+    unsigned long long bytes;     /*< Bytes verified */
+    unsigned long transactions;   /*< Transactions closed in the slice */
+    int pending;                  /*< A transaction was open at the end */
+    int error;                    /*< A structural error was found */
+    unsigned long long error_pos; /*< Position of the first error */
+} CHECK_SLICE;
+
+static void check_slice(void *data);
+static int load_split_points(const char *path, unsigned long long filelen,
+                             unsigned long long **out);
+static int check_parallel(ROUTER_INSTANCE *inst, const char *path,
+                          unsigned long long filelen, int nthreads,
+                          int debug);
+
 int
 MaxScaleUptime()
 {
     return 1;
 }
 
+/**
+ * The entry point of a verification worker thread.
+ *
+ * The worker walks the events of its slice: the header of every event is
+ * read and checked, the body is read so that the whole slice is proven
+ * readable, and event boundaries must chain exactly to the end of the
+ * slice. Transactions are tracked with the same rules as the sequential
+ * checker; since the slice boundaries are transaction safe positions, a
+ * transaction still open at the end of a slice is an error in the file
+ * or the index. The kernel is advised of the sequential access pattern,
+ * so the read-ahead of one slice overlaps the decoding of another.
+ *
+ * @param data  The CHECK_SLICE for the worker
+ */
+static void
+check_slice(void *data)
+{
+    CHECK_SLICE *slice = (CHECK_SLICE *)data;
+    uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
+    uint8_t *body = NULL;
+    unsigned int body_size = 0;
+    unsigned long long pos = slice->start;
+    int pending = 0;
+    int max_type = slice->mariadb10 ? MAX_EVENT_TYPE_MARIADB10 : MAX_EVENT_TYPE;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(slice->fd, slice->start, slice->end - slice->start,
+                  POSIX_FADV_SEQUENTIAL);
+#endif
+
+    while (pos < slice->end)
+    {
+        REP_HEADER hdr;
+        uint8_t *ptr;
+        int n;
+
+        if ((n = pread(slice->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos))
+            != BINLOG_EVENT_HDR_LEN)
+        {
+            MXS_ERROR("Short read of the event header at %llu, "
+                      "expected 19 bytes but got %d.", pos, n);
+            slice->error = 1;
+            break;
+        }
+
+        hdr.timestamp = EXTRACT32(hdbuf);
+        hdr.event_type = hdbuf[4];
+        hdr.serverid = EXTRACT32(&hdbuf[5]);
+        hdr.event_size = extract_field(&hdbuf[9], 32);
+        hdr.next_pos = EXTRACT32(&hdbuf[13]);
+        hdr.flags = EXTRACT16(&hdbuf[17]);
+
+        if (hdr.event_type > max_type)
+        {
+            MXS_ERROR("Invalid event type 0x%x at %llu.",
+                      hdr.event_type, pos);
+            slice->error = 1;
+            break;
+        }
+        if (hdr.event_size <= BINLOG_EVENT_HDR_LEN ||
+            pos + hdr.event_size > slice->end)
+        {
+            MXS_ERROR("Event size error: size %d at %llu crosses the "
+                      "slice boundary at %llu.",
+                      hdr.event_size, pos, slice->end);
+            slice->error = 1;
+            break;
+        }
+
+        if (hdr.event_size - BINLOG_EVENT_HDR_LEN > body_size)
+        {
+            uint8_t *tmp = realloc(body, hdr.event_size);
+
+            if (tmp == NULL)
+            {
+                MXS_ERROR("Failed to allocate %d bytes for the event "
+                          "body at %llu.", hdr.event_size, pos);
+                slice->error = 1;
+                break;
+            }
+            body = tmp;
+            body_size = hdr.event_size;
+        }
+        if ((n = pread(slice->fd, body, hdr.event_size - BINLOG_EVENT_HDR_LEN,
+                       pos + BINLOG_EVENT_HDR_LEN))
+            != hdr.event_size - BINLOG_EVENT_HDR_LEN)
+        {
+            MXS_ERROR("Short read of the event at %llu, expected %d "
+                      "bytes but got %d.",
+                      pos, hdr.event_size - BINLOG_EVENT_HDR_LEN, n);
+            slice->error = 1;
+            break;
+        }
+        ptr = body;
+
+        /* Track the transactions with the rules of the sequential scan */
+        if (slice->mariadb10 && hdr.event_type == MARIADB10_GTID_EVENT)
+        {
+            unsigned int flags = *(ptr + 8 + 4);
+
+            if (flags == 0)
+            {
+                if (pending)
+                {
+                    MXS_ERROR("Transaction cannot start at %llu: another "
+                              "transaction is already open.", pos);
+                    slice->error = 1;
+                    break;
+                }
+                pending = 1;
+            }
+        }
+        else if (hdr.event_type == QUERY_EVENT)
+        {
+            int db_name_len = ptr[4 + 4];
+            int var_block_len = ptr[4 + 4 + 1 + 2];
+            int statement_len =
+                hdr.event_size -
+                BINLOG_EVENT_HDR_LEN -
+                (4 + 4 + 1 + 2 + 2 + var_block_len + 1 + db_name_len);
+            char *statement_sql =
+                (char *)ptr + 4 + 4 + 1 + 2 + 2 + var_block_len + 1 + db_name_len;
+
+            if (statement_len >= 5 && strncmp(statement_sql, "BEGIN", 5) == 0)
+            {
+                if (pending)
+                {
+                    MXS_ERROR("Transaction cannot start at %llu: another "
+                              "transaction is already open.", pos);
+                    slice->error = 1;
+                    break;
+                }
+                pending = 1;
+            }
+            else if (statement_len >= 6 &&
+                     strncmp(statement_sql, "COMMIT", 6) == 0 && pending)
+            {
+                pending = 0;
+                slice->transactions++;
+            }
+        }
+        else if (hdr.event_type == XID_EVENT && pending)
+        {
+            pending = 0;
+            slice->transactions++;
+        }
+
+        slice->events++;
+        slice->bytes += hdr.event_size;
+        pos += hdr.event_size;
+    }
+
+    if (slice->error)
+    {
+        slice->error_pos = pos;
+    }
+    slice->pending = pending;
+    free(body);
+}
+
+/**
+ * Load the transaction safe positions from the binlog position index
+ * that the binlog router maintains alongside the file.
+ *
+ * @param path      Path of the binlog file; the index adds its suffix
+ * @param filelen   Size of the binlog file, entries beyond it are ignored
+ * @param out       The malloc'd array of positions is returned here
+ * @return The number of positions loaded, 0 if there is no usable index
+ */
+static int
+load_split_points(const char *path, unsigned long long filelen,
+                  unsigned long long **out)
+{
+    static const unsigned char magic[] = BINLOG_INDEX_MAGIC;
+    char idxpath[PATH_MAX + 1];
+    unsigned char entry[BINLOG_INDEX_ENTRY_LEN];
+    unsigned long long *points, pos, prev = 0;
+    struct stat statb;
+    int fd, i, j, n, count = 0;
+
+    snprintf(idxpath, sizeof(idxpath), "%s%s", path, BINLOG_INDEX_SUFFIX);
+
+    if ((fd = open(idxpath, O_RDONLY)) == -1)
+    {
+        return 0;
+    }
+    if (fstat(fd, &statb) != 0 ||
+        statb.st_size < BINLOG_INDEX_MAGIC_SIZE + BINLOG_INDEX_ENTRY_LEN ||
+        pread(fd, entry, BINLOG_INDEX_MAGIC_SIZE, 0) != BINLOG_INDEX_MAGIC_SIZE ||
+        memcmp(entry, magic, BINLOG_INDEX_MAGIC_SIZE) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    n = (statb.st_size - BINLOG_INDEX_MAGIC_SIZE) / BINLOG_INDEX_ENTRY_LEN;
+    if ((points = malloc(n * sizeof(unsigned long long))) == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (pread(fd, entry, BINLOG_INDEX_ENTRY_LEN,
+                  BINLOG_INDEX_MAGIC_SIZE + (off_t)i * BINLOG_INDEX_ENTRY_LEN)
+            != BINLOG_INDEX_ENTRY_LEN)
+        {
+            break;
+        }
+        pos = 0;
+        for (j = 0; j < BINLOG_INDEX_ENTRY_LEN; j++)
+        {
+            pos |= (unsigned long long)entry[j] << (j * 8);
+        }
+        /* The entries must ascend and fall within the file */
+        if (pos <= prev || pos >= filelen)
+        {
+            break;
+        }
+        points[count++] = pos;
+        prev = pos;
+    }
+    close(fd);
+    if (count == 0)
+    {
+        free(points);
+        points = NULL;
+    }
+    *out = points;
+    return count;
+}
+
+/**
+ * Verify a binlog file with a pool of worker threads.
+ *
+ * The file is split at transaction safe positions taken from the binlog
+ * position index and each worker verifies one slice, overlapping its
+ * decoding with the read-ahead of the others. The parallel mode only
+ * verifies; when an error is found the position is reported and the
+ * sequential mode, which can also truncate with --fix, should be run on
+ * the file.
+ *
+ * @param inst      The router instance holding the open binlog file
+ * @param path      Path of the binlog file, used to find the index
+ * @param filelen   Size of the binlog file
+ * @param nthreads  The number of worker threads requested
+ * @param debug     Print debug messages
+ * @return 0 on success, >0 on failure or when no index is available
+ */
+static int
+check_parallel(ROUTER_INSTANCE *inst, const char *path,
+               unsigned long long filelen, int nthreads, int debug)
+{
+    CHECK_SLICE slices[CHECK_MAX_WORKERS];
+    THREAD threads[CHECK_MAX_WORKERS];
+    unsigned long long *points = NULL;
+    unsigned long events = 0, transactions = 0;
+    unsigned long long bytes = 0;
+    int i, npoints, rval = 0;
+
+    if (nthreads > CHECK_MAX_WORKERS)
+    {
+        nthreads = CHECK_MAX_WORKERS;
+    }
+    if ((npoints = load_split_points(path, filelen, &points)) == 0)
+    {
+        MXS_ERROR("No usable binlog position index '%s%s'; the parallel "
+                  "mode needs the index to split the file at event "
+                  "boundaries. Run the sequential check instead.",
+                  path, BINLOG_INDEX_SUFFIX);
+        return 1;
+    }
+    if (nthreads > npoints + 1)
+    {
+        nthreads = npoints + 1;
+    }
+
+    /* Slice i runs from its boundary to the start of slice i + 1; the
+     * boundaries are drawn evenly from the index entries and the last
+     * slice runs to the end of the file. */
+    for (i = 0; i < nthreads; i++)
+    {
+        memset(&slices[i], 0, sizeof(CHECK_SLICE));
+        slices[i].fd = inst->binlog_fd;
+        slices[i].mariadb10 = inst->mariadb10_compat;
+        slices[i].debug = debug;
+        slices[i].start = i == 0 ? 4 : points[(i * npoints) / nthreads - 1];
+        slices[i].end = i == nthreads - 1
+            ? filelen : points[((i + 1) * npoints) / nthreads - 1];
+    }
+    free(points);
+
+    MXS_NOTICE("Verifying with %d worker threads, %d indexed positions.",
+               nthreads, npoints);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        if (thread_start(&threads[i], check_slice, &slices[i]) == NULL)
+        {
+            /* Run the slice on this thread instead */
+            check_slice(&slices[i]);
+            threads[i] = 0;
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        if (threads[i])
+        {
+            thread_wait(threads[i]);
+        }
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+        if (debug)
+        {
+            MXS_DEBUG("Slice %d [%llu, %llu): %lu events, %llu bytes, "
+                      "%lu transactions%s%s",
+                      i, slices[i].start, slices[i].end,
+                      slices[i].events, slices[i].bytes,
+                      slices[i].transactions,
+                      slices[i].pending ? ", open transaction" : "",
+                      slices[i].error ? ", ERROR" : "");
+        }
+        events += slices[i].events;
+        bytes += slices[i].bytes;
+        transactions += slices[i].transactions;
+
+        if (slices[i].error)
+        {
+            MXS_ERROR("Verification error in slice %d at position %llu. "
+                      "Run the sequential check with --fix on the file.",
+                      i, slices[i].error_pos);
+            rval = 1;
+        }
+        else if (slices[i].pending)
+        {
+            if (i == nthreads - 1)
+            {
+                MXS_WARNING("Binlog file %s contains an open transaction "
+                            "at the end of the file.", inst->binlog_name);
+            }
+            else
+            {
+                MXS_ERROR("Transaction still open at the slice boundary "
+                          "%llu; the position index does not match the "
+                          "file. Run the sequential check.",
+                          slices[i].end);
+                rval = 1;
+            }
+        }
+    }
+
+    MXS_NOTICE("%lu events, %llu bytes and %lu transactions verified "
+               "in %s.", events, bytes, transactions, inst->binlog_name);
+    return rval;
+}
+
 int main(int argc, char **argv)
 {
     ROUTER_INSTANCE *inst;
@@ -101,8 +496,9 @@ int main(int argc, char **argv)
     int debug_out = 0;
     int fix_file = 0;
     int mariadb10_compat = 0;
+    int parallel = 0;
 
-    while ((c = getopt_long(argc, argv, "dVfM?", long_options, &option_index)) >= 0)
+    while ((c = getopt_long(argc, argv, "dVfMj:?", long_options, &option_index)) >= 0)
     {
         switch (c)
         {
@@ -119,6 +515,9 @@ int main(int argc, char **argv)
         case 'M':
             mariadb10_compat = 1;
             break;
+        case 'j':
+            parallel = atoi(optarg);
+            break;
         case '?':
             printUsage(*argv);
             exit(optopt ? EXIT_FAILURE : EXIT_SUCCESS);
@@ -172,6 +571,8 @@ int main(int argc, char **argv)
     }
 
     inst->binlog_fd = fd;
+    /* No index for the standalone checker, the whole file is scanned */
+    inst->index_fd = -1;
 
     if (mariadb10_compat == 1)
     {
@@ -197,14 +598,35 @@ int main(int argc, char **argv)
 
     MXS_NOTICE("Checking %s (%s), size %lu bytes", path, inst->binlog_name, filelen);
 
-    /* read binary log */
-    ret = blr_read_events_all_events(inst, fix_file, debug_out);
+    if (parallel > 1 && fix_file)
+    {
+        MXS_WARNING("The --fix option needs the sequential scan to "
+                    "truncate the file, ignoring --parallel.");
+        parallel = 0;
+    }
+
+    if (parallel > 1)
+    {
+        /* Verify the file with a pool of worker threads */
+        ret = check_parallel(inst, path, filelen, parallel, debug_out);
 
-    close(inst->binlog_fd);
+        close(inst->binlog_fd);
 
-    mxs_log_flush_sync();
+        mxs_log_flush_sync();
 
-    MXS_NOTICE("Check retcode: %i, Binlog Pos = %lu", ret, inst->binlog_position);
+        MXS_NOTICE("Check retcode: %i", ret);
+    }
+    else
+    {
+        /* read binary log */
+        ret = blr_read_events_all_events(inst, fix_file, debug_out);
+
+        close(inst->binlog_fd);
+
+        mxs_log_flush_sync();
+
+        MXS_NOTICE("Check retcode: %i, Binlog Pos = %lu", ret, inst->binlog_position);
+    }
 
     mxs_log_flush_sync();
     mxs_log_finish();
@@ -236,6 +658,7 @@ printUsage(const char *progname)
     printf("  -f|--fix		Fix binlog file, require write permissions (truncate)\n");
     printf("  -d|--debug		Print debug messages\n");
     printf("  -M|--mariadb10	MariaDB 10 binlog compatibility\n");
+    printf("  -j|--parallel N	Verify with N worker threads, needs the binlog index\n");
     printf("  -V|--version          print version information and exit\n");
     printf("  -?|--help             Print this help text\n");
 }
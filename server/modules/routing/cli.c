@@ -26,6 +26,8 @@
  * Date		Who		Description
  * 18/06/13	Mark Riddoch	Initial implementation
  * 13/06/14	Mark Riddoch	Creted from the debugcli
+ * 03/07/16	Mark Riddoch	Commands run on the admin executor thread,
+ *				the OK terminator is written on completion
  *
  * @endverbatim
  */
@@ -191,6 +193,8 @@ CLI_SESSION	*client;
 
 	session->state = SESSION_STATE_READY;
 	client->mode = inst->mode;
+	/* Completion marker the maxadmin client uses to frame the response */
+	client->terminator = "OK";
 
 	return (void *)client;
 }
@@ -25,6 +25,8 @@
  *
  * Date		Who		Description
  * 18/06/13	Mark Riddoch	Initial implementation
+ * 03/07/16	Mark Riddoch	Commands run on the admin executor thread,
+ *				the prompt is written on completion
  *
  * @endverbatim
  */
@@ -201,6 +203,8 @@ CLI_SESSION	*client;
 
 	session->state = SESSION_STATE_READY;
 	client->mode = inst->mode;
+	/* Prompt written once a queued command has completed */
+	client->terminator = "MaxScale> ";
 
 	dcb_printf(session->client_dcb, "Welcome the MariaDB Corporation MaxScale Debug Interface (%s).\n",
 		version_str);
@@ -284,9 +288,11 @@ CLI_SESSION	*session = (CLI_SESSION *)router_session;
 
 	if (strrchr(session->cmdbuf, '\n'))
 	{
-		if (execute_cmd(session))
-			dcb_printf(session->session->client_dcb, "MaxScale> ");
-		else
+		/*
+		 * The command is executed on the admin executor thread,
+		 * which writes the prompt once the output is complete.
+		 */
+		if (execute_cmd(session) == 0)
                         dcb_close(session->session->client_dcb);
 	}
 	return 1;
@@ -45,6 +45,14 @@
  * 05/03/15     Massimiliano Pinto      Added enable/disable feedback
  * 27/05/15     Martin Brampton         Add show persistent [server]
  * 06/11/15     Martin Brampton         Add show buffers (conditional compilation)
+ * 29/06/16     Mark Riddoch            Add show hotqueries and show latency
+ * 03/07/16     Mark Riddoch            Add show logsuppression
+ * 03/07/16     Mark Riddoch            Add show trace
+ * 03/07/16     Mark Riddoch            Add show memory
+ * 03/07/16     Mark Riddoch            Commands executed on an admin executor
+ *                                      thread rather than the polling threads
+ * 05/07/16     Mark Riddoch            Add enable/disable filter-profiling
+ * 05/07/16     Mark Riddoch            Add show topsessions
  *
  * @endverbatim
  */
@@ -72,6 +80,10 @@
 #include <monitor.h>
 #include <debugcli.h>
 #include <housekeeper.h>
+#include <querystats.h>
+#include <memlog.h>
+#include <memaccount.h>
+#include <thread.h>
 
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -105,6 +117,7 @@ struct subcommand {
 };
 
 static  void    telnetdShowUsers(DCB *);
+static  void    showLogSuppression(DCB *);
 /**
  * The subcommands of the show command
  */
@@ -153,6 +166,22 @@ struct subcommand showoptions[] = {
       "Show all filters",
       "Show all filters",
       {0, 0, 0} },
+    { "hotqueries", 0, dprintHotQueries,
+      "Show the query shapes with the highest execution counts",
+      "Show the query shapes with the highest execution counts",
+      {0, 0, 0} },
+    { "latency", 0, dprintQueryLatency,
+      "Show the query shapes with the highest average latency",
+      "Show the query shapes with the highest average latency",
+      {0, 0, 0} },
+    { "logsuppression", 0, showLogSuppression,
+      "Show the logging call sites that have had duplicate messages suppressed",
+      "Show the logging call sites that have had duplicate messages suppressed",
+      {0, 0, 0} },
+    { "memory", 0, dprintMemory,
+      "Show the memory used by each subsystem and the memory budget",
+      "Show the memory used by each subsystem and the memory budget",
+      {0, 0, 0} },
     { "modules", 0, dprintAllModules,
       "Show all currently loaded modules",
       "Show all currently loaded modules",
@@ -199,6 +228,16 @@ struct subcommand showoptions[] = {
       "Show all active sessions in MaxScale",
       "Show all active sessions in MaxScale",
       {0, 0, 0} },
+    { "topsessions", 1, dprintTopSessions,
+      "Show the busiest client sessions ranked by a metric, one of\n"
+      "\t\tqueries, in, out, writeq or latency. e.g. show topsessions queries",
+      "Show the busiest client sessions ranked by a metric, one of\n"
+      "\t\tqueries, in, out, writeq or latency. e.g. show topsessions queries",
+      {ARG_TYPE_STRING, 0, 0} },
+    { "spinlocks", 0, dprintAllSpinlocks,
+      "Show the contention statistics of the global spinlocks",
+      "Show the contention statistics of the global spinlocks",
+      {0, 0, 0} },
     { "tasks", 0, hkshow_tasks,
       "Show all active housekeeper tasks in MaxScale",
       "Show all active housekeeper tasks in MaxScale",
@@ -207,6 +246,10 @@ struct subcommand showoptions[] = {
       "Show the status of the polling threads in MaxScale",
       "Show the status of the polling threads in MaxScale",
       {0, 0, 0} },
+    { "trace", 0, dprintTraceRings,
+      "Show the flight recorder event rings of all threads",
+      "Show the flight recorder event rings of all threads",
+      {0, 0, 0} },
     { "users", 0, telnetdShowUsers,
       "Show statistics and user names for the debug interface",
       "Show statistics and user names for the debug interface",
@@ -430,6 +473,8 @@ static void enable_syslog();
 static void disable_syslog();
 static void enable_maxlog();
 static void disable_maxlog();
+static void enable_filter_profiling(DCB *dcb);
+static void disable_filter_profiling(DCB *dcb);
 
 /**
  *  * The subcommands of the enable command
@@ -517,6 +562,16 @@ struct subcommand enableoptions[] = {
         "Enable maxlog logging",
         {0, 0, 0}
     },
+    {
+        "filter-profiling",
+        0,
+        enable_filter_profiling,
+        "Enable profiling of the filter chains of new sessions; "
+        "the results are shown by 'show filter'",
+        "Enable profiling of the filter chains of new sessions; "
+        "the results are shown by 'show filter'",
+        {0, 0, 0}
+    },
     {
         NULL,
         0,
@@ -615,6 +670,14 @@ struct subcommand disableoptions[] = {
         "Disable maxlog logging",
         {0, 0, 0}
     },
+    {
+        "filter-profiling",
+        0,
+        disable_filter_profiling,
+        "Disable profiling of the filter chains of new sessions",
+        "Disable profiling of the filter chains of new sessions",
+        {0, 0, 0}
+    },
     {
         NULL,
         0,
@@ -766,6 +829,33 @@ flushlogs(DCB *pdcb)
     mxs_log_rotate();
 }
 
+/**
+ * Callback for mxs_log_suppression_stats, prints one suppressed call site
+ *
+ * @param userdata      The stream to write output to
+ * @param file          File name of the logging call site
+ * @param line          Line number of the logging call site
+ * @param suppressed    Number of messages suppressed for the site
+ */
+static void
+print_suppression(void *userdata, const char *file, int line, uint64_t suppressed)
+{
+    dcb_printf((DCB *)userdata, "%-40s | %6d | %12lu\n",
+               file, line, (unsigned long)suppressed);
+}
+
+/**
+ * Show the logging call sites that have had duplicate messages suppressed
+ *
+ * @param pdcb          The stream to write output to
+ */
+static void
+showLogSuppression(DCB *pdcb)
+{
+    dcb_printf(pdcb, "%-40s | %6s | %12s\n", "File", "Line", "Suppressed");
+    dcb_printf(pdcb, "-----------------------------------------+--------+-------------\n");
+    mxs_log_suppression_stats(print_suppression, pdcb);
+}
 
 /**
  * The subcommands of the flush command
@@ -909,8 +999,194 @@ convert_arg(int mode, char *arg, int arg_type)
     return 0;
 }
 
+/** How long the admin executor thread sleeps when idle, in milliseconds */
+#define ADMIN_EXEC_INTERVAL 10
+
+/**
+ * A command line handed off to the admin executor thread
+ */
+typedef struct admin_request {
+    CLI_SESSION *cli;           /*< The CLI session the command came from */
+    DCB *dcb;                   /*< The client DCB for the output */
+    char cmdbuf[cmdbuflen];     /*< Copy of the command line */
+    struct admin_request *next; /*< Next request in the queue */
+} ADMIN_REQUEST;
+
+static SPINLOCK admin_queue_lock = SPINLOCK_INIT;
+static ADMIN_REQUEST *admin_qhead = NULL;
+static ADMIN_REQUEST *admin_qtail = NULL;
+static int admin_executor_running = 0;
+static THREAD admin_executor;
+
+static int execute_cmd_body(CLI_SESSION *cli, DCB *dcb, char *cmdbuf);
+
+/**
+ * Take a reference on a session so that it survives until the admin
+ * executor thread has finished with a command queued for it.
+ *
+ * @param session       The session to pin
+ * @return Non-zero if the reference was taken
+ */
+static int
+admin_session_pin(SESSION *session)
+{
+    spinlock_acquire(&session->ses_lock);
+    if (session->state == SESSION_STATE_FREE ||
+        session->state == SESSION_STATE_TO_BE_FREED)
+    {
+        spinlock_release(&session->ses_lock);
+        return 0;
+    }
+    atomic_add(&session->refcount, 1);
+    spinlock_release(&session->ses_lock);
+    return 1;
+}
+
+/**
+ * The admin executor thread. Commands are interpreted and executed here
+ * rather than on the polling thread that owns the client DCB, so a heavy
+ * diagnostic command such as "show dcbs" never stalls event processing
+ * for production traffic. The output is streamed back through the write
+ * queue of the client DCB, which may be written from any thread, and the
+ * session's terminator is written once the command has completed so that
+ * clients always see the output before the completion marker.
+ *
+ * @param data  Unused thread argument
+ */
+static void
+admin_executor_thread(void *data)
+{
+    ADMIN_REQUEST *request;
+
+    while (1)
+    {
+        spinlock_acquire(&admin_queue_lock);
+        request = admin_qhead;
+        if (request)
+        {
+            admin_qhead = request->next;
+            if (admin_qhead == NULL)
+            {
+                admin_qtail = NULL;
+            }
+        }
+        spinlock_release(&admin_queue_lock);
+
+        if (request == NULL)
+        {
+            thread_millisleep(ADMIN_EXEC_INTERVAL);
+            continue;
+        }
+
+        /*
+         * The client may have gone away while the command was queued.
+         * The reference taken on the session keeps the session itself
+         * alive; the DCB is revalidated before any output is written.
+         */
+        if (dcb_isvalid(request->dcb))
+        {
+            execute_cmd_body(request->cli, request->dcb, request->cmdbuf);
+            if (request->cli->terminator && dcb_isvalid(request->dcb))
+            {
+                dcb_printf(request->dcb, "%s", request->cli->terminator);
+            }
+        }
+        session_free(request->cli->session);
+        free(request);
+    }
+}
+
+/**
+ * We have a complete line from the user, hand it to the admin executor
+ * thread for execution.
+ *
+ * The quit command must close the client connection and so is detected
+ * here and handled by the caller on the polling thread; everything else
+ * is queued and the session's terminator is written to the client when
+ * the command completes.
+ *
+ * @param cli           The CLI_SESSION
+ * @return      Returns 0 if the interpreter should exit
+ */
+int
+execute_cmd(CLI_SESSION *cli)
+{
+    DCB           *dcb = cli->session->client_dcb;
+    ADMIN_REQUEST *request;
+    char          *ptr = cli->cmdbuf;
+    int            start = 0;
+
+    while (*ptr == ' ' || *ptr == '\t')
+    {
+        ptr++;
+    }
+    if (*ptr == 0 || *ptr == '\n' || *ptr == '\r')
+    {
+        /* Nothing to execute, complete the exchange at once */
+        memset(cli->cmdbuf, 0, cmdbuflen);
+        if (cli->terminator)
+        {
+            dcb_printf(dcb, "%s", cli->terminator);
+        }
+        return 1;
+    }
+    if (!strncasecmp(ptr, "quit", 4) &&
+        (ptr[4] == 0 || ptr[4] == ' ' || ptr[4] == '\t' ||
+         ptr[4] == '\r' || ptr[4] == '\n'))
+    {
+        memset(cli->cmdbuf, 0, cmdbuflen);
+        if (cli->terminator)
+        {
+            dcb_printf(dcb, "%s", cli->terminator);
+        }
+        return 0;
+    }
+
+    if ((request = malloc(sizeof(ADMIN_REQUEST))) == NULL ||
+        !admin_session_pin(cli->session))
+    {
+        free(request);
+        memset(cli->cmdbuf, 0, cmdbuflen);
+        dcb_printf(dcb, "Unable to queue command for execution\n");
+        if (cli->terminator)
+        {
+            dcb_printf(dcb, "%s", cli->terminator);
+        }
+        return 1;
+    }
+    request->cli = cli;
+    request->dcb = dcb;
+    memcpy(request->cmdbuf, cli->cmdbuf, cmdbuflen);
+    request->cmdbuf[cmdbuflen - 1] = 0;
+    request->next = NULL;
+    memset(cli->cmdbuf, 0, cmdbuflen);
+
+    spinlock_acquire(&admin_queue_lock);
+    if (admin_qtail)
+    {
+        admin_qtail->next = request;
+    }
+    else
+    {
+        admin_qhead = request;
+    }
+    admin_qtail = request;
+    if (!admin_executor_running)
+    {
+        admin_executor_running = 1;
+        start = 1;
+    }
+    spinlock_release(&admin_queue_lock);
+
+    if (start)
+    {
+        thread_start(&admin_executor, admin_executor_thread, NULL);
+    }
+    return 1;
+}
+
 /**
- * We have a complete line from the user, lookup the commands and execute them
+ * Interpret and execute a complete command line from the user
  *
  * Commands are tokenised based on white space and then the first
  * word is checked againts the cmds table. If a match is found the
@@ -920,13 +1196,17 @@ convert_arg(int mode, char *arg, int arg_type)
  * assumed to the numeric values and will be converted before being passed
  * to the handler function for the command.
  *
+ * Runs on the admin executor thread; cmdbuf is the request's private
+ * copy of the command line and may be modified freely.
+ *
  * @param cli           The CLI_SESSION
+ * @param dcb           The DCB to stream output to
+ * @param cmdbuf        The command line to execute
  * @return      Returns 0 if the interpreter should exit
  */
-int
-execute_cmd(CLI_SESSION *cli)
+static int
+execute_cmd_body(CLI_SESSION *cli, DCB *dcb, char *cmdbuf)
 {
-    DCB           *dcb = cli->session->client_dcb;
     int            argc, i, j, found = 0;
     char          *args[MAXARGS + 1];
     unsigned long  arg1, arg2, arg3;
@@ -935,7 +1215,7 @@ execute_cmd(CLI_SESSION *cli)
     bool           in_space = false;
     int            nskip = 0;
 
-    args[0] = cli->cmdbuf;
+    args[0] = cmdbuf;
     ptr = args[0];
     lptr = ptr;
     i = 0;
@@ -1177,8 +1457,6 @@ execute_cmd(CLI_SESSION *cli)
                    "Command '%s' not known, type help for a list of available commands\n", args[0]);
     }
 
-    memset(cli->cmdbuf, 0, cmdbuflen);
-
     return 1;
 }
 
@@ -1482,21 +1760,13 @@ static void enable_sess_log_action(DCB *dcb, char *arg1, char *arg2)
     if (get_log_action(arg1, &entry))
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
+        SESSION* session = session_get_by_id(id);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
-
-        while (session)
+        if (session)
         {
-            if (session->ses_id == id)
-            {
-                session_enable_log_priority(session, entry.priority);
-                break;
-            }
-            session = session->next;
+            session_enable_log_priority(session, entry.priority);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1520,21 +1790,13 @@ static void disable_sess_log_action(DCB *dcb, char *arg1, char *arg2)
     if (get_log_action(arg1, &entry))
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
+        SESSION* session = session_get_by_id(id);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
-
-        while (session)
+        if (session)
         {
-            if (session->ses_id == id)
-            {
-                session_disable_log_priority(session, entry.priority);
-                break;
-            }
-            session = session->next;
+            session_disable_log_priority(session, entry.priority);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1595,21 +1857,13 @@ static void enable_sess_log_priority(DCB *dcb, char *arg1, char *arg2)
     if (priority != -1)
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
+        SESSION* session = session_get_by_id(id);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
-
-        while (session)
+        if (session)
         {
-            if (session->ses_id == id)
-            {
-                session_enable_log_priority(session, priority);
-                break;
-            }
-            session = session->next;
+            session_enable_log_priority(session, priority);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1633,21 +1887,13 @@ static void disable_sess_log_priority(DCB *dcb, char *arg1, char *arg2)
     if (priority != -1)
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
+        SESSION* session = session_get_by_id(id);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
-
-        while (session)
+        if (session)
         {
-            if (session->ses_id == id)
-            {
-                session_disable_log_priority(session, priority);
-                break;
-            }
-            session = session->next;
+            session_disable_log_priority(session, priority);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1819,6 +2065,32 @@ disable_maxlog()
     mxs_log_set_maxlog_enabled(false);
 }
 
+/**
+ * Enable filter profiling.
+ *
+ * @param dcb   The DCB to print the result to
+ */
+static void
+enable_filter_profiling(DCB *dcb)
+{
+    filterProfiling(1);
+    dcb_printf(dcb, "Filter profiling enabled for sessions "
+               "created from now on.\n");
+}
+
+/**
+ * Disable filter profiling.
+ *
+ * @param dcb   The DCB to print the result to
+ */
+static void
+disable_filter_profiling(DCB *dcb)
+{
+    filterProfiling(0);
+    dcb_printf(dcb, "Filter profiling disabled for sessions "
+               "created from now on.\n");
+}
+
 #if defined(FAKE_CODE)
 static void fail_backendfd(void)
 {
@@ -27,6 +27,7 @@
  * 16/02/15	Mark Riddoch		Initial implementation
  * 27/02/15	Massimiliano Pinto	Added maxinfo_add_mysql_user
  * 09/09/2015   Martin Brampton         Modify error handler
+ * 30/06/2016   Mark Riddoch            Start the snapshot publisher task
  *
  * @endverbatim
  */
@@ -184,6 +185,12 @@ int		i;
 	instances = inst;
 	spinlock_release(&instlock);
 
+	/*
+	 * Start the task that publishes the snapshot tables the SHOW
+	 * commands are served from.
+	 */
+	maxinfo_snapshot_init();
+
 	/*
 	 * The following add the service user to service->users via mysql_users_alloc()
 	 * password to be used.
@@ -25,6 +25,9 @@
  *
  * Date		Who		Description
  * 17/02/15	Mark Riddoch	Initial implementation
+ * 30/06/16	Mark Riddoch	SHOW commands served from the snapshot tables
+ * 03/07/16	Mark Riddoch	WHERE clause predicates on the session tables
+ *				pushed down into the list iteration
  *
  * @endverbatim
  */
@@ -106,9 +109,32 @@ maxinfo_execute(DCB *dcb, MAXINFO_TREE *tree)
 	}
 }
 
+/**
+ * Return the value of an equality predicate on the given column from a
+ * WHERE clause parse tree, or NULL if the clause does not constrain the
+ * column.
+ *
+ * @param filter	The WHERE clause parse tree, may be NULL
+ * @param column	The column name to look for
+ * @return The value the column must be equal to, or NULL
+ */
+static char *
+maxinfo_filter_value(MAXINFO_TREE *filter, char *column)
+{
+	if (filter && filter->op == MAXOP_EQUAL && filter->value
+			&& strcasecmp(filter->value, column) == 0
+			&& filter->left && filter->left->op == MAXOP_LITERAL)
+		return filter->left->value;
+	return NULL;
+}
+
 /**
  * Fetch the list of services and stream as a result set
  *
+ * The rows come from the periodic snapshot so that monitoring queries
+ * do not walk the live service list under its lock; the live list is
+ * only used if no snapshot has been published.
+ *
  * @param dcb	DCB to which to stream result set
  * @param tree	Potential like clause (currently unused)
  */
@@ -117,9 +143,10 @@ exec_show_services(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*set;
 
-	if ((set = serviceGetList()) == NULL)
+	if ((set = maxinfo_snapshot_fetch(MAXINFO_TAB_SERVICES)) == NULL
+			&& (set = serviceGetList()) == NULL)
 		return;
-	
+
 	resultset_stream_mysql(set, dcb);
 	resultset_free(set);
 }
@@ -135,7 +162,8 @@ exec_show_listeners(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*set;
 
-	if ((set = serviceGetListenerList()) == NULL)
+	if ((set = maxinfo_snapshot_fetch(MAXINFO_TAB_LISTENERS)) == NULL
+			&& (set = serviceGetListenerList()) == NULL)
 		return;
 	
 	resultset_stream_mysql(set, dcb);
@@ -145,17 +173,30 @@ RESULTSET	*set;
 /**
  * Fetch the list of sessions and stream as a result set
  *
+ * A WHERE clause on the service or state column is pushed down into the
+ * session list iteration so that only the matching sessions are ever
+ * materialized; unfiltered queries are served from the snapshot.
+ *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	Potential where clause
  */
 static void
 exec_show_sessions(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*set;
+char		*service = maxinfo_filter_value(tree, "service");
+char		*state = maxinfo_filter_value(tree, "state");
 
-	if ((set = sessionGetList(SESSION_LIST_ALL)) == NULL)
+	if (service || state)
+	{
+		if ((set = sessionGetFilteredList(SESSION_LIST_ALL,
+				service, state)) == NULL)
+			return;
+	}
+	else if ((set = maxinfo_snapshot_fetch(MAXINFO_TAB_SESSIONS)) == NULL
+			&& (set = sessionGetList(SESSION_LIST_ALL)) == NULL)
 		return;
-	
+
 	resultset_stream_mysql(set, dcb);
 	resultset_free(set);
 }
@@ -163,17 +204,30 @@ RESULTSET	*set;
 /**
  * Fetch the list of client sessions and stream as a result set
  *
+ * A WHERE clause on the service or state column is pushed down into the
+ * session list iteration so that only the matching sessions are ever
+ * materialized; unfiltered queries are served from the snapshot.
+ *
  * @param dcb	DCB to which to stream result set
- * @param tree	Potential like clause (currently unused)
+ * @param tree	Potential where clause
  */
 static void
 exec_show_clients(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*set;
+char		*service = maxinfo_filter_value(tree, "service");
+char		*state = maxinfo_filter_value(tree, "state");
 
-	if ((set = sessionGetList(SESSION_LIST_CONNECTION)) == NULL)
+	if (service || state)
+	{
+		if ((set = sessionGetFilteredList(SESSION_LIST_CONNECTION,
+				service, state)) == NULL)
+			return;
+	}
+	else if ((set = maxinfo_snapshot_fetch(MAXINFO_TAB_CLIENTS)) == NULL
+			&& (set = sessionGetList(SESSION_LIST_CONNECTION)) == NULL)
 		return;
-	
+
 	resultset_stream_mysql(set, dcb);
 	resultset_free(set);
 }
@@ -189,7 +243,8 @@ exec_show_servers(DCB *dcb, MAXINFO_TREE *tree)
 {
 RESULTSET	*set;
 
-	if ((set = serverGetList()) == NULL)
+	if ((set = maxinfo_snapshot_fetch(MAXINFO_TAB_SERVERS)) == NULL
+			&& (set = serverGetList()) == NULL)
 		return;
 	
 	resultset_stream_mysql(set, dcb);
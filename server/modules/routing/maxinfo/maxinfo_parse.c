@@ -25,6 +25,8 @@
  *
  * Date		Who		Description
  * 16/02/15	Mark Riddoch	Initial implementation
+ * 03/07/16	Mark Riddoch	Parse WHERE clause equality predicates
+ *				for the SHOW commands
  *
  * @endverbatim
  */
@@ -100,6 +102,50 @@ MAXINFO_TREE	*col, *table;
 					return NULL;
 				}
 			}
+			else if (token == LT_WHERE)
+			{
+				char	*column;
+
+				free(text);	// not needed
+				if ((ptr = fetch_token(ptr, &token, &text)) == NULL
+						|| token != LT_STRING)
+				{
+					// Expected column name
+					*parse_error = PARSE_SYNTAX_ERROR;
+					if (ptr)
+						free(text);
+					free_tree(tree);
+					return NULL;
+				}
+				column = text;
+				if ((ptr = fetch_token(ptr, &token, &text)) == NULL
+						|| token != LT_EQUAL)
+				{
+					// Expected '='
+					*parse_error = PARSE_SYNTAX_ERROR;
+					if (ptr)
+						free(text);
+					free(column);
+					free_tree(tree);
+					return NULL;
+				}
+				free(text);	// not needed
+				if ((ptr = fetch_token(ptr, &token, &text)) == NULL
+						|| token != LT_STRING)
+				{
+					// Expected value
+					*parse_error = PARSE_SYNTAX_ERROR;
+					if (ptr)
+						free(text);
+					free(column);
+					free_tree(tree);
+					return NULL;
+				}
+				tree->right = make_tree_node(MAXOP_EQUAL, column,
+						make_tree_node(MAXOP_LITERAL,
+						text, NULL, NULL), NULL);
+				return tree;
+			}
 			// Malformed show
 			free(text);
 			free_tree(tree);
@@ -303,6 +349,7 @@ static struct
     { "select",     LT_SELECT},
     { "from",       LT_FROM},
     { "like",       LT_LIKE},
+    { "where",      LT_WHERE},
     { "=",          LT_EQUAL},
     { ",",          LT_COMMA},
     { "*",          LT_STAR},
@@ -356,6 +403,14 @@ int	i;
 			quote = *s1++;
 		}
 	}
+	if (quote == '\0' && *s1 == '=')
+	{
+		/* The '=' is also a delimiter so it would never be
+		 * gathered by the loop below */
+		*text = strndup(s1, 1);
+		*token = LT_EQUAL;
+		return s1 + 1;
+	}
 	s2 = s1;
 	while (*s2)
 	{
@@ -0,0 +1,326 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright MariaDB Corporation Ab 2016
+ */
+
+/**
+ * @file maxinfo_snapshot.c - Pre-aggregated snapshots of the diagnostic tables
+ *
+ * The SHOW commands of the maxinfo interface were answered by walking
+ * the live service, server and session lists under their spinlocks,
+ * one list traversal per row, so a monitoring client polling maxinfo
+ * held up the traffic those locks protect. A housekeeper task now
+ * materialises the expensive tables into a read-only snapshot once a
+ * second; the SHOW commands stream rows from the snapshot and never
+ * touch a live list or its lock.
+ *
+ * A snapshot is reference counted: a reader streaming a result set
+ * when the task publishes a fresh snapshot keeps the old one alive
+ * until the stream completes.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date		Who		Description
+ * 30/06/16	Mark Riddoch	Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <service.h>
+#include <session.h>
+#include <server.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <housekeeper.h>
+#include <maxinfo.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <resultset.h>
+
+/** A column definition copied out of a live result set */
+typedef struct
+{
+    char            *name;  /*< Column name */
+    int             len;    /*< Column length */
+    RESULT_COL_TYPE type;   /*< Column type */
+} SNAP_COLUMN;
+
+/** One materialised diagnostic table */
+typedef struct
+{
+    int         n_cols; /*< Number of columns */
+    SNAP_COLUMN *cols;  /*< The column definitions */
+    int         n_rows; /*< Number of rows */
+    char        ***rows; /*< Row data, an array of column value arrays */
+} SNAP_TABLE;
+
+/** A complete snapshot of all materialised tables */
+typedef struct
+{
+    int         refcount;   /*< References held by readers and the publisher */
+    SNAP_TABLE  tables[MAXINFO_TAB_LAST];
+} MAXINFO_SNAPSHOT;
+
+static SPINLOCK snapshot_lock = SPINLOCK_INIT;
+static MAXINFO_SNAPSHOT *current_snapshot = NULL;
+
+/** Context for streaming a snapshot table as a result set */
+typedef struct
+{
+    MAXINFO_SNAPSHOT *snapshot; /*< The snapshot holding the rows */
+    SNAP_TABLE       *table;    /*< The table being streamed */
+    int              rowno;     /*< Next row to stream */
+} SNAP_STREAM;
+
+/**
+ * Release a reference to a snapshot, freeing it when the last
+ * reference is dropped.
+ *
+ * @param snapshot	The snapshot to release
+ */
+static void
+snapshot_release(MAXINFO_SNAPSHOT *snapshot)
+{
+    int i, j, k;
+
+    if (atomic_add(&snapshot->refcount, -1) > 1)
+    {
+        return;
+    }
+    for (i = 0; i < MAXINFO_TAB_LAST; i++)
+    {
+        SNAP_TABLE *table = &snapshot->tables[i];
+
+        for (j = 0; j < table->n_rows; j++)
+        {
+            for (k = 0; k < table->n_cols; k++)
+            {
+                free(table->rows[j][k]);
+            }
+            free(table->rows[j]);
+        }
+        free(table->rows);
+        for (j = 0; j < table->n_cols; j++)
+        {
+            free(table->cols[j].name);
+        }
+        free(table->cols);
+    }
+    free(snapshot);
+}
+
+/**
+ * Materialise a live result set into a snapshot table. The live set
+ * is pumped to exhaustion, which also frees its row callback data,
+ * and then freed.
+ *
+ * @param table	The snapshot table to fill
+ * @param live	The live result set, may be NULL
+ */
+static void
+snapshot_materialise(SNAP_TABLE *table, RESULTSET *live)
+{
+    RESULT_COLUMN *col;
+    RESULT_ROW *row;
+    int i;
+
+    if (live == NULL)
+    {
+        return;
+    }
+    table->n_cols = live->n_cols;
+    if ((table->cols = (SNAP_COLUMN *)calloc(live->n_cols, sizeof(SNAP_COLUMN))) == NULL)
+    {
+        table->n_cols = 0;
+    }
+    for (col = live->column, i = 0; col && table->cols; col = col->next, i++)
+    {
+        table->cols[i].name = strdup(col->name);
+        table->cols[i].len = col->len;
+        table->cols[i].type = col->type;
+    }
+    while ((row = live->fetchrow(live, live->userdata)) != NULL)
+    {
+        char **cols;
+
+        if (table->cols &&
+            (cols = (char **)calloc(live->n_cols, sizeof(char *))) != NULL)
+        {
+            char ***bigger;
+
+            for (i = 0; i < row->n_cols && i < live->n_cols; i++)
+            {
+                cols[i] = row->cols[i] ? strdup(row->cols[i]) : NULL;
+            }
+            if ((bigger = (char ***)realloc(table->rows,
+                                            (table->n_rows + 1) * sizeof(char **))) != NULL)
+            {
+                table->rows = bigger;
+                table->rows[table->n_rows++] = cols;
+            }
+            else
+            {
+                for (i = 0; i < live->n_cols; i++)
+                {
+                    free(cols[i]);
+                }
+                free(cols);
+            }
+        }
+        resultset_free_row(row);
+    }
+    resultset_free(live);
+}
+
+/**
+ * The housekeeper task; build a fresh snapshot of every materialised
+ * table from the live lists and publish it, releasing the reference
+ * the publisher held on the previous snapshot.
+ *
+ * @param data	Unused task data
+ */
+static void
+maxinfo_snapshot_task(void *data)
+{
+    MAXINFO_SNAPSHOT *snapshot, *previous;
+
+    if ((snapshot = (MAXINFO_SNAPSHOT *)calloc(1, sizeof(MAXINFO_SNAPSHOT))) == NULL)
+    {
+        return;
+    }
+    snapshot->refcount = 1;
+    snapshot_materialise(&snapshot->tables[MAXINFO_TAB_SERVICES],
+                         serviceGetList());
+    snapshot_materialise(&snapshot->tables[MAXINFO_TAB_LISTENERS],
+                         serviceGetListenerList());
+    snapshot_materialise(&snapshot->tables[MAXINFO_TAB_SESSIONS],
+                         sessionGetList(SESSION_LIST_ALL));
+    snapshot_materialise(&snapshot->tables[MAXINFO_TAB_CLIENTS],
+                         sessionGetList(SESSION_LIST_CONNECTION));
+    snapshot_materialise(&snapshot->tables[MAXINFO_TAB_SERVERS],
+                         serverGetList());
+
+    spinlock_acquire(&snapshot_lock);
+    previous = current_snapshot;
+    current_snapshot = snapshot;
+    spinlock_release(&snapshot_lock);
+    if (previous)
+    {
+        snapshot_release(previous);
+    }
+}
+
+/**
+ * Start the snapshot publisher. Registers the housekeeper task on the
+ * first call and takes the initial snapshot immediately so that the
+ * first query served does not find the snapshot empty.
+ */
+void
+maxinfo_snapshot_init()
+{
+    static int initialised = 0;
+
+    if (atomic_add(&initialised, 1) == 0)
+    {
+        maxinfo_snapshot_task(NULL);
+        hktask_add("MaxInfo snapshot", maxinfo_snapshot_task, NULL, 1);
+    }
+}
+
+/**
+ * Row callback streaming rows out of a snapshot table. When the last
+ * row has been streamed the reference on the snapshot is released.
+ *
+ * @param set	The result set being streamed
+ * @param data	The stream context
+ * @return The next row or NULL when the table is exhausted
+ */
+static RESULT_ROW *
+snapshot_row_callback(RESULTSET *set, void *data)
+{
+    SNAP_STREAM *stream = (SNAP_STREAM *)data;
+    RESULT_ROW *row;
+    char **cols;
+    int i;
+
+    if (stream->rowno >= stream->table->n_rows)
+    {
+        snapshot_release(stream->snapshot);
+        free(stream);
+        return NULL;
+    }
+    cols = stream->table->rows[stream->rowno++];
+    row = resultset_make_row(set);
+    for (i = 0; i < stream->table->n_cols; i++)
+    {
+        if (cols[i])
+        {
+            resultset_row_set(row, i, cols[i]);
+        }
+    }
+    return row;
+}
+
+/**
+ * Return a result set streaming the given table from the current
+ * snapshot, without touching any live list. The caller frees the
+ * result set as usual after streaming it.
+ *
+ * @param tab	The table wanted
+ * @return A result set or NULL if no snapshot has been published
+ */
+RESULTSET *
+maxinfo_snapshot_fetch(MAXINFO_TABLE tab)
+{
+    MAXINFO_SNAPSHOT *snapshot;
+    SNAP_STREAM *stream;
+    RESULTSET *set;
+    int i;
+
+    spinlock_acquire(&snapshot_lock);
+    if ((snapshot = current_snapshot) == NULL)
+    {
+        spinlock_release(&snapshot_lock);
+        return NULL;
+    }
+    atomic_add(&snapshot->refcount, 1);
+    spinlock_release(&snapshot_lock);
+
+    if ((stream = (SNAP_STREAM *)malloc(sizeof(SNAP_STREAM))) == NULL)
+    {
+        snapshot_release(snapshot);
+        return NULL;
+    }
+    stream->snapshot = snapshot;
+    stream->table = &snapshot->tables[tab];
+    stream->rowno = 0;
+    if ((set = resultset_create(snapshot_row_callback, stream)) == NULL)
+    {
+        snapshot_release(snapshot);
+        free(stream);
+        return NULL;
+    }
+    for (i = 0; i < stream->table->n_cols; i++)
+    {
+        resultset_add_column(set, stream->table->cols[i].name,
+                             stream->table->cols[i].len,
+                             stream->table->cols[i].type);
+    }
+    return set;
+}
@@ -71,6 +71,10 @@
  * 09/09/2015   Martin Brampton         Modify error handler
  * 25/09/2015   Martin Brampton         Block callback processing when no router session in the DCB
  * 09/11/2015   Martin Brampton         Modified routeQuery - must free "queue" regardless of outcome
+ * 02/06/2016   Mark Riddoch            Backend connections leased from the service pool
+ * 30/06/2016   Mark Riddoch            Maintain a heap of the eligible backends so
+ *                                      that server selection no longer walks the
+ *                                      whole server array for every new session
  *
  * @endverbatim
  */
@@ -180,6 +184,196 @@ GetModuleObject()
     return &MyObject;
 }
 
+/**
+ * Compare the weighted connection load of two backends.
+ *
+ * The load of a backend is the current connection count scaled by the
+ * routing weight, exactly as the previous linear candidate scan computed
+ * it. Ties are broken by the total number of connections made to the
+ * server since startup, which spreads sessions over the backends during
+ * periods of very low load.
+ *
+ * @param b1	The first backend
+ * @param b2	The second backend
+ * @return	Negative if b1 carries less load than b2
+ */
+static int
+backend_cmp(BACKEND *b1, BACKEND *b2)
+{
+    int l1 = ((b1->current_connection_count + 1) * 1000) / b1->weight;
+    int l2 = ((b2->current_connection_count + 1) * 1000) / b2->weight;
+
+    if (l1 != l2)
+    {
+        return l1 - l2;
+    }
+    return b1->server->stats.n_connections - b2->server->stats.n_connections;
+}
+
+/**
+ * Move the backend at the given heap position towards the root until the
+ * min-heap property is restored. The instance lock must be held.
+ *
+ * @param inst	The router instance
+ * @param pos	Heap position of the backend to sift
+ */
+static void
+heap_siftup(ROUTER_INSTANCE *inst, int pos)
+{
+    BACKEND *backend = inst->heap[pos];
+
+    while (pos > 0 && backend_cmp(backend, inst->heap[(pos - 1) / 2]) < 0)
+    {
+        inst->heap[pos] = inst->heap[(pos - 1) / 2];
+        inst->heap[pos]->heap_pos = pos;
+        pos = (pos - 1) / 2;
+    }
+    inst->heap[pos] = backend;
+    backend->heap_pos = pos;
+}
+
+/**
+ * Move the backend at the given heap position towards the leaves until the
+ * min-heap property is restored. The instance lock must be held.
+ *
+ * @param inst	The router instance
+ * @param pos	Heap position of the backend to sift
+ */
+static void
+heap_siftdown(ROUTER_INSTANCE *inst, int pos)
+{
+    BACKEND *backend = inst->heap[pos];
+
+    while (2 * pos + 1 < inst->nheap)
+    {
+        int child = 2 * pos + 1;
+
+        if (child + 1 < inst->nheap
+            && backend_cmp(inst->heap[child + 1], inst->heap[child]) < 0)
+        {
+            child++;
+        }
+        if (backend_cmp(inst->heap[child], backend) >= 0)
+        {
+            break;
+        }
+        inst->heap[pos] = inst->heap[child];
+        inst->heap[pos]->heap_pos = pos;
+        pos = child;
+    }
+    inst->heap[pos] = backend;
+    backend->heap_pos = pos;
+}
+
+/**
+ * Test whether a backend may be offered to new sessions. This is the same
+ * set of checks the candidate loop used to apply on every session creation;
+ * they are now evaluated only when the heap is rebuilt.
+ *
+ * @param inst		The router instance
+ * @param backend	The backend to check
+ * @return		True if the backend is eligible for selection
+ */
+static bool
+backend_eligible(ROUTER_INSTANCE *inst, BACKEND *backend)
+{
+    if (SERVER_IN_MAINT(backend->server) || backend->weight == 0)
+    {
+        return false;
+    }
+    if (!SERVER_IS_RUNNING(backend->server) ||
+        (backend->server->status & inst->bitmask & inst->bitvalue) == 0)
+    {
+        return false;
+    }
+    if (backend == inst->master_host && (inst->bitvalue & SERVER_SLAVE))
+    {
+        /* Skip the root Master here, as it could also be slave of an
+         * external server that is not in the configuration.
+         * Intermediate masters (Relay Servers) are also slave and will
+         * be selected as Slave(s)
+         */
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Rebuild the heap of eligible backends and refresh the cached root master.
+ * Called with the instance lock held, either at instance creation or from
+ * the server status callback when a monitor alters a server.
+ *
+ * @param inst	The router instance
+ */
+static void
+rebuild_backend_heap(ROUTER_INSTANCE *inst)
+{
+    int i;
+
+    inst->master_host = get_root_master(inst->servers);
+    inst->nheap = 0;
+    for (i = 0; inst->servers[i]; i++)
+    {
+        inst->servers[i]->heap_pos = -1;
+    }
+    for (i = 0; inst->servers[i]; i++)
+    {
+        if (backend_eligible(inst, inst->servers[i]))
+        {
+            inst->heap[inst->nheap] = inst->servers[i];
+            inst->nheap++;
+            heap_siftup(inst, inst->nheap - 1);
+        }
+    }
+}
+
+/**
+ * Server status change callback. The eligibility of the backends and the
+ * identity of the root master only change when the status bits of a server
+ * change, so this is the one place the heap needs a full rebuild.
+ *
+ * @param server	The server that changed, unused
+ * @param old_status	The previous status bits, unused
+ * @param new_status	The new status bits, unused
+ * @param userdata	The router instance that subscribed
+ */
+static void
+backend_status_change(SERVER *server, unsigned int old_status,
+                      unsigned int new_status, void *userdata)
+{
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) userdata;
+
+    spinlock_acquire(&inst->lock);
+    rebuild_backend_heap(inst);
+    spinlock_release(&inst->lock);
+}
+
+/**
+ * Apply a connection count change to a backend and re-sift it within the
+ * heap so that the heap top remains the least loaded eligible backend.
+ *
+ * @param inst		The router instance
+ * @param backend	The backend gaining or losing a connection
+ * @param delta		The change to apply to the connection count
+ * @return		The connection count after the change
+ */
+static int
+backend_change_connections(ROUTER_INSTANCE *inst, BACKEND *backend, int delta)
+{
+    int count;
+
+    spinlock_acquire(&inst->lock);
+    backend->current_connection_count += delta;
+    count = backend->current_connection_count;
+    if (backend->heap_pos >= 0)
+    {
+        heap_siftup(inst, backend->heap_pos);
+        heap_siftdown(inst, backend->heap_pos);
+    }
+    spinlock_release(&inst->lock);
+    return count;
+}
+
 /**
  * Create an instance of the router for a particular service
  * within the gateway.
@@ -239,6 +433,7 @@ createInstance(SERVICE *service, char **options)
         inst->servers[n]->server = sref->server;
         inst->servers[n]->current_connection_count = 0;
         inst->servers[n]->weight = 1000;
+        inst->servers[n]->heap_pos = -1;
         n++;
     }
     inst->servers[n] = NULL;
@@ -359,6 +554,25 @@ createInstance(SERVICE *service, char **options)
         inst->bitmask |= (SERVER_RUNNING);
         inst->bitvalue |= SERVER_RUNNING;
     }
+
+    /*
+     * Build the heap of eligible backends used for session routing and
+     * subscribe to server status changes so that the heap and the cached
+     * root master are refreshed whenever a monitor alters a server.
+     */
+    if ((inst->heap = (BACKEND **) calloc(n + 1, sizeof(BACKEND *))) == NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            free(inst->servers[i]);
+        }
+        free(inst->servers);
+        free(inst);
+        return NULL;
+    }
+    rebuild_backend_heap(inst);
+    server_status_subscribe(backend_status_change, inst);
+
     /*
      * We have completed the creation of the instance data, so now
      * insert this router instance into the linked list of routers
@@ -385,7 +599,6 @@ newSession(ROUTER *instance, SESSION *session)
     ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
     ROUTER_CLIENT_SES *client_rses;
     BACKEND *candidate = NULL;
-    int i;
     BACKEND *master_host = NULL;
 
     MXS_DEBUG("%lu [newSession] new router session with session "
@@ -408,122 +621,35 @@ newSession(ROUTER *instance, SESSION *session)
 #endif
 
     /**
-     * Find the Master host from available servers
+     * Find a backend server to connect to. The heap of eligible backends
+     * is maintained on server status transitions, so the load balancing
+     * decision is merely a read of the heap top here; the subsequent
+     * connection count bump re-sifts the chosen backend.
      */
-    master_host = get_root_master(inst->servers);
-
-    /**
-     * Find a backend server to connect to. This is the extent of the
-     * load balancing algorithm we need to implement for this simple
-     * connection router.
-     */
-
-    /*
-     * Loop over all the servers and find any that have fewer connections
-     * than the candidate server.
-     *
-     * If a server has less connections than the current candidate we mark this
-     * as the new candidate to connect to.
-     *
-     * If a server has the same number of connections currently as the candidate
-     * and has had less connections over time than the candidate it will also
-     * become the new candidate. This has the effect of spreading the
-     * connections over different servers during periods of very low load.
-     */
-    for (i = 0; inst->servers[i]; i++)
+    spinlock_acquire(&inst->lock);
+    master_host = inst->master_host;
+    if (inst->bitvalue & SERVER_MASTER)
     {
-        if (inst->servers[i])
-        {
-            MXS_DEBUG("%lu [newSession] Examine server in port %d with "
-                      "%d connections. Status is %s, "
-                      "inst->bitvalue is %d",
-                      pthread_self(),
-                      inst->servers[i]->server->port,
-                      inst->servers[i]->current_connection_count,
-                      STRSRVSTATUS(inst->servers[i]->server),
-                      inst->bitmask);
-        }
-
-        if (SERVER_IN_MAINT(inst->servers[i]->server))
+        if (master_host && master_host->heap_pos >= 0)
         {
-            continue;
+            /* If option is "master" return only the root Master as there
+             * could be intermediate masters (Relay Servers)
+             * and they must not be selected.
+             */
+            candidate = master_host;
         }
-
-        if (inst->servers[i]->weight == 0)
+        else if (master_host && inst->nheap > 0)
         {
-            continue;
-        }
-
-        /* Check server status bits against bitvalue from router_options */
-        if (inst->servers[i] &&
-            SERVER_IS_RUNNING(inst->servers[i]->server) &&
-            (inst->servers[i]->server->status & inst->bitmask & inst->bitvalue))
-        {
-            if (master_host)
-            {
-                if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_SLAVE))
-                {
-                    /* skip root Master here, as it could also be slave of an external server
-                     * that is not in the configuration.
-                     * Intermediate masters (Relay Servers) are also slave and will be selected
-                     * as Slave(s)
-                     */
-
-                    continue;
-                }
-                if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_MASTER))
-                {
-                    /* If option is "master" return only the root Master as there
-                     * could be intermediate masters (Relay Servers)
-                     * and they must not be selected.
-                     */
-
-                    candidate = master_host;
-                    break;
-                }
-            }
-            else
-            {
-                /* master_host is NULL, no master server.
-                 * If requested router_option is 'master'
-                 * candidate wll be NULL.
-                 */
-                if (inst->bitvalue & SERVER_MASTER)
-                {
-                    candidate = NULL;
-                    break;
-                }
-            }
-
-            /* If no candidate set, set first running server as
-            our initial candidate server */
-            if (candidate == NULL)
-            {
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight <
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight)
-            {
-                /* This running server has fewer
-                connections, set it as a new candidate */
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight ==
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight &&
-                     inst->servers[i]->server->stats.n_connections <
-                     candidate->server->stats.n_connections)
-            {
-                /* This running server has the same number
-                of connections currently as the candidate
-                but has had fewer connections over time
-                than candidate, set this server to candidate*/
-                candidate = inst->servers[i];
-            }
+            /* The root Master fails the status checks, fall back to the
+             * least loaded of the other eligible masters.
+             */
+            candidate = inst->heap[0];
         }
+        /* master_host is NULL, no master server: candidate stays NULL. */
+    }
+    else if (inst->nheap > 0)
+    {
+        candidate = inst->heap[0];
     }
 
     /* There is no candidate server here!
@@ -532,27 +658,33 @@ newSession(ROUTER *instance, SESSION *session)
      */
     if (!candidate)
     {
-        if (master_host)
-        {
-            candidate = master_host;
-        }
-        else
+        candidate = master_host;
+    }
+
+    if (candidate)
+    {
+        /*
+         * We now have the server with the least weighted load.
+         * Bump the connection count for this server
+         */
+        candidate->current_connection_count++;
+        if (candidate->heap_pos >= 0)
         {
-            MXS_ERROR("Failed to create new routing session. "
-                      "Couldn't find eligible candidate server. Freeing "
-                      "allocated resources.");
-            free(client_rses);
-            return NULL;
+            heap_siftdown(inst, candidate->heap_pos);
         }
     }
+    spinlock_release(&inst->lock);
 
-    client_rses->rses_capabilities = RCAP_TYPE_PACKET_INPUT;
+    if (!candidate)
+    {
+        MXS_ERROR("Failed to create new routing session. "
+                  "Couldn't find eligible candidate server. Freeing "
+                  "allocated resources.");
+        free(client_rses);
+        return NULL;
+    }
 
-    /*
-     * We now have the server with the least connections.
-     * Bump the connection count for this server
-     */
-    atomic_add(&candidate->current_connection_count, 1);
+    client_rses->rses_capabilities = RCAP_TYPE_PACKET_INPUT;
     client_rses->backend = candidate;
     MXS_DEBUG("%lu [newSession] Selected server in port %d. "
               "Connections : %d\n",
@@ -561,15 +693,15 @@ newSession(ROUTER *instance, SESSION *session)
               candidate->current_connection_count);
 
     /*
-     * Open a backend connection, putting the DCB for this
-     * connection in the client_rses->backend_dcb
+     * Lease a backend connection from the service pool, putting the DCB
+     * for this connection in the client_rses->backend_dcb
      */
-    client_rses->backend_dcb = dcb_connect(candidate->server,
-                                           session,
-                                           candidate->server->protocol);
+    client_rses->backend_dcb = service_pool_lease_dcb(inst->service,
+                                                      candidate->server,
+                                                      session);
     if (client_rses->backend_dcb == NULL)
     {
-        atomic_add(&candidate->current_connection_count, -1);
+        backend_change_connections(inst, candidate, -1);
         free(client_rses);
         return NULL;
     }
@@ -620,10 +752,10 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     ROUTER_INSTANCE* router = (ROUTER_INSTANCE *) router_instance;
     ROUTER_CLIENT_SES* router_cli_ses =
         (ROUTER_CLIENT_SES *) router_client_ses;
-    int prev_val;
+    int conn_count;
 
-    prev_val = atomic_add(&router_cli_ses->backend->current_connection_count, -1);
-    ss_dassert(prev_val > 0);
+    conn_count = backend_change_connections(router, router_cli_ses->backend, -1);
+    ss_dassert(conn_count >= 0);
 
     spinlock_acquire(&router->lock);
 
@@ -653,7 +785,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
               router_cli_ses,
               router,
               router_cli_ses->backend->server->port,
-              prev_val - 1);
+              conn_count);
 
     free(router_cli_ses);
 }
@@ -668,6 +800,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
 static void
 closeSession(ROUTER *instance, void *router_session)
 {
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
     ROUTER_CLIENT_SES *router_cli_ses = (ROUTER_CLIENT_SES *) router_session;
     DCB* backend_dcb;
 
@@ -686,12 +819,12 @@ closeSession(ROUTER *instance, void *router_session)
         rses_end_locked_router_action(router_cli_ses);
 
         /**
-         * Close the backend server connection
+         * Release the backend server connection back to the service pool
          */
         if (backend_dcb != NULL)
         {
             CHK_DCB(backend_dcb);
-            dcb_close(backend_dcb);
+            service_pool_release_dcb(inst->service, backend_dcb);
         }
     }
 }
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <ctype.h>
 
 #include <router.h>
 #include <readwritesplit.h>
@@ -31,6 +32,7 @@
 #include <query_classifier.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <hk_heartbeat.h>
 #include <modinfo.h>
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
@@ -68,6 +70,44 @@ MODULE_INFO 	info = {
  *
  * 09/09/2015   Martin Brampton         Modify error handler
  * 25/09/2015   Martin Brampton         Block callback processing when no router session in the DCB
+ * 28/06/2016   Martin Brampton         Session command history compaction
+ * 28/06/2016   Mark Riddoch            Pipelining window for consecutive reads
+ * 03/07/2016   Mark Riddoch            Slave selection uses interpolated replication lag
+ * 03/07/2016   Mark Riddoch            Routing decisions taken against an atomic
+ *                                      status snapshot
+ * 03/07/2016   Mark Riddoch            Read only prepared statements are executed
+ *                                      on slave servers
+ * 03/07/2016   Mark Riddoch            Router session allocated from the arena
+ *                                      of the session
+ * 03/07/2016   Mark Riddoch            Route targets precomputed into a decision
+ *                                      table indexed by the query type
+ * 03/07/2016   Mark Riddoch            Data phase of LOAD DATA LOCAL INFILE
+ *                                      streamed directly to the master
+ * 03/07/2016   Mark Riddoch            Slaves at their max_inflight limit are
+ *                                      skipped and excess reads rerouted
+ * 03/07/2016   Mark Riddoch            Read only transactions are routed in
+ *                                      their entirety to a single slave
+ * 03/07/2016   Mark Riddoch            Master connection initiated before the
+ *                                      slaves so that routing starts as soon
+ *                                      as the master handshake completes
+ * 03/07/2016   Mark Riddoch            Reads stalled on a slow slave are hedged
+ *                                      with a copy sent to a second slave
+ * 03/07/2016   Mark Riddoch            Reads in flight on a failed slave are
+ *                                      replayed on another backend
+ * 05/07/2016   Mark Riddoch            Sessions switch to their established
+ *                                      connection to a promoted slave when
+ *                                      the master fails
+ * 05/07/2016   Mark Riddoch            Routed queries accumulated per backend
+ *                                      and shown in the diagnostics
+ * 05/07/2016   Mark Riddoch            Contiguity of a statement read from the
+ *                                      buffer type tag set at ingestion
+ * 05/07/2016   Mark Riddoch            Temporary tables counted in the session
+ *                                      so the per query checks stop once the
+ *                                      last one is dropped
+ * 05/07/2016   Mark Riddoch            The galera_write_split option routes
+ *                                      certification safe writes across the
+ *                                      synced nodes of a Galera cluster by
+ *                                      the hash of the target table
  *
  * @endverbatim
  */
@@ -102,6 +142,18 @@ static int  rses_get_max_replication_lag(ROUTER_CLIENT_SES* rses);
 static backend_ref_t* get_bref_from_dcb(ROUTER_CLIENT_SES* rses, DCB* dcb);
 static DCB* rses_get_client_dcb(ROUTER_CLIENT_SES* rses);
 
+/** Classification of a routed statement for the per-backend statistics */
+typedef enum backend_stat_kind {
+	BSTAT_READ,	/*< Statement routed as a read */
+	BSTAT_WRITE,	/*< Statement routed as a write */
+	BSTAT_SESCMD	/*< Session command */
+} backend_stat_kind_t;
+
+static void backend_stats_add(
+	BACKEND*            backend,
+	GWBUF*              buf,
+	backend_stat_kind_t kind);
+
 static backend_ref_t* check_candidate_bref(
 	backend_ref_t* candidate_bref,
 	backend_ref_t* new_bref,
@@ -117,11 +169,35 @@ static void check_create_tmp_table(
 	GWBUF*  querybuf,
 	qc_query_type_t type);
 
+static bool get_galera_write_target(
+	ROUTER_CLIENT_SES* rses,
+	GWBUF*  querybuf,
+	int     packet_type,
+	DCB**   p_dcb);
+
+static bool stream_load_data(
+	ROUTER_INSTANCE*   inst,
+	ROUTER_CLIENT_SES* rses,
+	GWBUF**            p_readbuf);
+
 static bool route_single_stmt(
 	ROUTER_INSTANCE*   inst,
 	ROUTER_CLIENT_SES* rses,
 	GWBUF*             querybuf);
 
+static bool pipeline_handle_stmt(
+	ROUTER_INSTANCE*   inst,
+	ROUTER_CLIENT_SES* rses,
+	GWBUF*             querybuf,
+	route_target_t     route_target,
+	bool*              succp);
+
+static void pipeline_parser_reset(backend_ref_t* bref);
+
+static int pipeline_count_responses(
+	backend_ref_t*     bref,
+	GWBUF*             writebuf);
+
 
 static  int getCapabilities();
 
@@ -153,6 +229,12 @@ int bref_cmp_current_load(
         const void* bref1,
         const void* bref2);
 
+int bref_cmp_response_time(
+        const void* bref1,
+        const void* bref2);
+
+static void bref_sample_response_time(backend_ref_t* bref);
+
 /**
  * The order of functions _must_ match with the order the select criteria are
  * listed in select_criteria_t definition in readwritesplit.h
@@ -163,7 +245,8 @@ int (*criteria_cmpfun[LAST_CRITERIA])(const void*, const void*)=
         bref_cmp_global_conn,
         bref_cmp_router_conn,
         bref_cmp_behind_master,
-        bref_cmp_current_load
+        bref_cmp_current_load,
+        bref_cmp_response_time
 };
 
 static bool select_connect_backend_servers(
@@ -176,6 +259,18 @@ static bool select_connect_backend_servers(
         SESSION*           session,
         ROUTER_INSTANCE*   router);
 
+static void rwsplit_server_status_cb(
+        SERVER*      server,
+        unsigned int old_status,
+        unsigned int new_status,
+        void*        userdata);
+
+static void refresh_candidate_servers(ROUTER_INSTANCE* router);
+
+static bool backend_is_slave_candidate(
+	ROUTER_INSTANCE* router,
+	BACKEND*         b);
+
 static bool get_dcb(
         DCB**              dcb,
         ROUTER_CLIENT_SES* rses,
@@ -209,6 +304,12 @@ static void rses_end_locked_router_action(
 static void mysql_sescmd_done(
 	mysql_sescmd_t* sescmd);
 
+static char* sescmd_get_compaction_key(GWBUF* buf, unsigned char packet_type);
+
+static void compact_sescmd_history(
+        ROUTER_CLIENT_SES* rses,
+        rses_property_t*   newprop);
+
 static mysql_sescmd_t* mysql_sescmd_init (
 	rses_property_t*   rses_prop,
 	GWBUF*             sescmd_buf,
@@ -247,9 +348,6 @@ static void sescmd_cursor_set_active(
 static bool sescmd_cursor_is_active(
 	sescmd_cursor_t* sescmd_cursor);
 
-static GWBUF* sescmd_cursor_clone_querybuf(
-	sescmd_cursor_t* scur);
-
 static mysql_sescmd_t* sescmd_cursor_get_command(
 	sescmd_cursor_t* scur);
 
@@ -275,10 +373,16 @@ static void refreshInstance(
         ROUTER_INSTANCE*  router,
         CONFIG_PARAMETER* param);
 
+static void rt_table_build(ROUTER_INSTANCE* router);
+
 static void bref_clear_state(backend_ref_t* bref, bref_state_t state);
 static void bref_set_state(backend_ref_t*   bref, bref_state_t state);
 static sescmd_cursor_t* backend_ref_get_sescmd_cursor (backend_ref_t* bref);
 
+static void rses_stmt_register(ROUTER_CLIENT_SES* rses, uint32_t stmt_id, bool read_only);
+static bool rses_stmt_is_read_only(ROUTER_CLIENT_SES* rses, uint32_t stmt_id);
+static void rses_stmt_remove(ROUTER_CLIENT_SES* rses, uint32_t stmt_id);
+
 static int  router_handle_state_switch(DCB* dcb, DCB_REASON reason, void* data);
 static bool handle_error_new_connection(
         ROUTER_INSTANCE*   inst,
@@ -310,6 +414,29 @@ static int hashkeyfun(void* key);
 static int hashcmpfun (void *, void *);
 static void check_for_multi_stmt(ROUTER_CLIENT_SES* rses, GWBUF *buf,
                                  mysql_server_cmd_t packet_type);
+static bool check_for_read_only_trx(ROUTER_CLIENT_SES* rses, GWBUF *buf,
+                                    qc_query_type_t qtype,
+                                    mysql_server_cmd_t packet_type);
+static void hedge_arm(ROUTER_CLIENT_SES* rses, backend_ref_t* bref,
+                      GWBUF *querybuf);
+static void hedge_timer_cb(void *data);
+static bool retry_read_on_backend(ROUTER_CLIENT_SES* rses,
+                                  backend_ref_t* failed);
+static qc_query_type_t rwsplit_get_prepare_type(ROUTER_INSTANCE *inst,
+                                                GWBUF *querybuf);
+
+/** Maximum number of statements kept in the prepared statement cache */
+#define RWSPLIT_STMT_CACHE_MAX 1024
+
+/**
+ * A read is hedged once it has waited this multiple of the moving average
+ * response time of the backend it was routed to, but never before
+ * HEDGE_MIN_TICKS timer wheel ticks (one tick is 100 milliseconds) have
+ * passed, so that ordinarily fast backends are given a reasonable grace
+ * period before a speculative copy of the read is sent elsewhere.
+ */
+#define HEDGE_DELAY_MULTIPLIER	4
+#define HEDGE_MIN_TICKS		2
 
 static int hashkeyfun(
 		void* key)
@@ -348,6 +475,48 @@ static void* hfree(void* fval)
   return NULL;
 }
 
+/**
+ * Resolve the query type of a COM_STMT_PREPARE packet.
+ *
+ * The query types of prepared statements are cached in the router
+ * instance, keyed by the statement text, so that repeated prepares of
+ * the same statement across sessions avoid the query classifier. The
+ * QUERY_TYPE_PREPARE_STMT bit is always set in the cached value, which
+ * conveniently also keeps it distinct from the NULL returned by
+ * hashtable_fetch on a miss.
+ *
+ * @param inst		The router instance
+ * @param querybuf	GWBUF including the prepare packet
+ * @return The query type of the statement being prepared
+ */
+static qc_query_type_t rwsplit_get_prepare_type(
+	ROUTER_INSTANCE* inst,
+	GWBUF*           querybuf)
+{
+	qc_query_type_t qtype;
+	char*           sql = modutil_get_SQL(querybuf);
+	void*           cached;
+
+	if (sql != NULL && inst->stmt_cache != NULL &&
+		(cached = hashtable_fetch(inst->stmt_cache, sql)) != NULL)
+	{
+		qtype = (qc_query_type_t)(intptr_t)cached;
+	}
+	else
+	{
+		qtype = qc_get_type(querybuf);
+		qtype |= QUERY_TYPE_PREPARE_STMT;
+
+		if (sql != NULL && inst->stmt_cache != NULL &&
+			hashtable_size(inst->stmt_cache) < RWSPLIT_STMT_CACHE_MAX)
+		{
+			hashtable_add(inst->stmt_cache, sql, (void *)(intptr_t)qtype);
+		}
+	}
+	free(sql);
+	return qtype;
+}
+
 
 /**
  * Implementation of the mandatory version entry point
@@ -533,6 +702,8 @@ static void refreshInstance(
         }
 #endif /*< NOT_USED */
 
+	/** The routing decision tables depend on the configuration */
+	rt_table_build(router);
 }
 
 /**
@@ -601,6 +772,9 @@ createInstance(SERVICE *service, char **options)
                 router->servers[nservers]->backend_conn_count = 0;
                 router->servers[nservers]->be_valid = false;
                 router->servers[nservers]->weight = 1000;
+                router->servers[nservers]->response_time = 0.0;
+                memset(&router->servers[nservers]->stats, 0,
+                       sizeof(BACKEND_STATS));
 #if defined(SS_DEBUG)
                 router->servers[nservers]->be_chk_top = CHK_NUM_BACKEND;
                 router->servers[nservers]->be_chk_tail = CHK_NUM_BACKEND;
@@ -615,6 +789,34 @@ createInstance(SERVICE *service, char **options)
 	 */
 	router->available_slaves = true;
 
+	/*
+	 * The prepared statement cache is shared by all sessions of the
+	 * service; repeated prepares of the same statement text skip the
+	 * query classifier. Failure to allocate the cache is not fatal,
+	 * every prepare is then classified as before.
+	 */
+	if ((router->stmt_cache = hashtable_alloc(101, hashkeyfun, hashcmpfun)) != NULL)
+	{
+		hashtable_memory_fns(router->stmt_cache, hstrdup, NULL, hfree, NULL);
+	}
+
+	/*
+	 * The candidate server sets are kept current by server status
+	 * events so that backend selection doesn't need to re-filter the
+	 * whole server list on every call. If the allocation or the
+	 * subscription fails, selection falls back to testing the status
+	 * bits directly.
+	 */
+	spinlock_init(&router->cand_lock);
+
+	if ((router->cand_slaves =
+		(BACKEND **)calloc(nservers + 1, sizeof(BACKEND *))) != NULL &&
+		server_status_subscribe(rwsplit_server_status_cb, router) != 0)
+	{
+		free(router->cand_slaves);
+		router->cand_slaves = NULL;
+	}
+
     /*
      * If server weighting has been defined calculate the percentage
      * of load that will be sent to each server. This is only used for
@@ -755,6 +957,9 @@ createInstance(SERVICE *service, char **options)
 	{
 		refreshInstance(router, param);
 	}
+	/** Precompute the routing decision tables from the configuration */
+	rt_table_build(router);
+
         /**
          * We have completed the creation of the router data, so now
          * insert this router into the linked list of routers
@@ -793,13 +998,16 @@ static void* newSession(
         int                 i;
         const int           min_nservers = 1; /*< hard-coded for now */
 
-        client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+        /** Drawn from the arena of the session, freed with the session */
+        client_rses = (ROUTER_CLIENT_SES *)session_arena_alloc(
+                session, sizeof(ROUTER_CLIENT_SES));
 
         if (client_rses == NULL)
         {
                 ss_dassert(false);
                 goto return_rses;
         }
+        memset(client_rses, 0, sizeof(ROUTER_CLIENT_SES));
 #if defined(SS_DEBUG)
         client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
         client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
@@ -831,8 +1039,17 @@ static void* newSession(
          */
         client_rses->rses_autocommit_enabled = true;
         client_rses->rses_transaction_active = false;
+        client_rses->rses_ro_trx_active = false;
+        client_rses->rses_ro_trx_next = false;
+        client_rses->rses_ro_trx_session = false;
+        client_rses->rses_ro_trx_bref = NULL;
         client_rses->have_tmp_tables = false;
+        client_rses->rses_n_tmp_tables = 0;
         client_rses->forced_node = NULL;
+        client_rses->rses_hedge_timer = NULL;
+        client_rses->rses_hedge_bref = NULL;
+        client_rses->rses_hedge_second = NULL;
+        client_rses->rses_hedge_stmt = NULL;
         
         router_nservers = router_get_servercount(router);
 
@@ -846,16 +1063,16 @@ static void* newSession(
         /**
          * Create backend reference objects for this session.
          */
-        backend_ref = (backend_ref_t *)calloc(1, router_nservers*sizeof(backend_ref_t));
+        backend_ref = (backend_ref_t *)session_arena_alloc(
+                session, router_nservers*sizeof(backend_ref_t));
 
         if (backend_ref == NULL)
         {
                 /** log this */
-                free(client_rses);
-                free(backend_ref);
                 client_rses = NULL;
                 goto return_rses;
         }
+        memset(backend_ref, 0, router_nservers*sizeof(backend_ref_t));
         /**
          * Initialize backend references with BACKEND ptr.
          * Initialize session command cursors for each backend reference.
@@ -876,6 +1093,7 @@ static void* newSession(
                 backend_ref[i].bref_sescmd_cur.scmd_cur_ptr_property =
                         &client_rses->rses_properties[RSES_PROP_TYPE_SESCMD];
                 backend_ref[i].bref_sescmd_cur.scmd_cur_cmd = NULL;
+                backend_ref[i].bref_sescmd_cur.scmd_sent_pos = 0;
         }
         max_nslaves    = rses_get_max_slavecount(client_rses, router_nservers);
         max_slave_rlag = rses_get_max_replication_lag(client_rses);
@@ -892,8 +1110,6 @@ static void* newSession(
 
         if(!succp)
 	{
-                free(client_rses->rses_backend_ref);
-                free(client_rses);
 		client_rses = NULL;
                 goto return_rses;
 	}
@@ -912,8 +1128,6 @@ static void* newSession(
 	 * Master and at least <min_nslaves> slaves must be found
 	 */
         if (!succp) {
-                free(client_rses->rses_backend_ref);
-                free(client_rses);
                 client_rses = NULL;
                 goto return_rses;
         }
@@ -1000,10 +1214,21 @@ static void closeSession(
                  */
                 router_cli_ses->rses_closed = true;
 
+                if (router_cli_ses->rses_hedge_stmt != NULL)
+                {
+                        gwbuf_free(router_cli_ses->rses_hedge_stmt);
+                        router_cli_ses->rses_hedge_stmt = NULL;
+                }
+
                 for (i=0; i<router_cli_ses->rses_nbackends; i++)
                 {
                         backend_ref_t* bref = &backend_ref[i];
                         DCB* dcb = bref->bref_dcb;
+                        if (bref->bref_retry_stmt != NULL)
+                        {
+                                gwbuf_free(bref->bref_retry_stmt);
+                                bref->bref_retry_stmt = NULL;
+                        }
                         /** Close those which had been connected */
                         if (BREF_IS_IN_USE(bref))
                         {
@@ -1026,9 +1251,12 @@ static void closeSession(
                                 bref_clear_state(bref, BREF_IN_USE);
                                 bref_set_state(bref, BREF_CLOSED);
                                 /**
-                                 * closes protocol and dcb
+                                 * Returns the connection to the service pool,
+                                 * or closes protocol and dcb
                                  */
-                                dcb_close(dcb);
+                                service_pool_release_dcb(
+                                        ((ROUTER_INSTANCE *)instance)->service,
+                                        dcb);
                                 /** decrease server current connection counters */
                                 atomic_add(&bref->bref_backend->backend_conn_count, -1);
                         }
@@ -1036,6 +1264,17 @@ static void closeSession(
                 /** Unlock */
                 rses_end_locked_router_action(router_cli_ses);
         }
+        /**
+         * Release the hedging timer outside of the session lock; tw_remove()
+         * waits for a concurrently executing callback, which takes the lock
+         * itself, so holding it here would deadlock. The callback finds the
+         * session closed and returns without touching it.
+         */
+        if (router_cli_ses->rses_hedge_timer != NULL)
+        {
+                tw_remove(router_cli_ses->rses_hedge_timer);
+                router_cli_ses->rses_hedge_timer = NULL;
+        }
 }
 
 /**
@@ -1095,8 +1334,17 @@ static void freeSession(
          * all the memory and other resources associated
          * to the client session.
          */
-        free(router_cli_ses->rses_backend_ref);
-	free(router_cli_ses);
+        gwbuf_free(router_cli_ses->rses_pipeline_queue);
+        while (router_cli_ses->rses_stmts != NULL)
+        {
+                rses_stmt_t* stmt = router_cli_ses->rses_stmts;
+                router_cli_ses->rses_stmts = stmt->next;
+                free(stmt);
+        }
+        /**
+         * The router session and the backend reference array are in the
+         * arena of the session and are freed with it.
+         */
         return;
 }
 
@@ -1162,7 +1410,8 @@ static bool get_dcb(
 		{
 			BACKEND* b = backend_ref[i].bref_backend;
 			SERVER server;
-			server.status = backend_ref[i].bref_backend->backend_server->status;
+			server.status = server_status_snapshot(
+				backend_ref[i].bref_backend->backend_server, NULL);
 			/**
 			 * To become chosen:
 			 * backend must be in use, name must match,
@@ -1199,13 +1448,24 @@ static bool get_dcb(
         if (btype == BE_SLAVE)
         {
 		backend_ref_t* candidate_bref = NULL;
+		backend_ref_t* overflow_bref = NULL;
 
 		for (i=0; i<rses->rses_nbackends; i++)
 		{
 			BACKEND* b = (&backend_ref[i])->bref_backend;
 			SERVER server;
 			SERVER candidate;
-			server.status = backend_ref[i].bref_backend->backend_server->status;
+			/**
+			 * Take one snapshot of the status word for the whole
+			 * decision; the monitor may change it at any time.
+			 */
+			server.status = server_status_snapshot(
+				backend_ref[i].bref_backend->backend_server, NULL);
+			/**
+			 * Use the replication lag interpolated from the
+			 * last monitor sample rather than the raw reading.
+			 */
+			int b_rlag = server_interpolated_rlag(b->backend_server);
 			/**
 			 * Unused backend or backend which is not master nor
 			 * slave can't be used
@@ -1216,6 +1476,25 @@ static bool get_dcb(
 			{
 				continue;
 			}
+			/**
+			 * A slave that has reached its configured limit of
+			 * in-flight operations is skipped so that the excess
+			 * reads flow to the remaining slaves. The least
+			 * loaded of the saturated slaves is remembered so
+			 * that routing still succeeds when every eligible
+			 * slave is at its limit.
+			 */
+			else if (SERVER_IS_SLAVE(&server) &&
+				SERVER_AT_INFLIGHT_LIMIT(b->backend_server))
+			{
+				if (overflow_bref == NULL ||
+					b->backend_server->stats.n_current_ops <
+					overflow_bref->bref_backend->backend_server->stats.n_current_ops)
+				{
+					overflow_bref = &backend_ref[i];
+				}
+				continue;
+			}
 			/**
 			 * If there are no candidates yet accept both master or
 			 * slave.
@@ -1231,7 +1510,7 @@ static bool get_dcb(
 				{
 					/** found master */
 					candidate_bref = &backend_ref[i];
-					candidate.status = candidate_bref->bref_backend->backend_server->status;
+					candidate.status = server.status;
 					succp = true;
 				}
 				/**
@@ -1240,12 +1519,12 @@ static bool get_dcb(
 				 * maximum allowed replication lag.
 				 */
 				else if (max_rlag == MAX_RLAG_UNDEFINED ||
-					(b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-					b->backend_server->rlag <= max_rlag))
+					(b_rlag != MAX_RLAG_NOT_AVAILABLE &&
+					b_rlag <= max_rlag))
 				{
 					/** found slave */
 					candidate_bref = &backend_ref[i];
-					candidate.status = candidate_bref->bref_backend->backend_server->status;
+					candidate.status = server.status;
 					succp = true;
 				}
 			}
@@ -1256,13 +1535,13 @@ static bool get_dcb(
 			else if (SERVER_IS_MASTER(&candidate) &&
 				SERVER_IS_SLAVE(&server) &&
 				(max_rlag == MAX_RLAG_UNDEFINED ||
-				(b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-				b->backend_server->rlag <= max_rlag)) &&
+				(b_rlag != MAX_RLAG_NOT_AVAILABLE &&
+				b_rlag <= max_rlag)) &&
 				 !rses->rses_config.rw_master_reads)
 			{
 				/** found slave */
 				candidate_bref = &backend_ref[i];
-				candidate.status = candidate_bref->bref_backend->backend_server->status;
+				candidate.status = server.status;
 				succp = true;
 			}
 			/**
@@ -1273,14 +1552,15 @@ static bool get_dcb(
 			else if (SERVER_IS_SLAVE(&server))
 			{
 				if (max_rlag == MAX_RLAG_UNDEFINED ||
-				(b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-				b->backend_server->rlag <= max_rlag))
+				(b_rlag != MAX_RLAG_NOT_AVAILABLE &&
+				b_rlag <= max_rlag))
 				{
 					candidate_bref = check_candidate_bref(
 								candidate_bref,
 								&backend_ref[i],
 								rses->rses_config.rw_slave_select_criteria);
-					candidate.status = candidate_bref->bref_backend->backend_server->status;
+					candidate.status = server_status_snapshot(
+						candidate_bref->bref_backend->backend_server, NULL);
 				}
 				else
 				{
@@ -1288,10 +1568,24 @@ static bool get_dcb(
                                              "master, %d s. and can't be chosen.",
                                              b->backend_server->name,
                                              b->backend_server->port,
-                                             b->backend_server->rlag);
+                                             b_rlag);
 				}
 			}
 		} /*<  for */
+		/**
+		 * Every eligible slave was at its in-flight limit; route
+		 * the overflow to the least loaded of them rather than
+		 * failing the query.
+		 */
+		if (candidate_bref == NULL && overflow_bref != NULL)
+		{
+			MXS_INFO("All eligible slaves have reached their "
+				"max_inflight limit, overflow routed to %s:%d.",
+				overflow_bref->bref_backend->backend_server->name,
+				overflow_bref->bref_backend->backend_server->port);
+			candidate_bref = overflow_bref;
+			succp = true;
+		}
 		/** Assign selected DCB's pointer value */
 		if (candidate_bref != NULL)
 		{
@@ -1310,7 +1604,8 @@ static bool get_dcb(
          * so copying it locally will make possible error messages
          * easier to understand */
         SERVER server;
-        server.status = master_bref->bref_backend->backend_server->status;
+        server.status = server_status_snapshot(
+            master_bref->bref_backend->backend_server, NULL);
         if (BREF_IS_IN_USE(master_bref) && SERVER_IS_MASTER(&server))
         {
             *p_dcb = master_bref->bref_dcb;
@@ -1370,10 +1665,162 @@ static backend_ref_t* check_candidate_bref(
 }
 
 
+/**
+ * Compress the query type bits that influence routing into an index for
+ * the routing decision table.
+ *
+ * @param qtype The query type bitmask
+ * @return Index into the decision table
+ */
+static inline unsigned int rt_table_class(qc_query_type_t qtype)
+{
+    unsigned int q = (unsigned int)qtype;
+
+    return ((q >> 1) & 0x000F) |    /*< READ, WRITE, MASTER_READ, SESSION_WRITE */
+           ((q >> 2) & 0x0030) |    /*< USERVAR_READ, SYSVAR_READ */
+           ((q >> 3) & 0x00C0) |    /*< GSYSVAR_READ, GSYSVAR_WRITE */
+           ((q >> 4) & 0x0300) |    /*< ENABLE_, DISABLE_AUTOCOMMIT */
+           ((q >> 6) & 0x1C00) |    /*< PREPARE_NAMED_, PREPARE_, EXEC_STMT */
+           ((q >> 9) & 0x2000);     /*< SHOW_TABLES */
+}
+
+/**
+ * Reconstruct a query type bitmask from a decision table index, the
+ * inverse of rt_table_class, used when the table is built.
+ *
+ * @param class Index into the decision table
+ * @return The query type bitmask the index stands for
+ */
+static qc_query_type_t rt_table_qtype(unsigned int class)
+{
+    return (qc_query_type_t)(((class & 0x000F) << 1) |
+                             ((class & 0x0030) << 2) |
+                             ((class & 0x00C0) << 3) |
+                             ((class & 0x0300) << 4) |
+                             ((class & 0x1C00) << 6) |
+                             ((class & 0x2000) << 9));
+}
+
+/**
+ * Compute one entry of the routing decision table. This is the if/else
+ * cascade that was previously run for every query, evaluated once per
+ * query type combination when the configuration is read.
+ *
+ * @param qtype                 The query type bitmask of the entry
+ * @param trx_active            Entry is for an open transaction
+ * @param use_sql_variables_in  The configured target for SQL variables
+ * @return The table entry; the route target plus the RT_ENTRY flags
+ */
+static uint8_t rt_table_entry(qc_query_type_t qtype, bool trx_active,
+                              target_t use_sql_variables_in)
+{
+    route_target_t target = TARGET_UNDEFINED;
+    uint8_t entry = 0;
+
+    if (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
+        /** Configured to allow writing variables to all nodes */
+        (use_sql_variables_in == TYPE_ALL &&
+         QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE)) ||
+        /** enable or disable autocommit are always routed to all */
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+    {
+        /**
+         * A SELECT that also modifies session variables cannot be routed
+         * to all backends; it is sent to the master and the session is
+         * warned when the entry is used.
+         */
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+            !(QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT)))
+        {
+            entry |= RT_ENTRY_WARN;
+            target = TARGET_MASTER;
+        }
+        target |= TARGET_ALL;
+    }
+    else if (!trx_active && !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
+             (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||          /*< any SELECT */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) ||   /*< 'SHOW TABLES' */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||  /*< read user var */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||   /*< read sys var */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||     /*< prepared stmt exec */
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ)))   /*< read global sys var */
+    {
+        /** Routing hints may alter the decision of these entries */
+        entry |= RT_ENTRY_HINTABLE;
+
+        if (!QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) ||
+             /** Configured to allow reading variables from slaves */
+             (use_sql_variables_in == TYPE_ALL &&
+              (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
+               QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
+               QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ)))))
+        {
+            target = TARGET_SLAVE;
+        }
+
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+            /** Configured not to allow reading variables from slaves */
+            (use_sql_variables_in == TYPE_MASTER &&
+             (QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
+              QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ))))
+        {
+            target = TARGET_MASTER;
+        }
+
+        /** If nothing matches then choose the master */
+        if ((target & (TARGET_ALL | TARGET_SLAVE | TARGET_MASTER)) == 0)
+        {
+            entry |= RT_ENTRY_DEFAULTED;
+            target = TARGET_MASTER;
+        }
+    }
+    else
+    {
+        /** Writes, open transactions and the rest go to the master */
+        target = TARGET_MASTER;
+    }
+    return entry | (uint8_t)target;
+}
+
+/**
+ * Build the routing decision tables of the instance from its current
+ * configuration. Called when the configuration is read or refreshed.
+ *
+ * @param router The router instance
+ */
+static void rt_table_build(ROUTER_INSTANCE *router)
+{
+    target_t use_sql_variables_in = router->rwsplit_config.rw_use_sql_variables_in;
+    unsigned int class;
+
+    for (class = 0; class < RT_TABLE_SIZE; class++)
+    {
+        qc_query_type_t qtype = rt_table_qtype(class);
+
+        router->rt_table[0][class] = rt_table_entry(qtype, false,
+                                                    use_sql_variables_in);
+        router->rt_table[1][class] = rt_table_entry(qtype, true,
+                                                    use_sql_variables_in);
+    }
+}
+
 /**
  * Examine the query type, transaction state and routing hints. Find out the
  * target for query routing.
  *
+ * For the common case the decision is a single load from the decision
+ * table of the instance, precomputed by rt_table_build; only queries
+ * that carry routing hints walk the hint list.
+ *
  *  @param qtype      Type of query
  *  @param trx_active Is transacation active or not
  *  @param hint       Pointer to list of hints attached to the query buffer
@@ -1384,185 +1831,105 @@ static backend_ref_t* check_candidate_bref(
 static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
                                        qc_query_type_t qtype, HINT *hint)
 {
-    bool trx_active = rses->rses_transaction_active;
-    bool load_active = rses->rses_load_active;
-    target_t use_sql_variables_in = rses->rses_config.rw_use_sql_variables_in;
-    route_target_t target = TARGET_UNDEFINED;
+    route_target_t target;
+    uint8_t entry;
 
     if (rses->rses_config.rw_strict_multi_stmt && rses->forced_node == rses->rses_master_ref)
     {
-        target = TARGET_MASTER;
+        return TARGET_MASTER;
+    }
+    if (rses->rses_load_active)
+    {
+        /** Hints and the query type play no part during load of data */
+        return TARGET_MASTER;
     }
-	/**
-	 * These queries are not affected by hints
-	 */
-	else if (!load_active && (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
-		/** Configured to allow writing variables to all nodes */
-		(use_sql_variables_in == TYPE_ALL &&
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE)) ||
-		/** enable or disable autocommit are always routed to all */
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT)))
-	{
-		/**
-		 * This is problematic query because it would be routed to all
-		 * backends but since this is SELECT that is not possible:
-		 * 1. response set is not handled correctly in clientReply and
-		 * 2. multiple results can degrade performance.
-		 *
-		 * Prepared statements are an exception to this since they do not
-		 * actually do anything but only prepare the statement to be used.
-		 * They can be safely routed to all backends since the execution
-		 * is done later.
-		 *
-		 * With prepared statement caching the task of routing
-		 * the execution of the prepared statements to the right server would be
-		 * an easy one. Currently this is not supported.
-		 */
-		if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
-		 !( QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
-		    QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT)))
-		{
-                    MXS_WARNING("The query can't be routed to all "
-				"backend servers because it includes SELECT and "
-				"SQL variable modifications which is not supported. "
-				"Set use_sql_variables_in=master or split the "
-				"query to two, where SQL variable modifications "
-				"are done in the first and the SELECT in the "
-				"second one.");
-
-			target = TARGET_MASTER;
-		}
-		target |= TARGET_ALL;
-	}
-	/**
-	 * Hints may affect on routing of the following queries
-	 */
-	else if (!trx_active && !load_active && !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
-		(QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||	/*< any SELECT */
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) || /*< 'SHOW TABLES' */
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ)||	/*< read user var */
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||	/*< read sys var */
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||   /*< prepared stmt exec */
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
-		QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ))) /*< read global sys var */
-	{
-		/** First set expected targets before evaluating hints */
-		if (!QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) &&
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_SHOW_TABLES) || /*< 'SHOW TABLES' */
-			/** Configured to allow reading variables from slaves */
-			(use_sql_variables_in == TYPE_ALL &&
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ)))))
-		{
-			target = TARGET_SLAVE;
-		}
 
-                if (QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT)	||
-		    QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
-		    QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
-			/** Configured not to allow reading variables from slaves */
-			(use_sql_variables_in == TYPE_MASTER &&
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ)	||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ))))
-		{
-			target = TARGET_MASTER;
-		}
-		/** process routing hints */
-		while (hint != NULL)
-		{
-			if (hint->type == HINT_ROUTE_TO_MASTER)
-			{
-				target = TARGET_MASTER; /*< override */
-				MXS_DEBUG("%lu [get_route_target] Hint: route to master.",
-                                          pthread_self());
-				break;
-			}
-			else if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
-			{
-				/**
-				 * Searching for a named server. If it can't be
-				 * found, the oroginal target is chosen.
-				 */
-				target |= TARGET_NAMED_SERVER;
-				MXS_DEBUG("%lu [get_route_target] Hint: route to "
-                                          "named server : ",
-                                          pthread_self());
-			}
-			else if (hint->type == HINT_ROUTE_TO_UPTODATE_SERVER)
-			{
-				/** not implemented */
-			}
-			else if (hint->type == HINT_ROUTE_TO_ALL)
-			{
-				/** not implemented */
-			}
-			else if (hint->type == HINT_PARAMETER)
-			{
-				if (strncasecmp(
-					(char *)hint->data,
-						"max_slave_replication_lag",
-						strlen("max_slave_replication_lag")) == 0)
-				{
-					target |= TARGET_RLAG_MAX;
-				}
-				else
-				{
-                                    MXS_ERROR("Unknown hint parameter "
-                                              "'%s' when 'max_slave_replication_lag' "
-                                              "was expected.",
-                                              (char *)hint->data);
-				}
-			}
-			else if (hint->type == HINT_ROUTE_TO_SLAVE)
-			{
-				target = TARGET_SLAVE;
-				MXS_DEBUG("%lu [get_route_target] Hint: route to "
-                                          "slave.",
-                                          pthread_self());
-			}
-			hint = hint->next;
-		} /*< while (hint != NULL) */
-		/** If nothing matches then choose the master */
-		if ((target & (TARGET_ALL|TARGET_SLAVE|TARGET_MASTER)) == 0)
-		{
-			target = TARGET_MASTER;
-		}
-	}
-	else
-	{
-		/** hints don't affect on routing */
-		ss_dassert(trx_active ||
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_USERVAR_READ) &&
-				use_sql_variables_in == TYPE_MASTER) ||
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) &&
-				use_sql_variables_in == TYPE_MASTER) ||
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ) &&
-				use_sql_variables_in == TYPE_MASTER) ||
-			(QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_WRITE) &&
-				use_sql_variables_in == TYPE_MASTER) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_CREATE_TMP_TABLE) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_TMP_TABLE) ||
-			QUERY_IS_TYPE(qtype, QUERY_TYPE_UNKNOWN)));
-		target = TARGET_MASTER;
-	}
+    entry = rses->router->rt_table[rses->rses_transaction_active ? 1 : 0]
+                                  [rt_table_class(qtype)];
+
+    if (entry & RT_ENTRY_WARN)
+    {
+        MXS_WARNING("The query can't be routed to all "
+                    "backend servers because it includes SELECT and "
+                    "SQL variable modifications which is not supported. "
+                    "Set use_sql_variables_in=master or split the "
+                    "query to two, where SQL variable modifications "
+                    "are done in the first and the SELECT in the "
+                    "second one.");
+    }
+    target = (route_target_t)(entry & RT_ENTRY_TARGET);
+
+    if (hint != NULL && (entry & RT_ENTRY_HINTABLE))
+    {
+        /** The hints are applied to the target before the master default */
+        if (entry & RT_ENTRY_DEFAULTED)
+        {
+            target = TARGET_UNDEFINED;
+        }
+        /** process routing hints */
+        while (hint != NULL)
+        {
+            if (hint->type == HINT_ROUTE_TO_MASTER)
+            {
+                target = TARGET_MASTER; /*< override */
+                MXS_DEBUG("%lu [get_route_target] Hint: route to master.",
+                          pthread_self());
+                break;
+            }
+            else if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
+            {
+                /**
+                 * Searching for a named server. If it can't be
+                 * found, the oroginal target is chosen.
+                 */
+                target |= TARGET_NAMED_SERVER;
+                MXS_DEBUG("%lu [get_route_target] Hint: route to "
+                          "named server : ",
+                          pthread_self());
+            }
+            else if (hint->type == HINT_ROUTE_TO_UPTODATE_SERVER)
+            {
+                /** not implemented */
+            }
+            else if (hint->type == HINT_ROUTE_TO_ALL)
+            {
+                /** not implemented */
+            }
+            else if (hint->type == HINT_PARAMETER)
+            {
+                if (strncasecmp((char *)hint->data,
+                                "max_slave_replication_lag",
+                                strlen("max_slave_replication_lag")) == 0)
+                {
+                    target |= TARGET_RLAG_MAX;
+                }
+                else
+                {
+                    MXS_ERROR("Unknown hint parameter "
+                              "'%s' when 'max_slave_replication_lag' "
+                              "was expected.",
+                              (char *)hint->data);
+                }
+            }
+            else if (hint->type == HINT_ROUTE_TO_SLAVE)
+            {
+                target = TARGET_SLAVE;
+                MXS_DEBUG("%lu [get_route_target] Hint: route to "
+                          "slave.",
+                          pthread_self());
+            }
+            hint = hint->next;
+        } /*< while (hint != NULL) */
+        /** If nothing matches then choose the master */
+        if ((target & (TARGET_ALL | TARGET_SLAVE | TARGET_MASTER)) == 0)
+        {
+            target = TARGET_MASTER;
+        }
+    }
 #if defined(SS_EXTRA_DEBUG)
-        MXS_INFO("Selected target \"%s\"", STRTARGET(target));
+    MXS_INFO("Selected target \"%s\"", STRTARGET(target));
 #endif
-	return target;
+    return target;
 }
 
 /**
@@ -1627,6 +1994,12 @@ void check_drop_tmp_table(
 											   (void *)hkey))
 							  {
                                                               MXS_INFO("Temporary table dropped: %s",hkey);
+							      if (--router_cli_ses->rses_n_tmp_tables == 0)
+								      {
+									      /** The checks are skipped again
+									       * until the next CREATE TEMPORARY */
+									      router_cli_ses->have_tmp_tables = false;
+								      }
 							  }
 					  }
 				  free(tbl[i]);
@@ -1770,7 +2143,6 @@ static void check_create_tmp_table(
       return;
   }
 
-  router_cli_ses->have_tmp_tables = true;
   rses_prop_tmp = router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES];
   data = (MYSQL_session*)router_cli_ses->client_dcb->data;
 
@@ -1835,12 +2207,21 @@ static void check_create_tmp_table(
 
 	}
 
-     if (hkey && rses_prop_tmp->rses_prop_data.temp_tables &&
-	  hashtable_add(rses_prop_tmp->rses_prop_data.temp_tables,
+     if (hkey && rses_prop_tmp->rses_prop_data.temp_tables)
+	{
+	  if (hashtable_add(rses_prop_tmp->rses_prop_data.temp_tables,
 			(void *)hkey,
 			(void *)is_temp) == 0) /*< Conflict in hash table */
-	{
+	    {
             MXS_INFO("Temporary table conflict in hashtable: %s", hkey);
+	    }
+	  else
+	    {
+	      /** The flag arms the per query checks; it is cleared again
+	       * when the count returns to zero in check_drop_tmp_table */
+	      router_cli_ses->rses_n_tmp_tables++;
+	      router_cli_ses->have_tmp_tables = true;
+	    }
 	}
 #if defined(SS_DEBUG)
       {
@@ -1861,37 +2242,144 @@ static void check_create_tmp_table(
 }
 
 /**
- * Get client DCB pointer of the router client session.
- * This routine must be protected by Router client session lock.
+ * Select a synced Galera node for a certification safe write.
  *
- * @param rses	Router client session pointer
+ * With the galera_write_split router option enabled, autocommit writes
+ * that touch a single table are spread across the synced nodes of the
+ * cluster instead of all landing on the designated master. The node is
+ * chosen by hashing the table name, so the writes of one table always
+ * certify on the same node and conflict with each other locally rather
+ * than through cluster certification. The monitor marks the synced
+ * nodes with SERVER_JOINED, any one of them is a valid write target.
  *
- * @return Pointer to client DCB
+ * Statements that are prone to certification conflicts stay on the
+ * master: anything inside a transaction or with autocommit disabled,
+ * multi-table statements, statements with no resolvable table and
+ * sessions that use temporary tables or a forced node.
+ *
+ * @param rses		Router client session
+ * @param querybuf	GWBUF containing the query
+ * @param packet_type	The MySQL packet type of the query
+ * @param p_dcb		The DCB of the chosen node is returned here
+ * @return true if a node was chosen, false to route to the master
  */
-static DCB* rses_get_client_dcb(
-	ROUTER_CLIENT_SES* rses)
+static bool get_galera_write_target(
+	ROUTER_CLIENT_SES* rses,
+	GWBUF*  querybuf,
+	int     packet_type,
+	DCB**   p_dcb)
 {
-	DCB*	dcb = NULL;
-	int	i;
+	backend_ref_t*	bref;
+	qc_query_op_t	op;
+	unsigned int	hash = 0;
+	char**		tbl;
+	char*		ptr;
+	int		tsize = 0, ncandidates = 0, idx, i;
+
+	if (packet_type != MYSQL_COM_QUERY ||
+		rses->rses_transaction_active ||
+		!rses->rses_autocommit_enabled ||
+		rses->rses_load_active ||
+		rses->have_tmp_tables ||
+		rses->forced_node != NULL)
+	{
+		return false;
+	}
 
-	for (i=0; i<rses->rses_nbackends; i++)
+	op = qc_get_operation(querybuf);
+
+	if (op != QUERY_OP_INSERT && op != QUERY_OP_UPDATE &&
+		op != QUERY_OP_DELETE)
 	{
-		if ((dcb = rses->rses_backend_ref[i].bref_dcb) != NULL &&
-			BREF_IS_IN_USE(&rses->rses_backend_ref[i]) &&
-			dcb->session != NULL &&
-			dcb->session->client_dcb != NULL)
+		return false;
+	}
+
+	tbl = qc_get_table_names(querybuf, &tsize, true);
+
+	if (tbl == NULL || tsize != 1 || tbl[0] == NULL)
+	{
+		/** Multi-table statements and statements whose table cannot
+		 * be resolved keep the conflict free master routing */
+		for (i = 0; i < tsize; i++)
 		{
-			return dcb->session->client_dcb;
+			free(tbl[i]);
 		}
+		free(tbl);
+		return false;
 	}
-	return NULL;
-}
 
-/**
- * The main routing entry, this is called with every packet that is
- * received and has to be forwarded to the backend database.
- *
- * The routeQuery will make the routing decision based on the contents
+	for (ptr = tbl[0]; *ptr; ptr++)
+	{
+		hash = *ptr + (hash << 6) + (hash << 16) - hash;
+	}
+	free(tbl[0]);
+	free(tbl);
+
+	for (i = 0; i < rses->rses_nbackends; i++)
+	{
+		bref = &rses->rses_backend_ref[i];
+
+		if (BREF_IS_IN_USE(bref) && !BREF_IS_CLOSED(bref) &&
+			SERVER_IS_JOINED(bref->bref_backend->backend_server))
+		{
+			ncandidates++;
+		}
+	}
+
+	if (ncandidates < 2)
+	{
+		/** Not a Galera cluster, or nothing to spread over */
+		return false;
+	}
+	idx = hash % ncandidates;
+
+	for (i = 0; i < rses->rses_nbackends; i++)
+	{
+		bref = &rses->rses_backend_ref[i];
+
+		if (BREF_IS_IN_USE(bref) && !BREF_IS_CLOSED(bref) &&
+			SERVER_IS_JOINED(bref->bref_backend->backend_server) &&
+			idx-- == 0)
+		{
+			*p_dcb = bref->bref_dcb;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Get client DCB pointer of the router client session.
+ * This routine must be protected by Router client session lock.
+ *
+ * @param rses	Router client session pointer
+ *
+ * @return Pointer to client DCB
+ */
+static DCB* rses_get_client_dcb(
+	ROUTER_CLIENT_SES* rses)
+{
+	DCB*	dcb = NULL;
+	int	i;
+
+	for (i=0; i<rses->rses_nbackends; i++)
+	{
+		if ((dcb = rses->rses_backend_ref[i].bref_dcb) != NULL &&
+			BREF_IS_IN_USE(&rses->rses_backend_ref[i]) &&
+			dcb->session != NULL &&
+			dcb->session->client_dcb != NULL)
+		{
+			return dcb->session->client_dcb;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * The main routing entry, this is called with every packet that is
+ * received and has to be forwarded to the backend database.
+ *
+ * The routeQuery will make the routing decision based on the contents
  * of the instance, session and the query itself in the queue. The
  * data in the queue may not represent a complete query, it represents
  * the data that has been received. The query router itself is responsible
@@ -1910,6 +2398,150 @@ static DCB* rses_get_client_dcb(
  * For now, routeQuery don't tolerate errors, so any error will close
  * the session. vraa 14.6.14
  */
+/**
+ * Stream the data phase of a LOAD DATA LOCAL INFILE to the master.
+ *
+ * While the load is active the client sends raw file data, so there is
+ * nothing to classify or to route: every packet until the terminating
+ * empty packet belongs to the master. Instead of splitting the stream
+ * to packets and copying each of them contiguous, the chunks read from
+ * the client are forwarded to the master DCB as zero copy views and the
+ * byte stream is merely scanned for the packet boundaries to find the
+ * empty packet that ends the load. The scanner state is kept in the
+ * router session so a header split between two reads is handled.
+ *
+ * Memory use of the session stays bounded by the write queue water
+ * marks; when the master cannot keep up, the core suspends the reads
+ * of the client DCB until the master write queue has drained.
+ *
+ * The terminating empty packet is not consumed here but left in the
+ * read buffer for the packet loop of routeQuery, which closes the load
+ * through route_single_stmt and so retains the response bookkeeping.
+ * A trailing partial header is also left in the buffer; the caller
+ * stores it to the read queue of the DCB to wait for more data.
+ *
+ * @param inst		router instance
+ * @param rses		router client session
+ * @param p_readbuf	pointer to the data read from the client; on
+ *			return points to the unconsumed tail or to NULL
+ *
+ * @return true if streaming succeeded, false on routing failure
+ */
+static bool stream_load_data(
+	ROUTER_INSTANCE*   inst,
+	ROUTER_CLIENT_SES* rses,
+	GWBUF**            p_readbuf)
+{
+	GWBUF*       buf = *p_readbuf;
+	DCB*         master_dcb;
+	unsigned int scanned = 0;
+	unsigned int forward;
+	bool         terminator = false;
+
+	while (buf != NULL && !terminator)
+	{
+		uint8_t* ptr = (uint8_t *)GWBUF_DATA(buf);
+		uint8_t* end = (uint8_t *)buf->end;
+
+		while (ptr < end)
+		{
+			if (rses->rses_load_left > 0)
+			{
+				unsigned int n = MIN(rses->rses_load_left,
+						(unsigned int)(end - ptr));
+
+				rses->rses_load_left -= n;
+				ptr += n;
+				scanned += n;
+				continue;
+			}
+			rses->rses_load_header[rses->rses_load_nheader] = *ptr;
+			rses->rses_load_nheader += 1;
+			ptr += 1;
+			scanned += 1;
+
+			if (rses->rses_load_nheader == 4)
+			{
+				uint32_t pktlen =
+					gw_mysql_get_byte3(rses->rses_load_header);
+
+				rses->rses_load_nheader = 0;
+
+				if (pktlen == 0)
+				{
+					/** The empty packet ends the load */
+					terminator = true;
+					forward = scanned - 4;
+					break;
+				}
+				rses->rses_load_left = pktlen;
+			}
+		}
+		buf = buf->next;
+	}
+
+	if (!terminator)
+	{
+		/**
+		 * Hold back a trailing partial header; it is rescanned
+		 * when the rest of it arrives.
+		 */
+		forward = scanned - rses->rses_load_nheader;
+		rses->rses_load_nheader = 0;
+	}
+
+	if (forward > 0)
+	{
+		GWBUF*       out = NULL;
+		unsigned int nsent = forward;
+		int          rc;
+
+		while (forward > 0)
+		{
+			unsigned int n = MIN(GWBUF_LENGTH(*p_readbuf), forward);
+			GWBUF*       part;
+
+			if ((part = gwbuf_clone_portion(*p_readbuf, 0, n)) == NULL)
+			{
+				gwbuf_free(out);
+				return false;
+			}
+			out = gwbuf_append(out, part);
+			*p_readbuf = gwbuf_consume(*p_readbuf, n);
+			forward -= n;
+		}
+		gwbuf_set_type(out, GWBUF_TYPE_MYSQL);
+
+		if (!rses_begin_locked_router_action(rses))
+		{
+			gwbuf_free(out);
+			return false;
+		}
+
+		if ((master_dcb = rses->rses_master_ref->bref_dcb) == NULL ||
+			BREF_IS_CLOSED(rses->rses_master_ref))
+		{
+			rses_end_locked_router_action(rses);
+			MXS_ERROR("Can't route LOAD DATA LOCAL INFILE data to "
+				"backend server. Session doesn't have a Master "
+				"node");
+			gwbuf_free(out);
+			return false;
+		}
+		rses->rses_load_data_sent += nsent;
+		rc = master_dcb->func.write(master_dcb, out);
+		rses_end_locked_router_action(rses);
+
+		if (rc != 1)
+		{
+			MXS_ERROR("Routing the LOAD DATA LOCAL INFILE stream "
+				"to the master failed.");
+			return false;
+		}
+	}
+	return true;
+}
+
 static int routeQuery(
         ROUTER* instance,
         void*   router_session,
@@ -1933,6 +2565,24 @@ static int routeQuery(
         if (GWBUF_IS_TYPE_UNDEFINED(querybuf))
 	{
 		GWBUF* tmpbuf = querybuf;
+
+		/**
+		 * The data phase of LOAD DATA LOCAL INFILE is streamed to
+		 * the master without splitting it to packets; only the
+		 * terminating empty packet drops through to the packet
+		 * loop below.
+		 */
+		if (router_cli_ses->rses_load_active &&
+			!router_cli_ses->rses_closed)
+		{
+			succp = stream_load_data(inst, router_cli_ses, &tmpbuf);
+
+			if (!succp || tmpbuf == NULL)
+			{
+				querybuf = tmpbuf;
+				goto retblock;
+			}
+		}
 		do
 		{
 			/**
@@ -1953,6 +2603,10 @@ static int routeQuery(
 			/** Mark buffer to as MySQL type */
 			gwbuf_set_type(querybuf, GWBUF_TYPE_MYSQL);
 			gwbuf_set_type(querybuf, GWBUF_TYPE_SINGLE_STMT);
+			if (querybuf->next == NULL)
+			{
+				gwbuf_set_type(querybuf, GWBUF_TYPE_CONTIGUOUS);
+			}
 
 			/**
 			 * If router is closed, discard the packet
@@ -1979,7 +2633,10 @@ static int routeQuery(
 			else
 			{
 				/** route_single_stmt expects the buffer to be contiguous. */
-				querybuf = gwbuf_make_contiguous(querybuf);
+				if (!GWBUF_IS_TYPE_CONTIGUOUS(querybuf))
+				{
+					querybuf = gwbuf_make_contiguous(querybuf);
+				}
 
 				succp = route_single_stmt(inst, router_cli_ses, querybuf);
 			}
@@ -2011,7 +2668,10 @@ static int routeQuery(
 	else
 	{
 		/** route_single_stmt expects the buffer to be contiguous. */
-		querybuf = gwbuf_make_contiguous(querybuf);
+		if (!GWBUF_IS_TYPE_CONTIGUOUS(querybuf))
+		{
+			querybuf = gwbuf_make_contiguous(querybuf);
+		}
 
 		succp = route_single_stmt(inst, router_cli_ses, querybuf);
 	}
@@ -2038,6 +2698,211 @@ retblock:
 }
 
 
+/**
+ * Reset the response boundary parser of a backend reference. Called when
+ * a pipelining window is opened on the backend, before any response bytes
+ * for the pipelined reads have arrived.
+ *
+ * @param bref	backend reference serving the window
+ */
+static void pipeline_parser_reset(
+	backend_ref_t* bref)
+{
+	memset(&bref->bref_reply_parser, 0, sizeof(bref->bref_reply_parser));
+	bref->bref_reply_parser.response_first = true;
+}
+
+/**
+ * Count the complete MySQL responses included in a chunk of the response
+ * stream read from a backend. The chunk may begin and end in the middle of
+ * a packet; the parser state is kept in the backend reference between
+ * calls. A response is complete when it is a single OK or ERR packet, or
+ * when the second EOF packet - or an ERR packet - of a result set has been
+ * seen. Packets of 16MB or more are not handled; statements producing them
+ * are not expected within a pipelining window.
+ *
+ * @param bref		backend reference serving the window
+ * @param writebuf	the latest chunk of the response stream
+ *
+ * @return the number of responses completed by this chunk
+ */
+static int pipeline_count_responses(
+	backend_ref_t* bref,
+	GWBUF*         writebuf)
+{
+	bref_reply_parser_t* p = &bref->bref_reply_parser;
+	GWBUF* buf = writebuf;
+	int    ncomplete = 0;
+
+	while (buf != NULL)
+	{
+		uint8_t* ptr = (uint8_t *)GWBUF_DATA(buf);
+		uint8_t* end = (uint8_t *)buf->end;
+
+		while (ptr < end)
+		{
+			if (p->nheader < 4)
+			{
+				p->header[p->nheader] = *ptr;
+				p->nheader += 1;
+				ptr += 1;
+
+				if (p->nheader < 4)
+				{
+					continue;
+				}
+				p->pktlen = gw_mysql_get_byte3(p->header);
+				p->payload_left = p->pktlen;
+				p->examined = false;
+				p->firstbyte = 0;
+			}
+
+			if (p->payload_left > 0 && ptr < end)
+			{
+				size_t n;
+
+				if (!p->examined)
+				{
+					p->firstbyte = *ptr;
+					p->examined = true;
+				}
+				n = MIN((size_t)(end - ptr), (size_t)p->payload_left);
+				ptr += n;
+				p->payload_left -= n;
+			}
+
+			if (p->payload_left == 0)
+			{
+				/** A whole packet has been consumed */
+				if (p->response_first)
+				{
+					if (p->examined &&
+						(p->firstbyte == 0x00 || p->firstbyte == 0xff))
+					{
+						/** OK or ERR is a complete response */
+						ncomplete += 1;
+					}
+					else
+					{
+						/** Result set header packet */
+						p->response_first = false;
+						p->nsignals = 0;
+					}
+				}
+				else if (p->firstbyte == 0xff ||
+					(p->firstbyte == 0xfe && p->pktlen < 9))
+				{
+					p->nsignals += 1;
+
+					if (p->firstbyte == 0xff || p->nsignals == 2)
+					{
+						/** Result set complete, or aborted
+						 * with an error packet */
+						ncomplete += 1;
+						p->response_first = true;
+					}
+				}
+				p->nheader = 0;
+			}
+		}
+		buf = buf->next;
+	}
+	return ncomplete;
+}
+
+/**
+ * Handle a statement which arrives while a pipelining window is open.
+ * A plain read - a slave target without hints, while the window is not
+ * full and no statements are already serialized - is routed to the slave
+ * serving the window without waiting for the previous replies. Any other
+ * statement, such as a write, a session command or a hinted read, is
+ * serialized behind the window; clientReply routes the serialized
+ * statements once all the pipelined replies have arrived.
+ *
+ * @param inst		router instance
+ * @param rses		router session
+ * @param querybuf	GWBUF including the query
+ * @param route_target	the routing target resolved for the statement
+ * @param succp		to be set to the routing result if handled
+ *
+ * @return true if the statement was handled here, false if the caller
+ * must route it normally.
+ */
+static bool pipeline_handle_stmt(
+	ROUTER_INSTANCE*   inst,
+	ROUTER_CLIENT_SES* rses,
+	GWBUF*             querybuf,
+	route_target_t     route_target,
+	bool*              succp)
+{
+	bool handled = false;
+
+	if (rses->rses_pipeline_active == 0)
+	{
+		return false;
+	}
+	if (!rses_begin_locked_router_action(rses))
+	{
+		*succp = false;
+		return true;
+	}
+	/** Re-check after acquiring the lock; the window may have drained */
+	if (rses->rses_pipeline_active > 0)
+	{
+		backend_ref_t* pbref = rses->rses_pipeline_bref;
+
+		handled = true;
+
+		if (route_target == TARGET_SLAVE &&
+			rses->rses_pipeline_queue == NULL &&
+			rses->rses_pipeline_active <
+				rses->rses_config.rw_max_pipeline_reads &&
+			(!rses->rses_ro_trx_active ||
+				rses->rses_ro_trx_bref == pbref) &&
+			pbref != NULL &&
+			BREF_IS_IN_USE(pbref) &&
+			!BREF_IS_CLOSED(pbref) &&
+			!sescmd_cursor_is_active(&pbref->bref_sescmd_cur))
+		{
+			if (pbref->bref_dcb->func.write(pbref->bref_dcb,
+					gwbuf_clone(querybuf)) == 1)
+			{
+				atomic_add(&inst->stats.n_queries, 1);
+				atomic_add(&inst->stats.n_slave, 1);
+				backend_stats_add(pbref->bref_backend,
+					querybuf, BSTAT_READ);
+				clock_gettime(CLOCK_MONOTONIC, &pbref->bref_query_start);
+				bref_set_state(pbref, BREF_QUERY_ACTIVE);
+				bref_set_state(pbref, BREF_WAITING_RESULT);
+				rses->rses_pipeline_active += 1;
+
+				MXS_INFO("Pipelined read %d/%d to %s:%d",
+					rses->rses_pipeline_active,
+					rses->rses_config.rw_max_pipeline_reads,
+					pbref->bref_backend->backend_server->name,
+					pbref->bref_backend->backend_server->port);
+				*succp = true;
+			}
+			else
+			{
+				MXS_ERROR("Routing pipelined query failed.");
+				*succp = false;
+			}
+		}
+		else
+		{
+			/** Serialize the statement behind the window */
+			rses->rses_pipeline_queue = gwbuf_append(
+				rses->rses_pipeline_queue,
+				gwbuf_clone(querybuf));
+			*succp = true;
+		}
+	}
+	rses_end_locked_router_action(rses);
+
+	return handled;
+}
+
 /**
  * Routing function. Find out query type, backend type, and target DCB(s).
  * Then route query to found target(s).
@@ -2062,6 +2927,7 @@ static bool route_single_stmt(
 	DCB*               target_dcb     = NULL;
 	route_target_t     route_target;
 	bool           	   succp          = false;
+	bool               ro_trx_stmt    = false;
 	int                rlag_max       = MAX_RLAG_UNDEFINED;
 	backend_type_t     btype; /*< target backend type */
 
@@ -2100,6 +2966,11 @@ static bool route_single_stmt(
         route_target = TARGET_MASTER;
         MXS_INFO("> LOAD DATA LOCAL INFILE finished: "
                  "%lu bytes sent.", rses->rses_load_data_sent + gwbuf_length(querybuf));
+
+        if (pipeline_handle_stmt(inst, rses, querybuf, route_target, &succp))
+        {
+            goto retblock;
+        }
 	}
 	else
 	{
@@ -2128,8 +2999,7 @@ static bool route_single_stmt(
 			break;
 
 		case MYSQL_COM_STMT_PREPARE:
-			qtype = qc_get_type(querybuf);
-			qtype |= QUERY_TYPE_PREPARE_STMT;
+			qtype = rwsplit_get_prepare_type(inst, querybuf);
 			break;
 
 		case MYSQL_COM_STMT_EXECUTE:
@@ -2160,6 +3030,21 @@ static bool route_single_stmt(
      * TODO: add warnings when incompatible protocols are used */
     check_for_multi_stmt(rses, querybuf, packet_type);
 
+    /**
+     * Binary protocol packets carry the statement id at a fixed offset.
+     * The routing class recorded at prepare time decides where an execution
+     * goes without parsing the packet; unknown ids stay on the master.
+     */
+    if (packet_type == MYSQL_COM_STMT_EXECUTE && packet_len >= 5 &&
+        rses_stmt_is_read_only(rses, gw_mysql_get_byte4(&packet[5])))
+    {
+        qtype = QUERY_TYPE_READ;
+    }
+    else if (packet_type == MYSQL_COM_STMT_CLOSE && packet_len >= 5)
+    {
+        rses_stmt_remove(rses, gw_mysql_get_byte4(&packet[5]));
+    }
+
     /**
      * Check if the query has anything to do with temporary tables.
      */
@@ -2185,6 +3070,8 @@ static bool route_single_stmt(
         {
             rses->rses_load_active = true;
             rses->rses_load_data_sent = 0;
+            rses->rses_load_nheader = 0;
+            rses->rses_load_left = 0;
         }
     }
     else
@@ -2193,6 +3080,16 @@ static bool route_single_stmt(
     }
 
 	rses_end_locked_router_action(rses);
+	/**
+	 * Track the transaction access mode. A read only transaction does
+	 * not need the master and is routed in its entirety to one slave.
+	 */
+	if (!rses->rses_transaction_active &&
+		check_for_read_only_trx(rses, querybuf, qtype, packet_type))
+	{
+		rses->rses_ro_trx_active = true;
+	}
+	ro_trx_stmt = rses->rses_ro_trx_active;
 	/**
 	 * If autocommit is disabled or transaction is explicitly started
 	 * transaction becomes active and master gets all statements until
@@ -2222,12 +3119,16 @@ static bool route_single_stmt(
 		QUERY_IS_TYPE(qtype,QUERY_TYPE_ROLLBACK)))
 	{
 		rses->rses_transaction_active = false;
+		rses->rses_ro_trx_active = false;
+		rses->rses_ro_trx_bref = NULL;
 	}
 	else if (!rses->rses_autocommit_enabled &&
 		QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
 	{
 		rses->rses_autocommit_enabled = true;
 		rses->rses_transaction_active = false;
+		rses->rses_ro_trx_active = false;
+		rses->rses_ro_trx_bref = NULL;
 	}
 
 	if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
@@ -2280,6 +3181,46 @@ static bool route_single_stmt(
 	 */
 	route_target = get_route_target(rses, qtype, querybuf->hint);
 
+	/**
+	 * Statements belonging to a read only transaction, the terminating
+	 * COMMIT or ROLLBACK included, are routed to the slave which was
+	 * chosen when the transaction was started. The open transaction
+	 * would otherwise force them to the master.
+	 */
+	if (ro_trx_stmt && TARGET_IS_MASTER(route_target) &&
+		!rses->rses_load_active &&
+		rses->forced_node != rses->rses_master_ref)
+	{
+		route_target = TARGET_SLAVE;
+	}
+
+	/**
+	 * Binary protocol prepares are routed to all backends so that read
+	 * only statements can later be executed on a slave. The statement
+	 * ids the backends assign stay in sync because every prepare is
+	 * executed on every connection in the same order. Close, reset and
+	 * long data packets follow the prepare to all backends; the first
+	 * two travel through the one-way branch of route_session_write.
+	 */
+	if (packet_type == MYSQL_COM_STMT_PREPARE ||
+		packet_type == MYSQL_COM_STMT_CLOSE ||
+		packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
+		packet_type == MYSQL_COM_STMT_RESET)
+	{
+		route_target = TARGET_ALL;
+	}
+
+	/**
+	 * If a pipelining window is open, the statement either joins it -
+	 * a plain read routed to the same slave without waiting for the
+	 * previous replies - or is serialized behind it until all the
+	 * pipelined replies have arrived.
+	 */
+	if (pipeline_handle_stmt(inst, rses, querybuf, route_target, &succp))
+	{
+		goto retblock;
+	}
+
 	if (TARGET_IS_ALL(route_target))
 	{
 		/** Multiple, conflicting routing target. Return error */
@@ -2455,33 +3396,83 @@ static bool route_single_stmt(
 	{
 		btype = BE_SLAVE;
 
-		if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+		if (ro_trx_stmt && rses->rses_ro_trx_bref != NULL)
 		{
-			rlag_max = rses_get_max_replication_lag(rses);
+			/**
+			 * A read only transaction is open. The consistent
+			 * snapshot exists only on the slave which executed
+			 * the START TRANSACTION so the statement must be
+			 * routed there; the transaction cannot be resumed
+			 * on another server.
+			 */
+			if (BREF_IS_IN_USE(rses->rses_ro_trx_bref) &&
+				!BREF_IS_CLOSED(rses->rses_ro_trx_bref))
+			{
+				target_dcb = rses->rses_ro_trx_bref->bref_dcb;
+				succp = true;
+				atomic_add(&inst->stats.n_slave, 1);
+			}
+			else
+			{
+				MXS_ERROR("Server %s:%d serving an open read "
+                                          "only transaction failed. The "
+                                          "transaction cannot be resumed on "
+                                          "another server.",
+                                          BREFSRV(rses->rses_ro_trx_bref)->name,
+                                          BREFSRV(rses->rses_ro_trx_bref)->port);
+				succp = false;
+			}
 		}
-		/**
-		 * Search suitable backend server, get DCB in target_dcb
-		 */
-		succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL,rlag_max);
-
-		if (succp)
+		else
 		{
+			if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+			{
+				rlag_max = rses_get_max_replication_lag(rses);
+			}
+			/**
+			 * Search suitable backend server, get DCB in target_dcb
+			 */
+			succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL,rlag_max);
+
+			if (succp && ro_trx_stmt)
+			{
+				/** Pin the read only transaction to the chosen slave */
+				rses->rses_ro_trx_bref = get_bref_from_dcb(rses, target_dcb);
+			}
+
+			if (succp)
+			{
 #if defined(SS_EXTRA_DEBUG)
-                        MXS_INFO("Found DCB for slave.");
+				MXS_INFO("Found DCB for slave.");
 #endif
-			atomic_add(&inst->stats.n_slave, 1);
-		}
-		else
-		{
-                    MXS_INFO("Was supposed to route to slave"
-                             "but finding suitable one "
-                             "failed.");
+				atomic_add(&inst->stats.n_slave, 1);
+			}
+			else
+			{
+				MXS_INFO("Was supposed to route to slave"
+					 "but finding suitable one "
+					 "failed.");
+			}
 		}
 	}
 	else if (TARGET_IS_MASTER(route_target))
 	{
 		DCB* curr_master_dcb = NULL;
 
+		/**
+		 * A certification safe write may be routed to any synced
+		 * node of a Galera cluster when the galera_write_split
+		 * router option is enabled.
+		 */
+		if (inst->rwsplit_config.rw_galera_split &&
+			get_galera_write_target(rses, querybuf,
+						packet_type, &target_dcb))
+		{
+			atomic_add(&inst->stats.n_galera_split, 1);
+			succp = true;
+		}
+		else
+		{
 		succp = get_dcb(&curr_master_dcb,
 				rses,
 				BE_MASTER,
@@ -2513,6 +3504,7 @@ static bool route_single_stmt(
 			succp = false;
 			goto retblock;
 		}
+		}
 	}
 
 	if (succp) /*< Have DCB of the target backend */
@@ -2562,8 +3554,73 @@ static bool route_single_stmt(
 			 * Add one query response waiter to backend reference
 			 */
 			bref = get_bref_from_dcb(rses, target_dcb);
+			backend_stats_add(bref->bref_backend, querybuf,
+				TARGET_IS_MASTER(route_target) ?
+				BSTAT_WRITE : BSTAT_READ);
+			clock_gettime(CLOCK_MONOTONIC, &bref->bref_query_start);
 			bref_set_state(bref, BREF_QUERY_ACTIVE);
 			bref_set_state(bref, BREF_WAITING_RESULT);
+			/**
+			 * A plain read routed to a slave opens a pipelining
+			 * window: until the reply has arrived, consecutive
+			 * reads may be routed to the same backend without
+			 * waiting for it.
+			 */
+			if (rses->rses_config.rw_max_pipeline_reads > 1 &&
+				route_target == TARGET_SLAVE &&
+				rses->rses_pipeline_active == 0 &&
+				!rses->rses_transaction_active &&
+				!rses->rses_load_active &&
+				bref->bref_num_result_wait == 1)
+			{
+				pipeline_parser_reset(bref);
+				rses->rses_pipeline_bref = bref;
+				rses->rses_pipeline_active = 1;
+			}
+			/**
+			 * Hedged reads: start a timer which, if the reply has
+			 * not arrived by the time it fires, sends a copy of
+			 * the read to a second slave. Only a plain read
+			 * outside of any transaction can be hedged; reads
+			 * captured by the pipelining window above are never
+			 * hedged because their responses are interleaved in
+			 * a single stream.
+			 */
+			if (rses->rses_config.rw_hedged_reads &&
+				route_target == TARGET_SLAVE &&
+				packet_type == MYSQL_COM_QUERY &&
+				rses->rses_pipeline_active == 0 &&
+				!rses->rses_transaction_active &&
+				!rses->rses_ro_trx_active &&
+				!rses->rses_load_active &&
+				rses->forced_node == NULL &&
+				rses->rses_hedge_stmt == NULL &&
+				bref != rses->rses_master_ref &&
+				bref->bref_num_result_wait == 1)
+			{
+				hedge_arm(rses, bref, querybuf);
+			}
+			/**
+			 * Retain a copy of a plain read sent to a slave so
+			 * that, should the slave fail before replying, the
+			 * read can be replayed on another backend rather
+			 * than surfacing an error to the client.
+			 */
+			if (route_target == TARGET_SLAVE &&
+				packet_type == MYSQL_COM_QUERY &&
+				rses->rses_pipeline_active == 0 &&
+				!rses->rses_transaction_active &&
+				!rses->rses_ro_trx_active &&
+				!rses->rses_load_active &&
+				bref != rses->rses_master_ref &&
+				bref->bref_num_result_wait == 1)
+			{
+				if (bref->bref_retry_stmt != NULL)
+				{
+					gwbuf_free(bref->bref_retry_stmt);
+				}
+				bref->bref_retry_stmt = gwbuf_clone(querybuf);
+			}
 		}
 		else
 		{
@@ -2653,6 +3710,42 @@ static void rses_end_locked_router_action(
 }
 
 
+/**
+ * Account a statement routed to a backend in the per-backend statistics.
+ *
+ * The counters are owned by the router instance and shared by all of its
+ * sessions. They are updated with atomic adds rather than under a lock,
+ * so each counter is consistent on its own but the set of counters is
+ * only an approximation of any single point in time.
+ *
+ * @param	backend	The backend the statement was written to
+ * @param	buf	The statement buffer, used only for its length
+ * @param	kind	How the statement was classified when it was routed
+ */
+static void backend_stats_add(
+	BACKEND*            backend,
+	GWBUF*              buf,
+	backend_stat_kind_t kind)
+{
+	atomic_add(&backend->stats.n_queries, 1);
+
+	switch (kind)
+	{
+	case BSTAT_READ:
+		atomic_add(&backend->stats.n_reads, 1);
+		break;
+	case BSTAT_WRITE:
+		atomic_add(&backend->stats.n_writes, 1);
+		break;
+	case BSTAT_SESCMD:
+		atomic_add(&backend->stats.n_sescmd, 1);
+		break;
+	}
+	/** atomic_add is int only, so the byte count uses the builtin */
+	__sync_fetch_and_add(&backend->stats.n_bytes,
+			     (uint64_t)gwbuf_length(buf));
+}
+
 /**
  * Diagnostics routine
  *
@@ -2703,6 +3796,15 @@ double master_pct = 0.0;
 	dcb_printf(dcb,
                    "\tNumber of queries forwarded to all:   	%d\n",
                    router->stats.n_all);
+	dcb_printf(dcb,
+                   "\tNumber of hedged reads:               	%d\n",
+                   router->stats.n_hedged);
+	dcb_printf(dcb,
+                   "\tNumber of retried reads:              	%d\n",
+                   router->stats.n_retried_reads);
+	dcb_printf(dcb,
+                   "\tNumber of Galera split writes:        	%d\n",
+                   router->stats.n_galera_split);
 	dcb_printf(dcb,
                    "\tMaster/Slave percentage:		%.2f%%\n",
                    master_pct * 100.0);
@@ -2730,6 +3832,24 @@ double master_pct = 0.0;
                 }
 
         }
+
+	dcb_printf(dcb,
+		   "\tRouted queries per backend:\n");
+	dcb_printf(dcb,
+		   "\t\tServer               Queries  Reads    Writes   "
+		   "Sess cmds  Bytes\n");
+	for (i = 0; router->servers[i]; i++)
+	{
+		backend = router->servers[i];
+		dcb_printf(dcb,
+			   "\t\t%-20s %-8d %-8d %-8d %-9d %lu\n",
+			   backend->backend_server->unique_name,
+			   backend->stats.n_queries,
+			   backend->stats.n_reads,
+			   backend->stats.n_writes,
+			   backend->stats.n_sescmd,
+			   backend->stats.n_bytes);
+	}
 }
 
 /**
@@ -2753,6 +3873,7 @@ static void clientReply (
         ROUTER_CLIENT_SES* router_cli_ses;
 	sescmd_cursor_t*   scur = NULL;
         backend_ref_t*     bref;
+	GWBUF*             stalled = NULL;
 
 	router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
         router_inst = (ROUTER_INSTANCE*)instance;
@@ -2809,6 +3930,20 @@ static void clientReply (
 #endif
 
         CHK_BACKEND_REF(bref);
+
+	if (BREF_IS_CLOSED(bref) && !BREF_IS_IN_USE(bref))
+	{
+		/**
+		 * The backend has been closed, which happens when its reply
+		 * lost the race of a hedged read. Discard the response.
+		 */
+		while ((writebuf = gwbuf_consume(
+			writebuf,
+			GWBUF_LENGTH(writebuf))) != NULL);
+		rses_end_locked_router_action(router_cli_ses);
+		goto lock_failed;
+	}
+
         scur = &bref->bref_sescmd_cur;
         /**
          * Active cursor means that reply is from session command
@@ -2876,11 +4011,96 @@ static void clientReply (
          */
 	else if (BREF_IS_QUERY_ACTIVE(bref))
 	{
-                bref_clear_state(bref, BREF_QUERY_ACTIVE);
-                /** Set response status as replied */
-                bref_clear_state(bref, BREF_WAITING_RESULT);
+		if (bref == router_cli_ses->rses_pipeline_bref &&
+			router_cli_ses->rses_pipeline_active > 0)
+		{
+			/**
+			 * Pipelined reads: count the responses completed by
+			 * this chunk of the response stream and decrease the
+			 * waiter count once for each of them.
+			 */
+			int ncomplete = pipeline_count_responses(bref, writebuf);
+
+			while (ncomplete > 0 &&
+				router_cli_ses->rses_pipeline_active > 0)
+			{
+				router_cli_ses->rses_pipeline_active -= 1;
+				bref_clear_state(bref, BREF_WAITING_RESULT);
+				ncomplete -= 1;
+			}
+
+			if (router_cli_ses->rses_pipeline_active == 0)
+			{
+				/** The pipelining window has drained */
+				bref_sample_response_time(bref);
+				bref_clear_state(bref, BREF_QUERY_ACTIVE);
+				router_cli_ses->rses_pipeline_bref = NULL;
+			}
+		}
+		else
+		{
+			bref_sample_response_time(bref);
+			bref_clear_state(bref, BREF_QUERY_ACTIVE);
+			/** Set response status as replied */
+			bref_clear_state(bref, BREF_WAITING_RESULT);
+			/** The read completed, the retry copy is no longer needed */
+			if (bref->bref_retry_stmt != NULL)
+			{
+				gwbuf_free(bref->bref_retry_stmt);
+				bref->bref_retry_stmt = NULL;
+			}
+		}
         }
 
+	/**
+	 * A hedged read resolves on the first response: whichever of the two
+	 * backends replies first wins, and the connection to the other is
+	 * closed, discarding the duplicate response along with it.
+	 */
+	if (router_cli_ses->rses_hedge_stmt != NULL &&
+		(bref == router_cli_ses->rses_hedge_bref ||
+		 bref == router_cli_ses->rses_hedge_second))
+	{
+		backend_ref_t* loser = NULL;
+
+		if (router_cli_ses->rses_hedge_second != NULL)
+		{
+			loser = (bref == router_cli_ses->rses_hedge_bref) ?
+				router_cli_ses->rses_hedge_second :
+				router_cli_ses->rses_hedge_bref;
+		}
+		gwbuf_free(router_cli_ses->rses_hedge_stmt);
+		router_cli_ses->rses_hedge_stmt = NULL;
+		router_cli_ses->rses_hedge_bref = NULL;
+		router_cli_ses->rses_hedge_second = NULL;
+
+		if (loser != NULL && BREF_IS_IN_USE(loser))
+		{
+			MXS_INFO("Closing connection to %s:%d, its hedged "
+				 "read was answered faster by %s:%d.",
+				 BREFSRV(loser)->name,
+				 BREFSRV(loser)->port,
+				 BREFSRV(bref)->name,
+				 BREFSRV(bref)->port);
+
+			while (BREF_IS_WAITING_RESULT(loser))
+			{
+				bref_clear_state(loser, BREF_WAITING_RESULT);
+			}
+			bref_clear_state(loser, BREF_QUERY_ACTIVE);
+			bref_clear_state(loser, BREF_IN_USE);
+			bref_set_state(loser, BREF_CLOSED);
+			/**
+			 * The connection carries an unread result and thus
+			 * must not re-enter the connection pool.
+			 */
+			loser->bref_dcb->dcb_errhandle_called = true;
+			service_pool_release_dcb(router_inst->service,
+						 loser->bref_dcb);
+			atomic_add(&loser->bref_backend->backend_conn_count, -1);
+		}
+	}
+
         if (writebuf != NULL && client_dcb != NULL)
         {
                 /** Write reply to client DCB */
@@ -2926,9 +4146,14 @@ static void clientReply (
 		{
 			ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
 			atomic_add(&inst->stats.n_queries, 1);
+			backend_stats_add(bref->bref_backend,
+				bref->bref_pending_cmd,
+				bref == router_cli_ses->rses_master_ref ?
+				BSTAT_WRITE : BSTAT_READ);
 			/**
 			 * Add one query response waiter to backend reference
 			 */
+			clock_gettime(CLOCK_MONOTONIC, &bref->bref_query_start);
 			bref_set_state(bref, BREF_QUERY_ACTIVE);
 			bref_set_state(bref, BREF_WAITING_RESULT);
 		}
@@ -2949,9 +4174,35 @@ static void clientReply (
 		gwbuf_free(bref->bref_pending_cmd);
 		bref->bref_pending_cmd = NULL;
 	}
+	/**
+	 * If the pipelining window has drained, detach the statements that
+	 * were serialized behind it. They are routed below, after the
+	 * router session has been unlocked.
+	 */
+	if (router_cli_ses->rses_pipeline_active == 0 &&
+		router_cli_ses->rses_pipeline_queue != NULL)
+	{
+		stalled = router_cli_ses->rses_pipeline_queue;
+		router_cli_ses->rses_pipeline_queue = NULL;
+	}
 	/** Unlock router session */
         rses_end_locked_router_action(router_cli_ses);
 
+	while (stalled != NULL)
+	{
+		GWBUF* stmt = stalled;
+
+		stalled = stalled->next;
+		stmt->next = NULL;
+
+		if (!route_single_stmt(router_inst, router_cli_ses, stmt))
+		{
+			MXS_ERROR("Routing of a statement serialized behind "
+				"pipelined reads failed.");
+		}
+		gwbuf_free(stmt);
+	}
+
 lock_failed:
         return;
 }
@@ -3014,8 +4265,285 @@ int bref_cmp_behind_master(
         BACKEND* b1 = ((backend_ref_t *)bref1)->bref_backend;
         BACKEND* b2 = ((backend_ref_t *)bref2)->bref_backend;
 
-        return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1 :
-        ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+        return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1 :
+        ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+}
+
+/** Compare the average response time of the backend servers. Backends
+ * without any samples yet sort first so that they get traffic and thereby
+ * a measurement. */
+int bref_cmp_response_time(
+        const void* bref1,
+        const void* bref2)
+{
+        double t1 = ((backend_ref_t *)bref1)->bref_backend->response_time;
+        double t2 = ((backend_ref_t *)bref2)->bref_backend->response_time;
+
+        return ((t1 < t2) ? -1 : ((t1 > t2) ? 1 : 0));
+}
+
+/** Weight of the newest sample in the response time moving average */
+#define RESPONSE_TIME_ALPHA 0.2
+
+/**
+ * Fold the response time of the query that has just completed into the
+ * moving average of the backend. The average is updated without locking;
+ * a lost update merely drops a sample, which is acceptable for a load
+ * balancing heuristic.
+ *
+ * @param bref  Backend reference whose active query completed
+ */
+static void bref_sample_response_time(
+        backend_ref_t* bref)
+{
+        struct timespec now;
+        double sample;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sample = (now.tv_sec - bref->bref_query_start.tv_sec) +
+                (now.tv_nsec - bref->bref_query_start.tv_nsec) * 1e-9;
+
+        if (bref->bref_backend->response_time == 0.0)
+        {
+                bref->bref_backend->response_time = sample;
+        }
+        else
+        {
+                bref->bref_backend->response_time =
+                        (1.0 - RESPONSE_TIME_ALPHA) * bref->bref_backend->response_time +
+                        RESPONSE_TIME_ALPHA * sample;
+        }
+}
+
+/**
+ * Arm the hedging timer for a read which has just been routed to a slave.
+ *
+ * The delay before the timer fires is derived from the moving average
+ * response time of the chosen backend, so a backend which is usually fast
+ * triggers hedging sooner than one that is always slow. The timer is
+ * created once per session and rescheduled for each hedgeable read; a
+ * stale expiry for an earlier read is recognised in the callback by the
+ * recorded due time.
+ *
+ * Caller must hold the router client session lock.
+ *
+ * @param rses          Router client session
+ * @param bref          Backend reference the read was routed to
+ * @param querybuf      The routed statement
+ */
+static void hedge_arm(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             querybuf)
+{
+        long ticks;
+
+        ticks = (long)(bref->bref_backend->response_time * 10.0 *
+                       HEDGE_DELAY_MULTIPLIER);
+
+        if (ticks < HEDGE_MIN_TICKS)
+        {
+                ticks = HEDGE_MIN_TICKS;
+        }
+
+        if (rses->rses_hedge_timer != NULL)
+        {
+                if (!tw_reschedule(rses->rses_hedge_timer, ticks))
+                {
+                        return;
+                }
+        }
+        else if ((rses->rses_hedge_timer =
+                  tw_add(ticks, hedge_timer_cb, rses)) == NULL)
+        {
+                return;
+        }
+        rses->rses_hedge_stmt = gwbuf_clone(querybuf);
+        rses->rses_hedge_bref = bref;
+        rses->rses_hedge_second = NULL;
+        rses->rses_hedge_due = hkheartbeat + ticks;
+}
+
+/**
+ * Timer wheel callback for a hedged read.
+ *
+ * Runs on the housekeeper thread when a read routed to a slave has waited
+ * longer than the hedging threshold for its reply. If the reply is still
+ * outstanding, a copy of the read is sent to the fastest other connected
+ * slave and the first response to arrive, from either backend, is the one
+ * returned to the client. The timer is removed in closeSession();
+ * tw_remove() guarantees that the router session can not be freed under
+ * our feet while this callback executes.
+ *
+ * @param data  The router client session
+ */
+static void hedge_timer_cb(
+        void* data)
+{
+        ROUTER_CLIENT_SES* rses = (ROUTER_CLIENT_SES *)data;
+        backend_ref_t*     candidate = NULL;
+        int                i;
+
+        if (!rses_begin_locked_router_action(rses))
+        {
+                return;
+        }
+
+        if (rses->rses_hedge_stmt == NULL ||
+                rses->rses_hedge_second != NULL ||
+                hkheartbeat < rses->rses_hedge_due)
+        {
+                /** The reply arrived before the timer fired, or the timer
+                 * fired for an earlier read that has since completed. */
+                rses_end_locked_router_action(rses);
+                return;
+        }
+
+        if (BREF_IS_CLOSED(rses->rses_hedge_bref) ||
+                !BREF_IS_IN_USE(rses->rses_hedge_bref) ||
+                !BREF_IS_WAITING_RESULT(rses->rses_hedge_bref))
+        {
+                /** The backend failed before replying; the error handler
+                 * deals with the read itself, so just drop the hedging
+                 * state. */
+                gwbuf_free(rses->rses_hedge_stmt);
+                rses->rses_hedge_stmt = NULL;
+                rses->rses_hedge_bref = NULL;
+                rses_end_locked_router_action(rses);
+                return;
+        }
+
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+                if (bref == rses->rses_hedge_bref ||
+                        !BREF_IS_IN_USE(bref) ||
+                        BREF_IS_CLOSED(bref) ||
+                        BREF_IS_WAITING_RESULT(bref) ||
+                        sescmd_cursor_is_active(&bref->bref_sescmd_cur) ||
+                        !SERVER_IS_SLAVE(bref->bref_backend->backend_server))
+                {
+                        continue;
+                }
+
+                if (candidate == NULL ||
+                        bref->bref_backend->response_time <
+                        candidate->bref_backend->response_time)
+                {
+                        candidate = bref;
+                }
+        }
+
+        if (candidate != NULL &&
+                candidate->bref_dcb->func.write(
+                        candidate->bref_dcb,
+                        gwbuf_clone(rses->rses_hedge_stmt)) == 1)
+        {
+                clock_gettime(CLOCK_MONOTONIC, &candidate->bref_query_start);
+                bref_set_state(candidate, BREF_QUERY_ACTIVE);
+                bref_set_state(candidate, BREF_WAITING_RESULT);
+                rses->rses_hedge_second = candidate;
+                atomic_add(&rses->router->stats.n_hedged, 1);
+                backend_stats_add(candidate->bref_backend,
+                        rses->rses_hedge_stmt, BSTAT_READ);
+
+                MXS_INFO("Read stalled on %s:%d, hedging with a copy to "
+                         "%s:%d.",
+                         BREFSRV(rses->rses_hedge_bref)->name,
+                         BREFSRV(rses->rses_hedge_bref)->port,
+                         BREFSRV(candidate)->name,
+                         BREFSRV(candidate)->port);
+        }
+        rses_end_locked_router_action(rses);
+}
+
+/**
+ * Replay a read whose backend failed before replying on another backend.
+ *
+ * Called from the error handler, with the router client session lock held,
+ * when a slave fails while a plain read is outstanding on it. The copy of
+ * the statement retained at routing time is resent to the fastest other
+ * connected slave, or to the master if no slave is available, so that the
+ * backend failure never surfaces to the client.
+ *
+ * @param rses          Router client session
+ * @param failed        Backend reference of the failed connection
+ *
+ * @return true if the read was resent to another backend
+ */
+static bool retry_read_on_backend(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     failed)
+{
+        backend_ref_t* candidate = NULL;
+        int            i;
+
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+                if (bref == failed ||
+                        !BREF_IS_IN_USE(bref) ||
+                        BREF_IS_CLOSED(bref) ||
+                        BREF_IS_WAITING_RESULT(bref) ||
+                        sescmd_cursor_is_active(&bref->bref_sescmd_cur) ||
+                        !SERVER_IS_SLAVE(bref->bref_backend->backend_server))
+                {
+                        continue;
+                }
+
+                if (candidate == NULL ||
+                        bref->bref_backend->response_time <
+                        candidate->bref_backend->response_time)
+                {
+                        candidate = bref;
+                }
+        }
+
+        if (candidate == NULL)
+        {
+                backend_ref_t* master = rses->rses_master_ref;
+
+                if (master != NULL &&
+                        master != failed &&
+                        BREF_IS_IN_USE(master) &&
+                        !BREF_IS_CLOSED(master) &&
+                        !BREF_IS_WAITING_RESULT(master) &&
+                        !sescmd_cursor_is_active(&master->bref_sescmd_cur) &&
+                        SERVER_IS_MASTER(master->bref_backend->backend_server))
+                {
+                        candidate = master;
+                }
+        }
+
+        if (candidate != NULL &&
+                candidate->bref_dcb->func.write(
+                        candidate->bref_dcb,
+                        gwbuf_clone(failed->bref_retry_stmt)) == 1)
+        {
+                clock_gettime(CLOCK_MONOTONIC, &candidate->bref_query_start);
+                bref_set_state(candidate, BREF_QUERY_ACTIVE);
+                bref_set_state(candidate, BREF_WAITING_RESULT);
+                if (candidate->bref_retry_stmt != NULL)
+                {
+                        gwbuf_free(candidate->bref_retry_stmt);
+                }
+                candidate->bref_retry_stmt = failed->bref_retry_stmt;
+                failed->bref_retry_stmt = NULL;
+                atomic_add(&rses->router->stats.n_retried_reads, 1);
+                backend_stats_add(candidate->bref_backend,
+                        candidate->bref_retry_stmt, BSTAT_READ);
+
+                MXS_INFO("Replaying read in flight on failed backend %s:%d "
+                         "on %s:%d.",
+                         BREFSRV(failed)->name,
+                         BREFSRV(failed)->port,
+                         BREFSRV(candidate)->name,
+                         BREFSRV(candidate)->port);
+                return true;
+        }
+        return false;
 }
 
 /** Compare nunmber of current operations in backend servers */
@@ -3129,6 +4657,150 @@ static void bref_set_state(
         }
 }
 
+/**
+ * Server status event callback for the router instance.
+ *
+ * Invoked by the core, typically from a monitor thread, when the status
+ * bits of any server change. If the server belongs to this instance the
+ * candidate sets are marked stale; the next backend selection rebuilds
+ * them.
+ *
+ * @param server     The server whose status changed
+ * @param old_status Status bits before the transition
+ * @param new_status Status bits after the transition
+ * @param userdata   The router instance that subscribed
+ */
+static void rwsplit_server_status_cb(
+        SERVER*      server,
+        unsigned int old_status,
+        unsigned int new_status,
+        void*        userdata)
+{
+        ROUTER_INSTANCE* router = (ROUTER_INSTANCE *)userdata;
+        int              i;
+
+        for (i = 0; router->servers[i] != NULL; i++)
+        {
+                if (router->servers[i]->backend_server == server)
+                {
+                        router->cand_valid = 0;
+                        break;
+                }
+        }
+}
+
+/**
+ * Rebuild the candidate server sets if a status transition has invalidated
+ * them.
+ *
+ * Computes the root master, i.e. the master with the lowest replication
+ * depth, and the array of running slave and relay server candidates which
+ * match the router's status bit requirements. The sets stay valid until the
+ * next status event, so in the common case backend selection only reads
+ * pre-filtered arrays. The arrays are rebuilt in place; a racing reader may
+ * act on a mix of old and new candidates for one decision, which is no worse
+ * than the racy status bit reads this replaces.
+ *
+ * @param router     Router instance
+ */
+static void refresh_candidate_servers(
+        ROUTER_INSTANCE* router)
+{
+        BACKEND* master_host;
+        int      nslaves;
+        int      i;
+
+        if (router->cand_slaves == NULL || router->cand_valid)
+        {
+                return;
+        }
+        spinlock_acquire(&router->cand_lock);
+
+        if (!router->cand_valid)
+        {
+                /**
+                 * Mark the set valid before reading the status bits; a
+                 * transition arriving during the rebuild clears the flag
+                 * again and the next selection repeats the rebuild.
+                 */
+                router->cand_valid = 1;
+
+                master_host = NULL;
+
+                for (i = 0; router->servers[i] != NULL; i++)
+                {
+                        BACKEND* b = router->servers[i];
+
+                        if ((b->backend_server->status &
+                                (SERVER_MASTER|SERVER_MAINT)) == SERVER_MASTER &&
+                                (master_host == NULL ||
+                                b->backend_server->depth <
+                                master_host->backend_server->depth))
+                        {
+                                master_host = b;
+                        }
+                }
+                nslaves = 0;
+
+                for (i = 0; router->servers[i] != NULL; i++)
+                {
+                        BACKEND* b = router->servers[i];
+
+                        if (SERVER_IS_RUNNING(b->backend_server) &&
+                                ((b->backend_server->status & router->bitmask) ==
+                                router->bitvalue) &&
+                                (SERVER_IS_SLAVE(b->backend_server) ||
+                                SERVER_IS_RELAY_SERVER(b->backend_server)) &&
+                                (master_host == NULL ||
+                                b->backend_server != master_host->backend_server))
+                        {
+                                router->cand_slaves[nslaves] = b;
+                                nslaves += 1;
+                        }
+                }
+                router->cand_master = master_host;
+                router->cand_nslaves = nslaves;
+        }
+        spinlock_release(&router->cand_lock);
+}
+
+/**
+ * Check whether a backend is a slave candidate.
+ *
+ * Reads the pre-filtered candidate array when it is maintained and falls
+ * back to testing the status bits directly when it is not.
+ *
+ * @param router     Router instance
+ * @param b          The backend to check
+ *
+ * @return true if the backend is a running slave or relay server matching
+ * the router's status bit requirements
+ */
+static bool backend_is_slave_candidate(
+	ROUTER_INSTANCE* router,
+	BACKEND*         b)
+{
+        int i;
+
+        if (router->cand_slaves == NULL)
+        {
+                return SERVER_IS_RUNNING(b->backend_server) &&
+                        ((b->backend_server->status & router->bitmask) ==
+                        router->bitvalue) &&
+                        (SERVER_IS_SLAVE(b->backend_server) ||
+                        SERVER_IS_RELAY_SERVER(b->backend_server));
+        }
+
+        for (i = 0; i < router->cand_nslaves; i++)
+        {
+                if (router->cand_slaves[i] == b)
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
 /**
  * @node Search suitable backend servers from those of router instance.
  *
@@ -3192,8 +4864,18 @@ static bool select_connect_backend_servers(
                 goto return_succp;
         }
 
-	/* get the root Master */
-	master_host = get_root_master(backend_ref, router_nservers);
+	/* get the root Master from the candidate set kept current by status
+	 * events, or by scanning the backends when the set is not maintained */
+	refresh_candidate_servers(router);
+
+	if (router->cand_slaves != NULL)
+	{
+		master_host = router->cand_master;
+	}
+	else
+	{
+		master_host = get_root_master(backend_ref, router_nservers);
+	}
 
 	/**
 	 * Existing session : master is already chosen and connected.
@@ -3321,144 +5003,158 @@ static bool select_connect_backend_servers(
         /**
          * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves
          * servers from the sorted list. First master found is selected.
+         *
+         * The master connection is initiated first, in its own pass, because
+         * its handshake gates the first routed query; the session starts
+         * routing as soon as the master is up. The slave connections are
+         * then all initiated back to back. The connects are non-blocking so
+         * the handshakes of every backend proceed in parallel on the polling
+         * threads and each slave joins the session as its own connection
+         * completes. If no master can be connected the slaves are not
+         * contacted at all.
          */
-        for (i=0;
-             i<router_nservers &&
-             (slaves_connected < max_nslaves || !master_connected);
-             i++)
+        for (i=0; i<router_nservers; i++)
         {
                 BACKEND* b = backend_ref[i].bref_backend;
 
-                if (SERVER_IS_RUNNING(b->backend_server) &&
-                        ((b->backend_server->status & router->bitmask) ==
+                if (master_host == NULL ||
+                        b->backend_server != master_host->backend_server ||
+                        !SERVER_IS_RUNNING(b->backend_server) ||
+                        ((b->backend_server->status & router->bitmask) !=
                         router->bitvalue))
                 {
-			/* check also for relay servers and don't take the master_host */
-                        if (slaves_found < max_nslaves &&
-                                (max_slave_rlag == MAX_RLAG_UNDEFINED ||
-                                (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                                 b->backend_server->rlag <= max_slave_rlag)) &&
-                                (SERVER_IS_SLAVE(b->backend_server) ||
-					SERVER_IS_RELAY_SERVER(b->backend_server)) &&
-				(master_host != NULL &&
-					(b->backend_server != master_host->backend_server)))
-                        {
-			    if(BREF_HAS_FAILED(&backend_ref[i]))
-			    {
-				continue;
-			    }
+                        continue;
+                }
+		/**
+		 * *p_master_ref must be assigned with this
+		 * backend_ref pointer because its original value
+		 * may have been lost when backend references were
+		 * sorted (qsort).
+		 */
+                *p_master_ref = &backend_ref[i];
 
-                                slaves_found += 1;
+                if (master_connected)
+                {
+                        continue;
+                }
+                master_found = true;
 
-                                /** Slave is already connected */
-                                if (BREF_IS_IN_USE((&backend_ref[i])))
-                                {
-                                        slaves_connected += 1;
-                                }
-                                /** New slave connection is taking place */
-                                else
-                                {
-                                        backend_ref[i].bref_dcb = dcb_connect(
-                                                b->backend_server,
-                                                session,
-                                                b->backend_server->protocol);
+                backend_ref[i].bref_dcb = service_pool_lease_dcb(
+                        router->service,
+                        b->backend_server,
+                        session);
 
-                                        if (backend_ref[i].bref_dcb != NULL)
-                                        {
-                                                slaves_connected += 1;
-                                                /**
-                                                 * Start executing session command
-                                                 * history.
-                                                 */
-                                                execute_sescmd_history(&backend_ref[i]);
-                                                /**
-						 * Here we actually say : When this
-						 * type of issue occurs (DCB_REASON_...)
-						 * for this particular DCB,
-						 * call this function.
-                                                 */
-                                                dcb_add_callback(
-                                                        backend_ref[i].bref_dcb,
-                                                        DCB_REASON_NOT_RESPONDING,
-                                                        &router_handle_state_switch,
-                                                        (void *)&backend_ref[i]);
-                                                backend_ref[i].bref_state = 0;
-                                                bref_set_state(&backend_ref[i],
-                                                               BREF_IN_USE);
-                                               /**
-                                                * Increase backend connection counter.
-                                                * Server's stats are _increased_ in
-                                                * dcb.c:dcb_alloc !
-                                                * But decreased in the calling function
-                                                * of dcb_close.
-                                                */
-                                                atomic_add(&b->backend_conn_count, 1);
-                                        }
-                                        else
-                                        {
-                                            MXS_ERROR("Unable to establish "
-                                                      "connection with slave %s:%d",
-                                                      b->backend_server->name,
-                                                      b->backend_server->port);
-                                                /* handle connect error */
-                                        }
-                                }
-                        }
-			/* take the master_host for master */
-			else if (master_host &&
-                                (b->backend_server == master_host->backend_server))
-                        {
-				/**
-				 * *p_master_ref must be assigned with this
-				 * backend_ref pointer because its original value
-				 * may have been lost when backend references were
-				 * sorted (qsort).
-				 */
-                                *p_master_ref = &backend_ref[i];
+                if (backend_ref[i].bref_dcb != NULL)
+                {
+                        master_connected = true;
+                        /**
+                         * When server fails, this callback
+                         * is called.
+                         */
+                        dcb_add_callback(
+                                backend_ref[i].bref_dcb,
+                                DCB_REASON_NOT_RESPONDING,
+                                &router_handle_state_switch,
+                                (void *)&backend_ref[i]);
+
+                        backend_ref[i].bref_state = 0;
+                        bref_set_state(&backend_ref[i],
+                                       BREF_IN_USE);
+                        /** Increase backend connection counters */
+                        atomic_add(&b->backend_conn_count, 1);
+                }
+                else
+                {
+                        succp = false;
+                        MXS_ERROR("Unable to establish "
+                                  "connection with master %s:%d",
+                                  b->backend_server->name,
+                                  b->backend_server->port);
+                        /** handle connect error */
+                }
+        } /*< for */
 
-                                if (master_connected)
-                                {
-                                        continue;
-                                }
-                                master_found = true;
+        for (i=0;
+             master_connected && i<router_nservers &&
+             slaves_connected < max_nslaves;
+             i++)
+        {
+                BACKEND* b = backend_ref[i].bref_backend;
+
+                if (!backend_is_slave_candidate(router, b))
+                {
+                        continue;
+                }
+		/* check also for relay servers and don't take the master_host */
+                if (slaves_found < max_nslaves &&
+                        (max_slave_rlag == MAX_RLAG_UNDEFINED ||
+                        (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
+                         b->backend_server->rlag <= max_slave_rlag)) &&
+			(master_host != NULL &&
+				(b->backend_server != master_host->backend_server)))
+                {
+		    if(BREF_HAS_FAILED(&backend_ref[i]))
+		    {
+			continue;
+		    }
 
-                                backend_ref[i].bref_dcb = dcb_connect(
+                        slaves_found += 1;
+
+                        /** Slave is already connected */
+                        if (BREF_IS_IN_USE((&backend_ref[i])))
+                        {
+                                slaves_connected += 1;
+                        }
+                        /** New slave connection is taking place */
+                        else
+                        {
+                                backend_ref[i].bref_dcb = service_pool_lease_dcb(
+                                        router->service,
                                         b->backend_server,
-                                        session,
-                                        b->backend_server->protocol);
+                                        session);
 
                                 if (backend_ref[i].bref_dcb != NULL)
                                 {
-                                        master_connected = true;
+                                        slaves_connected += 1;
+                                        /**
+                                         * Start executing session command
+                                         * history.
+                                         */
+                                        execute_sescmd_history(&backend_ref[i]);
                                         /**
-                                         * When server fails, this callback
-                                         * is called.
+					 * Here we actually say : When this
+					 * type of issue occurs (DCB_REASON_...)
+					 * for this particular DCB,
+					 * call this function.
                                          */
                                         dcb_add_callback(
                                                 backend_ref[i].bref_dcb,
                                                 DCB_REASON_NOT_RESPONDING,
                                                 &router_handle_state_switch,
                                                 (void *)&backend_ref[i]);
-
                                         backend_ref[i].bref_state = 0;
                                         bref_set_state(&backend_ref[i],
                                                        BREF_IN_USE);
-                                        /** Increase backend connection counters */
+                                       /**
+                                        * Increase backend connection counter.
+                                        * Server's stats are _increased_ in
+                                        * dcb.c:dcb_alloc !
+                                        * But decreased in the calling function
+                                        * of dcb_close.
+                                        */
                                         atomic_add(&b->backend_conn_count, 1);
                                 }
                                 else
                                 {
-                                        succp = false;
-                                        MXS_ERROR("Unable to establish "
-                                                  "connection with master %s:%d",
-                                                  b->backend_server->name,
-                                                  b->backend_server->port);
-                                        /** handle connect error */
+                                    MXS_ERROR("Unable to establish "
+                                              "connection with slave %s:%d",
+                                              b->backend_server->name,
+                                              b->backend_server->port);
+                                        /* handle connect error */
                                 }
                         }
                 }
         } /*< for */
-
 #if defined(EXTRA_SS_DEBUG)
         MXS_INFO("Servers and conns after ordering:");
 
@@ -3737,22 +5433,272 @@ static mysql_sescmd_t* mysql_sescmd_init (
         sescmd->my_sescmd_buf  = sescmd_buf;
         sescmd->my_sescmd_packet_type = packet_type;
 	sescmd->position = atomic_add(&rses->pos_generator,1);
+        sescmd->my_sescmd_key = sescmd_get_compaction_key(sescmd_buf, packet_type);
 
         return sescmd;
 }
 
 
-static void mysql_sescmd_done(
-	mysql_sescmd_t* sescmd)
-{
-    if(sescmd == NULL)
-    {
-	MXS_ERROR("[%s] Error: NULL parameter.",__FUNCTION__);
-	return;
-    }
-	CHK_RSES_PROP(sescmd->my_sescmd_prop);
-	gwbuf_free(sescmd->my_sescmd_buf);
-        memset(sescmd, 0, sizeof(mysql_sescmd_t));
+static void mysql_sescmd_done(
+	mysql_sescmd_t* sescmd)
+{
+    if(sescmd == NULL)
+    {
+	MXS_ERROR("[%s] Error: NULL parameter.",__FUNCTION__);
+	return;
+    }
+	CHK_RSES_PROP(sescmd->my_sescmd_prop);
+	gwbuf_free(sescmd->my_sescmd_buf);
+        free(sescmd->my_sescmd_key);
+        memset(sescmd, 0, sizeof(mysql_sescmd_t));
+}
+
+/**
+ * Record the routing class of a prepared statement. Called when the reply
+ * to a COM_STMT_PREPARE is received from the master. If the id is already
+ * known its class is replaced.
+ *
+ * Router session must be locked.
+ *
+ * @param rses		Router client session
+ * @param stmt_id	Statement id assigned by the backend
+ * @param read_only	True if the statement may be executed on a slave
+ */
+static void rses_stmt_register(
+	ROUTER_CLIENT_SES* rses,
+	uint32_t           stmt_id,
+	bool               read_only)
+{
+	rses_stmt_t* stmt;
+
+	for (stmt = rses->rses_stmts; stmt != NULL; stmt = stmt->next)
+	{
+		if (stmt->stmt_id == stmt_id)
+		{
+			stmt->read_only = read_only;
+			return;
+		}
+	}
+
+	if ((stmt = (rses_stmt_t *)malloc(sizeof(rses_stmt_t))) != NULL)
+	{
+		stmt->stmt_id = stmt_id;
+		stmt->read_only = read_only;
+		stmt->next = rses->rses_stmts;
+		rses->rses_stmts = stmt;
+	}
+}
+
+/**
+ * Look up the routing class of a prepared statement. Unknown statement ids
+ * are reported as not read only so that they are executed on the master.
+ *
+ * Router session must be locked.
+ *
+ * @param rses		Router client session
+ * @param stmt_id	Statement id read from a COM_STMT_EXECUTE packet
+ * @return True if the statement was classified read only at prepare time
+ */
+static bool rses_stmt_is_read_only(
+	ROUTER_CLIENT_SES* rses,
+	uint32_t           stmt_id)
+{
+	rses_stmt_t* stmt;
+
+	for (stmt = rses->rses_stmts; stmt != NULL; stmt = stmt->next)
+	{
+		if (stmt->stmt_id == stmt_id)
+		{
+			return stmt->read_only;
+		}
+	}
+	return false;
+}
+
+/**
+ * Remove a prepared statement from the routing class map when the client
+ * closes it.
+ *
+ * Router session must be locked.
+ *
+ * @param rses		Router client session
+ * @param stmt_id	Statement id read from a COM_STMT_CLOSE packet
+ */
+static void rses_stmt_remove(
+	ROUTER_CLIENT_SES* rses,
+	uint32_t           stmt_id)
+{
+	rses_stmt_t** ptr = &rses->rses_stmts;
+
+	while (*ptr != NULL)
+	{
+		if ((*ptr)->stmt_id == stmt_id)
+		{
+			rses_stmt_t* stmt = *ptr;
+			*ptr = stmt->next;
+			free(stmt);
+			return;
+		}
+		ptr = &(*ptr)->next;
+	}
+}
+
+/**
+ * Derive the compaction key of a session command, the name of the
+ * session variable or state the command sets. A command supersedes any
+ * earlier command in the history with the same key, so only the latest
+ * one needs to be replayed on a new backend connection. NULL is
+ * returned for commands that have no single superseding key; those are
+ * never compacted.
+ *
+ * @param buf           The session command buffer
+ * @param packet_type   The MySQL packet type of the command
+ * @return Allocated key string or NULL
+ */
+static char* sescmd_get_compaction_key(
+        GWBUF*        buf,
+        unsigned char packet_type)
+{
+        char* sql;
+        char* ptr;
+        char* key = NULL;
+
+        if (packet_type == MYSQL_COM_INIT_DB)
+        {
+                /** Contains a space so it cannot collide with a variable name */
+                return strdup("use database");
+        }
+        if (packet_type != MYSQL_COM_QUERY ||
+            (sql = modutil_get_SQL(buf)) == NULL)
+        {
+                return NULL;
+        }
+        ptr = sql;
+        while (isspace(*ptr))
+        {
+                ptr++;
+        }
+        /**
+         * Only SET statements with a single assignment are given a key;
+         * a comma anywhere makes this a multiple assignment, or a value
+         * containing one, and such commands are kept as they are.
+         */
+        if (strncasecmp(ptr, "set", 3) == 0 && isspace(ptr[3]) &&
+            strchr(ptr, ',') == NULL)
+        {
+                int len = 0;
+
+                ptr += 4;
+                while (isspace(*ptr))
+                {
+                        ptr++;
+                }
+                /** The scope keyword is not part of the key */
+                if ((strncasecmp(ptr, "session", 7) == 0 && isspace(ptr[7])) ||
+                    (strncasecmp(ptr, "global", 6) == 0 && isspace(ptr[6])) ||
+                    (strncasecmp(ptr, "local", 5) == 0 && isspace(ptr[5])))
+                {
+                        while (!isspace(*ptr))
+                        {
+                                ptr++;
+                        }
+                        while (isspace(*ptr))
+                        {
+                                ptr++;
+                        }
+                }
+                while (isalnum(ptr[len]) || ptr[len] == '_' ||
+                       ptr[len] == '@' || ptr[len] == '.' || ptr[len] == '$')
+                {
+                        len++;
+                }
+                if (len > 0 && (key = (char *)malloc(len + 1)) != NULL)
+                {
+                        int i;
+
+                        for (i = 0; i < len; i++)
+                        {
+                                key[i] = tolower(ptr[i]);
+                        }
+                        key[len] = '\0';
+                }
+        }
+        free(sql);
+        return key;
+}
+
+/**
+ * Check whether the session command cursor of any backend in use still
+ * refers to the given property, either as its current command or via
+ * its pointer to the property list link.
+ *
+ * @param rses  Router client session
+ * @param prop  The session command property
+ * @return true if some cursor refers to the property
+ */
+static bool sescmd_prop_in_use(
+        ROUTER_CLIENT_SES* rses,
+        rses_property_t*   prop)
+{
+        int i;
+
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                backend_ref_t*   bref = &rses->rses_backend_ref[i];
+                sescmd_cursor_t* scur = &bref->bref_sescmd_cur;
+
+                if (BREF_IS_IN_USE(bref) &&
+                    (scur->scmd_cur_cmd == &prop->rses_prop_data.sescmd ||
+                     scur->scmd_cur_ptr_property == &prop->rses_prop_next))
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Compact the session command history after a new command has been
+ * added to it. Earlier commands with the same compaction key as the new
+ * command set the same variable or state and are superseded by it, so
+ * they are removed from the history, keeping replay on new backend
+ * connections and the memory of long sessions proportional to the
+ * number of distinct variables instead of the number of commands
+ * issued. A command is only removed when no backend cursor still refers
+ * to it.
+ *
+ * Called with the router session locked.
+ *
+ * @param rses          Router client session
+ * @param newprop       The newly added session command property
+ */
+static void compact_sescmd_history(
+        ROUTER_CLIENT_SES* rses,
+        rses_property_t*   newprop)
+{
+        rses_property_t** slot = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+        const char* key = newprop->rses_prop_data.sescmd.my_sescmd_key;
+
+        ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+
+        while (*slot != NULL && *slot != newprop)
+        {
+                rses_property_t* prop = *slot;
+                mysql_sescmd_t*  scmd = &prop->rses_prop_data.sescmd;
+
+                if (scmd->my_sescmd_key != NULL &&
+                    strcasecmp(scmd->my_sescmd_key, key) == 0 &&
+                    !sescmd_prop_in_use(rses, prop))
+                {
+                        *slot = prop->rses_prop_next;
+                        rses_property_done(prop);
+                        atomic_add(&rses->rses_nsescmd, -1);
+                }
+                else
+                {
+                        slot = &prop->rses_prop_next;
+                }
+        }
 }
 
 /**
@@ -3844,6 +5790,24 @@ static GWBUF* sescmd_cursor_process_replies(
                         /** Mark the rest session commands as replied */
                         scmd->my_sescmd_is_replied = true;
                         scmd->reply_cmd = *((unsigned char*)replybuf->start + 4);
+
+			if (scmd->my_sescmd_packet_type == MYSQL_COM_STMT_PREPARE &&
+				scmd->reply_cmd == 0x00)
+			{
+				uint8_t idbuf[4];
+
+				/** The prepare OK packet carries the statement
+				 * id in bytes 5-8. The slaves assign the same
+				 * id as the master because the prepare is
+				 * executed on every connection in history
+				 * order. */
+				if (gwbuf_copy_data(replybuf, 5, 4, idbuf) == 4)
+				{
+					rses_stmt_register(ses,
+						gw_mysql_get_byte4(idbuf),
+						scmd->my_sescmd_read_only);
+				}
+			}
 			MXS_INFO("Master '%s' responded to a session command.",
                                  bref->bref_backend->backend_server->unique_name);
 			int i;
@@ -3956,27 +5920,6 @@ static void sescmd_cursor_set_active(
         sescmd_cursor->scmd_cur_active = value;
 }
 
-/**
- * Clone session command's command buffer.
- * Router session must be locked
- */
-static GWBUF* sescmd_cursor_clone_querybuf(
-	sescmd_cursor_t* scur)
-{
-	GWBUF* buf;
-	if(scur == NULL)
-	{
-            MXS_ERROR("[%s] Error: NULL parameter.",__FUNCTION__);
-	    return NULL;
-	}
-	ss_dassert(scur->scmd_cur_cmd != NULL);
-
-	buf = gwbuf_clone_all(scur->scmd_cur_cmd->my_sescmd_buf);
-
-	CHK_GWBUF(buf);
-	return buf;
-}
-
 static bool sescmd_cursor_history_empty(
         sescmd_cursor_t* scur)
 {
@@ -4020,6 +5963,8 @@ static void sescmd_cursor_reset(
         CHK_RSES_PROP((*scur->scmd_cur_ptr_property));
         scur->scmd_cur_active = false;
         scur->scmd_cur_cmd = &(*scur->scmd_cur_ptr_property)->rses_prop_data.sescmd;
+        /** The whole history will be written again to this backend */
+        scur->scmd_sent_pos = 0;
 }
 
 static bool execute_sescmd_history(
@@ -4050,10 +5995,82 @@ static bool execute_sescmd_history(
         return succp;
 }
 
+/**
+ * Write a single session command to a backend DCB.
+ *
+ * @param dcb	The backend DCB to write to
+ * @param scmd	The session command to write
+ * @return 1 if the command was written or queued successfully
+ */
+static int sescmd_write_to_backend(
+	DCB*		dcb,
+	mysql_sescmd_t*	scmd)
+{
+	GWBUF*	buf;
+	int	rc;
+
+        switch (scmd->my_sescmd_packet_type) {
+                case MYSQL_COM_CHANGE_USER:
+			/** This makes it possible to handle replies correctly */
+			gwbuf_set_type(scmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
+			buf = gwbuf_clone_all(scmd->my_sescmd_buf);
+			rc = dcb->func.auth(
+                                dcb,
+                                NULL,
+                                dcb->session,
+                                buf);
+                        break;
+
+		case MYSQL_COM_INIT_DB:
+		{
+			/**
+			 * Record database name and store to session.
+			 */
+			GWBUF* tmpbuf;
+			MYSQL_session* data;
+			unsigned int qlen;
+
+			data = dcb->session->client_dcb->data;
+			tmpbuf = scmd->my_sescmd_buf;
+			qlen = MYSQL_GET_PACKET_LEN((unsigned char*)tmpbuf->start);
+			memset(data->db,0,MYSQL_DATABASE_MAXLEN+1);
+			if(qlen > 0 && qlen < MYSQL_DATABASE_MAXLEN+1)
+				strncpy(data->db,tmpbuf->start+5,qlen - 1);
+		}
+		/** Fallthrough */
+		case MYSQL_COM_QUERY:
+                default:
+                        /**
+                         * Mark session command buffer, it triggers writing
+                         * MySQL command to protocol
+                         */
+
+                        gwbuf_set_type(scmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
+			buf = gwbuf_clone_all(scmd->my_sescmd_buf);
+                        rc = dcb->func.write(
+                                dcb,
+                                buf);
+                        break;
+        }
+	return rc;
+}
+
 /**
  * If session command cursor is passive, sends the command to backend for
  * execution.
  *
+ * The replay is pipelined: every command from the one the cursor points
+ * at to the end of the history is written to the backend in one batch
+ * without waiting for the replies between them. The replies arrive in
+ * order and are validated one by one by sescmd_cursor_process_replies,
+ * so attaching a backend with a long history costs a single round trip
+ * instead of one per command. The position of the last command written
+ * is kept in the cursor so that the call made when each reply arrives
+ * does not write the commands a second time; only commands appended to
+ * the history after the batch was sent are written then. A change user
+ * command ends a batch, since the commands after it must not be sent
+ * until the authentication change has succeeded.
+ *
  * Returns true if command was sent or added successfully to the queue.
  * Returns false if command sending failed or if there are no pending session
  * 	commands.
@@ -4065,9 +6082,9 @@ static bool execute_sescmd_in_backend(
 {
 	DCB*             dcb;
 	bool             succp;
-	int              rc = 0;
 	sescmd_cursor_t* scur;
-	GWBUF* buf;
+	rses_property_t* prop;
+	mysql_sescmd_t*  scmd;
 	if(backend_ref == NULL)
 	{
             MXS_ERROR("[%s] Error: NULL parameter.",__FUNCTION__);
@@ -4103,58 +6120,36 @@ static bool execute_sescmd_in_backend(
                 sescmd_cursor_set_active(scur, true);
         }
 
-        switch (scur->scmd_cur_cmd->my_sescmd_packet_type) {
-                case MYSQL_COM_CHANGE_USER:
-			/** This makes it possible to handle replies correctly */
-			gwbuf_set_type(scur->scmd_cur_cmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
-			buf = sescmd_cursor_clone_querybuf(scur);
-			rc = dcb->func.auth(
-                                dcb,
-                                NULL,
-                                dcb->session,
-                                buf);
-                        break;
+	/** The command the cursor waits for may already be in flight
+	 * from an earlier pipelined batch */
+	succp = scur->scmd_cur_cmd->position <= scur->scmd_sent_pos;
 
-		case MYSQL_COM_INIT_DB:
-		{
-			/**
-			 * Record database name and store to session.
-			 */
-			GWBUF* tmpbuf;
-			MYSQL_session* data;
-			unsigned int qlen;
+	for (prop = *scur->scmd_cur_ptr_property;
+	     prop != NULL;
+	     prop = prop->rses_prop_next)
+	{
+		scmd = &prop->rses_prop_data.sescmd;
 
-			data = dcb->session->client_dcb->data;
-			tmpbuf = scur->scmd_cur_cmd->my_sescmd_buf;
-			qlen = MYSQL_GET_PACKET_LEN((unsigned char*)tmpbuf->start);
-			memset(data->db,0,MYSQL_DATABASE_MAXLEN+1);
-			if(qlen > 0 && qlen < MYSQL_DATABASE_MAXLEN+1)
-				strncpy(data->db,tmpbuf->start+5,qlen - 1);
+		if (scmd->position <= scur->scmd_sent_pos)
+		{
+			continue;
 		}
-		/** Fallthrough */
-		case MYSQL_COM_QUERY:
-                default:
-                        /**
-                         * Mark session command buffer, it triggers writing
-                         * MySQL command to protocol
-                         */
-
-                        gwbuf_set_type(scur->scmd_cur_cmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
-			buf = sescmd_cursor_clone_querybuf(scur);
-                        rc = dcb->func.write(
-                                dcb,
-                                buf);
-                        break;
-        }
-
-        if (rc == 1)
-        {
-                succp = true;
-        }
-        else
-        {
-                succp = false;
-        }
+		if (sescmd_write_to_backend(dcb, scmd) != 1)
+		{
+			/** Commands already written are in flight and
+			 * their replies will retrigger the execution,
+			 * which retries the commands left unwritten. */
+			break;
+		}
+		scur->scmd_sent_pos = scmd->position;
+		succp = true;
+                backend_stats_add(backend_ref->bref_backend,
+                        scmd->my_sescmd_buf, BSTAT_SESCMD);
+		if (scmd->my_sescmd_packet_type == MYSQL_COM_CHANGE_USER)
+		{
+			break;
+		}
+	}
 return_succp:
 	return succp;
 }
@@ -4486,6 +6481,13 @@ static bool route_session_write(
 	}
         mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
 
+        /** Remember whether a prepared statement may later run on a slave */
+        prop->rses_prop_data.sescmd.my_sescmd_read_only =
+                (packet_type == MYSQL_COM_STMT_PREPARE &&
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+                !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
+                !QUERY_IS_TYPE(qtype, QUERY_TYPE_MASTER_READ));
+
         /** Add sescmd property to router client session */
         if(rses_property_add(router_cli_ses, prop) != 0)
 	{
@@ -4494,6 +6496,12 @@ static bool route_session_write(
 	    return false;
 	}
 
+        /** Drop the commands this one supersedes from the history */
+        if (prop->rses_prop_data.sescmd.my_sescmd_key != NULL)
+        {
+                compact_sescmd_history(router_cli_ses, prop);
+        }
+
         for (i=0; i<router_cli_ses->rses_nbackends; i++)
         {
                 if (BREF_IS_IN_USE((&backend_ref[i])))
@@ -4633,6 +6641,7 @@ static void rwsplit_process_router_options(
                                         c == LEAST_ROUTER_CONNECTIONS ||
                                         c == LEAST_BEHIND_MASTER ||
                                         c == LEAST_CURRENT_OPERATIONS ||
+                                        c == ADAPTIVE_RESPONSE_TIME ||
                                         c == UNDEFINED_CRITERIA);
 
                                 if (c == UNDEFINED_CRITERIA)
@@ -4641,8 +6650,9 @@ static void rwsplit_process_router_options(
                                                 "slave selection criteria \"%s\". "
                                                 "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
                                                 "LEAST_ROUTER_CONNECTIONS, "
-                                                "LEAST_BEHIND_MASTER,"
-                                                "and LEAST_CURRENT_OPERATIONS.",
+                                                "LEAST_BEHIND_MASTER, "
+                                                "LEAST_CURRENT_OPERATIONS "
+                                                "and ADAPTIVE_RESPONSE_TIME.",
                                                 STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria));
                                 }
                                 else
@@ -4666,6 +6676,18 @@ static void rwsplit_process_router_options(
 			{
 			    router->rwsplit_config.rw_strict_multi_stmt = config_truth_value(value);
 			}
+			else if(strcmp(options[i],"max_pipeline_reads") == 0)
+			{
+			    router->rwsplit_config.rw_max_pipeline_reads = atoi(value);
+			}
+			else if(strcmp(options[i],"hedged_reads") == 0)
+			{
+			    router->rwsplit_config.rw_hedged_reads = config_truth_value(value);
+			}
+			else if(strcmp(options[i],"galera_write_split") == 0)
+			{
+			    router->rwsplit_config.rw_galera_split = config_truth_value(value);
+			}
                 }
         } /*< for */
 }
@@ -4741,13 +6763,17 @@ static void handleError (
 			}
 			srv = rses->rses_master_ref->bref_backend->backend_server;
 			/**
-			 * If master has lost its Master status error can't be
-			 * handled so that session could continue.
+			 * If master has lost its Master status the session can
+			 * only continue when the monitor has already promoted
+			 * one of the slaves this session is connected to; the
+			 * established slave connection then acts as a warm
+			 * standby and the session is switched onto it in place.
 			 */
                         if (rses->rses_master_ref->bref_dcb == problem_dcb &&
 				!SERVER_IS_MASTER(srv))
 			{
                         	backend_ref_t*  bref;
+                        	backend_ref_t*  standby;
                             bref = get_bref_from_dcb(rses, problem_dcb);
                         	if (bref != NULL)
                             {
@@ -4764,17 +6790,51 @@ static void handleError (
                                           srv->port);
                                 dcb_close(problem_dcb);
                             }
-				if (!srv->master_err_is_logged)
+				/**
+				 * An already connected backend that now holds
+				 * the master status is a warm standby. The
+				 * connection has replayed the session command
+				 * history, so as long as no transaction was
+				 * open on the failed master the session can
+				 * simply start writing to it.
+				 */
+				standby = get_root_master_bref(rses);
+				if (standby != NULL &&
+					standby != rses->rses_master_ref &&
+					standby->bref_dcb != NULL &&
+					BREF_IS_IN_USE(standby) &&
+					!rses->rses_transaction_active &&
+					rses->rses_autocommit_enabled)
+				{
+					if (rses->forced_node == rses->rses_master_ref)
+					{
+						rses->forced_node = standby;
+					}
+					rses->rses_master_ref = standby;
+                                    MXS_NOTICE("Session switched to its warm "
+                                               "standby connection to promoted "
+                                               "master %s:%d after %s:%d "
+                                               "failed.",
+                                               BREFSRV(standby)->name,
+                                               BREFSRV(standby)->port,
+                                               srv->name,
+                                               srv->port);
+					*succp = true;
+				}
+				else
 				{
+					if (!srv->master_err_is_logged)
+					{
                                     MXS_ERROR("server %s:%d lost the "
                                               "master status. Readwritesplit "
                                               "service can't locate the master. "
                                               "Client sessions will be closed.",
                                               srv->name,
                                               srv->port);
-					srv->master_err_is_logged = true;
+						srv->master_err_is_logged = true;
+					}
+					*succp = false;
 				}
-				*succp = false;
 			}
 			else
 			{
@@ -4895,9 +6955,82 @@ static bool handle_error_new_connection(
 	if (BREF_IS_WAITING_RESULT(bref))
 	{
 		DCB* client_dcb;
+		bool covered = false;
 		client_dcb = ses->client_dcb;
-		client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+
+		/**
+		 * If the backend served a pipelining window the client waits
+		 * for several replies, and it must get an error for each
+		 * outstanding read and each statement serialized behind the
+		 * window to keep the protocol in sync.
+		 */
+		if (bref == myrses->rses_pipeline_bref)
+		{
+			while (myrses->rses_pipeline_active > 1 &&
+				BREF_IS_WAITING_RESULT(bref))
+			{
+				client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+				bref_clear_state(bref, BREF_WAITING_RESULT);
+				myrses->rses_pipeline_active -= 1;
+			}
+			while (myrses->rses_pipeline_queue != NULL)
+			{
+				GWBUF* stmt = myrses->rses_pipeline_queue;
+
+				myrses->rses_pipeline_queue = stmt->next;
+				stmt->next = NULL;
+				gwbuf_free(stmt);
+				client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+			}
+			myrses->rses_pipeline_active = 0;
+			myrses->rses_pipeline_bref = NULL;
+		}
+		/**
+		 * If the read was hedged and the other backend of the pair
+		 * is still producing the reply, the failure is invisible to
+		 * the client and only the hedging state is dropped. Failing
+		 * that, the copy of a plain read retained at routing time
+		 * is replayed on another backend; the client is sent an
+		 * error only when neither applies.
+		 */
+		if (myrses->rses_hedge_stmt != NULL &&
+			(bref == myrses->rses_hedge_bref ||
+			 bref == myrses->rses_hedge_second))
+		{
+			backend_ref_t* other;
+
+			other = (bref == myrses->rses_hedge_bref) ?
+				myrses->rses_hedge_second :
+				myrses->rses_hedge_bref;
+
+			if (other != NULL &&
+				BREF_IS_IN_USE(other) &&
+				!BREF_IS_CLOSED(other) &&
+				BREF_IS_WAITING_RESULT(other))
+			{
+				covered = true;
+			}
+			gwbuf_free(myrses->rses_hedge_stmt);
+			myrses->rses_hedge_stmt = NULL;
+			myrses->rses_hedge_bref = NULL;
+			myrses->rses_hedge_second = NULL;
+		}
+		if (!covered &&
+			bref->bref_retry_stmt != NULL &&
+			retry_read_on_backend(myrses, bref))
+		{
+			covered = true;
+		}
+		if (!covered)
+		{
+			client_dcb->func.write(client_dcb, gwbuf_clone(errmsg));
+		}
 		bref_clear_state(bref, BREF_WAITING_RESULT);
+		if (bref->bref_retry_stmt != NULL)
+		{
+			gwbuf_free(bref->bref_retry_stmt);
+			bref->bref_retry_stmt = NULL;
+		}
 	}
 	bref_clear_state(bref, BREF_IN_USE);
 	bref_set_state(bref, BREF_CLOSED);
@@ -5062,7 +7195,7 @@ static bool have_enough_servers(
                                       dbgpct);
                         }
                 }
-                free(*p_rses);
+                /** The router session is in the arena of the session */
                 *p_rses = NULL;
                 succp = false;
         }
@@ -5417,3 +7550,169 @@ static void check_for_multi_stmt(ROUTER_CLIENT_SES* rses, GWBUF *buf,
         }
     }
 }
+
+/**
+ * Check whether the statement text at @c ptr starts with @c word as a whole
+ * keyword, i.e. the word is not a prefix of a longer identifier.
+ *
+ * @param ptr Position in the statement text
+ * @param end End of the statement text
+ * @param word The keyword to look for, in lower case
+ * @return true if the keyword starts at @c ptr
+ */
+static bool stmt_keyword_at(const char *ptr, const char *end, const char *word)
+{
+    int len = strlen(word);
+
+    return end - ptr >= len && strncasecmp(ptr, word, len) == 0 &&
+        (ptr + len == end ||
+         (!isalnum((unsigned char)ptr[len]) && ptr[len] != '_'));
+}
+
+/**
+ * Search the statement text for a whole keyword.
+ *
+ * @param data Statement text, not null-terminated
+ * @param buflen Length of the statement text
+ * @param word The keyword to look for, in lower case
+ * @return Pointer to the character following the keyword, or NULL if the
+ * keyword is not present
+ */
+static const char *stmt_find_keyword(const char *data, int buflen,
+                                     const char *word)
+{
+    const char *end = data + buflen;
+    const char *ptr = data;
+
+    while (ptr < end)
+    {
+        if ((ptr == data ||
+             (!isalnum((unsigned char)ptr[-1]) && ptr[-1] != '_')) &&
+            stmt_keyword_at(ptr, end, word))
+        {
+            return ptr + strlen(word);
+        }
+        ptr++;
+    }
+    return NULL;
+}
+
+/**
+ * Check whether the statement contains the transaction access mode clause
+ * READ ONLY or READ WRITE.
+ *
+ * @param data Statement text, not null-terminated
+ * @param buflen Length of the statement text
+ * @param mode Either "only" or "write"
+ * @return true if the READ keyword followed by @c mode is present
+ */
+static bool stmt_has_access_mode(const char *data, int buflen,
+                                 const char *mode)
+{
+    const char *end = data + buflen;
+    const char *ptr = data;
+
+    while ((ptr = stmt_find_keyword(ptr, end - ptr, "read")) != NULL)
+    {
+        while (ptr < end && isspace((unsigned char)*ptr))
+        {
+            ptr++;
+        }
+        if (stmt_keyword_at(ptr, end, mode))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Detect read only transaction syntax
+ *
+ * START TRANSACTION READ ONLY opens a transaction which cannot modify data
+ * and SET [SESSION] TRANSACTION READ ONLY marks the access mode of the
+ * transactions which follow. Such transactions do not need the master; the
+ * whole transaction can run on one slave where the backend server enforces
+ * the access mode. Detection is done on the statement text because the
+ * query classifier does not expose the access mode clause.
+ *
+ * The routine updates the access mode bookkeeping of the session for SET
+ * TRANSACTION statements as a side effect. Statements with GLOBAL scope do
+ * not affect the issuing connection and are ignored.
+ *
+ * @param rses Router client session
+ * @param buf Buffer containing the full query
+ * @param qtype Query type of the statement
+ * @param packet_type Command byte of the statement
+ * @return true if the statement opens a read only transaction
+ */
+static bool check_for_read_only_trx(ROUTER_CLIENT_SES* rses, GWBUF *buf,
+                                    qc_query_type_t qtype,
+                                    mysql_server_cmd_t packet_type)
+{
+    bool ro = false;
+
+    if (packet_type == MYSQL_COM_QUERY)
+    {
+        char *data = GWBUF_DATA(buf) + 5;
+        /** Payload size without command byte */
+        int buflen = gw_mysql_get_byte3((uint8_t*)GWBUF_DATA(buf)) - 1;
+
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+        {
+            ro = rses->rses_ro_trx_next || rses->rses_ro_trx_session;
+            rses->rses_ro_trx_next = false;
+
+            if (stmt_has_access_mode(data, buflen, "write"))
+            {
+                ro = false;
+            }
+            else if (stmt_has_access_mode(data, buflen, "only"))
+            {
+                ro = true;
+            }
+        }
+        else
+        {
+            const char *ptr = data;
+            const char *end = data + buflen;
+
+            while (ptr < end && isspace((unsigned char)*ptr))
+            {
+                ptr++;
+            }
+
+            if (stmt_keyword_at(ptr, end, "set") &&
+                stmt_find_keyword(ptr, end - ptr, "transaction") != NULL &&
+                stmt_find_keyword(ptr, end - ptr, "global") == NULL)
+            {
+                bool session_scope =
+                    stmt_find_keyword(ptr, end - ptr, "session") != NULL;
+
+                if (stmt_has_access_mode(ptr, end - ptr, "only"))
+                {
+                    if (session_scope)
+                    {
+                        rses->rses_ro_trx_session = true;
+                    }
+                    else
+                    {
+                        rses->rses_ro_trx_next = true;
+                    }
+                }
+                else if (stmt_has_access_mode(ptr, end - ptr, "write"))
+                {
+                    if (session_scope)
+                    {
+                        rses->rses_ro_trx_session = false;
+                    }
+                    else
+                    {
+                        rses->rses_ro_trx_next = false;
+                    }
+                }
+            }
+        }
+    }
+    return ro;
+}
@@ -36,9 +36,15 @@
 #include <mysql_client_server_protocol.h>
 #include <maxscale/poll.h>
 #include <pcre.h>
+#include <housekeeper.h>
+#include <gwdirs.h>
+#include <sys/stat.h>
 
 #define DEFAULT_REFRESH_INTERVAL 30.0
 
+/** How often the shard maps are written to the cache file, in seconds */
+#define SHARD_MAP_SAVE_INTERVAL 300
+
 /** Size of the hashtable used to store ignored databases */
 #define SCHEMAROUTER_HASHSIZE 100
 
@@ -65,6 +71,11 @@ MODULE_INFO info =
  *  01/12/2014  Vilho Raatikka/Markus Mäkelä  Initial implementation
  *  09/09/2015  Martin Brampton               Modify error handler
  *  25/09/2015  Martin Brampton               Block callback processing when no router session in the DCB
+ *  03/07/2016  Mark Riddoch                  Background shard scan thread maps the
+ *                                            databases outside the session setup path
+ *  05/07/2016  Mark Riddoch                  Bloom filter in front of the shard map
+ *                                            hashtable so that lookups of unknown
+ *                                            databases avoid a locked probe
  *
  * @endverbatim
  */
@@ -182,6 +193,9 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
 bool handle_default_db(ROUTER_CLIENT_SES *router_cli_ses);
 void route_queued_query(ROUTER_CLIENT_SES *router_cli_ses);
 void synchronize_shard_map(ROUTER_CLIENT_SES *client);
+static void shard_map_load_all(ROUTER_INSTANCE *router);
+static void shard_map_save_all(void *data);
+static void shard_scan_main(void *data);
 
 static int hashkeyfun(void* key)
 {
@@ -213,6 +227,67 @@ void* keyfreefun(void* data)
     return NULL;
 }
 
+/** Number of bits in the shard map bloom filter */
+#define SHARD_BLOOM_BITS (SHARD_BLOOM_SIZE * 8)
+
+/**
+ * Compute the two bloom filter bit positions for a database name. The
+ * first hash is the same function the shard map hashtable uses, the
+ * second is a djb2 hash so that the two probes stay independent.
+ *
+ * @param name Database name
+ * @param b1   First bit position
+ * @param b2   Second bit position
+ */
+static void shard_bloom_hash(const char *name, unsigned int *b1, unsigned int *b2)
+{
+    unsigned int h1 = 0, h2 = 5381;
+    int c;
+
+    while ((c = *name++))
+    {
+        h1 = c + (h1 << 6) + (h1 << 16) - h1;
+        h2 = ((h2 << 5) + h2) ^ c;
+    }
+    *b1 = h1 % SHARD_BLOOM_BITS;
+    *b2 = h2 % SHARD_BLOOM_BITS;
+}
+
+/**
+ * Record a database name in the bloom filter of a shard map. This must be
+ * called for every database added to the map hashtable. Bits are never
+ * cleared; entries are only ever removed by replacing the whole map, which
+ * starts from an empty filter.
+ *
+ * @param map  Shard map the database was added to
+ * @param name Database name
+ */
+static void shard_bloom_add(shard_map_t *map, const char *name)
+{
+    unsigned int b1, b2;
+
+    shard_bloom_hash(name, &b1, &b2);
+    map->bloom[b1 / 8] |= 1 << (b1 & 7);
+    map->bloom[b2 / 8] |= 1 << (b2 & 7);
+}
+
+/**
+ * Test the bloom filter of a shard map for a database name.
+ *
+ * @param map  Shard map to test
+ * @param name Database name
+ * @return Zero if the database is definitely not in the map, non-zero if
+ * it may be and the hashtable must be probed
+ */
+static int shard_bloom_test(shard_map_t *map, const char *name)
+{
+    unsigned int b1, b2;
+
+    shard_bloom_hash(name, &b1, &b2);
+    return (map->bloom[b1 / 8] & (1 << (b1 & 7))) &&
+        (map->bloom[b2 / 8] & (1 << (b2 & 7)));
+}
+
 /**
  * Allocate a shard map and initialize it.
  * @return Pointer to new shard_map_t or NULL if memory allocation failed
@@ -231,6 +306,7 @@ shard_map_t* shard_map_alloc()
             spinlock_init(&rval->lock);
             rval->last_updated = 0;
             rval->state = SHMAP_UNINIT;
+            memset(rval->bloom, 0, sizeof(rval->bloom));
         }
         else
         {
@@ -241,6 +317,428 @@ shard_map_t* shard_map_alloc()
     return rval;
 }
 
+/**
+ * Build the path of the shard map cache file of this router instance.
+ * The file lives in the same per service cache directory as the cached
+ * authentication data.
+ * @param router Router instance
+ * @param path Buffer where the path is written
+ * @param size Size of the buffer
+ */
+static void shard_map_cache_path(ROUTER_INSTANCE *router, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s/.cache/shardmap", get_cachedir(),
+             router->service->name);
+}
+
+/**
+ * Load the shard maps of all users from the cache file.
+ *
+ * The maps that are read from the cache are marked as ready so that new
+ * sessions route from them immediately instead of mapping every backend
+ * with SHOW DATABASES first. The cached maps are validated asynchronously
+ * by the normal refresh machinery: they turn stale once
+ * refresh_min_interval has passed and any database that is not found in a
+ * cached map triggers a re-mapping while the query waits in the session
+ * queue, so an out of date cache corrects itself without blocking the
+ * restart.
+ * @param router Router instance
+ */
+static void shard_map_load_all(ROUTER_INSTANCE *router)
+{
+    char path[PATH_MAX + 1];
+    char line[3 * MYSQL_DATABASE_MAXLEN];
+    FILE *file;
+    int nentries = 0;
+
+    shard_map_cache_path(router, path, sizeof(path));
+
+    if ((file = fopen(path, "r")) == NULL)
+    {
+        MXS_INFO("schemarouter: No shard map cache file '%s', "
+                 "all sessions will map the databases.", path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char *saveptr = NULL;
+        char *user = strtok_r(line, "\t\n", &saveptr);
+        char *db = strtok_r(NULL, "\t\n", &saveptr);
+        char *target = strtok_r(NULL, "\t\n", &saveptr);
+
+        if (user == NULL || db == NULL || target == NULL)
+        {
+            continue;
+        }
+
+        shard_map_t *map = hashtable_fetch(router->shard_maps, user);
+
+        if (map == NULL)
+        {
+            if ((map = shard_map_alloc()) == NULL)
+            {
+                break;
+            }
+            map->state = SHMAP_READY;
+            map->last_updated = time(NULL);
+            hashtable_add(router->shard_maps, user, map);
+        }
+
+        if (hashtable_add(map->hash, db, target))
+        {
+            shard_bloom_add(map, db);
+            nentries++;
+        }
+    }
+    fclose(file);
+
+    if (nentries > 0)
+    {
+        MXS_NOTICE("schemarouter: %s: Loaded %d cached shard map entries from '%s'.",
+                   router->service->name, nentries, path);
+    }
+}
+
+/**
+ * Write the shard maps of all users to the cache file so that a restart
+ * of MaxScale can warm-start its routing decisions. This is executed as a
+ * housekeeper task and does nothing if the maps have not changed since
+ * they were last saved. The file is written to a temporary name and
+ * renamed into place so that a crash never leaves a half written cache.
+ * @param data Router instance cast to void*
+ */
+static void shard_map_save_all(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE*)data;
+    char path[PATH_MAX + 1];
+    char tmppath[PATH_MAX + 5];
+    FILE *file;
+    char *user;
+
+    if (!router->shmap_dirty)
+    {
+        return;
+    }
+    router->shmap_dirty = false;
+
+    snprintf(path, sizeof(path), "%s/%s", get_cachedir(), router->service->name);
+    mkdir(path, 0777);
+    strncat(path, "/.cache", sizeof(path) - strlen(path) - 1);
+    mkdir(path, 0777);
+
+    shard_map_cache_path(router, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    if ((file = fopen(tmppath, "w")) == NULL)
+    {
+        MXS_ERROR("schemarouter: Failed to open shard map cache file '%s' "
+                  "for writing.", tmppath);
+        return;
+    }
+
+    spinlock_acquire(&router->lock);
+    HASHITERATOR *iter = hashtable_iterator(router->shard_maps);
+
+    while (iter && (user = hashtable_next(iter)))
+    {
+        shard_map_t *map = hashtable_fetch(router->shard_maps, user);
+
+        if (map == NULL)
+        {
+            continue;
+        }
+
+        spinlock_acquire(&map->lock);
+        if (map->state == SHMAP_READY)
+        {
+            HASHITERATOR *dbiter = hashtable_iterator(map->hash);
+            char *db;
+
+            while (dbiter && (db = hashtable_next(dbiter)))
+            {
+                char *target = hashtable_fetch(map->hash, db);
+
+                if (target)
+                {
+                    fprintf(file, "%s\t%s\t%s\n", user, db, target);
+                }
+            }
+            hashtable_iterator_free(dbiter);
+        }
+        spinlock_release(&map->lock);
+    }
+    hashtable_iterator_free(iter);
+    spinlock_release(&router->lock);
+
+    fclose(file);
+
+    if (rename(tmppath, path) != 0)
+    {
+        MXS_ERROR("schemarouter: Failed to rename shard map cache file "
+                  "'%s' to '%s'.", tmppath, path);
+        unlink(tmppath);
+    }
+}
+
+/**
+ * The per server worker state of the background shard scan.
+ */
+typedef struct shard_scan_st
+{
+    ROUTER_INSTANCE *router;   /*< The router instance being scanned */
+    BACKEND         *backend;  /*< The backend server this worker scans */
+    char            *user;     /*< Service user to connect as */
+    char            *passwd;   /*< Decrypted service password */
+    shard_map_t     *map;      /*< The shard map being built */
+    THREAD           thread;   /*< Worker thread */
+    bool             threaded; /*< The worker runs in its own thread */
+    bool             ok;       /*< The scan of this server succeeded */
+} SHARD_SCAN;
+
+/**
+ * Scan a single shard for the databases it holds.
+ *
+ * Connects to the server with the service credentials, runs SHOW DATABASES
+ * and adds each database to the shard map being built. Databases on the
+ * ignore list, or matching the ignore regex, are skipped. A database found
+ * on more than one shard keeps its first mapping and a warning is logged.
+ *
+ * @param scan The scan worker state
+ * @return True if the server was scanned successfully
+ */
+static bool shard_scan_server(SHARD_SCAN *scan)
+{
+    ROUTER_INSTANCE *router = scan->router;
+    SERVER *server = scan->backend->backend_server;
+    MYSQL *con;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int connect_timeout = 3;
+
+    if ((con = mysql_init(NULL)) == NULL)
+    {
+        return false;
+    }
+
+    mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, (void *) &connect_timeout);
+
+    if (mysql_real_connect(con, server->name, scan->user, scan->passwd,
+                           NULL, server->port, NULL, 0) == NULL)
+    {
+        MXS_WARNING("schemarouter: Shard scan could not connect to %s:%d: %s",
+                    server->name, server->port, mysql_error(con));
+        mysql_close(con);
+        return false;
+    }
+
+    if (mysql_query(con, "SHOW DATABASES") != 0 ||
+        (result = mysql_store_result(con)) == NULL)
+    {
+        MXS_WARNING("schemarouter: Shard scan of %s:%d failed: %s",
+                    server->name, server->port, mysql_error(con));
+        mysql_close(con);
+        return false;
+    }
+
+    spinlock_acquire(&scan->map->lock);
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        if (row[0] == NULL ||
+            hashtable_fetch(router->ignored_dbs, row[0]) ||
+            (router->ignore_regex &&
+             pcre2_match(router->ignore_regex, (PCRE2_SPTR) row[0],
+                         PCRE2_ZERO_TERMINATED, 0, 0,
+                         router->ignore_match_data, NULL) >= 0))
+        {
+            continue;
+        }
+
+        if (hashtable_add(scan->map->hash, row[0], server->unique_name))
+        {
+            shard_bloom_add(scan->map, row[0]);
+        }
+        else
+        {
+            MXS_WARNING("schemarouter: Shard scan found database '%s' on both "
+                        "'%s' and '%s', using the first.",
+                        row[0],
+                        (char *) hashtable_fetch(scan->map->hash, row[0]),
+                        server->unique_name);
+        }
+    }
+
+    spinlock_release(&scan->map->lock);
+
+    mysql_free_result(result);
+    mysql_close(con);
+
+    return true;
+}
+
+/**
+ * Worker thread entry point for one shard of the background scan.
+ *
+ * @param data The SHARD_SCAN for the server to examine
+ */
+static void shard_scan_thread(void *data)
+{
+    SHARD_SCAN *scan = (SHARD_SCAN *) data;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in the shard scan worker for %s.",
+                  scan->backend->backend_server->unique_name);
+        return;
+    }
+    scan->ok = shard_scan_server(scan);
+    mysql_thread_end();
+}
+
+/**
+ * Scan every shard in parallel and publish the result as the service
+ * level shard map.
+ *
+ * A worker thread is started for each running server so that the complete
+ * cluster is scanned in the time taken by the slowest shard rather than the
+ * sum of all of them. The finished map is published with a pointer swap
+ * under the instance lock; sessions read the published pointer without any
+ * locking as the map is never modified after it has been published. The
+ * map replaced two rounds ago is freed, giving a session that picked up
+ * the previous pointer a full scan cycle to finish copying it.
+ *
+ * @param router The router instance to scan for
+ */
+static void shard_scan_round(ROUTER_INSTANCE *router)
+{
+    SERVICE *service = router->service;
+    shard_map_t *map, *retire;
+    SHARD_SCAN *scans;
+    char *dpwd;
+    int i, nservers, started = 0;
+    bool ok = false;
+
+    for (nservers = 0; router->servers && router->servers[nservers]; nservers++)
+    {
+        ;
+    }
+
+    if (nservers == 0 || service->credentials.name == NULL ||
+        service->credentials.authdata == NULL ||
+        (map = shard_map_alloc()) == NULL)
+    {
+        return;
+    }
+
+    if ((scans = (SHARD_SCAN *) calloc(nservers, sizeof(SHARD_SCAN))) == NULL)
+    {
+        hashtable_free(map->hash);
+        free(map);
+        return;
+    }
+
+    dpwd = decryptPassword(service->credentials.authdata);
+
+    for (i = 0; i < nservers; i++)
+    {
+        if (!SERVER_IS_RUNNING(router->servers[i]->backend_server))
+        {
+            continue;
+        }
+        scans[started].router = router;
+        scans[started].backend = router->servers[i];
+        scans[started].user = service->credentials.name;
+        scans[started].passwd = dpwd;
+        scans[started].map = map;
+
+        if (thread_start(&scans[started].thread, shard_scan_thread,
+                         &scans[started]) == NULL)
+        {
+            /* Could not start a thread, scan this shard inline */
+            scans[started].ok = shard_scan_server(&scans[started]);
+        }
+        else
+        {
+            scans[started].threaded = true;
+        }
+        started++;
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        if (scans[i].threaded)
+        {
+            thread_wait(scans[i].thread);
+        }
+        if (scans[i].ok)
+        {
+            ok = true;
+        }
+    }
+
+    free(dpwd);
+    free(scans);
+
+    if (ok)
+    {
+        map->state = SHMAP_READY;
+        map->last_updated = time(NULL);
+
+        spinlock_acquire(&router->lock);
+        retire = router->svc_shardmap_old;
+        router->svc_shardmap_old = router->svc_shardmap;
+        router->svc_shardmap = map;
+        router->svc_map_version++;
+        spinlock_release(&router->lock);
+
+        if (retire)
+        {
+            hashtable_free(retire->hash);
+            free(retire);
+        }
+    }
+    else
+    {
+        hashtable_free(map->hash);
+        free(map);
+    }
+}
+
+/**
+ * Entry point of the background shard scan thread.
+ *
+ * Rescans the cluster every refresh_min_interval seconds until MaxScale
+ * shuts down, so that an up to date shard map is always available for new
+ * sessions and the SHOW DATABASES round trips are taken off the session
+ * setup path entirely.
+ *
+ * @param data The router instance
+ */
+static void shard_scan_main(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *) data;
+    int i;
+
+    if (mysql_thread_init())
+    {
+        MXS_ERROR("mysql_thread_init failed in the schemarouter shard scan thread.");
+        return;
+    }
+
+    while (!router->scan_shutdown && !router->service->svc_do_shutdown)
+    {
+        shard_scan_round(router);
+
+        for (i = 0; i < (int) router->schemarouter_config.refresh_min_interval &&
+             !router->scan_shutdown && !router->service->svc_do_shutdown; i++)
+        {
+            thread_millisleep(1000);
+        }
+    }
+    mysql_thread_end();
+}
+
 /**
  * Convert a length encoded string into a C string.
  * @param data Pointer to the first byte of the string
@@ -370,6 +868,7 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
         {
             if (hashtable_add(rses->shardmap->hash, data, target))
             {
+                shard_bloom_add(rses->shardmap, data);
                 MXS_INFO("schemarouter: <%s, %s>", target, data);
             }
             else
@@ -499,7 +998,11 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
         for (i = 0; i < sz; i++)
         {
             char* name;
-            if ((name = (char*)hashtable_fetch(ht, dbnms[i])))
+            /** The bloom filter rejects names that are definitely not mapped,
+             * e.g. temporary tables and aliases identified as databases,
+             * without taking the hashtable chain lock */
+            if (shard_bloom_test(client->shardmap, dbnms[i]) &&
+                (name = (char*)hashtable_fetch(ht, dbnms[i])))
             {
                 if (strcmp(dbnms[i], "information_schema") == 0 && rval == NULL)
                 {
@@ -537,7 +1040,8 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
             char *saved, *tok = strtok_r(tmp, " ;", &saved);
             tok = strtok_r(NULL, " ;", &saved);
             ss_dassert(tok != NULL);
-            tmp = (char*) hashtable_fetch(ht, tok);
+            tmp = (tok && shard_bloom_test(client->shardmap, tok)) ?
+                (char*) hashtable_fetch(ht, tok) : NULL;
 
             if (tmp)
             {
@@ -928,6 +1432,29 @@ static ROUTER* createInstance(SERVICE *service, char **options)
      * that have been created with this module.
      */
 
+    /** Warm-start the routing decisions from the shard map cache and
+     * persist the maps periodically so the next restart can do the same */
+    shard_map_load_all(router);
+    {
+        char taskname[PATH_MAX];
+        snprintf(taskname, sizeof(taskname), "%s shardmap", service->name);
+        hktask_add(taskname, shard_map_save_all, router, SHARD_MAP_SAVE_INTERVAL);
+    }
+
+    /** Start the background thread that maps the databases of all the
+     * shards in parallel with the service credentials, so that sessions
+     * do not need to run SHOW DATABASES on their own connections */
+    if (thread_start(&router->scan_thread, shard_scan_main, router) == NULL)
+    {
+        MXS_ERROR("Failed to start the shard scan thread for service '%s'. "
+                  "Databases will be mapped on the first query of each session.",
+                  service->name);
+    }
+    else
+    {
+        router->scan_active = true;
+    }
+
     spinlock_acquire(&instlock);
     router->next = instances;
     instances = router;
@@ -1043,6 +1570,8 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
 
     spinlock_release(&router->lock);
 
+    bool seeded = false;
+
     if (map == NULL || state != SHMAP_READY)
     {
         if ((map = shard_map_alloc()) == NULL)
@@ -1052,7 +1581,38 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
             free(client_rses);
             return NULL;
         }
-        client_rses->init = INIT_UNINT;
+
+        shard_map_t *scanned = router->svc_shardmap;
+
+        if (scanned && scanned->state == SHMAP_READY)
+        {
+            /**
+             * Seed the session from the map published by the background
+             * scan thread instead of mapping the databases inline with
+             * SHOW DATABASES. The published map is never modified, so it
+             * can be copied without taking any lock.
+             */
+            HASHITERATOR *iter = hashtable_iterator(scanned->hash);
+            char *db;
+
+            while (iter && (db = hashtable_next(iter)))
+            {
+                hashtable_add(map->hash, db, hashtable_fetch(scanned->hash, db));
+            }
+            hashtable_iterator_free(iter);
+
+            /** The scanned bloom filter covers exactly the copied entries */
+            memcpy(map->bloom, scanned->bloom, sizeof(map->bloom));
+            map->last_updated = scanned->last_updated;
+            map->state = SHMAP_READY;
+            client_rses->init = INIT_READY;
+            seeded = true;
+            atomic_add(&router->stats.shmap_scan_hit, 1);
+        }
+        else
+        {
+            client_rses->init = INIT_UNINT;
+        }
     }
     else
     {
@@ -1061,6 +1621,12 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     }
 
     client_rses->shardmap = map;
+
+    if (seeded)
+    {
+        /** Share the seeded map with later sessions of the same user */
+        synchronize_shard_map(client_rses);
+    }
     client_rses->dcb_reply = dcb_alloc(DCB_ROLE_REQUEST_HANDLER);
     client_rses->dcb_reply->func.read = internalReply;
     client_rses->dcb_reply->state = DCB_STATE_POLLING;
@@ -2455,6 +3021,8 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
     }
     dcb_printf(dcb, "Shard map cache hits: %d\n", router->stats.shmap_cache_hit);
     dcb_printf(dcb, "Shard map cache misses: %d\n", router->stats.shmap_cache_miss);
+    dcb_printf(dcb, "Sessions seeded from the shard scan: %d\n", router->stats.shmap_scan_hit);
+    dcb_printf(dcb, "Shard scan map version: %d\n", router->svc_map_version);
     dcb_printf(dcb, "\n");
 }
 
@@ -4442,9 +5010,7 @@ bool handle_default_db(ROUTER_CLIENT_SES *router_cli_ses)
 
 void route_queued_query(ROUTER_CLIENT_SES *router_cli_ses)
 {
-    GWBUF* tmp = router_cli_ses->queue;
-    router_cli_ses->queue = router_cli_ses->queue->next;
-    tmp->next = NULL;
+    GWBUF* tmp = gwbuf_detach_head(router_cli_ses->queue, &router_cli_ses->queue);
 #ifdef SS_DEBUG
     char* querystr = modutil_get_SQL(tmp);
     MXS_DEBUG("schemarouter: Sending queued buffer for session %p: %s",
@@ -4596,12 +5162,14 @@ void synchronize_shard_map(ROUTER_CLIENT_SES *client)
         if (map->state == SHMAP_STALE)
         {
             replace_shard_map(&map, &client->shardmap);
+            client->router->shmap_dirty = true;
         }
         else if (map->state != SHMAP_READY)
         {
             MXS_WARNING("Shard map state is not ready but"
                         "it is in use. Replacing it with a newer one.");
             replace_shard_map(&map, &client->shardmap);
+            client->router->shmap_dirty = true;
         }
         else
         {
@@ -4619,6 +5187,7 @@ void synchronize_shard_map(ROUTER_CLIENT_SES *client)
         hashtable_add(client->router->shard_maps,
                       client->rses_client_dcb->user,
                       client->shardmap);
+        client->router->shmap_dirty = true;
         ss_dassert(hashtable_fetch(client->router->shard_maps,
                                    client->rses_client_dcb->user) == client->shardmap);
     }
@@ -658,9 +658,7 @@ filterReply(FILTER* instance, void *session, GWBUF *reply)
 
 	    if(rses->queue)
 	    {
-		GWBUF* tmp = rses->queue;
-		rses->queue = rses->queue->next;
-		tmp->next = NULL;
+		GWBUF* tmp = gwbuf_detach_head(rses->queue, &rses->queue);
 		char* querystr = modutil_get_SQL(tmp);
 		MXS_DEBUG("schemarouter: Sending queued buffer for session %p: %s",
                           rses->rses_client_dcb->session,
@@ -677,9 +675,7 @@ filterReply(FILTER* instance, void *session, GWBUF *reply)
 
     if(rses->queue)
     {
-	GWBUF* tmp = rses->queue;
-	rses->queue = rses->queue->next;
-	tmp->next = NULL;
+	GWBUF* tmp = gwbuf_detach_head(rses->queue, &rses->queue);
 	char* querystr = modutil_get_SQL(tmp);
 	MXS_DEBUG("schemarouter: Sending queued buffer for session %p: %s",
                   rses->rses_client_dcb->session,
@@ -1093,7 +1089,7 @@ newSession(
         }
         dummy_filterdef->obj = &dummyObject;
         dummy_filterdef->filter = (FILTER*)client_rses;
-        dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail);
+        dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail,NULL);
 
         if(dummy_upstream == NULL)
         {
@@ -23,6 +23,9 @@
 #include <session.h>
 #include <monitor.h>
 #include <string.h>
+#include <httpd.h>
+#include <maxscale/poll.h>
+#include <resultset.h>
 
 /**
  * The instance structure for this router.
@@ -79,6 +82,7 @@ static void	send_services(WEB_SESSION *);
 static void	send_sessions(WEB_SESSION *);
 static void	send_servers(WEB_SESSION *);
 static void	send_monitors(WEB_SESSION *);
+static void	send_stats_json(WEB_SESSION *);
 static void	respond_error(WEB_SESSION *, int, char *);
 
 /**
@@ -98,6 +102,7 @@ static struct {
 	{ "servers.html", send_servers },
 	{ "monitors.html", send_monitors },
 	{ "styles.css", send_css },
+	{ "stats.json", send_stats_json },
 	{ NULL, NULL }
 };
 
@@ -204,9 +209,11 @@ char		*ptr;
 int		i, found = 0;
 char		*url;
 
-	if ((url = gwbuf_get_property(queue, "URL")) == NULL)
+	if ((url = gwbuf_get_wellknown_property(queue, GWBUF_PROP_URL)) == NULL)
 	{
 		respond_error(wsession, 404, "No URL available");
+		gwbuf_free(queue);
+		return 0;
 	}
 
 	ptr = strrchr(url, '/');
@@ -324,29 +331,6 @@ static char *css =
 "p { font-family: serif }\n"
 "li { font-family: serif }\n";
 
-/**
- * Send the standard HTTP headers for an HTML file
- */
-static void
-send_html_header(DCB *dcb)
-{
-char date[64] = "";
-const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
-
-	time_t httpd_current_time = time(NULL);
-        struct tm tm;
-        char buffer[32]; // asctime_r documentation requires 26
-
-        localtime_r(&http_current_time, &tm);
-        asctime_r(&tm, buffer);
-
-	strftime(date, sizeof(date), fmt, buffer);
-
-	dcb_printf(dcb, "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: close\r\nContent-Type: text/html\r\n", date, "MaxScale");
-
-	dcb_printf(dcb, "\r\n");
-}
-
 /**
  * Send a static HTML page
  *
@@ -369,9 +353,7 @@ send_index(WEB_SESSION	*session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	send_static_html(dcb, index_page);
-	dcb_close(dcb);
 }
 
 /**
@@ -384,9 +366,7 @@ send_css(WEB_SESSION	*session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	send_static_html(dcb, css);
-	dcb_close(dcb);
 }
 
 /**
@@ -399,9 +379,7 @@ send_title(WEB_SESSION	*session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	send_static_html(dcb, title_page);
-	dcb_close(dcb);
 }
 
 /**
@@ -414,9 +392,7 @@ send_frame1(WEB_SESSION	*session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	send_static_html(dcb, frame1_page);
-	dcb_close(dcb);
 }
 
 /**
@@ -429,9 +405,7 @@ send_menu(WEB_SESSION	*session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	send_static_html(dcb, menu_page);
-	dcb_close(dcb);
 }
 
 /**
@@ -444,9 +418,7 @@ send_blank(WEB_SESSION	*session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	send_static_html(dcb, blank_page);
-	dcb_close(dcb);
 }
 
 /**
@@ -459,9 +431,12 @@ DCB	*dcb = session->session->client_dcb;
 static void
 service_row(SERVICE *service, DCB *dcb)
 {
+int	n_sessions, n_current;
+
+	service_stats_read(service, &n_sessions, &n_current);
 	dcb_printf(dcb, "<TR><TD>%s</TD><TD>%s</TD><TD>%d</TD><TD>%d</TD></TR>\n",
 		service->name, service->routerModule,
-		service->stats.n_current, service->stats.n_sessions);
+		n_current, n_sessions);
 }
 
 /**
@@ -475,7 +450,6 @@ send_services(WEB_SESSION *session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	dcb_printf(dcb, "<HTML><HEAD>");
 	dcb_printf(dcb, "<LINK REL=\"stylesheet\" type=\"text/css\" href=\"styles.css\">");
 	dcb_printf(dcb, "<BODY><H2>Services</H2><P>");
@@ -483,7 +457,6 @@ DCB	*dcb = session->session->client_dcb;
 	dcb_printf(dcb, "Current Sessions</TH><TH>Total Sessions</TH></TR>\n");
 	serviceIterate(service_row, dcb);
 	dcb_printf(dcb, "</TABLE></BODY></HTML>\n");
-	dcb_close(dcb);
 }
 
 /**
@@ -516,7 +489,6 @@ send_sessions(WEB_SESSION *session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	dcb_printf(dcb, "<HTML><HEAD>");
 	dcb_printf(dcb, "<LINK REL=\"stylesheet\" type=\"text/css\" href=\"styles.css\">");
 	dcb_printf(dcb, "<BODY><H2>Sessions</H2><P>");
@@ -524,7 +496,6 @@ DCB	*dcb = session->session->client_dcb;
 	dcb_printf(dcb, "Service</TH><TH>State</TH></TR>\n");
 	sessionIterate(session_row, dcb);
 	dcb_printf(dcb, "</TABLE></BODY></HTML>\n");
-	dcb_close(dcb);
 }
 
 /**
@@ -552,7 +523,6 @@ send_servers(WEB_SESSION *session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	dcb_printf(dcb, "<HTML><HEAD>");
 	dcb_printf(dcb, "<LINK REL=\"stylesheet\" type=\"text/css\" href=\"styles.css\">");
 	dcb_printf(dcb, "<BODY><H2>Servers</H2><P>");
@@ -560,7 +530,6 @@ DCB	*dcb = session->session->client_dcb;
 	dcb_printf(dcb, "Port</TH><TH>State</TH><TH>Connections</TH></TR>\n");
 	serverIterate(server_row, dcb);
 	dcb_printf(dcb, "</TABLE></BODY></HTML>\n");
-	dcb_close(dcb);
 }
 
 /**
@@ -588,14 +557,72 @@ send_monitors(WEB_SESSION *session)
 {
 DCB	*dcb = session->session->client_dcb;
 
-	send_html_header(dcb);
 	dcb_printf(dcb, "<HTML><HEAD>");
 	dcb_printf(dcb, "<LINK REL=\"stylesheet\" type=\"text/css\" href=\"styles.css\">");
 	dcb_printf(dcb, "<BODY><H2>Monitors</H2><P>");
 	dcb_printf(dcb, "<TABLE><TR><TH>Monitor</TH><TH>State</TH></TR>\n");
 	monitorIterate(monitor_row, dcb);
 	dcb_printf(dcb, "</TABLE></BODY></HTML>\n");
-	dcb_close(dcb);
+}
+
+/**
+ * Stream one result set as the value of a JSON document member. The rows
+ * of the result set are serialized one at a time by resultset_stream_json,
+ * so no complete copy of the document is ever built by the router; the
+ * output goes into the write queue of the DCB a buffer at a time.
+ *
+ * @param dcb		The DCB of the connection to the client
+ * @param name		The name of the document member
+ * @param set		The result set, may be NULL in which case the
+ *			member value is an empty list
+ */
+static void
+stream_json_member(DCB *dcb, char *name, RESULTSET *set)
+{
+	dcb_printf(dcb, "\"%s\" : ", name);
+	if (set)
+	{
+		resultset_stream_json(set, dcb);
+		resultset_free(set);
+	}
+	else
+		dcb_printf(dcb, "[ ]\n");
+}
+
+/**
+ * Send the statistics document. This is a machine readable JSON rendering
+ * of the server, service, polling thread and event queue statistics for
+ * external collectors to scrape; the counters it reports are maintained
+ * per thread or refreshed by the housekeeper, so serving the document
+ * does not contend with the query routing threads.
+ *
+ * @param session	The router session
+ */
+static void
+send_stats_json(WEB_SESSION *session)
+{
+DCB	*dcb = session->session->client_dcb;
+
+	dcb_printf(dcb, "{ ");
+	stream_json_member(dcb, "servers", serverGetList());
+	dcb_printf(dcb, ", ");
+	stream_json_member(dcb, "services", serviceGetList());
+	dcb_printf(dcb, ", ");
+	stream_json_member(dcb, "threads", pollThreadsGetList());
+	dcb_printf(dcb, ", ");
+	stream_json_member(dcb, "eventTimes", eventTimesGetList());
+	dcb_printf(dcb, ", \"eventQueue\" : { ");
+	dcb_printf(dcb, "\"reads\" : %d, ", poll_get_stat(POLL_STAT_READ));
+	dcb_printf(dcb, "\"writes\" : %d, ", poll_get_stat(POLL_STAT_WRITE));
+	dcb_printf(dcb, "\"errors\" : %d, ", poll_get_stat(POLL_STAT_ERROR));
+	dcb_printf(dcb, "\"hangups\" : %d, ", poll_get_stat(POLL_STAT_HANGUP));
+	dcb_printf(dcb, "\"accepts\" : %d, ", poll_get_stat(POLL_STAT_ACCEPT));
+	dcb_printf(dcb, "\"length\" : %d, ", poll_get_stat(POLL_STAT_EVQ_LEN));
+	dcb_printf(dcb, "\"pending\" : %d, ", poll_get_stat(POLL_STAT_EVQ_PENDING));
+	dcb_printf(dcb, "\"maxLength\" : %d, ", poll_get_stat(POLL_STAT_EVQ_MAX));
+	dcb_printf(dcb, "\"maxQueueTime\" : %d, ", poll_get_stat(POLL_STAT_MAX_QTIME));
+	dcb_printf(dcb, "\"maxExecTime\" : %d ", poll_get_stat(POLL_STAT_MAX_EXECTIME));
+	dcb_printf(dcb, "} }\n");
 }
 
 /**
@@ -609,13 +636,15 @@ static void
 respond_error(WEB_SESSION *session, int err, char *msg)
 {
 DCB	*dcb = session->session->client_dcb;
+HTTPD_session	*client_data = dcb->data;
 
-	dcb_printf(dcb, "HTTP/1.1 %d %s\n", err, msg);
-	dcb_printf(dcb, "Content-Type: text/html\n");
-	dcb_printf(dcb, "\n");
+	if (client_data)
+	{
+		client_data->status = err;
+		client_data->content_type = "text/html";
+	}
 	dcb_printf(dcb, "<HTML><BODY>\n");
 	dcb_printf(dcb, "MaxScale webserver plugin unable to satisfy request.\n");
 	dcb_printf(dcb, "<P>Code: %d, %s\n", err, msg);
 	dcb_printf(dcb, "</BODY></HTML>");
-	dcb_close(dcb);
 }
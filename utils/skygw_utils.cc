@@ -36,6 +36,10 @@
 #include <atomic.h>
 #include <random_jkiss.h>
 #include <pcre2.h>
+#include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static bool file_write_header(skygw_file_t* file);
 static void simple_mutex_free_memory(simple_mutex_t* sm);
@@ -1445,6 +1449,215 @@ char* replace_quoted(const char** src, const size_t* srcsize, char** dest, size_
     return output;
 }
 
+/** True for bytes that can continue an identifier; a digit preceded by one of
+ * these is part of a name, not a literal */
+#define CANON_IDENT_CHAR(c) (isalnum((unsigned char) (c)) || (c) == '_' || (c) == '$' || (c) == '.')
+
+/**
+ * Produce the canonical form of an SQL statement in a single pass.
+ *
+ * Quoted strings, numeric literals and user variable names are replaced with
+ * question marks and comments are stripped, which is what the
+ * replace_quoted(), remove_mysql_comments() and replace_values() pipeline
+ * produces with three regex passes and three intermediate buffers. Executable
+ * comments are kept as they alter the behavior of the query, and identifiers
+ * that merely begin with digits are left alone. On x86 the scanner skips runs
+ * of uninteresting bytes sixteen at a time; only quotes, comment starters,
+ * digits and user variables drop to the byte-by-byte state machine.
+ *
+ * @param sql Pointer to the SQL statement, not necessarily null-terminated
+ * @param len Length of the statement in bytes
+ * @return Newly allocated null-terminated canonical form of the statement, or
+ * NULL if memory allocation failed. The caller must free the result.
+ */
+char* canonicalize_sql(const char* sql, size_t len)
+{
+    const char* s = sql;
+    const char* end = sql + len;
+    char* out;
+    char* d;
+
+    /** An empty quoted string grows from two bytes to three ("" -> "?") so
+     * the output can be up to 1.5 times the input; the slack also covers the
+     * overshoot of the 16 byte wide copies below */
+    if ((out = (char*) malloc(len + len / 2 + 19)) == NULL)
+    {
+        return NULL;
+    }
+
+    d = out;
+
+    while (s < end)
+    {
+#if defined(__SSE2__)
+        while (end - s >= 16)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i*) s);
+            __m128i hits = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\''));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('`')));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('#')));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('-')));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('@')));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('.')));
+            hits = _mm_or_si128(hits,
+                                _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                              _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1))));
+            int mask = _mm_movemask_epi8(hits);
+
+            /** The bytes past the first interesting one are rewritten on the
+             * next round, the buffer has room for the full store */
+            _mm_storeu_si128((__m128i*) d, chunk);
+
+            if (mask == 0)
+            {
+                s += 16;
+                d += 16;
+            }
+            else
+            {
+                int skip = __builtin_ctz(mask);
+                s += skip;
+                d += skip;
+                break;
+            }
+        }
+
+        if (s == end)
+        {
+            break;
+        }
+#endif
+        unsigned char c = *s;
+
+        if (c == '\'' || c == '"')
+        {
+            const char* p = s + 1;
+
+            *d++ = c;
+            *d++ = '?';
+
+            while (p < end && *p != (char) c)
+            {
+                if (*p == '\\' && p + 1 < end)
+                {
+                    p++;
+                }
+                p++;
+            }
+
+            if (p < end)
+            {
+                *d++ = c;
+                p++;
+            }
+            s = p;
+        }
+        else if (c == '`')
+        {
+            /** Quoted identifier, copied verbatim */
+            const char* p = s + 1;
+
+            while (p < end && *p != '`')
+            {
+                p++;
+            }
+
+            if (p < end)
+            {
+                p++;
+            }
+            memcpy(d, s, p - s);
+            d += p - s;
+            s = p;
+        }
+        else if (c == '#' ||
+                 (c == '-' && s + 1 < end && s[1] == '-' &&
+                  (s + 2 == end || isspace((unsigned char) s[2]))))
+        {
+            /** Comment running to the end of the line */
+            while (s < end && *s != '\n')
+            {
+                s++;
+            }
+        }
+        else if (c == '/' && s + 1 < end && s[1] == '*' &&
+                 !(s + 2 < end && (s[2] == '!' ||
+                                   (s[2] == 'M' && s + 3 < end && s[3] == '!'))))
+        {
+            /** Plain comment; the executable /\*! and /\*M! forms fail the
+             * test above and fall through to be scanned like regular SQL */
+            s += 2;
+
+            while (s + 1 < end && !(*s == '*' && s[1] == '/'))
+            {
+                s++;
+            }
+            s = s + 1 < end ? s + 2 : end;
+        }
+        else if (c == '@')
+        {
+            *d++ = *s++;
+
+            if (s < end && *s == '@')
+            {
+                *d++ = *s++;
+            }
+
+            if (s < end && (isalnum((unsigned char) *s) || *s == '_'))
+            {
+                *d++ = '?';
+
+                while (s < end && (isalnum((unsigned char) *s) || *s == '_'))
+                {
+                    s++;
+                }
+            }
+        }
+        else if ((isdigit(c) ||
+                  ((c == '.' || c == '-') && s + 1 < end &&
+                   (isdigit((unsigned char) s[1]) ||
+                    (c == '-' && s[1] == '.' && s + 2 < end &&
+                     isdigit((unsigned char) s[2]))))) &&
+                 (d == out || !CANON_IDENT_CHAR(d[-1])))
+        {
+            const char* p = s;
+
+            if (*p == '-')
+            {
+                p++;
+            }
+
+            while (p < end && (isdigit((unsigned char) *p) || *p == '.' ||
+                               (*p == '-' && p + 1 < end && isdigit((unsigned char) p[1]))))
+            {
+                p++;
+            }
+
+            if (p < end && (isalnum((unsigned char) *p) || *p == '_' || *p == '$'))
+            {
+                /** An identifier that begins with digits, keep it */
+                memcpy(d, s, p - s);
+                d += p - s;
+            }
+            else
+            {
+                *d++ = '?';
+            }
+            s = p;
+        }
+        else
+        {
+            *d++ = *s++;
+        }
+    }
+
+    *d = '\0';
+
+    return out;
+}
+
 /**
  * Calculate the number of decimal numbers from a size_t value.
  *
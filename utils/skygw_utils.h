@@ -195,6 +195,7 @@ char* replace_literal(char* haystack,
                       const char* needle,
                       const char* replacement);
 char* replace_quoted(const char** src, const size_t* srcsize, char** dest, size_t* destsize);
+char* canonicalize_sql(const char* sql, size_t len);
 bool is_valid_posix_path(char* path);
 bool strip_escape_chars(char*);
 int simple_str_hash(char* key);